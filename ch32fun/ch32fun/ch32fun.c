@@ -1156,6 +1156,19 @@ asm volatile(
 	addi a0, a0, 4\n\
 	blt a0, a1, 1b\n\
 2:"
+#if FUNCONF_PLACEMENT
+	// Load the functions placed in RAM (placement.ld) from FLASH.
+"	la a0, _highcode_lma\n\
+	la a1, _highcode_vma_start\n\
+	la a2, _highcode_vma_end\n\
+	bgeu a1, a2, 2f\n\
+1:	lw a3, 0(a0)\n\
+	sw a3, 0(a1)\n\
+	addi a0, a0, 4\n\
+	addi a1, a1, 4\n\
+	bltu a1, a2, 1b\n\
+2:\n"
+#endif
 	// This loads DATA from FLASH to RAM.
 "	la a0, _data_lma\n\
 	la a1, _data_vma\n\
@@ -1214,7 +1227,7 @@ void handle_reset( void )
 	addi a0, a0, 4\n\
 	bltu a0, a1, 1b\n\
 2:\n"
-#ifdef CH5xx
+#if defined(CH5xx) || FUNCONF_PLACEMENT
 	/* Load highcode code section from FLASH to HIGHRAM */
 "	la a0, _highcode_lma\n\
 	la a1, _highcode_vma_start\n\
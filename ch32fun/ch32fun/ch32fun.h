@@ -86,6 +86,7 @@
 #define FUNCONF_SUPPORT_CONSTRUCTORS 0	// Call functions with __attribute__((constructor)) in SystemInit()
 #define FUNCONF_ICACHE_EN 1				// Enables ICache on cores that support it, may require power-down + power up to work properly at flash time.
 #define FUNCONF_OVERRIDE_STARTUP 0      // User code will have its own `handle_reset` and `InterruptVector`
+#define FUNCONF_PLACEMENT 0             // Set by ch32fun.mk if there is a placement.ld, runs the functions it lists from RAM (see misc/placement)
 */
 
 // Sanity check for when porting old code.
@@ -354,6 +354,18 @@ LDFLAGS+=-lgcc
 GENERATED_LD_FILE:=$(CH32FUN)/generated_$(TARGET_MCU_PACKAGE)_$(TARGET_MCU_MEMORY_SPLIT).ld
 LINKER_SCRIPT?=$(GENERATED_LD_FILE)
 
+# Profile-guided placement: a placement.ld next to the program lists the
+# functions to run from RAM (ITCM on the CH32H41x). `make placement` writes
+# it from PLACEMENT_PROFILE, see misc/placement. PLACEMENT_BUDGET is in bytes,
+# left empty the tool takes an eighth of the RAM (all of the ITCM) in the map.
+PLACEMENT_BUDGET?=
+PLACEMENT_RATIO?=1.5
+PLACEMENT_TOOL?=python3 $(CH32FUN)/../misc/placement/placement.py
+ifneq ($(wildcard placement.ld),)
+	PLACEMENT_FLAGS:=-DFUNCONF_PLACEMENT=1
+	CFLAGS+=$(PLACEMENT_FLAGS)
+endif
+
 CFLAGS+= \
 	$(CFLAGS_ARCH) -static-libgcc \
 	-I$(NEWLIB) \
@@ -406,11 +418,18 @@ FLASH_EXT_COMMAND?=$(MINICHLINK)/minichlink -w $< $(EXT_ORIGIN) -b
 
 .PHONY : $(GENERATED_LD_FILE)
 $(GENERATED_LD_FILE) :
-	$(PREFIX)-gcc -E -P -x c -DTARGET_MCU=$(TARGET_MCU) -DMCU_PACKAGE=$(MCU_PACKAGE) -DTARGET_MCU_LD=$(TARGET_MCU_LD) -DTARGET_MCU_MEMORY_SPLIT=$(TARGET_MCU_MEMORY_SPLIT) $(CH32FUN)/ch32fun.ld > $(GENERATED_LD_FILE)
+	$(PREFIX)-gcc -E -P -x c -DTARGET_MCU=$(TARGET_MCU) -DMCU_PACKAGE=$(MCU_PACKAGE) -DTARGET_MCU_LD=$(TARGET_MCU_LD) -DTARGET_MCU_MEMORY_SPLIT=$(TARGET_MCU_MEMORY_SPLIT) $(PLACEMENT_FLAGS) $(CH32FUN)/ch32fun.ld > $(GENERATED_LD_FILE)
 
-$(TARGET).elf : $(FILES_TO_COMPILE) $(LINKER_SCRIPT) $(EXTRA_ELF_DEPENDENCIES)
+$(TARGET).elf : $(FILES_TO_COMPILE) $(LINKER_SCRIPT) $(EXTRA_ELF_DEPENDENCIES) $(wildcard placement.ld)
 	$(PREFIX)-gcc -o $@ $(FILES_TO_COMPILE) $(CFLAGS) $(LDFLAGS)
 
+# Uses the map of the build that was profiled, so run it before rebuilding.
+placement :
+	$(PLACEMENT_TOOL) -m $(TARGET).map $(if $(PLACEMENT_BUDGET),-b $(PLACEMENT_BUDGET)) -r $(PLACEMENT_RATIO) -o placement.ld $(PLACEMENT_PROFILE)
+
+placement_clean :
+	rm -f placement.ld
+
 # Rule for independently building ch32fun.o indirectly, instead of recompiling it from source every time.
 # Not used in the default 003fun toolchain, but used in more sophisticated toolchains.
 ch32fun.o : $(SYSTEM_C)
@@ -6,8 +6,60 @@
 // This is actually 1/F_CPU per PWM period advance.
 uint32_t target_rotor_speed = 3500;
 
+// 0 = trapezoid drive stepped from SysTick (the original demo)
+// 1 = sinusoidal field oriented control with space vector PWM, run from the
+//     ADC interrupt once per PWM period. See foc_q15.h.
+#define BLDC_FOC 0
+
+// Only for BLDC_FOC. The gimbal is driven straight off the GPIO and there's
+// no way to measure phase currents, so by default FOC runs in voltage mode
+// (fixed Vq, open loop angle). Set to 1 if there are bidirectional current
+// sense amplifiers (zero current at mid scale) on FOC_ADC_IA / FOC_ADC_IB,
+// then Id / Iq are closed with PI loops.
+#define FOC_CURRENT_SENSE 0
+
+#if BLDC_FOC
+// Center aligned, so the PWM runs at F_CPU / (2 << PWM_PERIOD_PO2), 23.4kHz.
+#define PWM_PERIOD_PO2 10
+#else
 // Higher values here use longer but more accurate PWM periods.
 #define PWM_PERIOD_PO2 5
+#endif
+
+#if BLDC_FOC
+#include "foc_q15.h"
+
+#define FOC_PWM_HZ (FUNCONF_SYSTEM_CORE_CLOCK / (2<<PWM_PERIOD_PO2))
+
+// Electrical angle is the top 16 bits of a 32 bit accumulator.
+#define FOC_INC_PER_ERPS (0xffffffffu / FOC_PWM_HZ)
+
+// Speed ramp, electrical revolutions per second, per second.
+#define FOC_ERPS_ACCEL 50
+#define FOC_INC_RAMP ((FOC_INC_PER_ERPS * FOC_ERPS_ACCEL) / FOC_PWM_HZ)
+
+// Voltage mode drive level, Q15 of the supply. The SVPWM linear limit is 18918.
+#define FOC_VQ 12000
+
+// Current sense inputs, A0 = PA2, A1 = PA1.
+#define FOC_ADC_IA 0
+#define FOC_ADC_IB 1
+#define FOC_IQ_TARGET 8000
+
+volatile uint32_t foc_inc_target;
+volatile int32_t foc_vq = FOC_VQ;
+volatile int32_t foc_iq_target = FOC_IQ_TARGET;
+volatile int32_t foc_id, foc_iq;
+uint32_t foc_inc;
+uint32_t foc_angle;
+
+#if FOC_CURRENT_SENSE
+foc_pi foc_pi_d = { 4000, 4, 18000, 0 };
+foc_pi foc_pi_q = { 4000, 4, 18000, 0 };
+int32_t foc_ofs_a, foc_ofs_b;
+int foc_calib = 256; // periods spent measuring the zero current offsets
+#endif
+#endif
 
 void handle_debug_input( int numbytes, uint8_t * data )
 {
@@ -16,8 +68,13 @@ void handle_debug_input( int numbytes, uint8_t * data )
 		int targspeed = data[numbytes-1] - '0';
 		if( targspeed >= 0 && targspeed <= 9 )
 		{
+#if BLDC_FOC
+			// Same speeds as the trapezoid drive, 12 electrical rev/s per step.
+			foc_inc_target = FOC_INC_PER_ERPS * 12 * (targspeed+1);
+#else
 			// Kinda a random target speed, but making 0..9 make sense.
 			target_rotor_speed = (665600>>PWM_PERIOD_PO2) / (targspeed+1);
+#endif
 		}
 	}
 }
@@ -99,8 +156,14 @@ void t2pwm_init( void )
 	// SMCFGR: default clk input is CK_INT
 	// set TIM2 clock prescaler divider 
 	TIM2->PSC = 0x0000;
+#if BLDC_FOC
+	// Center aligned, counts 0..top..0, so the compare values are 0..top.
+	TIM2->ATRLR = (1<<PWM_PERIOD_PO2);
+	TIM2->CTLR1 |= TIM_CMS_0;
+#else
 	// set PWM total cycle width
 	TIM2->ATRLR = (1<<PWM_PERIOD_PO2)-1;
+#endif
 	
 	// for channel 1 and 2, let CCxS stay 00 (output), set OCxM to 110 (PWM I)
 	// enabling preload causes the new pulse width in compare capture register only to come into effect when UG bit in SWEVGR is set (= initiate update) (auto-clears)
@@ -118,13 +181,126 @@ void t2pwm_init( void )
 	// initialize counter
 	TIM2->SWEVGR |= TIM_UG;
 
+#if BLDC_FOC
+	// Channel 1 has no pin, OC1REF only goes high at the bottom of the count,
+	// that edge is TRGO and samples the currents once per PWM period in the
+	// middle of the low side on time.
+	TIM2->CHCTLR1 |= TIM_OC1M_2 | TIM_OC1M_1;
+	TIM2->CH1CVR = 1;
+	TIM2->CTLR2 = TIM_MMS_2;
+#else
 	// Setup TRGO for ADC. We want to synchronize the ADC with this timer.
 	TIM2->CTLR2 = TIM_MMS_1;
+#endif
 
 	// Enable TIM2
 	TIM2->CTLR1 |= TIM_CEN;
 }
 
+#if BLDC_FOC
+
+void foc_adc_init()
+{
+	RCC->APB2PCENR |= RCC_APB2Periph_ADC1 | RCC_APB2Periph_GPIOA;
+
+	RCC->APB2PRSTR |= RCC_APB2Periph_ADC1;
+	RCC->APB2PRSTR &= ~RCC_APB2Periph_ADC1;
+
+	// ADCCLK = 24 MHz
+	RCC->CFGR0 &= ~RCC_ADCPRE;
+	RCC->CFGR0 |= RCC_ADCPRE_DIV2;
+
+#if FOC_CURRENT_SENSE
+	funPinMode( PA2, GPIO_CFGLR_IN_ANALOG );
+	funPinMode( PA1, GPIO_CFGLR_IN_ANALOG );
+#endif
+
+	// Phase A is the regular conversion, started by TIM2 TRGO. JAUTO chains
+	// phase B on as an injected conversion right after, and its end of
+	// conversion interrupt runs the control loop. No DMA needed.
+	ADC1->RSQR1 = 0;
+	ADC1->RSQR2 = 0;
+	ADC1->RSQR3 = FOC_ADC_IA;
+	ADC1->ISQR = FOC_ADC_IB << 15; // JL = 0, one conversion in JSQ4
+	ADC1->SAMPTR2 = (1<<(3*FOC_ADC_IA)) | (1<<(3*FOC_ADC_IB));
+
+	ADC1->CTLR2 = ADC_ADON | ADC_EXTTRIG | ( ADC_EXTSEL_0 | ADC_EXTSEL_1 ) | ADC_JEXTSEL;
+
+	ADC1->CTLR2 |= ADC_RSTCAL;
+	while(ADC1->CTLR2 & ADC_RSTCAL);
+	ADC1->CTLR2 |= ADC_CAL;
+	while(ADC1->CTLR2 & ADC_CAL);
+
+	ADC1->CTLR1 = ADC_JAUTO | ADC_JEOCIE;
+	NVIC_EnableIRQ( ADC_IRQn );
+}
+
+// Once per PWM period. Everything in here is fixed length, no divides and
+// the multiplies go through foc_mul(), so the time doesn't depend on the data.
+void ADC1_IRQHandler(void) __attribute__((interrupt));
+void ADC1_IRQHandler(void)
+{
+	int32_t ra = ADC1->RDATAR;
+	int32_t rb = ADC1->IDATAR1;
+	ADC1->STATR = 0;
+
+	// Ramp the speed toward the target.
+	uint32_t inc = foc_inc;
+	uint32_t target = foc_inc_target;
+	if( inc + FOC_INC_RAMP < target ) inc += FOC_INC_RAMP;
+	else if( inc > target + FOC_INC_RAMP ) inc -= FOC_INC_RAMP;
+	else inc = target;
+	foc_inc = inc;
+	foc_angle += inc;
+
+	uint32_t theta = foc_angle >> 16;
+	int32_t s = foc_sin( theta );
+	int32_t c = foc_cos( theta );
+	int32_t vd, vq;
+
+#if FOC_CURRENT_SENSE
+	if( foc_calib )
+	{
+		// Outputs sit at 50%, no current flows, average the offsets.
+		foc_ofs_a += ra;
+		foc_ofs_b += rb;
+		if( --foc_calib == 0 )
+		{
+			foc_ofs_a >>= 8;
+			foc_ofs_b >>= 8;
+		}
+		vd = vq = 0;
+	}
+	else
+	{
+		// 10 bit ADC, +/- half scale is +/- 1.0.
+		int32_t alpha, beta, id, iq;
+		foc_clarke( ( ra - foc_ofs_a ) << 6, ( rb - foc_ofs_b ) << 6, &alpha, &beta );
+		foc_park( alpha, beta, s, c, &id, &iq );
+		foc_id = id;
+		foc_iq = iq;
+		vd = foc_pi_step( &foc_pi_d, -id );
+		vq = foc_pi_step( &foc_pi_q, foc_iq_target - iq );
+	}
+#else
+	(void)ra; (void)rb;
+	vd = 0;
+	vq = foc_vq;
+#endif
+
+	int32_t alpha, beta;
+	int32_t duty[3];
+	foc_inv_park( vd, vq, s, c, &alpha, &beta );
+	foc_svpwm( alpha, beta, PWM_PERIOD_PO2, duty );
+
+	// The outputs are set up active low.
+	TIM2->CH2CVR = (1<<PWM_PERIOD_PO2) - duty[0];
+	TIM2->CH3CVR = (1<<PWM_PERIOD_PO2) - duty[1];
+	TIM2->CH4CVR = (1<<PWM_PERIOD_PO2) - duty[2];
+}
+
+#else
+
 //  /‾‾\__...
 //  ‾\__/‾...
 //  __/‾‾\...
@@ -246,6 +422,8 @@ static void systick_init()
 	SysTick->CMP = SysTick->CNT + g_advance_speed;
 }	
 
+#endif
+
 
 
 int main()
@@ -254,16 +432,25 @@ int main()
 	SystemInit();
 	Delay_Ms( 100 );
 
+#if BLDC_FOC
+	foc_adc_init();
+	t2pwm_init();
+#else
 	adc_init();
 	t2pwm_init();
 
 	g_advance_speed = 100000;
 
 	systick_init();
+#endif
 
 	int ttp = SysTick->CNT + 1200000;
 	while(1)
 	{
+#if BLDC_FOC
+		printf( "%d,%d,%d\n", (int)(foc_inc / FOC_INC_PER_ERPS), (int)foc_id, (int)foc_iq );
+#else
 		printf( "%d,%d,%d\n", g_advance_speed, last_spin_cancel, last_spinningness );
+#endif
 	}
 }
@@ -0,0 +1,165 @@
+#ifndef _FOC_Q15_H
+#define _FOC_Q15_H
+
+// Fixed point kernels for the FOC mode of bldc_gimbal.
+//
+// Everything is Q15 (32767 = 1.0) and angles are uint16 (65536 = one
+// electrical turn). The CH32V003 is an EC core with no hardware multiply,
+// and GCC's __mulsi3 is slow and data dependent, so the few real multiplies
+// go through foc_mul() below, which always runs the same 16 iterations. The
+// constant multiplies (1/sqrt(3), sqrt(3)/2) are done with shifts and adds.
+//
+// Nothing in here touches hardware, so it also builds on a PC for checking
+// against floating point.
+
+#include <stdint.h>
+
+// First quadrant of sin(), 256 steps, Q15.
+static const int16_t foc_sin_quarter[257] = {
+	0, 201, 402, 603, 804, 1005, 1206, 1407, 1608, 1809, 2009, 2210, 2410, 2611, 2811, 3012,
+	3212, 3412, 3612, 3811, 4011, 4210, 4410, 4609, 4808, 5007, 5205, 5404, 5602, 5800, 5998, 6195,
+	6393, 6590, 6786, 6983, 7179, 7375, 7571, 7767, 7962, 8157, 8351, 8545, 8739, 8933, 9126, 9319,
+	9512, 9704, 9896, 10087, 10278, 10469, 10659, 10849, 11039, 11228, 11417, 11605, 11793, 11980, 12167, 12353,
+	12539, 12725, 12910, 13094, 13279, 13462, 13645, 13828, 14010, 14191, 14372, 14553, 14732, 14912, 15090, 15269,
+	15446, 15623, 15800, 15976, 16151, 16325, 16499, 16673, 16846, 17018, 17189, 17360, 17530, 17700, 17869, 18037,
+	18204, 18371, 18537, 18703, 18868, 19032, 19195, 19357, 19519, 19680, 19841, 20000, 20159, 20317, 20475, 20631,
+	20787, 20942, 21096, 21250, 21403, 21554, 21705, 21856, 22005, 22154, 22301, 22448, 22594, 22739, 22884, 23027,
+	23170, 23311, 23452, 23592, 23731, 23870, 24007, 24143, 24279, 24413, 24547, 24680, 24811, 24942, 25072, 25201,
+	25329, 25456, 25582, 25708, 25832, 25955, 26077, 26198, 26319, 26438, 26556, 26674, 26790, 26905, 27019, 27133,
+	27245, 27356, 27466, 27575, 27683, 27790, 27896, 28001, 28105, 28208, 28310, 28411, 28510, 28609, 28706, 28803,
+	28898, 28992, 29085, 29177, 29268, 29358, 29447, 29534, 29621, 29706, 29791, 29874, 29956, 30037, 30117, 30195,
+	30273, 30349, 30424, 30498, 30571, 30643, 30714, 30783, 30852, 30919, 30985, 31050, 31113, 31176, 31237, 31297,
+	31356, 31414, 31470, 31526, 31580, 31633, 31685, 31736, 31785, 31833, 31880, 31926, 31971, 32014, 32057, 32098,
+	32137, 32176, 32213, 32250, 32285, 32318, 32351, 32382, 32412, 32441, 32469, 32495, 32521, 32545, 32567, 32589,
+	32609, 32628, 32646, 32663, 32678, 32692, 32705, 32717, 32728, 32737, 32745, 32752, 32757, 32761, 32765, 32766,
+	32767,
+};
+
+// 1024 steps per turn is plenty for a gimbal motor, no interpolation.
+static inline int32_t foc_sin( uint32_t angle )
+{
+	uint32_t idx = ( ( angle + 32 ) >> 6 ) & 0x3ff;
+	uint32_t quad = idx >> 8;
+	idx &= 0xff;
+	if( quad & 1 ) idx = 256 - idx;
+	int32_t s = foc_sin_quarter[idx];
+	return ( quad & 2 ) ? -s : s;
+}
+
+static inline int32_t foc_cos( uint32_t angle )
+{
+	return foc_sin( angle + 16384 );
+}
+
+// a * b >> 15 with b in -32768..32767. Fixed 16 rounds of shift and add so
+// the control interrupt takes the same time every period, the 16th is for
+// |b| = 32768.
+static inline int32_t foc_mul( int32_t a, int32_t b )
+{
+	uint32_t acc = 0;
+	uint32_t m = a;
+	int neg = b < 0;
+	uint32_t bits = neg ? -b : b;
+	int i;
+	for( i = 0; i < 16; i++ )
+	{
+		if( bits & 1 )
+			acc += m;
+		m <<= 1;
+		bits >>= 1;
+	}
+	int32_t r = (int32_t)acc >> 15;
+	return neg ? -r : r;
+}
+
+// x / sqrt(3), 0.577350 ~= 2^-1 + 2^-4 + 2^-7 + 2^-8 + 2^-9 + 2^-10 + 2^-13 + 2^-14
+static inline int32_t foc_inv_sqrt3( int32_t x )
+{
+	return ( x >> 1 ) + ( x >> 4 ) + ( x >> 7 ) + ( x >> 8 ) + ( x >> 9 ) + ( x >> 10 ) + ( x >> 13 ) + ( x >> 14 );
+}
+
+// x * sqrt(3) / 2, 0.866025 ~= 1 - 2^-3 - 2^-7 - 2^-10 - 2^-13 - 2^-14
+static inline int32_t foc_sqrt3_2( int32_t x )
+{
+	return x - ( x >> 3 ) - ( x >> 7 ) - ( x >> 10 ) - ( x >> 13 ) - ( x >> 14 );
+}
+
+// Clarke: two measured phase currents to alpha / beta, ic = -ia - ib.
+static inline void foc_clarke( int32_t ia, int32_t ib, int32_t * alpha, int32_t * beta )
+{
+	*alpha = ia;
+	*beta = foc_inv_sqrt3( ia + ib + ib );
+}
+
+// Park: alpha / beta into the rotor frame.
+static inline void foc_park( int32_t alpha, int32_t beta, int32_t s, int32_t c, int32_t * d, int32_t * q )
+{
+	*d = foc_mul( alpha, c ) + foc_mul( beta, s );
+	*q = foc_mul( beta, c ) - foc_mul( alpha, s );
+}
+
+static inline void foc_inv_park( int32_t d, int32_t q, int32_t s, int32_t c, int32_t * alpha, int32_t * beta )
+{
+	*alpha = foc_mul( d, c ) - foc_mul( q, s );
+	*beta = foc_mul( d, s ) + foc_mul( q, c );
+}
+
+// Space vector PWM by min/max injection: inverse Clarke, then shift all three
+// phases so they're centered in the supply. Voltages are Q15 of the supply,
+// the linear range is a phase amplitude of 1/sqrt(3) (18918). Duties come
+// out in 0..top, top has to be a power of two, 1 << top_po2.
+static inline void foc_svpwm( int32_t alpha, int32_t beta, int top_po2, int32_t * duty )
+{
+	int32_t hb = foc_sqrt3_2( beta );
+	int32_t va = alpha;
+	int32_t vb = -( alpha >> 1 ) + hb;
+	int32_t vc = -( alpha >> 1 ) - hb;
+
+	int32_t mx = va, mn = va;
+	if( vb > mx ) mx = vb;
+	if( vb < mn ) mn = vb;
+	if( vc > mx ) mx = vc;
+	if( vc < mn ) mn = vc;
+	int32_t mid = ( mx + mn ) >> 1;
+
+	int32_t top = 1 << top_po2;
+	int32_t half = top >> 1;
+	int shift = 15 - top_po2;
+	int32_t v[3] = { va - mid, vb - mid, vc - mid };
+	int i;
+	for( i = 0; i < 3; i++ )
+	{
+		int32_t t = half + ( v[i] >> shift );
+		if( t < 0 ) t = 0;
+		if( t > top ) t = top;
+		duty[i] = t;
+	}
+}
+
+// PI with the integral gain as a shift to save a multiply. Anti-windup by
+// clamping the integrator to the output limit.
+typedef struct
+{
+	int32_t kp;       // Q15
+	int ki_shift;     // integ += err >> ki_shift every period
+	int32_t limit;    // Q15 output clamp
+	int32_t integ;
+} foc_pi;
+
+static inline int32_t foc_pi_step( foc_pi * pi, int32_t err )
+{
+	if( err > 32767 ) err = 32767;
+	if( err < -32767 ) err = -32767;
+
+	int32_t i = pi->integ + ( err >> pi->ki_shift );
+	if( i > pi->limit ) i = pi->limit;
+	if( i < -pi->limit ) i = -pi->limit;
+	pi->integ = i;
+
+	int32_t out = foc_mul( err, pi->kp ) + i;
+	if( out > pi->limit ) out = pi->limit;
+	if( out < -pi->limit ) out = -pi->limit;
+	return out;
+}
+
+#endif
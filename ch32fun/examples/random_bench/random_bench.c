@@ -0,0 +1,78 @@
+// Times the generators of lib_rand.h on a CH32V003: cycles a word for each,
+// one at a time and through the fill functions. rand() is seeded from the
+// noise on PA2 (A0), left floating.
+
+#include "ch32fun.h"
+#include <stdio.h>
+
+#define RANDOM_ADC_CHANNEL 0
+#include "lib_rand.h"
+
+#define WORDS 1024
+
+static uint32_t buf[256];
+
+static uint32_t x32 = 1;
+static xoshiro128_state xo;
+static pcg32_state pcg;
+
+static uint32_t gen_lfsr1( void ) { _rand_lfsr_update(); return _rand_lfsr; }
+static uint32_t gen_lfsr2( void ) { return _rand_gen_32b(); }
+static uint32_t gen_lfsr3( void ) { return _rand_gen_32b() ^ _rand_gen_32b(); }
+static uint32_t gen_xorshift32( void ) { return xorshift32( &x32 ); }
+static uint32_t gen_xoshiro128( void ) { return xoshiro128( &xo ); }
+static uint32_t gen_pcg32( void ) { return pcg32( &pcg ); }
+
+static const struct
+{
+	const char * name;
+	uint32_t (*gen)( void );
+} gens[] = {
+	{ "LFSR strength 1", gen_lfsr1 },
+	{ "LFSR strength 2", gen_lfsr2 },
+	{ "LFSR strength 3", gen_lfsr3 },
+	{ "xorshift32     ", gen_xorshift32 },
+	{ "xoshiro128**   ", gen_xoshiro128 },
+	{ "pcg32          ", gen_pcg32 },
+};
+
+static void report( const char * name, uint32_t ticks, uint32_t words )
+{
+	uint32_t c = ticks * 100 / words;
+	printf( "%s %5lu.%02lu cycles a word\n", name, c / 100, c % 100 );
+}
+
+int main()
+{
+	SystemInit();
+	funGpioInitAll();
+	funPinMode( PA2, GPIO_CFGLR_IN_ANALOG );
+	funAnalogInit();
+
+	rand_seed_entropy();
+	xorshift32_seed( &x32, rand_entropy() );
+	xoshiro128_seed( &xo, rand_entropy() );
+	pcg32_seed( &pcg, rand_entropy(), 1 );
+
+	uint32_t sum = 0;
+	for( uint32_t g = 0; g < sizeof( gens ) / sizeof( gens[0] ); g++ )
+	{
+		uint32_t t0 = SysTick->CNT;
+		for( int i = 0; i < WORDS; i++ ) sum += gens[g].gen();
+		report( gens[g].name, SysTick->CNT - t0, WORDS );
+	}
+
+	uint32_t t0 = SysTick->CNT;
+	for( int i = 0; i < WORDS / 256; i++ ) xorshift32_fill( &x32, buf, sizeof( buf ) );
+	report( "xorshift32_fill", SysTick->CNT - t0, WORDS );
+	t0 = SysTick->CNT;
+	for( int i = 0; i < WORDS / 256; i++ ) xoshiro128_fill( &xo, buf, sizeof( buf ) );
+	report( "xoshiro128_fill", SysTick->CNT - t0, WORDS );
+	t0 = SysTick->CNT;
+	for( int i = 0; i < WORDS / 256; i++ ) pcg32_fill( &pcg, buf, sizeof( buf ) );
+	report( "pcg32_fill     ", SysTick->CNT - t0, WORDS );
+
+	printf( "sum %08lx, rand() %08lx %08lx\n", sum, rand(), rand() );
+
+	while( 1 );
+}
@@ -0,0 +1,7 @@
+#ifndef _FUNCONFIG_H
+#define _FUNCONFIG_H
+
+// SysTick at HCLK, so its ticks are cycles.
+#define FUNCONF_SYSTICK_USE_HCLK 1
+
+#endif
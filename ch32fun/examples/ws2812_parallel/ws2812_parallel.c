@@ -0,0 +1,77 @@
+// 8 strings of 300 WS2812Bs on PC0 to PC7 of a CH32V003, driven at once by
+// ws2812b_dma_gpio_parallel.h, a rainbow running down each, a string apart.
+//
+// First it times the encoder, in cycles an LED of all 8 strings, with and
+// without working out the colors, against the cycles the DMA takes to send
+// that LED, then the frame rate, frames started back to back for a second.
+
+#include "ch32fun.h"
+#include <stdio.h>
+
+#define WS2812PAR_IMPLEMENTATION
+#define WS2812PAR_PORT GPIOC
+#define WS2812PAR_STRIPS 8
+#include "ws2812b_dma_gpio_parallel.h"
+
+#define NR_LEDS 300
+
+static int frame;
+
+// A color wheel, at a quarter brightness.
+static uint32_t Wheel( uint8_t h )
+{
+	uint8_t third = h / 86, f = ( h - third * 86 ) * 3;
+	uint32_t up = f >> 2, down = ( 255 - f ) >> 2;
+	if( third == 0 ) return ( up << 16 ) | ( down << 8 );   // G up, R down
+	if( third == 1 ) return ( ( 63 - up ) << 16 ) | up;     // G down, B up
+	return ( up << 8 ) | ( 63 - up );                       // R up, B down
+}
+
+void WS2812BParLEDCallback( uint32_t * colors, int ledno )
+{
+	for( int s = 0; s < WS2812PAR_STRIPS; s++ )
+		colors[s] = Wheel( ledno * 2 + frame + s * 32 );
+}
+
+static uint32_t scratch[WS2812PAR_WORDS_PER_LED];
+
+int main()
+{
+	SystemInit();
+	Delay_Ms( 100 );
+	WS2812BParInit();
+
+	uint32_t colors[8];
+	for( int s = 0; s < 8; s++ ) colors[s] = Wheel( s * 32 );
+	uint32_t t0 = SysTick->CNT;
+	for( int i = 0; i < NR_LEDS; i++ ) WS2812BParEncode( scratch, colors );
+	uint32_t encode = ( SysTick->CNT - t0 ) / NR_LEDS;
+	t0 = SysTick->CNT;
+	for( int i = 0; i < NR_LEDS; i++ )
+	{
+		WS2812BParLEDCallback( colors, i );
+		WS2812BParEncode( scratch, colors );
+	}
+	uint32_t both = ( SysTick->CNT - t0 ) / NR_LEDS;
+	uint32_t sent = WS2812PAR_WORDS_PER_LED * ( TIM1->ATRLR + 1 );
+	printf( "%d strings, cycles an LED: encode %lu, with the colors %lu, sending it %lu (%lu%% busy)\n",
+		WS2812PAR_STRIPS, encode, both, sent, both * 100 / sent );
+
+	int frames = 0;
+	t0 = SysTick->CNT;
+	while( SysTick->CNT - t0 < FUNCONF_SYSTEM_CORE_CLOCK )
+	{
+		while( WS2812BParLEDInUse );
+		frame++;
+		WS2812BParStart( NR_LEDS );
+		frames++;
+	}
+	printf( "%d strings of %d LEDs, %d frames/s\n", WS2812PAR_STRIPS, NR_LEDS, frames );
+
+	while(1)
+	{
+		while( WS2812BParLEDInUse );
+		frame++;
+		WS2812BParStart( NR_LEDS );
+	}
+}
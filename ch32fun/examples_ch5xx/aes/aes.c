@@ -1,43 +1,17 @@
 #include "ch32fun.h"
 #include <stdio.h>
 
-#define AES_BASE ((uint32_t)0x4000c300)
+// #define AES_HW 0 // to try the software on a part with the block
+#include "lib_aes.h"
 
-typedef struct {
-	volatile uint32_t CFG;
-	volatile uint32_t STA; // Completely (?) useless
-	volatile uint32_t some_reg1; // Don't know yet what are these 4 for
-	volatile uint32_t some_reg2;
-	volatile uint32_t some_reg3;
-	volatile uint32_t some_reg4;
-	volatile uint32_t data[4];
-	volatile uint32_t key[4];
-} AES_Type;
+static uint8_t buf[1024];
 
-#define AES ((AES_Type *) AES_BASE)
-
-void doAES(uint32_t * key, uint32_t * in, uint32_t * out, uint8_t enc) {
-	
-	AES->CFG = 0x100; // Don't know what it does, maybe enables the peripheral or clock for it
-	AES->CFG = enc?0:2; // Type of operation
-	AES->key[0] = key[0];
-	AES->key[1] = key[1];
-	AES->key[2] = key[2];
-	AES->key[3] = key[3];
-	AES->data[0] = in[0];
-	AES->data[1] = in[1];
-	AES->data[2] = in[2];
-	AES->data[3] = in[3];
-	// AES->STA &= 0xfffffffd;
-	// AES->STA |= 1;
-	AES->CFG |= 1; // Start process
-  
-  while(AES->CFG & 1); // Wait for it to finish
-  
-	out[0] = AES->data[0];
-	out[1] = AES->data[1];
-	out[2] = AES->data[2];
-	out[3] = AES->data[3];
+static void print_hex(const char * what, const uint8_t * p, int n) {
+	printf("%s:\n ", what);
+	for (int i = 0; i < n; i++) {
+		printf("%02X", p[i]);
+	}
+	printf("\n\n");
 }
 
 int main()
@@ -51,42 +25,64 @@ int main()
 	char plain_text[16] = "ch5xx can do aes";
 	uint8_t secret_message[16] = {0xD7,0xF6, 0x79, 0x38, 0x60, 0x2A, 0xCC, 0x2F, 0x50, 0xF7, 0x2A, 0x8B, 0x2B, 0x04, 0x31, 0x52};
 	uint8_t output_data[16];
+	aes_ctx ctx;
 
 	printf("128 bit key:\n ");
 	for (int i = 0; i < 16; i++) {
 		printf("%c", key[i]);
 	}
 	printf("\n\n");
-	printf("key in HEX:\n ");
-	for (int i = 0; i < 16; i++) {
-		printf("%02X", key[i]);
-	}
-	printf("\n\n");
+	print_hex("key in HEX", (uint8_t *)key, 16);
 
-	doAES(key, plain_text, output_data, 1);
+	aes_setkey(&ctx, key);
+	aes_encrypt_block(&ctx, plain_text, output_data);
 	printf("normal text:\n ");
 	for (int i = 0; i < 16; i++) {
 		printf("%c", plain_text[i]);
 	}
 	printf("\n\n");
-	printf("encrypted text:\n ");
-	for (int i = 0; i < 16; i++) {
-		printf("%02X", output_data[i]);
-	}
-	printf("\n\n");
+	print_hex("encrypted text", output_data, 16);
+	print_hex("secret message", secret_message, 16);
 
-	printf("secret message:\n ");
+	aes_decrypt_block(&ctx, secret_message, output_data);
+	printf("decrypted message:\n ");
 	for (int i = 0; i < 16; i++) {
-		printf("%02X", secret_message[i]);
+		printf("%c", output_data[i]);
 	}
 	printf("\n\n");
 
-	doAES(key, secret_message, output_data, 0);
-	printf("decrypted message:\n ");
-	for (int i = 0; i < 16; i++) {
-		printf("%c", output_data[i]);
+	// A packet, sealed and opened as lib_aes.h suggests for iSLER
+	uint8_t nonce[13] = {1, 0, 0, 0, 0, 0xa0, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7};
+	uint8_t hdr[2] = {0x02, 16 + 4};
+	uint8_t pkt[16 + 4] = "ch5xx can do ccm";
+	aes_ccm_encrypt(&ctx, nonce, 13, hdr, 2, pkt, pkt, 16, pkt + 16, 4);
+	print_hex("CCM packet, 4 byte tag", pkt, 20);
+	int ok = !aes_ccm_decrypt(&ctx, nonce, 13, hdr, 2, pkt, pkt, 16, pkt + 16, 4);
+	printf("opened: %s, %.16s\n", ok ? "ok" : "FAILED", pkt);
+	aes_ccm_encrypt(&ctx, nonce, 13, hdr, 2, pkt, pkt, 16, pkt + 16, 4);
+	pkt[3] ^= 1;
+	printf("with a bit flipped: %s\n\n", aes_ccm_decrypt(&ctx, nonce, 13, hdr, 2, pkt, pkt, 16, pkt + 16, 4) ? "refused" : "TAKEN");
+
+	// Throughput of each mode over 1 kB, SysTick counts cycles
+	static const char * const names[] = {"ECB encrypt", "ECB decrypt", "CBC encrypt", "CBC decrypt", "CTR        ", "CCM        "};
+	uint8_t iv[16] = {0}, tag[4];
+	aes_ctr_state ctr;
+	aes_ctr_start(&ctr, iv);
+	printf("%s, %lu MHz, 1 kB:\n", AES_HW ? "AES block" : "software", FUNCONF_SYSTEM_CORE_CLOCK / 1000000);
+	for (int m = 0; m < 6; m++) {
+		uint32_t t0 = SysTick->CNT;
+		switch (m) {
+		case 0: aes_ecb_encrypt(&ctx, buf, buf, sizeof(buf)); break;
+		case 1: aes_ecb_decrypt(&ctx, buf, buf, sizeof(buf)); break;
+		case 2: aes_cbc_encrypt(&ctx, iv, buf, buf, sizeof(buf)); break;
+		case 3: aes_cbc_decrypt(&ctx, iv, buf, buf, sizeof(buf)); break;
+		case 4: aes_ctr(&ctx, &ctr, buf, buf, sizeof(buf)); break;
+		default: aes_ccm_encrypt(&ctx, nonce, 13, hdr, 2, buf, buf, sizeof(buf), tag, 4); break;
+		}
+		uint32_t t = SysTick->CNT - t0;
+		uint32_t kbs = (uint64_t)sizeof(buf) * (FUNCONF_SYSTEM_CORE_CLOCK / 1024) / t;
+		printf(" %s %5lu cycles a block, %lu.%02lu MB/s\n", names[m], t / (sizeof(buf) / 16), kbs / 1024, kbs % 1024 * 100 / 1024);
 	}
-	printf("\n");
 
 	while(1)
 	{
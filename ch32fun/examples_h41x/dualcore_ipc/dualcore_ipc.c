@@ -0,0 +1,137 @@
+// Splits a FIR filter between the V3F and the V5F with lib_ipc.h, and
+// measures how long a message and a job take to go around.
+
+#include "ch32fun.h"
+#include <stdio.h>
+#include "lib_ipc.h"
+
+#define N     4096
+#define TAPS  32
+#define ROUNDS 1000
+
+static int32_t in[N + TAPS];
+static int32_t out[N];
+static int32_t taps[TAPS];
+
+typedef struct
+{
+	int from;
+	int to;
+} span_t;
+
+static int fir( void * arg )
+{
+	span_t * s = arg;
+	for( int i = s->from; i < s->to; i++ )
+	{
+		int32_t acc = 0;
+		for( int t = 0; t < TAPS; t++ )
+			acc += in[i + t] * taps[t];
+		out[i] = acc >> 8;
+	}
+	return s->to - s->from;
+}
+
+static int nop( void * arg )
+{
+	return 0;
+}
+
+// Runs the other core's jobs, and sends back any message it gets.
+static int v5f_entry( void )
+{
+	ipc_msg_t m;
+	while( 1 )
+	{
+		IPCPoll();
+		if( IPCRecv( &m ) == 0 )
+			while( IPCSend( &m ) );
+	}
+	return 0;
+}
+
+static uint32_t checksum( void )
+{
+	uint32_t c = 0;
+	IPCCacheInvalidate( out, sizeof( out ) );
+	for( int i = 0; i < N; i++ )
+		c = c * 31 + out[i];
+	return c;
+}
+
+static uint32_t ticks( void )
+{
+	return (uint32_t)SysTick->CNT;
+}
+
+int main()
+{
+	SystemInit();
+	IPCInit();
+
+	for( int i = 0; i < N + TAPS; i++ ) in[i] = ( i * 7919 ) % 1021 - 510;
+	for( int t = 0; t < TAPS; t++ ) taps[t] = 16 - ( t - TAPS / 2 ) * ( t - TAPS / 2 ) / 16;
+	IPCCacheWriteback( in, sizeof( in ) );
+	IPCCacheWriteback( taps, sizeof( taps ) );
+
+	StartV5F( v5f_entry );
+	Delay_Ms( 10 );
+
+	// Message round trip, V3F -> V5F -> V3F.
+	ipc_msg_t m = { 0 };
+	uint32_t t0 = ticks();
+	for( int i = 0; i < ROUNDS; i++ )
+	{
+		m.arg[0] = i;
+		while( IPCSend( &m ) );
+		while( IPCRecv( &m ) );
+	}
+	uint32_t t_msg = ticks() - t0;
+
+	// Job round trip, submit to done.
+	t0 = ticks();
+	for( int i = 0; i < ROUNDS; i++ )
+		IPCWait( IPCSubmit( nop, 0 ) );
+	uint32_t t_job = ticks() - t0;
+
+	// The whole filter on each core, then split by how fast each one was.
+	static span_t all = { 0, N }, mine, theirs;
+
+	memset( out, 0, sizeof( out ) );
+	t0 = ticks();
+	fir( &all );
+	uint32_t t_v3f = ticks() - t0;
+	uint32_t ref = checksum();
+
+	memset( out, 0, sizeof( out ) );
+	IPCCacheWriteback( out, sizeof( out ) );
+	t0 = ticks();
+	IPCWait( IPCSubmit( fir, &all ) );
+	uint32_t t_v5f = ticks() - t0;
+	uint32_t c_v5f = checksum();
+
+	int split = (int)( (uint64_t)N * t_v5f / ( t_v3f + t_v5f ) ); // V3F's share
+	mine.from = 0;
+	mine.to = split;
+	theirs.from = split;
+	theirs.to = N;
+	memset( out, 0, sizeof( out ) );
+	IPCCacheWriteback( out, sizeof( out ) );
+	t0 = ticks();
+	uint32_t job = IPCSubmit( fir, &theirs );
+	fir( &mine );
+	IPCWait( job );
+	uint32_t t_both = ticks() - t0;
+	uint32_t c_both = checksum();
+
+	printf( "message round trip  %lu.%02lu us\n", t_msg / ROUNDS / DELAY_US_TIME, t_msg * 100 / ROUNDS / DELAY_US_TIME % 100 );
+	printf( "job round trip      %lu.%02lu us\n", t_job / ROUNDS / DELAY_US_TIME, t_job * 100 / ROUNDS / DELAY_US_TIME % 100 );
+	printf( "FIR %d x %d taps\n", N, TAPS );
+	printf( "  V3F alone         %lu us\n", t_v3f / DELAY_US_TIME );
+	printf( "  V5F alone         %lu us%s\n", t_v5f / DELAY_US_TIME, c_v5f == ref ? "" : "  MISMATCH" );
+	printf( "  both, %4d / %4d %lu us%s\n", split, N - split, t_both / DELAY_US_TIME, c_both == ref ? "" : "  MISMATCH" );
+	printf( "  speedup           %lu.%02lux over the V3F, %lu.%02lux over the V5F\n",
+		t_v3f / t_both, t_v3f * 100 / t_both % 100, t_v5f / t_both, t_v5f * 100 / t_both % 100 );
+
+	while( 1 );
+}
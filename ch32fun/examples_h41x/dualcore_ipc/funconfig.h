@@ -0,0 +1,4 @@
+#ifndef _FUNCONFIG_H
+#define _FUNCONFIG_H
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef _FUNCONFIG_H
+#define _FUNCONFIG_H
+
+#define FUNCONF_USE_DEBUGPRINTF     1
+#define FUNCONF_ENABLE_HPE          0
+#define FUNCONF_SYSTICK_USE_HCLK    1
+#define FUNCONF_USE_HSI             0
+#define FUNCONF_USE_HSE             1
+#define FUNCONF_PLL_MULTIPLIER      12 // 96 MHz, so ADCCLK = 96 / 8 = 12 MHz stays under 14
+#define FUNCONF_DEBUG_HARDFAULT     1
+
+#endif
@@ -0,0 +1,125 @@
+// Streams two ADC channels to the PC over USB bulk.
+//
+// TIM3 triggers a scan of PA1 / PA2 at SAMPLE_RATE, lib_adc_stream.h runs
+// a 3rd order CIC on each channel in the DMA interrupt, and the decimated
+// frames go out EP1 as little endian int16, interleaved, 64 bytes a packet.
+// Set STREAM_RAW to send the undecimated samples instead.
+//
+// usbfs_adc_stream.py reads it back.
+
+#include "ch32fun.h"
+#include <stdio.h>
+#include "fsusb.h"
+
+#define ADC_STREAM_FRAMES 64    // 4 ms per half buffer at 16 kHz
+#include "lib_adc_stream.h"
+
+#define SAMPLE_RATE 16000
+#define CIC_RATIO   8          // 2 kHz out
+#define STREAM_RAW  0
+
+#define CHANNELS    2
+#define RING_SIZE   1024       // samples, power of two, multiple of CHANNELS
+
+static const uint8_t channels[CHANNELS] = { 1, 2 };  // PA1, PA2
+
+static int16_t ring[RING_SIZE];
+static volatile uint32_t ring_head, ring_tail;
+static volatile uint32_t dropped;
+
+// Producer is the DMA interrupt. Whole frames only, so the host never loses
+// track of which sample is which channel.
+static void ring_push_frames( const void * frames, int nframes, int wide )
+{
+	uint32_t h = ring_head;
+	int n = nframes * CHANNELS;
+	if( RING_SIZE - ( h - ring_tail ) < (uint32_t)n )
+	{
+		dropped += nframes;
+		return;
+	}
+	int i;
+	for( i = 0; i < n; i++ )
+		ring[( h + i ) & ( RING_SIZE - 1 )] = wide ? ((const int32_t *)frames)[i] : ((const uint16_t *)frames)[i];
+	ring_head = h + n;
+}
+
+static void got_block( const uint16_t * frames, int nframes, int nch )
+{
+	if( STREAM_RAW ) ring_push_frames( frames, nframes, 0 );
+}
+
+static void got_decimated( const int32_t * frames, int nframes, int nch )
+{
+	ring_push_frames( frames, nframes, 1 );
+}
+
+static const ADCStreamConfig adc_cfg = {
+	.channels = channels,
+	.count = CHANNELS,
+	.sample_rate = SAMPLE_RATE,
+	.decim = STREAM_RAW ? ADC_DECIM_NONE : ADC_DECIM_CIC,
+	.cic_order = 3,
+	.ratio = CIC_RATIO,
+	.shift = 9,                // 3 * log2( 8 ), output in ADC counts
+	.on_block = got_block,
+	.on_decimated = got_decimated,
+};
+
+int HandleSetupCustom( struct _USBState * ctx, int setup_code )
+{
+	return 0;
+}
+
+int HandleInRequest( struct _USBState * ctx, int endp, uint8_t * data, int len )
+{
+	return 0;
+}
+
+void HandleDataOut( struct _USBState * ctx, int endp, uint8_t * data, int len )
+{
+	if( endp == 0 )
+		ctx->USBFS_SetupReqLen = 0;
+}
+
+int main()
+{
+	SystemInit();
+	funGpioInitAll();
+
+	funPinMode( PA1, GPIO_CFGLR_IN_ANALOG );
+	funPinMode( PA2, GPIO_CFGLR_IN_ANALOG );
+
+	// PCLK2 / 8, the ADC clock has to stay under 14 MHz.
+	RCC->CFGR0 = ( RCC->CFGR0 & ~RCC_ADCPRE ) | RCC_ADCPRE_DIV8;
+
+	USBFSSetup();
+	ADCStreamInit( &adc_cfg );
+
+	uint32_t last_report = SysTick->CNT;
+	while(1)
+	{
+		uint32_t t = ring_tail;
+		if( ring_head - t >= FUSB_EP_SIZE / 2 )
+		{
+			uint16_t * buffer = (uint16_t *)USBFS_GetEPBufferIfAvailable( USB_EP_TX );
+			if( buffer )
+			{
+				int i;
+				for( i = 0; i < FUSB_EP_SIZE / 2; i++ )
+					buffer[i] = ring[( t + i ) & ( RING_SIZE - 1 )];
+				ring_tail = t + FUSB_EP_SIZE / 2;
+				USBFS_SendEndpoint( USB_EP_TX, FUSB_EP_SIZE );
+			}
+		}
+
+		if( (int32_t)( SysTick->CNT - last_report ) > (int32_t)( FUNCONF_SYSTEM_CORE_CLOCK ) )
+		{
+			ADCStats s;
+			ADCStreamGetStats( 0, &s );
+			printf( "ch0 min %d max %d mean %d, dropped %lu, overruns %lu\n",
+				s.min, s.max, ADCStats_Mean( &s ), dropped, ADCStreamOverruns() );
+			last_report = SysTick->CNT;
+		}
+	}
+}
@@ -0,0 +1,54 @@
+#!/usr/bin/env python
+"""
+Reads the sample stream from usbfs_adc_stream and prints the per channel
+mean / min / max and the rate once a second.
+
+requires pyusb, which should be pippable
+SUBSYSTEM=="usb", ATTR{idVendor}=="1209", ATTR{idProduct}=="d036", MODE="666"
+sudo udevadm control --reload-rules && sudo udevadm trigger
+"""
+import argparse
+import struct
+import usb.core
+from timeit import default_timer as timer
+
+CH_USB_VENDOR_ID    = 0x1209    # VID
+CH_USB_PRODUCT_ID   = 0xd036    # PID
+CH_USB_EP_IN        = 0x81      # endpoint for the sample stream
+CH_USB_READ_SIZE    = 4096      # bytes per read, whole packets
+CH_USB_TIMEOUT_MS   = 2000      # timeout for USB operations
+CHANNELS            = 2         # keep in line with the firmware
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('-o', '--output', help='Write raw interleaved int16 samples to a file')
+    args = parser.parse_args()
+
+    device = usb.core.find(idVendor=CH_USB_VENDOR_ID, idProduct=CH_USB_PRODUCT_ID)
+    if device is None:
+        print("MCU not found")
+        exit(0)
+
+    out = open(args.output, 'wb') if args.output else None
+    frames = 0
+    acc = [[] for _ in range(CHANNELS)]
+    start = timer()
+    while True:
+        r = bytes(device.read(CH_USB_EP_IN, CH_USB_READ_SIZE, CH_USB_TIMEOUT_MS))
+        if out:
+            out.write(r)
+        samples = struct.unpack('<%dh' % (len(r) // 2), r)
+        for i, s in enumerate(samples):
+            acc[i % CHANNELS].append(s)
+        frames += len(samples) // CHANNELS
+
+        now = timer()
+        if now - start >= 1.0:
+            stats = ' '.join(f'ch{c}: {sum(v) / len(v):7.1f} [{min(v)}..{max(v)}]' for c, v in enumerate(acc) if v)
+            print(f'{frames / (now - start):7.0f} frames/s  {stats}')
+            frames = 0
+            acc = [[] for _ in range(CHANNELS)]
+            start = now
+
+if __name__ == '__main__':
+    main()
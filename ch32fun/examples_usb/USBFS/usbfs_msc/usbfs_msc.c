@@ -0,0 +1,130 @@
+// USB flash disk: 32 kB of the internal flash, or with USE_SPI_NOR a W25Q
+// SPI NOR flash on SPI1, as a mass storage device through lib_msc.h.
+
+#include "ch32fun.h"
+#include "fsusb.h"
+
+#define USE_SPI_NOR 0
+
+#if USE_SPI_NOR
+
+// W25Q16 on SPI1: PA4 CS, PA5 SCK, PA6 MISO, PA7 MOSI
+#define NOR_CS PA4
+
+static uint8_t nor_xfer( uint8_t b )
+{
+	while( !( SPI1->STATR & SPI_STATR_TXE ) );
+	SPI1->DATAR = b;
+	while( !( SPI1->STATR & SPI_STATR_RXNE ) );
+	return SPI1->DATAR;
+}
+
+static void nor_cmd( uint8_t cmd, uint32_t addr )
+{
+	funDigitalWrite( NOR_CS, FUN_LOW );
+	nor_xfer( cmd );
+	nor_xfer( addr >> 16 );
+	nor_xfer( addr >> 8 );
+	nor_xfer( addr );
+}
+
+static void nor_write_enable( void )
+{
+	funDigitalWrite( NOR_CS, FUN_LOW );
+	nor_xfer( 0x06 );
+	funDigitalWrite( NOR_CS, FUN_HIGH );
+}
+
+static int nor_read( uint32_t addr, uint8_t * buf, int len )
+{
+	nor_cmd( 0x03, addr );
+	while( len-- ) *buf++ = nor_xfer( 0 );
+	funDigitalWrite( NOR_CS, FUN_HIGH );
+	return 0;
+}
+
+// Page program and sector erase only start the operation, lib_msc polls
+// nor_busy() and keeps taking USB packets meanwhile.
+static int nor_program( uint32_t addr, const uint8_t * data, int len )
+{
+	nor_write_enable();
+	nor_cmd( 0x02, addr );
+	while( len-- ) nor_xfer( *data++ );
+	funDigitalWrite( NOR_CS, FUN_HIGH );
+	return 0;
+}
+
+static int nor_erase( uint32_t addr )
+{
+	nor_write_enable();
+	nor_cmd( 0x20, addr );
+	funDigitalWrite( NOR_CS, FUN_HIGH );
+	return 0;
+}
+
+static int nor_busy( void )
+{
+	uint8_t s;
+	funDigitalWrite( NOR_CS, FUN_LOW );
+	nor_xfer( 0x05 );
+	s = nor_xfer( 0 );
+	funDigitalWrite( NOR_CS, FUN_HIGH );
+	return s & 1;
+}
+
+static void nor_init( void )
+{
+	RCC->APB2PCENR |= RCC_APB2Periph_SPI1;
+	funPinMode( NOR_CS, GPIO_CFGLR_OUT_50Mhz_PP );
+	funDigitalWrite( NOR_CS, FUN_HIGH );
+	funPinMode( PA5, GPIO_CFGLR_OUT_50Mhz_AF_PP );
+	funPinMode( PA6, GPIO_CFGLR_IN_FLOAT );
+	funPinMode( PA7, GPIO_CFGLR_OUT_50Mhz_AF_PP );
+	SPI1->CTLR1 = SPI_CTLR1_MSTR | SPI_CTLR1_SSM | SPI_CTLR1_SSI | SPI_CTLR1_BR_0 | SPI_CTLR1_SPE; // HCLK / 4
+}
+
+#define MSC_BLOCKS 4096  // 2 MB
+#define MSC_BD_READ( addr, buf, len ) nor_read( addr, buf, len )
+#define MSC_BD_PROGRAM( addr, data, len ) nor_program( addr, data, len )
+#define MSC_BD_ERASE( addr ) nor_erase( addr )
+#define MSC_BD_BUSY() nor_busy()
+
+#else
+
+// The upper half of a 64 kB part, the program has to stay below.
+#define MSC_BLOCKS  64
+#define MSC_BD_BASE 0x08008000
+
+#endif
+
+#include "lib_msc.h"
+
+int HandleSetupCustom( struct _USBState * ctx, int setup_code )
+{
+	return MSCHandleSetup( ctx, setup_code );
+}
+
+int HandleInRequest( struct _USBState * ctx, int endp, uint8_t * data, int len )
+{
+	return endp == MSC_EP_IN ? MSCTx( data ) : 0;
+}
+
+void HandleDataOut( struct _USBState * ctx, int endp, uint8_t * data, int len )
+{
+	if( endp == 0 )
+		ctx->USBFS_SetupReqLen = 0; // To ACK
+	else if( endp == MSC_EP_OUT )
+		MSCRx( data, len );
+}
+
+int main()
+{
+	SystemInit();
+	funGpioInitAll();
+#if USE_SPI_NOR
+	nor_init();
+#endif
+	USBFSSetup();
+
+	while( 1 ) MSCPoll();
+}
@@ -0,0 +1,102 @@
+// USB camera: a DVP camera on a CH32V307, streamed over USBHS as a UVC
+// device through lib_uvc.h. With TEST_PATTERN it sends moving color bars
+// instead, to try it without a camera. Once a second it prints the frame
+// rate, the frames dropped and the MB/s that went out.
+
+#include "ch32fun.h"
+#include <stdio.h>
+#include "hsusb.h"
+#include "lib_uvc.h"
+
+#define TEST_PATTERN 1
+
+int HandleSetupCustom( struct _USBState * ctx, int setup_code )
+{
+	return UVCHandleSetup( ctx, setup_code );
+}
+
+int HandleInRequest( struct _USBState * ctx, int endp, uint8_t * data, int len )
+{
+	return endp == UVC_EP_IN ? UVCTx() : 0;
+}
+
+void HandleDataOut( struct _USBState * ctx, int endp, uint8_t * data, int len )
+{
+	if( endp == 0 ) UVCHandleDataOut( ctx, data, len );
+}
+
+#if TEST_PATTERN && !UVC_MJPEG
+
+// Eight bars in YUY2, white to black, that move a pixel pair per frame.
+static const uint32_t bars[8] = {
+	0x80eb80eb, 0x92d210d2, 0x10aaa6aa, 0x22912291,
+	0xde6ade6a, 0xf051f051, 0x6e29f029, 0x80108010,
+};
+
+static int row = -1;
+
+// One row of frame n when its slot is free, the USB side takes them out at
+// its own pace. A frame that's skipped goes through at once.
+static void pattern_row( uint32_t n )
+{
+	if( uvc.on && !uvc_free( uvc.first + row / UVC_SLOT_LINES ) ) return;
+	uint32_t * p = (uint32_t *)UVCRowAddr();
+	for( int x = 0; x < UVC_WIDTH / 2; x++ )
+		p[x] = bars[( ( x + n ) % ( UVC_WIDTH / 2 ) ) * 8 / ( UVC_WIDTH / 2 )];
+	UVCRowDone();
+	if( ++row == UVC_HEIGHT )
+	{
+		UVCFrameEnd( 0 );
+		row = -1;
+	}
+}
+
+#else
+
+// Set the sensor up here, over SCCB (I2C), for UVC_WIDTH x UVC_HEIGHT in
+// YUY2, or JPEG with UVC_MJPEG. WCH's DVP examples have the OV2640 tables.
+static void camera_setup( void )
+{
+}
+
+#endif
+
+int main()
+{
+	SystemInit();
+	funGpioInitAll();
+	USBHSSetup();
+
+#if TEST_PATTERN && !UVC_MJPEG
+	uint32_t n = 0, next = SysTick->CNT;
+#else
+	camera_setup();
+	UVCDVPInit();
+#endif
+
+	uint32_t frames = 0, dropped = 0, bytes = 0, second = SysTick->CNT;
+	while( 1 )
+	{
+		UVCPoll();
+#if TEST_PATTERN && !UVC_MJPEG
+		if( row < 0 && (int32_t)( SysTick->CNT - next ) >= 0 )
+		{
+			next += DELAY_MS_TIME * 1000 / UVC_FPS;
+			n++;
+			UVCFrameStart();
+			row = 0;
+		}
+		if( row >= 0 ) pattern_row( n );
+#endif
+		if( (int32_t)( SysTick->CNT - second ) >= 0 )
+		{
+			second += DELAY_MS_TIME * 1000;
+			uint32_t f = uvc.frames, d = uvc.dropped, b = uvc.bytes;
+			uint32_t kbs = ( b - bytes ) / 1024;
+			printf( "%lu fps, %lu dropped, %lu.%02lu MB/s\n", f - frames, d - dropped, kbs / 1024, kbs % 1024 * 100 / 1024 );
+			frames = f;
+			dropped = d;
+			bytes = b;
+		}
+	}
+}
@@ -0,0 +1,147 @@
+// Throughput test for sfhip_netif.h on the CH32V208 (10 Mbit) and the
+// CH32V307 (100 / 1000 Mbit with an RTL8211).
+//
+// Gets an address over DHCP, then:
+//
+//  UDP 5001  receive sink, e.g. iperf -u -c <ip> -b 10M -t 10
+//  TCP 5001  receive sink, e.g. iperf -c <ip> -t 10
+//  UDP 5002  any datagram starts a 10 s transmit burst of 1472 byte
+//            datagrams back to the sender, eth_iperf.py does this and
+//            measures the rate.
+//
+// Rates are printed once a second.
+
+#include "ch32fun.h"
+#include <stdio.h>
+#include <string.h>
+
+#define SFHIP_TCP_SOCKETS 4
+#define SFHIP_UDP_USER_HANDLER iperf_udp
+#define SFHIP_IMPLEMENTATION
+#include "sfhip_netif.h"
+
+#define IPERF_PORT      5001
+#define BLAST_PORT      5002
+#define BLAST_MS        10000
+#define BLAST_PAYLOAD   1472
+
+static sfhip hip = {
+	.ip = HIPIP( 192, 168, 14, 251 ),
+	.mask = HIPIP( 255, 255, 255, 0 ),
+	.gateway = HIPIP( 192, 168, 14, 1 ),
+	.hostname = "ch32_iperf",
+};
+
+static uint32_t rx_bytes, tx_bytes, rx_frames;
+
+// Transmit burst target.
+static hipmac blast_mac;
+static sfhip_address blast_ip;
+static int blast_port;
+static int blast_ms_left;
+static uint32_t blast_seq;
+
+int iperf_udp( sfhip * hip, sfhip_phy_packet_mtu * pkt, uint8_t * payload, int ulen, int source_port, int destination_port )
+{
+	if ( destination_port == IPERF_PORT )
+	{
+		rx_bytes += ulen;
+		return 0;
+	}
+	if ( destination_port == BLAST_PORT )
+	{
+		sfhip_ip_header * ip = (sfhip_ip_header *)( &pkt->mac_header + 1 );
+		blast_mac = pkt->mac_header.source;
+		blast_ip = ip->source_address;
+		blast_port = source_port;
+		blast_ms_left = BLAST_MS;
+		blast_seq = 0;
+	}
+	return 0;
+}
+
+int sfhip_tcp_accept_connection( sfhip * hip, int sockno, int localport, hipbe32 remote_host )
+{
+	return localport == IPERF_PORT;
+}
+
+sfhip_length_or_tcp_code sfhip_tcp_event( sfhip * hip, int sockno, uint8_t * ip_payload, int ip_payload_length, int max_out_payload, int acked )
+{
+	rx_bytes += ip_payload_length;
+	return 0;
+}
+
+void sfhip_tcp_socket_closed( sfhip * hip, int sockno )
+{
+}
+
+void sfhip_got_dhcp_lease( sfhip * hip, sfhip_address addr )
+{
+	printf( "IP " HIPIPSTR "\n", HIPIPV( addr ) );
+}
+
+// Fills every free TX buffer with a datagram, built in place.
+static void blast( void )
+{
+	sfhip_phy_packet_mtu * pkt;
+	while ( blast_ms_left > 0 && ( pkt = sfhip_netif_get_tx() ) )
+	{
+		uint8_t * payload = (uint8_t *)( (sfhip_udp_header *)( (sfhip_ip_header *)pkt->payload + 1 ) + 1 );
+		memcpy( payload, &blast_seq, sizeof( blast_seq ) );
+		if ( sfhip_send_udp_packet( &hip, pkt, blast_mac, blast_ip, BLAST_PORT, blast_port, BLAST_PAYLOAD ) )
+			break;
+		blast_seq++;
+		tx_bytes += BLAST_PAYLOAD;
+	}
+}
+
+int main()
+{
+	SystemInit();
+	funGpioInitAll();
+
+	sfhip_netif_init( &hip );
+	printf( "MAC " HIPMACSTR "\n", HIPMACV( hip.self_mac ) );
+
+	uint32_t last = SysTick->CNT;
+	uint32_t ticks = 0;
+	int ms_report = 0, ms_link = 0;
+
+	while ( 1 )
+	{
+		uint32_t now = SysTick->CNT;
+		ticks += now - last;
+		last = now;
+		int ms = ticks / DELAY_MS_TIME;
+		ticks -= ms * DELAY_MS_TIME;
+
+		rx_frames += sfhip_netif_poll( &hip, ms );
+
+		if ( blast_ms_left > 0 )
+		{
+			blast_ms_left -= ms;
+			blast();
+		}
+
+#if SFHIP_NETIF_V208
+		if ( ( ms_link += ms ) >= 50 )
+		{
+			ms_link = 0;
+			eth_poll_link();
+		}
+#else
+		if ( ( ms_link += ms ) >= 500 )
+		{
+			ms_link = 0;
+			ch32v307ethTickPhy();
+		}
+#endif
+
+		if ( ( ms_report += ms ) >= 1000 )
+		{
+			printf( "rx %lu kbit/s (%lu frames)  tx %lu kbit/s\n", rx_bytes * 8 / ms_report, rx_frames, tx_bytes * 8 / ms_report );
+			rx_bytes = tx_bytes = rx_frames = 0;
+			ms_report = 0;
+		}
+	}
+}
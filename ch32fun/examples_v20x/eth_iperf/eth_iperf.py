@@ -0,0 +1,50 @@
+#!/usr/bin/env python
+"""
+Triggers the transmit burst of eth_iperf and measures the received rate
+and lost datagrams.
+
+./eth_iperf.py <device ip>
+"""
+import socket
+import struct
+import sys
+from timeit import default_timer as timer
+
+BLAST_PORT = 5002
+
+def main():
+    if len(sys.argv) < 2:
+        print(__doc__)
+        exit(1)
+
+    s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    s.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4 << 20)
+    s.settimeout(1.0)
+    s.sendto(b'go', (sys.argv[1], BLAST_PORT))
+
+    total = 0
+    count = 0
+    last_seq = -1
+    lost = 0
+    start = None
+    while True:
+        try:
+            data, _ = s.recvfrom(2048)
+        except socket.timeout:
+            break
+        if start is None:
+            start = timer()
+        seq = struct.unpack('<I', data[:4])[0]
+        if seq > last_seq + 1:
+            lost += seq - last_seq - 1
+        last_seq = seq
+        total += len(data)
+        count += 1
+    if not count:
+        print('nothing received')
+        return
+    end = timer() - 1.0
+    print(f'{count} datagrams, {lost} lost, {total * 8 / (end - start) / 1e6:.2f} Mbit/s')
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,76 @@
+// CRC benchmark for lib_crc.h on a CH32V307: the software CRCs and the CRC
+// unit, fed by the CPU and by DMA, over a few buffer sizes, in MB/s and
+// cycles per byte. Set CRC_SLICES to compare the table sizes.
+//
+// It also checks that the unit, by either path, agrees with the software.
+
+#include "ch32fun.h"
+#include <stdio.h>
+
+#define CRC_SLICES 4
+
+#include "lib_crc.h"
+
+static uint32_t buf[16384];
+
+enum { SW_CRC32, SW_MPEG2, SW_CRC16, SW_CRC8, HW_CPU, HW_DMA, WAYS };
+
+static const char * const names[WAYS] = {
+	"crc32_update      ",
+	"crc32_mpeg2_update",
+	"crc16_update      ",
+	"crc8_update       ",
+	"unit, CPU         ",
+	"unit, DMA         ",
+};
+
+static uint32_t run( int way, uint32_t len )
+{
+	switch( way )
+	{
+	case SW_CRC32: return crc32_update( 0, buf, len );
+	case SW_MPEG2: return crc32_mpeg2_update( CRC32_MPEG2_INIT, buf, len );
+	case SW_CRC16: return crc16_update( 0, buf, len );
+	case SW_CRC8: return crc8_update( 0, buf, len );
+	case HW_CPU: return CRC_calculateArray32( buf, len / 4 );
+	default:
+		CRC_startDMA( buf, len / 4 );
+		return CRC_waitDMA();
+	}
+}
+
+int main()
+{
+	SystemInit();
+	Delay_Ms( 100 );
+	CRC_init();
+
+	for( int i = 0; i < 16384; i++ ) buf[i] = i * 2654435761u;
+
+	static const uint32_t sizes[] = { 16, 64, 256, 1024, 4096, 65536 };
+	printf( "CRC_SLICES %d, %lu MHz, MB/s (cycles/byte)\n", CRC_SLICES, FUNCONF_SYSTEM_CORE_CLOCK / 1000000 );
+	for( int w = 0; w < WAYS; w++ )
+	{
+		printf( "%s", names[w] );
+		for( int s = 0; s < 6; s++ )
+		{
+			uint32_t len = sizes[s], reps = 262144 / len;
+			uint32_t t0 = SysTick->CNT;
+			for( uint32_t r = 0; r < reps; r++ ) run( w, len );
+			uint32_t t = SysTick->CNT - t0;
+			uint32_t kbs = (uint64_t)reps * len * ( FUNCONF_SYSTEM_CORE_CLOCK / 1024 ) / t;
+			uint32_t cpb = (uint64_t)t * 100 / ( reps * len );
+			printf( " %5lu: %3lu.%02lu (%lu.%02lu)", len, kbs / 1024, kbs % 1024 * 100 / 1024, cpb / 100, cpb % 100 );
+		}
+		printf( "\n" );
+	}
+
+	uint32_t sw = crc32_mpeg2_update( CRC32_MPEG2_INIT, buf, sizeof( buf ) );
+	uint32_t cpu = CRC_calculateArray32( buf, 16384 );
+	uint32_t dma = run( HW_DMA, sizeof( buf ) );
+	uint32_t bytes = CRC_calculateBytes( (uint8_t *)buf + 1, 1001 );
+	uint32_t swbytes = crc32_mpeg2_update( CRC32_MPEG2_INIT, (uint8_t *)buf + 1, 1001 );
+	printf( sw == cpu && sw == dma && bytes == swbytes ? "unit agrees with software\n" : "unit and software DISAGREE\n" );
+
+	while( 1 );
+}
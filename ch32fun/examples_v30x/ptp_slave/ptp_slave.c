@@ -0,0 +1,80 @@
+// PTP slave on a CH32V307 with an RTL8211: follows a PTP master on the LAN
+// with lib_ptp.h, on the MAC's own IEEE 1588 clock. Once a second it prints
+// the state, the offset from the master, the path delay and the rate the
+// clock runs at, and PPS_PIN is high for the first 100 ms of every second of
+// the PTP clock.
+//
+// A Linux box with a NIC that stamps in hardware is a master with
+//   ptp4l -i eth0 -2 -m
+// and its clock follows the system clock with
+//   phc2sys -s CLOCK_REALTIME -c eth0 -O 0 -m
+
+#include "ch32fun.h"
+#include <stdio.h>
+
+#define CH32V307GIGABIT_PTP 1
+#define CH32V307GIGABIT_RX_POLL 1
+#include "ch32v307gigabit.h"
+#include "lib_ptp.h"
+
+#define PPS_PIN PA15
+
+static const char * states[] = { "listening", "uncalibrated", "slave" };
+
+int ch32v307ethInitHandlePacket( uint8_t * data, int frame_length, ETH_DMADESCTypeDef * dmadesc )
+{
+	PTPRx( data, frame_length, ch32v307eth_rxtime );
+	return 0;
+}
+
+void ch32v307ethInitHandleTXC( void )
+{
+}
+
+void ch32v307ethHandleReconfig( int link, int speed, int duplex )
+{
+	printf( "link %d, %d Mbit/s, %s duplex\n", link, speed, duplex ? "full" : "half" );
+}
+
+// Up to +-2 s, for printf.
+static long clip( int64_t v )
+{
+	return v > 2000000000 ? 2000000000 : v < -2000000000 ? -2000000000 : (long)v;
+}
+
+int main()
+{
+	SystemInit();
+	funGpioInitAll();
+	funPinMode( PPS_PIN, GPIO_Speed_10MHz | GPIO_CNF_OUT_PP );
+
+	ch32v307ethInit();
+	PTPInit( ch32v307eth_mac );
+	printf( "MAC %02x:%02x:%02x:%02x:%02x:%02x\n", ch32v307eth_mac[0], ch32v307eth_mac[1], ch32v307eth_mac[2],
+		ch32v307eth_mac[3], ch32v307eth_mac[4], ch32v307eth_mac[5] );
+
+	uint32_t phy = SysTick->CNT;
+	int64_t second = 0;
+	while( 1 )
+	{
+		ch32v307ethPoll( 8 );
+		PTPPoll();
+
+		if( (int32_t)( SysTick->CNT - phy ) >= 0 )
+		{
+			phy += DELAY_MS_TIME * 500;
+			ch32v307ethTickPhy();
+		}
+
+		// The pin goes as exactly as this loop comes around, a few us.
+		int64_t now = ch32v307ethPTPNow();
+		int64_t s = now / 1000000000;
+		funDigitalWrite( PPS_PIN, now % 1000000000 < 100000000 ? FUN_HIGH : FUN_LOW );
+		if( s != second )
+		{
+			second = s;
+			printf( "%-12s offset %ld ns, delay %ld ns, %ld ppb, %lu syncs, %lu steps\n", states[ptp.state],
+				clip( ptp.offset ), clip( ptp.delay ), (long)ptp.ppb, ptp.syncs, ptp.steps );
+		}
+	}
+}
@@ -0,0 +1,122 @@
+// SD card benchmark for lib_sdcard.h on a CH32V307: reads and writes of a
+// few sizes, then a logging stream with the latency of every buffer.
+//
+// It writes over BENCH_MB MB from BENCH_LBA on. Use a card with nothing on it.
+
+#include "ch32fun.h"
+#include <stdio.h>
+
+#define BENCH_LBA ( 64 * 2048 )   // 64 MB into the card
+#define BENCH_MB  16
+#define TOTAL     ( 2 * 2048 )    // blocks per read / write size
+
+static void latency( uint32_t ticks );
+#define SD_STREAM_DONE( lba, blocks, ticks ) latency( ticks )
+
+#include "lib_sdcard.h"
+
+static uint32_t buf[32 * 128];
+
+// Buffer latencies, 100 us per bucket
+#define BUCKETS 1000
+static uint16_t hist[BUCKETS];
+static uint32_t nlat, maxlat;
+
+static void latency( uint32_t ticks )
+{
+	uint32_t us = ticks / DELAY_US_TIME;
+	uint32_t b = us / 100;
+	hist[b < BUCKETS ? b : BUCKETS - 1]++;
+	if( us > maxlat ) maxlat = us;
+	nlat++;
+}
+
+// The latency below which p of 1000 buffers were, in us.
+static uint32_t percentile( uint32_t p )
+{
+	uint32_t n = 0, want = ( nlat * p + 999 ) / 1000;
+	for( int b = 0; b < BUCKETS; b++ )
+		if( ( n += hist[b] ) >= want ) return b < BUCKETS - 1 ? ( b + 1 ) * 100 : maxlat;
+	return maxlat;
+}
+
+static void rate( const char * what, uint32_t blocks, uint32_t ticks )
+{
+	uint32_t us = ticks / DELAY_US_TIME;
+	uint32_t kbs = (uint64_t)blocks * 512 * 1000 / 1024 / ( us / 1000 + 1 );
+	printf( "%s %4lu.%02lu MB/s\n", what, kbs / 1024, kbs % 1024 * 100 / 1024 );
+}
+
+int main()
+{
+	SystemInit();
+	Delay_Ms( 100 );
+
+	int e = SDInit();
+	if( e )
+	{
+		printf( "SDInit: %d\n", e );
+		while( 1 );
+	}
+	printf( "%s card, %lu MB\n", sd.hc ? "SDHC/SDXC" : "SDSC", SDBlocks() / 2048 );
+	if( SDBlocks() < BENCH_LBA + BENCH_MB * 2048 )
+	{
+		printf( "too small for the benchmark\n" );
+		while( 1 );
+	}
+
+	static const int sizes[] = { 1, 8, 32 };
+	for( int s = 0; s < 3; s++ )
+	{
+		uint32_t n = sizes[s], t0;
+		char what[24];
+
+		t0 = SysTick->CNT;
+		for( uint32_t i = 0; i < TOTAL && !e; i += n ) e = SDRead( BENCH_LBA + i, buf, n );
+		snprintf( what, sizeof( what ), "read  %2lu blocks", n );
+		rate( what, TOTAL, SysTick->CNT - t0 );
+
+		t0 = SysTick->CNT;
+		for( uint32_t i = 0; i < TOTAL && !e; i += n ) e = SDWrite( BENCH_LBA + i, buf, n );
+		snprintf( what, sizeof( what ), "write %2lu blocks", n );
+		rate( what, TOTAL, SysTick->CNT - t0 );
+	}
+	if( e ) printf( "error %d\n", e );
+
+	// A stream as fast as the card takes it. Each buffer is its index, in
+	// every word, to check afterwards.
+	uint32_t blocks = BENCH_MB * 2048, done = 0;
+	uint32_t t0 = SysTick->CNT;
+	e = SDStreamOpen( BENCH_LBA, blocks );
+	while( !e && done < blocks )
+	{
+		uint32_t * b = (uint32_t *)SDStreamBuffer();
+		if( !b )
+		{
+			e = SDStreamPoll();
+			continue;
+		}
+		for( int i = 0; i < SD_STREAM_BLOCKS * 128; i++ ) b[i] = done;
+		e = SDStreamSubmit( SD_STREAM_BLOCKS );
+		done += SD_STREAM_BLOCKS;
+	}
+	int c = SDStreamClose();
+	if( !e ) e = c;
+	uint32_t t = SysTick->CNT - t0;
+	if( e ) printf( "stream error %d at block %lu\n", e, sd.sent - BENCH_LBA );
+
+	printf( "stream, %d block buffers\n", SD_STREAM_BLOCKS );
+	rate( "  sustained      ", done, t );
+	printf( "  latency us: p50 %lu p90 %lu p99 %lu p99.9 %lu max %lu (%lu buffers)\n",
+		percentile( 500 ), percentile( 900 ), percentile( 990 ), percentile( 999 ), maxlat, nlat );
+
+	int bad = 0;
+	for( uint32_t i = 0; i < done && !bad; i += 997 )
+	{
+		if( SDRead( BENCH_LBA + i, buf, 1 ) ) bad = 1;
+		else if( buf[0] != i / SD_STREAM_BLOCKS * SD_STREAM_BLOCKS || buf[127] != buf[0] ) bad = 1;
+	}
+	printf( bad ? "read back FAILED\n" : "read back ok\n" );
+
+	while( 1 );
+}
@@ -3,6 +3,11 @@
  *	Configuration:
  *		- USBPD_IMPLEMENTATION: Enable USB PD implementation
  *		- FUNCONF_USBPD_NO_STR: Disable string conversion functions
+ *		- USBPD_PPS_REQUEST_MS: How often a PPS contract is requested again, default 5000
+ *			(the spec allows 10s, the source drops the contract after tPPSTimeout, 12 - 15s)
+ *		- USBPD_SINK_CURRENT_IN_10MA: 5V current in our Sink_Capabilities, default 150 (1.5A)
+ *		- USBPD_RX_QUEUE_LEN: Received messages the interrupt can queue, power of 2, default 4
+ *		- USBPD_GET_TICKS() and USBPD_TICKS_PER_MS: Time base, default SysTick->CNTL and DELAY_MS_TIME
  *	Notes:
  *		- This library is based on the USB Power Delivery Specification.
  *			https://www.usb.org/document-library/usb-power-delivery
@@ -10,6 +15,12 @@
  *			are taken directly from the spec above.
  *		- Not all messages are implemented.
  *		- Formatting macros are provided next to the struct deffinitions.
+ *		- The interrupt is the protocol layer: it answers every message with GoodCRC, drops
+ *			retries of messages it already has, matches GoodCRC to the message in flight and
+ *			queues the rest. USBPD_SinkNegotiate() is the policy engine: it works through the
+ *			queue, retries, runs the spec timers and recovers with Soft and Hard Reset.
+ *		- SysTick has to be running, USBPD_SinkNegotiate() reads it for the timers.
+ *		- misc/usbpdsim runs this file against a simulated source on the host.
  *	Basic usage:
  *		USBPD_VCC_e vcc = eUSBPD_VCC_5V0; // set the VCC voltage
  *		USBPD_Result_e result = USBPD_Init( vcc ); // initialize the peripheral
@@ -21,6 +32,9 @@
  *		const size_t count = USBPD_GetCapabilities( &capabilities );
  *		USBPD_SelectPDO( count - 1, voltage ); // select the last supply (voltage is only used for PPS)
  *
+ *		// keep calling USBPD_SinkNegotiate(), a charger can then steer a PPS supply with
+ *		USBPD_SelectPPS( index, millivolts / 20, milliamps / 50 );
+ *
  *	The above is not a complete example, check the funtion declarations below for more details.
  */
 
@@ -459,6 +473,7 @@ typedef enum
 	eUSBPD_CC2 = 2,
 } USBPD_CC_e;
 
+
 typedef enum
 {
 	eSTATE_IDLE,
@@ -467,9 +482,20 @@ typedef enum
 	eSTATE_WAIT_ACCEPT,
 	eSTATE_WAIT_PS_RDY,
 	eSTATE_PS_RDY,
+	eSTATE_SOFT_RESET,
+	eSTATE_HARD_RESET,
+	eSTATE_ERROR,
 	eSTATE_MAX,
 } USBPD_State_e;
 
+typedef struct
+{
+	uint8_t index; // Index of the PDO (0-based)
+	bool pps;
+	uint16_t millivolts;
+	uint16_t milliamps;
+} USBPD_Contract_t;
+
 /**
  * @brief  Initialize the USB PD module
  * @param  vcc: VCC voltage level (3.3V or 5V)
@@ -478,9 +504,11 @@ typedef enum
 USBPD_Result_e USBPD_Init( USBPD_VCC_e vcc );
 
 /**
- * @brief  Negotiate with the USB PD Source, must be called periodically
+ * @brief  Run the sink policy engine, must be called periodically, at least once a millisecond
+ *         while a message is waiting for its GoodCRC, for retries to go out in time
  * @param  None
- * @return USBPD_BUSY if negotiation is in progress, eUSBPD_OK if successful, or an error code
+ * @return eUSBPD_BUSY until the first explicit contract, eUSBPD_OK while there is one (a new
+ *         request keeps the old contract until PS_RDY), or an error code
  */
 USBPD_Result_e USBPD_SinkNegotiate( void );
 
@@ -513,13 +541,32 @@ const char *USBPD_StateToStr( USBPD_State_e state );
 const char *USBPD_ResultToStr( USBPD_Result_e result );
 
 /**
- * @brief  Select a new Power Data Object (PDO) to be used. No re-negotiation is needed.
+ * @brief  Select a new Power Data Object (PDO) to be used. The request goes out from
+ *         USBPD_SinkNegotiate() as soon as the previous one is done.
  * @param  index: Index of the PDO to select (0-based)
- * @param  voltageIn100mV: Desired output voltage in 100mV units (e.g., 500 for 5V) (only applicable for PPS)
+ * @param  voltageIn100mV: Desired output voltage in 100mV units (e.g., 50 for 5V) (only applicable for PPS)
  * @return USBPD_Result_e
  */
 USBPD_Result_e USBPD_SelectPDO( uint8_t index, uint32_t voltageIn100mV );
 
+/**
+ * @brief  Set the output voltage and operating current of a PPS supply. Can be called as often as
+ *         a charging loop likes, only the latest values are kept and sent, and they are re-requested
+ *         every USBPD_PPS_REQUEST_MS to keep the contract.
+ * @param  index: Index of the PPS APDO (0-based)
+ * @param  voltageIn20mV: Output voltage in 20mV units, clamped to the APDO
+ * @param  currentIn50mA: Operating current in 50mA units, clamped to the APDO, 0 for its maximum
+ * @return USBPD_Result_e
+ */
+USBPD_Result_e USBPD_SelectPPS( uint8_t index, uint32_t voltageIn20mV, uint32_t currentIn50mA );
+
+/**
+ * @brief  Get the explicit contract in place
+ * @param[out] contract: Pointer to where the contract is stored, can be NULL
+ * @return true if there is an explicit contract, false otherwise
+ */
+bool USBPD_GetContract( USBPD_Contract_t *contract );
+
 /**
  * @brief  Get the capabilities of the USB PD Source
  * @param[out] capabilities: Pointer to a pointer where the capabilities message structure is stored
@@ -545,6 +592,64 @@ USBPD_SpecificationRevision_e USBPD_GetVersion( void );
 
 #include <string.h>
 
+#ifndef USBPD_PPS_REQUEST_MS
+#define USBPD_PPS_REQUEST_MS 5000
+#endif
+
+#ifndef USBPD_SINK_CURRENT_IN_10MA
+#define USBPD_SINK_CURRENT_IN_10MA 150
+#endif
+
+#ifndef USBPD_RX_QUEUE_LEN
+#define USBPD_RX_QUEUE_LEN 4
+#endif
+
+#ifndef USBPD_GET_TICKS
+#define USBPD_GET_TICKS() ( SysTick->CNTL )
+#define USBPD_TICKS_PER_MS ( DELAY_MS_TIME )
+#endif
+
+static_assert( ( USBPD_RX_QUEUE_LEN & ( USBPD_RX_QUEUE_LEN - 1 ) ) == 0, "USBPD_RX_QUEUE_LEN must be a power of 2" );
+
+// Timers and counters, section 6.6 and 6.7 of the spec
+typedef enum
+{
+	eUSBPD_T_RECEIVE_MS = 1, // GoodCRC for a message we sent (0.9 - 1.1ms)
+	eUSBPD_T_SENDER_RESPONSE_MS = 27, // Answer to a Request or Soft_Reset (24 - 30ms)
+	eUSBPD_T_PS_TRANSITION_MS = 500, // PS_RDY after Accept (450 - 550ms)
+	eUSBPD_T_SINK_WAIT_CAP_MS = 465, // Source_Capabilities after attach (310 - 620ms)
+	eUSBPD_T_SINK_REQUEST_MS = 100, // Request again after a Wait (100ms min)
+	eUSBPD_T_PD_DEBOUNCE_MS = 15, // Rp gone for this long is a detach (10 - 20ms)
+	eUSBPD_T_SRC_RECOVER_MS = 2000, // Source off and back on after a Hard Reset, worst case
+	eUSBPD_N_RETRY_COUNT = 2,
+	eUSBPD_N_HARD_RESET_COUNT = 2,
+} USBPD_TimeParameters_t;
+
+typedef enum
+{
+	eTX_IDLE,
+	eTX_QUEUED, // Waiting for the PHY
+	eTX_SENDING,
+	eTX_WAIT_GOODCRC,
+	eTX_DONE,
+	eTX_FAILED, // No GoodCRC after all retries
+	eTX_DISCARDED, // A message came in first
+} USBPD_TxState_e;
+
+typedef enum
+{
+	ePHY_RX,
+	ePHY_TX_GOODCRC,
+	ePHY_TX_MESSAGE,
+	ePHY_TX_HARD_RESET,
+} USBPD_PhyState_e;
+
+typedef struct
+{
+	USBPD_MessageHeader_t header;
+	uint32_t data[7];
+} USBPD_Message_t;
+
 typedef struct
 {
 	uint32_t ccCount;
@@ -552,20 +657,71 @@ typedef struct
 	USBPD_SpecificationRevision_e pdVersion;
 	USBPD_CC_e lastCCLine;
 	USBPD_SPR_CapabilitiesMessage_t caps;
-	uint8_t messageID;
 	uint8_t pdoCount;
-	bool gotSourceGoodCRC;
+
+	// Protocol layer, shared with the interrupt
+	volatile uint8_t messageID; // Of the next message we send
+	volatile uint8_t lastRxID; // Of the last message received, 0xff for none
+	volatile uint8_t rxHead;
+	volatile uint8_t rxTail;
+	volatile USBPD_PhyState_e phy;
+	volatile USBPD_TxState_e tx;
+	volatile uint32_t txTick;
+	volatile bool hardResetReceived;
+	volatile bool hardResetSent;
+	volatile bool hardResetPending; // Goes out when the PHY is done
+	uint8_t txSize;
+	uint8_t txRetries;
+
+	// Policy engine
+	uint32_t now;
+	uint32_t timerTick;
+	uint32_t timerMs; // 0: stopped
+	uint32_t ppsTick;
+	uint32_t detachTick;
+	bool ccLost;
+	uint8_t hardResetCount;
+	bool hasContract;
+	bool wantPending;
+	USBPD_Contract_t contract; // In place
+	USBPD_Contract_t requested; // Waiting for Accept and PS_RDY
+	USBPD_Contract_t want; // What the application asked for last
 } USBPD_Instance_t;
 
-static __attribute__( ( aligned( 4 ) ) ) uint8_t s_buffer[34];
+static __attribute__( ( aligned( 4 ) ) ) uint8_t s_rxBuffer[34];
+static __attribute__( ( aligned( 4 ) ) ) uint8_t s_txBuffer[34];
+static __attribute__( ( aligned( 4 ) ) ) uint8_t s_goodCRCBuffer[4];
+static USBPD_Message_t s_rxQueue[USBPD_RX_QUEUE_LEN];
 static USBPD_Instance_t s_instance = {
 	.pdVersion = eUSBPD_REV_30,
+	.lastRxID = 0xff,
 };
 
 static USBPD_CC_e GetActiveCCLine( void );
 static void SwitchRXMode( void );
-static void SendMessage( uint8_t size );
-static void ParsePacket( void );
+static void SendMessage( uint8_t *buffer, uint8_t size, uint8_t sop );
+static bool Expired( uint32_t since, uint32_t ms );
+static void StartTimer( uint32_t ms );
+static bool CheckDetach( void );
+static void ResetProtocol( void );
+static void Transmit( uint8_t type, uint8_t count, const void *data );
+static void StartTransmission( void );
+static void ServiceTransmission( void );
+static void HandleMessage( const USBPD_Message_t *message );
+static void HandleCapabilities( const USBPD_Message_t *message );
+static bool FitRequest( USBPD_Contract_t *request );
+static void ClampPPS( const USBPD_SourcePDO_t *pdo, uint32_t *voltageIn20mV, uint32_t *currentIn50mA );
+static void SendRequest( const USBPD_Contract_t *request );
+static void SendSinkCapabilities( void );
+static void WaitForCapabilities( uint32_t ms );
+static void EnterReady( void );
+static void Unexpected( void );
+static void Unsupported( void );
+static void SoftReset( void );
+static void HardReset( void );
+static void SendGoodCRC( uint8_t messageID );
+static void ReceivePacket( uint16_t count );
+static void TransmitDone( void );
 
 USBPD_Result_e USBPD_Init( USBPD_VCC_e vcc )
 {
@@ -583,7 +739,7 @@ USBPD_Result_e USBPD_Init( USBPD_VCC_e vcc )
 		AFIO->CTLR |= USBPD_PHY_V33;
 	}
 
-	USBPD->DMA = (uint32_t)s_buffer;
+	USBPD->DMA = (uint32_t)s_rxBuffer;
 	USBPD->CONFIG = IE_RX_ACT | IE_RX_RESET | IE_TX_END | PD_DMA_EN | PD_FILT_EN;
 	USBPD->STATUS = BUF_ERR | IF_RX_BIT | IF_RX_BYTE | IF_RX_ACT | IF_RX_RESET | IF_TX_END;
 
@@ -599,58 +755,125 @@ USBPD_Result_e USBPD_Init( USBPD_VCC_e vcc )
 
 USBPD_Result_e USBPD_SinkNegotiate( void )
 {
-	switch ( s_instance.state )
+	s_instance.now = USBPD_GET_TICKS();
+
+	if ( s_instance.state == eSTATE_IDLE )
 	{
-		case eSTATE_IDLE:;
-			const uint8_t ccLine = GetActiveCCLine();
-			if ( ccLine == eUSBPD_CCNONE )
-			{
-				s_instance.ccCount = 0;
-				s_instance.lastCCLine = eUSBPD_CCNONE;
-				break;
-			}
+		const uint8_t ccLine = GetActiveCCLine();
+		if ( ccLine == eUSBPD_CCNONE )
+		{
+			s_instance.ccCount = 0;
+			s_instance.lastCCLine = eUSBPD_CCNONE;
+			return eUSBPD_BUSY;
+		}
 
-			if ( s_instance.lastCCLine != ccLine )
+		if ( s_instance.lastCCLine != ccLine )
+		{
+			s_instance.lastCCLine = ccLine;
+			s_instance.ccCount = 0;
+		}
+		else
+		{
+			s_instance.ccCount++;
+		}
+
+		if ( s_instance.ccCount > 10 )
+		{
+			if ( ccLine == eUSBPD_CC2 )
 			{
-				s_instance.lastCCLine = ccLine;
-				s_instance.ccCount = 0;
+				USBPD->CONFIG |= CC_SEL;
 			}
 			else
 			{
-				s_instance.ccCount++;
+				USBPD->CONFIG &= ~CC_SEL;
 			}
 
-			if ( s_instance.ccCount > 10 )
-			{
-				if ( ccLine == eUSBPD_CC2 )
-				{
-					USBPD->CONFIG |= CC_SEL;
-				}
-				else
-				{
-					USBPD->CONFIG &= ~CC_SEL;
-				}
+			s_instance.ccCount = 0;
+			ResetProtocol();
+			s_instance.phy = ePHY_RX;
+			WaitForCapabilities( eUSBPD_T_SINK_WAIT_CAP_MS );
 
-				s_instance.ccCount = 0;
-				s_instance.state = eSTATE_CABLE_DETECT;
+			SwitchRXMode();
+			USBPD->STATUS = BUF_ERR | IF_RX_BIT | IF_RX_BYTE | IF_RX_ACT | IF_RX_RESET | IF_TX_END;
+			// NVIC_SetPriority(USBPD_IRQn, 0x00); // TODO: Is this needed?
+			NVIC_EnableIRQ( USBPD_IRQn );
+		}
+		return eUSBPD_BUSY;
+	}
 
-				SwitchRXMode();
-				// NVIC_SetPriority(USBPD_IRQn, 0x00); // TODO: Is this needed?
-				NVIC_EnableIRQ( USBPD_IRQn );
-			}
-			break;
+	if ( CheckDetach() )
+	{
+		return eUSBPD_BUSY;
+	}
 
-		case eSTATE_SOURCE_CAP:
-			USBPD_SelectPDO( 0, 0 ); // Select the first PDO by default
-			s_instance.state = eSTATE_WAIT_ACCEPT;
-			break;
+	if ( s_instance.state == eSTATE_ERROR )
+	{
+		return eUSBPD_ERROR;
+	}
 
-		case eSTATE_PS_RDY: return eUSBPD_OK;
+	if ( s_instance.hardResetReceived )
+	{
+		s_instance.hardResetReceived = false;
+		ResetProtocol();
+		s_instance.hasContract = false;
+		WaitForCapabilities( eUSBPD_T_SRC_RECOVER_MS + eUSBPD_T_SINK_WAIT_CAP_MS );
+	}
+	else if ( s_instance.state == eSTATE_HARD_RESET && s_instance.hardResetSent )
+	{
+		s_instance.hardResetSent = false;
+		WaitForCapabilities( eUSBPD_T_SRC_RECOVER_MS + eUSBPD_T_SINK_WAIT_CAP_MS );
+	}
 
-		default: break;
+	ServiceTransmission();
+
+	// One message at a time, the answer to it has to be on its way before the next
+	while ( s_instance.tx == eTX_IDLE && s_instance.rxTail != s_instance.rxHead )
+	{
+		const USBPD_Message_t message = s_rxQueue[s_instance.rxTail & ( USBPD_RX_QUEUE_LEN - 1 )];
+		s_instance.rxTail++;
+		HandleMessage( &message );
+	}
+
+	if ( s_instance.timerMs && Expired( s_instance.timerTick, s_instance.timerMs ) )
+	{
+		s_instance.timerMs = 0;
+		switch ( s_instance.state )
+		{
+			case eSTATE_PS_RDY: break; // Done waiting after a Wait
+			case eSTATE_HARD_RESET: WaitForCapabilities( eUSBPD_T_SRC_RECOVER_MS + eUSBPD_T_SINK_WAIT_CAP_MS ); break;
+			default: HardReset(); break;
+		}
 	}
 
-	return eUSBPD_BUSY;
+	if ( s_instance.state == eSTATE_PS_RDY && s_instance.tx == eTX_IDLE && s_instance.timerMs == 0 )
+	{
+		// A PPS contract lapses if it isn't requested again within tPPSTimeout
+		if ( s_instance.contract.pps && !s_instance.wantPending && Expired( s_instance.ppsTick, USBPD_PPS_REQUEST_MS ) )
+		{
+			s_instance.want = s_instance.contract;
+			s_instance.wantPending = true;
+		}
+
+		if ( s_instance.wantPending )
+		{
+			USBPD_Contract_t request = s_instance.want;
+			if ( FitRequest( &request ) )
+			{
+				SendRequest( &request );
+			}
+			else
+			{
+				s_instance.wantPending = false;
+			}
+		}
+	}
+
+	if ( s_instance.state == eSTATE_ERROR )
+	{
+		return eUSBPD_ERROR;
+	}
+
+	return s_instance.hasContract ? eUSBPD_OK : eUSBPD_BUSY;
 }
 
 void USBPD_Reset( void )
@@ -658,6 +881,7 @@ void USBPD_Reset( void )
 	NVIC_DisableIRQ( USBPD_IRQn );
 	s_instance = ( USBPD_Instance_t ){
 		.pdVersion = eUSBPD_REV_30,
+		.lastRxID = 0xff,
 	};
 }
 
@@ -689,6 +913,9 @@ const char *USBPD_StateToStr( USBPD_State_e state )
 		case eSTATE_WAIT_ACCEPT: return "Waiting for Accept";
 		case eSTATE_WAIT_PS_RDY: return "Waiting for PS_Ready";
 		case eSTATE_PS_RDY: return "Power Supply Ready";
+		case eSTATE_SOFT_RESET: return "Soft Reset";
+		case eSTATE_HARD_RESET: return "Hard Reset";
+		case eSTATE_ERROR: return "Error";
 		default: return "Unknown State";
 	}
 };
@@ -715,54 +942,49 @@ USBPD_Result_e USBPD_SelectPDO( uint8_t index, uint32_t voltageIn100mV )
 		return eUSBPD_ERROR_ARGS;
 	}
 
-	const USBPD_SourcePDO_t *const pdo = &s_instance.caps.Source[index];
+	if ( USBPD_IsPPS( &s_instance.caps.Source[index] ) )
+	{
+		return USBPD_SelectPPS( index, voltageIn100mV * 5, 0 );
+	}
 
-	*(USBPD_MessageHeader_t *)&s_buffer[0] = ( USBPD_MessageHeader_t ){
-		.MessageID = s_instance.messageID,
-		.MessageType = eUSBPD_DATA_MSG_REQUEST,
-		.NumberOfDataObjects = 1u,
-		.SpecificationRevision = s_instance.pdVersion,
+	s_instance.want = ( USBPD_Contract_t ){
+		.index = index,
 	};
-	USBPD_RequestDataObject_t *const rdo = (USBPD_RequestDataObject_t *)&s_buffer[sizeof( USBPD_MessageHeader_t )];
+	s_instance.wantPending = true;
 
-	if ( USBPD_IsPPS( pdo ) )
-	{
-		// Clamp voltage to min/max NOTE: Maybe we should return an error if the voltage is out of range?
-		const uint32_t minVoltage = pdo->SPR_PPS.MinVoltageIn100mV;
-		const uint32_t maxVoltage = pdo->SPR_PPS.MaxVoltageIn100mV;
-		voltageIn100mV = voltageIn100mV > maxVoltage ? maxVoltage : voltageIn100mV;
-		voltageIn100mV = voltageIn100mV < minVoltage ? minVoltage : voltageIn100mV;
+	return eUSBPD_OK;
+}
 
-		*rdo = ( USBPD_RequestDataObject_t ){
-			.PPS =
-				{
-					.ObjectPosition = index + 1,
-					.OutputVoltageIn20mV = voltageIn100mV * 5,
-					.OperatingCurrentIn50mA = pdo->SPR_PPS.MaxCurrentIn50mA,
-					.NoUSBSuspended = 1u,
-					.USBComsCapable = 1u, // TODO: Should have these are arguments or define
-				},
-		};
-	}
-	else
+USBPD_Result_e USBPD_SelectPPS( uint8_t index, uint32_t voltageIn20mV, uint32_t currentIn50mA )
+{
+	if ( index >= s_instance.pdoCount || !USBPD_IsPPS( &s_instance.caps.Source[index] ) )
 	{
-		*rdo = ( USBPD_RequestDataObject_t ){
-			.FixedAndVariable =
-				{
-					.ObjectPosition = index + 1,
-					.MaxCurrentIn10mA = pdo->FixedSupply.MaxCurrentIn10mA,
-					.OperatingCurrentIn10mA = pdo->FixedSupply.MaxCurrentIn10mA,
-					.USBComsCapable = 1u,
-					.NoUSBSuspended = 1u,
-				},
-		};
+		return eUSBPD_ERROR_ARGS;
 	}
 
-	SendMessage( 6 );
+	ClampPPS( &s_instance.caps.Source[index], &voltageIn20mV, &currentIn50mA );
+
+	s_instance.want = ( USBPD_Contract_t ){
+		.index = index,
+		.pps = true,
+		.millivolts = voltageIn20mV * 20,
+		.milliamps = currentIn50mA * 50,
+	};
+	s_instance.wantPending = true;
 
 	return eUSBPD_OK;
 }
 
+bool USBPD_GetContract( USBPD_Contract_t *contract )
+{
+	if ( contract && s_instance.hasContract )
+	{
+		*contract = s_instance.contract;
+	}
+
+	return s_instance.hasContract;
+}
+
 /**
  * @brief  Get the capabilities of the USB PD Source
  * @param[out] capabilities: pointer to the capabilities message structure
@@ -827,110 +1049,696 @@ static USBPD_CC_e GetActiveCCLine( void )
  */
 static void SwitchRXMode( void )
 {
+	USBPD->DMA = (uint32_t)s_rxBuffer;
 	USBPD->BMC_CLK_CNT = UPD_TMR_RX;
 	USBPD->CONTROL = ( USBPD->CONTROL & ~PD_TX_EN ) | BMC_START;
 }
 
 /**
  * @brief  Begin transmission of PD message
- * @param  size: size of the message in bytes
+ * @param  buffer: the message, stays in use until IF_TX_END
+ * @param  size: size of the message in bytes, the CRC is added by the PHY
+ * @param  sop: UPD_SOP0, or UPD_HARD_RESET with a size of 0
  * @return None
  */
-static void SendMessage( uint8_t size )
+static void SendMessage( uint8_t *buffer, uint8_t size, uint8_t sop )
 {
+	USBPD->DMA = (uint32_t)buffer;
 	USBPD->BMC_CLK_CNT = UPD_TMR_TX;
-	USBPD->TX_SEL = UPD_SOP0;
+	USBPD->TX_SEL = sop;
 	USBPD->BMC_TX_SZ = size;
 	USBPD->STATUS = 0;
 	USBPD->CONTROL |= BMC_START | PD_TX_EN;
 }
 
 /**
- * @brief  Parse the received packet
+ * @brief  Check if a timer has run out, wrap safe
+ * @param  since: SysTick count it was started at
+ * @param  ms: its length in ms
+ * @return true if it has run out
+ */
+static bool Expired( uint32_t since, uint32_t ms )
+{
+	return ( s_instance.now - since ) >= ms * USBPD_TICKS_PER_MS;
+}
+
+/**
+ * @brief  Start the policy engine timer of the current state
+ * @param  ms: time out in ms
+ * @return None
+ */
+static void StartTimer( uint32_t ms )
+{
+	s_instance.timerTick = s_instance.now;
+	s_instance.timerMs = ms;
+}
+
+/**
+ * @brief  Go back to idle when Rp has been gone from the CC line for tPDDebounce
+ * @param  None
+ * @return true on detach
+ */
+static bool CheckDetach( void )
+{
+	const uint16_t cc = ( s_instance.lastCCLine == eUSBPD_CC2 ) ? USBPD->PORT_CC2 : USBPD->PORT_CC1;
+	if ( cc & PA_CC_AI )
+	{
+		s_instance.ccLost = false;
+		return false;
+	}
+
+	if ( !s_instance.ccLost )
+	{
+		s_instance.ccLost = true;
+		s_instance.detachTick = s_instance.now;
+		return false;
+	}
+
+	if ( !Expired( s_instance.detachTick, eUSBPD_T_PD_DEBOUNCE_MS ) )
+	{
+		return false;
+	}
+
+	USBPD_Reset();
+	return true;
+}
+
+/**
+ * @brief  Reset MessageIDs and drop whatever is queued, for Soft and Hard Reset
  * @param  None
  * @return None
  */
-static void ParsePacket( void )
+static void ResetProtocol( void )
 {
-	bool sendGoodCRC = true;
-	USBPD_MessageHeader_t message = *(USBPD_MessageHeader_t *)s_buffer;
+	__disable_irq();
+	s_instance.messageID = 0;
+	s_instance.lastRxID = 0xff;
+	s_instance.rxTail = s_instance.rxHead;
+	s_instance.tx = eTX_IDLE;
+	__enable_irq();
+}
 
-	USBPD_State_e nextState = s_instance.state;
+/**
+ * @brief  Queue a message for transmission, there can only be one in flight
+ * @param  type: USBPD_ControlMessage_e or USBPD_DataMessage_e
+ * @param  count: number of data objects
+ * @param  data: the data objects
+ * @return None
+ */
+static void Transmit( uint8_t type, uint8_t count, const void *data )
+{
+	*(USBPD_MessageHeader_t *)&s_txBuffer[0] = ( USBPD_MessageHeader_t ){
+		.MessageID = s_instance.messageID,
+		.MessageType = type,
+		.NumberOfDataObjects = count,
+		.SpecificationRevision = s_instance.pdVersion,
+	};
+	memcpy( &s_txBuffer[sizeof( USBPD_MessageHeader_t )], data, count * sizeof( uint32_t ) );
+
+	s_instance.txSize = sizeof( USBPD_MessageHeader_t ) + count * sizeof( uint32_t );
+	s_instance.txRetries = 0;
+	s_instance.tx = eTX_QUEUED;
+	StartTransmission();
+}
 
-	if ( message.NumberOfDataObjects == 0u )
+/**
+ * @brief  Start the queued message if the PHY isn't busy with a GoodCRC and the line is idle.
+ *         The PHY doesn't listen before it talks, IF_RX_BIT since the last packet means the
+ *         source is sending (or was, into a collision), so the message waits for the next call.
+ * @param  None
+ * @return None
+ */
+static void StartTransmission( void )
+{
+	__disable_irq();
+	if ( s_instance.tx == eTX_QUEUED && s_instance.phy == ePHY_RX )
 	{
-		switch ( (USBPD_ControlMessage_e)message.MessageType )
+		if ( USBPD->STATUS & IF_RX_BIT )
 		{
-			case eUSBPD_CTRL_MSG_GOODCRC:
-				sendGoodCRC = false;
-				s_instance.messageID++;
+			USBPD->STATUS = IF_RX_BIT;
+		}
+		else
+		{
+			s_instance.phy = ePHY_TX_MESSAGE;
+			s_instance.tx = eTX_SENDING;
+			SendMessage( s_txBuffer, s_instance.txSize, UPD_SOP0 );
+		}
+	}
+	__enable_irq();
+}
+
+/**
+ * @brief  Start, retry and finish transmissions
+ * @param  None
+ * @return None
+ */
+static void ServiceTransmission( void )
+{
+	__disable_irq();
+	if ( s_instance.tx == eTX_WAIT_GOODCRC && Expired( s_instance.txTick, eUSBPD_T_RECEIVE_MS ) )
+	{
+		if ( s_instance.txRetries < eUSBPD_N_RETRY_COUNT )
+		{
+			s_instance.txRetries++;
+			s_instance.tx = eTX_QUEUED;
+		}
+		else
+		{
+			s_instance.messageID = ( s_instance.messageID + 1 ) & 7;
+			s_instance.tx = eTX_FAILED;
+		}
+	}
+	__enable_irq();
+
+	switch ( s_instance.tx )
+	{
+		case eTX_QUEUED: StartTransmission(); break;
+
+		case eTX_DONE:
+		case eTX_DISCARDED:
+			s_instance.tx = eTX_IDLE;
+			// Wait for the answer, a discarded Request may well have made it
+			if ( s_instance.state == eSTATE_WAIT_ACCEPT || s_instance.state == eSTATE_SOFT_RESET )
+			{
+				StartTimer( eUSBPD_T_SENDER_RESPONSE_MS );
+			}
+			break;
+
+		case eTX_FAILED:
+			s_instance.tx = eTX_IDLE;
+			if ( s_instance.state == eSTATE_SOFT_RESET )
+			{
+				HardReset();
+			}
+			else
+			{
+				SoftReset();
+			}
+			break;
+
+		default: break;
+	}
+}
+
+/**
+ * @brief  Run the policy engine on a received message
+ * @param  message: the message
+ * @return None
+ */
+static void HandleMessage( const USBPD_Message_t *message )
+{
+	const USBPD_MessageHeader_t header = message->header;
+
+	if ( header.Extended )
+	{
+		Unsupported();
+	}
+	else if ( header.NumberOfDataObjects == 0u )
+	{
+		switch ( (USBPD_ControlMessage_e)header.MessageType )
+		{
+			case eUSBPD_CTRL_MSG_ACCEPT:
+				if ( s_instance.state == eSTATE_WAIT_ACCEPT )
+				{
+					s_instance.state = eSTATE_WAIT_PS_RDY;
+					StartTimer( eUSBPD_T_PS_TRANSITION_MS );
+				}
+				else if ( s_instance.state == eSTATE_SOFT_RESET )
+				{
+					WaitForCapabilities( eUSBPD_T_SINK_WAIT_CAP_MS );
+				}
+				else
+				{
+					Unexpected();
+				}
 				break;
 
-			case eUSBPD_CTRL_MSG_ACCEPT: nextState = eSTATE_WAIT_PS_RDY; break;
+			case eUSBPD_CTRL_MSG_REJECT:
+			case eUSBPD_CTRL_MSG_WAIT:
+				if ( s_instance.state != eSTATE_WAIT_ACCEPT )
+				{
+					Unexpected();
+				}
+				else if ( !s_instance.hasContract )
+				{
+					WaitForCapabilities( eUSBPD_T_SINK_WAIT_CAP_MS );
+				}
+				else
+				{
+					// The old contract stays, ask again after tSinkRequest if told to wait
+					EnterReady();
+					if ( header.MessageType == eUSBPD_CTRL_MSG_WAIT )
+					{
+						if ( !s_instance.wantPending )
+						{
+							s_instance.want = s_instance.requested;
+							s_instance.wantPending = true;
+						}
+						StartTimer( eUSBPD_T_SINK_REQUEST_MS );
+					}
+				}
+				break;
 
-			case eUSBPD_CTRL_MSG_REJECT: nextState = eSTATE_SOURCE_CAP; break;
+			case eUSBPD_CTRL_MSG_PS_RDY:
+				if ( s_instance.state != eSTATE_WAIT_PS_RDY )
+				{
+					Unexpected();
+					break;
+				}
+				s_instance.contract = s_instance.requested;
+				s_instance.hasContract = true;
+				s_instance.hardResetCount = 0;
+				EnterReady();
+				break;
+
+			case eUSBPD_CTRL_MSG_SOFT_RESET:
+				ResetProtocol();
+				Transmit( eUSBPD_CTRL_MSG_ACCEPT, 0, NULL );
+				WaitForCapabilities( eUSBPD_T_SINK_WAIT_CAP_MS );
+				break;
 
-			case eUSBPD_CTRL_MSG_PS_RDY: nextState = eSTATE_PS_RDY; break;
+			case eUSBPD_CTRL_MSG_GET_SINK_CAP: SendSinkCapabilities(); break;
 
-			default: break;
+			case eUSBPD_CTRL_MSG_GOODCRC:
+			case eUSBPD_CTRL_MSG_PING: break;
+
+			default: Unsupported(); break;
 		}
 	}
 	else
 	{
-		switch ( (USBPD_DataMessage_e)message.MessageType )
+		switch ( (USBPD_DataMessage_e)header.MessageType )
 		{
+			case eUSBPD_DATA_MSG_SOURCE_CAP: HandleCapabilities( message ); break;
+
+			case eUSBPD_DATA_MSG_ALERT: break;
 
-			case eUSBPD_DATA_MSG_SOURCE_CAP:
-				nextState = eSTATE_SOURCE_CAP;
-				s_instance.pdoCount = message.NumberOfDataObjects;
-				s_instance.pdVersion = message.SpecificationRevision;
-				memcpy( &s_instance.caps, &s_buffer[2], sizeof( USBPD_SPR_CapabilitiesMessage_t ) );
+			case eUSBPD_DATA_MSG_VENDOR_DEFINED:
+				if ( s_instance.pdVersion >= eUSBPD_REV_30 )
+				{
+					Unsupported();
+				}
 				break;
 
-			default: break;
+			default: Unsupported(); break;
 		}
 	}
+}
 
-	if ( message.Extended || sendGoodCRC )
+/**
+ * @brief  Take new Source_Capabilities and request from them what the application asked for
+ *         last, if it's still there, else vSafe5V
+ * @param  message: the Source_Capabilities message
+ * @return None
+ */
+static void HandleCapabilities( const USBPD_Message_t *message )
+{
+	const USBPD_MessageHeader_t header = message->header;
+
+	s_instance.pdoCount = header.NumberOfDataObjects;
+	s_instance.pdVersion = ( header.SpecificationRevision > eUSBPD_REV_30 ) ? eUSBPD_REV_30 : header.SpecificationRevision;
+	memset( &s_instance.caps, 0, sizeof( USBPD_SPR_CapabilitiesMessage_t ) );
+	memcpy( &s_instance.caps, message->data, header.NumberOfDataObjects * sizeof( uint32_t ) );
+	s_instance.state = eSTATE_SOURCE_CAP;
+
+	USBPD_Contract_t request = s_instance.want;
+	if ( !FitRequest( &request ) )
+	{
+		request = ( USBPD_Contract_t ){ 0 };
+		FitRequest( &request );
+	}
+	SendRequest( &request );
+}
+
+/**
+ * @brief  Fit a request to the source capabilities
+ * @param[in,out] request: PDO index and, for PPS, voltage and current, the rest is filled in
+ * @return false if the PDO is gone or isn't of the same kind anymore
+ */
+static bool FitRequest( USBPD_Contract_t *request )
+{
+	if ( request->index >= s_instance.pdoCount )
+	{
+		return false;
+	}
+
+	const USBPD_SourcePDO_t *const pdo = &s_instance.caps.Source[request->index];
+	if ( request->pps != USBPD_IsPPS( pdo ) )
 	{
-		Delay_Us( 30 );
-		USBPD_ControlMessage_t reply = ( USBPD_ControlMessage_t ){
-			.MessageID = message.MessageID,
-			.MessageType = eUSBPD_CTRL_MSG_GOODCRC,
-			.SpecificationRevision = s_instance.pdVersion,
+		return false;
+	}
+
+	if ( request->pps )
+	{
+		uint32_t voltageIn20mV = request->millivolts / 20;
+		uint32_t currentIn50mA = request->milliamps / 50;
+		ClampPPS( pdo, &voltageIn20mV, &currentIn50mA );
+		request->millivolts = voltageIn20mV * 20;
+		request->milliamps = currentIn50mA * 50;
+	}
+	else if ( pdo->Header.PDOType == eUSBPD_PDO_FIXED )
+	{
+		request->millivolts = pdo->FixedSupply.VoltageIn50mV * 50;
+		request->milliamps = pdo->FixedSupply.MaxCurrentIn10mA * 10;
+	}
+	else
+	{
+		request->millivolts = pdo->VariableSupply.MinVoltageIn50mV * 50;
+		request->milliamps = pdo->VariableSupply.MaxCurrentIn10mA * 10;
+	}
+
+	return true;
+}
+
+/**
+ * @brief  Clamp a PPS voltage and current to what the APDO allows
+ * @param  pdo: the PPS APDO
+ * @param[in,out] voltageIn20mV: voltage
+ * @param[in,out] currentIn50mA: current, 0 for the maximum
+ * @return None
+ */
+static void ClampPPS( const USBPD_SourcePDO_t *pdo, uint32_t *voltageIn20mV, uint32_t *currentIn50mA )
+{
+	const uint32_t minVoltage = pdo->SPR_PPS.MinVoltageIn100mV * 5;
+	const uint32_t maxVoltage = pdo->SPR_PPS.MaxVoltageIn100mV * 5;
+	const uint32_t maxCurrent = pdo->SPR_PPS.MaxCurrentIn50mA;
+
+	*voltageIn20mV = *voltageIn20mV > maxVoltage ? maxVoltage : *voltageIn20mV;
+	*voltageIn20mV = *voltageIn20mV < minVoltage ? minVoltage : *voltageIn20mV;
+	*currentIn50mA = ( *currentIn50mA == 0 || *currentIn50mA > maxCurrent ) ? maxCurrent : *currentIn50mA;
+}
+
+/**
+ * @brief  Send a Request, the timer for the answer starts on its GoodCRC
+ * @param  request: a request that fits the capabilities
+ * @return None
+ */
+static void SendRequest( const USBPD_Contract_t *request )
+{
+	const USBPD_SourcePDO_t *const pdo = &s_instance.caps.Source[request->index];
+	USBPD_RequestDataObject_t rdo;
+
+	if ( request->pps )
+	{
+		rdo = ( USBPD_RequestDataObject_t ){
+			.PPS =
+				{
+					.ObjectPosition = request->index + 1,
+					.OutputVoltageIn20mV = request->millivolts / 20,
+					.OperatingCurrentIn50mA = request->milliamps / 50,
+					.NoUSBSuspended = 1u,
+					.USBComsCapable = 1u, // TODO: Should have these are arguments or define
+				},
+		};
+	}
+	else
+	{
+		rdo = ( USBPD_RequestDataObject_t ){
+			.FixedAndVariable =
+				{
+					.ObjectPosition = request->index + 1,
+					.MaxCurrentIn10mA = pdo->FixedSupply.MaxCurrentIn10mA,
+					.OperatingCurrentIn10mA = pdo->FixedSupply.MaxCurrentIn10mA,
+					.USBComsCapable = 1u,
+					.NoUSBSuspended = 1u,
+				},
 		};
-		*(uint16_t *)&s_buffer[0] = reply.data;
-		SendMessage( sizeof( reply ) );
 	}
 
-	s_instance.state = nextState;
+	s_instance.requested = *request;
+	s_instance.wantPending = false;
+	s_instance.state = eSTATE_WAIT_ACCEPT;
+	s_instance.timerMs = 0;
+	Transmit( eUSBPD_DATA_MSG_REQUEST, 1, &rdo );
+}
+
+/**
+ * @brief  Answer Get_Sink_Cap, vSafe5V is all a sink has to list
+ * @param  None
+ * @return None
+ */
+static void SendSinkCapabilities( void )
+{
+	const USBPD_SinkPDO_t pdo = {
+		.FixedSupply =
+			{
+				.CurrentIn10mA = USBPD_SINK_CURRENT_IN_10MA,
+				.VoltageIn50mV = 100,
+				.USBComsCapable = 1u,
+				.HigherCapability = 1u,
+				.PDOType = eUSBPD_PDO_FIXED,
+			},
+	};
+	Transmit( eUSBPD_DATA_MSG_SINK_CAP, 1, &pdo );
+}
+
+/**
+ * @brief  Wait for Source_Capabilities, Hard Reset if they don't come
+ * @param  ms: how long to wait
+ * @return None
+ */
+static void WaitForCapabilities( uint32_t ms )
+{
+	s_instance.state = eSTATE_CABLE_DETECT;
+	StartTimer( ms );
+}
+
+/**
+ * @brief  Enter the ready state with the contract in place
+ * @param  None
+ * @return None
+ */
+static void EnterReady( void )
+{
+	s_instance.state = eSTATE_PS_RDY;
+	s_instance.timerMs = 0;
+	s_instance.ppsTick = s_instance.now;
+}
+
+/**
+ * @brief  A message that makes no sense in this state: Soft Reset, or Hard Reset while the
+ *         power supply is changing
+ * @param  None
+ * @return None
+ */
+static void Unexpected( void )
+{
+	switch ( s_instance.state )
+	{
+		case eSTATE_WAIT_PS_RDY: HardReset(); break;
+		case eSTATE_HARD_RESET:
+		case eSTATE_ERROR: break;
+		default: SoftReset(); break;
+	}
+}
+
+/**
+ * @brief  A message we don't support: Not_Supported (Reject before PD 3.0) when ready,
+ *         else the same as an unexpected one
+ * @param  None
+ * @return None
+ */
+static void Unsupported( void )
+{
+	if ( s_instance.state != eSTATE_PS_RDY )
+	{
+		Unexpected();
+	}
+	else if ( s_instance.pdVersion >= eUSBPD_REV_30 )
+	{
+		Transmit( eUSBPD_CTRL_MSG_NOT_SUPPORTED, 0, NULL );
+	}
+	else
+	{
+		Transmit( eUSBPD_CTRL_MSG_REJECT, 0, NULL );
+	}
+}
+
+/**
+ * @brief  Send Soft_Reset and wait for the Accept, then Source_Capabilities
+ * @param  None
+ * @return None
+ */
+static void SoftReset( void )
+{
+	ResetProtocol();
+	s_instance.state = eSTATE_SOFT_RESET;
+	s_instance.timerMs = 0;
+	Transmit( eUSBPD_CTRL_MSG_SOFT_RESET, 0, NULL );
+}
+
+/**
+ * @brief  Send Hard Reset signalling, give up after nHardResetCount of them
+ * @param  None
+ * @return None
+ */
+static void HardReset( void )
+{
+	if ( s_instance.hardResetCount > eUSBPD_N_HARD_RESET_COUNT )
+	{
+		s_instance.state = eSTATE_ERROR;
+		s_instance.timerMs = 0;
+		return;
+	}
+
+	s_instance.hardResetCount++;
+	ResetProtocol();
+	s_instance.hasContract = false;
+	s_instance.hardResetSent = false;
+	s_instance.state = eSTATE_HARD_RESET;
+	StartTimer( eUSBPD_T_SENDER_RESPONSE_MS );
+
+	__disable_irq();
+	if ( s_instance.phy == ePHY_RX )
+	{
+		s_instance.phy = ePHY_TX_HARD_RESET;
+		SendMessage( s_txBuffer, 0, UPD_HARD_RESET );
+	}
+	else
+	{
+		// Not over a GoodCRC or message on the wire, TransmitDone() sends it
+		s_instance.hardResetPending = true;
+	}
+	__enable_irq();
+}
+
+/**
+ * @brief  Answer a received message with GoodCRC
+ * @param  messageID: its MessageID
+ * @return None
+ */
+static void SendGoodCRC( uint8_t messageID )
+{
+	*(USBPD_ControlMessage_t *)&s_goodCRCBuffer[0] = ( USBPD_ControlMessage_t ){
+		.MessageID = messageID,
+		.MessageType = eUSBPD_CTRL_MSG_GOODCRC,
+		.SpecificationRevision = s_instance.pdVersion,
+	};
+	Delay_Us( 30 );
+	s_instance.phy = ePHY_TX_GOODCRC;
+	SendMessage( s_goodCRCBuffer, sizeof( USBPD_ControlMessage_t ), UPD_SOP0 );
+}
+
+/**
+ * @brief  Protocol layer for a received packet: GoodCRC matched to the message in flight,
+ *         everything else answered with GoodCRC, retries dropped, and the rest queued
+ * @param  count: number of bytes received, with the CRC
+ * @return None
+ */
+static void ReceivePacket( uint16_t count )
+{
+	const USBPD_MessageHeader_t header = *(USBPD_MessageHeader_t *)s_rxBuffer;
+	const uint8_t size = sizeof( USBPD_MessageHeader_t ) + header.NumberOfDataObjects * sizeof( uint32_t );
+
+	if ( count < size + sizeof( uint32_t ) )
+	{
+		return;
+	}
+
+	if ( header.NumberOfDataObjects == 0u && header.MessageType == eUSBPD_CTRL_MSG_GOODCRC )
+	{
+		if ( ( s_instance.tx == eTX_WAIT_GOODCRC || s_instance.tx == eTX_SENDING ) &&
+			 header.MessageID == s_instance.messageID )
+		{
+			s_instance.messageID = ( s_instance.messageID + 1 ) & 7;
+			s_instance.tx = eTX_DONE;
+		}
+		return;
+	}
+
+	// Soft_Reset restarts the MessageIDs
+	if ( header.NumberOfDataObjects == 0u && header.MessageType == eUSBPD_CTRL_MSG_SOFT_RESET )
+	{
+		s_instance.lastRxID = 0xff;
+	}
+	const bool isNew = ( header.MessageID != s_instance.lastRxID );
+	s_instance.lastRxID = header.MessageID;
+
+	if ( isNew )
+	{
+		// A message coming in discards the one we were about to send
+		if ( s_instance.tx == eTX_QUEUED || s_instance.tx == eTX_WAIT_GOODCRC )
+		{
+			s_instance.messageID = ( s_instance.messageID + 1 ) & 7;
+			s_instance.tx = eTX_DISCARDED;
+		}
+
+		if ( (uint8_t)( s_instance.rxHead - s_instance.rxTail ) < USBPD_RX_QUEUE_LEN )
+		{
+			USBPD_Message_t *const message = &s_rxQueue[s_instance.rxHead & ( USBPD_RX_QUEUE_LEN - 1 )];
+			message->header = header;
+			memcpy( message->data, &s_rxBuffer[sizeof( USBPD_MessageHeader_t )], size - sizeof( USBPD_MessageHeader_t ) );
+			s_instance.rxHead++;
+		}
+	}
+
+	SendGoodCRC( header.MessageID );
+}
+
+/**
+ * @brief  Back to RX after a transmission, and start tReceive if it was a message of ours,
+ *         or send the Hard Reset that was waiting for it
+ * @param  None
+ * @return None
+ */
+static void TransmitDone( void )
+{
+	switch ( s_instance.phy )
+	{
+		case ePHY_TX_MESSAGE:
+			if ( s_instance.tx == eTX_SENDING )
+			{
+				s_instance.txTick = USBPD_GET_TICKS();
+				s_instance.tx = eTX_WAIT_GOODCRC;
+			}
+			break;
+
+		case ePHY_TX_HARD_RESET: s_instance.hardResetSent = true; break;
+
+		default: break;
+	}
+
+	if ( s_instance.hardResetPending )
+	{
+		s_instance.hardResetPending = false;
+		s_instance.phy = ePHY_TX_HARD_RESET;
+		SendMessage( s_txBuffer, 0, UPD_HARD_RESET );
+		return;
+	}
+
+	s_instance.phy = ePHY_RX;
+	SwitchRXMode();
 }
 
 void USBPD_IRQHandler( void ) __attribute__( ( interrupt ) );
 void USBPD_IRQHandler( void )
 {
+	const uint8_t status = USBPD->STATUS;
+
+	// Transmit complete interrupt, first as anything received came after it
+	if ( status & IF_TX_END )
+	{
+		USBPD->STATUS = IF_TX_END;
+		TransmitDone();
+	}
+
 	// Receive complete interrupt
-	if ( USBPD->STATUS & IF_RX_ACT )
+	if ( status & IF_RX_ACT )
 	{
+		// The bits were this packet's, the line is idle again
+		USBPD->STATUS = IF_RX_ACT | IF_RX_BIT | IF_RX_BYTE;
 		// Check if we received a SOP0 packet
-		if ( ( ( USBPD->STATUS & BMC_AUX_MASK ) == BMC_AUX_SOP0 ) && ( USBPD->BMC_BYTE_CNT >= 6 ) )
+		if ( ( status & BMC_AUX_MASK ) == BMC_AUX_SOP0 )
 		{
-			ParsePacket();
+			ReceivePacket( USBPD->BMC_BYTE_CNT );
 		}
-		USBPD->STATUS |= IF_RX_ACT;
-	}
-
-	// Transmit complete interrupt (GoodCRC only)
-	if ( USBPD->STATUS & IF_TX_END )
-	{
-		SwitchRXMode();
-		USBPD->STATUS |= IF_TX_END;
 	}
 
-	// Reset interrupt
-	if ( USBPD->STATUS & IF_RX_RESET )
+	// Reset interrupt, the policy engine starts over
+	if ( status & IF_RX_RESET )
 	{
-		USBPD->STATUS |= IF_RX_RESET;
+		USBPD->STATUS = IF_RX_RESET;
+		s_instance.hardResetReceived = true;
 	}
 }
 
@@ -19,6 +19,7 @@ static uint32_t count = 0;
 static uint32_t countLast = 0;
 
 static void SysTick_Init( void );
+static USBPD_Result_e WaitMs( uint32_t ms );
 
 /**
  * @brief  Debugger input handler
@@ -36,7 +37,8 @@ void handle_debug_input( int numbytes, uint8_t *data )
  * @brief  Get the next character from the debugger
  * @param  None
  * @return the next character or -1 if no character is available
- * @note   This function will block for up to 100ms waiting for a character
+ * @note   This function will block for up to 100ms waiting for a character, the USB PD
+ *         policy engine keeps running meanwhile
  */
 int getchar( void )
 {
@@ -46,6 +48,7 @@ int getchar( void )
 	{
 		poll_input();
 		putchar( 0 );
+		USBPD_SinkNegotiate();
 	}
 
 	if ( count == countLast )
@@ -167,6 +170,7 @@ loop_start:
 		if ( cycleSupplies )
 		{
 			LOG( "Cycling though PDO" );
+			USBPD_Contract_t contract;
 			for ( size_t i = 0; i < count; i++ )
 			{
 				const USBPD_SourcePDO_t *pdo = &capabilities->Source[i];
@@ -176,21 +180,30 @@ loop_start:
 					for ( uint32_t voltage = pdo->SPR_PPS.MinVoltageIn100mV; voltage <= pdo->SPR_PPS.MaxVoltageIn100mV;
 						  voltage += 10 )
 					{
-						LOG( "Setting PPS voltage to %d mV", (int)voltage * 10 );
-						USBPD_SelectPDO( i, voltage );
-						Delay_Ms( 1000 );
+						LOG( "Setting PPS voltage to %d mV", (int)voltage * 100 );
+						USBPD_SelectPPS( i, voltage * 5, 0 );
+						WaitMs( 1000 );
 					}
 				}
 				else
 				{
 					USBPD_SelectPDO( i, 0 );
 				}
-				Delay_Ms( 1000 );
+				result = WaitMs( 1000 );
+				if ( USBPD_GetContract( &contract ) )
+				{
+					LOG( "Contract: PDO %d, %d mV, %d mA", contract.index, contract.millivolts, contract.milliamps );
+				}
+				else
+				{
+					LOG( "No contract: %s, state: %s", USBPD_ResultToStr( result ), USBPD_StateToStr( USBPD_GetState() ) );
+				}
 			}
 		}
 	}
 
-	Delay_Ms( 3000 );
+	// The policy engine has to keep running, for GoodCRC retries, the source's messages and PPS
+	WaitMs( 3000 );
 
 	goto loop_start;
 }
@@ -222,6 +235,22 @@ static void SysTick_Init( void )
 	SysTick->CTLR = SYSTICK_CTLR_STE | SYSTICK_CTLR_STIE | SYSTICK_CTLR_STCLK;
 }
 
+/**
+ * @brief  Wait while keeping the USB PD policy engine running
+ * @param  ms - the time to wait
+ * @return the last result of USBPD_SinkNegotiate()
+ */
+static USBPD_Result_e WaitMs( uint32_t ms )
+{
+	const uint32_t start = s_systickCount;
+	USBPD_Result_e result;
+	do
+	{
+		result = USBPD_SinkNegotiate();
+	} while ( ( s_systickCount - start ) < ms );
+	return result;
+}
+
 /**
  * @brief  SysTick interrupt handler
  * @param  None
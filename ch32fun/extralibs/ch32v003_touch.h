@@ -196,6 +196,257 @@ uint32_t ReadTouchPinSafe( GPIO_TypeDef * io, int portpin, int adcno, int iterat
 }
 
 
+
+#ifdef TOUCH_SCAN
+
+/** Background scanning engine.
+
+	ReadTouchPin() keeps the CPU busy for every sample. With TOUCH_SCAN
+	defined before including this file, all pads are scanned in the
+	background instead: a timer interrupt floats the pads and starts one
+	regular ADC sequence, DMA collects the results and its interrupt runs
+	the filter from lib_touch_filter.h. Presses and releases come out as
+	events.
+
+	This uses a different measurement than ReadTouchPin(), because all pads
+	have to be released at once. Each pad is precharged high, then floated as
+	an analog input. The sequence alternates the reference channel
+	(Vrefint) and a pad, so the ADC sample cap is left near 1.2V before it
+	shares charge with the floating pad. More pad capacitance pulls the
+	result closer to VDD, so a bigger number means a harder press, the same
+	as TOUCH_SLOPE 1. With 16 slots in the sequence, that's at most 8 pads.
+
+	#define TOUCH_SCAN
+	#include "ch32v003_touch.h"
+
+	static const TouchPad pads[] = {
+		{ GPIOA, 2, 0, 40 },  // port, pin, adc channel, press threshold
+		{ GPIOC, 4, 2, 40 },
+		{ GPIOD, 2, 3, 40 },
+	};
+
+	RCC->APB2PCENR |= RCC_APB2Periph_GPIOA | RCC_APB2Periph_GPIOC | RCC_APB2Periph_GPIOD;
+	TouchScanInit( pads, 3, 100 ); // 100 frames / s
+
+	TouchEvent e;
+	while( TouchScanGetEvent( &e ) )
+		printf( "%d %s\n", e.channel, e.type == TOUCH_EV_PRESS ? "down" : "up" );
+
+	Uses TIM2, DMA1 channel 1 and the ADC. Define TOUCH_SCAN_CUSTOM_TIMER to
+	call TouchScanKick() from your own interrupt instead, at frame rate times
+	TOUCH_SCAN_PASSES. Other pins on the pad ports may be reconfigured from
+	main code, but not from interrupts, the scan does read-modify-write on
+	CFGLR.
+*/
+
+#include "lib_touch_filter.h"
+
+#ifndef TOUCH_SCAN_MAX_PADS
+#define TOUCH_SCAN_MAX_PADS 8
+#endif
+
+#ifndef TOUCH_SCAN_PASSES
+#define TOUCH_SCAN_PASSES 4         // sequences summed per frame
+#endif
+
+#ifndef TOUCH_SCAN_REF_CHANNEL
+#define TOUCH_SCAN_REF_CHANNEL 8    // Vrefint
+#endif
+
+#ifndef TOUCH_SCAN_SAMPLE_TIME
+#define TOUCH_SCAN_SAMPLE_TIME 2    // 15 cycles, the pad only has to share charge
+#endif
+
+#ifndef TOUCH_SCAN_REF_SAMPLE_TIME
+#define TOUCH_SCAN_REF_SAMPLE_TIME 5 // 57 cycles, Vrefint is high impedance
+#endif
+
+#if TOUCH_SCAN_MAX_PADS > 8
+#error "TOUCH_SCAN: the regular sequence only fits 8 pads"
+#endif
+
+typedef struct
+{
+	GPIO_TypeDef * io;
+	uint8_t portpin;
+	uint8_t adcno;
+	uint16_t threshold;
+} TouchPad;
+
+static const TouchPad * touch_scan_pads;
+static int touch_scan_count;
+static int touch_scan_pass;
+static volatile uint16_t touch_scan_buf[TOUCH_SCAN_MAX_PADS*2];
+static uint32_t touch_scan_sum[TOUCH_SCAN_MAX_PADS];
+static TouchChannel touch_scan_ch[TOUCH_SCAN_MAX_PADS];
+static TouchEventQueue touch_scan_events;
+
+// Pads can be spread over GPIOA, C and D, keep the CFGLR bits per port.
+static GPIO_TypeDef * touch_scan_io[3];
+static uint32_t touch_scan_cfgmask[3];
+static uint32_t touch_scan_cfgdrive[3];
+static int touch_scan_ports;
+
+static inline void TouchScanPrecharge( void )
+{
+	int i;
+	for( i = 0; i < touch_scan_ports; i++ )
+	{
+		GPIO_TypeDef * io = touch_scan_io[i];
+		io->CFGLR = ( io->CFGLR & ~touch_scan_cfgmask[i] ) | touch_scan_cfgdrive[i];
+	}
+}
+
+// Float every pad and start the sequence. Call at frame rate * TOUCH_SCAN_PASSES.
+static void TouchScanKick( void )
+{
+	int i;
+	for( i = 0; i < touch_scan_ports; i++ )
+		touch_scan_io[i]->CFGLR &= ~touch_scan_cfgmask[i]; // analog input
+	ADC1->CTLR2 = ADC_SWSTART | ADC_ADON | ADC_EXTSEL | ADC_DMA | ADC_TSVREFE;
+}
+
+void DMA1_Channel1_IRQHandler( void ) __attribute__((interrupt));
+void DMA1_Channel1_IRQHandler( void )
+{
+	int i;
+	DMA1->INTFCR = DMA1_IT_GL1;
+
+	// Charge the pads back up straight away so they're settled for next time.
+	TouchScanPrecharge();
+
+	for( i = 0; i < touch_scan_count; i++ )
+		touch_scan_sum[i] += touch_scan_buf[i*2+1];
+
+	if( ++touch_scan_pass < TOUCH_SCAN_PASSES ) return;
+	touch_scan_pass = 0;
+
+	for( i = 0; i < touch_scan_count; i++ )
+	{
+		int ev = TouchFilterUpdate( &touch_scan_ch[i], touch_scan_sum[i] );
+		if( ev ) TouchEventPush( &touch_scan_events, i, ev );
+		touch_scan_sum[i] = 0;
+	}
+}
+
+#ifndef TOUCH_SCAN_CUSTOM_TIMER
+void TIM2_IRQHandler( void ) __attribute__((interrupt));
+void TIM2_IRQHandler( void )
+{
+	TIM2->INTFR = ~TIM_UIF;
+	TouchScanKick();
+}
+#endif
+
+static void TouchScanInit( const TouchPad * pads, int count, int frame_hz )
+{
+	int i, j;
+	if( count > TOUCH_SCAN_MAX_PADS ) count = TOUCH_SCAN_MAX_PADS;
+	touch_scan_pads = pads;
+	touch_scan_count = count;
+	touch_scan_ports = 0;
+
+	RCC->APB2PCENR |= RCC_APB2Periph_ADC1;
+	RCC->AHBPCENR |= RCC_AHBPeriph_DMA1;
+
+	uint32_t rsqr[3] = { 0, 0, 0 };
+	uint32_t samptr = TOUCH_SCAN_REF_SAMPLE_TIME << ( 3 * TOUCH_SCAN_REF_CHANNEL );
+	for( i = 0; i < count; i++ )
+	{
+		const TouchPad * p = &pads[i];
+		GPIO_TypeDef * io = p->io;
+
+		for( j = 0; j < touch_scan_ports && touch_scan_io[j] != io; j++ );
+		if( j == touch_scan_ports )
+		{
+			touch_scan_io[j] = io;
+			touch_scan_cfgmask[j] = 0;
+			touch_scan_cfgdrive[j] = 0;
+			touch_scan_ports++;
+		}
+		touch_scan_cfgmask[j] |= 0xf << ( 4 * p->portpin );
+		touch_scan_cfgdrive[j] |= GPIO_CFGLR_OUT_2Mhz_PP << ( 4 * p->portpin );
+		io->BSHR = 1 << p->portpin;
+
+		// Slot 2i is the reference, slot 2i+1 the pad.
+		int slot = i * 2;
+		rsqr[slot / 6] |= TOUCH_SCAN_REF_CHANNEL << ( 5 * ( slot % 6 ) );
+		slot++;
+		rsqr[slot / 6] |= p->adcno << ( 5 * ( slot % 6 ) );
+		samptr |= TOUCH_SCAN_SAMPLE_TIME << ( 3 * p->adcno );
+
+		TouchFilterInit( &touch_scan_ch[i], p->threshold );
+		touch_scan_sum[i] = 0;
+	}
+	touch_scan_pass = 0;
+	TouchScanPrecharge();
+
+	// ADCCLK = 24 MHz
+	RCC->CFGR0 &= ~(0x1F<<11);
+
+	ADC1->RSQR1 = ( ( count * 2 - 1 ) << 20 ) | rsqr[2];
+	ADC1->RSQR2 = rsqr[1];
+	ADC1->RSQR3 = rsqr[0];
+	ADC1->SAMPTR2 = samptr;
+	ADC1->CTLR1 = ADC_SCAN;
+	ADC1->CTLR2 = ADC_ADON | ADC_EXTSEL | ADC_DMA | ADC_TSVREFE;
+
+	ADC1->CTLR2 |= ADC_RSTCAL;
+	while(ADC1->CTLR2 & ADC_RSTCAL);
+	ADC1->CTLR2 |= ADC_CAL;
+	while(ADC1->CTLR2 & ADC_CAL);
+
+	// Circular, the sequence length never changes so it stays aligned.
+	DMA1_Channel1->CFGR = 0;
+	DMA1_Channel1->PADDR = (uint32_t)&ADC1->RDATAR;
+	DMA1_Channel1->MADDR = (uint32_t)touch_scan_buf;
+	DMA1_Channel1->CNTR = count * 2;
+	DMA1_Channel1->CFGR =
+		DMA_Priority_VeryHigh |
+		DMA_MemoryDataSize_HalfWord |
+		DMA_PeripheralDataSize_HalfWord |
+		DMA_MemoryInc_Enable |
+		DMA_Mode_Circular |
+		DMA_DIR_PeripheralSRC |
+		DMA_CFGR1_TCIE |
+		DMA_CFGR1_EN;
+	NVIC_EnableIRQ( DMA1_Channel1_IRQn );
+
+#ifndef TOUCH_SCAN_CUSTOM_TIMER
+	// 1MHz tick, update interrupt once per pass.
+	RCC->APB1PCENR |= RCC_APB1Periph_TIM2;
+	RCC->APB1PRSTR |= RCC_APB1Periph_TIM2;
+	RCC->APB1PRSTR &= ~RCC_APB1Periph_TIM2;
+	TIM2->PSC = ( FUNCONF_SYSTEM_CORE_CLOCK / 1000000 ) - 1;
+	TIM2->ATRLR = 1000000 / ( frame_hz * TOUCH_SCAN_PASSES ) - 1;
+	TIM2->SWEVGR = TIM_UG;
+	TIM2->INTFR = ~TIM_UIF;
+	TIM2->DMAINTENR = TIM_UIE;
+	NVIC_EnableIRQ( TIM2_IRQn );
+	TIM2->CTLR1 = TIM_CEN;
+#else
+	(void)frame_hz;
+#endif
+}
+
+static int TouchScanGetEvent( TouchEvent * e )
+{
+	return TouchEventPop( &touch_scan_events, e );
+}
+
+static int TouchScanPressed( int pad )
+{
+	return touch_scan_ch[pad].pressed;
+}
+
+// Delta above baseline, for picking thresholds.
+static int TouchScanDelta( int pad )
+{
+	return TouchFilterDelta( &touch_scan_ch[pad] );
+}
+
+#endif
+
 #endif
 
 /*
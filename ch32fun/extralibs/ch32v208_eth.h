@@ -40,6 +40,11 @@
  *       eth_process_rx(); // IF using callback mode
  *   }
  *
+ *   eth_process_rx_budget(n) hands over at most n packets per call so a flood
+ *   can't starve the rest of the main loop. The RX interrupt itself stays on,
+ *   it has to move ERXST to a free buffer after every packet or the next one
+ *   lands on top of it.
+ *
  * RECEIVING PACKETS
  *
  * Callback mode:
@@ -57,6 +62,14 @@
  *       eth_release_rx_packet();  // must call when done
  *   }
  *
+ * Replying in place (the stack edits the RX buffer into its reply):
+ *
+ *   if (eth_send_rx_packet(reply_length) < 0)
+ *       eth_release_rx_packet();  // TX queue full, drop the reply
+ *
+ *   This sends straight out of the RX buffer and releases it, the buffer
+ *   goes back to the RX ring once the frame has left. No copy.
+ *
  * SENDING PACKETS
  *
  * Simple (with memcpy):
@@ -145,6 +158,8 @@ typedef struct
 	uint32_t tx_errors;
 	uint32_t rx_dropped;
 	uint32_t tx_dropped;
+	uint32_t rx_polls; // eth_process_rx_budget() calls that found packets
+	uint32_t rx_poll_full; // ... and had to leave some for the next call
 } eth_stats_t;
 #endif
 
@@ -183,12 +198,28 @@ extern "C"
 	 */
 	int eth_send_packet_zerocopy( uint16_t length );
 
+	/**
+	 * Send the currently held RX packet (from eth_get_rx_packet()) after
+	 * it was rewritten in place, and release it. The RX buffer only goes
+	 * back to DMA once transmission is done.
+	 * @param length Length of the frame now in the RX buffer
+	 * @return 0 on success, -1 if the TX queue is full (packet is still held)
+	 */
+	int eth_send_rx_packet( uint16_t length );
+
 	/**
 	 * Process received packets (call from main loop)
 	 * This will invoke the rx_callback for each received pkt
 	 */
 	void eth_process_rx( void );
 
+	/**
+	 * Process at most budget received packets (call from main loop)
+	 * @param budget Max packets to hand to rx_callback, 0 = no limit
+	 * @return Number of packets processed
+	 */
+	int eth_process_rx_budget( int budget );
+
 	/**
 	 * Get pointer to next received packet (alternative to eth_process_rx with callback)
 	 * @param length Pointer to store packet length
@@ -272,6 +303,7 @@ typedef struct
 	uint32_t rx_head_idx;
 	uint32_t rx_tail_idx;
 	tx_queue_t tx_q;
+	uint8_t tx_rx_hold[ETH_TX_BUF_COUNT]; // RX descriptor + 1 a TX slot is sending from, 0 = own buffer
 	uint8_t mac_addr[ETH_MAC_ADDR_LEN];
 	eth_rx_callback_t rx_callback;
 	eth_link_callback_t link_callback;
@@ -343,6 +375,20 @@ static inline void tx_queue_consume( tx_queue_t *q )
 	q->is_full = false; // after consuming, definitely not full
 }
 
+// Retire the TX slot at the tail, handing back any RX buffer it was sent from.
+static void tx_complete_tail( void )
+{
+	uint32_t idx = g_eth_state.tx_q.tail;
+	uint8_t hold = g_eth_state.tx_rx_hold[idx];
+	if ( hold )
+	{
+		g_eth_state.tx_rx_hold[idx] = 0;
+		g_dma_tx_descs[idx].Buffer1Addr = (uint32_t)&g_mac_tx_bufs[idx * ETH_TX_BUF_SIZE];
+		g_dma_rx_descs[hold - 1].Status = ETH_DMARxDesc_OWN;
+	}
+	tx_queue_consume( &g_eth_state.tx_q );
+}
+
 static void eth_get_chip_mac_addr( uint8_t *mac )
 {
 	const uint8_t *macaddr_src = (const uint8_t *)( ROM_CFG_USERADR_ID + 5 );
@@ -667,6 +713,39 @@ const uint8_t *eth_get_rx_packet( uint16_t *length )
 	return (const uint8_t *)g_dma_rx_descs[tail_idx].Buffer1Addr;
 }
 
+int eth_send_rx_packet( uint16_t length )
+{
+	if ( tx_queue_is_full( &g_eth_state.tx_q ) )
+	{
+#ifdef ETH_ENABLE_STATS
+		g_eth_state.stats.tx_dropped++;
+#endif
+		return -1;
+	}
+
+	uint32_t tail_idx = g_eth_state.rx_tail_idx;
+	uint32_t idx = g_eth_state.tx_q.head;
+
+	// point the TX slot at the RX buffer, the TX interrupt gives both back
+	g_eth_state.tx_rx_hold[idx] = tail_idx + 1;
+	g_dma_tx_descs[idx].Buffer1Addr = g_dma_rx_descs[tail_idx].Buffer1Addr;
+	g_dma_tx_descs[idx].Status = length;
+
+	// leave OWN clear so the RX interrupt won't reuse it yet
+	g_dma_rx_descs[tail_idx].Status = 0;
+	g_eth_state.rx_tail_idx = ( tail_idx + 1 ) % ETH_RX_BUF_COUNT;
+#ifdef ETH_ENABLE_STATS
+	g_eth_state.stats.rx_packets++;
+#endif
+
+	NVIC_DisableIRQ( ETH_IRQn );
+	tx_queue_produce( &g_eth_state.tx_q );
+	tx_start_if_possible();
+	NVIC_EnableIRQ( ETH_IRQn );
+
+	return 0;
+}
+
 void eth_release_rx_packet( void )
 {
 #ifdef ETH_ENABLE_STATS
@@ -683,13 +762,27 @@ void eth_release_rx_packet( void )
 
 
 void eth_process_rx( void )
+{
+	eth_process_rx_budget( 0 );
+}
+
+int eth_process_rx_budget( int budget )
 {
 	uint16_t length;
 	const uint8_t *packet;
+	int count = 0;
 
-	// process all packets that DMA has released
+	// process packets that DMA has released
 	while ( ( packet = eth_get_rx_packet( &length ) ) != NULL )
 	{
+		if ( budget && count == budget )
+		{
+#ifdef ETH_ENABLE_STATS
+			g_eth_state.stats.rx_poll_full++;
+#endif
+			break;
+		}
+
 		// deliver to user callback if registered
 		if ( g_eth_state.rx_callback )
 		{
@@ -697,7 +790,16 @@ void eth_process_rx( void )
 		}
 
 		eth_release_rx_packet();
+		count++;
 	}
+
+#ifdef ETH_ENABLE_STATS
+	if ( count )
+	{
+		g_eth_state.stats.rx_polls++;
+	}
+#endif
+	return count;
 }
 
 void eth_poll_link( void )
@@ -899,7 +1001,7 @@ void ETH_IRQHandler( void )
 #ifdef ETH_ENABLE_STATS
 			g_eth_state.stats.tx_packets++;
 #endif
-			tx_queue_consume( &g_eth_state.tx_q );
+			tx_complete_tail();
 		}
 
 		tx_start_if_possible();
@@ -920,7 +1022,7 @@ void ETH_IRQHandler( void )
 
 		if ( !tx_queue_is_empty( &g_eth_state.tx_q ) )
 		{
-			tx_queue_consume( &g_eth_state.tx_q );
+			tx_complete_tail();
 		}
 		tx_start_if_possible();
 	}
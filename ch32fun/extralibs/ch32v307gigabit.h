@@ -7,8 +7,14 @@
 // #define CH32V307GIGABIT_MCO25 1
 // #define CH32V307GIGABIT_PHYADDRESS 0
 
+#ifndef CH32V307GIGABIT_RXBUFNB
 #define CH32V307GIGABIT_RXBUFNB 8
+#endif
+
+#ifndef CH32V307GIGABIT_TXBUFNB
 #define CH32V307GIGABIT_TXBUFNB 8
+#endif
+
 #define CH32V307GIGABIT_BUFFSIZE 1524 // 1518 + 4, Rounded up.
 
 #define CH32V307GIGABIT_CFG_CLOCK_DELAY 4 // 0..7
@@ -26,6 +32,44 @@
 #define CH32V307GIGABIT_PHY_TIMEOUT 0x10000
 #endif
 
+// Polled RX. The first RX interrupt masks RX interrupts and leaves the ring
+// to ch32v307ethPoll() in the main loop, which hands over at most budget
+// frames per call and only unmasks once the ring is empty. This keeps a flood
+// from living in the interrupt, ch32v307ethInitHandlePacket() is then called
+// from ch32v307ethPoll() instead.
+// #define CH32V307GIGABIT_RX_POLL 1
+
+// With CH32V307GIGABIT_RX_POLL, keep polling this long after the ring went
+// empty before unmasking the RX interrupt again (interrupt mitigation). The
+// MAC has no RX watchdog timer, so this is done against SysTick.
+#ifndef CH32V307GIGABIT_RX_HOLDOFF_US
+#define CH32V307GIGABIT_RX_HOLDOFF_US 0
+#endif
+
+// IEEE 1588 timestamps. The MAC stamps every frame it receives, the stamp
+// is in ch32v307eth_rxtime while ch32v307ethInitHandlePacket() runs, and
+// frames sent with ch32v307ethTransmitStaticTS(). The clock runs off HCLK
+// and is steered with ch32v307ethPTPStep() and ch32v307ethPTPAdjust(),
+// lib_ptp.h is a PTP slave on top of it. Times are ns on the PTP clock.
+//
+// With normal descriptors the MAC writes a stamp over the buffer and next
+// descriptor addresses, the driver puts them back from the descriptor's
+// place in the ring. Multicast frames all pass the filter.
+// #define CH32V307GIGABIT_PTP 1
+
+#if CH32V307GIGABIT_PTP
+#ifndef CH32V307GIGABIT_PTP_HCLK
+#define CH32V307GIGABIT_PTP_HCLK FUNCONF_SYSTEM_CORE_CLOCK
+#endif
+// Subseconds are 2^-31 s. The accumulator overflows at 2^31 / SSIR Hz,
+// just under HCLK, which leaves the addend room to speed the clock up.
+#define CH32V307GIGABIT_PTP_SSIR   ( ( 1ULL << 31 ) / CH32V307GIGABIT_PTP_HCLK + 1 )
+#define CH32V307GIGABIT_PTP_ADDEND ( (uint32_t)( ( 1ULL << 63 ) / ( CH32V307GIGABIT_PTP_SSIR * CH32V307GIGABIT_PTP_HCLK ) ) )
+#ifndef CH32V307GIGABIT_PTP_MAX_PPB
+#define CH32V307GIGABIT_PTP_MAX_PPB 500000
+#endif
+#endif
+
 // Additional definitions, not part of ch32v003fun.h
 #ifndef CH32V307GIGABIT_PHY_RSTB
 #define CH32V307GIGABIT_PHY_RSTB PA10
@@ -44,7 +88,8 @@ typedef struct
 
 void ch32v307ethHandleReconfig( int link, int speed, int duplex );
 
-// Return non-zero to suppress OWN return (for if you are still holding onto the buffer)
+// Return non-zero to suppress OWN return (for if you are still holding onto the buffer),
+// then give it back with ch32v307ethRxRelease() once you're done with it.
 int ch32v307ethInitHandlePacket( uint8_t * data, int frame_length, ETH_DMADESCTypeDef * dmadesc );
 
 void ch32v307ethInitHandleTXC( void );
@@ -54,6 +99,17 @@ static void ch32v307ethGetMacInUC( uint8_t * mac );
 static int ch32v307ethInit( void );
 static int ch32v307ethTransmitStatic(uint8_t * buffer, uint32_t length, int enable_txc);  // Does not copy.
 static int ch32v307ethTickPhy( void );
+static void ch32v307ethRxRelease( ETH_DMADESCTypeDef * desc ); // A descriptor ch32v307ethInitHandlePacket() kept.
+#if CH32V307GIGABIT_RX_POLL
+static int ch32v307ethPoll( int budget );  // Returns frames handed over, call from the main loop. 0 for no limit.
+#endif
+#if CH32V307GIGABIT_PTP
+static ETH_DMADESCTypeDef * ch32v307ethTransmitStaticTS( uint8_t * buffer, uint32_t length, int enable_txc ); // 0 if the ring is full.
+static int ch32v307ethTxTimestamp( ETH_DMADESCTypeDef * desc, int64_t * t ); // 0 once it's sent, before the ring comes around.
+static int64_t ch32v307ethPTPNow( void );
+static void ch32v307ethPTPStep( int64_t ns );      // Adds ns to the clock.
+static void ch32v307ethPTPAdjust( int32_t ppb );   // Runs it ppb faster than HCLK says.
+#endif
 
 // Data pursuent to ethernet.
 uint8_t ch32v307eth_mac[6] = { 0 };
@@ -64,11 +120,45 @@ uint8_t  ch32v307eth_MACRxBuf[CH32V307GIGABIT_RXBUFNB*CH32V307GIGABIT_BUFFSIZE]
 ETH_DMADESCTypeDef * pDMARxGet;
 ETH_DMADESCTypeDef * pDMATxSet;
 
+// Descriptors kept by ch32v307ethInitHandlePacket() until ch32v307ethRxRelease().
+// Their OWN is clear and their status is the old frame's, once every one is
+// held the ring walk comes round to them and has to stop there.
+volatile uint8_t ch32v307eth_rxheld[CH32V307GIGABIT_RXBUFNB];
+
+#if CH32V307GIGABIT_PTP
+int64_t ch32v307eth_rxtime; // Of the frame being handed over.
+
+// A stamp may be over a descriptor's next address, go by its place.
+#define CH32V307GIGABIT_RX_NEXT( d ) ( ch32v307eth_DMARxDscrTab + ( (d) - ch32v307eth_DMARxDscrTab + 1 ) % CH32V307GIGABIT_RXBUFNB )
+#define CH32V307GIGABIT_TX_NEXT( d ) ( ch32v307eth_DMATxDscrTab + ( (d) - ch32v307eth_DMATxDscrTab + 1 ) % CH32V307GIGABIT_TXBUFNB )
+#else
+#define CH32V307GIGABIT_RX_NEXT( d ) ( (ETH_DMADESCTypeDef *)(d)->Buffer2NextDescAddr )
+#define CH32V307GIGABIT_TX_NEXT( d ) ( (ETH_DMADESCTypeDef *)(d)->Buffer2NextDescAddr )
+#endif
+
+#if CH32V307GIGABIT_RX_POLL
+// How the poll budget gets used. frames / polls is the average use, full
+// counts polls that used the whole budget and left frames behind, rearms
+// counts going back to interrupts.
+struct
+{
+	uint32_t polls;
+	uint32_t frames;
+	uint32_t full;
+	uint32_t rearms;
+} ch32v307eth_pollstats;
+volatile int ch32v307eth_rxpoll; // RX interrupt masked, ring belongs to ch32v307ethPoll().
+uint32_t ch32v307eth_rxidle;    // SysTick when the ring was last found empty.
+#endif
+
 
 // Internal functions
 static int ch32v307ethPHYRegWrite( uint32_t reg, uint32_t val );
 static int ch32v307ethPHYRegAsyncRead( int reg, int * value );
 static int ch32v307ethPHYRegRead( uint32_t reg );
+#if CH32V307GIGABIT_PTP
+static int64_t ch32v307ethPTPTime( uint32_t sec, uint32_t sub );
+#endif
 
 static int ch32v307ethPHYRegAsyncRead( int reg, int * value )
 {
@@ -356,7 +446,11 @@ static int ch32v307ethInit( void )
 		ETH_BroadcastFramesReception_Enable |
 		ETH_DestinationAddrFilter_Normal |
 		ETH_PromiscuousMode_Disable |
+#if CH32V307GIGABIT_PTP
+		ETH_MulticastFramesFilter_None |
+#else
 		ETH_MulticastFramesFilter_Perfect |
+#endif
 		ETH_UnicastFramesFilter_Perfect);
 
 	ETH->MACHTHR = (uint32_t)0;
@@ -389,6 +483,19 @@ static int ch32v307ethInit( void )
 	pDMARxGet = ch32v307eth_DMARxDscrTab;
 	pDMATxSet = ch32v307eth_DMATxDscrTab;
 
+#if CH32V307GIGABIT_PTP
+	// Fine update, stamps on all frames, the clock from 0.
+	ETH->PTPSSIR = CH32V307GIGABIT_PTP_SSIR;
+	ETH->PTPTSAR = CH32V307GIGABIT_PTP_ADDEND;
+	ETH->PTPTSCR = ETH_PTPTSCR_TSE | ETH_PTPTSCR_TSFCU | ETH_PTPTSSR_TSSARFE;
+	ETH->PTPTSCR |= ETH_PTPTSCR_TSARU;
+	for( timeout = 10000; timeout > 0 && ( ETH->PTPTSCR & ETH_PTPTSCR_TSARU ); timeout-- );
+	ETH->PTPTSHUR = 0;
+	ETH->PTPTSLUR = 0;
+	ETH->PTPTSCR |= ETH_PTPTSCR_TSSTI;
+	for( timeout = 10000; timeout > 0 && ( ETH->PTPTSCR & ETH_PTPTSCR_TSSTI ); timeout-- );
+#endif
+
 	// Receive a good frame half interrupt mask.
 	// Receive CRC error frame half interrupt mask.
 	// For the future: Why do we want this?
@@ -409,6 +516,127 @@ static int ch32v307ethInit( void )
 	return 0;
 }
 
+// Hands received frames to ch32v307ethInitHandlePacket(), at most budget of
+// them (negative for no limit). Returns how many descriptors it went through.
+static int ch32v307ethRxWalk( int budget )
+{
+	int n;
+
+	// Received a packet, normally.
+	// Status is in Table 27-17 Definitions of RDes0
+	for( n = 0; n != budget; n++ )
+	{
+		// XXX TODO: Is this a good place to acknowledge? REVISIT: Should this go lower?
+		ETH->DMASR = ETH_DMA_IT_R;
+
+		uint32_t status = pDMARxGet->Status;
+		if( status & ETH_DMARxDesc_OWN ) break;
+
+		// Still held from the last time round, the MAC hasn't written it since.
+		if( ch32v307eth_rxheld[pDMARxGet - ch32v307eth_DMARxDscrTab] ) break;
+
+		// We only have a valid packet in a specific situation.
+		// So, we take the status, then mask off the bits we care about
+		// And see if they're equal to the ones that need to be set/unset.
+		const uint32_t mask = 
+			ETH_DMARxDesc_OWN |
+			ETH_DMARxDesc_LS |
+			ETH_DMARxDesc_ES |
+			ETH_DMARxDesc_FS;
+		const uint32_t eq = 
+			0 |
+			ETH_DMARxDesc_LS |
+			0 |
+			ETH_DMARxDesc_FS;
+
+		int suppress_own = 0;
+
+#if CH32V307GIGABIT_PTP
+		// The stamp is where the addresses were.
+		int i = pDMARxGet - ch32v307eth_DMARxDscrTab;
+		ch32v307eth_rxtime = ch32v307ethPTPTime( pDMARxGet->Buffer2NextDescAddr, pDMARxGet->Buffer1Addr );
+		pDMARxGet->Buffer1Addr = (uint32_t)(&ch32v307eth_MACRxBuf[i * CH32V307GIGABIT_BUFFSIZE]);
+		pDMARxGet->Buffer2NextDescAddr = (uint32_t)CH32V307GIGABIT_RX_NEXT( pDMARxGet );
+#endif
+
+		if( ( status & mask ) == eq )
+		{
+			int32_t frame_length = ((status & ETH_DMARxDesc_FL) >> ETH_DMARXDESC_FRAME_LENGTHSHIFT) - 4;
+			if( frame_length > 0 )
+			{
+				uint8_t * data = (uint8_t*)pDMARxGet->Buffer1Addr;
+				suppress_own = ch32v307ethInitHandlePacket( data, frame_length, pDMARxGet );
+			}
+		}
+		// Otherwise, Invalid Packet
+
+		// Relinquish control back to underlying hardware.
+		if( !suppress_own )
+			pDMARxGet->Status = ETH_DMARxDesc_OWN;
+		else
+			ch32v307eth_rxheld[pDMARxGet - ch32v307eth_DMARxDscrTab] = 1;
+
+		// Tricky logic for figuring out the next packet. Originally
+		// discussed in ch32v30x_eth.c in ETH_DropRxPkt
+		if((pDMARxGet->ControlBufferSize & ETH_DMARxDesc_RCH) != (uint32_t)RESET)
+			pDMARxGet = (ETH_DMADESCTypeDef *)(pDMARxGet->Buffer2NextDescAddr);
+		else
+		{
+			if((pDMARxGet->ControlBufferSize & ETH_DMARxDesc_RER) != (uint32_t)RESET)
+				pDMARxGet = (ETH_DMADESCTypeDef *)(ETH->DMARDLAR);
+			else
+				pDMARxGet = (ETH_DMADESCTypeDef *)((uint32_t)pDMARxGet + 0x10 + ((ETH->DMABMR & ETH_DMABMR_DSL) >> 2));
+		}
+	}
+
+	// If it ran out of descriptors, the errata parts wait for this to go on.
+	if( n )
+		ETH->DMARPDR = 0;
+	return n;
+}
+
+static void ch32v307ethRxRelease( ETH_DMADESCTypeDef * desc )
+{
+	// OWN goes back before the mark comes off, so the walk never finds the old
+	// status unmarked. A frame landing in between would find the walk stopped
+	// at the mark and be left there until the next one, so no interrupt here.
+	NVIC_DisableIRQ( ETH_IRQn );
+	desc->Status = ETH_DMARxDesc_OWN;
+	ch32v307eth_rxheld[desc - ch32v307eth_DMARxDscrTab] = 0;
+	NVIC_EnableIRQ( ETH_IRQn );
+	ETH->DMARPDR = 0; // Resume RX if it ran out of descriptors.
+}
+
+#if CH32V307GIGABIT_RX_POLL
+static int ch32v307ethPoll( int budget )
+{
+	if( !ch32v307eth_rxpoll ) return 0;
+	if( budget <= 0 ) budget = -1; // No limit, the ring walk takes negative for that.
+
+	int n = ch32v307ethRxWalk( budget );
+	ch32v307eth_pollstats.polls++;
+	ch32v307eth_pollstats.frames += n;
+	if( n == budget )
+	{
+		ch32v307eth_pollstats.full++;
+		return n;
+	}
+
+	// Ring is empty. R was acknowledged before finding it so, anything
+	// landing after that interrupts as soon as it's unmasked.
+	uint32_t now = SysTick->CNT;
+	if( n )
+		ch32v307eth_rxidle = now;
+	if( now - ch32v307eth_rxidle < Ticks_from_Us( CH32V307GIGABIT_RX_HOLDOFF_US ) )
+		return n;
+
+	ch32v307eth_rxpoll = 0;
+	ch32v307eth_pollstats.rearms++;
+	ETH->DMAIER |= ETH_DMA_IT_R;
+	return n;
+}
+#endif
+
 void ETH_IRQHandler( void ) __attribute__((interrupt));
 void ETH_IRQHandler( void )
 {
@@ -431,7 +659,11 @@ void ETH_IRQHandler( void )
 		        ETH->DMASR = ETH_DMA_IT_RBU;
 		        if((INFO->CHIPID & 0xf0) == 0x10)
 		        {
-		            ((ETH_DMADESCTypeDef *)(((ETH_DMADESCTypeDef *)(ETH->DMACHRDR))->Buffer2NextDescAddr))->Status = ETH_DMARxDesc_OWN;
+		            // Not if the application still has it, or it's a frame the ring
+		            // walk hasn't got to yet (polled RX), that's what ran the ring out.
+		            ETH_DMADESCTypeDef * next = CH32V307GIGABIT_RX_NEXT( (ETH_DMADESCTypeDef *)(ETH->DMACHRDR) );
+		            if( !ch32v307eth_rxheld[next - ch32v307eth_DMARxDscrTab] && next != pDMARxGet )
+		                next->Status = ETH_DMARxDesc_OWN;
 		            ETH->DMARPDR = 0;
 		        }
 		    }
@@ -443,60 +675,14 @@ void ETH_IRQHandler( void )
 		{
 		    if( int_sta & ETH_DMA_IT_R )
 		    {
-				// Received a packet, normally.
-				// Status is in Table 27-17 Definitions of RDes0
-				do
-				{
-					// XXX TODO: Is this a good place to acknowledge? REVISIT: Should this go lower?
-					// XXX TODO: Restructure this to allow for 
-				    ETH->DMASR = ETH_DMA_IT_R;
-
-					uint32_t status = pDMARxGet->Status;
-					if( status & ETH_DMARxDesc_OWN ) break;
-
-					// We only have a valid packet in a specific situation.
-					// So, we take the status, then mask off the bits we care about
-					// And see if they're equal to the ones that need to be set/unset.
-					const uint32_t mask = 
-						ETH_DMARxDesc_OWN |
-						ETH_DMARxDesc_LS |
-						ETH_DMARxDesc_ES |
-						ETH_DMARxDesc_FS;
-					const uint32_t eq = 
-						0 |
-						ETH_DMARxDesc_LS |
-						0 |
-						ETH_DMARxDesc_FS;
-
-					int suppress_own = 0;
-
-					if( ( status & mask ) == eq )
-					{
-						int32_t frame_length = ((status & ETH_DMARxDesc_FL) >> ETH_DMARXDESC_FRAME_LENGTHSHIFT) - 4;
-						if( frame_length > 0 )
-						{
-							uint8_t * data = (uint8_t*)pDMARxGet->Buffer1Addr;
-							suppress_own = ch32v307ethInitHandlePacket( data, frame_length, pDMARxGet );
-						}
-					}
-					// Otherwise, Invalid Packet
-
-					// Relinquish control back to underlying hardware.
-					if( !suppress_own )
-						pDMARxGet->Status = ETH_DMARxDesc_OWN;
-
-					// Tricky logic for figuring out the next packet. Originally
-					// discussed in ch32v30x_eth.c in ETH_DropRxPkt
-					if((pDMARxGet->ControlBufferSize & ETH_DMARxDesc_RCH) != (uint32_t)RESET)
-						pDMARxGet = (ETH_DMADESCTypeDef *)(pDMARxGet->Buffer2NextDescAddr);
-					else
-					{
-						if((pDMARxGet->ControlBufferSize & ETH_DMARxDesc_RER) != (uint32_t)RESET)
-							pDMARxGet = (ETH_DMADESCTypeDef *)(ETH->DMARDLAR);
-						else
-							pDMARxGet = (ETH_DMADESCTypeDef *)((uint32_t)pDMARxGet + 0x10 + ((ETH->DMABMR & ETH_DMABMR_DSL) >> 2));
-					}
-				} while( 1 );
+#if CH32V307GIGABIT_RX_POLL
+				// Leave the ring to ch32v307ethPoll() until it's drained.
+				ETH->DMAIER &= ~ETH_DMA_IT_R;
+				ETH->DMASR = ETH_DMA_IT_R;
+				ch32v307eth_rxpoll = 1;
+#else
+				ch32v307ethRxWalk( -1 );
+#endif
 		    }
 		    if( int_sta & ETH_DMA_IT_T )
 		    {
@@ -508,41 +694,108 @@ void ETH_IRQHandler( void )
 	} while( 1 );
 }
 
-static int ch32v307ethTransmitStatic(uint8_t * buffer, uint32_t length, int enable_txc)
+static ETH_DMADESCTypeDef * ch32v307ethTxQueue( uint8_t * buffer, uint32_t length, uint32_t status )
 {
 	// The official SDK waits until ETH_DMATxDesc_TTSS is set.
 	// This also provides a transmit timestamp, which could be
 	// used for PTP.
 	// But we don't want to do that.
-	// We just want to go.  If anyone cares, they can check later.
+	// We just want to go.  If anyone cares, they can check later,
+	// with ch32v307ethTxTimestamp().
 
-	if( pDMATxSet->Status & ETH_DMATxDesc_OWN )
+	ETH_DMADESCTypeDef * desc = pDMATxSet;
+	if( desc->Status & ETH_DMATxDesc_OWN )
 	{
 		ETH->DMATPDR = 0;
-		return -1;
+		return 0;
 	}
 
-    pDMATxSet->ControlBufferSize = (length & ETH_DMATxDesc_TBS1);
-	pDMATxSet->Buffer1Addr = (uint32_t)buffer;
+    desc->ControlBufferSize = (length & ETH_DMATxDesc_TBS1);
+	desc->Buffer1Addr = (uint32_t)buffer;
+#if CH32V307GIGABIT_PTP
+	desc->Buffer2NextDescAddr = (uint32_t)CH32V307GIGABIT_TX_NEXT( desc );
+#endif
 
 	// Status is in Table 27-12 "Definitions of TDes0 bits"
-	enable_txc = enable_txc ? ETH_DMATxDesc_IC : 0;
-    pDMATxSet->Status = 
+    desc->Status = 
 		ETH_DMATxDesc_LS |                  // Last Segment (This is all you need to have to transmit)
 		ETH_DMATxDesc_FS |                  // First Segment (Beginning of transmission)
-		enable_txc |                        // Interrupt when complete
+		status |                            // Interrupt when complete, timestamp
 		ETH_DMATxDesc_TCH |                 // Next Descriptor Address Valid
 		ETH_DMATxDesc_CIC_TCPUDPICMP_Full | // Do all header checksums.
 		ETH_DMATxDesc_OWN;                  // Own back to hardware
 
-	pDMATxSet = (ETH_DMADESCTypeDef*)pDMATxSet->Buffer2NextDescAddr;
+	pDMATxSet = CH32V307GIGABIT_TX_NEXT( desc );
 
 	ETH->DMASR = ETH_DMASR_TBUS; // This resets the transmit process (or "starts" it)
 	ETH->DMATPDR = 0;
 
+	return desc;
+}
+
+static int ch32v307ethTransmitStatic(uint8_t * buffer, uint32_t length, int enable_txc)
+{
+	return ch32v307ethTxQueue( buffer, length, enable_txc ? ETH_DMATxDesc_IC : 0 ) ? 0 : -1;
+}
+
+#if CH32V307GIGABIT_PTP
+
+// Seconds and subseconds, as the MAC has them, in ns.
+static int64_t ch32v307ethPTPTime( uint32_t sec, uint32_t sub )
+{
+	return (int64_t)sec * 1000000000 + ( ( (uint64_t)( sub & ETH_PTPTSLR_STSS ) * 1000000000 ) >> 31 );
+}
+
+static ETH_DMADESCTypeDef * ch32v307ethTransmitStaticTS( uint8_t * buffer, uint32_t length, int enable_txc )
+{
+	return ch32v307ethTxQueue( buffer, length, ETH_DMATxDesc_TTSE | ( enable_txc ? ETH_DMATxDesc_IC : 0 ) );
+}
+
+static int ch32v307ethTxTimestamp( ETH_DMADESCTypeDef * desc, int64_t * t )
+{
+	uint32_t status = desc->Status;
+	if( ( status & ( ETH_DMATxDesc_OWN | ETH_DMATxDesc_TTSS ) ) != ETH_DMATxDesc_TTSS ) return -1;
+	*t = ch32v307ethPTPTime( desc->Buffer2NextDescAddr, desc->Buffer1Addr );
 	return 0;
 }
 
+static int64_t ch32v307ethPTPNow( void )
+{
+	uint32_t sec, sub;
+	do
+	{
+		sec = ETH->PTPTSHR;
+		sub = ETH->PTPTSLR;
+	} while( sec != ETH->PTPTSHR );
+	return ch32v307ethPTPTime( sec, sub );
+}
+
+static void ch32v307ethPTPStep( int64_t ns )
+{
+	uint32_t sign = 0;
+	if( ns < 0 )
+	{
+		ns = -ns;
+		sign = ETH_PTP_NegativeTime;
+	}
+	int timeout;
+	for( timeout = 10000; timeout > 0 && ( ETH->PTPTSCR & ( ETH_PTPTSCR_TSSTU | ETH_PTPTSCR_TSSTI ) ); timeout-- );
+	ETH->PTPTSHUR = ns / 1000000000;
+	ETH->PTPTSLUR = sign | (uint32_t)( ( (uint64_t)( ns % 1000000000 ) << 31 ) / 1000000000 );
+	ETH->PTPTSCR |= ETH_PTPTSCR_TSSTU;
+}
+
+static void ch32v307ethPTPAdjust( int32_t ppb )
+{
+	if( ppb > CH32V307GIGABIT_PTP_MAX_PPB ) ppb = CH32V307GIGABIT_PTP_MAX_PPB;
+	if( ppb < -CH32V307GIGABIT_PTP_MAX_PPB ) ppb = -CH32V307GIGABIT_PTP_MAX_PPB;
+	int timeout;
+	for( timeout = 10000; timeout > 0 && ( ETH->PTPTSCR & ETH_PTPTSCR_TSARU ); timeout-- );
+	ETH->PTPTSAR = CH32V307GIGABIT_PTP_ADDEND + (int32_t)( (int64_t)CH32V307GIGABIT_PTP_ADDEND * ppb / 1000000000 );
+	ETH->PTPTSCR |= ETH_PTPTSCR_TSARU;
+}
+
+#endif
 
 #endif
 
@@ -296,8 +296,8 @@ void USBHS_IRQHandler()
 							if( ep < FUSB_CONFIG_EPS ) 
 							{
 								// UEP_CTRL_TX(ep) = USBHS_UEP_T_RES_STALL;
-								if( USBHS_SetupReqIndex & USBHS_DEF_UEP_IN  && ctx->endpoint_mode[ep] == -1 ) UEP_CTRL_TX(ep) = USBHS_UEP_T_RES_NAK;
-								else if( USBHS_SetupReqIndex & USBHS_DEF_UEP_OUT && ctx->endpoint_mode[ep] == 1 ) UEP_CTRL_RX(ep) = USBHS_UEP_R_RES_ACK;
+								if( USBHS_SetupReqIndex & USBHS_DEF_UEP_IN  && ctx->endpoint_mode[ep] == 1 ) UEP_CTRL_TX(ep) = USBHS_UEP_T_RES_NAK;
+								else if( !( USBHS_SetupReqIndex & USBHS_DEF_UEP_IN ) && ctx->endpoint_mode[ep] == -1 ) UEP_CTRL_RX(ep) = USBHS_UEP_R_RES_ACK;
 								else 
 								{
 									goto sendstall;
@@ -344,8 +344,8 @@ void USBHS_IRQHandler()
 							int ep = USBHS_SetupReqIndex & 0xf;
 							if( ep < FUSB_CONFIG_EPS )
 							{
-								if( (USBHS_SetupReqIndex & USBHS_DEF_UEP_IN) && ctx->endpoint_mode[ep] == -1 ) UEP_CTRL_TX(ep) = ( UEP_CTRL_TX(ep) & ~USBHS_UEP_T_RES_MASK ) | USBHS_UEP_T_RES_STALL;
-								else if( (USBHS_SetupReqIndex & USBHS_DEF_UEP_OUT) && ctx->endpoint_mode[ep] == 1 ) UEP_CTRL_RX(ep) = ( UEP_CTRL_RX(ep) & ~USBHS_UEP_R_RES_MASK ) | USBHS_UEP_R_RES_STALL;
+								if( (USBHS_SetupReqIndex & USBHS_DEF_UEP_IN) && ctx->endpoint_mode[ep] == 1 ) UEP_CTRL_TX(ep) = ( UEP_CTRL_TX(ep) & ~USBHS_UEP_T_RES_MASK ) | USBHS_UEP_T_RES_STALL;
+								else if( !(USBHS_SetupReqIndex & USBHS_DEF_UEP_IN) && ctx->endpoint_mode[ep] == -1 ) UEP_CTRL_RX(ep) = ( UEP_CTRL_RX(ep) & ~USBHS_UEP_R_RES_MASK ) | USBHS_UEP_R_RES_STALL;
 								else 
 								{
 									goto sendstall;
@@ -389,8 +389,8 @@ void USBHS_IRQHandler()
 						int ep = USBHS_SetupReqIndex & 0xf;
 						if( ep < FUSB_CONFIG_EPS )
 						{
-							if( USBHS_SetupReqIndex & USBHS_DEF_UEP_IN && ctx->endpoint_mode[ep] == -1 ) ctrl0buff[0] = ( UEP_CTRL_TX(ep) & USBHS_UEP_T_RES_MASK ) == USBHS_UEP_T_RES_STALL;
-							else if( USBHS_SetupReqIndex & USBHS_DEF_UEP_OUT && ctx->endpoint_mode[ep] == 1 ) ctrl0buff[0] = ( UEP_CTRL_RX(ep) & USBHS_UEP_R_RES_MASK ) == USBHS_UEP_R_RES_STALL;
+							if( USBHS_SetupReqIndex & USBHS_DEF_UEP_IN && ctx->endpoint_mode[ep] == 1 ) ctrl0buff[0] = ( UEP_CTRL_TX(ep) & USBHS_UEP_T_RES_MASK ) == USBHS_UEP_T_RES_STALL;
+							else if( !( USBHS_SetupReqIndex & USBHS_DEF_UEP_IN ) && ctx->endpoint_mode[ep] == -1 ) ctrl0buff[0] = ( UEP_CTRL_RX(ep) & USBHS_UEP_R_RES_MASK ) == USBHS_UEP_R_RES_STALL;
 							else goto sendstall;
 						}
 						else
@@ -0,0 +1,173 @@
+#ifndef _LIB_ADC_DECIMATE_H
+#define _LIB_ADC_DECIMATE_H
+
+/** Decimation and block statistics for ADC sample streams.
+
+	Used by lib_adc_stream.h from the DMA interrupt, but plain C with no
+	hardware access so it can be checked and timed on a PC. There are no
+	multiplies or divides on the per sample path, so it is cheap on the EC
+	cores too.
+
+	Samples are interleaved frames (one sample per channel), every kernel
+	takes a stride so it can walk a single channel of the DMA buffer.
+
+	CIC: order 1..4 integrator / comb pairs, decimation ratio R. The gain is
+	R^order, set shift to order * log2(R) for an output in input units. The
+	integrators wrap, which is fine for a CIC as long as the full output
+	(input bits + order * log2(R)) fits in 32 bits, 12 bit input with R = 64,
+	order 3 is the limit. The outputs are int32_t, so what's left after the
+	shift has to fit in 31.
+
+	Boxcar: sum of R samples, then >> shift. Same as a first order CIC, but
+	cheaper.
+
+	CICDecimator cic;
+	CIC_Init( &cic, 3, 16, 12 );
+	int n = CIC_Block( &cic, buf + ch, frames, channels, out ); // n outputs
+*/
+
+#include <stdint.h>
+
+#define ADC_CIC_MAX_ORDER 4
+
+typedef struct
+{
+	uint32_t integ[ADC_CIC_MAX_ORDER];
+	uint32_t comb[ADC_CIC_MAX_ORDER];
+	uint16_t ratio;
+	uint16_t phase;
+	uint8_t order;
+	uint8_t shift;
+} CICDecimator;
+
+typedef struct
+{
+	uint32_t acc;
+	uint16_t ratio;
+	uint16_t phase;
+	uint8_t shift;
+} BoxcarDecimator;
+
+typedef struct
+{
+	uint16_t min;
+	uint16_t max;
+	uint32_t sum;
+	uint32_t count;
+} ADCStats;
+
+static void CIC_Init( CICDecimator * c, int order, int ratio, int shift )
+{
+	int i;
+	if( order < 1 ) order = 1;
+	if( order > ADC_CIC_MAX_ORDER ) order = ADC_CIC_MAX_ORDER;
+	for( i = 0; i < ADC_CIC_MAX_ORDER; i++ )
+	{
+		c->integ[i] = 0;
+		c->comb[i] = 0;
+	}
+	c->order = order;
+	c->ratio = ratio;
+	c->shift = shift;
+	c->phase = 0;
+}
+
+// Runs n samples, spaced stride apart, writes one output every ratio inputs.
+// Returns the number of outputs written.
+static int CIC_Block( CICDecimator * c, const uint16_t * in, int n, int stride, int32_t * out )
+{
+	uint32_t i0 = c->integ[0], i1 = c->integ[1], i2 = c->integ[2], i3 = c->integ[3];
+	int phase = c->phase;
+	int ratio = c->ratio;
+	int order = c->order;
+	int outs = 0;
+
+	while( n-- )
+	{
+		// Unrolled by order, the integrators are the per sample cost.
+		i0 += *in;
+		if( order > 1 ) i1 += i0;
+		if( order > 2 ) i2 += i1;
+		if( order > 3 ) i3 += i2;
+		in += stride;
+
+		if( ++phase < ratio ) continue;
+		phase = 0;
+
+		uint32_t y = order == 1 ? i0 : order == 2 ? i1 : order == 3 ? i2 : i3;
+		int k;
+		for( k = 0; k < order; k++ )
+		{
+			uint32_t t = y;
+			y -= c->comb[k];
+			c->comb[k] = t;
+		}
+		out[outs++] = (int32_t)( y >> c->shift );
+	}
+
+	c->integ[0] = i0; c->integ[1] = i1; c->integ[2] = i2; c->integ[3] = i3;
+	c->phase = phase;
+	return outs;
+}
+
+static void Boxcar_Init( BoxcarDecimator * b, int ratio, int shift )
+{
+	b->acc = 0;
+	b->ratio = ratio;
+	b->shift = shift;
+	b->phase = 0;
+}
+
+static int Boxcar_Block( BoxcarDecimator * b, const uint16_t * in, int n, int stride, int32_t * out )
+{
+	uint32_t acc = b->acc;
+	int phase = b->phase;
+	int outs = 0;
+
+	while( n-- )
+	{
+		acc += *in;
+		in += stride;
+		if( ++phase < b->ratio ) continue;
+		out[outs++] = (int32_t)( acc >> b->shift );
+		acc = 0;
+		phase = 0;
+	}
+
+	b->acc = acc;
+	b->phase = phase;
+	return outs;
+}
+
+static void ADCStats_Reset( ADCStats * s )
+{
+	s->min = 0xffff;
+	s->max = 0;
+	s->sum = 0;
+	s->count = 0;
+}
+
+static void ADCStats_Block( ADCStats * s, const uint16_t * in, int n, int stride )
+{
+	uint32_t mn = s->min, mx = s->max, sum = s->sum;
+	s->count += n;
+	while( n-- )
+	{
+		uint32_t v = *in;
+		in += stride;
+		sum += v;
+		if( v < mn ) mn = v;
+		if( v > mx ) mx = v;
+	}
+	s->min = mn;
+	s->max = mx;
+	s->sum = sum;
+}
+
+// Divides, keep it out of interrupts on parts without a divider.
+static int ADCStats_Mean( const ADCStats * s )
+{
+	return s->count ? (int)( s->sum / s->count ) : 0;
+}
+
+#endif
@@ -0,0 +1,256 @@
+#ifndef _LIB_ADC_STREAM_H
+#define _LIB_ADC_STREAM_H
+
+/** Continuous multi-channel ADC acquisition.
+
+	A timer TRGO starts one scan of the regular sequence per sample period,
+	DMA circles over a two half buffer, and the half / full transfer
+	interrupt hands each finished half to you. Optionally every channel is
+	decimated (CIC or boxcar from lib_adc_decimate.h) and min / max / sum
+	statistics are kept per block, all inside that interrupt.
+
+	Timer: TIM1 on ch32v003, ch32v00x and ch32x035, TIM3 on ch32v10x, v20x and
+	v30x (TIM1 TRGO can't start regular conversions there). DMA1 channel 1.
+
+	Usage:
+
+	#include "lib_adc_stream.h"
+
+	void got_block( const uint16_t * frames, int nframes, int channels ) { ... }  // raw, interleaved
+	void got_decim( const int32_t * frames, int nframes, int channels ) { ... }   // decimated, interleaved
+
+	static const uint8_t chls[] = { 2, 3, 4 };
+	ADCStreamConfig cfg = {
+		.channels = chls, .count = 3,
+		.sample_rate = 20000,             // frames / s
+		.decim = ADC_DECIM_CIC, .cic_order = 3, .ratio = 16, .shift = 12,
+		.on_block = got_block, .on_decimated = got_decim,
+	};
+	ADCStreamInit( &cfg );   // pins have to be analog inputs already
+
+	ADCStats s;
+	ADCStreamGetStats( 0, &s ); // stats of the last finished block, channel 0
+
+	Both callbacks run in the DMA interrupt and have half a buffer of time
+	(ADC_STREAM_FRAMES / sample_rate) before the data is overwritten. A
+	count over ADC_STREAM_MAX_CHANNELS is cut down to it, the callbacks get
+	the number of channels actually scanned.
+
+	On parts other than the ch32v003 the ADC clock prescaler is left alone,
+	like funAnalogInit(), check it's within spec for your clock.
+*/
+
+#include "lib_adc_decimate.h"
+
+// Defaults are sized for the 2kB of RAM on the ch32v003, bump them on the
+// bigger parts.
+#ifndef ADC_STREAM_MAX_CHANNELS
+#define ADC_STREAM_MAX_CHANNELS 4
+#endif
+
+#ifndef ADC_STREAM_FRAMES
+#define ADC_STREAM_FRAMES 16      // frames per half buffer
+#endif
+
+#ifndef ADC_STREAM_SAMPLE_TIME
+#define ADC_STREAM_SAMPLE_TIME 1  // 9 cycles on v003, 7.5 on the others
+#endif
+
+#define ADC_DECIM_NONE   0
+#define ADC_DECIM_BOXCAR 1
+#define ADC_DECIM_CIC    2
+
+#if defined( CH32V003 ) || defined( CH32V00x ) || defined( CH32X03x )
+#define ADC_STREAM_TIM          TIM1
+#define ADC_STREAM_TIM_RCC()    ( RCC->APB2PCENR |= RCC_APB2Periph_TIM1 )
+#define ADC_STREAM_TRIG         ADC_ExternalTrigConv_T1_TRGO
+#elif defined( CH32V10x ) || defined( CH32V20x ) || defined( CH32V30x )
+#define ADC_STREAM_TIM          TIM3
+#define ADC_STREAM_TIM_RCC()    ( RCC->APB1PCENR |= RCC_APB1Periph_TIM3 )
+#define ADC_STREAM_TRIG         ADC_ExternalTrigConv_T3_TRGO
+#else
+#error "lib_adc_stream: unsupported ADC"
+#endif
+
+// ch32x00xhw.h doesn't have the timer bit names.
+#ifndef TIM_CEN
+#define TIM_CEN 0x0001
+#endif
+#ifndef TIM_UG
+#define TIM_UG 0x0001
+#endif
+
+typedef struct
+{
+	const uint8_t * channels;
+	int count;
+	uint32_t sample_rate;
+	uint8_t decim;            // ADC_DECIM_*
+	uint8_t cic_order;
+	uint16_t ratio;
+	uint8_t shift;
+	void (*on_block)( const uint16_t * frames, int nframes, int channels );
+	void (*on_decimated)( const int32_t * frames, int nframes, int channels );
+} ADCStreamConfig;
+
+static volatile uint16_t adc_stream_buf[ADC_STREAM_FRAMES * 2 * ADC_STREAM_MAX_CHANNELS];
+static const ADCStreamConfig * adc_stream_cfg;
+static int adc_stream_nch;        // cfg->count, clamped to ADC_STREAM_MAX_CHANNELS
+static CICDecimator adc_stream_cic[ADC_STREAM_MAX_CHANNELS];
+static BoxcarDecimator adc_stream_box[ADC_STREAM_MAX_CHANNELS];
+static ADCStats adc_stream_stats[ADC_STREAM_MAX_CHANNELS];
+static ADCStats adc_stream_last[ADC_STREAM_MAX_CHANNELS];
+static volatile uint32_t adc_stream_overruns;
+
+static void ADCStreamProcess( const uint16_t * half )
+{
+	const ADCStreamConfig * cfg = adc_stream_cfg;
+	int nch = adc_stream_nch;
+	int c;
+
+	for( c = 0; c < nch; c++ )
+	{
+		ADCStats_Reset( &adc_stream_stats[c] );
+		ADCStats_Block( &adc_stream_stats[c], half + c, ADC_STREAM_FRAMES, nch );
+		adc_stream_last[c] = adc_stream_stats[c];
+	}
+
+	if( cfg->on_block )
+		cfg->on_block( half, ADC_STREAM_FRAMES, nch );
+
+	if( cfg->decim != ADC_DECIM_NONE && cfg->on_decimated )
+	{
+		// Each channel runs its own decimator into one column of out[].
+		int32_t col[ADC_STREAM_FRAMES];
+		static int32_t out[ADC_STREAM_FRAMES * ADC_STREAM_MAX_CHANNELS];
+		int n = 0, i;
+		for( c = 0; c < nch; c++ )
+		{
+			if( cfg->decim == ADC_DECIM_CIC )
+				n = CIC_Block( &adc_stream_cic[c], half + c, ADC_STREAM_FRAMES, nch, col );
+			else
+				n = Boxcar_Block( &adc_stream_box[c], half + c, ADC_STREAM_FRAMES, nch, col );
+			for( i = 0; i < n; i++ )
+				out[i * nch + c] = col[i];
+		}
+		if( n ) cfg->on_decimated( out, n, nch );
+	}
+}
+
+void DMA1_Channel1_IRQHandler( void ) __attribute__((interrupt));
+void DMA1_Channel1_IRQHandler( void )
+{
+	uint32_t flags = DMA1->INTFR;
+	DMA1->INTFCR = DMA1_IT_GL1;
+
+	int nch = adc_stream_nch;
+
+	// Both set means we fell a whole half behind.
+	if( ( flags & ( DMA1_FLAG_HT1 | DMA1_FLAG_TC1 ) ) == ( DMA1_FLAG_HT1 | DMA1_FLAG_TC1 ) )
+		adc_stream_overruns++;
+
+	if( flags & DMA1_FLAG_HT1 )
+		ADCStreamProcess( (const uint16_t *)adc_stream_buf );
+	if( flags & DMA1_FLAG_TC1 )
+		ADCStreamProcess( (const uint16_t *)adc_stream_buf + ADC_STREAM_FRAMES * nch );
+}
+
+static void ADCStreamInit( const ADCStreamConfig * cfg )
+{
+	int i;
+	int nch = cfg->count;
+	if( nch > ADC_STREAM_MAX_CHANNELS ) nch = ADC_STREAM_MAX_CHANNELS;
+	adc_stream_cfg = cfg;
+	adc_stream_nch = nch;
+	adc_stream_overruns = 0;
+
+	for( i = 0; i < nch; i++ )
+	{
+		CIC_Init( &adc_stream_cic[i], cfg->cic_order, cfg->ratio, cfg->shift );
+		Boxcar_Init( &adc_stream_box[i], cfg->ratio, cfg->shift );
+		ADCStats_Reset( &adc_stream_last[i] );
+	}
+
+	RCC->APB2PCENR |= RCC_APB2Periph_ADC1;
+	RCC->APB2PRSTR |= RCC_APB2Periph_ADC1;
+	RCC->APB2PRSTR &= ~RCC_APB2Periph_ADC1;
+	RCC->AHBPCENR |= RCC_AHBPeriph_DMA1;
+
+#if defined( CH32V003 )
+	// ADCCLK = 24 MHz
+	RCC->CFGR0 &= ~RCC_ADCPRE;
+	RCC->CFGR0 |= RCC_ADCPRE_DIV2;
+#endif
+
+	// Regular sequence, 6 per RSQR3 / RSQR2 slot, 4 in RSQR1.
+	uint32_t rsqr[3] = { 0, 0, 0 };
+	uint32_t smp1 = 0, smp2 = 0;
+	for( i = 0; i < nch; i++ )
+	{
+		int ch = cfg->channels[i];
+		rsqr[i / 6] |= ch << ( 5 * ( i % 6 ) );
+		if( ch < 10 ) smp2 |= ADC_STREAM_SAMPLE_TIME << ( 3 * ch );
+		else smp1 |= ADC_STREAM_SAMPLE_TIME << ( 3 * ( ch - 10 ) );
+	}
+	ADC1->RSQR1 = ( ( nch - 1 ) << 20 ) | rsqr[2];
+	ADC1->RSQR2 = rsqr[1];
+	ADC1->RSQR3 = rsqr[0];
+	ADC1->SAMPTR1 = smp1;
+	ADC1->SAMPTR2 = smp2;
+	ADC1->CTLR1 = ADC_SCAN;
+	ADC1->CTLR2 = ADC_ADON | ADC_DMA | ADC_EXTTRIG | ADC_STREAM_TRIG;
+
+	ADC1->CTLR2 |= CTLR2_RSTCAL_Set;
+	while(ADC1->CTLR2 & CTLR2_RSTCAL_Set);
+	ADC1->CTLR2 |= CTLR2_CAL_Set;
+	while(ADC1->CTLR2 & CTLR2_CAL_Set);
+
+	DMA1_Channel1->CFGR = 0;
+	DMA1_Channel1->PADDR = (uint32_t)&ADC1->RDATAR;
+	DMA1_Channel1->MADDR = (uint32_t)adc_stream_buf;
+	DMA1_Channel1->CNTR = ADC_STREAM_FRAMES * 2 * nch;
+	DMA1_Channel1->CFGR =
+		DMA_Priority_VeryHigh |
+		DMA_MemoryDataSize_HalfWord |
+		DMA_PeripheralDataSize_HalfWord |
+		DMA_MemoryInc_Enable |
+		DMA_Mode_Circular |
+		DMA_DIR_PeripheralSRC |
+		DMA_IT_HT | DMA_IT_TC;
+	DMA1->INTFCR = DMA1_IT_GL1;
+	NVIC_EnableIRQ( DMA1_Channel1_IRQn );
+	DMA1_Channel1->CFGR |= DMA_CFGR1_EN;
+
+	// One update, so one scan, per sample period.
+	uint32_t div = FUNCONF_SYSTEM_CORE_CLOCK / cfg->sample_rate;
+	uint32_t psc = div >> 16;
+	ADC_STREAM_TIM_RCC();
+	ADC_STREAM_TIM->CTLR1 = 0;
+	ADC_STREAM_TIM->PSC = psc;
+	ADC_STREAM_TIM->ATRLR = div / ( psc + 1 ) - 1;
+	ADC_STREAM_TIM->CTLR2 = TIM_TRGOSource_Update;
+	ADC_STREAM_TIM->SWEVGR = TIM_UG;
+	ADC_STREAM_TIM->CTLR1 = TIM_CEN;
+}
+
+static void ADCStreamStop( void )
+{
+	ADC_STREAM_TIM->CTLR1 = 0;
+	DMA1_Channel1->CFGR &= ~DMA_CFGR1_EN;
+	NVIC_DisableIRQ( DMA1_Channel1_IRQn );
+}
+
+// Statistics of the last finished half buffer.
+static void ADCStreamGetStats( int channel, ADCStats * s )
+{
+	__disable_irq();
+	*s = adc_stream_last[channel];
+	__enable_irq();
+}
+
+static uint32_t ADCStreamOverruns( void )
+{
+	return adc_stream_overruns;
+}
+
+#endif
@@ -0,0 +1,695 @@
+#ifndef _LIB_AES_H
+#define _LIB_AES_H
+
+/* AES-128 in ECB, CBC, CTR and CCM, on the AES block of the CH5xx parts with
+	BLE, or in software on any part.
+
+		aes_ctx key;
+		aes_setkey( &key, k );                         // 16 bytes, once
+		aes_ecb_encrypt( &key, in, out, len );         // len a multiple of 16
+		aes_ecb_decrypt( &key, in, out, len );
+		aes_cbc_encrypt( &key, iv, in, out, len );     // iv is updated, so
+		aes_cbc_decrypt( &key, iv, in, out, len );     // the next call goes on
+		aes_ctr_start( &ctr, iv );
+		aes_ctr( &key, &ctr, in, out, len );           // any len, in pieces
+		aes_ccm_encrypt( &key, nonce, nlen, adata, alen, in, out, len, tag, tlen );
+		if( aes_ccm_decrypt( &key, nonce, nlen, adata, alen, in, out, len, tag, tlen ) )
+			...                                        // forged, out is zeroed
+
+	in and out may be the same buffer, and any alignment. The CTR counter is
+	the whole 16 bytes, big endian, as SP 800-38A has it.
+
+	CCM is SP 800-38C (and RFC 3610): a nonce of 7 to 13 bytes that must never
+	be used twice with a key, and a tag of 4 to 16 bytes, even. For packets
+	over iSLER, a 13 byte nonce of a packet counter and a per link IV, the
+	header as adata and a 4 byte tag after the payload, like BLE:
+
+		aes_ccm_encrypt( &key, nonce, 13, hdr, 2, pl, pl, n, pl + n, 4 );
+		aes_ccm_decrypt( &key, nonce, 13, hdr, 2, pl, pl, n - 4, pl + n - 4, 4 );
+
+	The block is what examples_ch5xx/aes found: a key and a block of data in
+	registers, AES-128 as FIPS-197 has it, the bytes in memory order. It's run
+	a block behind the CPU, which reads the next input, stores the last output
+	and does the CBC and CTR xors meanwhile. It's on the CH571/3, CH582/3,
+	CH584/5 and CH591/2, and doesn't work on the CH570 (see the example), so
+	that gets the software, as do all the others. AES_HW 0 or 1 overrides it.
+	There's no DMA, the registers that look like it are still unknown.
+
+	Nothing else may use the block meanwhile, the WCH BLE library does for
+	pairing. The key goes in for every call. With AES_HW_KEY_CACHE 1 it only
+	goes in when the aes_ctx or the direction changes, which is fine on the
+	parts tried; set aes_hw_key to 0 when something else used the block.
+
+	The software is constant time: no table lookups or branches on the key or
+	the data. The S-box is the 113 gate circuit of Boyar and Peralta, run on
+	the 16 bytes at once, MixColumns a word at a time. It's a few thousand
+	cycles a block, not fast, but it doesn't give the key away to anyone who
+	can time it, as a table would. The key is expanded once, in aes_setkey().
+
+	misc/aessim checks all of it against the NIST vectors, and the block code
+	against a model of the block.
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#ifndef AES_HW
+#if defined( CH571_CH573 ) || defined( CH582_CH583 ) || defined( CH584_CH585 ) || defined( CH591_CH592 )
+#define AES_HW 1
+#else
+#define AES_HW 0
+#endif
+#endif
+
+#ifndef AES_HW_KEY_CACHE
+#define AES_HW_KEY_CACHE 0
+#endif
+
+#define AES_ENCRYPT 0
+#define AES_DECRYPT 2
+
+typedef struct
+{
+#if AES_HW
+	uint32_t rk[4];
+#else
+	uint32_t rk[44];
+#endif
+} aes_ctx;
+
+typedef struct
+{
+	uint8_t ctr[16];
+	uint8_t ks[16];
+	uint8_t used;
+} aes_ctr_state;
+
+// Blocks of the caller's buffers, which may be any type.
+typedef uint32_t __attribute__( ( may_alias ) ) aes_word;
+
+static inline void _aes_get( const void * p, uint32_t w[4] )
+{
+	if( (uintptr_t)p & 3 )
+	{
+		memcpy( w, p, 16 );
+		return;
+	}
+	const aes_word * q = p;
+	w[0] = q[0];
+	w[1] = q[1];
+	w[2] = q[2];
+	w[3] = q[3];
+}
+
+static inline void _aes_put( void * p, const uint32_t w[4] )
+{
+	if( (uintptr_t)p & 3 )
+	{
+		memcpy( p, w, 16 );
+		return;
+	}
+	aes_word * q = p;
+	q[0] = w[0];
+	q[1] = w[1];
+	q[2] = w[2];
+	q[3] = w[3];
+}
+
+#if AES_HW
+
+#ifndef AES_BASE
+#define AES_BASE ( (uint32_t)0x4000c300 )
+#endif
+
+typedef struct
+{
+	volatile uint32_t CFG;
+	volatile uint32_t STA; // a flag the BLE library sets and clears itself
+	volatile uint32_t some_reg1; // used by AES_DevPktEnc/Dec, unknown
+	volatile uint32_t some_reg2;
+	volatile uint32_t some_reg3;
+	volatile uint32_t some_reg4;
+	volatile uint32_t data[4]; // in, then out
+	volatile uint32_t key[4];
+} AES_Type;
+
+#define AES ( (AES_Type *)AES_BASE )
+
+#define AES_CFG_START 0x001 // cleared when done
+#define AES_CFG_DECRYPT AES_DECRYPT
+#define AES_CFG_ON 0x100 // written first by the BLE library
+
+// The key in the block, for AES_HW_KEY_CACHE.
+static const aes_ctx * aes_hw_key;
+static uint32_t aes_hw_dir;
+
+#else
+
+/* The software. A block is 4 words of 4 bytes, as it is in memory on a little
+	endian CPU: word c is column c, row r is its byte r. */
+
+static inline uint32_t _aes_ror( uint32_t x, int n )
+{
+	return x >> n | x << ( 32 - n );
+}
+
+// Each byte times 2 in GF(2^8). The multiply only adds 0x1b or 0.
+static inline uint32_t _aes_xtime( uint32_t x )
+{
+	return ( ( x & 0x7f7f7f7f ) << 1 ) ^ ( ( x >> 7 & 0x01010101 ) * 0x1b );
+}
+
+// 8 bytes as an 8x8 bit matrix, transposed, so byte j holds bit j of each.
+static inline void _aes_transpose( uint32_t * lo, uint32_t * hi )
+{
+	uint32_t l = *lo, h = *hi, t;
+	t = ( l ^ ( l >> 7 ) ) & 0x00aa00aa; l ^= t ^ ( t << 7 );
+	t = ( h ^ ( h >> 7 ) ) & 0x00aa00aa; h ^= t ^ ( t << 7 );
+	t = ( l ^ ( l >> 14 ) ) & 0x0000cccc; l ^= t ^ ( t << 14 );
+	t = ( h ^ ( h >> 14 ) ) & 0x0000cccc; h ^= t ^ ( t << 14 );
+	t = ( l ^ ( h << 4 ) ) & 0xf0f0f0f0; l ^= t; h ^= t >> 4;
+	*lo = l;
+	*hi = h;
+}
+
+// The S-box on bit planes, q[j] is bit j of every byte (Boyar and Peralta).
+static void _aes_sbox( uint32_t q[8] )
+{
+	uint32_t x0 = q[7], x1 = q[6], x2 = q[5], x3 = q[4], x4 = q[3], x5 = q[2], x6 = q[1], x7 = q[0];
+	uint32_t y1, y2, y3, y4, y5, y6, y7, y8, y9, y10, y11, y12, y13, y14, y15, y16, y17, y18, y19, y20, y21;
+	uint32_t t0, t1, t2, t3, t4, t5, t6, t7, t8, t9, t10, t11, t12, t13, t14, t15, t16, t17, t18, t19, t20;
+	uint32_t t21, t22, t23, t24, t25, t26, t27, t28, t29, t30, t31, t32, t33, t34, t35, t36, t37, t38, t39;
+	uint32_t t40, t41, t42, t43, t44, t45, t46, t47, t48, t49, t50, t51, t52, t53, t54, t55, t56, t57, t58;
+	uint32_t t59, t60, t61, t62, t63, t64, t65, t66, t67;
+	uint32_t z0, z1, z2, z3, z4, z5, z6, z7, z8, z9, z10, z11, z12, z13, z14, z15, z16, z17;
+
+	// Top linear transform
+	y14 = x3 ^ x5; y13 = x0 ^ x6; y9 = x0 ^ x3; y8 = x0 ^ x5;
+	t0 = x1 ^ x2; y1 = t0 ^ x7; y4 = y1 ^ x3; y12 = y13 ^ y14;
+	y2 = y1 ^ x0; y5 = y1 ^ x6; y3 = y5 ^ y8; t1 = x4 ^ y12;
+	y15 = t1 ^ x5; y20 = t1 ^ x1; y6 = y15 ^ x7; y10 = y15 ^ t0;
+	y11 = y20 ^ y9; y7 = x7 ^ y11; y17 = y10 ^ y11; y19 = y10 ^ y8;
+	y16 = t0 ^ y11; y21 = y13 ^ y16; y18 = x0 ^ y16;
+
+	// Inversion in GF(2^8), by way of GF(2^4)
+	t2 = y12 & y15; t3 = y3 & y6; t4 = t3 ^ t2; t5 = y4 & x7;
+	t6 = t5 ^ t2; t7 = y13 & y16; t8 = y5 & y1; t9 = t8 ^ t7;
+	t10 = y2 & y7; t11 = t10 ^ t7; t12 = y9 & y11; t13 = y14 & y17;
+	t14 = t13 ^ t12; t15 = y8 & y10; t16 = t15 ^ t12; t17 = t4 ^ t14;
+	t18 = t6 ^ t16; t19 = t9 ^ t14; t20 = t11 ^ t16; t21 = t17 ^ y20;
+	t22 = t18 ^ y19; t23 = t19 ^ y21; t24 = t20 ^ y18;
+
+	t25 = t21 ^ t22; t26 = t21 & t23; t27 = t24 ^ t26; t28 = t25 & t27;
+	t29 = t28 ^ t22; t30 = t23 ^ t24; t31 = t22 ^ t26; t32 = t31 & t30;
+	t33 = t32 ^ t24; t34 = t23 ^ t33; t35 = t27 ^ t33; t36 = t24 & t35;
+	t37 = t36 ^ t34; t38 = t27 ^ t36; t39 = t29 & t38; t40 = t25 ^ t39;
+
+	t41 = t40 ^ t37; t42 = t29 ^ t33; t43 = t29 ^ t40; t44 = t33 ^ t37;
+	t45 = t42 ^ t41;
+	z0 = t44 & y15; z1 = t37 & y6; z2 = t33 & x7; z3 = t43 & y16;
+	z4 = t40 & y1; z5 = t29 & y7; z6 = t42 & y11; z7 = t45 & y17;
+	z8 = t41 & y10; z9 = t44 & y12; z10 = t37 & y3; z11 = t33 & y4;
+	z12 = t43 & y13; z13 = t40 & y5; z14 = t29 & y2; z15 = t42 & y9;
+	z16 = t45 & y14; z17 = t41 & y8;
+
+	// Bottom linear transform, with the affine map
+	t46 = z15 ^ z16; t47 = z10 ^ z11; t48 = z5 ^ z13; t49 = z9 ^ z10;
+	t50 = z2 ^ z12; t51 = z2 ^ z5; t52 = z7 ^ z8; t53 = z0 ^ z3;
+	t54 = z6 ^ z7; t55 = z16 ^ z17; t56 = z12 ^ t48; t57 = t50 ^ t53;
+	t58 = z4 ^ t46; t59 = z3 ^ t54; t60 = t46 ^ t57; t61 = z14 ^ t57;
+	t62 = t52 ^ t58; t63 = t49 ^ t58; t64 = z4 ^ t59; t65 = t61 ^ t62;
+	t66 = z1 ^ t63; t67 = t64 ^ t65;
+
+	q[7] = t59 ^ t63;
+	q[1] = t56 ^ ~t62;
+	q[0] = t48 ^ ~t60;
+	q[4] = t53 ^ t66;
+	q[3] = t51 ^ t66;
+	q[2] = t47 ^ t65;
+	q[6] = t64 ^ ~q[4];
+	q[5] = t55 ^ ~t67;
+}
+
+// The inverse of the S-box's affine map, x ^ 0x63 through the inverse matrix.
+static void _aes_unaffine( uint32_t q[8] )
+{
+	uint32_t r[8];
+	for( int i = 0; i < 8; i++ ) r[i] = q[( i + 2 ) & 7] ^ q[( i + 5 ) & 7] ^ q[( i + 7 ) & 7];
+	for( int i = 0; i < 8; i++ ) q[i] = r[i];
+	q[0] = ~q[0];
+	q[2] = ~q[2];
+}
+
+// SubBytes, or with inv InvSubBytes, which is the S-box between two inverse
+// affine maps: the S-box is the affine map of the inverse.
+static void _aes_subbytes( uint32_t s[4], int inv )
+{
+	uint32_t a0 = s[0], a1 = s[1], b0 = s[2], b1 = s[3], q[8];
+	_aes_transpose( &a0, &a1 );
+	_aes_transpose( &b0, &b1 );
+	for( int j = 0; j < 4; j++ )
+	{
+		q[j] = ( a0 >> 8 * j & 0xff ) | ( b0 >> 8 * j & 0xff ) << 8;
+		q[j + 4] = ( a1 >> 8 * j & 0xff ) | ( b1 >> 8 * j & 0xff ) << 8;
+	}
+	if( inv ) _aes_unaffine( q );
+	_aes_sbox( q );
+	if( inv ) _aes_unaffine( q );
+	a0 = a1 = b0 = b1 = 0;
+	for( int j = 0; j < 4; j++ )
+	{
+		a0 |= ( q[j] & 0xff ) << 8 * j;
+		b0 |= ( q[j] >> 8 & 0xff ) << 8 * j;
+		a1 |= ( q[j + 4] & 0xff ) << 8 * j;
+		b1 |= ( q[j + 4] >> 8 & 0xff ) << 8 * j;
+	}
+	_aes_transpose( &a0, &a1 );
+	_aes_transpose( &b0, &b1 );
+	s[0] = a0;
+	s[1] = a1;
+	s[2] = b0;
+	s[3] = b1;
+}
+
+// Row r goes r columns left, or right with inv.
+static void _aes_shiftrows( uint32_t s[4], int inv )
+{
+	uint32_t a[4] = { s[0], s[1], s[2], s[3] };
+	int k = inv ? 3 : 1;
+	for( int c = 0; c < 4; c++ )
+		s[c] = ( a[c] & 0xff ) | ( a[( c + k ) & 3] & 0xff00 ) |
+			( a[( c + 2 ) & 3] & 0xff0000 ) | ( a[( c + 3 * k ) & 3] & 0xff000000 );
+}
+
+static void _aes_mixcolumns( uint32_t s[4], int inv )
+{
+	for( int c = 0; c < 4; c++ )
+	{
+		uint32_t w = s[c];
+		// InvMixColumns is MixColumns after adding 4 ( a[r] ^ a[r + 2] )
+		if( inv ) w ^= _aes_xtime( _aes_xtime( w ^ _aes_ror( w, 16 ) ) );
+		uint32_t t = w ^ _aes_ror( w, 8 );
+		s[c] = _aes_xtime( t ) ^ _aes_ror( w, 8 ) ^ _aes_ror( t, 16 );
+	}
+}
+
+static inline void _aes_addkey( uint32_t s[4], const uint32_t * rk )
+{
+	s[0] ^= rk[0];
+	s[1] ^= rk[1];
+	s[2] ^= rk[2];
+	s[3] ^= rk[3];
+}
+
+static void _aes_sw_encrypt( const uint32_t * rk, uint32_t s[4] )
+{
+	_aes_addkey( s, rk );
+	for( int r = 1; r <= 10; r++ )
+	{
+		_aes_subbytes( s, 0 );
+		_aes_shiftrows( s, 0 );
+		if( r < 10 ) _aes_mixcolumns( s, 0 );
+		_aes_addkey( s, rk + 4 * r );
+	}
+}
+
+static void _aes_sw_decrypt( const uint32_t * rk, uint32_t s[4] )
+{
+	_aes_addkey( s, rk + 40 );
+	for( int r = 9; r >= 0; r-- )
+	{
+		_aes_shiftrows( s, 1 );
+		_aes_subbytes( s, 1 );
+		_aes_addkey( s, rk + 4 * r );
+		if( r ) _aes_mixcolumns( s, 1 );
+	}
+}
+
+#endif
+
+static void aes_setkey( aes_ctx * ctx, const void * key )
+{
+	_aes_get( key, ctx->rk );
+#if AES_HW
+	if( aes_hw_key == ctx ) aes_hw_key = 0;
+#else
+	uint32_t * w = ctx->rk, rcon = 1;
+	for( int i = 4; i < 44; i++ )
+	{
+		uint32_t t = w[i - 1];
+		if( !( i & 3 ) )
+		{
+			uint32_t s[4] = { _aes_ror( t, 8 ), 0, 0, 0 };
+			_aes_subbytes( s, 0 );
+			t = s[0] ^ rcon;
+			rcon = _aes_xtime( rcon );
+		}
+		w[i] = w[i - 4] ^ t;
+	}
+#endif
+}
+
+/* One block at a time through the block, or the software: _aes_start()
+	gives it a block, _aes_finish() takes the result, and the CPU is free in
+	between while it's the block. */
+
+typedef struct
+{
+	const aes_ctx * ctx;
+	uint32_t dir;
+#if !AES_HW
+	uint32_t s[4];
+#endif
+} _aes_engine;
+
+static inline void _aes_begin( _aes_engine * e, const aes_ctx * ctx, uint32_t dir )
+{
+	e->ctx = ctx;
+	e->dir = dir;
+#if AES_HW
+	AES->CFG = AES_CFG_ON;
+	AES->CFG = dir;
+	if( !AES_HW_KEY_CACHE || aes_hw_key != ctx || aes_hw_dir != dir )
+	{
+		AES->key[0] = ctx->rk[0];
+		AES->key[1] = ctx->rk[1];
+		AES->key[2] = ctx->rk[2];
+		AES->key[3] = ctx->rk[3];
+		aes_hw_key = ctx;
+		aes_hw_dir = dir;
+	}
+#endif
+}
+
+static inline void _aes_start( _aes_engine * e, const uint32_t in[4] )
+{
+#if AES_HW
+	AES->data[0] = in[0];
+	AES->data[1] = in[1];
+	AES->data[2] = in[2];
+	AES->data[3] = in[3];
+	AES->CFG = e->dir | AES_CFG_START;
+#else
+	e->s[0] = in[0];
+	e->s[1] = in[1];
+	e->s[2] = in[2];
+	e->s[3] = in[3];
+	if( e->dir == AES_DECRYPT ) _aes_sw_decrypt( e->ctx->rk, e->s );
+	else _aes_sw_encrypt( e->ctx->rk, e->s );
+#endif
+}
+
+static inline void _aes_finish( _aes_engine * e, uint32_t out[4] )
+{
+#if AES_HW
+	while( AES->CFG & AES_CFG_START );
+	out[0] = AES->data[0];
+	out[1] = AES->data[1];
+	out[2] = AES->data[2];
+	out[3] = AES->data[3];
+#else
+	out[0] = e->s[0];
+	out[1] = e->s[1];
+	out[2] = e->s[2];
+	out[3] = e->s[3];
+#endif
+}
+
+static inline void _aes_block( _aes_engine * e, uint32_t b[4] )
+{
+	_aes_start( e, b );
+	_aes_finish( e, b );
+}
+
+static inline void _aes_xor( uint32_t a[4], const uint32_t b[4] )
+{
+	a[0] ^= b[0];
+	a[1] ^= b[1];
+	a[2] ^= b[2];
+	a[3] ^= b[3];
+}
+
+static void aes_encrypt_block( const aes_ctx * ctx, const void * in, void * out )
+{
+	_aes_engine e;
+	uint32_t b[4];
+	_aes_get( in, b );
+	_aes_begin( &e, ctx, AES_ENCRYPT );
+	_aes_block( &e, b );
+	_aes_put( out, b );
+}
+
+static void aes_decrypt_block( const aes_ctx * ctx, const void * in, void * out )
+{
+	_aes_engine e;
+	uint32_t b[4];
+	_aes_get( in, b );
+	_aes_begin( &e, ctx, AES_DECRYPT );
+	_aes_block( &e, b );
+	_aes_put( out, b );
+}
+
+// The next input is read while the block works on this one, the output of
+// this one is stored while it works on the next.
+static void _aes_ecb( const aes_ctx * ctx, uint32_t dir, const uint8_t * in, uint8_t * out, uint32_t len )
+{
+	_aes_engine e;
+	uint32_t x[4], y[4];
+	if( len < 16 ) return;
+	_aes_begin( &e, ctx, dir );
+	_aes_get( in, x );
+	_aes_start( &e, x );
+	for( ; len >= 32; len -= 16, in += 16, out += 16 )
+	{
+		_aes_get( in + 16, x );
+		_aes_finish( &e, y );
+		_aes_start( &e, x );
+		_aes_put( out, y );
+	}
+	_aes_finish( &e, y );
+	_aes_put( out, y );
+}
+
+static void aes_ecb_encrypt( const aes_ctx * ctx, const void * in, void * out, uint32_t len )
+{
+	_aes_ecb( ctx, AES_ENCRYPT, in, out, len );
+}
+
+static void aes_ecb_decrypt( const aes_ctx * ctx, const void * in, void * out, uint32_t len )
+{
+	_aes_ecb( ctx, AES_DECRYPT, in, out, len );
+}
+
+// Each block needs the one before, only the reads and writes overlap.
+static void aes_cbc_encrypt( const aes_ctx * ctx, void * iv, const void * in, void * out, uint32_t len )
+{
+	const uint8_t * src = in;
+	uint8_t * dst = out;
+	_aes_engine e;
+	uint32_t x[4], v[4];
+	if( len < 16 ) return;
+	_aes_begin( &e, ctx, AES_ENCRYPT );
+	_aes_get( iv, v );
+	_aes_get( src, x );
+	for( ; len >= 16; len -= 16, src += 16, dst += 16 )
+	{
+		_aes_xor( x, v );
+		_aes_start( &e, x );
+		if( len >= 32 ) _aes_get( src + 16, x );
+		_aes_finish( &e, v );
+		_aes_put( dst, v );
+	}
+	_aes_put( iv, v );
+}
+
+static void aes_cbc_decrypt( const aes_ctx * ctx, void * iv, const void * in, void * out, uint32_t len )
+{
+	const uint8_t * src = in;
+	uint8_t * dst = out;
+	_aes_engine e;
+	uint32_t x[4], next[4], y[4], v[4];
+	if( len < 16 ) return;
+	_aes_begin( &e, ctx, AES_DECRYPT );
+	_aes_get( iv, v );
+	_aes_get( src, x );
+	_aes_start( &e, x );
+	for( ; len >= 32; len -= 16, src += 16, dst += 16 )
+	{
+		_aes_get( src + 16, next );
+		_aes_finish( &e, y );
+		_aes_start( &e, next );
+		_aes_xor( y, v );
+		memcpy( v, x, 16 );
+		memcpy( x, next, 16 );
+		_aes_put( dst, y );
+	}
+	_aes_finish( &e, y );
+	_aes_xor( y, v );
+	_aes_put( dst, y );
+	_aes_put( iv, x );
+}
+
+static void aes_ctr_start( aes_ctr_state * st, const void * iv )
+{
+	memcpy( st->ctr, iv, 16 );
+	st->used = 16;
+}
+
+static inline void _aes_ctr_next( uint8_t ctr[16] )
+{
+	for( int i = 15; i >= 0 && !++ctr[i]; i-- );
+}
+
+// The counter of the next block goes in while the CPU xors this one.
+static void aes_ctr( const aes_ctx * ctx, aes_ctr_state * st, const void * in, void * out, uint32_t len )
+{
+	const uint8_t * src = in;
+	uint8_t * dst = out;
+	_aes_engine e;
+	uint32_t c[4], ks[4], x[4];
+
+	for( ; len && st->used < 16; len-- ) *dst++ = *src++ ^ st->ks[st->used++];
+	if( !len ) return;
+
+	_aes_begin( &e, ctx, AES_ENCRYPT );
+	memcpy( c, st->ctr, 16 );
+	_aes_start( &e, c );
+	_aes_ctr_next( st->ctr );
+	for( ;; )
+	{
+		_aes_finish( &e, ks );
+		if( len > 16 )
+		{
+			memcpy( c, st->ctr, 16 );
+			_aes_start( &e, c );
+			_aes_ctr_next( st->ctr );
+		}
+		if( len < 16 )
+		{
+			memcpy( st->ks, ks, 16 );
+			for( st->used = 0; st->used < len; st->used++ ) dst[st->used] = src[st->used] ^ st->ks[st->used];
+			return;
+		}
+		_aes_get( src, x );
+		_aes_xor( x, ks );
+		_aes_put( dst, x );
+		st->used = 16;
+		if( !( len -= 16 ) ) return;
+		src += 16;
+		dst += 16;
+	}
+}
+
+// CBC-MAC of bytes into mac, from byte pos of its block. Returns where it
+// got to.
+static uint32_t _aes_mac( _aes_engine * e, uint32_t mac[4], uint32_t pos, const uint8_t * p, uint32_t n )
+{
+	uint8_t * m = (uint8_t *)mac;
+	while( n-- )
+	{
+		m[pos++] ^= *p++;
+		if( pos == 16 )
+		{
+			_aes_block( e, mac );
+			pos = 0;
+		}
+	}
+	return pos;
+}
+
+// CCM both ways, the MAC is of the plaintext. The tag, before it's cut to
+// tlen, goes to tag.
+static int _aes_ccm( const aes_ctx * ctx, int dec, const uint8_t * nonce, uint32_t nlen, const uint8_t * adata,
+	uint32_t alen, const uint8_t * in, uint8_t * out, uint32_t len, uint32_t tlen, uint32_t tag[4] )
+{
+	uint32_t q = 15 - nlen, mac[4], a[4], ks[4], x[4];
+	uint8_t * m = (uint8_t *)mac, * ac = (uint8_t *)a, * kb = (uint8_t *)ks;
+	if( nlen < 7 || nlen > 13 || tlen < 4 || tlen > 16 || ( tlen & 1 ) || ( q < 4 && len >> 8 * q ) ) return -1;
+
+	_aes_engine e;
+	_aes_begin( &e, ctx, AES_ENCRYPT );
+
+	// B0: flags, nonce, length
+	memset( mac, 0, 16 );
+	m[0] = ( alen ? 0x40 : 0 ) | ( tlen - 2 ) / 2 << 3 | ( q - 1 );
+	memcpy( m + 1, nonce, nlen );
+	for( uint32_t i = 0; i < q && i < 4; i++ ) m[15 - i] = len >> 8 * i;
+	_aes_block( &e, mac );
+
+	if( alen )
+	{
+		uint8_t l[6] = { 0xff, 0xfe, alen >> 24, alen >> 16, alen >> 8, alen };
+		uint32_t pos = alen < 0xff00 ? _aes_mac( &e, mac, 0, l + 4, 2 ) : _aes_mac( &e, mac, 0, l, 6 );
+		if( _aes_mac( &e, mac, pos, adata, alen ) ) _aes_block( &e, mac );
+	}
+
+	// A0, its block masks the tag, A1 on are the keystream
+	memset( a, 0, 16 );
+	ac[0] = q - 1;
+	memcpy( ac + 1, nonce, nlen );
+	memcpy( tag, a, 16 );
+	_aes_block( &e, tag );
+
+	while( len )
+	{
+		_aes_ctr_next( ac );
+		memcpy( ks, a, 16 );
+		_aes_block( &e, ks );
+		if( len >= 16 )
+		{
+			_aes_get( in, x );
+			if( !dec ) _aes_xor( mac, x );
+			_aes_xor( x, ks );
+			if( dec ) _aes_xor( mac, x );
+			_aes_put( out, x );
+			in += 16;
+			out += 16;
+			len -= 16;
+		}
+		else
+		{
+			for( uint32_t i = 0; i < len; i++ )
+			{
+				uint8_t p = in[i], c = p ^ kb[i];
+				out[i] = c;
+				m[i] ^= dec ? c : p;
+			}
+			len = 0;
+		}
+		_aes_block( &e, mac );
+	}
+
+	_aes_xor( tag, mac );
+	return 0;
+}
+
+static int aes_ccm_encrypt( const aes_ctx * ctx, const void * nonce, uint32_t nlen, const void * adata, uint32_t alen,
+	const void * in, void * out, uint32_t len, void * tag, uint32_t tlen )
+{
+	uint32_t t[4];
+	if( _aes_ccm( ctx, 0, nonce, nlen, adata, alen, in, out, len, tlen, t ) ) return -1;
+	memcpy( tag, t, tlen );
+	return 0;
+}
+
+// 0 if the tag is right. If not, or the sizes are wrong, -1, with out zeroed
+// so no unauthenticated plaintext gets out. The tag compare takes as long
+// right or wrong.
+static int aes_ccm_decrypt( const aes_ctx * ctx, const void * nonce, uint32_t nlen, const void * adata, uint32_t alen,
+	const void * in, void * out, uint32_t len, const void * tag, uint32_t tlen )
+{
+	uint32_t t[4];
+	uint8_t diff = 0;
+	const uint8_t * want = tag, * got = (const uint8_t *)t;
+	if( _aes_ccm( ctx, 1, nonce, nlen, adata, alen, in, out, len, tlen, t ) )
+	{
+		memset( out, 0, len );
+		return -1;
+	}
+	for( uint32_t i = 0; i < tlen; i++ ) diff |= got[i] ^ want[i];
+	if( !diff ) return 0;
+	memset( out, 0, len );
+	return -1;
+}
+
+#endif
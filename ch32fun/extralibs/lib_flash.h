@@ -0,0 +1,94 @@
+#ifndef _LIB_FLASH_H
+#define _LIB_FLASH_H
+
+/** Programming the internal flash of the ch32v003, v00x, x035, v20x and
+	v30x: half words in the standard programming mode and fast page erases,
+	all of it blocking. lib_kvstore.h and lib_msc.h write through this.
+
+	IFlashProgram( addr, data, len )   len even. Half words that already
+	                                   hold the value are skipped, the rest
+	                                   are programmed and read back. 0, or
+	                                   -1 on a protection error or a half
+	                                   word that didn't take.
+	IFlashErase( addr, len )           IFLASH_PAGE pages from addr, both
+	                                   multiples of it. 0 or -1.
+
+	Keep the linker away from what's written, and don't run from the flash
+	page being changed.
+
+	IFLASH_PAGE is the fast page erase, 64 bytes on the ch32v003 and 256
+	everywhere else. IFLASH_ERASED is what an erased word reads back as:
+	0xe339e339 on the ch32v20x and v30x (that's what WCH's FLASH examples
+	check for), 0xffffffff on the others. A half word reading back as
+	IFLASH_ERASED can be programmed to anything. Programming 0x0000 over
+	one that's already programmed works too.
+*/
+
+#include <stdint.h>
+
+#ifndef IFLASH_PAGE
+#if defined( CH32V003 )
+#define IFLASH_PAGE 64
+#else
+#define IFLASH_PAGE 256
+#endif
+#endif
+
+#ifndef IFLASH_ERASED
+#if defined( CH32V20x ) || defined( CH32V30x )
+#define IFLASH_ERASED 0xe339e339
+#else
+#define IFLASH_ERASED 0xffffffff
+#endif
+#endif
+
+static void iflash_unlock( void )
+{
+	FLASH->KEYR = FLASH_KEY1;
+	FLASH->KEYR = FLASH_KEY2;
+	FLASH->MODEKEYR = FLASH_KEY1;
+	FLASH->MODEKEYR = FLASH_KEY2;
+}
+
+static int iflash_done( void )
+{
+	while( FLASH->STATR & FLASH_STATR_BSY );
+	int err = FLASH->STATR & FLASH_STATR_WRPRTERR;
+	FLASH->STATR = FLASH_STATR_EOP | FLASH_STATR_WRPRTERR;
+	return err ? -1 : 0;
+}
+
+static int IFlashProgram( uint32_t addr, const void * data, int len )
+{
+	const uint8_t * d = data;
+	int i, err = 0;
+	iflash_unlock();
+	FLASH->CTLR = CR_PG_Set;
+	for( i = 0; i < len && !err; i += 2 )
+	{
+		uint16_t v = d[i] | ( d[i + 1] << 8 );
+		if( *(volatile uint16_t *)( addr + i ) == v ) continue;
+		*(volatile uint16_t *)( addr + i ) = v;
+		err = iflash_done();
+		if( *(volatile uint16_t *)( addr + i ) != v ) err = -1;
+	}
+	FLASH->CTLR = CR_LOCK_Set;
+	return err;
+}
+
+static int IFlashErase( uint32_t addr, int len )
+{
+	int i, err = 0;
+	iflash_unlock();
+	for( i = 0; i < len && !err; i += IFLASH_PAGE )
+	{
+		FLASH->CTLR = CR_PAGE_ER;
+		FLASH->ADDR = addr + i;
+		FLASH->CTLR = CR_PAGE_ER | CR_STRT_Set;
+		err = iflash_done();
+	}
+	FLASH->CTLR = CR_LOCK_Set;
+	return err;
+}
+
+#endif
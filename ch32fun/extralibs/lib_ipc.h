@@ -0,0 +1,305 @@
+#ifndef _LIB_IPC_H
+#define _LIB_IPC_H
+
+/** Work sharing between the two cores of the CH32H41x. The V3F (hart 0)
+	runs main(), the V5F (hart 1) runs what StartV5F() gives it.
+
+	Both cores see the same image and the same .bss in the shared RAM, so
+	everything here is one struct there, `ipc`. In it:
+
+	- Two message rings per direction, one for jobs and one for the
+	  program's own messages. Each ring has one producer and one consumer,
+	  so it needs no lock. The producer only writes head and the consumer
+	  only writes tail, with a fence between the slot and the index.
+	- Jobs: IPCSubmit() queues fn( arg ) for the other core. That core runs
+	  its jobs in order, in IPCPoll(), and counts them. A job is done when
+	  the count passes its ticket.
+	- Locks for anything else that's shared. With exactly two cores
+	  Peterson's algorithm is enough, loads and stores and fences, no
+	  atomics or hardware semaphore needed.
+
+	Usage:
+
+	#include "lib_ipc.h"
+
+	static int v5f_entry( void )
+	{
+		while( 1 ) IPCPoll();      // or IPCServe()
+	}
+
+	int main()
+	{
+		SystemInit();
+		IPCInit();                 // before the V5F starts
+		StartV5F( v5f_entry );
+
+		uint32_t t = IPCSubmit( work, &args_b );   // runs on the V5F
+		work( &args_a );                         // this half here
+		IPCWait( t );
+	}
+
+	Messages: IPCSend( &msg ) / IPCRecv( &msg ), 0 or -1 if full / empty,
+	to and from the other core. Locks: static ipc_lock_t l; IPCLock( &l );
+	IPCUnlock( &l ).
+
+	Hooks, define before including:
+
+	IPC_DOORBELL( core )       Ring the other core after a ring got
+	                           something, e.g. through an IPC channel. Its
+	                           IPC_CHx_Handler() then calls IPCPoll().
+	                           Without it the other core has to poll.
+	IPC_IDLE()                 What IPCWait() and IPCServe() do while
+	                           waiting, e.g. wfi with a doorbell. If both
+	                           cores submit jobs to each other, make it
+	                           IPCPoll(), or they can wait on each other.
+	IPC_SPIN()                 What IPCLock() does while it waits.
+	IPC_HSEM_TAKE( n ) / IPC_HSEM_RELEASE( n )
+	                           Use hardware semaphore n for a lock (its
+	                           `sem`) instead of Peterson. TAKE is
+	                           nonzero when it got it.
+	IPC_CACHE_WB( addr, len ) / IPC_CACHE_INV( addr, len )
+	                           Write back / drop cached lines, for a core
+	                           that caches the shared RAM. The rings keep
+	                           what each side writes on its own line, the
+	                           Peterson locks don't and need the lock in
+	                           memory both see the same (or the HSEM).
+	IPC_SHARED_ATTR            Attributes for `ipc`, e.g. a section the
+	                           linker script puts in memory the V5F
+	                           doesn't cache.
+
+	ch32fun has no register map for the HSEM and IPC blocks yet, so none
+	of these has a default beyond a fence. setup_cache() turns on the
+	V5F's D-cache, and ch32fun has no cache operation that is known to
+	work yet (the one setup_cache() writes doesn't clear it), so with the
+	defaults the rings, counts and locks are only coherent while the V5F
+	doesn't cache `ipc`: keep it uncached with IPC_SHARED_ATTR, or define
+	IPC_CACHE_WB / IPC_CACHE_INV with a sequence checked on the part.
+
+	IPCCacheWriteback() and IPCCacheInvalidate() are for the program's own
+	buffers that go through jobs: write back before IPCSubmit(), invalidate
+	before reading results.
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#ifndef IPC_RING_LEN
+#define IPC_RING_LEN 16  // power of 2
+#endif
+
+#ifndef IPC_LINE
+#define IPC_LINE 32      // keeps the indices of either side on their own cache line
+#endif
+
+#ifndef IPC_FENCE
+#define IPC_FENCE() asm volatile( "fence rw, rw" : : : "memory" )
+#endif
+
+#ifndef IPC_CORE
+#define IPC_CORE() ( { uint32_t _h; asm volatile( "csrr %0, mhartid" : "=r"( _h ) ); _h; } )
+#endif
+
+#ifndef IPC_DOORBELL
+#define IPC_DOORBELL( core )
+#endif
+
+#ifndef IPC_IDLE
+#define IPC_IDLE()
+#endif
+
+#ifndef IPC_SPIN
+#define IPC_SPIN()
+#endif
+
+#ifndef IPC_SHARED_ATTR
+#define IPC_SHARED_ATTR
+#endif
+
+#ifndef IPC_CACHE_WB
+#define IPC_CACHE_WB( addr, len ) IPC_FENCE()
+#endif
+
+#ifndef IPC_CACHE_INV
+#define IPC_CACHE_INV( addr, len ) IPC_FENCE()
+#endif
+
+typedef int ( *ipc_job_fn )( void * arg );
+
+typedef struct
+{
+	uintptr_t type;
+	uintptr_t arg[3];
+} ipc_msg_t;
+
+typedef struct
+{
+	volatile uint32_t head;                      // producer
+	uint8_t pad0[IPC_LINE - 4];
+	volatile uint32_t tail;                      // consumer
+	uint8_t pad1[IPC_LINE - 4];
+	ipc_msg_t slot[IPC_RING_LEN];
+} ipc_ring_t;
+
+typedef struct
+{
+	volatile uint8_t want[2];
+	volatile uint8_t turn;
+	uint8_t sem;                                 // with IPC_HSEM_TAKE
+} ipc_lock_t;
+
+typedef struct
+{
+	volatile uint32_t n;
+	volatile int result;                         // of the last job
+	uint8_t pad[IPC_LINE - 8];
+} ipc_count_t;
+
+struct ipc_shared
+{
+	ipc_ring_t jobs[2];                          // to core 0, to core 1
+	ipc_ring_t msgs[2];
+	ipc_count_t submitted[2];                    // by the other core
+	ipc_count_t done[2];                         // by the core that runs them
+};
+
+static struct ipc_shared ipc IPC_SHARED_ATTR __attribute__((aligned(IPC_LINE)));
+
+static int IPCPoll( void );
+
+static void IPCInit( void )
+{
+	memset( (void *)&ipc, 0, sizeof( ipc ) );
+	IPC_CACHE_WB( &ipc, sizeof( ipc ) );
+}
+
+static inline void IPCCacheWriteback( const volatile void * addr, int len )
+{
+	IPC_CACHE_WB( addr, len );
+}
+
+static inline void IPCCacheInvalidate( const volatile void * addr, int len )
+{
+	IPC_CACHE_INV( addr, len );
+}
+
+static int ipc_put( ipc_ring_t * r, const ipc_msg_t * m, int to )
+{
+	uint32_t h = r->head;
+	IPC_CACHE_INV( &r->tail, 4 );
+	if( h - r->tail >= IPC_RING_LEN ) return -1;
+	r->slot[h & ( IPC_RING_LEN - 1 )] = *m;
+	IPC_CACHE_WB( &r->slot[h & ( IPC_RING_LEN - 1 )], sizeof( *m ) );
+	IPC_FENCE();                                 // the slot before the index
+	r->head = h + 1;
+	IPC_CACHE_WB( &r->head, 4 );
+	IPC_DOORBELL( to );
+	return 0;
+}
+
+static int ipc_get( ipc_ring_t * r, ipc_msg_t * m )
+{
+	uint32_t t = r->tail;
+	IPC_CACHE_INV( &r->head, 4 );
+	if( t == r->head ) return -1;
+	IPC_FENCE();                                 // the index before the slot
+	IPC_CACHE_INV( &r->slot[t & ( IPC_RING_LEN - 1 )], sizeof( *m ) );
+	*m = r->slot[t & ( IPC_RING_LEN - 1 )];
+	IPC_FENCE();                                 // done with the slot before giving it back
+	r->tail = t + 1;
+	IPC_CACHE_WB( &r->tail, 4 );
+	return 0;
+}
+
+// To the other core. 0, or -1 if its ring is full.
+static int IPCSend( const ipc_msg_t * m )
+{
+	int to = IPC_CORE() ^ 1;
+	return ipc_put( &ipc.msgs[to], m, to );
+}
+
+// From the other core. 0, or -1 if nothing came.
+static int IPCRecv( ipc_msg_t * m )
+{
+	return ipc_get( &ipc.msgs[IPC_CORE()], m );
+}
+
+// Queues fn( arg ) for the other core. Returns the ticket for IPCDone() /
+// IPCWait(), spins (IPC_IDLE()) while the job ring is full. Only one
+// thread of execution per core may submit.
+static uint32_t IPCSubmit( ipc_job_fn fn, void * arg )
+{
+	int to = IPC_CORE() ^ 1;
+	ipc_msg_t m = { (uintptr_t)fn, { (uintptr_t)arg, 0, 0 } };
+	while( ipc_put( &ipc.jobs[to], &m, to ) ) IPC_IDLE();
+	return ++ipc.submitted[to].n;
+}
+
+static inline int IPCDone( uint32_t ticket )
+{
+	int to = IPC_CORE() ^ 1;
+	IPC_CACHE_INV( &ipc.done[to], 8 );
+	return (int32_t)( ipc.done[to].n - ticket ) >= 0;
+}
+
+// Waits for a job. Returns what the other core's last job returned, which
+// is this one's if nothing was submitted after it.
+static int IPCWait( uint32_t ticket )
+{
+	while( !IPCDone( ticket ) ) IPC_IDLE();
+	IPC_FENCE();
+	return ipc.done[IPC_CORE() ^ 1].result;
+}
+
+// Runs the jobs queued for this core. Returns how many.
+static int IPCPoll( void )
+{
+	int me = IPC_CORE();
+	int n = 0;
+	ipc_msg_t m;
+	while( ipc_get( &ipc.jobs[me], &m ) == 0 )
+	{
+		ipc_job_fn fn = (ipc_job_fn)m.type;
+		ipc.done[me].result = fn( (void *)m.arg[0] );
+		IPC_FENCE();                             // the job's writes before done
+		ipc.done[me].n++;
+		IPC_CACHE_WB( &ipc.done[me], 8 );
+		n++;
+	}
+	return n;
+}
+
+static void IPCServe( void )
+{
+	while( 1 )
+	{
+		if( !IPCPoll() ) IPC_IDLE();
+	}
+}
+
+static void IPCLock( ipc_lock_t * l )
+{
+#ifdef IPC_HSEM_TAKE
+	while( !IPC_HSEM_TAKE( l->sem ) ) IPC_SPIN();
+#else
+	int me = IPC_CORE();
+	l->want[me] = 1;
+	IPC_FENCE();                                 // want, then turn, then look
+	l->turn = me ^ 1;
+	IPC_FENCE();
+	while( l->want[me ^ 1] && l->turn != me ) IPC_SPIN();
+	IPC_FENCE();
+#endif
+}
+
+static void IPCUnlock( ipc_lock_t * l )
+{
+#ifdef IPC_HSEM_TAKE
+	IPC_FENCE();
+	IPC_HSEM_RELEASE( l->sem );
+#else
+	IPC_FENCE();
+	l->want[IPC_CORE()] = 0;
+#endif
+}
+
+#endif
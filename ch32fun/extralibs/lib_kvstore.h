@@ -0,0 +1,510 @@
+#ifndef _LIB_KVSTORE_H
+#define _LIB_KVSTORE_H
+
+/** Key / value store for settings and calibration, in a few flash sectors.
+
+	Records are only ever appended: a new value for a key goes after the
+	old one, a delete appends a tombstone. Every record carries a CRC. At
+	mount the log is scanned once, oldest sector first, into a RAM index
+	(2 bytes per key), after that a lookup is a table read. When the sectors
+	fill up the oldest one is compacted: its still current records are copied
+	to the head of the log and it's erased. Sectors get reused in a circle,
+	so they all wear the same, static values included.
+
+	Power can fail at any point. A record that didn't get all the way out
+	fails its CRC, the sector it's in isn't written to any more and the next
+	write opens a fresh one. A sector is marked dead before it's erased, so
+	a half erased one is just erased again at mount.
+
+	Usage:
+
+	#define KV_FLASH_BASE 0x08003000  // the last 4 kB of a ch32v003, keep the linker away from it
+	#define KV_SECTORS    4         // of KV_SECTOR_SIZE, 1 kB
+	#include "lib_kvstore.h"
+
+	KVMount();
+	KVSet( KEY_CAL, &cal, sizeof( cal ) );
+	if( KVGet( KEY_CAL, &cal, sizeof( cal ) ) != sizeof( cal ) ) ...  // -1 if not set
+	KVDelete( KEY_CAL );
+
+	// In the main loop, compacts ahead of time so KVSet() doesn't have to.
+	KVMaintain();
+
+	Keys are 0..KV_KEYS-1, values up to a sector less 24 bytes. Setting a
+	key to the value it already has doesn't write anything.
+
+	By default it's the internal flash of the ch32v003, v00x, x035, v20x and
+	v30x, through lib_flash.h. KV_SECTOR_SIZE has to be a multiple of its
+	IFLASH_PAGE. Erased flash reads back as KV_ERASED, IFLASH_ERASED there
+	and 0xffffffff for the other backends.
+
+	On the CH5xx it's the DataFlash through EEPROM_READ(), EEPROM_WRITE()
+	and EEPROM_ERASE() from WCH's libISPxxx.a. ch32fun doesn't ship that,
+	include its ISPxxx.h before this and link the library. KV_FLASH_BASE is
+	then an offset into the DataFlash, and a sector is marked dead by
+	erasing its first EEPROM_MIN_ER_SIZE page, not by programming over it.
+
+	For anything else (a host simulation), define KV_FLASH_READ( addr, buf,
+	len ), KV_FLASH_WRITE( addr, data, len ) (len even, returns < 0 on
+	error) and KV_FLASH_ERASE( addr ) (one KV_SECTOR_SIZE sector) before
+	including this. KV_FLASH_WRITE() has to be able to program 0x0000 over a
+	half word that's already programmed, that's how sectors are marked dead,
+	or define KV_FLASH_KILL( addr ) to do it some other way.
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#ifndef KV_FLASH_BASE
+#error "lib_kvstore: define KV_FLASH_BASE, sector aligned"
+#endif
+
+#ifndef KV_SECTOR_SIZE
+#define KV_SECTOR_SIZE 1024
+#endif
+
+#ifndef KV_SECTORS
+#define KV_SECTORS 4     // at least 3, one is always kept erased
+#endif
+
+#ifndef KV_KEYS
+#define KV_KEYS 32
+#endif
+
+#define KV_SECTOR_MAGIC 0x4b56534c  // "LSVK"
+#define KV_NONE         0xffff
+#define KV_TOMBSTONE    0x8000      // in len
+
+// At the start of every sector in use.
+typedef struct
+{
+	uint32_t magic;
+	uint32_t seq;     // higher is newer
+	uint32_t erases;  // of this sector, before this use
+	uint32_t crc;
+} KVSectorHeader;
+
+// Followed by the value, padded to 4 bytes.
+typedef struct
+{
+	uint16_t key;
+	uint16_t len;     // | KV_TOMBSTONE for a delete
+	uint32_t crc;     // of key, len and the value
+} KVRecordHeader;
+
+typedef struct
+{
+	uint32_t writes;       // records written, compaction copies included
+	uint32_t copies;       // records moved by compaction
+	uint32_t erases;       // sector erases
+	uint32_t erases_min;   // over all sectors, from their headers
+	uint32_t erases_max;
+	int free_sectors;
+	int live_bytes;        // records the index points at
+} KVStats;
+
+#if ( KV_SECTORS * KV_SECTOR_SIZE ) >= 0x40000
+#error "lib_kvstore: the index only reaches 256kB"
+#endif
+
+#if defined( KV_FLASH_READ ) && defined( KV_FLASH_WRITE ) && defined( KV_FLASH_ERASE )
+
+// The program's own.
+
+#elif defined( CH5xx )
+
+#ifndef EEPROM_READ
+#error "lib_kvstore: include WCH's ISPxxx.h (EEPROM_READ/WRITE/ERASE) first"
+#endif
+
+#if KV_SECTOR_SIZE % EEPROM_MIN_ER_SIZE
+#error "lib_kvstore: KV_SECTOR_SIZE has to be a multiple of EEPROM_MIN_ER_SIZE"
+#endif
+
+#define KV_FLASH_READ( addr, buf, len ) EEPROM_READ( ( addr ), ( buf ), ( len ) )
+#define KV_FLASH_WRITE( addr, data, len ) ( EEPROM_WRITE( ( addr ), (void *)( data ), ( len ) ) ? -1 : 0 )
+#define KV_FLASH_ERASE( addr ) ( EEPROM_ERASE( ( addr ), KV_SECTOR_SIZE ) ? -1 : 0 )
+#define KV_FLASH_KILL( addr ) EEPROM_ERASE( ( addr ), EEPROM_MIN_ER_SIZE )
+
+#else
+
+#include "lib_flash.h"
+
+#define KV_FLASH_READ( addr, buf, len ) memcpy( ( buf ), (const void *)( addr ), ( len ) )
+#define KV_FLASH_WRITE( addr, data, len ) IFlashProgram( ( addr ), ( data ), ( len ) )
+#define KV_FLASH_ERASE( addr ) IFlashErase( ( addr ), KV_SECTOR_SIZE )
+
+#if KV_SECTOR_SIZE % IFLASH_PAGE
+#error "lib_kvstore: KV_SECTOR_SIZE has to be a multiple of IFLASH_PAGE"
+#endif
+
+#ifndef KV_ERASED
+#define KV_ERASED IFLASH_ERASED
+#endif
+
+#endif
+
+#ifndef KV_ERASED
+#define KV_ERASED 0xffffffff
+#endif
+
+#ifndef KV_FLASH_KILL
+#define KV_FLASH_KILL( addr ) kv_kill( addr )
+
+static void kv_kill( uint32_t addr )
+{
+	uint16_t zero = 0;
+	KV_FLASH_WRITE( addr, &zero, 2 );
+}
+#endif
+
+static uint16_t kv_index[KV_KEYS];       // record offset in the region / 4
+static uint8_t kv_order[KV_SECTORS];     // sectors in use, oldest first
+static uint32_t kv_erases[KV_SECTORS];
+static int kv_used;                      // entries in kv_order, the last is the head
+static uint32_t kv_head;                 // write offset in the head sector
+static uint32_t kv_seq;
+static uint32_t kv_gc_off;               // compaction progress in kv_order[0]
+static KVStats kv_stats;
+
+static uint32_t kv_crc( uint32_t crc, const void * data, int len )
+{
+	static const uint32_t t[16] = {
+		0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+		0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c };
+	const uint8_t * p = data;
+	crc = ~crc;
+	while( len-- )
+	{
+		crc ^= *p++;
+		crc = ( crc >> 4 ) ^ t[crc & 15];
+		crc = ( crc >> 4 ) ^ t[crc & 15];
+	}
+	return ~crc;
+}
+
+static uint32_t kv_addr( int sector, uint32_t off )
+{
+	return KV_FLASH_BASE + sector * KV_SECTOR_SIZE + off;
+}
+
+static int kv_padded( int len )
+{
+	return sizeof( KVRecordHeader ) + ( ( len + 3 ) & ~3 );
+}
+
+static int kv_free( void )
+{
+	return KV_SECTORS - kv_used;
+}
+
+// 1 if the sector is erased from off to the end.
+static int kv_blank( int sector, uint32_t off )
+{
+	uint32_t buf[8];
+	int i, n;
+	for( ; off < KV_SECTOR_SIZE; off += n )
+	{
+		n = KV_SECTOR_SIZE - off < sizeof( buf ) ? KV_SECTOR_SIZE - off : sizeof( buf );
+		KV_FLASH_READ( kv_addr( sector, off ), buf, n );
+		for( i = 0; i < n / 4; i++ )
+			if( buf[i] != KV_ERASED ) return 0;
+	}
+	return 1;
+}
+
+// Reads and checks the record at off, returns its size or 0 at the end of
+// the sector (erased, or didn't get written completely).
+static int kv_record( int sector, uint32_t off, KVRecordHeader * h )
+{
+	uint8_t buf[32];
+	int len, done, n;
+	uint32_t crc;
+
+	if( off + sizeof( *h ) > KV_SECTOR_SIZE ) return 0;
+	KV_FLASH_READ( kv_addr( sector, off ), h, sizeof( *h ) );
+	len = h->len & ~KV_TOMBSTONE;
+	if( h->key >= KV_KEYS || off + kv_padded( len ) > KV_SECTOR_SIZE ) return 0;
+
+	crc = kv_crc( 0, h, 4 );
+	for( done = 0; done < len; done += n )
+	{
+		n = len - done < (int)sizeof( buf ) ? len - done : (int)sizeof( buf );
+		KV_FLASH_READ( kv_addr( sector, off + sizeof( *h ) + done ), buf, n );
+		crc = kv_crc( crc, buf, n );
+	}
+	return crc == h->crc ? kv_padded( len ) : 0;
+}
+
+static int kv_erase( int sector )
+{
+	KVSectorHeader h;
+
+	// Dead before the erase starts, so half an erase can't bring old
+	// records back.
+	KV_FLASH_READ( kv_addr( sector, 0 ), &h, sizeof( h ) );
+	if( h.magic == KV_SECTOR_MAGIC ) KV_FLASH_KILL( kv_addr( sector, 0 ) );
+
+	kv_stats.erases++;
+	kv_erases[sector]++;
+	return KV_FLASH_ERASE( kv_addr( sector, 0 ) );
+}
+
+// Starts a new head sector in the least worn erased one.
+static int kv_open( void )
+{
+	KVSectorHeader h;
+	int s, i, best = -1;
+
+	for( s = 0; s < KV_SECTORS; s++ )
+	{
+		for( i = 0; i < kv_used && kv_order[i] != s; i++ );
+		if( i == kv_used && ( best < 0 || kv_erases[s] < kv_erases[best] ) ) best = s;
+	}
+	if( best < 0 ) return -1;
+
+	h.magic = KV_SECTOR_MAGIC;
+	h.seq = ++kv_seq;
+	h.erases = kv_erases[best];
+	h.crc = kv_crc( 0, &h, 12 );
+	kv_order[kv_used++] = best;
+	kv_head = sizeof( h );
+	if( KV_FLASH_WRITE( kv_addr( best, 0 ), &h, sizeof( h ) ) < 0 )
+		kv_head = KV_SECTOR_SIZE; // move on next time
+	return 0;
+}
+
+// Appends a record, the value from RAM at data or else from flash at src.
+//
+// reserve is how many erased sectors a new head can't take. User writes
+// keep one back for compaction, and don't write at all while compaction
+// has it (it's then the head, holding copies of the oldest sector only,
+// mount relies on that).
+static int kv_put( const KVRecordHeader * h, const uint8_t * data, uint32_t src, int reserve )
+{
+	uint8_t buf[32];
+	int vlen = h->len & ~KV_TOMBSTONE;
+	int size = kv_padded( vlen );
+	int done, n;
+	uint32_t a;
+
+	if( kv_free() < reserve ) return -1;
+	if( !kv_used || kv_head + size > KV_SECTOR_SIZE )
+	{
+		if( kv_free() <= reserve || kv_open() < 0 ) return -1;
+		if( kv_head + size > KV_SECTOR_SIZE ) return -1;
+	}
+
+	a = kv_addr( kv_order[kv_used - 1], kv_head );
+	kv_head += size;
+	kv_stats.writes++;
+
+	// Value first, the header going in last makes it count.
+	for( done = 0; done < vlen; done += n )
+	{
+		n = vlen - done < (int)sizeof( buf ) ? vlen - done : (int)sizeof( buf );
+		if( data ) memcpy( buf, data + done, n );
+		else KV_FLASH_READ( src + done, buf, n );
+		while( n & 3 ) buf[n++] = 0xff;
+		if( KV_FLASH_WRITE( a + sizeof( *h ) + done, buf, n ) < 0 ) goto fail;
+	}
+	if( KV_FLASH_WRITE( a, h, sizeof( *h ) ) < 0 ) goto fail;
+
+	kv_index[h->key] = ( h->len & KV_TOMBSTONE ) ? KV_NONE : ( a - KV_FLASH_BASE ) / 4;
+	return 0;
+fail:
+	kv_head = KV_SECTOR_SIZE; // nothing goes after a broken record
+	return -1;
+}
+
+// One step of compacting the oldest sector: move one live record, or erase
+// it once there are none left. Returns 0 when there's nothing to do.
+static int kv_gc_step( void )
+{
+	KVRecordHeader h;
+	int sector, size, i;
+
+	if( kv_used < 2 ) return 0;
+	sector = kv_order[0];
+
+	while( ( size = kv_record( sector, kv_gc_off, &h ) ) )
+	{
+		uint32_t here = kv_addr( sector, kv_gc_off );
+		kv_gc_off += size;
+		// Only what the index still points at. Tombstones can go, there's
+		// nothing older than this sector for them to hide.
+		if( kv_index[h.key] != ( here - KV_FLASH_BASE ) / 4 ) continue;
+		if( kv_put( &h, 0, here + sizeof( h ), 0 ) < 0 ) return -1;
+		kv_stats.copies++;
+		return 1;
+	}
+
+	for( i = 1; i < kv_used; i++ )
+		kv_order[i - 1] = kv_order[i];
+	kv_used--;
+	kv_gc_off = sizeof( KVSectorHeader );
+	kv_erase( sector );
+	return 1;
+}
+
+// Scans the sectors and builds the index. Finishes off whatever a power
+// failure interrupted. Returns -1 if an erase fails.
+static int KVMount( void )
+{
+	KVSectorHeader h;
+	KVRecordHeader r;
+	uint32_t seqs[KV_SECTORS];
+	int s, i, size;
+
+again:
+	memset( kv_index, 0xff, sizeof( kv_index ) );
+	kv_used = 0;
+	kv_seq = 0;
+
+	for( s = 0; s < KV_SECTORS; s++ )
+	{
+		KV_FLASH_READ( kv_addr( s, 0 ), &h, sizeof( h ) );
+		if( h.magic == KV_SECTOR_MAGIC && h.crc == kv_crc( 0, &h, 12 ) )
+		{
+			// Insert by sequence number, oldest first.
+			for( i = kv_used; i > 0 && seqs[i - 1] > h.seq; i-- )
+			{
+				seqs[i] = seqs[i - 1];
+				kv_order[i] = kv_order[i - 1];
+			}
+			seqs[i] = h.seq;
+			kv_order[i] = s;
+			kv_used++;
+			kv_erases[s] = h.erases;
+			if( h.seq > kv_seq ) kv_seq = h.seq;
+			continue;
+		}
+
+		// Not erased all the way is as good as dead.
+		if( !kv_blank( s, 0 ) && kv_erase( s ) < 0 ) return -1;
+	}
+
+	for( i = 0; i < kv_used; i++ )
+	{
+		s = kv_order[i];
+		kv_head = sizeof( h );
+		while( ( size = kv_record( s, kv_head, &r ) ) )
+		{
+			kv_index[r.key] = ( r.len & KV_TOMBSTONE ) ? KV_NONE : ( kv_addr( s, kv_head ) - KV_FLASH_BASE ) / 4;
+			kv_head += size;
+		}
+	}
+
+	// Don't append over a record that didn't make it.
+	if( kv_used && !kv_blank( kv_order[kv_used - 1], kv_head ) )
+		kv_head = KV_SECTOR_SIZE;
+
+	// Compaction was copying into the last erased sector and got cut off
+	// there, the rest of the oldest sector won't fit any more. Everything in
+	// the newest is still in the oldest, start the copy over.
+	if( !kv_free() && kv_head == KV_SECTOR_SIZE )
+	{
+		if( kv_erase( kv_order[kv_used - 1] ) < 0 ) return -1;
+		goto again;
+	}
+	kv_gc_off = sizeof( h );
+	return 0;
+}
+
+// Length of the value, copied to buf up to maxlen bytes (nothing with buf
+// 0 or maxlen 0). -1 if not set.
+static int KVGet( int key, void * buf, int maxlen )
+{
+	KVRecordHeader h;
+	uint32_t a;
+
+	if( key < 0 || key >= KV_KEYS || kv_index[key] == KV_NONE ) return -1;
+	a = KV_FLASH_BASE + kv_index[key] * 4;
+	KV_FLASH_READ( a, &h, sizeof( h ) );
+	if( buf && maxlen > 0 )
+		KV_FLASH_READ( a + sizeof( h ), buf, h.len < maxlen ? h.len : maxlen );
+	return h.len;
+}
+
+static int kv_write( int key, int len, const uint8_t * data )
+{
+	KVRecordHeader h;
+	int i;
+
+	h.key = key;
+	h.len = len;
+	h.crc = kv_crc( kv_crc( 0, &h, 4 ), data, len & ~KV_TOMBSTONE );
+
+	// Compact until it fits, gives up once that's gone round all the
+	// sectors without making room.
+	for( i = 0; i < KV_SECTORS * ( KV_SECTOR_SIZE / (int)sizeof( h ) + 1 ); i++ )
+	{
+		if( kv_put( &h, data, 0, 1 ) == 0 ) return 0;
+		if( kv_gc_step() <= 0 ) return -1;
+	}
+	return -1;
+}
+
+// Returns 0, or -1 if it doesn't fit.
+static int KVSet( int key, const void * data, int len )
+{
+	uint8_t cur[32];
+	int same, done, n;
+
+	if( key < 0 || key >= KV_KEYS || len < 0 || len >= KV_TOMBSTONE ||
+		kv_padded( len ) > KV_SECTOR_SIZE - (int)sizeof( KVSectorHeader ) )
+		return -1;
+
+	// Nothing to do if it's not changing.
+	if( KVGet( key, 0, 0 ) == len )
+	{
+		uint32_t a = KV_FLASH_BASE + kv_index[key] * 4 + sizeof( KVRecordHeader );
+		for( same = 1, done = 0; same && done < len; done += n )
+		{
+			n = len - done < (int)sizeof( cur ) ? len - done : (int)sizeof( cur );
+			KV_FLASH_READ( a + done, cur, n );
+			same = !memcmp( cur, (const uint8_t *)data + done, n );
+		}
+		if( same ) return 0;
+	}
+	return kv_write( key, len, data );
+}
+
+static int KVDelete( int key )
+{
+	if( key < 0 || key >= KV_KEYS ) return -1;
+	if( kv_index[key] == KV_NONE ) return 0;
+	return kv_write( key, KV_TOMBSTONE, 0 );
+}
+
+// Call when there's time. While only one erased sector is left, compacts
+// the oldest a record at a time so KVSet() doesn't have to. Returns 1 if it
+// did something.
+static int KVMaintain( void )
+{
+	if( kv_free() > 1 ) return 0;
+	return kv_gc_step() > 0;
+}
+
+static void KVGetStats( KVStats * s )
+{
+	int i;
+	*s = kv_stats;
+	s->free_sectors = kv_free();
+	s->erases_min = s->erases_max = kv_erases[0];
+	for( i = 1; i < KV_SECTORS; i++ )
+	{
+		if( kv_erases[i] < s->erases_min ) s->erases_min = kv_erases[i];
+		if( kv_erases[i] > s->erases_max ) s->erases_max = kv_erases[i];
+	}
+	s->live_bytes = 0;
+	for( i = 0; i < KV_KEYS; i++ )
+	{
+		KVRecordHeader h;
+		if( kv_index[i] == KV_NONE ) continue;
+		KV_FLASH_READ( KV_FLASH_BASE + kv_index[i] * 4, &h, sizeof( h ) );
+		s->live_bytes += kv_padded( h.len );
+	}
+}
+
+#endif
@@ -0,0 +1,1141 @@
+#ifndef _LIB_MSC_H
+#define _LIB_MSC_H
+
+/** USB mass storage device: Bulk-Only Transport and the SCSI commands
+	Windows, Linux and macOS use, over flash.
+
+	The host sees MSC_BLOCKS blocks of 512 bytes. Behind them is a cache of
+	MSC_LINES lines, each one erase unit of the flash (at least 512 bytes):
+
+	- A block that isn't cached brings in its whole line with one
+	  MSC_BD_READ(), that's the read ahead. While a READ(10) is sent from
+	  one line the next one is fetched, and after a READ(10) the line where
+	  the next one would start.
+	- Writes land in the line and are combined there. A line goes out when a
+	  write runs past its end, when its slot is needed, on SYNCHRONIZE CACHE
+	  and once the host has been quiet for MSC_FLUSH_TICKS. Going out is an
+	  erase and the pages that don't read as erased (MSC_BD_ERASED). If
+	  the new data only clears bits of what's on the flash (NOR), or only
+	  goes into erased half words (internal flash), it's just the pages
+	  that changed, no erase. Data the host rewrites unchanged isn't
+	  written at all.
+	- MSCPoll() starts one flash operation per call. With a flash that
+	  works in the background (an SPI NOR, see MSC_BD_BUSY()) the USB
+	  interrupt keeps receiving into the next line while a page programs,
+	  the OUT endpoint only NAKs when no line is free.
+
+	Writes are acknowledged once they're in the cache. The caching mode page
+	says so (WCE), so Linux and macOS send SYNCHRONIZE CACHE before they
+	let go of the disk. Windows doesn't, MSC_FLUSH_TICKS covers that.
+
+	Usage, with fsusb.h or hsusb.h, and an interface of class 8, subclass 6,
+	protocol 0x50 with bulk endpoints MSC_EP_IN and MSC_EP_OUT:
+
+	#define MSC_BLOCKS 4096
+	#include "lib_msc.h"
+
+	int HandleSetupCustom( struct _USBState * ctx, int setup_code )
+	{
+		return MSCHandleSetup( ctx, setup_code );
+	}
+	int HandleInRequest( struct _USBState * ctx, int endp, uint8_t * data, int len )
+	{
+		return endp == MSC_EP_IN ? MSCTx( data ) : 0;
+	}
+	void HandleDataOut( struct _USBState * ctx, int endp, uint8_t * data, int len )
+	{
+		if( endp == MSC_EP_OUT ) MSCRx( data, len );
+		...
+	}
+
+	while( 1 ) MSCPoll();
+
+	The flash, byte addresses from MSC_BD_BASE, define all of them or none:
+
+	MSC_BD_READ( addr, buf, len )      < 0 on error
+	MSC_BD_PROGRAM( addr, data, len )  one MSC_BD_PAGE_SIZE page
+	MSC_BD_ERASE( addr )               one MSC_BD_ERASE_SIZE unit
+	MSC_BD_BUSY()                      > 0 while a program or erase is still
+	                                   running, < 0 once if it failed
+
+	PROGRAM and ERASE may return before they're done, MSCPoll() doesn't touch
+	the flash again until MSC_BD_BUSY() says it's idle. The data passed to
+	PROGRAM stays put until then. MSC_BD_ERASED is what an erased word
+	reads back as, 0xffffffff unless defined. Without them it's the
+	internal flash of the ch32v20x, v30x, x035 and the other parts with
+	that controller, through lib_flash.h: memory mapped reads, half word
+	programming and 256 byte erase units, all of it blocking, and
+	MSC_BD_ERASED is IFLASH_ERASED (0xe339e339 on the v20x and v30x).
+	MSC_BD_BASE is a flash address then, keep the linker away from it.
+
+	Without fsusb.h or hsusb.h (a host simulation, another USB stack), the
+	endpoint side is MSC_IN_BUF, MSC_IN_READY(), MSC_IN_SEND( len ),
+	MSC_IN_STALL(), MSC_IN_HALTED(), MSC_OUT_ACK(), MSC_OUT_NAK(),
+	MSC_OUT_STALL(), MSC_LOCK() and MSC_UNLOCK(), see below what they do.
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#ifndef MSC_BLOCKS
+#error "lib_msc: define MSC_BLOCKS, the disk size in 512 byte blocks"
+#endif
+
+#ifndef MSC_BD_BASE
+#define MSC_BD_BASE 0
+#endif
+
+#if !defined( MSC_BD_READ ) || !defined( MSC_BD_PROGRAM ) || !defined( MSC_BD_ERASE )
+#include "lib_flash.h"
+#define MSC_BD_INTERNAL 1
+#ifndef MSC_BD_ERASED
+#define MSC_BD_ERASED IFLASH_ERASED
+#endif
+#ifndef MSC_BD_ERASE_SIZE
+#define MSC_BD_ERASE_SIZE 256
+#endif
+#ifndef MSC_BD_PAGE_SIZE
+#define MSC_BD_PAGE_SIZE 256
+#endif
+#ifndef MSC_BD_CLEAR_BITS
+#define MSC_BD_CLEAR_BITS 0     // no reprogramming a programmed half word
+#endif
+#else
+#define MSC_BD_INTERNAL 0
+#ifndef MSC_BD_ERASE_SIZE
+#define MSC_BD_ERASE_SIZE 4096  // SPI NOR sector
+#endif
+#ifndef MSC_BD_PAGE_SIZE
+#define MSC_BD_PAGE_SIZE 256
+#endif
+#ifndef MSC_BD_CLEAR_BITS
+#define MSC_BD_CLEAR_BITS 1     // programming may clear more bits of a page
+#endif
+#endif
+
+#ifndef MSC_BD_BUSY
+#define MSC_BD_BUSY() 0
+#endif
+
+#ifndef MSC_BD_ERASED
+#define MSC_BD_ERASED 0xffffffff  // what an erased word reads back as
+#endif
+
+#ifndef MSC_LINES
+#define MSC_LINES 3     // at least 1, 2 to overlap the flash with USB
+#endif
+
+#if MSC_BD_ERASE_SIZE > 512
+#define MSC_LINE_SIZE MSC_BD_ERASE_SIZE
+#else
+#define MSC_LINE_SIZE 512
+#endif
+#define MSC_LINE_BLOCKS ( MSC_LINE_SIZE / 512 )
+#define MSC_LINE_PAGES  ( MSC_LINE_SIZE / MSC_BD_PAGE_SIZE )
+#define MSC_ALL( n )    ( 0xffffffff >> ( 32 - ( n ) ) )
+
+#if MSC_LINE_BLOCKS > 32 || MSC_LINE_PAGES > 32
+#error "lib_msc: at most 32 blocks and 32 pages per erase unit"
+#endif
+
+#ifndef MSC_EP_IN
+#define MSC_EP_IN 1
+#endif
+#ifndef MSC_EP_OUT
+#define MSC_EP_OUT 2
+#endif
+
+// INQUIRY strings, padded with spaces
+#ifndef MSC_VENDOR
+#define MSC_VENDOR "ch32fun"
+#endif
+#ifndef MSC_PRODUCT
+#define MSC_PRODUCT "Flash disk"
+#endif
+#ifndef MSC_REVISION
+#define MSC_REVISION "1.0"
+#endif
+
+#ifndef MSC_READ_ONLY
+#define MSC_READ_ONLY 0
+#endif
+
+// Dirty lines go out after this long without a command.
+#ifndef MSC_TICKS
+#define MSC_TICKS() ( (uint32_t)SysTick->CNT )
+#endif
+#ifndef MSC_FLUSH_TICKS
+#define MSC_FLUSH_TICKS Ticks_from_Ms( 500 )
+#endif
+
+#if defined( _FSUSB_H )
+
+#ifndef MSC_PACKET
+#define MSC_PACKET 64
+#endif
+
+// fsusb's own send functions switch the USB interrupt back on, these run
+// with it off or inside it.
+static inline int msc_in_ready( void )
+{
+	if( USBFSCTX.USBFS_errata_dont_send_endpoint_in_window || USBFSCTX.USBFS_SetupReqLen > 0 ) return 0;
+#if defined( CH5xx ) || defined( CH32X03x )
+	if( USBFS->INT_ST & 0x80 ) return 0;  // RB_UIS_SETUP_ACT
+#endif
+	return 1;
+}
+
+#define MSC_IN_BUF        USBFSCTX.ENDPOINTS[MSC_EP_IN]
+#define MSC_IN_READY()    msc_in_ready()
+#define MSC_IN_SEND( n )  ( UEP_CTRL_LEN( MSC_EP_IN ) = ( n ), UEP_CTRL_TX( MSC_EP_IN ) = ( UEP_CTRL_TX( MSC_EP_IN ) & ~USBFS_UEP_T_RES_MASK ) | USBFS_UEP_T_RES_ACK )
+#define MSC_IN_STALL()    ( UEP_CTRL_TX( MSC_EP_IN ) = ( UEP_CTRL_TX( MSC_EP_IN ) & ~USBFS_UEP_T_RES_MASK ) | USBFS_UEP_T_RES_STALL )
+#define MSC_IN_HALTED()   ( ( UEP_CTRL_TX( MSC_EP_IN ) & USBFS_UEP_T_RES_MASK ) == USBFS_UEP_T_RES_STALL )
+#define MSC_OUT_ACK()     USBFS_SendACK( MSC_EP_OUT, 0 )
+#define MSC_OUT_NAK()     USBFS_SendNAK( MSC_EP_OUT, 0 )
+#define MSC_OUT_STALL()   ( UEP_CTRL_RX( MSC_EP_OUT ) = ( UEP_CTRL_RX( MSC_EP_OUT ) & ~USBFS_UEP_R_RES_MASK ) | USBFS_UEP_R_RES_STALL )
+#define MSC_LOCK()        NVIC_DisableIRQ( USB_IRQn )
+#define MSC_UNLOCK()      NVIC_EnableIRQ( USB_IRQn )
+#define MSC_SETUP_TYPE( ctx ) ( ( ctx )->USBFS_SetupReqType )
+
+#elif defined( _HSUSB_H ) && !defined( HUSB_CONFIG_EPS )
+
+#ifndef MSC_PACKET
+#define MSC_PACKET USBHS_UEP_SIZE
+#endif
+
+static inline int msc_in_ready( void )
+{
+	return !USBHSCTX.USBHS_errata_dont_send_endpoint_in_window && USBHSCTX.USBHS_SetupReqLen == 0;
+}
+
+#define MSC_IN_BUF        USBHSCTX.ENDPOINTS[MSC_EP_IN - 1]
+#define MSC_IN_READY()    msc_in_ready()
+#define MSC_IN_SEND( n )  ( UEP_CTRL_LEN( MSC_EP_IN ) = ( n ), UEP_CTRL_TX( MSC_EP_IN ) = ( UEP_CTRL_TX( MSC_EP_IN ) & ~USBHS_UEP_T_RES_MASK ) | USBHS_UEP_T_RES_ACK )
+#define MSC_IN_STALL()    ( UEP_CTRL_TX( MSC_EP_IN ) = ( UEP_CTRL_TX( MSC_EP_IN ) & ~USBHS_UEP_T_RES_MASK ) | USBHS_UEP_T_RES_STALL )
+#define MSC_IN_HALTED()   ( ( UEP_CTRL_TX( MSC_EP_IN ) & USBHS_UEP_T_RES_MASK ) == USBHS_UEP_T_RES_STALL )
+#define MSC_OUT_ACK()     USBHS_SendACK( MSC_EP_OUT, 0 )
+#define MSC_OUT_NAK()     USBHS_SendNAK( MSC_EP_OUT, 0 )
+#define MSC_OUT_STALL()   ( UEP_CTRL_RX( MSC_EP_OUT ) = ( UEP_CTRL_RX( MSC_EP_OUT ) & ~USBHS_UEP_R_RES_MASK ) | USBHS_UEP_R_RES_STALL )
+#define MSC_LOCK()        NVIC_DisableIRQ( USBHS_IRQn )
+#define MSC_UNLOCK()      NVIC_EnableIRQ( USBHS_IRQn )
+#define MSC_SETUP_TYPE( ctx ) ( ( ctx )->USBHS_SetupReqType )
+
+#elif !defined( MSC_IN_SEND )
+#error "lib_msc: include fsusb.h or hsusb.h first, or define the MSC_IN_ / MSC_OUT_ endpoint macros"
+#endif
+
+#if MSC_PACKET > 512 || ( 512 % MSC_PACKET )
+#error "lib_msc: packets have to divide the 512 byte block"
+#endif
+
+#define MSC_CBW_SIG 0x43425355
+#define MSC_CSW_SIG 0x53425355
+#define MSC_NO_LINE 0xffffffff
+
+// Where the transport is.
+#define MSC_IDLE     0  // waiting for a CBW
+#define MSC_DATA_IN  1
+#define MSC_DATA_OUT 2
+#define MSC_WAIT     3  // MSCPoll() sends the CSW (after a stall, or a SYNCHRONIZE CACHE)
+#define MSC_RESET    4  // bad CBW, stalled until the host resets the interface
+
+// What MSCTx() sends.
+#define MSC_TX_NONE 0
+#define MSC_TX_RESP 1   // msc.resp
+#define MSC_TX_READ 2   // blocks from the cache
+#define MSC_TX_CSW  3
+
+// Line states.
+#define MSC_CLEAN  0
+#define MSC_DIRTY  1    // changed
+#define MSC_QUEUED 2    // changed, goes out next
+#define MSC_FLUSH  3    // going out, no writes into it until it's done
+
+typedef struct
+{
+	uint32_t line;     // erase unit on the flash, MSC_NO_LINE if the slot is free
+	uint32_t have;     // blocks that hold data
+	uint32_t pages;    // pages that changed
+	uint32_t used;     // for LRU
+	uint8_t state;
+	uint8_t erase;     // a change needs an erase
+	uint8_t busy;      // MSCPoll() is reading into it
+} MSCLine;
+
+typedef struct
+{
+	uint32_t cmds;
+	uint32_t blocks_read;      // by the host
+	uint32_t blocks_written;
+	uint32_t bd_reads;         // MSC_BD_READ() calls
+	uint32_t erases;
+	uint32_t programs;         // pages
+	uint32_t flushes;          // lines written out
+	uint32_t out_waits;        // times the OUT endpoint had to wait for a line
+} MSCStats;
+
+static uint8_t msc_buf[MSC_LINES][MSC_LINE_SIZE] __attribute__( ( aligned( 4 ) ) );
+static MSCLine msc_line[MSC_LINES];
+static uint32_t msc_clock;
+static MSCStats msc_stats;
+
+static struct
+{
+	uint8_t state;
+	uint8_t tx;
+	uint8_t tx_busy;     // a packet is armed on MSC_EP_IN
+	uint8_t hin;         // host expects data in
+	uint8_t out_wait;    // MSC_EP_OUT NAKs until MSCPoll() has a line
+	uint8_t halt_in;     // 1 stall IN when it's idle, 2 stalled, CSW once cleared
+	uint8_t halt_out;
+	uint8_t sync;        // CSW once nothing is dirty
+	uint8_t status;      // for the CSW
+	uint8_t werr;        // a write out failed, the next command fails
+	uint8_t sense[3];    // key, ASC, ASCQ
+	uint32_t tag;
+	uint32_t expect;     // dCBWDataTransferLength
+	uint32_t done;       // bytes moved in the data phase
+	uint32_t left;       // bytes still to move
+	uint32_t lba;        // READ(10) / WRITE(10) block
+	uint32_t off;        // byte in it
+	uint32_t ra;         // block to read ahead when idle, MSC_NO_LINE for none
+	uint32_t idle;       // MSC_TICKS() at the last CBW
+	uint8_t resp[36];
+	uint8_t csw[13];
+} msc = { .ra = MSC_NO_LINE };
+
+static struct
+{
+	int slot;            // line going out, -1 if none
+	int next;            // erase unit
+	int units;           // erase units to erase
+	uint32_t pages;      // pages still to program
+} msc_fl = { -1, 0, 0, 0 };
+
+#if MSC_BD_INTERNAL
+
+#define MSC_BD_READ( addr, buf, len ) ( memcpy( ( buf ), (const void *)( addr ), ( len ) ), 0 )
+#define MSC_BD_PROGRAM( addr, data, len ) IFlashProgram( ( addr ), ( data ), ( len ) )
+#define MSC_BD_ERASE( addr ) IFlashErase( ( addr ), MSC_BD_ERASE_SIZE )
+
+#endif
+
+static uint32_t msc_le32( const uint8_t * p )
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint32_t msc_be32( const uint8_t * p )
+{
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void msc_put_be32( uint8_t * p, uint32_t v )
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void msc_pad( uint8_t * p, const char * s, int n )
+{
+	while( n-- ) *p++ = *s ? *s++ : ' ';
+}
+
+// 1 if the data is what the flash reads back as right after an erase, so
+// it needn't be programmed.
+static int msc_blank( const uint8_t * p, int n )
+{
+	const uint32_t * w = (const uint32_t *)p;
+	for( n /= 4; n; n-- )
+		if( *w++ != MSC_BD_ERASED ) return 0;
+	return 1;
+}
+
+static int msc_find( uint32_t line )
+{
+	int i;
+	for( i = 0; i < MSC_LINES; i++ )
+		if( msc_line[i].line == line ) return i;
+	return -1;
+}
+
+// The line the interrupt is reading from or writing into right now.
+static int msc_pinned( int i )
+{
+	if( ( msc.state == MSC_DATA_IN && msc.tx == MSC_TX_READ ) || msc.state == MSC_DATA_OUT )
+		return msc_line[i].line == msc.lba / MSC_LINE_BLOCKS;
+	return 0;
+}
+
+// A slot for line, free or the least recently used clean one. No flash
+// access, the interrupt uses this too.
+static int msc_alloc( uint32_t line )
+{
+	int i, v = -1;
+	for( i = 0; i < MSC_LINES; i++ )
+	{
+		MSCLine * l = &msc_line[i];
+		if( l->line == MSC_NO_LINE )
+		{
+			v = i;
+			break;
+		}
+		if( l->state == MSC_CLEAN && !l->busy && !msc_pinned( i ) && ( v < 0 || l->used < msc_line[v].used ) )
+			v = i;
+	}
+	if( v >= 0 )
+	{
+		msc_line[v].line = line;
+		msc_line[v].have = 0;
+		msc_line[v].pages = 0;
+		msc_line[v].erase = 0;
+		msc_line[v].state = MSC_CLEAN;
+		msc_line[v].used = ++msc_clock;
+	}
+	return v;
+}
+
+// No slot to be had, queue the least recently used dirty line to free one.
+static void msc_evict( void )
+{
+	int i, v = -1;
+	for( i = 0; i < MSC_LINES; i++ )
+		if( msc_line[i].state == MSC_DIRTY && !msc_pinned( i ) && ( v < 0 || msc_line[i].used < msc_line[v].used ) )
+			v = i;
+	if( v >= 0 ) msc_line[v].state = MSC_QUEUED;
+}
+
+static void msc_queue_all( void )
+{
+	int i;
+	for( i = 0; i < MSC_LINES; i++ )
+		if( msc_line[i].state == MSC_DIRTY ) msc_line[i].state = MSC_QUEUED;
+}
+
+static int msc_dirty( void )
+{
+	int i;
+	for( i = 0; i < MSC_LINES; i++ )
+		if( msc_line[i].state != MSC_CLEAN ) return 1;
+	return 0;
+}
+
+// Reads the blocks of the line that aren't there yet. The slot is busy
+// meanwhile, the interrupt won't write into it.
+static int msc_fill( int i )
+{
+	MSCLine * l = &msc_line[i];
+	uint32_t missing = ~l->have & MSC_ALL( MSC_LINE_BLOCKS );
+	uint32_t base = MSC_BD_BASE + l->line * MSC_LINE_SIZE;
+	int b, n, r = 0;
+
+	for( b = 0; b < MSC_LINE_BLOCKS && r >= 0; b += n )
+	{
+		for( n = 0; b + n < MSC_LINE_BLOCKS && ( missing >> ( b + n ) & 1 ); n++ );
+		if( !n )
+		{
+			n = 1;
+			continue;
+		}
+		r = MSC_BD_READ( base + b * 512, msc_buf[i] + b * 512, n * 512 );
+		msc_stats.bd_reads++;
+	}
+
+	MSC_LOCK();
+	if( r >= 0 ) l->have |= missing;
+	l->busy = 0;
+	MSC_UNLOCK();
+	return r;
+}
+
+// Host data into line slot i at byte pos, within one block.
+static void msc_store( int i, uint32_t pos, const uint8_t * data, int len )
+{
+	MSCLine * l = &msc_line[i];
+	uint8_t * p = msc_buf[i] + pos;
+	int k, erase = 1;
+
+	if( l->have & ( 1u << ( pos / 512 ) ) )
+	{
+		// What's there is what the flash holds (or will), compare.
+		uint8_t changed = 0, set = 0;
+		for( k = 0; k < len; k++ )
+		{
+			changed |= p[k] ^ data[k];
+			set |= ~p[k] & data[k];
+		}
+		if( !changed ) return;
+		erase = set || !MSC_BD_CLEAR_BITS;
+	}
+	memcpy( p, data, len );
+	l->pages |= MSC_ALL( ( pos + len - 1 ) / MSC_BD_PAGE_SIZE + 1 ) & ~( MSC_ALL( pos / MSC_BD_PAGE_SIZE + 1 ) >> 1 );
+	if( erase ) l->erase = 1;
+	if( l->state == MSC_CLEAN ) l->state = MSC_DIRTY;
+}
+
+static void msc_csw( void )
+{
+	uint32_t residue = msc.expect - msc.done;
+	msc.csw[0] = 'U';
+	msc.csw[1] = 'S';
+	msc.csw[2] = 'B';
+	msc.csw[3] = 'S';
+	memcpy( msc.csw + 4, &msc.tag, 4 );
+	msc.csw[8] = residue;
+	msc.csw[9] = residue >> 8;
+	msc.csw[10] = residue >> 16;
+	msc.csw[11] = residue >> 24;
+	msc.csw[12] = msc.status;
+	msc.state = MSC_IDLE;
+	msc.tx = MSC_TX_CSW;
+	msc.idle = MSC_TICKS();
+}
+
+// Next IN packet into buf, 0 if there's nothing to send (yet).
+static int msc_tx_fill( uint8_t * buf )
+{
+	int n, i;
+	uint32_t b;
+
+	switch( msc.tx )
+	{
+	case MSC_TX_RESP:
+		n = msc.left < MSC_PACKET ? msc.left : MSC_PACKET;
+		memcpy( buf, msc.resp + msc.done, n );
+		break;
+	case MSC_TX_READ:
+		b = msc.lba % MSC_LINE_BLOCKS;
+		i = msc_find( msc.lba / MSC_LINE_BLOCKS );
+		if( i < 0 || !( msc_line[i].have & ( 1u << b ) ) ) return 0;  // MSCPoll() fetches it
+		n = MSC_PACKET;
+		memcpy( buf, msc_buf[i] + b * 512 + msc.off, n );
+		msc_line[i].used = ++msc_clock;
+		msc.off += n;
+		if( msc.off == 512 )
+		{
+			msc.off = 0;
+			msc.lba++;
+			msc_stats.blocks_read++;
+		}
+		break;
+	case MSC_TX_CSW:
+		memcpy( buf, msc.csw, 13 );
+		msc.tx = MSC_TX_NONE;
+		return 13;
+	default:
+		return 0;
+	}
+
+	msc.done += n;
+	msc.left -= n;
+	if( !msc.left )
+	{
+		if( msc.tx == MSC_TX_READ ) msc.ra = msc.lba;
+		msc.tx = MSC_TX_NONE;
+		// Less than the host asked for and no short packet to say so.
+		if( msc.done < msc.expect && !( msc.done % MSC_PACKET ) )
+		{
+			msc.state = MSC_WAIT;
+			msc.halt_in = 1;
+		}
+		else
+		{
+			msc_csw();
+		}
+	}
+	return n;
+}
+
+// Arms MSC_EP_IN if it's idle and there's something to send.
+static void msc_tx_kick( void )
+{
+	int n;
+	if( msc.tx_busy || msc.tx == MSC_TX_NONE || !MSC_IN_READY() ) return;
+	n = msc_tx_fill( MSC_IN_BUF );
+	if( n )
+	{
+		MSC_IN_SEND( n );
+		msc.tx_busy = 1;
+	}
+}
+
+// Whether the next block of a WRITE(10) has a slot to go into.
+static int msc_out_ready( void )
+{
+	uint32_t line = msc.lba / MSC_LINE_BLOCKS;
+	int i = msc_find( line );
+	if( i < 0 ) i = msc_alloc( line );
+	return i >= 0 && msc_line[i].state != MSC_FLUSH && !msc_line[i].busy;
+}
+
+static void msc_fail( uint8_t key, uint8_t asc )
+{
+	msc.status = 1;
+	msc.sense[0] = key;
+	msc.sense[1] = asc;
+	msc.sense[2] = 0;
+}
+
+// Starts the data phase of a command that has n bytes to move, in if in,
+// or goes on to the CSW. tx is where IN data comes from. Mismatches with
+// what the host announced follow the 13 cases of the BOT spec, simplified:
+// the host gets less than it asked for with a short packet or a stall,
+// anything else is a phase error.
+static void msc_phase( uint32_t n, int in, int tx )
+{
+	if( n && ( in != msc.hin || !msc.expect || ( tx == MSC_TX_READ ? n > msc.expect : 0 ) || ( !in && n != msc.expect ) ) )
+	{
+		msc.status = 2;
+		n = 0;
+	}
+	if( in && n > msc.expect ) n = msc.expect;  // response cut to what the host wants
+
+	if( n && in )
+	{
+		msc.state = MSC_DATA_IN;
+		msc.tx = tx;
+		msc.left = n;
+		msc.off = 0;
+		msc_tx_kick();
+	}
+	else if( n )
+	{
+		msc.state = MSC_DATA_OUT;
+		msc.left = n;
+		msc.off = 0;
+		if( !msc_out_ready() )
+		{
+			msc.out_wait = 1;
+			msc_stats.out_waits++;
+		}
+	}
+	else if( msc.expect && msc.hin )
+	{
+		msc.state = MSC_WAIT;
+		msc.halt_in = 1;
+	}
+	else
+	{
+		if( msc.expect ) msc.halt_out = 1;
+		msc_csw();
+		msc_tx_kick();
+	}
+}
+
+static void msc_resp( int n, int alloc )
+{
+	msc_phase( n < alloc ? n : alloc, 1, MSC_TX_RESP );
+}
+
+// Reads and writes, 0 if it started a data phase.
+static int msc_rw( const uint8_t * cb )
+{
+	uint32_t lba = msc_be32( cb + 2 );
+	uint32_t n = cb[7] << 8 | cb[8];
+
+	if( lba >= MSC_BLOCKS || n > MSC_BLOCKS - lba )
+	{
+		msc_fail( 5, 0x21 );  // ILLEGAL REQUEST, LBA out of range
+		return -1;
+	}
+	if( cb[0] == 0x2a && MSC_READ_ONLY )
+	{
+		msc_fail( 7, 0x27 );  // DATA PROTECT, write protected
+		return -1;
+	}
+	msc.lba = lba;
+	msc_phase( n * 512, cb[0] == 0x28, MSC_TX_READ );
+	return 0;
+}
+
+static void msc_scsi( const uint8_t * cb )
+{
+	uint8_t * r = msc.resp;
+	uint32_t alloc = cb[4];
+
+	memset( r, 0, sizeof( msc.resp ) );
+	if( msc.werr && cb[0] != 0x03 && cb[0] != 0x12 )
+	{
+		msc.werr = 0;
+		msc_fail( 3, 0x0c );  // MEDIUM ERROR, write error
+		msc_phase( 0, 0, 0 );
+		return;
+	}
+
+	switch( cb[0] )
+	{
+	case 0x00:  // TEST UNIT READY
+	case 0x1e:  // PREVENT ALLOW MEDIUM REMOVAL
+		break;
+	case 0x03:  // REQUEST SENSE
+		r[0] = 0x70;
+		r[2] = msc.sense[0];
+		r[7] = 10;
+		r[12] = msc.sense[1];
+		r[13] = msc.sense[2];
+		msc.sense[0] = msc.sense[1] = msc.sense[2] = 0;
+		msc_resp( 18, alloc );
+		return;
+	case 0x12:  // INQUIRY
+		if( cb[1] & 1 ) break;  // no vital product data pages
+		r[1] = 0x80;  // removable
+		r[2] = 0x04;  // SPC-2
+		r[3] = 0x02;
+		r[4] = 31;
+		msc_pad( r + 8, MSC_VENDOR, 8 );
+		msc_pad( r + 16, MSC_PRODUCT, 16 );
+		msc_pad( r + 32, MSC_REVISION, 4 );
+		msc_resp( 36, alloc );
+		return;
+	case 0x1a:  // MODE SENSE(6)
+	case 0x5a:  // MODE SENSE(10)
+	{
+		int h = cb[0] == 0x1a ? 4 : 8;
+		int page = cb[2] & 0x3f, n = h;
+		if( page == 0x08 || page == 0x3f )
+		{
+			r[h] = 0x08;       // caching
+			r[h + 1] = 0x12;
+			r[h + 2] = 0x04;   // WCE, writes are cached
+			n += 20;
+		}
+		if( cb[0] == 0x1a )
+		{
+			r[0] = n - 1;
+			r[2] = MSC_READ_ONLY ? 0x80 : 0;
+		}
+		else
+		{
+			r[1] = n - 2;
+			r[3] = MSC_READ_ONLY ? 0x80 : 0;
+			alloc = cb[7] << 8 | cb[8];
+		}
+		msc_resp( n, alloc );
+		return;
+	}
+	case 0x1b:  // START STOP UNIT, write everything out on eject
+	case 0x35:  // SYNCHRONIZE CACHE(10)
+		msc_queue_all();
+		msc.sync = 1;
+		msc.state = MSC_WAIT;
+		return;
+	case 0x23:  // READ FORMAT CAPACITIES
+		r[3] = 8;
+		msc_put_be32( r + 4, MSC_BLOCKS );
+		msc_put_be32( r + 8, 512 );
+		r[8] = 0x02;  // formatted media
+		msc_resp( 12, cb[7] << 8 | cb[8] );
+		return;
+	case 0x25:  // READ CAPACITY(10)
+		msc_put_be32( r, MSC_BLOCKS - 1 );
+		msc_put_be32( r + 4, 512 );
+		msc_resp( 8, 8 );
+		return;
+	case 0x28:  // READ(10)
+	case 0x2a:  // WRITE(10)
+		if( !msc_rw( cb ) ) return;
+		break;
+	case 0x2f:  // VERIFY(10)
+		if( cb[1] & 0x02 ) msc_fail( 5, 0x24 );  // no byte compare
+		break;
+	default:
+		msc_fail( 5, 0x20 );  // ILLEGAL REQUEST, invalid command operation code
+		break;
+	}
+	msc_phase( 0, 0, 0 );
+}
+
+static void msc_cbw( const uint8_t * data, int len )
+{
+	if( len != 31 || msc_le32( data ) != MSC_CBW_SIG || data[13] || !data[14] || data[14] > 16 )
+	{
+		// Not a CBW, the host has to reset the interface (BOT 6.6.1).
+		msc.state = MSC_RESET;
+		msc.halt_in = 1;
+		msc.halt_out = 1;
+		return;
+	}
+	memcpy( &msc.tag, data + 4, 4 );
+	msc.expect = msc_le32( data + 8 );
+	msc.hin = data[12] >> 7;
+	msc.done = 0;
+	msc.status = 0;
+	msc.idle = MSC_TICKS();
+	msc_stats.cmds++;
+	msc_scsi( data + 15 );
+}
+
+static void msc_rx_write( const uint8_t * data, int len )
+{
+	uint32_t b = msc.lba % MSC_LINE_BLOCKS;
+	int i = msc_find( msc.lba / MSC_LINE_BLOCKS );  // msc_out_ready() made sure
+
+	if( len > (int)( 512 - msc.off ) ) len = 512 - msc.off;
+	msc_store( i, b * 512 + msc.off, data, len );
+	msc_line[i].used = ++msc_clock;
+	msc.off += len;
+	msc.done += len;
+	msc.left -= len;
+	if( msc.off == 512 )
+	{
+		msc_line[i].have |= 1u << b;
+		msc.off = 0;
+		msc.lba++;
+		msc_stats.blocks_written++;
+		// Written up to the end, no reason to wait with it.
+		if( b == MSC_LINE_BLOCKS - 1 && msc_line[i].state == MSC_DIRTY ) msc_line[i].state = MSC_QUEUED;
+	}
+
+	if( !msc.left )
+	{
+		msc_csw();
+		msc_tx_kick();
+	}
+	else if( !msc_out_ready() )
+	{
+		msc.out_wait = 1;
+		msc_stats.out_waits++;
+	}
+}
+
+// An OUT packet arrived, call from HandleDataOut().
+static void MSCRx( const uint8_t * data, int len )
+{
+	switch( msc.state )
+	{
+	case MSC_IDLE:
+		msc_cbw( data, len );
+		break;
+	case MSC_DATA_OUT:
+		msc_rx_write( data, len );
+		break;
+	case MSC_RESET:
+		msc.halt_out = 1;
+		break;
+	default:
+		break;  // out of step, dropped
+	}
+
+	if( msc.halt_out )
+	{
+		msc.halt_out = 0;
+		MSC_OUT_STALL();
+	}
+	else if( msc.out_wait )
+	{
+		MSC_OUT_NAK();
+	}
+	else
+	{
+		MSC_OUT_ACK();
+	}
+}
+
+// An IN packet went out, returns the length of the next one in buf, 0 to
+// NAK. Call from HandleInRequest().
+static int MSCTx( uint8_t * buf )
+{
+	int n = msc_tx_fill( buf );
+	if( !n ) msc.tx_busy = 0;
+	return n;
+}
+
+// Bulk-Only Mass Storage Reset, from the setup handler. The cache stays,
+// what's dirty still goes out.
+static void MSCReset( void )
+{
+	msc.state = MSC_IDLE;
+	msc.tx = MSC_TX_NONE;
+	msc.tx_busy = 0;
+	msc.halt_in = 0;
+	msc.halt_out = 0;
+	msc.sync = 0;
+	msc.out_wait = 0;
+	msc.off = 0;
+}
+
+#ifdef MSC_SETUP_TYPE
+// Class requests, call from HandleSetupCustom().
+static int MSCHandleSetup( struct _USBState * ctx, int setup_code )
+{
+	static uint8_t max_lun = 0;
+	if( ( MSC_SETUP_TYPE( ctx ) & USB_REQ_TYP_MASK ) != USB_REQ_TYP_CLASS ) return 0;
+	if( setup_code == 0xfe )  // Get Max LUN
+	{
+		ctx->pCtrlPayloadPtr = &max_lun;
+		return 1;
+	}
+	if( setup_code == 0xff )
+	{
+		MSCReset();
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+// Whether line slot i can go out without an erase, because the flash only
+// needs bits cleared (NOR) or erased half words programmed (internal).
+// Sets the pages that differ.
+static int msc_no_erase( int i, uint32_t * pages )
+{
+	uint32_t old[16], base = MSC_BD_BASE + msc_line[i].line * MSC_LINE_SIZE;
+	const uint32_t * w = (const uint32_t *)msc_buf[i];
+	int off, k;
+
+	*pages = 0;
+	for( off = 0; off < MSC_LINE_SIZE; off += sizeof( old ) )
+	{
+		if( MSC_BD_READ( base + off, (uint8_t *)old, sizeof( old ) ) < 0 ) return 0;
+		for( k = 0; k < 16; k++, w++ )
+		{
+			uint32_t d = old[k] ^ *w;
+			if( !d ) continue;
+#if MSC_BD_CLEAR_BITS
+			if( ~old[k] & *w ) return 0;
+#else
+			if( ( ( d & 0xffff ) && ( old[k] & 0xffff ) != ( MSC_BD_ERASED & 0xffff ) ) ||
+				( ( d >> 16 ) && ( old[k] >> 16 ) != ( MSC_BD_ERASED >> 16 ) ) ) return 0;
+#endif
+			*pages |= 1u << ( ( off + k * 4 ) / MSC_BD_PAGE_SIZE );
+		}
+	}
+	return 1;
+}
+
+// Starts writing out the oldest queued line, 1 if there was one.
+static int msc_flush_start( void )
+{
+	MSCLine * l;
+	int i, v = -1, p;
+
+	MSC_LOCK();
+	for( i = 0; i < MSC_LINES; i++ )
+		if( msc_line[i].state == MSC_QUEUED && !msc_line[i].busy && !msc_pinned( i ) && ( v < 0 || msc_line[i].used < msc_line[v].used ) )
+			v = i;
+	if( v >= 0 )
+	{
+		msc_line[v].state = MSC_FLUSH;
+		if( msc_line[v].erase && msc_line[v].have != MSC_ALL( MSC_LINE_BLOCKS ) ) msc_line[v].busy = 1;
+	}
+	MSC_UNLOCK();
+	if( v < 0 ) return 0;
+
+	l = &msc_line[v];
+	msc_fl.next = 0;
+	msc_fl.units = 0;
+	msc_fl.pages = l->pages;
+	if( l->erase )
+	{
+		// The rest of the erase unit has to be put back.
+		if( l->busy && msc_fill( v ) < 0 )
+		{
+			MSC_LOCK();
+			l->line = MSC_NO_LINE;
+			l->state = MSC_CLEAN;
+			MSC_UNLOCK();
+			msc.werr = 1;
+			return 1;
+		}
+		if( !msc_no_erase( v, &msc_fl.pages ) )
+		{
+			msc_fl.units = MSC_LINE_SIZE / MSC_BD_ERASE_SIZE;
+			msc_fl.pages = 0;
+			for( p = 0; p < MSC_LINE_PAGES; p++ )
+				if( !msc_blank( msc_buf[v] + p * MSC_BD_PAGE_SIZE, MSC_BD_PAGE_SIZE ) ) msc_fl.pages |= 1u << p;
+		}
+	}
+	l->pages = 0;
+	l->erase = 0;
+	msc_fl.slot = v;
+	msc_stats.flushes++;
+	return 1;
+}
+
+// Next erase or page program of the line going out.
+static void msc_flush_step( void )
+{
+	MSCLine * l = &msc_line[msc_fl.slot];
+	uint32_t addr = MSC_BD_BASE + l->line * MSC_LINE_SIZE;
+	int r, p;
+
+	if( msc_fl.next < msc_fl.units )
+	{
+		r = MSC_BD_ERASE( addr + msc_fl.next++ * MSC_BD_ERASE_SIZE );
+		msc_stats.erases++;
+	}
+	else if( msc_fl.pages )
+	{
+		p = __builtin_ctz( msc_fl.pages );
+		msc_fl.pages &= msc_fl.pages - 1;
+		r = MSC_BD_PROGRAM( addr + p * MSC_BD_PAGE_SIZE, msc_buf[msc_fl.slot] + p * MSC_BD_PAGE_SIZE, MSC_BD_PAGE_SIZE );
+		msc_stats.programs++;
+	}
+	else
+	{
+		MSC_LOCK();
+		l->state = MSC_CLEAN;
+		msc_fl.slot = -1;
+		MSC_UNLOCK();
+		return;
+	}
+	if( r < 0 ) msc.werr = 1;
+}
+
+// Brings the line of block b into the cache, with all its blocks. Only
+// takes a clean or free slot, or with evict queues a dirty one to get one
+// next time. 1 if it read, -1 if that failed.
+static int msc_fetch( uint32_t b, int evict )
+{
+	int i, r;
+
+	MSC_LOCK();
+	i = msc_find( b / MSC_LINE_BLOCKS );
+	if( i < 0 ) i = msc_alloc( b / MSC_LINE_BLOCKS );
+	if( i < 0 && evict ) msc_evict();
+	if( i >= 0 && ( msc_line[i].busy || msc_line[i].have == MSC_ALL( MSC_LINE_BLOCKS ) ) ) i = -1;
+	if( i >= 0 ) msc_line[i].busy = 1;
+	MSC_UNLOCK();
+	if( i < 0 ) return 0;
+
+	r = msc_fill( i );
+	if( r < 0 )
+	{
+		MSC_LOCK();
+		if( msc_line[i].state == MSC_CLEAN ) msc_line[i].line = MSC_NO_LINE;
+		MSC_UNLOCK();
+		return -1;
+	}
+	return 1;
+}
+
+// Does the flash side, one read, erase or page program per call. Call it
+// from the main loop as often as there's time for.
+static void MSCPoll( void )
+{
+	uint32_t b;
+	int r;
+
+	MSC_LOCK();
+	if( msc.halt_in == 1 && !msc.tx_busy )
+	{
+		MSC_IN_STALL();
+		msc.halt_in = 2;
+	}
+	else if( msc.halt_in == 2 && !MSC_IN_HALTED() )
+	{
+		// The host cleared the stall, now it wants the CSW.
+		msc.halt_in = msc.state == MSC_RESET;
+		if( msc.state == MSC_WAIT && !msc.sync ) msc_csw();
+	}
+	msc_tx_kick();
+	MSC_UNLOCK();
+
+	r = MSC_BD_BUSY();
+	if( r > 0 ) return;
+	if( r < 0 ) msc.werr = 1;
+
+	// A READ(10) waiting for its block comes first.
+	if( msc.state == MSC_DATA_IN && msc.tx == MSC_TX_READ )
+	{
+		r = msc_fetch( msc.lba, 1 );
+		if( r < 0 )
+		{
+			MSC_LOCK();
+			if( msc.state == MSC_DATA_IN )
+			{
+				msc_fail( 3, 0x11 );  // MEDIUM ERROR, unrecovered read error
+				msc.tx = MSC_TX_NONE;
+				msc.state = MSC_WAIT;
+				msc.halt_in = 1;
+			}
+			MSC_UNLOCK();
+		}
+		if( r )
+		{
+			MSC_LOCK();
+			msc_tx_kick();
+			MSC_UNLOCK();
+			return;
+		}
+	}
+
+	if( msc_fl.slot >= 0 )
+	{
+		msc_flush_step();
+		return;
+	}
+
+	if( msc.out_wait )
+	{
+		MSC_LOCK();
+		if( msc_out_ready() )
+		{
+			msc.out_wait = 0;
+			MSC_OUT_ACK();
+		}
+		else if( msc_find( msc.lba / MSC_LINE_BLOCKS ) < 0 )
+		{
+			msc_evict();
+		}
+		MSC_UNLOCK();
+	}
+
+	if( msc_flush_start() ) return;
+
+	if( msc.sync && !msc_dirty() )
+	{
+		MSC_LOCK();
+		msc.sync = 0;
+		if( msc.werr )
+		{
+			msc.werr = 0;
+			msc_fail( 3, 0x0c );
+		}
+		msc_phase( 0, 0, 0 );
+		MSC_UNLOCK();
+		return;
+	}
+
+	if( msc.state == MSC_IDLE && (int32_t)( MSC_TICKS() - msc.idle ) > (int32_t)MSC_FLUSH_TICKS )
+	{
+		MSC_LOCK();
+		msc_queue_all();
+		MSC_UNLOCK();
+	}
+
+	// Read ahead, into clean or free slots only.
+	if( msc.out_wait ) return;
+	if( msc.state == MSC_DATA_IN && msc.tx == MSC_TX_READ )
+	{
+		b = ( msc.lba / MSC_LINE_BLOCKS + 1 ) * MSC_LINE_BLOCKS;
+	}
+	else if( msc.state == MSC_IDLE )
+	{
+		b = msc.ra;
+		msc.ra = MSC_NO_LINE;
+	}
+	else
+	{
+		return;
+	}
+	if( b < MSC_BLOCKS ) msc_fetch( b, 0 );
+}
+
+// Writes out everything that's dirty, blocking. Before a reset or when the
+// host is gone.
+static int MSCSync( void )
+{
+	int r;
+	MSC_LOCK();
+	msc_queue_all();
+	MSC_UNLOCK();
+	while( msc_dirty() || msc_fl.slot >= 0 || MSC_BD_BUSY() > 0 ) MSCPoll();
+	r = msc.werr;
+	msc.werr = 0;
+	return r ? -1 : 0;
+}
+
+#endif
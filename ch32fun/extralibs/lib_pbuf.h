@@ -0,0 +1,274 @@
+#ifndef _LIB_PBUF_H
+#define _LIB_PBUF_H
+
+/** Packet buffer pool.
+
+	PBUF_COUNT fixed blocks of PBUF_SIZE bytes on a free list, so allocating
+	and freeing are O(1) and there's no fragmentation. A packet bigger than a
+	block is a chain of them (next / tot_len). Blocks are reference counted,
+	so a frame can be handed from a USB endpoint to the MAC, or queued in
+	two places, without copying it.
+
+	Safe to use from interrupts, the free list and the reference counts are
+	only touched with interrupts off (a few instructions).
+
+	Usage:
+
+	#define PBUF_COUNT 16
+	#define PBUF_SIZE  1536
+	#include "lib_pbuf.h"
+
+	PBufInit();
+
+	PBuf * p = PBufAlloc( 1514 );       // 0 when the pool can't cover it
+	memcpy( p->payload, frame, 1514 );  // or let a DMA fill p->payload
+	PBufRef( p );                       // a second owner
+	PBufFree( p );                      // each owner frees once, the last
+	PBufFree( p );                      // one puts the blocks back
+
+	For a USB to ethernet bridge the OUT endpoint DMAs straight into a block,
+	the block goes to the MAC as the TX buffer and the TX complete frees it.
+	Drivers that only keep the data address (DMA descriptors) can get the
+	block back with PBufFromPayload().
+
+	Chains follow lwIP: PBufFree() walks on down the chain only while the
+	counts drop to 0, PBufCat() hands the tail's reference to the head.
+	Freeing a block that's already free returns -1 and leaves the pool as it
+	was. Once the block has been allocated again it can't be told apart.
+	Use PBufCopyOut() / PBufCopyIn() where something needs it contiguous.
+
+	PBUF_LOCK() / PBUF_UNLOCK() can be overridden, i.e. on a host.
+	misc/pbufsim runs the pool from threads and from a timer signal standing
+	in for an interrupt, and times a hand-off against a copy.
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#ifndef PBUF_COUNT
+#define PBUF_COUNT 8
+#endif
+
+#ifndef PBUF_SIZE
+#define PBUF_SIZE 1536  // a full ethernet frame in one block
+#endif
+
+// Room left in front of the payload of the first block, for headers added
+// on the way out with PBufHeader().
+#ifndef PBUF_HEADROOM
+#define PBUF_HEADROOM 0
+#endif
+
+#ifndef PBUF_LOCK
+#define PBUF_LOCK()   uint32_t pbuf_mstatus = __get_MSTATUS(); __disable_irq()
+#define PBUF_UNLOCK() __set_MSTATUS( pbuf_mstatus )
+#endif
+
+typedef struct PBuf
+{
+	struct PBuf * next;  // next block of the same packet, 0 at the end
+	uint8_t * payload;   // where the data in this block starts
+	uint16_t len;        // bytes at payload
+	uint16_t tot_len;    // len of this block and all the ones after it
+	uint8_t ref;
+	uint8_t flags;       // not used here
+	uint8_t data[PBUF_SIZE] __attribute__( ( aligned( 4 ) ) );
+} PBuf;
+
+static PBuf pbuf_pool[PBUF_COUNT];
+static PBuf * pbuf_free_list;
+static volatile uint16_t pbuf_free_count;
+static uint16_t pbuf_min_free;        // low water mark
+static volatile uint32_t pbuf_alloc_fails;
+
+static void PBufInit( void )
+{
+	int i;
+	pbuf_free_list = 0;
+	for( i = PBUF_COUNT - 1; i >= 0; i-- )
+	{
+		pbuf_pool[i].next = pbuf_free_list;
+		pbuf_pool[i].ref = 0;
+		pbuf_free_list = &pbuf_pool[i];
+	}
+	pbuf_free_count = pbuf_min_free = PBUF_COUNT;
+	pbuf_alloc_fails = 0;
+}
+
+// A packet of len bytes, in as many blocks as that takes. All or nothing,
+// returns 0 if there aren't enough free blocks.
+static PBuf * PBufAlloc( int len )
+{
+	int room = PBUF_SIZE - PBUF_HEADROOM;
+	int n = len <= room ? 1 : 1 + ( len - room + PBUF_SIZE - 1 ) / PBUF_SIZE;
+	PBuf * head;
+	PBuf * p;
+	int i;
+
+	PBUF_LOCK();
+	if( n > pbuf_free_count )
+	{
+		pbuf_alloc_fails++;
+		PBUF_UNLOCK();
+		return 0;
+	}
+	head = p = pbuf_free_list;
+	for( i = 1; i < n; i++ )
+		p = p->next;
+	pbuf_free_list = p->next;
+	pbuf_free_count -= n;
+	if( pbuf_free_count < pbuf_min_free ) pbuf_min_free = pbuf_free_count;
+	PBUF_UNLOCK();
+
+	p->next = 0;
+	for( p = head; p; p = p->next )
+	{
+		int off = p == head ? PBUF_HEADROOM : 0;
+		int l = len < PBUF_SIZE - off ? len : PBUF_SIZE - off;
+		p->payload = p->data + off;
+		p->len = l;
+		p->tot_len = len;
+		p->ref = 1;
+		p->flags = 0;
+		len -= l;
+	}
+	return head;
+}
+
+static void PBufRef( PBuf * p )
+{
+	PBUF_LOCK();
+	p->ref++;
+	PBUF_UNLOCK();
+}
+
+// Drops a reference, returns how many blocks went back to the pool, or -1
+// if p was free already.
+static int PBufFree( PBuf * p )
+{
+	int n = 0;
+	PBUF_LOCK();
+	if( p && p->ref == 0 )
+	{
+		PBUF_UNLOCK();
+		return -1;
+	}
+	while( p && --p->ref == 0 )
+	{
+		PBuf * next = p->next;
+		p->next = pbuf_free_list;
+		pbuf_free_list = p;
+		n++;
+		p = next;
+	}
+	pbuf_free_count += n;
+	PBUF_UNLOCK();
+	return n;
+}
+
+// Appends tail to head, head's owner now owns (and frees) both.
+static void PBufCat( PBuf * head, PBuf * tail )
+{
+	PBuf * p;
+	for( p = head; p->next; p = p->next )
+		p->tot_len += tail->tot_len;
+	p->tot_len += tail->tot_len;
+	p->next = tail;
+}
+
+// Appends tail to head and keeps tail's owner's reference too.
+static void PBufChain( PBuf * head, PBuf * tail )
+{
+	PBufCat( head, tail );
+	PBufRef( tail );
+}
+
+// Cuts the packet down to len bytes, the blocks that aren't needed any more
+// go back to the pool. For receiving into a full size packet.
+static void PBufTrim( PBuf * p, int len )
+{
+	PBuf * rest;
+	if( len >= p->tot_len ) return;
+	while( len > p->len )
+	{
+		p->tot_len = len;
+		len -= p->len;
+		p = p->next;
+	}
+	rest = p->next;
+	p->len = p->tot_len = len;
+	p->next = 0;
+	if( rest ) PBufFree( rest );
+}
+
+// Moves the start of the first block by delta bytes, positive to add a
+// header in front, negative to strip one. Returns -1 if it doesn't fit.
+static int PBufHeader( PBuf * p, int delta )
+{
+	uint8_t * np = p->payload - delta;
+	if( np < p->data || np > p->payload + p->len ) return -1;
+	p->payload = np;
+	p->len += delta;
+	p->tot_len += delta;
+	return 0;
+}
+
+// The block payload points into, 0 if it isn't in the pool.
+static PBuf * PBufFromPayload( const void * payload )
+{
+	uintptr_t off = (uintptr_t)payload - (uintptr_t)pbuf_pool;
+	PBuf * p;
+	if( off >= sizeof( pbuf_pool ) ) return 0;
+	p = &pbuf_pool[off / sizeof( PBuf )];
+	return (const uint8_t *)payload >= p->data ? p : 0;
+}
+
+// Copies len bytes from offset off of the packet out to dst. Returns the
+// number copied, less if the packet is shorter.
+static int PBufCopyOut( const PBuf * p, void * dst, int off, int len )
+{
+	uint8_t * d = dst;
+	int done = 0;
+	for( ; p && done < len; p = p->next )
+	{
+		if( off >= p->len )
+		{
+			off -= p->len;
+			continue;
+		}
+		int n = p->len - off;
+		if( n > len - done ) n = len - done;
+		memcpy( d + done, p->payload + off, n );
+		done += n;
+		off = 0;
+	}
+	return done;
+}
+
+// And the other way round.
+static int PBufCopyIn( PBuf * p, const void * src, int off, int len )
+{
+	const uint8_t * s = src;
+	int done = 0;
+	for( ; p && done < len; p = p->next )
+	{
+		if( off >= p->len )
+		{
+			off -= p->len;
+			continue;
+		}
+		int n = p->len - off;
+		if( n > len - done ) n = len - done;
+		memcpy( p->payload + off, s + done, n );
+		done += n;
+		off = 0;
+	}
+	return done;
+}
+
+static int PBufFreeCount( void )
+{
+	return pbuf_free_count;
+}
+
+#endif
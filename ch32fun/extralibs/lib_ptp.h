@@ -0,0 +1,491 @@
+#ifndef _LIB_PTP_H
+#define _LIB_PTP_H
+
+/** IEEE 1588-2008 (PTPv2) slave: an ordinary clock with one port that
+	follows a master over Ethernet (layer 2, ethertype 0x88f7 to
+	01:1b:19:00:00:00), with the end to end delay mechanism. The master
+	may be one step or two step, and transparent clocks on the way are
+	fine, their correction fields are taken into account.
+
+	- The master is the best one heard in Announce messages, compared on
+	  priority1, clockClass, clockAccuracy, the variance, priority2 and the
+	  grandmaster identity, in that order. There's no qualification window
+	  and no stepsRemoved, with one port they don't change the choice. The
+	  master is lost after PTP_ANNOUNCE_LOST Announce intervals without one,
+	  the clock keeps the rate it had.
+	- A Sync, with its Follow_Up from a two step master, gives t1 (sent, on
+	  the master's clock) and t2 (received, on ours). After a Sync a
+	  Delay_Req goes out, at most once per interval the master asks for in
+	  its Delay_Resp, which brings t4 for our stamp t3. Corrections are
+	  added to t1 and taken off t4. The path delay is
+	  ( ( t2 - t1 ) + ( t4 - t3 ) ) / 2, averaged over about
+	  2^PTP_DELAY_SHIFT of them, and the offset is t2 - t1 - delay.
+	- The servo is the PI loop of ptp4l, with its gains for the Sync
+	  interval (kp 0.7, ki 0.3 at one a second). The first offset, and later any over PTP_STEP_NS, steps
+	  the clock. Then Syncs over at least a second measure the rate, which
+	  is set at once, and the PI loop takes it from there. ptp.state goes
+	  PTP_LISTENING, PTP_UNCALIBRATED, then PTP_SLAVE after PTP_LOCK_COUNT
+	  offsets in a row within PTP_LOCK_NS.
+
+	A path that's slower one way than the other shows up as half the
+	difference in the offset, PTP can't see that.
+
+	Usage with ch32v307gigabit.h, CH32V307GIGABIT_PTP and
+	CH32V307GIGABIT_RX_POLL:
+
+	#include "ch32v307gigabit.h"
+	#include "lib_ptp.h"
+
+	int ch32v307ethInitHandlePacket( uint8_t * data, int frame_length, ETH_DMADESCTypeDef * dmadesc )
+	{
+		PTPRx( data, frame_length, ch32v307eth_rxtime );
+		return 0;
+	}
+
+	ch32v307ethInit();
+	PTPInit( ch32v307eth_mac );
+	while( 1 )
+	{
+		ch32v307ethPoll( 8 );
+		PTPPoll();
+	}
+
+	PTPRx() and PTPPoll() mustn't interrupt each other, which is what
+	CH32V307GIGABIT_RX_POLL is for here. For another MAC or a host
+	simulation define these, times are int64_t ns on the local clock:
+
+	PTP_SEND( frame, len )  queue the frame, 0 if it was, it stays put
+	PTP_TX_TIME( &t )       1 once the last frame sent has its stamp in t
+	PTP_NOW()               the clock
+	PTP_STEP( ns )          add ns to it
+	PTP_ADJUST( ppb )       run it ppb faster than it would on its own
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#ifndef PTP_DOMAIN
+#define PTP_DOMAIN 0
+#endif
+
+// An offset over this steps the clock instead of slewing it.
+#ifndef PTP_STEP_NS
+#define PTP_STEP_NS 100000
+#endif
+
+#ifndef PTP_LOCK_NS
+#define PTP_LOCK_NS 1000
+#endif
+
+#ifndef PTP_LOCK_COUNT
+#define PTP_LOCK_COUNT 4
+#endif
+
+#ifndef PTP_DELAY_SHIFT
+#define PTP_DELAY_SHIFT 3
+#endif
+
+#ifndef PTP_ANNOUNCE_LOST
+#define PTP_ANNOUNCE_LOST 3
+#endif
+
+// A Delay_Resp that doesn't come in this long is given up on.
+#ifndef PTP_DELAY_TIMEOUT_NS
+#define PTP_DELAY_TIMEOUT_NS 1000000000
+#endif
+
+#if !defined( PTP_SEND ) && defined( _CH32V307GIGABIT_H ) && CH32V307GIGABIT_PTP
+static ETH_DMADESCTypeDef * ptp_txdesc;
+#define PTP_SEND( frame, len ) ( ( ptp_txdesc = ch32v307ethTransmitStaticTS( frame, len, 0 ) ) ? 0 : -1 )
+#define PTP_TX_TIME( t )       ( ptp_txdesc && ch32v307ethTxTimestamp( ptp_txdesc, t ) == 0 )
+#define PTP_NOW()              ch32v307ethPTPNow()
+#define PTP_STEP( ns )         ch32v307ethPTPStep( ns )
+#define PTP_ADJUST( ppb )      ch32v307ethPTPAdjust( ppb )
+#ifndef PTP_MAX_PPB
+#define PTP_MAX_PPB CH32V307GIGABIT_PTP_MAX_PPB
+#endif
+#endif
+
+#if !defined( PTP_SEND ) || !defined( PTP_TX_TIME ) || !defined( PTP_NOW ) || !defined( PTP_STEP ) || !defined( PTP_ADJUST )
+#error "lib_ptp: define PTP_SEND, PTP_TX_TIME, PTP_NOW, PTP_STEP and PTP_ADJUST, or use ch32v307gigabit.h with CH32V307GIGABIT_PTP"
+#endif
+
+#ifndef PTP_MAX_PPB
+#define PTP_MAX_PPB 500000
+#endif
+
+#define PTP_ETHERTYPE  0x88f7
+#define PTP_HEADER     34
+
+// Message types
+#define PTP_SYNC       0x0
+#define PTP_DELAY_REQ  0x1
+#define PTP_FOLLOW_UP  0x8
+#define PTP_DELAY_RESP 0x9
+#define PTP_ANNOUNCE   0xb
+
+#define PTP_TWO_STEP   0x02 // In the first flags byte.
+
+#define PTP_LISTENING     0
+#define PTP_UNCALIBRATED  1
+#define PTP_SLAVE         2
+
+struct
+{
+	uint8_t state;        // PTP_LISTENING, PTP_UNCALIBRATED or PTP_SLAVE
+	uint8_t master[10];   // Port identity of the master.
+	int64_t offset;       // Ours minus the master's at the last Sync, ns.
+	int64_t delay;        // Mean path delay, ns.
+	int32_t ppb;          // What the clock is adjusted by.
+	uint32_t syncs;
+	uint32_t steps;
+	uint32_t delay_reqs;
+	uint32_t delay_lost;  // Delay_Reqs without a stamp or an answer.
+	uint32_t bad;         // PTP frames that didn't parse.
+
+	uint8_t mac[6];
+	uint8_t id[10];       // Ours, EUI-64 from the MAC and port 1.
+	uint8_t best[14];     // The master's dataset, in the order it compares.
+	int8_t log_sync, log_announce, log_delay;
+	int64_t announce_at;
+
+	uint8_t sync_wait;    // For a Follow_Up.
+	uint16_t sync_seq;
+	int64_t t2, corr;
+	uint8_t ms_ok;
+	int64_t ms;           // t2 - t1 of the last Sync.
+	uint8_t synced;       // A Sync since the last Delay_Req.
+
+	uint8_t req;          // A Delay_Req is out.
+	uint8_t have_t3, have_t4, delay_ok;
+	uint16_t req_seq;
+	int64_t req_at, req_ms, t3, t4;
+
+	uint8_t servo;        // 0 step, 1 and 2 measure the rate, 3 PI.
+	uint8_t locked;
+	int64_t f1, f2;       // t1 and t2 where the rate measurement started.
+	int64_t drift;        // Integral term, ppb << 8.
+} ptp;
+
+static int64_t ptp_interval( int8_t log )
+{
+	return log >= 0 ? 1000000000LL << log : 1000000000LL >> -log;
+}
+
+static int8_t ptp_log( uint8_t log )
+{
+	int8_t l = (int8_t)log;
+	return l < -7 ? -7 : l > 6 ? 6 : l;
+}
+
+static int64_t ptp_get_time( const uint8_t * p )
+{
+	uint64_t s = 0;
+	for( int i = 0; i < 6; i++ ) s = ( s << 8 ) | p[i];
+	uint32_t ns = ( (uint32_t)p[6] << 24 ) | ( p[7] << 16 ) | ( p[8] << 8 ) | p[9];
+	return (int64_t)s * 1000000000 + ns;
+}
+
+// The correction field is ns << 16, the fraction is dropped.
+static int64_t ptp_get_correction( const uint8_t * p )
+{
+	uint64_t c = 0;
+	for( int i = 0; i < 8; i++ ) c = ( c << 8 ) | p[i];
+	return (int64_t)c >> 16;
+}
+
+// What a message of the type needs at least.
+static int ptp_length( int type )
+{
+	switch( type )
+	{
+	case PTP_SYNC:
+	case PTP_FOLLOW_UP:
+		return 44;
+	case PTP_DELAY_RESP:
+		return 54;
+	case PTP_ANNOUNCE:
+		return 64;
+	}
+	return PTP_HEADER;
+}
+
+static void ptp_adjust( int64_t ppb )
+{
+	if( ppb > PTP_MAX_PPB ) ppb = PTP_MAX_PPB;
+	if( ppb < -PTP_MAX_PPB ) ppb = -PTP_MAX_PPB;
+	ptp.ppb = ppb;
+	PTP_ADJUST( ptp.ppb );
+}
+
+// Times kept on our clock move with it, what was measured across the step
+// is thrown away.
+static void ptp_step( int64_t ns )
+{
+	PTP_STEP( ns );
+	ptp.steps++;
+	ptp.announce_at += ns;
+	ptp.req_at += ns;
+	ptp.ms_ok = 0;
+	ptp.req = 0;
+	ptp.sync_wait = 0;
+	ptp.locked = 0;
+	ptp.servo = 1;
+	if( ptp.state == PTP_SLAVE ) ptp.state = PTP_UNCALIBRATED;
+}
+
+static void ptp_sync( int64_t t1, int64_t t2 )
+{
+	ptp.syncs++;
+	ptp.ms = t2 - t1;
+	ptp.ms_ok = 1;
+	ptp.synced = 1;
+	int64_t offset = ptp.ms - ptp.delay;
+	ptp.offset = offset;
+	int big = offset > PTP_STEP_NS || offset < -PTP_STEP_NS;
+
+	switch( ptp.servo )
+	{
+	case 0:
+		if( big ) ptp_step( -offset );
+		ptp.servo = 1;
+		return;
+	case 1:
+		ptp.f1 = t1;
+		ptp.f2 = t2;
+		ptp.servo = 2;
+		return;
+	case 2:
+	{
+		// Our clock ran t2 - f2 while the master's ran dt, at ptp.ppb.
+		int64_t dt = t1 - ptp.f1, more = t2 - ptp.f2 - dt;
+		if( dt < 1000000000 ) return;
+		if( dt > 1000000000000LL || more > dt / 1000 || more < -dt / 1000 )
+		{
+			// Over 1000 ppm is no crystal, start again.
+			ptp.servo = 1;
+			return;
+		}
+		int64_t fast = more * 1000000000 / dt;
+		ptp.drift = (int64_t)( ptp.ppb - fast ) * 256;
+		ptp_adjust( ptp.ppb - fast );
+		if( big ) ptp_step( -offset );
+		ptp.servo = 3;
+		return;
+	}
+	}
+
+	if( big )
+	{
+		ptp_step( -offset );
+		return;
+	}
+
+	// ptp4l's gains for the Sync interval I: kp = 0.7 I^-0.3 and
+	// ki = 0.3 I^0.4, kp I at most 0.7 and ki I at most 0.3. As 16.16, ki
+	// times I, for log I -7 to 6.
+	static const uint32_t kp[14] = { 196671, 159747, 129755, 105394, 85606, 69534, 56479, 45875, 22938, 11469, 5734, 2867, 1434, 717 };
+	static const uint32_t ki[14] = { 22, 58, 154, 405, 1070, 2823, 7450, 19661, 19661, 19661, 19661, 19661, 19661, 19661 };
+	int64_t p = offset * kp[ptp.log_sync + 7] / 256, i = offset * ki[ptp.log_sync + 7] / 256;
+	ptp.drift -= i;
+	if( ptp.drift > (int64_t)PTP_MAX_PPB * 256 ) ptp.drift = (int64_t)PTP_MAX_PPB * 256;
+	if( ptp.drift < -(int64_t)PTP_MAX_PPB * 256 ) ptp.drift = -(int64_t)PTP_MAX_PPB * 256;
+	ptp_adjust( ( ptp.drift - p ) / 256 );
+
+	if( offset < PTP_LOCK_NS && offset > -PTP_LOCK_NS )
+	{
+		if( ptp.locked < PTP_LOCK_COUNT ) ptp.locked++;
+		if( ptp.locked == PTP_LOCK_COUNT ) ptp.state = PTP_SLAVE;
+	}
+	else
+		ptp.locked = 0;
+}
+
+// Once both t3 and t4 are in. Before the rate is set the drift between the
+// Sync and the Delay_Req would be in the delay, those are left out.
+static void ptp_delay( void )
+{
+	if( !ptp.have_t3 || !ptp.have_t4 ) return;
+	ptp.req = 0;
+	if( ptp.servo < 3 ) return;
+	int64_t d = ( ptp.req_ms + ptp.t4 - ptp.t3 ) / 2;
+	if( d > 1000000000 || d < -1000000000 ) return;
+	if( !ptp.delay_ok )
+		ptp.delay = d;
+	else
+		ptp.delay += ( d - ptp.delay ) / ( 1 << PTP_DELAY_SHIFT );
+	ptp.delay_ok = 1;
+}
+
+static void ptp_announce( const uint8_t * m, int64_t rxtime )
+{
+	const uint8_t * src = m + 20;
+	if( ptp.state != PTP_LISTENING && !memcmp( src, ptp.master, 10 ) )
+	{
+		memcpy( ptp.best, m + 47, 14 );
+		ptp.announce_at = rxtime;
+		ptp.log_announce = ptp_log( m[33] );
+		return;
+	}
+	if( ptp.state != PTP_LISTENING && memcmp( m + 47, ptp.best, 14 ) >= 0 ) return;
+
+	// A new master, starting over but for the rate.
+	memcpy( ptp.master, src, 10 );
+	memcpy( ptp.best, m + 47, 14 );
+	ptp.state = PTP_UNCALIBRATED;
+	ptp.announce_at = rxtime;
+	ptp.log_announce = ptp_log( m[33] );
+	ptp.log_sync = 0;
+	ptp.log_delay = 0;
+	ptp.sync_wait = 0;
+	ptp.ms_ok = 0;
+	ptp.req = 0;
+	ptp.delay = 0;
+	ptp.delay_ok = 0;
+	ptp.servo = 0;
+	ptp.locked = 0;
+}
+
+static void PTPInit( const uint8_t * mac )
+{
+	memset( &ptp, 0, sizeof( ptp ) );
+	memcpy( ptp.mac, mac, 6 );
+	ptp.id[0] = mac[0];
+	ptp.id[1] = mac[1];
+	ptp.id[2] = mac[2];
+	ptp.id[3] = 0xff;
+	ptp.id[4] = 0xfe;
+	ptp.id[5] = mac[3];
+	ptp.id[6] = mac[4];
+	ptp.id[7] = mac[5];
+	ptp.id[9] = 1;
+	ptp_adjust( 0 );
+}
+
+// Any received frame, rxtime its stamp. Frames that aren't PTP are ignored.
+static void PTPRx( const uint8_t * frame, int len, int64_t rxtime )
+{
+	int at = 12;
+	if( len >= 18 && frame[12] == 0x81 && frame[13] == 0x00 ) at = 16; // VLAN
+	if( len < at + 2 || ( ( frame[at] << 8 ) | frame[at + 1] ) != PTP_ETHERTYPE ) return;
+	const uint8_t * m = frame + at + 2;
+	len -= at + 2;
+	int mlen = len >= PTP_HEADER ? ( m[2] << 8 ) | m[3] : 0;
+	if( mlen < PTP_HEADER || mlen > len || ( m[1] & 0x0f ) != 2 )
+	{
+		ptp.bad++;
+		return;
+	}
+	if( m[4] != PTP_DOMAIN || !memcmp( m + 20, ptp.id, 10 ) ) return;
+
+	int type = m[0] & 0x0f;
+	uint16_t seq = ( m[30] << 8 ) | m[31];
+	int64_t corr = ptp_get_correction( m + 8 );
+	int master = ptp.state != PTP_LISTENING && !memcmp( m + 20, ptp.master, 10 );
+	// Seconds past 2106 would overflow the ns.
+	if( mlen < ptp_length( type ) || ( ptp_length( type ) > PTP_HEADER && ( m[34] | m[35] ) ) )
+	{
+		ptp.bad++;
+		return;
+	}
+
+	switch( type )
+	{
+	case PTP_ANNOUNCE:
+		ptp_announce( m, rxtime );
+		break;
+	case PTP_SYNC:
+		if( !master ) break;
+		ptp.log_sync = ptp_log( m[33] );
+		if( m[6] & PTP_TWO_STEP )
+		{
+			ptp.sync_wait = 1;
+			ptp.sync_seq = seq;
+			ptp.t2 = rxtime;
+			ptp.corr = corr;
+		}
+		else
+		{
+			ptp.sync_wait = 0;
+			ptp_sync( ptp_get_time( m + 34 ) + corr, rxtime );
+		}
+		break;
+	case PTP_FOLLOW_UP:
+		if( !master || !ptp.sync_wait || seq != ptp.sync_seq ) break;
+		ptp.sync_wait = 0;
+		ptp_sync( ptp_get_time( m + 34 ) + ptp.corr + corr, ptp.t2 );
+		break;
+	case PTP_DELAY_RESP:
+		if( !master || !ptp.req || ptp.have_t4 || seq != ptp.req_seq || memcmp( m + 44, ptp.id, 10 ) ) break;
+		ptp.log_delay = ptp_log( m[33] );
+		ptp.t4 = ptp_get_time( m + 34 ) - corr;
+		ptp.have_t4 = 1;
+		ptp_delay();
+		break;
+	}
+}
+
+static void ptp_delay_req( int64_t now )
+{
+	static uint8_t frame[60] __attribute__( ( aligned( 4 ) ) );
+	static const uint8_t dst[6] = { 0x01, 0x1b, 0x19, 0x00, 0x00, 0x00 };
+	uint8_t * m = frame + 14;
+	memset( frame, 0, sizeof( frame ) );
+	memcpy( frame, dst, 6 );
+	memcpy( frame + 6, ptp.mac, 6 );
+	frame[12] = PTP_ETHERTYPE >> 8;
+	frame[13] = PTP_ETHERTYPE & 0xff;
+	m[0] = PTP_DELAY_REQ;
+	m[1] = 2;
+	m[3] = 44;
+	m[4] = PTP_DOMAIN;
+	memcpy( m + 20, ptp.id, 10 );
+	uint16_t seq = ptp.req_seq + 1;
+	m[30] = seq >> 8;
+	m[31] = seq;
+	m[32] = 1;
+	m[33] = 0x7f;
+	if( PTP_SEND( frame, sizeof( frame ) ) ) return;
+	ptp.req_seq = seq;
+	ptp.req = 1;
+	ptp.have_t3 = 0;
+	ptp.have_t4 = 0;
+	ptp.req_at = now;
+	ptp.req_ms = ptp.ms;
+	ptp.synced = 0;
+	ptp.delay_reqs++;
+}
+
+// From the main loop, sends the Delay_Reqs and watches the master.
+static void PTPPoll( void )
+{
+	if( ptp.state == PTP_LISTENING ) return;
+	int64_t now = PTP_NOW();
+
+	if( now - ptp.announce_at > PTP_ANNOUNCE_LOST * ptp_interval( ptp.log_announce ) )
+	{
+		ptp.state = PTP_LISTENING;
+		ptp.req = 0;
+		return;
+	}
+
+	if( ptp.req )
+	{
+		if( !ptp.have_t3 && PTP_TX_TIME( &ptp.t3 ) )
+		{
+			ptp.have_t3 = 1;
+			ptp_delay();
+		}
+		else if( now - ptp.req_at > PTP_DELAY_TIMEOUT_NS )
+		{
+			ptp.req = 0;
+			ptp.delay_lost++;
+		}
+		return;
+	}
+
+	if( ptp.synced && ptp.ms_ok && now - ptp.req_at >= ptp_interval( ptp.log_delay ) )
+		ptp_delay_req( now );
+}
+
+#endif
@@ -28,15 +28,33 @@
 #ifndef CH32V003_LIB_RAND
 #define CH32V003_LIB_RAND
 
-// Define the strength of the random generation. Do this in funconfig.h
+// rand() and seed() are xoshiro128** unless RANDOM_STRENGTH picks the LFSR.
+// Define RANDOM_STRENGTH in funconfig.h for the LFSR, as before:
 // Strength 1: Tap and shift the LFSR, then returns the LFSR value as is
 // Strength 2: Generate 32 random bits using the LFSR
 // Strength 3: Genetate two 32bit values using the LFSR, then XOR them together
 // Example:    #define RANDOM_STRENGTH 2
-
-#ifndef RANDOM_STRENGTH 
-	#error "Error in lib_rand. Must define RANDOM_STRENGTH"
-#endif
+//
+// The LFSR makes a bit per step, so strength 2 and 3 cost 32 and 64 steps a
+// number. The word generators below make a word per step, each on its own
+// state, so there can be as many streams as needed:
+//   xorshift32     4 bytes of state, the cheapest. Its low bits are linear,
+//                  it fails statistical tests that look for that.
+//   xoshiro128**   16 bytes, a few cycles more, passes them. rand()'s.
+//   pcg32          16 bytes, needs 64 bit multiplies, slow without the M
+//                  extension (CH32V003), passes them too.
+// Each has _seed() and _fill(), to fill a buffer of any length.
+//
+// rand_entropy() gets 32 bits from the hardware to seed them with, and
+// rand_seed_entropy() seeds rand() with it:
+//   - the RNG of the CH32V30x and H41x, where there is one;
+//   - else RANDOM_ADC_CHANNEL, if defined, the noise of an analog input
+//     (call funAnalogInit() first, a floating or noisy pin is best), or
+//     RANDOM_ADC_READ(), any other source of a few noisy bits;
+//   - and always SysTick, which is only as random as the time something
+//     outside, like a button press, took.
+// None of this is fit for cryptography. misc/randsim tests the generators
+// and the RNG code on the host, and measures them.
 
 // @brief set the random LFSR values seed by default to a known-good value
 static uint32_t _rand_lfsr = 0x747AA32F;
@@ -108,8 +126,239 @@ uint32_t _rand_gen_nb( int bits)
 }
 
 
+/*** Word Generators *********************************************************/
+/*****************************************************************************/
+typedef uint32_t __attribute__((may_alias)) _rand_word;
+
+/// @brief murmur3's finaliser, each bit of h to every bit of the result, and
+/// only 0 to 0
+static inline uint32_t _rand_mix32(uint32_t h)
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+/// @brief Stores a word at any alignment, little endian
+static inline void _rand_put(uint8_t * p, uint32_t w)
+{
+	p[0] = w;
+	p[1] = w >> 8;
+	p[2] = w >> 16;
+	p[3] = w >> 24;
+}
+
+/// @brief Marsaglia's xorshift32 (13, 17, 5), period 2^32 - 1
+/// @param state, never 0
+/// @return a (psuedo)random 32-bit value
+static inline uint32_t xorshift32(uint32_t * state)
+{
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+/// @brief seeds xorshift32, any seed is fine
+static void xorshift32_seed(uint32_t * state, uint32_t seed_val)
+{
+	*state = _rand_mix32(seed_val + 0x9e3779b9);
+	if(!*state) *state = 0x9e3779b9;
+}
+
+/// @brief Fills len bytes at buf, any alignment, with the words xorshift32()
+/// would give, little endian. A part word at the end takes a whole one.
+static void xorshift32_fill(uint32_t * state, void * buf, uint32_t len)
+{
+	uint8_t * p = buf;
+	uint32_t s = *state, w;
+	if(!((uintptr_t)p & 3))
+		for(; len >= 4; len -= 4, p += 4) *(_rand_word *)p = xorshift32(&s);
+	for(; len >= 4; len -= 4, p += 4) _rand_put(p, xorshift32(&s));
+	for(w = len ? xorshift32(&s) : 0; len; len--, w >>= 8) *p++ = w;
+	*state = s;
+}
+
+/// @brief Blackman and Vigna's xoshiro128**, period 2^128 - 1
+typedef struct
+{
+	uint32_t s[4];  // never all 0
+} xoshiro128_state;
+
+/// @return a (psuedo)random 32-bit value
+static inline uint32_t xoshiro128(xoshiro128_state * st)
+{
+	uint32_t * s = st->s;
+	uint32_t r = s[1] * 5;
+	r = ((r << 7) | (r >> 25)) * 9;
+	uint32_t t = s[1] << 9;
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = (s[3] << 11) | (s[3] >> 21);
+	return r;
+}
+
+/// @brief seeds xoshiro128** from a 32-bit seed, any seed is fine. For more
+/// than 32 bits, set the state directly.
+static void xoshiro128_seed(xoshiro128_state * st, uint32_t seed_val)
+{
+	for(int i = 0; i < 4; i++) st->s[i] = _rand_mix32(seed_val += 0x9e3779b9);
+}
+
+/// @brief as xorshift32_fill()
+static void xoshiro128_fill(xoshiro128_state * st, void * buf, uint32_t len)
+{
+	uint8_t * p = buf;
+	xoshiro128_state s = *st;
+	uint32_t w;
+	if(!((uintptr_t)p & 3))
+		for(; len >= 4; len -= 4, p += 4) *(_rand_word *)p = xoshiro128(&s);
+	for(; len >= 4; len -= 4, p += 4) _rand_put(p, xoshiro128(&s));
+	for(w = len ? xoshiro128(&s) : 0; len; len--, w >>= 8) *p++ = w;
+	*st = s;
+}
+
+/// @brief O'Neill's PCG32, XSH RR on a 64-bit LCG, period 2^64 per stream
+typedef struct
+{
+	uint64_t state;
+	uint64_t inc;   // odd, picks the stream
+} pcg32_state;
+
+/// @return a (psuedo)random 32-bit value
+static inline uint32_t pcg32(pcg32_state * st)
+{
+	uint64_t old = st->state;
+	st->state = old * 6364136223846793005ull + st->inc;
+	uint32_t x = ((old >> 18) ^ old) >> 27;
+	uint32_t rot = old >> 59;
+	return (x >> rot) | (x << ((-rot) & 31));
+}
+
+/// @brief seeds PCG32 as pcg32_srandom_r() does, streams differ by stream
+static void pcg32_seed(pcg32_state * st, uint64_t seed_val, uint64_t stream)
+{
+	st->state = 0;
+	st->inc = (stream << 1) | 1;
+	pcg32(st);
+	st->state += seed_val;
+	pcg32(st);
+}
+
+/// @brief as xorshift32_fill()
+static void pcg32_fill(pcg32_state * st, void * buf, uint32_t len)
+{
+	uint8_t * p = buf;
+	pcg32_state s = *st;
+	uint32_t w;
+	if(!((uintptr_t)p & 3))
+		for(; len >= 4; len -= 4, p += 4) *(_rand_word *)p = pcg32(&s);
+	for(; len >= 4; len -= 4, p += 4) _rand_put(p, pcg32(&s));
+	for(w = len ? pcg32(&s) : 0; len; len--, w >>= 8) *p++ = w;
+	*st = s;
+}
+
+
+/*** Entropy *****************************************************************/
+/*****************************************************************************/
+#ifndef RANDOM_TICKS
+	#define RANDOM_TICKS() ((uint32_t)SysTick->CNT)
+#endif
+
+#if defined(RANDOM_ADC_CHANNEL) && !defined(RANDOM_ADC_READ)
+	#define RANDOM_ADC_READ() funAnalogRead(RANDOM_ADC_CHANNEL)
+#endif
+
+// Samples of RANDOM_ADC_READ() per word
+#ifndef RANDOM_ADC_SAMPLES
+	#define RANDOM_ADC_SAMPLES 32
+#endif
+
+// Polls of the RNG before giving up on it
+#ifndef RANDOM_RNG_TIMEOUT
+	#define RANDOM_RNG_TIMEOUT 100000
+#endif
+
+static uint32_t _rand_pool;
+
+static inline void _rand_stir(uint32_t x)
+{
+	_rand_pool = _rand_mix32((_rand_pool ^ x) + 0x9e3779b9);
+}
+
+#if defined(RNG_BASE)
+/// @brief Words from the RNG thrown away: seed errors, timeouts, and words
+/// the same as the one before
+static uint32_t rand_entropy_errors;
+static uint32_t _rand_rng_last;
+
+/// @brief A word from the RNG, restarting it on a seed error and throwing
+/// away a word the same as the last, the continuous test
+/// @return 1 with *out, or 0 if it didn't come up with one in time
+static int _rand_rng_word(uint32_t * out)
+{
+#if defined(CH32H41x)
+	RCC->HBPCENR |= RCC_HBPeriph_RNG;
+#else
+	RCC->AHBPCENR |= RCC_AHBPeriph_RNG;
+#endif
+	if(!(RNG->CR & RNG_CR_RNGEN)) RNG->CR |= RNG_CR_RNGEN;
+
+	for(uint32_t timeout = RANDOM_RNG_TIMEOUT; timeout; timeout--)
+	{
+		uint32_t sr = RNG->SR;
+		if(sr & RNG_SR_SECS)
+		{
+			RNG->SR &= ~RNG_SR_SEIS;
+			RNG->CR &= ~RNG_CR_RNGEN;
+			RNG->CR |= RNG_CR_RNGEN;
+			rand_entropy_errors++;
+			continue;
+		}
+		if(!(sr & RNG_SR_DRDY)) continue;
+
+		uint32_t w = RNG->DR;
+		if(w == _rand_rng_last)
+		{
+			rand_entropy_errors++;
+			continue;
+		}
+		*out = _rand_rng_last = w;
+		return 1;
+	}
+	rand_entropy_errors++;
+	return 0;
+}
+#endif
+
+/// @brief 32 bits from the hardware, to seed a generator with. From the RNG
+/// where there is one, else stirred from RANDOM_ADC_READ() and SysTick.
+/// @param None
+/// @return 32 (hopefully) random bits
+static uint32_t rand_entropy(void)
+{
+#if defined(RNG_BASE)
+	uint32_t w;
+	if(_rand_rng_word(&w)) return w;
+#endif
+	_rand_stir(RANDOM_TICKS());
+#if defined(RANDOM_ADC_READ)
+	for(int i = 0; i < RANDOM_ADC_SAMPLES; i++)
+		_rand_stir((uint32_t)RANDOM_ADC_READ() ^ (RANDOM_TICKS() << 16));
+#endif
+	return _rand_pool;
+}
+
 /*** API Functions ***********************************************************/
 /*****************************************************************************/
+#ifdef RANDOM_STRENGTH
 /// @brief seeds the Random LFSR to the value passed
 /// @param uint32_t seed
 /// @return None
@@ -151,4 +400,45 @@ uint32_t rand(void)
 	return rand_out;
 }
 
+#else
+
+static xoshiro128_state _rand_state = { { 0x747aa32f, 0x9e3779b9, 0x6a09e667, 0xbb67ae85 } };
+
+/// @brief seeds rand(), xoshiro128**, from the value passed
+/// @param uint32_t seed
+/// @return None
+void seed(const uint32_t seed_val)
+{
+	xoshiro128_seed(&_rand_state, seed_val);
+}
+
+/// @brief Generates a Random 32-bit Number with xoshiro128**
+/// @param None
+/// @return 32bit Random value
+uint32_t rand(void)
+{
+	return xoshiro128(&_rand_state);
+}
+
+/// @brief Fills a buffer from rand()'s generator
+/// @param buf, any alignment
+/// @param len in bytes
+/// @return None
+static void rand_fill(void * buf, uint32_t len)
+{
+	xoshiro128_fill(&_rand_state, buf, len);
+}
+
+/// @brief seeds rand() from the hardware, see rand_entropy()
+/// @param None
+/// @return None
+static void rand_seed_entropy(void)
+{
+	for(int i = 0; i < 4; i++) _rand_state.s[i] = rand_entropy();
+	if(!(_rand_state.s[0] | _rand_state.s[1] | _rand_state.s[2] | _rand_state.s[3]))
+		xoshiro128_seed(&_rand_state, 0);
+}
+
+#endif
+
 #endif
@@ -0,0 +1,611 @@
+#ifndef _LIB_SDCARD_H
+#define _LIB_SDCARD_H
+
+/** SD cards (SDSC, SDHC, SDXC) on the SDIO peripheral of the CH32V30x and
+	the CH32H41x: 4 bit bus, DMA, 512 byte blocks.
+
+	- SDRead() / SDWrite() move a run of blocks with one CMD18 / CMD25 and
+	  a CMD12, not a command per block. A write of more than one block
+	  tells the card how many are coming first (ACMD23), so it can erase
+	  ahead.
+	- A write stream for logging. SDStreamOpen() starts one CMD25 that stays
+	  open. The program fills one buffer while the DMA sends the other, and
+	  SDStreamClose() ends it. The card sees one long sequential write, the
+	  case it's fastest at, and no command overhead between buffers.
+	- SDErase() erases a range ahead of time (CMD32/33/38).
+	- SDRead, SDWrite, SDSync and SDBlocks are the block device, with the
+	  arguments FatFs' disk_read() and friends take. See blockdev_t.
+
+	Usage:
+
+	#include "lib_sdcard.h"
+
+	if( SDInit() ) ...             // no card, or not one this can use
+	SDRead( lba, buf, 8 );         // buffers word aligned
+	SDWrite( lba, buf, 8 );
+
+	SDStreamOpen( lba, blocks );   // how many will come, or 0
+	while( logging )
+	{
+		uint8_t * b = SDStreamBuffer();     // 0 while both buffers are out
+		if( b )
+		{
+			... fill SD_STREAM_BLOCKS * 512 bytes
+			SDStreamSubmit( SD_STREAM_BLOCKS );
+		}
+		SDStreamPoll();
+	}
+	SDStreamClose();
+
+	Everything returns 0 or one of the negative SD_ERR_*. SDRead() and
+	SDWrite() try a run SD_RETRIES times. A stream stops at the first error,
+	SDStreamClose() returns it.
+
+	Hooks, define before including:
+
+	SD_STREAM_DONE( lba, blocks, ticks )   A stream buffer is on the card,
+	                           ticks after its SDStreamSubmit().
+	SD_TICKS() / SD_TICKS_MS( ms )         Time, SysTick by default.
+
+	The hardware, all of these or none (a host model, another controller):
+
+	SD_HW_INIT()               Power, pins, clock at 400 kHz, 1 bit, and
+	                           the 74 clocks before the first command.
+	SD_HW_CLOCK( div, wide )   SDIO clock divider, 4 bit bus if wide.
+	SD_HW_CMD( cmd, arg, flags, resp )
+	                           Send a command and wait for the response.
+	                           flags are SD_R_*. 0, SD_ERR_TIMEOUT or
+	                           SD_ERR_CRC. resp gets 1 word, or 4 for
+	                           SD_R_LONG, the most significant one first.
+	SD_HW_DATA( buf, blocks, to_card )
+	                           Start a DMA transfer of blocks * 512 bytes.
+	SD_HW_DATA_BUSY()          1 while it runs, then 0, or SD_ERR_*.
+	SD_HW_DATA_ABORT()         Stop it.
+
+	Without them it's the SDIO peripheral and DMA2 channel 4 of the
+	CH32V30x, on PC8-PC11 (D0-D3), PC12 (CK) and PD2 (CMD). The card needs
+	pull-ups on CMD and D0-D3, most sockets have them. The CH32H41x has the
+	same SDIO. Its pins go through alternate function selection and its DMA
+	requests through a DMAMUX, so there define SD_HW_PINS(), SD_DMA (the
+	channel) and SD_HW_DMA_SETUP() (route the SDIO request to it).
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#define SD_ERR_TIMEOUT   -1  // no response, or the data didn't come
+#define SD_ERR_CRC       -2
+#define SD_ERR_CARD      -3  // the card reported an error in its status
+#define SD_ERR_NOCARD    -4
+#define SD_ERR_UNUSABLE  -5  // wrong voltage or an unknown CSD
+#define SD_ERR_RANGE     -6
+#define SD_ERR_PARAM     -7  // unaligned buffer, no stream open, ...
+
+// Response types for SD_HW_CMD()
+#define SD_R_NONE   0
+#define SD_R_SHORT  1
+#define SD_R_LONG   2
+#define SD_R_NOCRC  4      // R3 has no CRC
+#define SD_R_STATUS 8      // R1, check the error bits
+#define SD_R1  ( SD_R_SHORT | SD_R_STATUS )
+#define SD_R2  SD_R_LONG
+#define SD_R3  ( SD_R_SHORT | SD_R_NOCRC )
+#define SD_R6  SD_R_SHORT
+#define SD_R7  SD_R_SHORT
+
+#define SD_R1_ERRORS  0xfdffe008
+#define SD_R1_ILLEGAL 0x00400000
+#define SD_R1_READY   0x00000100
+#define SD_R1_STATE( r ) ( ( ( r ) >> 9 ) & 15 )
+#define SD_STATE_TRAN 4
+
+#ifndef SD_STREAM_BLOCKS
+#define SD_STREAM_BLOCKS 16   // per buffer, there are two
+#endif
+
+#ifndef SD_RUN_BLOCKS
+#define SD_RUN_BLOCKS 128     // most blocks per command, the DMA counts up to 511
+#endif
+
+#ifndef SD_RETRIES
+#define SD_RETRIES 2
+#endif
+
+#ifndef SD_WRITE_MS
+#define SD_WRITE_MS 500       // longest the card may be busy, per the spec 250 ms for SDHC, 500 ms SDXC
+#endif
+
+#ifndef SD_ERASE_MS
+#define SD_ERASE_MS 5000
+#endif
+
+#ifndef SD_TICKS
+#define SD_TICKS() ( (uint32_t)SysTick->CNT )
+#define SD_TICKS_MS( ms ) Ticks_from_Ms( ms )
+#endif
+
+#ifndef SD_STREAM_DONE
+#define SD_STREAM_DONE( lba, blocks, ticks )
+#endif
+
+#ifndef SD_HW_CMD
+
+// Card clock is HCLK / ( div + 2 )
+#ifndef SD_INIT_DIV
+#if FUNCONF_SYSTEM_CORE_CLOCK / 400000 - 1 > 255
+#define SD_INIT_DIV 255       // CLKDIV is 8 bits, 560 kHz at 144 MHz, cards put up with it
+#else
+#define SD_INIT_DIV ( FUNCONF_SYSTEM_CORE_CLOCK / 400000 - 1 )
+#endif
+#endif
+#ifndef SD_CLK_DIV
+#if FUNCONF_SYSTEM_CORE_CLOCK > 48000000
+#define SD_CLK_DIV ( ( FUNCONF_SYSTEM_CORE_CLOCK + 23999999 ) / 24000000 - 2 )  // at most 24 MHz
+#else
+#define SD_CLK_DIV 0
+#endif
+#endif
+
+#ifndef SD_DTIMER
+#define SD_DTIMER ( 24000000 / 1000 * SD_WRITE_MS )  // card clocks
+#endif
+
+#define SD_CLKCR_CLKEN 0x00000100
+#define SD_DCTRL_DMAEN 0x00000008
+#define SD_CMD_FLAGS   ( SDIO_FLAG_CCRCFAIL | SDIO_FLAG_CTIMEOUT | SDIO_FLAG_CMDREND | SDIO_FLAG_CMDSENT )
+#define SD_DATA_ERRORS ( SDIO_FLAG_DCRCFAIL | SDIO_FLAG_DTIMEOUT | SDIO_FLAG_TXUNDERR | SDIO_FLAG_RXOVERR | SDIO_FLAG_STBITERR )
+#define SD_DATA_FLAGS  ( SD_DATA_ERRORS | SDIO_FLAG_DATAEND | SDIO_FLAG_DBCKEND )
+
+#if defined( CH32H41x )
+#if !defined( SD_HW_PINS ) || !defined( SD_DMA ) || !defined( SD_HW_DMA_SETUP )
+#error "lib_sdcard: on the CH32H41x define SD_HW_PINS(), SD_DMA and SD_HW_DMA_SETUP(), see the top of lib_sdcard.h"
+#endif
+#else
+#ifndef SD_HW_PINS
+#define SD_HW_PINS() { \
+	RCC->APB2PCENR |= RCC_IOPCEN | RCC_IOPDEN; \
+	funPinMode( PC8, GPIO_CFGLR_OUT_50Mhz_AF_PP ); \
+	funPinMode( PC9, GPIO_CFGLR_OUT_50Mhz_AF_PP ); \
+	funPinMode( PC10, GPIO_CFGLR_OUT_50Mhz_AF_PP ); \
+	funPinMode( PC11, GPIO_CFGLR_OUT_50Mhz_AF_PP ); \
+	funPinMode( PC12, GPIO_CFGLR_OUT_50Mhz_AF_PP ); \
+	funPinMode( PD2, GPIO_CFGLR_OUT_50Mhz_AF_PP ); }
+#endif
+#ifndef SD_DMA
+#define SD_DMA DMA2_Channel4
+#endif
+#ifndef SD_HW_DMA_SETUP
+#define SD_HW_DMA_SETUP()
+#endif
+#endif
+
+static void sd_hw_init( void )
+{
+#if defined( CH32H41x )
+	RCC->HB2PCENR |= RCC_SDIOEN;
+	RCC->HBPCENR |= RCC_DMA2EN;
+#else
+	RCC->AHBPCENR |= RCC_SDIOEN | RCC_DMA2EN;
+#endif
+	SD_HW_PINS();
+	SD_HW_DMA_SETUP();
+	SDIO->CLKCR = SD_CLKCR_CLKEN | SD_INIT_DIV;
+	SDIO->POWER = SDIO_PowerState_ON;
+	Delay_Ms( 2 );        // power up, and well over 74 clocks
+}
+
+static void sd_hw_clock( int div, int wide )
+{
+	SDIO->CLKCR = SD_CLKCR_CLKEN | ( wide ? SDIO_BusWide_4b : 0 ) | div;
+}
+
+static int sd_hw_cmd( int cmd, uint32_t arg, int flags, uint32_t * resp )
+{
+	SDIO->ICR = SD_CMD_FLAGS;
+	SDIO->ARG = arg;
+	uint32_t wait = ( flags & SD_R_LONG ) ? SDIO_Response_Long : ( flags & SD_R_SHORT ) ? SDIO_Response_Short : SDIO_Response_No;
+	SDIO->CMD = cmd | wait | SDIO_CPSM_Enable;
+
+	// The CPSM times out by itself after 64 clocks without a response.
+	uint32_t done = wait ? SDIO_FLAG_CMDREND | SDIO_FLAG_CCRCFAIL | SDIO_FLAG_CTIMEOUT : SDIO_FLAG_CMDSENT;
+	uint32_t sta;
+	while( !( ( sta = SDIO->STA ) & done ) );
+	SDIO->ICR = SD_CMD_FLAGS;
+
+	if( sta & SDIO_FLAG_CTIMEOUT ) return SD_ERR_TIMEOUT;
+	if( !wait ) return 0;
+	if( !( flags & SD_R_NOCRC ) )
+	{
+		if( sta & SDIO_FLAG_CCRCFAIL ) return SD_ERR_CRC;
+		if( !( flags & SD_R_LONG ) && ( SDIO->RESPCMD & 0x3f ) != (uint32_t)cmd ) return SD_ERR_CRC;
+	}
+	resp[0] = SDIO->RESP1;
+	if( flags & SD_R_LONG )
+	{
+		resp[1] = SDIO->RESP2;
+		resp[2] = SDIO->RESP3;
+		resp[3] = SDIO->RESP4;
+	}
+	return 0;
+}
+
+static void sd_hw_data_abort( void )
+{
+	SDIO->DCTRL = 0;
+	SD_DMA->CFGR = 0;
+	SDIO->ICR = SD_DATA_FLAGS;
+}
+
+static void sd_hw_data( const void * buf, int blocks, int to_card )
+{
+	sd_hw_data_abort();
+	SD_DMA->PADDR = (uint32_t)&SDIO->FIFO;
+	SD_DMA->MADDR = (uint32_t)buf;
+	SD_DMA->CNTR = blocks * 128;
+	SD_DMA->CFGR = DMA_CFGR1_MINC | DMA_CFGR1_PSIZE_1 | DMA_CFGR1_MSIZE_1 | DMA_CFGR1_PL |
+		( to_card ? DMA_CFGR1_DIR : 0 ) | DMA_CFGR1_EN;
+	SDIO->DTIMER = SD_DTIMER;
+	SDIO->DLEN = blocks * 512;
+	SDIO->DCTRL = SDIO_DataBlockSize_512b | SD_DCTRL_DMAEN | ( to_card ? 0 : SDIO_TransferDir_ToSDIO ) | SDIO_DPSM_Enable;
+}
+
+static int sd_hw_data_busy( void )
+{
+	uint32_t sta = SDIO->STA;
+	if( sta & SD_DATA_ERRORS )
+	{
+		sd_hw_data_abort();
+		return ( sta & SDIO_FLAG_DTIMEOUT ) ? SD_ERR_TIMEOUT : SD_ERR_CRC;
+	}
+	// On a read the DMA may still be emptying the FIFO after DATAEND.
+	if( !( sta & SDIO_FLAG_DATAEND ) || SD_DMA->CNTR ) return 1;
+	SD_DMA->CFGR = 0;
+	return 0;
+}
+
+#define SD_HW_INIT()                    sd_hw_init()
+#define SD_HW_CLOCK( div, wide )        sd_hw_clock( div, wide )
+#define SD_HW_CMD( cmd, arg, flags, r ) sd_hw_cmd( cmd, arg, flags, r )
+#define SD_HW_DATA( buf, n, to_card )   sd_hw_data( buf, n, to_card )
+#define SD_HW_DATA_BUSY()               sd_hw_data_busy()
+#define SD_HW_DATA_ABORT()              sd_hw_data_abort()
+
+#endif // SD_HW_CMD
+
+#ifndef SD_CLK_DIV
+#define SD_CLK_DIV 0
+#endif
+
+// A block device, as FatFs' diskio or a USB mass storage class wants one.
+#ifndef BLOCKDEV_T
+#define BLOCKDEV_T
+typedef struct
+{
+	int ( *read )( uint32_t lba, void * buf, uint32_t count );
+	int ( *write )( uint32_t lba, const void * buf, uint32_t count );
+	int ( *sync )( void );
+	uint32_t ( *blocks )( void );
+} blockdev_t;
+#endif
+
+#define SD_BLOCKDEV { SDRead, SDWrite, SDSync, SDBlocks }
+
+static struct
+{
+	uint32_t rca;           // in the upper half, as the commands want it
+	uint32_t blocks;
+	uint8_t hc;             // addressed in blocks, not bytes
+	uint8_t stream;         // a CMD25 is open
+	uint8_t queued;         // stream buffers submitted and not on the card yet
+	uint8_t out;            // the DMA is sending buf[tail]
+	uint8_t head, tail;
+	int err;
+	uint32_t lba;           // of the next stream buffer to submit
+	uint32_t sent;          // of the one the DMA sends next
+	uint32_t n[2];
+	uint32_t t[2];          // when they were submitted
+	uint32_t start;         // when the DMA started on buf[tail]
+	uint32_t cid[4];
+	uint32_t csd[4];
+} sd;
+
+static uint32_t sd_stream_buf[2][SD_STREAM_BLOCKS * 128];
+
+#define SD_ADDR( lba ) ( sd.hc ? ( lba ) : ( lba ) * 512 )
+
+static int sd_cmd( int cmd, uint32_t arg, int flags, uint32_t * resp )
+{
+	uint32_t r[4];
+	if( !resp ) resp = r;
+	int e = SD_HW_CMD( cmd, arg, flags, resp );
+	if( e ) return e;
+	if( ( flags & SD_R_STATUS ) && ( resp[0] & SD_R1_ERRORS ) ) return SD_ERR_CARD;
+	return 0;
+}
+
+static int sd_acmd( int cmd, uint32_t arg, int flags, uint32_t * resp )
+{
+	int e = sd_cmd( 55, sd.rca, SD_R1, 0 );
+	return e ? e : sd_cmd( cmd, arg, flags, resp );
+}
+
+// Bits hi..lo of a 128 bit R2 (CID, CSD).
+static uint32_t sd_bits( const uint32_t * r, int hi, int lo )
+{
+	uint32_t v = 0;
+	for( int b = hi; b >= lo; b-- )
+		v = v << 1 | ( ( r[3 - b / 32] >> ( b % 32 ) ) & 1 );
+	return v;
+}
+
+// Waits until the card is done programming and back in the transfer state.
+// Errors it reports on the way count, except the illegal command of a CMD12
+// it didn't need (after a write command that never made it). A lost or
+// broken response is just asked again.
+static int sd_wait_ready( int ms )
+{
+	uint32_t r, err = 0, t0 = SD_TICKS();
+	while( 1 )
+	{
+		if( SD_HW_CMD( 13, sd.rca, SD_R1, &r ) == 0 )
+		{
+			err |= r & SD_R1_ERRORS & ~SD_R1_ILLEGAL;
+			if( ( r & SD_R1_READY ) && SD_R1_STATE( r ) == SD_STATE_TRAN ) return err ? SD_ERR_CARD : 0;
+		}
+		if( (int32_t)( SD_TICKS() - t0 ) > (int32_t)SD_TICKS_MS( ms ) ) return SD_ERR_TIMEOUT;
+	}
+}
+
+static int sd_data_wait( int ms )
+{
+	int e;
+	uint32_t t0 = SD_TICKS();
+	while( ( e = SD_HW_DATA_BUSY() ) > 0 )
+	{
+		if( (int32_t)( SD_TICKS() - t0 ) > (int32_t)SD_TICKS_MS( ms ) )
+		{
+			SD_HW_DATA_ABORT();
+			return SD_ERR_TIMEOUT;
+		}
+	}
+	return e;
+}
+
+static int SDInit( void )
+{
+	uint32_t r[4];
+	memset( &sd, 0, sizeof( sd ) );
+	SD_HW_INIT();
+	sd_cmd( 0, 0, SD_R_NONE, 0 );
+
+	// CMD8 is what tells a v2 card (SDHC and up may be) from a v1 one.
+	int v2 = sd_cmd( 8, 0x1aa, SD_R7, r ) == 0;
+	if( v2 && ( r[0] & 0xfff ) != 0x1aa ) return SD_ERR_UNUSABLE;
+
+	uint32_t t0 = SD_TICKS();
+	do
+	{
+		// Not sd_acmd(), a v1 card flags the CMD8 it didn't know in this R1.
+		int e = sd_cmd( 55, 0, SD_R_SHORT, 0 );
+		if( !e ) e = sd_cmd( 41, 0x00300000 | ( v2 ? 0x40000000 : 0 ), SD_R3, r );  // 3.2-3.4 V
+		if( e ) return e == SD_ERR_TIMEOUT ? SD_ERR_NOCARD : e;
+		if( (int32_t)( SD_TICKS() - t0 ) > (int32_t)SD_TICKS_MS( 1000 ) ) return SD_ERR_TIMEOUT;
+	} while( !( r[0] & 0x80000000 ) );
+	if( !( r[0] & 0x00300000 ) ) return SD_ERR_UNUSABLE;
+	sd.hc = !!( r[0] & 0x40000000 );
+
+	int e = sd_cmd( 2, 0, SD_R2, sd.cid );
+	if( !e ) e = sd_cmd( 3, 0, SD_R6, r );
+	if( e ) return e;
+	sd.rca = r[0] & 0xffff0000;
+
+	if( ( e = sd_cmd( 9, sd.rca, SD_R2, sd.csd ) ) ) return e;
+	switch( sd_bits( sd.csd, 127, 126 ) )
+	{
+	case 0:
+		sd.blocks = ( sd_bits( sd.csd, 73, 62 ) + 1 ) << ( sd_bits( sd.csd, 49, 47 ) + 2 + sd_bits( sd.csd, 83, 80 ) - 9 );
+		break;
+	case 1:
+		sd.blocks = ( sd_bits( sd.csd, 69, 48 ) + 1 ) << 10;
+		break;
+	default:
+		return SD_ERR_UNUSABLE;
+	}
+
+	if( ( e = sd_cmd( 7, sd.rca, SD_R1, 0 ) ) ) return e;
+	if( ( e = sd_wait_ready( 100 ) ) ) return e;
+	if( ( e = sd_acmd( 6, 2, SD_R1, 0 ) ) ) return e;     // 4 bit bus
+	SD_HW_CLOCK( SD_CLK_DIV, 1 );
+	if( !sd.hc && ( e = sd_cmd( 16, 512, SD_R1, 0 ) ) ) return e;
+	return 0;
+}
+
+static uint32_t SDBlocks( void )
+{
+	return sd.blocks;
+}
+
+static int sd_check( uint32_t lba, const void * buf, uint32_t n )
+{
+	if( sd.stream || ( (uintptr_t)buf & 3 ) ) return SD_ERR_PARAM;
+	if( lba > sd.blocks || n > sd.blocks - lba ) return SD_ERR_RANGE;
+	return 0;
+}
+
+static int sd_read_run( uint32_t lba, void * buf, uint32_t n )
+{
+	// The DPSM is armed first, the data follows the response right away.
+	SD_HW_DATA( buf, n, 0 );
+	int e = sd_cmd( n > 1 ? 18 : 17, SD_ADDR( lba ), SD_R1, 0 );
+	if( !e ) e = sd_data_wait( 100 );
+	else SD_HW_DATA_ABORT();
+	if( n > 1 )
+	{
+		int s = sd_cmd( 12, 0, SD_R1, 0 );
+		if( !e ) e = s;
+	}
+	if( e ) sd_wait_ready( 100 );
+	return e;
+}
+
+static int SDRead( uint32_t lba, void * buf, uint32_t n )
+{
+	int e = sd_check( lba, buf, n );
+	while( !e && n )
+	{
+		uint32_t run = n < SD_RUN_BLOCKS ? n : SD_RUN_BLOCKS;
+		int tries = SD_RETRIES;
+		while( ( e = sd_read_run( lba, buf, run ) ) && --tries > 0 );
+		lba += run;
+		buf = (uint8_t *)buf + run * 512;
+		n -= run;
+	}
+	return e;
+}
+
+static int sd_write_run( uint32_t lba, const void * buf, uint32_t n )
+{
+	int e = 0, sent = 0;
+	if( n > 1 ) e = sd_acmd( 23, n, SD_R1, 0 );            // erase ahead
+	if( !e )
+	{
+		e = sd_cmd( n > 1 ? 25 : 24, SD_ADDR( lba ), SD_R1, 0 );
+		sent = 1;
+	}
+	if( !e )
+	{
+		SD_HW_DATA( buf, n, 1 );
+		e = sd_data_wait( SD_WRITE_MS * ( n < 8 ? n : 8 ) );
+	}
+	if( n > 1 && sent )
+	{
+		int s = sd_cmd( 12, 0, SD_R1, 0 );
+		if( !e ) e = s;
+	}
+	int s = sd_wait_ready( SD_WRITE_MS );
+	return e ? e : s;
+}
+
+static int SDWrite( uint32_t lba, const void * buf, uint32_t n )
+{
+	int e = sd_check( lba, buf, n );
+	while( !e && n )
+	{
+		uint32_t run = n < SD_RUN_BLOCKS ? n : SD_RUN_BLOCKS;
+		int tries = SD_RETRIES;
+		while( ( e = sd_write_run( lba, buf, run ) ) && --tries > 0 );
+		lba += run;
+		buf = (const uint8_t *)buf + run * 512;
+		n -= run;
+	}
+	return e;
+}
+
+// Writes are done when SDWrite() returns, this only checks the card is idle.
+static int SDSync( void )
+{
+	return sd.stream ? SD_ERR_PARAM : sd_wait_ready( SD_WRITE_MS );
+}
+
+// The card erases whole allocation units fastest, a few MB, ask for those.
+static int SDErase( uint32_t lba, uint32_t n )
+{
+	int e = sd_check( lba, 0, n );
+	if( e || !n ) return e;
+	if( !( e = sd_cmd( 32, SD_ADDR( lba ), SD_R1, 0 ) ) &&
+		!( e = sd_cmd( 33, SD_ADDR( lba + n - 1 ), SD_R1, 0 ) ) &&
+		!( e = sd_cmd( 38, 0, SD_R1, 0 ) ) )
+		return sd_wait_ready( SD_ERASE_MS );
+	sd_wait_ready( SD_ERASE_MS );
+	return e;
+}
+
+// Starts a stream at lba. blocks, if known, is how many will follow.
+static int SDStreamOpen( uint32_t lba, uint32_t blocks )
+{
+	int e = sd_check( lba, 0, blocks );
+	if( e ) return e;
+	if( blocks && ( e = sd_acmd( 23, blocks < 0x7fffff ? blocks : 0x7fffff, SD_R1, 0 ) ) ) return e;
+	if( ( e = sd_cmd( 25, SD_ADDR( lba ), SD_R1, 0 ) ) )
+	{
+		sd_cmd( 12, 0, SD_R1, 0 );      // in case it got there
+		sd_wait_ready( SD_WRITE_MS );
+		return e;
+	}
+	sd.stream = 1;
+	sd.queued = sd.out = sd.head = sd.tail = 0;
+	sd.err = 0;
+	sd.lba = sd.sent = lba;
+	return 0;
+}
+
+// Moves the stream along: the next buffer to the DMA as soon as the last
+// one is done. Call it often, or from the SDIO or DMA interrupt.
+static int SDStreamPoll( void )
+{
+	if( !sd.stream || sd.err ) return sd.err;
+	if( sd.out )
+	{
+		int e = SD_HW_DATA_BUSY();
+		if( e > 0 )
+		{
+			if( (int32_t)( SD_TICKS() - sd.start ) > (int32_t)SD_TICKS_MS( SD_WRITE_MS * 2 ) )
+			{
+				SD_HW_DATA_ABORT();
+				return sd.err = SD_ERR_TIMEOUT;
+			}
+			return 0;
+		}
+		if( e < 0 ) return sd.err = e;
+		SD_STREAM_DONE( sd.sent, sd.n[sd.tail], SD_TICKS() - sd.t[sd.tail] );
+		sd.sent += sd.n[sd.tail];
+		sd.out = 0;
+		sd.tail ^= 1;
+		sd.queued--;
+	}
+	if( sd.queued )
+	{
+		SD_HW_DATA( sd_stream_buf[sd.tail], sd.n[sd.tail], 1 );
+		sd.start = SD_TICKS();
+		sd.out = 1;
+	}
+	return 0;
+}
+
+// The buffer to fill next, SD_STREAM_BLOCKS * 512 bytes, or 0 while both
+// are still going out (or after an error).
+static uint8_t * SDStreamBuffer( void )
+{
+	SDStreamPoll();
+	if( !sd.stream || sd.err || sd.queued == 2 ) return 0;
+	return (uint8_t *)sd_stream_buf[sd.head];
+}
+
+// Hands the buffer from SDStreamBuffer() to the card, its first n blocks.
+static int SDStreamSubmit( uint32_t n )
+{
+	if( !sd.stream || sd.queued == 2 || !n || n > SD_STREAM_BLOCKS ) return SD_ERR_PARAM;
+	if( sd.err ) return sd.err;
+	if( n > sd.blocks - sd.lba ) return sd.err = SD_ERR_RANGE;
+	sd.n[sd.head] = n;
+	sd.t[sd.head] = SD_TICKS();
+	sd.head ^= 1;
+	sd.lba += n;
+	sd.queued++;
+	return SDStreamPoll();
+}
+
+// Sends what was submitted and ends the write. Returns the first error of
+// the stream, blocks from sd.sent on may not have made it.
+static int SDStreamClose( void )
+{
+	if( !sd.stream ) return SD_ERR_PARAM;
+	while( sd.queued && !SDStreamPoll() );
+	if( sd.err ) SD_HW_DATA_ABORT();
+	int e = sd_cmd( 12, 0, SD_R1, 0 );
+	int w = sd_wait_ready( SD_WRITE_MS );
+	sd.stream = 0;
+	return sd.err ? sd.err : e ? e : w;
+}
+
+#endif
@@ -0,0 +1,578 @@
+#ifndef _LIB_STEPPER_H
+#define _LIB_STEPPER_H
+
+/** Timer driven stepper engine with acceleration ramps.
+
+	Step intervals come from the integer form of the Leib / AVR446 ramp,
+	c_n = c_(n-1) - 2*c_(n-1)/(4n+1), evaluated one step at a time inside a
+	SysTick compare interrupt. Every axis keeps an absolute deadline, the
+	interrupt steps whatever is due and re-arms the compare for the earliest
+	one, so any number of axes share the one timer without drift.
+
+	All four coil pins of an axis must be on the same port, a step is then a
+	single store to BSHR on CH32V, or a store to CLR and one to SET on CH5xx.
+	Nothing read-modify-writes the port, so other pins on it can be driven
+	from the main loop meanwhile. The CH582/3 have no SET register, there
+	the bits are set with OUT |= as GPIO_SetBits() does.
+
+	Usage:
+
+	#define STEPPER_MICROSTEPS 2 // 1 = full step, 2 = half step, 4..32 use STEPPER_PWM_HOOK
+	#include "lib_stepper.h"
+
+	StepperAxis x;
+	Stepper_Init( &x, PA6, PA7, PA10, PA11 ); // AIN1, AIN2, BIN1, BIN2
+	Stepper_SetLimits( &x, 4000, 2000 );      // steps/s^2, steps/s
+	Stepper_TimerInit();
+
+	Stepper_Move( &x, 800 );    // relative move, ramps up and down
+	Stepper_Run( &x, -1500 );   // or jog at a signed speed, 0 to ramp down
+	while( Stepper_Busy( &x ) );
+	Stepper_Release( &x );
+
+	StepperAxis * both[2] = { &x, &y };
+	int32_t delta[2] = { 1000, 250 };
+	Stepper_MoveLinear( both, delta, 2 ); // both axes arrive together
+
+	For microstepping (STEPPER_MICROSTEPS > 2) define
+	STEPPER_PWM_HOOK( axis, ia, ib ) before including. It gets the signed coil
+	currents -255..255 for every microstep and has to set the PWM duties, the
+	port is not touched in that mode.
+
+	By default this defines SysTick_Handler(), a program with its own can't
+	link with it. Define STEPPER_NO_SYSTICK_HANDLER then and call
+	Stepper_Tick() from that handler, it clears the flag and does the rest.
+	The compare stays the stepper's, the handler can't use it for anything
+	else.
+
+	To use another timer define STEPPER_CUSTOM_TIMER and STEPPER_TICK_HZ,
+	provide Stepper_Now() and Stepper_Kick(), and call Stepper_Service() from
+	the compare interrupt. Stepper_Kick() has to get the interrupt in soon
+	even when the compare is already set for later.
+*/
+
+#include <stdint.h>
+
+#ifndef STEPPER_MICROSTEPS
+#define STEPPER_MICROSTEPS 2
+#endif
+
+#ifndef STEPPER_MAX_AXES
+#define STEPPER_MAX_AXES 4
+#endif
+
+// Timer ticks per second, whatever rate SystemInit() left SysTick at.
+#ifndef STEPPER_TICK_HZ
+#define STEPPER_TICK_HZ ( DELAY_US_TIME * 1000000 )
+#endif
+
+// Steps due within this many ticks of each other are issued in the same
+// interrupt, saves an entry/exit when axes run at similar rates.
+#ifndef STEPPER_GROUP_TICKS
+#define STEPPER_GROUP_TICKS (STEPPER_TICK_HZ / 200000)
+#endif
+
+#if STEPPER_MICROSTEPS > 2 && !defined( STEPPER_PWM_HOOK )
+#error "lib_stepper: microstepping needs STEPPER_PWM_HOOK( axis, ia, ib )"
+#endif
+
+#if STEPPER_MICROSTEPS > 32 || ( STEPPER_MICROSTEPS & ( STEPPER_MICROSTEPS - 1 ) )
+#error "lib_stepper: STEPPER_MICROSTEPS must be a power of two up to 32"
+#endif
+
+// Electrical positions per full cycle (4 full steps)
+#define STEPPER_PHASES ( 4 * STEPPER_MICROSTEPS )
+
+#ifndef STEPPER_PORT_WRITE
+#if defined( CH5xx )
+typedef volatile uint32_t * StepperPort;
+#define STEPPER_PORT_OF( pin ) ( &R32_PA_OUT + OFFSET_FOR_GPIOB( pin ) )
+#define STEPPER_PIN_MASK( pin ) ( (pin) & ~PB )
+// Clear first, a coil passes through off rather than through brake.
+#if defined( CH571_CH573 ) || defined( CH582_CH583 )
+#define STEPPER_PORT_WRITE( a, bits ) do { \
+		(a)->port[&R32_PA_CLR - &R32_PA_OUT] = (a)->mask & ~(bits); \
+		*(a)->port |= (bits); \
+	} while( 0 )
+#else
+#define STEPPER_PORT_WRITE( a, bits ) do { \
+		(a)->port[&R32_PA_CLR - &R32_PA_OUT] = (a)->mask & ~(bits); \
+		(a)->port[&R32_PA_SET - &R32_PA_OUT] = (bits); \
+	} while( 0 )
+#endif
+#else
+typedef GPIO_TypeDef * StepperPort;
+#define STEPPER_PORT_OF( pin ) GpioOf( pin )
+#define STEPPER_PIN_MASK( pin ) ( 1 << ( (pin) & 0xf ) )
+#define STEPPER_PORT_WRITE( a, bits ) ( (a)->port->BSHR = (bits) | ( ( (a)->mask & ~(bits) ) << 16 ) )
+#endif
+#endif
+
+enum StepperState
+{
+	STEPPER_IDLE = 0,
+	STEPPER_MOVE,    // counting down steps_left, decelerates into the target
+	STEPPER_JOG,     // runs at target_delay until told otherwise
+	STEPPER_FOLLOW,  // slaved to another axis by Stepper_MoveLinear
+};
+
+typedef struct StepperAxis StepperAxis;
+struct StepperAxis
+{
+	StepperPort port;
+	uint32_t mask;                     // all four coil pins
+	uint32_t pattern[8];               // port bits for each half step position
+
+	volatile uint8_t state;
+	int8_t dir;                        // +1 / -1, direction of travel
+	int8_t jog_dir;                    // requested direction in jog mode
+	uint8_t phase;                     // 0..STEPPER_PHASES-1
+	volatile int32_t position;         // in steps
+
+	uint32_t c0;                       // first step interval, from the acceleration
+	uint32_t min_delay;                // from the top speed
+	uint32_t target_delay;             // cruise interval for this move / jog
+	uint32_t delay;                    // current interval
+	uint32_t rest;                     // remainder carried by the ramp recurrence
+	uint32_t n;                        // ramp index, steps needed to stop
+	uint32_t steps_left;
+	int32_t target;                    // where a move ends up
+	uint8_t pending;                   // move had to stop first, target still to go
+	uint32_t next;                     // absolute deadline, timer ticks
+
+	// Stepper_MoveLinear: Bresenham from the axis with the most steps
+	StepperAxis * follower;
+	uint32_t follow_delta;
+	uint32_t follow_total;
+	int32_t follow_err;
+};
+
+static StepperAxis * stepper_axes[STEPPER_MAX_AXES];
+static uint8_t stepper_axis_count;
+
+static uint32_t Stepper_Now( void );
+static void Stepper_Kick( void );
+
+// Step positions as AIN1 AIN2 BIN1 BIN2, half step order. Full step mode uses
+// the even entries, both coils on, same sequence the old tick loop used.
+static const uint8_t stepper_half_seq[8] = { 0b1010, 0b0010, 0b0110, 0b0100, 0b0101, 0b0001, 0b1001, 0b1000 };
+
+#if STEPPER_MICROSTEPS > 2
+// Quarter sine, 255 * sin( i * 90deg / 32 ), indexed in 1/32 steps
+static const uint8_t stepper_sine[33] = {
+	  0,  13,  25,  37,  50,  62,  74,  86,  98, 109, 120, 131, 142, 152, 162, 171,
+	180, 189, 197, 205, 212, 219, 225, 231, 236, 240, 244, 247, 250, 252, 254, 255,
+	255 };
+
+static int stepper_sin( uint32_t idx ) // idx in 1/128 of a turn
+{
+	uint32_t q = ( idx >> 5 ) & 3;
+	uint32_t i = idx & 31;
+	int v = ( q & 1 ) ? stepper_sine[32 - i] : stepper_sine[i];
+	return ( q & 2 ) ? -v : v;
+}
+#endif
+
+static void Stepper_ApplyPhase( StepperAxis * a )
+{
+#if STEPPER_MICROSTEPS > 2
+	// Full step 0 is both coils on, so start the sine at 45 degrees.
+	uint32_t idx = a->phase * ( 32 / STEPPER_MICROSTEPS ) + 16;
+	STEPPER_PWM_HOOK( a, stepper_sin( idx + 32 ), stepper_sin( idx ) );
+#elif STEPPER_MICROSTEPS == 2
+	STEPPER_PORT_WRITE( a, a->pattern[a->phase] );
+#else
+	STEPPER_PORT_WRITE( a, a->pattern[a->phase * 2] );
+#endif
+}
+
+static void Stepper_Init( StepperAxis * a, uint32_t a1, uint32_t a2, uint32_t b1, uint32_t b2 )
+{
+	uint32_t pins[4] = { a1, a2, b1, b2 };
+	int i, j;
+
+	a->port = STEPPER_PORT_OF( a1 );
+	a->mask = 0;
+	for( i = 0; i < 4; i++ )
+		a->mask |= STEPPER_PIN_MASK( pins[i] );
+	for( i = 0; i < 8; i++ )
+	{
+		a->pattern[i] = 0;
+		for( j = 0; j < 4; j++ )
+			if( stepper_half_seq[i] & ( 8 >> j ) )
+				a->pattern[i] |= STEPPER_PIN_MASK( pins[j] );
+	}
+
+	a->state = STEPPER_IDLE;
+	a->dir = a->jog_dir = 1;
+	a->phase = 0;
+	a->position = 0;
+	a->follower = 0;
+	STEPPER_PORT_WRITE( a, 0 );
+
+	if( stepper_axis_count < STEPPER_MAX_AXES )
+		stepper_axes[stepper_axis_count++] = a;
+}
+
+static uint32_t stepper_isqrt( uint64_t v )
+{
+	uint64_t r = 0, b = (uint64_t)1 << 62;
+	while( b > v ) b >>= 2;
+	while( b )
+	{
+		if( v >= r + b ) { v -= r + b; r = ( r >> 1 ) + b; }
+		else r >>= 1;
+		b >>= 2;
+	}
+	return (uint32_t)r;
+}
+
+// accel in steps/s^2, speed in steps/s. Takes effect on the next move.
+static void Stepper_SetLimits( StepperAxis * a, uint32_t accel, uint32_t speed )
+{
+	if( accel == 0 ) accel = 1;
+	if( speed == 0 ) speed = 1;
+	// c0 = 0.676 * f * sqrt( 2 / accel ), the 0.676 corrects the error of the
+	// first few steps of the recurrence.
+	a->c0 = (uint32_t)( (uint64_t)stepper_isqrt( 2ull * STEPPER_TICK_HZ * STEPPER_TICK_HZ / accel ) * 676 / 1000 );
+	a->min_delay = STEPPER_TICK_HZ / speed;
+	if( a->min_delay == 0 ) a->min_delay = 1;
+}
+
+static void Stepper_Step( StepperAxis * a )
+{
+	a->phase = ( a->phase + a->dir ) & ( STEPPER_PHASES - 1 );
+	a->position += a->dir;
+	Stepper_ApplyPhase( a );
+}
+
+// Works out the interval to the next step. Returns 0 when the axis is done.
+static int Stepper_NextDelay( StepperAxis * a )
+{
+	int stopping;
+	uint32_t target = a->target_delay;
+
+	if( a->state == STEPPER_MOVE )
+	{
+		if( --a->steps_left == 0 ) return 0;
+		stopping = a->steps_left <= a->n;
+	}
+	else
+	{
+		stopping = target == 0 || a->jog_dir != a->dir;
+	}
+
+	if( stopping || a->delay < target )
+	{
+		if( a->n == 0 )
+		{
+			if( a->state != STEPPER_JOG || !target ) return 0;
+			if( a->jog_dir != a->dir ) { a->dir = a->jog_dir; a->delay = a->c0; }
+			if( a->delay < target ) a->delay = target; // slower than the first ramp step
+			a->rest = 0;
+			return 1;
+		}
+		// Inverse of the ramp: c_(n-1) = c_n + 2*c_n / (4n - 1)
+		uint32_t den = 4 * a->n - 1;
+		uint32_t num = 2 * a->delay + a->rest;
+		a->delay += num / den;
+		a->rest = num % den;
+		a->n--;
+		// Slowed down past the new speed: keep the index of the faster
+		// step, the interval is then on or above the ramp for it and the
+		// next ramp from here can't be steeper than the acceleration.
+		if( !stopping && a->delay > target ) { a->delay = target; a->rest = 0; a->n++; }
+	}
+	else if( a->delay > target )
+	{
+		a->n++;
+		uint32_t den = 4 * a->n + 1;
+		uint32_t num = 2 * a->delay + a->rest;
+		a->delay -= num / den;
+		a->rest = num % den;
+		if( a->delay < target ) { a->delay = target; a->rest = 0; }
+	}
+	return 1;
+}
+
+static void Stepper_Start( StepperAxis * a, uint8_t state )
+{
+	a->n = 0;
+	a->rest = 0;
+	a->delay = a->c0 > a->target_delay ? a->c0 : a->target_delay;
+	a->next = Stepper_Now() + a->delay;
+	a->state = state;
+	Stepper_Kick();
+}
+
+// Absolute move, in steps from where Stepper_Init left the axis. Can be
+// called while the axis is running, if it can't stop in time or has to turn
+// around it ramps down first and then heads for the new target.
+static void Stepper_MoveTo( StepperAxis * a, int32_t target )
+{
+	__disable_irq();
+	int32_t togo = target - a->position;
+	uint32_t dist = togo < 0 ? -togo : togo;
+	int8_t dir = togo < 0 ? -1 : 1;
+
+	a->target = target;
+	a->target_delay = a->min_delay;
+	a->follower = 0;
+	if( a->state == STEPPER_IDLE || a->state == STEPPER_FOLLOW )
+	{
+		if( dist )
+		{
+			a->dir = dir;
+			a->steps_left = dist;
+			a->pending = 0;
+			Stepper_Start( a, STEPPER_MOVE );
+		}
+	}
+	else if( dir == a->dir && dist > a->n )
+	{
+		a->steps_left = dist;
+		a->pending = 0;
+		a->state = STEPPER_MOVE;
+	}
+	else
+	{
+		// Stop as fast as the ramp allows, finish the rest from standstill.
+		a->steps_left = a->n + 1;
+		a->pending = 1;
+		a->state = STEPPER_MOVE;
+	}
+	__enable_irq();
+}
+
+// Relative move.
+static void Stepper_Move( StepperAxis * a, int32_t steps )
+{
+	Stepper_MoveTo( a, a->position + steps );
+}
+
+// Jog at a signed speed in steps/s, ramps between speeds and through
+// direction changes. Speed 0 ramps down and stops.
+static void Stepper_Run( StepperAxis * a, int32_t speed )
+{
+	uint32_t s = speed < 0 ? -speed : speed;
+	uint32_t delay = s ? STEPPER_TICK_HZ / s : 0;
+	if( s && delay < a->min_delay ) delay = a->min_delay;
+
+	__disable_irq();
+	a->target_delay = delay;
+	a->pending = 0;
+	a->follower = 0;
+	if( speed ) a->jog_dir = speed > 0 ? 1 : -1;
+	if( a->state == STEPPER_IDLE || a->state == STEPPER_FOLLOW )
+	{
+		if( speed )
+		{
+			a->dir = a->jog_dir;
+			Stepper_Start( a, STEPPER_JOG );
+		}
+	}
+	else
+	{
+		a->state = STEPPER_JOG;
+	}
+	__enable_irq();
+}
+
+// Straight line move across several axes. The axis with the most steps runs
+// the ramp, the others step from its interrupt with Bresenham so they all
+// start and stop together. All axes should be idle.
+static void Stepper_MoveLinear( StepperAxis ** axes, const int32_t * delta, int count )
+{
+	int i, lead = -1;
+	uint32_t most = 0;
+	for( i = 0; i < count; i++ )
+	{
+		uint32_t d = delta[i] < 0 ? -delta[i] : delta[i];
+		if( d > most ) { most = d; lead = i; }
+	}
+	if( lead < 0 ) return;
+
+	StepperAxis * m = axes[lead];
+	StepperAxis ** link = &m->follower;
+	for( i = 0; i < count; i++ )
+	{
+		StepperAxis * f = axes[i];
+		if( i == lead || delta[i] == 0 ) continue;
+		f->state = STEPPER_FOLLOW;
+		f->dir = delta[i] > 0 ? 1 : -1;
+		f->follow_delta = delta[i] < 0 ? -delta[i] : delta[i];
+		f->follow_total = most;
+		f->follow_err = most / 2;
+		*link = f;
+		link = &f->follower;
+	}
+	*link = 0;
+
+	m->dir = delta[lead] > 0 ? 1 : -1;
+	m->steps_left = most;
+	m->target = m->position + delta[lead];
+	m->target_delay = m->min_delay;
+	m->pending = 0;
+	__disable_irq();
+	Stepper_Start( m, STEPPER_MOVE );
+	__enable_irq();
+}
+
+static int Stepper_Busy( StepperAxis * a )
+{
+	return a->state != STEPPER_IDLE;
+}
+
+// Stops immediately, no ramp. Coils stay energized.
+static void Stepper_Halt( StepperAxis * a )
+{
+	StepperAxis * f;
+	__disable_irq();
+	for( f = a->follower; f; f = f->follower )
+		f->state = STEPPER_IDLE;
+	a->follower = 0;
+	a->state = STEPPER_IDLE;
+	__enable_irq();
+}
+
+// Coils off, for when holding torque isn't needed.
+static void Stepper_Release( StepperAxis * a )
+{
+	Stepper_Halt( a );
+	STEPPER_PORT_WRITE( a, 0 );
+#if STEPPER_MICROSTEPS > 2
+	STEPPER_PWM_HOOK( a, 0, 0 );
+#endif
+}
+
+// Issues every step that's due, returns the next deadline or 0 if nothing is
+// running. Called from the timer interrupt.
+static int Stepper_Service( uint32_t now, uint32_t * deadline )
+{
+	int i, any = 0;
+	uint32_t earliest = 0;
+
+	for( i = 0; i < stepper_axis_count; i++ )
+	{
+		StepperAxis * a = stepper_axes[i];
+		uint8_t st = a->state;
+		if( st != STEPPER_MOVE && st != STEPPER_JOG ) continue;
+
+		if( (int32_t)( a->next - now ) <= (int32_t)STEPPER_GROUP_TICKS )
+		{
+			StepperAxis * f;
+			Stepper_Step( a );
+			for( f = a->follower; f; f = f->follower )
+			{
+				f->follow_err -= f->follow_delta;
+				if( f->follow_err < 0 )
+				{
+					f->follow_err += f->follow_total;
+					Stepper_Step( f );
+				}
+			}
+
+			if( !Stepper_NextDelay( a ) )
+			{
+				int32_t togo = a->target - a->position;
+				for( f = a->follower; f; f = f->follower )
+					f->state = STEPPER_IDLE;
+				a->follower = 0;
+				if( !a->pending || togo == 0 )
+				{
+					a->state = STEPPER_IDLE;
+					continue;
+				}
+				// Stopped for a Stepper_MoveTo() that turned around.
+				a->pending = 0;
+				a->dir = togo < 0 ? -1 : 1;
+				a->steps_left = togo < 0 ? -togo : togo;
+				a->n = 0;
+				a->rest = 0;
+				a->delay = a->c0 > a->target_delay ? a->c0 : a->target_delay;
+			}
+			a->next += a->delay;
+		}
+
+		if( !any || (int32_t)( a->next - earliest ) < 0 )
+			earliest = a->next;
+		any = 1;
+	}
+	*deadline = earliest;
+	return any;
+}
+
+#ifndef STEPPER_CUSTOM_TIMER
+
+#if defined( CH571_CH573 ) || defined( CH32V10x )
+#error "lib_stepper: this SysTick has no usable compare flag, provide a STEPPER_CUSTOM_TIMER"
+#endif
+
+// SysTick compare backend. The counter keeps free running so Delay_Us() and
+// friends still work, only the compare and its interrupt are used.
+
+#if defined( CH32V003 ) || defined( CH32V00x ) || defined( CH570_CH572 ) || defined( CH584_CH585 )
+static uint32_t Stepper_Now( void ) { return SysTick->CNT; }
+static void Stepper_SetCompare( uint32_t t ) { SysTick->CMP = t; }
+#else
+static uint32_t Stepper_Now( void ) { return (uint32_t)SysTick->CNT; }
+static void Stepper_SetCompare( uint32_t t )
+{
+	uint64_t now = SysTick->CNT;
+	SysTick->CMP = now + (int32_t)( t - (uint32_t)now );
+}
+#endif
+
+static volatile uint8_t stepper_timer_armed;
+
+static void Stepper_TimerInit( void )
+{
+	SysTick->CTLR |= SYSTICK_CTLR_STE;
+	NVIC_EnableIRQ( SysTick_IRQn );
+}
+
+// The body of the SysTick interrupt.
+#if defined( __HIGH_CODE )
+__HIGH_CODE
+#endif
+static void Stepper_Tick( void )
+{
+	uint32_t deadline;
+	SysTick->SR = 0;
+	while( Stepper_Service( Stepper_Now(), &deadline ) )
+	{
+		Stepper_SetCompare( deadline );
+		// Re-check after arming in case the deadline slipped past already.
+		if( (int32_t)( deadline - Stepper_Now() ) > 0 ) return;
+	}
+	SysTick->CTLR &= ~SYSTICK_CTLR_STIE;
+	stepper_timer_armed = 0;
+}
+
+#ifndef STEPPER_NO_SYSTICK_HANDLER
+#if defined( __HIGH_CODE )
+__HIGH_CODE
+#endif
+void SysTick_Handler( void ) __attribute__( ( interrupt ) );
+#if defined( __HIGH_CODE )
+__HIGH_CODE
+#endif
+void SysTick_Handler( void )
+{
+	Stepper_Tick();
+}
+#endif
+
+// Also when armed: the axis just started may be due before the compare.
+static void Stepper_Kick( void )
+{
+	Stepper_SetCompare( Stepper_Now() + STEPPER_GROUP_TICKS + 1 );
+	if( stepper_timer_armed ) return;
+	stepper_timer_armed = 1;
+	SysTick->SR = 0;
+	SysTick->CTLR |= SYSTICK_CTLR_STIE;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,196 @@
+#ifndef _LIB_TOUCH_FILTER_H
+#define _LIB_TOUCH_FILTER_H
+
+/** Touch channel filter and press / release state machine.
+
+	Used by the scanning engine in ch32v003_touch.h, but nothing in here
+	touches hardware, so recorded traces can be replayed through it on a PC.
+
+	Feed one reading per channel per frame, bigger = more capacitance:
+
+	TouchChannel ch;
+	TouchFilterInit( &ch, 40 );            // press threshold in reading counts
+	int ev = TouchFilterUpdate( &ch, raw ); // TOUCH_EV_PRESS / TOUCH_EV_RELEASE / 0
+
+	The reading is smoothed with a short IIR, and compared against a baseline
+	that is a much slower IIR of the smoothed reading. The baseline only moves
+	while the channel isn't touched and isn't close to the threshold, it
+	follows downward drift faster than upward drift so a finger that was on
+	the pad at power up doesn't leave it stuck. Presses need the delta above
+	the threshold for TOUCH_DEBOUNCE frames, in the reading itself as well as
+	the smoothed one, or the smoothing would spread a one frame spike over
+	two frames and get it past the debounce. Releases need it below the
+	threshold minus the hysteresis for as long. A press held longer than
+	TOUCH_MAX_HOLD frames is taken as drift, released and recalibrated.
+*/
+
+#include <stdint.h>
+
+#ifndef TOUCH_SIG_SHIFT
+#define TOUCH_SIG_SHIFT 1        // reading smoothing, 1/2 per frame
+#endif
+
+#ifndef TOUCH_BASE_SHIFT
+#define TOUCH_BASE_SHIFT 7       // baseline follows upward drift at 1/128 per frame
+#endif
+
+#ifndef TOUCH_BASE_FAST_SHIFT
+#define TOUCH_BASE_FAST_SHIFT 3  // and downward drift at 1/8 per frame
+#endif
+
+#ifndef TOUCH_HYST_SHIFT
+#define TOUCH_HYST_SHIFT 2       // release threshold is 3/4 of the press threshold
+#endif
+
+#ifndef TOUCH_DEBOUNCE
+#define TOUCH_DEBOUNCE 2
+#endif
+
+#ifndef TOUCH_MAX_HOLD
+#define TOUCH_MAX_HOLD 3000      // frames, 0 = never recalibrate while pressed
+#endif
+
+#ifndef TOUCH_WARMUP
+#define TOUCH_WARMUP 8           // frames to settle before reporting anything, 1..255
+#endif
+
+#ifndef TOUCH_EVENT_QUEUE
+#define TOUCH_EVENT_QUEUE 16     // power of two
+#endif
+
+#define TOUCH_EV_PRESS   1
+#define TOUCH_EV_RELEASE 2
+
+typedef struct
+{
+	int32_t sig;        // smoothed reading, Q4
+	int32_t base;       // baseline, Q4
+	int16_t threshold;  // press threshold, reading counts
+	uint8_t pressed;
+	uint8_t count;      // debounce counter
+	uint8_t warmup;     // frames left before reporting
+	uint16_t held;      // frames pressed
+} TouchChannel;
+
+typedef struct
+{
+	uint8_t channel;
+	uint8_t type;       // TOUCH_EV_PRESS / TOUCH_EV_RELEASE
+} TouchEvent;
+
+typedef struct
+{
+	TouchEvent ev[TOUCH_EVENT_QUEUE];
+	volatile uint8_t head;
+	volatile uint8_t tail;
+} TouchEventQueue;
+
+static void TouchFilterInit( TouchChannel * ch, int threshold )
+{
+	ch->sig = 0;
+	ch->base = 0;
+	ch->threshold = threshold;
+	ch->pressed = 0;
+	ch->count = 0;
+	ch->warmup = TOUCH_WARMUP;
+	ch->held = 0;
+}
+
+// Current delta above the baseline in reading counts.
+static inline int32_t TouchFilterDelta( const TouchChannel * ch )
+{
+	return ( ch->sig - ch->base ) >> 4;
+}
+
+static int TouchFilterUpdate( TouchChannel * ch, int32_t raw )
+{
+	int32_t x = raw << 4;
+
+	if( ch->warmup )
+	{
+		// Start from the reading instead of ramping up from 0, the baseline
+		// just follows until things settle.
+		if( ch->warmup == TOUCH_WARMUP )
+			ch->sig = x;
+		else
+			ch->sig += ( x - ch->sig ) >> TOUCH_SIG_SHIFT;
+		ch->base = ch->sig;
+		ch->warmup--;
+		return 0;
+	}
+
+	ch->sig += ( x - ch->sig ) >> TOUCH_SIG_SHIFT;
+	int32_t delta = TouchFilterDelta( ch );
+	int32_t th = ch->threshold;
+
+	if( !ch->pressed )
+	{
+		if( delta < 0 )
+			ch->base += ( ch->sig - ch->base ) >> TOUCH_BASE_FAST_SHIFT;
+		else if( delta < ( th >> 1 ) )
+			ch->base += ( ch->sig - ch->base ) >> TOUCH_BASE_SHIFT;
+
+		if( delta >= th && ( ( x - ch->base ) >> 4 ) >= th )
+		{
+			if( ++ch->count >= TOUCH_DEBOUNCE )
+			{
+				ch->pressed = 1;
+				ch->count = 0;
+				ch->held = 0;
+				return TOUCH_EV_PRESS;
+			}
+		}
+		else
+		{
+			ch->count = 0;
+		}
+		return 0;
+	}
+
+	if( TOUCH_MAX_HOLD && ++ch->held >= TOUCH_MAX_HOLD )
+	{
+		ch->base = ch->sig;
+		ch->pressed = 0;
+		ch->count = 0;
+		ch->held = 0;
+		return TOUCH_EV_RELEASE;
+	}
+
+	if( delta < th - ( th >> TOUCH_HYST_SHIFT ) )
+	{
+		if( ++ch->count >= TOUCH_DEBOUNCE )
+		{
+			ch->pressed = 0;
+			ch->count = 0;
+			ch->held = 0;
+			return TOUCH_EV_RELEASE;
+		}
+	}
+	else
+	{
+		ch->count = 0;
+	}
+	return 0;
+}
+
+// Single producer (the scan interrupt), single consumer. Drops the event
+// if the queue is full.
+static void TouchEventPush( TouchEventQueue * q, int channel, int type )
+{
+	uint8_t h = q->head;
+	if( (uint8_t)( h - q->tail ) >= TOUCH_EVENT_QUEUE ) return;
+	q->ev[h & ( TOUCH_EVENT_QUEUE - 1 )].channel = channel;
+	q->ev[h & ( TOUCH_EVENT_QUEUE - 1 )].type = type;
+	q->head = h + 1;
+}
+
+static int TouchEventPop( TouchEventQueue * q, TouchEvent * e )
+{
+	uint8_t t = q->tail;
+	if( t == q->head ) return 0;
+	*e = q->ev[t & ( TOUCH_EVENT_QUEUE - 1 )];
+	q->tail = t + 1;
+	return 1;
+}
+
+#endif
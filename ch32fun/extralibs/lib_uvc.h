@@ -0,0 +1,678 @@
+#ifndef _LIB_UVC_H
+#define _LIB_UVC_H
+
+/** USB Video Class camera: one YUY2 or MJPEG format at one frame size and
+	rate, over a bulk endpoint, sent straight out of the buffers the camera
+	interface writes into.
+
+	The buffers are a ring of UVC_SLOTS slots. A slot is UVC_HEADER bytes of
+	UVC payload header, then UVC_SLOT_LINES rows of UVC_LINE bytes:
+
+	- The capture side (the DVP interrupt on the ch32v30x, see the end of
+	  this file) gets an address for every row from UVCRowAddr(), that's
+	  where the DVP DMA writes it. A slot goes to the USB side once it's
+	  full, and the last one of a frame at its end, with EOF. If the frame
+	  ended right at the end of a slot, that's an empty payload.
+	- The USB side sends each slot as one payload, 512 byte packets with the
+	  endpoint DMA pointed into the slot, and a zero length packet after a
+	  payload that's shorter than dwMaxPayloadTransferSize and ends on a
+	  packet boundary. The CPU writes the header and none of the image.
+	- The header has the PTS and SCR, which makes it 12 bytes and keeps the
+	  rows after it word aligned for both DMAs.
+
+	When the ring runs full in the middle of a frame the rest of it goes to
+	a scratch row and the frame is lost: its last slot goes out with ERR and
+	EOF, or an empty payload does once a slot is free, so the host drops it
+	right away. A frame that starts with the ring full is skipped whole, and
+	so are the ones after a lost frame until the ring is empty: a host that
+	can't keep up gets every second or third frame rather than a piece of
+	each.
+	Both count in uvc.dropped, and so do frames cut off by the host
+	stopping. uvc.frames counts the frames that went out whole.
+
+	Streaming starts when the host commits the probe (SET_CUR of
+	VS_COMMIT_CONTROL) and stops when it clears the halt on the endpoint,
+	which is how Linux stops a bulk camera.
+
+	Usage, with hsusb.h. usb_config.h includes this file for the
+	configuration descriptor, uvc_config_descriptor (interfaces UVC_IF_VC
+	and UVC_IF_VS, the IN endpoint UVC_EP_IN), and the device descriptor has
+	class 0xef, subclass 2, protocol 1 for the interface association. After
+	hsusb.h, include it again for the rest:
+
+	#include "hsusb.h"
+	#include "lib_uvc.h"
+
+	int HandleSetupCustom( struct _USBState * ctx, int setup_code )
+	{
+		return UVCHandleSetup( ctx, setup_code );
+	}
+	int HandleInRequest( struct _USBState * ctx, int endp, uint8_t * data, int len )
+	{
+		return endp == UVC_EP_IN ? UVCTx() : 0;
+	}
+	void HandleDataOut( struct _USBState * ctx, int endp, uint8_t * data, int len )
+	{
+		if( endp == 0 ) UVCHandleDataOut( ctx, data, len );
+	}
+
+	USBHSSetup();
+	UVCDVPInit();     // after the sensor is set up
+	while( 1 ) UVCPoll();
+
+	FUSB_EP_SIZE has to be 512, a high speed bulk endpoint. Without hsusb.h
+	(a host simulation) the endpoint is UVC_IN_DMA( addr ), UVC_IN_SEND( len ),
+	UVC_IN_READY(), UVC_IN_NAKED(), UVC_IN_ABORT(), UVC_LOCK() and
+	UVC_UNLOCK(), see below.
+
+	Another capture source calls UVCFrameStart(), UVCRowAddr() for each row
+	it's going to write, UVCRowDone() once one is written, in order, and
+	UVCFrameEnd( partial ). For MJPEG, rows are just UVC_LINE byte pieces
+	of the JPEG data, partial says the last one was cut short. Decoders
+	don't look past the end of image marker, so what's after it in that
+	row is left there.
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#ifndef UVC_WIDTH
+#define UVC_WIDTH 320
+#endif
+#ifndef UVC_HEIGHT
+#define UVC_HEIGHT 240
+#endif
+#ifndef UVC_FPS
+#define UVC_FPS 30
+#endif
+
+#ifndef UVC_MJPEG
+#define UVC_MJPEG 0     // 1: the camera sends JPEG, 0: YUY2
+#endif
+
+#if UVC_MJPEG
+#ifndef UVC_LINE
+#define UVC_LINE 1024   // bytes per DVP row
+#endif
+#ifndef UVC_FRAME_BYTES
+#define UVC_FRAME_BYTES ( UVC_WIDTH * UVC_HEIGHT )   // the biggest JPEG
+#endif
+#define UVC_ROWS ( ( UVC_FRAME_BYTES + UVC_LINE - 1 ) / UVC_LINE )
+#else
+#define UVC_LINE ( UVC_WIDTH * 2 )
+#define UVC_FRAME_BYTES ( UVC_WIDTH * UVC_HEIGHT * 2 )
+#define UVC_ROWS UVC_HEIGHT
+#endif
+
+#ifndef UVC_SLOT_LINES
+#define UVC_SLOT_LINES 8
+#endif
+#ifndef UVC_SLOTS
+#define UVC_SLOTS 8     // at least 3, two rows are armed ahead
+#endif
+
+#ifndef UVC_EP_IN
+#define UVC_EP_IN 1
+#endif
+#ifndef UVC_IF_VC
+#define UVC_IF_VC 0
+#endif
+#ifndef UVC_IF_VS
+#define UVC_IF_VS 1
+#endif
+#ifndef UVC_PACKET
+#define UVC_PACKET 512
+#endif
+
+// How fast UVC_TICKS(), the PTS and SCR, counts.
+#ifndef UVC_CLOCK
+#define UVC_CLOCK ( DELAY_MS_TIME * 1000 )
+#endif
+
+#define UVC_HEADER    12
+#define UVC_PAYLOAD   ( UVC_HEADER + UVC_SLOT_LINES * UVC_LINE )
+#define UVC_PROBE_LEN 34
+
+#if UVC_LINE % 4
+#error "lib_uvc: rows have to be a multiple of 4 bytes"
+#endif
+#if UVC_SLOTS < 3
+#error "lib_uvc: at least 3 slots"
+#endif
+
+// Payload header bits
+#define UVC_FID 0x01
+#define UVC_EOF 0x02
+#define UVC_PTS 0x04
+#define UVC_SCR 0x08
+#define UVC_ERR 0x40
+#define UVC_EOH 0x80
+
+// Requests and the two controls there are
+#define UVC_SET_CUR  0x01
+#define UVC_GET_CUR  0x81
+#define UVC_GET_MIN  0x82
+#define UVC_GET_MAX  0x83
+#define UVC_GET_RES  0x84
+#define UVC_GET_LEN  0x85
+#define UVC_GET_INFO 0x86
+#define UVC_GET_DEF  0x87
+#define UVC_VS_PROBE  1
+#define UVC_VS_COMMIT 2
+
+#define UVC_U16( x ) (uint8_t)( x ), (uint8_t)( ( x ) >> 8 )
+#define UVC_U32( x ) (uint8_t)( x ), (uint8_t)( ( x ) >> 8 ), (uint8_t)( ( x ) >> 16 ), (uint8_t)( ( x ) >> 24 )
+
+#define UVC_INTERVAL ( 10000000 / UVC_FPS )   // 100 ns units
+#define UVC_BITRATE  ( UVC_FRAME_BYTES * 8 * UVC_FPS )
+
+#if UVC_MJPEG
+#define UVC_FORMAT_LEN 11
+#define UVC_FORMAT \
+	UVC_FORMAT_LEN, 0x24, 0x06,         /* VS_FORMAT_MJPEG */ \
+	1, 1,                               /* bFormatIndex, bNumFrameDescriptors */ \
+	0, 1, 0, 0, 0, 0                    /* bmFlags, bDefaultFrameIndex, aspect ratio, interlace, copy protect */
+#define UVC_FRAME_TYPE 0x07             // VS_FRAME_MJPEG
+#else
+#define UVC_FORMAT_LEN 27
+#define UVC_FORMAT \
+	UVC_FORMAT_LEN, 0x24, 0x04,         /* VS_FORMAT_UNCOMPRESSED */ \
+	1, 1,                               /* bFormatIndex, bNumFrameDescriptors */ \
+	'Y', 'U', 'Y', '2', 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71, \
+	16, 1, 0, 0, 0, 0                   /* bBitsPerPixel, bDefaultFrameIndex, aspect ratio, interlace, copy protect */
+#define UVC_FRAME_TYPE 0x05             // VS_FRAME_UNCOMPRESSED
+#endif
+
+#define UVC_VC_LEN     ( 13 + 18 + 9 )  // header, camera terminal, output terminal
+#define UVC_VS_LEN     ( 14 + UVC_FORMAT_LEN + 30 + 6 )
+#define UVC_CONFIG_LEN ( 9 + 8 + 9 + UVC_VC_LEN + 9 + UVC_VS_LEN + 7 )
+
+static const uint8_t uvc_config_descriptor[] =
+{
+	9, 0x02, UVC_U16( UVC_CONFIG_LEN ), 2, 1, 0, 0x80, 250,    // configuration, 500 mA
+
+	// Interface association, the video function
+	8, 0x0b, UVC_IF_VC, 2, 0x0e, 0x03, 0x00, 0,
+
+	// Video control: no controls, no interrupt endpoint
+	9, 0x04, UVC_IF_VC, 0, 0, 0x0e, 0x01, 0x00, 0,
+	13, 0x24, 0x01, UVC_U16( 0x0110 ), UVC_U16( UVC_VC_LEN ), UVC_U32( UVC_CLOCK ), 1, UVC_IF_VS,
+	18, 0x24, 0x02, 1, UVC_U16( 0x0201 ), 0, 0, 0, 0, 0, 0, 0, 0, 3, 0, 0, 0,   // camera, ID 1
+	9, 0x24, 0x03, 2, UVC_U16( 0x0101 ), 0, 1, 0,                            // streaming output, ID 2, from 1
+
+	// Video streaming, one bulk endpoint
+	9, 0x04, UVC_IF_VS, 0, 1, 0x0e, 0x02, 0x00, 0,
+	14, 0x24, 0x01, 1, UVC_U16( UVC_VS_LEN ), 0x80 | UVC_EP_IN, 0, 2, 0, 0, 0, 1, 0,
+	UVC_FORMAT,
+	30, 0x24, UVC_FRAME_TYPE, 1, 0, UVC_U16( UVC_WIDTH ), UVC_U16( UVC_HEIGHT ),
+		UVC_U32( UVC_BITRATE ), UVC_U32( UVC_BITRATE ), UVC_U32( UVC_FRAME_BYTES ),
+		UVC_U32( UVC_INTERVAL ), 1, UVC_U32( UVC_INTERVAL ),
+	6, 0x24, 0x0d, 1, 1, 4,             // BT.709 primaries, BT.709 transfer, SMPTE 170M matrix
+	7, 0x05, 0x80 | UVC_EP_IN, 0x02, UVC_U16( UVC_PACKET ), 0,
+};
+
+// The probe and commit controls, UVC 1.1. There's one way to stream, so
+// it's always the same whatever the host asked for.
+static int uvc_probe( uint8_t * p, int len )
+{
+	static const uint8_t probe[UVC_PROBE_LEN] =
+	{
+		UVC_U16( 0 ), 1, 1, UVC_U32( UVC_INTERVAL ),   // bmHint, format, frame, interval
+		UVC_U16( 0 ), UVC_U16( 0 ), UVC_U16( 0 ), UVC_U16( 0 ), UVC_U16( 0 ),
+		UVC_U32( UVC_FRAME_BYTES ), UVC_U32( UVC_PAYLOAD ), UVC_U32( UVC_CLOCK ),
+		3, 0, 0, 0,                                    // bmFramingInfo: FID and EOF
+	};
+	if( len > UVC_PROBE_LEN ) len = UVC_PROBE_LEN;
+	memcpy( p, probe, len );
+	return len;
+}
+
+#endif
+
+// The streaming part, once the endpoint can be reached. usb_config.h
+// includes this file before hsusb.h has its endpoint macros.
+#if !defined( _LIB_UVC_STREAM ) && ( defined( UVC_IN_SEND ) || ( defined( _HSUSB_H ) && defined( UEP_CTRL_LEN ) ) )
+#define _LIB_UVC_STREAM
+
+#if !defined( UVC_IN_SEND )
+
+#if USBHS_UEP_SIZE != UVC_PACKET
+#error "lib_uvc: FUSB_EP_SIZE has to be UVC_PACKET"
+#endif
+
+// Sends from anywhere in RAM, the endpoint's own buffer is left alone.
+#define UVC_IN_DMA( addr ) ( UEP_DMA_TX( UVC_EP_IN ) = (uintptr_t)( addr ) )
+#define UVC_IN_SEND( n )   ( UEP_CTRL_LEN( UVC_EP_IN ) = ( n ), UEP_CTRL_TX( UVC_EP_IN ) = ( UEP_CTRL_TX( UVC_EP_IN ) & ~USBHS_UEP_T_RES_MASK ) | USBHS_UEP_T_RES_ACK )
+#define UVC_IN_READY()     ( !USBHSCTX.USBHS_errata_dont_send_endpoint_in_window && USBHSCTX.USBHS_SetupReqLen == 0 )
+// A packet was armed and the endpoint NAKs: hsusb cleared the halt, or
+// the bus was reset.
+#define UVC_IN_NAKED()     ( ( UEP_CTRL_TX( UVC_EP_IN ) & USBHS_UEP_T_RES_MASK ) == USBHS_UEP_T_RES_NAK )
+#define UVC_IN_ABORT()     ( UEP_CTRL_TX( UVC_EP_IN ) = ( UEP_CTRL_TX( UVC_EP_IN ) & ~USBHS_UEP_T_RES_MASK ) | USBHS_UEP_T_RES_NAK )
+#define UVC_LOCK()         NVIC_DisableIRQ( USBHS_IRQn )
+#define UVC_UNLOCK()       NVIC_EnableIRQ( USBHS_IRQn )
+#ifndef UVC_SOF
+#define UVC_SOF()          ( USBHS->FRAME_NO )
+#endif
+
+#endif
+
+#ifndef UVC_TICKS
+#define UVC_TICKS() ( (uint32_t)SysTick->CNT )
+#endif
+#ifndef UVC_SOF
+#define UVC_SOF() 0
+#endif
+
+#ifndef UVC_FENCE
+#define UVC_FENCE() asm volatile( "" : : : "memory" )   // the slot before put, on one core
+#endif
+
+static uint8_t uvc_ring[UVC_SLOTS][UVC_PAYLOAD] __attribute__((aligned(4)));
+static uint8_t uvc_scratch[UVC_LINE] __attribute__((aligned(4)));
+
+static struct
+{
+	volatile uint32_t put;         // slots handed to the USB side, counting up
+	volatile uint32_t get;         // slots the USB side is done with
+	uint32_t len[UVC_SLOTS];       // payload bytes, with the header
+	uint8_t info[UVC_SLOTS];       // header bits
+	uint8_t epoch_of[UVC_SLOTS];   // the stream it's from
+
+	// Capture side
+	uint32_t first;                // slot of the first row of the frame
+	uint32_t rows;                 // rows done
+	uint32_t armed;                // rows given an address
+	uint32_t good;                 // rows given one in a slot
+	uint32_t pts;
+	uint8_t on;                    // this frame goes out
+	uint8_t broken;                // lost rows
+	uint8_t pending;               // header bits of an empty payload that still has to go out
+	uint8_t drain;                 // a frame was lost, the next one waits for an empty ring
+	uint8_t fid;
+	uint8_t frame_epoch;
+
+	// USB side
+	uint32_t off;                  // into the slot being sent
+	uint8_t sending;
+	uint8_t zlp;                   // sent it
+	uint8_t tx_busy;               // a packet is armed
+	volatile uint8_t want;         // the host has committed
+	volatile uint8_t epoch;        // counts starts and stops
+
+	volatile uint32_t captured;    // frames the camera sent while streaming
+	volatile uint32_t frames;      // sent whole
+	volatile uint32_t dropped;     // skipped or lost rows
+	volatile uint32_t bytes;       // payload bytes sent
+} uvc;
+
+// A payload header, with the time the frame started and the time now.
+static void uvc_header( uint8_t * h, int info, uint32_t pts )
+{
+	uint32_t stc = UVC_TICKS();
+	uint16_t sof = UVC_SOF() & 0x7ff;
+	h[0] = UVC_HEADER;
+	h[1] = UVC_EOH | UVC_PTS | UVC_SCR | info;
+	h[2] = pts;
+	h[3] = pts >> 8;
+	h[4] = pts >> 16;
+	h[5] = pts >> 24;
+	h[6] = stc;
+	h[7] = stc >> 8;
+	h[8] = stc >> 16;
+	h[9] = stc >> 24;
+	h[10] = sof;
+	h[11] = sof >> 8;
+}
+
+static inline int uvc_free( uint32_t slot )
+{
+	return slot - uvc.get < UVC_SLOTS;
+}
+
+static void uvc_commit( uint32_t lines, int info )
+{
+	uint32_t s = uvc.put % UVC_SLOTS;
+	uvc.len[s] = UVC_HEADER + lines * UVC_LINE;
+	uvc.info[s] = uvc.fid | info;
+	uvc.epoch_of[s] = uvc.frame_epoch;
+	uvc_header( uvc_ring[s], uvc.fid | info, uvc.pts );
+	UVC_FENCE();
+	uvc.put++;
+}
+
+// At the start of a frame, before its first row is armed.
+static void UVCFrameStart( void )
+{
+	uvc.rows = uvc.armed = uvc.good = 0;
+	uvc.on = 0;
+	if( !uvc.want )
+	{
+		uvc.pending = 0;
+		return;
+	}
+	uvc.captured++;
+	if( uvc.pending && uvc.frame_epoch != uvc.epoch ) uvc.pending = 0;
+	if( uvc.pending && uvc_free( uvc.put ) )
+	{
+		uvc_commit( 0, uvc.pending );
+		uvc.pending = 0;
+	}
+	if( uvc.pending || !uvc_free( uvc.put ) || ( uvc.drain && uvc.put != uvc.get ) )
+	{
+		uvc.dropped++;
+		return;
+	}
+	uvc.drain = 0;
+	uvc.on = 1;
+	uvc.broken = 0;
+	uvc.fid ^= UVC_FID;
+	uvc.first = uvc.put;
+	uvc.frame_epoch = uvc.epoch;
+	uvc.pts = UVC_TICKS();
+}
+
+// Where the next row goes. Rows of a frame that doesn't go out, or that
+// found the ring full, go to a scratch row, and so do the two armed past
+// the end of a frame.
+static uint8_t * UVCRowAddr( void )
+{
+	uint32_t r = uvc.armed++;
+	if( uvc.on && !uvc.broken && r < UVC_ROWS )
+	{
+		uint32_t s = uvc.first + r / UVC_SLOT_LINES;
+		if( uvc_free( s ) )
+		{
+			uvc.good++;
+			return uvc_ring[s % UVC_SLOTS] + UVC_HEADER + r % UVC_SLOT_LINES * UVC_LINE;
+		}
+		uvc.broken = 1;
+	}
+	return uvc_scratch;
+}
+
+// The oldest armed row is written. A full slot goes out, but for YUY2 the
+// last one waits for UVCFrameEnd(), to have EOF.
+static void UVCRowDone( void )
+{
+	uint32_t r = uvc.rows++;
+	if( r >= UVC_ROWS ) uvc.broken = 1;
+	if( !uvc.on || r >= uvc.good ) return;
+	if( r % UVC_SLOT_LINES == UVC_SLOT_LINES - 1 && ( UVC_MJPEG || r != UVC_HEIGHT - 1 ) )
+		uvc_commit( UVC_SLOT_LINES, 0 );
+}
+
+// The frame ended. partial: there's a row that was cut short (JPEG).
+static void UVCFrameEnd( int partial )
+{
+	if( !uvc.on ) return;
+	uvc.on = 0;
+	uint32_t rows = uvc.rows + ( partial && uvc.armed > uvc.rows );
+	if( !rows || rows > UVC_ROWS || ( !UVC_MJPEG && rows != UVC_HEIGHT ) ) uvc.broken = 1;
+	if( rows > uvc.good ) rows = uvc.good;
+	int info = UVC_EOF | ( uvc.broken ? UVC_ERR : 0 );
+	uint32_t rest = rows - ( uvc.put - uvc.first ) * UVC_SLOT_LINES;
+	// Nothing left for the last payload: an empty one, now or once there's room.
+	if( rest || uvc_free( uvc.put ) ) uvc_commit( rest, info );
+	else uvc.pending = info;
+	if( uvc.broken )
+	{
+		uvc.dropped++;
+		uvc.drain = 1;
+	}
+}
+
+// Rows that went missing (a FIFO overflow): the frame is lost.
+static void UVCFrameError( void )
+{
+	uvc.broken = 1;
+}
+
+static int uvc_packet( uint32_t s )
+{
+	uint32_t n = uvc.len[s] - uvc.off;
+	if( n > UVC_PACKET ) n = UVC_PACKET;
+	UVC_IN_DMA( uvc_ring[s] + uvc.off );
+	uvc.off += n;
+	uvc.bytes += n;
+	return n;
+}
+
+// Done with the slot at get. A frame's last slot that isn't sent, because
+// the stream stopped, loses the frame.
+static void uvc_slot_done( int sent )
+{
+	uint32_t s = uvc.get % UVC_SLOTS;
+	if( ( uvc.info[s] & ( UVC_EOF | UVC_ERR ) ) == UVC_EOF )
+	{
+		if( sent ) uvc.frames++;
+		else uvc.dropped++;
+	}
+	uvc.sending = 0;
+	uvc.off = 0;
+	uvc.zlp = 0;
+	uvc.get++;
+}
+
+// The IN packet before went through, from the USB interrupt. Returns the
+// length of the next one, -1 for a zero length packet, 0 for nothing to
+// send (NAK).
+static int UVCTx( void )
+{
+	uint32_t s;
+	if( !uvc.tx_busy ) return 0;
+	if( uvc.sending )
+	{
+		s = uvc.get % UVC_SLOTS;
+		if( uvc.off < uvc.len[s] ) return uvc_packet( s );
+		if( uvc.len[s] % UVC_PACKET == 0 && uvc.len[s] < UVC_PAYLOAD && !uvc.zlp )
+		{
+			uvc.zlp = 1;
+			return -1;
+		}
+		uvc_slot_done( 1 );
+	}
+	// Slots from before a stop or a new commit are dropped.
+	while( uvc.get != uvc.put )
+	{
+		s = uvc.get % UVC_SLOTS;
+		if( uvc.want && uvc.epoch_of[s] == uvc.epoch )
+		{
+			uvc.sending = 1;
+			return uvc_packet( s );
+		}
+		uvc_slot_done( 0 );
+	}
+	uvc.tx_busy = 0;
+	return 0;
+}
+
+// Starts sending when the endpoint is idle, and notices the host
+// stopping. Call it from the main loop.
+static void UVCPoll( void )
+{
+	UVC_LOCK();
+	if( uvc.tx_busy && UVC_IN_NAKED() )
+	{
+		uvc.tx_busy = 0;
+		if( uvc.sending ) uvc_slot_done( 0 );
+		if( uvc.want )
+		{
+			uvc.want = 0;
+			uvc.epoch++;
+		}
+	}
+	if( !uvc.tx_busy && uvc.get != uvc.put && UVC_IN_READY() )
+	{
+		uvc.tx_busy = 1;
+		int n = UVCTx();
+		if( n ) UVC_IN_SEND( n > 0 ? n : 0 );
+	}
+	UVC_UNLOCK();
+}
+
+// A class request on EP0. GETs fill data (up to len) and return how many
+// bytes, SET_CUR takes len bytes. -1 to stall.
+static int UVCRequest( int req, uint16_t value, uint16_t index, uint8_t * data, int len )
+{
+	int cs = value >> 8;
+	if( ( index & 0xff ) != UVC_IF_VS || ( cs != UVC_VS_PROBE && cs != UVC_VS_COMMIT ) ) return -1;
+	switch( req )
+	{
+	case UVC_SET_CUR:
+		if( len != 26 && len != UVC_PROBE_LEN ) return -1;
+		if( cs == UVC_VS_COMMIT )
+		{
+			// A packet of the stream before can't go out first.
+			if( uvc.tx_busy )
+			{
+				UVC_IN_ABORT();
+				uvc.tx_busy = 0;
+				if( uvc.sending ) uvc_slot_done( 0 );
+			}
+			uvc.epoch++;
+			uvc.want = 1;
+		}
+		return 0;
+	case UVC_GET_CUR:
+	case UVC_GET_MIN:
+	case UVC_GET_MAX:
+	case UVC_GET_DEF:
+		return uvc_probe( data, len );
+	case UVC_GET_LEN:
+		if( len < 2 ) return -1;
+		data[0] = UVC_PROBE_LEN;
+		data[1] = 0;
+		return 2;
+	case UVC_GET_INFO:
+		if( len < 1 ) return -1;
+		data[0] = 3;    // GET and SET
+		return 1;
+	}
+	return -1;
+}
+
+#if defined( _HSUSB_H )
+
+static uint8_t uvc_ep0[UVC_PROBE_LEN];
+static struct
+{
+	uint16_t value, index;
+	uint8_t req;
+	uint8_t got;
+	uint8_t on;     // a SET of ours is in its data stage
+} uvc_set;
+
+static int UVCHandleSetup( struct _USBState * ctx, int setup_code )
+{
+	uint16_t value = ctx->USBHS_IndexValue, index = ctx->USBHS_IndexValue >> 16;
+	int len = ctx->USBHS_SetupReqLen;
+	uvc_set.on = 0;
+	if( ( ctx->USBHS_SetupReqType & USB_REQ_TYP_MASK ) != USB_REQ_TYP_CLASS ) return 0;
+	ctx->pCtrlPayloadPtr = uvc_ep0;
+	if( setup_code & 0x80 )
+	{
+		if( len > UVC_PROBE_LEN ) len = UVC_PROBE_LEN;
+		int n = UVCRequest( setup_code, value, index, uvc_ep0, len );
+		return n > 0 ? n : 0;
+	}
+	// Checked now, done when the data is in.
+	if( len > UVC_PROBE_LEN || UVCRequest( UVC_GET_INFO, value, index, uvc_ep0, 1 ) < 0 ) return 0;
+	uvc_set.value = value;
+	uvc_set.index = index;
+	uvc_set.req = setup_code;
+	uvc_set.got = 0;
+	uvc_set.on = 1;
+	return len;
+}
+
+static void UVCHandleDataOut( struct _USBState * ctx, uint8_t * data, int len )
+{
+	if( !uvc_set.on ) return;
+	if( len > UVC_PROBE_LEN - uvc_set.got ) len = UVC_PROBE_LEN - uvc_set.got;
+	memcpy( uvc_ep0 + uvc_set.got, data, len );
+	uvc_set.got += len;
+	ctx->USBHS_SetupReqLen = ctx->USBHS_SetupReqLen > len ? ctx->USBHS_SetupReqLen - len : 0;
+	if( ctx->USBHS_SetupReqLen == 0 )
+	{
+		uvc_set.on = 0;
+		UVCRequest( uvc_set.req, uvc_set.value, uvc_set.index, uvc_ep0, uvc_set.got );
+	}
+}
+
+#endif
+
+#if defined( DVP_BASE ) && !defined( UVC_NO_DVP )
+
+// The DVP on the ch32v30x, 8 bit data, with the pins WCH's DVP examples
+// use: D0-D7 on PA9, PA10, PC8, PC9, PC11, PB6, PB8, PB9, PCLK on PA6,
+// VSYNC on PA5, HSYNC on PA4. Check them against your package and board,
+// or define UVC_DVP_PINS() for others. The sensor has to be set up to send
+// the format and size first.
+//
+// Rows alternate between DMA_BUF0 and DMA_BUF1, starting with BUF0 at
+// each frame. When one is done the interrupt points it at the row after
+// the next, so it has a row's time to get there.
+
+#ifndef UVC_DVP_PINS
+#define UVC_DVP_PINS() do { \
+	funPinMode( PA4, GPIO_CFGLR_IN_FLOAT ); funPinMode( PA5, GPIO_CFGLR_IN_FLOAT ); \
+	funPinMode( PA6, GPIO_CFGLR_IN_FLOAT ); funPinMode( PA9, GPIO_CFGLR_IN_FLOAT ); \
+	funPinMode( PA10, GPIO_CFGLR_IN_FLOAT ); funPinMode( PC8, GPIO_CFGLR_IN_FLOAT ); \
+	funPinMode( PC9, GPIO_CFGLR_IN_FLOAT ); funPinMode( PC11, GPIO_CFGLR_IN_FLOAT ); \
+	funPinMode( PB6, GPIO_CFGLR_IN_FLOAT ); funPinMode( PB8, GPIO_CFGLR_IN_FLOAT ); \
+	funPinMode( PB9, GPIO_CFGLR_IN_FLOAT ); } while( 0 )
+#endif
+
+#ifndef UVC_DVP_POLARITY
+#define UVC_DVP_POLARITY 0      // RB_DVP_V_POLAR, RB_DVP_H_POLAR, RB_DVP_P_POLAR to invert
+#endif
+
+// COL_NUM counts PCLKs per row. WCH's examples set the pixel count for
+// YUV422 / RGB565, half the bytes, define it if your part counts bytes.
+#ifndef UVC_DVP_COLS
+#define UVC_DVP_COLS ( UVC_LINE / 2 )
+#endif
+
+static void UVCDVPInit( void )
+{
+	UVC_DVP_PINS();
+	RCC->AHBPCENR |= RCC_DVPEN;
+	DVP->CR0 = RB_DVP_D8_MOD | UVC_DVP_POLARITY | ( UVC_MJPEG ? RB_DVP_JPEG : 0 );
+	DVP->CR1 = RB_DVP_ALL_CLR | RB_DVP_RCV_CLR;
+	DVP->CR1 = 0;
+	DVP->ROW_NUM = UVC_ROWS;
+	DVP->COL_NUM = UVC_DVP_COLS;
+	DVP->DMA_BUF0 = (uintptr_t)uvc_scratch;
+	DVP->DMA_BUF1 = (uintptr_t)uvc_scratch;
+	DVP->IFR = 0xff;
+	DVP->IER = RB_DVP_IE_STR_FRM | RB_DVP_IE_ROW_DONE | RB_DVP_IE_FRM_DONE | RB_DVP_IE_FIFO_OV;
+	NVIC_EnableIRQ( DVP_IRQn );
+	DVP->CR1 = RB_DVP_DMA_EN;
+	DVP->CR0 |= RB_DVP_ENABLE;
+}
+
+void DVP_IRQHandler( void ) __attribute__((interrupt));
+void DVP_IRQHandler( void )
+{
+	uint8_t f = DVP->IFR;
+	DVP->IFR = f;
+	if( f & RB_DVP_IF_STR_FRM )
+	{
+		UVCFrameStart();
+		DVP->DMA_BUF0 = (uintptr_t)UVCRowAddr();
+		DVP->DMA_BUF1 = (uintptr_t)UVCRowAddr();
+	}
+	if( f & RB_DVP_IF_ROW_DONE )
+	{
+		int b = uvc.rows & 1;
+		UVCRowDone();
+		if( b ) DVP->DMA_BUF1 = (uintptr_t)UVCRowAddr();
+		else DVP->DMA_BUF0 = (uintptr_t)UVCRowAddr();
+	}
+	if( f & RB_DVP_IF_FIFO_OV ) UVCFrameError();
+	if( f & RB_DVP_IF_FRM_DONE ) UVCFrameEnd( UVC_MJPEG );
+}
+
+#endif
+
+#endif
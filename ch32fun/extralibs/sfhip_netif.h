@@ -0,0 +1,336 @@
+#ifndef _SFHIP_NETIF_H
+#define _SFHIP_NETIF_H
+
+/**
+ Glue between sfhip.h and the on-chip Ethernet MACs, without copying frames.
+
+  CH32V208 (built-in 10BASE-T, ch32v208_eth.h)
+  CH32V307 (GbE MAC + RTL8211, ch32v307gigabit.h)
+
+ Received frames are handed to sfhip_accept_packet() where the MAC put them.
+ sfhip builds its reply in that same buffer, and the reply is sent straight
+ from it, the RX buffer only goes back to the MAC once the frame has left.
+ Packets sfhip makes on its own (sfhip_tick(), or your own sends through
+ sfhip_netif_get_tx()) are built directly in a TX buffer. The only copy
+ left is if you call sfhip_send_packet() on a buffer of your own.
+
+ In exactly one file:
+
+  #define SFHIP_IMPLEMENTATION
+  #include "sfhip_netif.h"   // includes sfhip.h and the MAC driver
+
+  sfhip hip = { ... };
+
+  sfhip_netif_init( &hip );           // brings up the MAC, sets hip.self_mac
+  while( 1 )
+  {
+    sfhip_netif_poll( &hip, ms );     // ms since the last call
+    ...
+  }
+
+ You still implement the sfhip callbacks (TCP, UDP handler, DHCP lease).
+ On the CH32V307 this also implements ch32v307ethInitHandlePacket(),
+ ch32v307ethInitHandleTXC() and ch32v307ethHandleReconfig(), define
+ SFHIP_NETIF_RECONFIG to get link changes. On the CH32V208 call
+ eth_poll_link() every 50-100ms yourself, as before.
+
+ The V307 MAC inserts IP/UDP/TCP checksums on transmit, so the software ones
+ are off by default there.
+*/
+
+#if defined( CH32V20x )
+	#define SFHIP_NETIF_V208 1
+#elif defined( CH32V30x )
+	#define SFHIP_NETIF_V307 1
+#else
+	#error "sfhip_netif: needs a CH32V208 or CH32V307"
+#endif
+
+// Largest frame on the wire without the CRC. The sfhip default is bigger
+// than the MAC buffers.
+#ifndef SFHIP_MTU
+	#define SFHIP_MTU 1514
+#endif
+
+#if SFHIP_NETIF_V307
+	#ifndef SFHIP_EMIT_UDP_CHECKSUM
+		#define SFHIP_EMIT_UDP_CHECKSUM 0
+	#endif
+	#ifndef SFHIP_EMIT_TCP_CHECKSUM
+		#define SFHIP_EMIT_TCP_CHECKSUM 0
+	#endif
+#endif
+
+#include "sfhip.h"
+
+// Frames handled per sfhip_netif_poll(), so a flood can't starve the caller.
+#ifndef SFHIP_NETIF_RX_BUDGET
+	#define SFHIP_NETIF_RX_BUDGET 8
+#endif
+
+void sfhip_netif_init( sfhip * hip );
+
+// Handles up to SFHIP_NETIF_RX_BUDGET received frames, then ticks sfhip.
+// Returns the number of frames handled.
+int sfhip_netif_poll( sfhip * hip, int milliseconds );
+
+// A TX buffer to build a packet of your own in, or NULL if none are free.
+// Send it with sfhip_send_packet() / sfhip_send_udp_packet() and it goes out
+// without a copy. Don't ask for a second one before sending the first.
+sfhip_phy_packet_mtu * sfhip_netif_get_tx( void );
+
+#ifdef SFHIP_IMPLEMENTATION
+
+#include <string.h>
+
+#if SFHIP_NETIF_V208
+
+#define CH32V208_ETH_IMPLEMENTATION
+#include "ch32v208_eth.h"
+
+HIPSTATIC_ASSERT( ETH_RX_BUF_SIZE >= sizeof( sfhip_phy_packet_mtu ) && ETH_TX_BUF_SIZE >= sizeof( sfhip_phy_packet_mtu ),
+                  "ETH buffers must hold SFHIP_MTU" );
+
+// The RX frame sfhip is working on, so sfhip_send_packet() can tell a reply
+// in place from everything else.
+static uint8_t * sfhip_netif_rx;
+static int sfhip_netif_rx_sent;
+static int sfhip_netif_pending_ms;
+
+void sfhip_netif_init( sfhip * hip )
+{
+	eth_config_t config = {
+		.mac_addr = NULL,
+		.broadcast_filter = true,
+	};
+	eth_init( &config );
+	eth_get_mac_address( hip->self_mac.mac );
+}
+
+sfhip_phy_packet_mtu * sfhip_netif_get_tx( void )
+{
+	return (sfhip_phy_packet_mtu *)eth_get_tx_buffer( NULL );
+}
+
+int sfhip_send_packet( sfhip * hip, sfhip_phy_packet * data, int length )
+{
+	uint8_t * d = (uint8_t *)data;
+	if ( d == sfhip_netif_rx && !sfhip_netif_rx_sent )
+	{
+		if ( eth_send_rx_packet( length ) < 0 )
+			return -1;
+		sfhip_netif_rx_sent = 1;
+		return 0;
+	}
+	if ( d == eth_get_tx_buffer( NULL ) )
+		return eth_send_packet_zerocopy( length );
+	return eth_send_packet( d, length );
+}
+
+int sfhip_netif_poll( sfhip * hip, int milliseconds )
+{
+	int n = 0;
+	uint16_t length;
+	uint8_t * pkt;
+
+	while ( n < SFHIP_NETIF_RX_BUDGET && ( pkt = (uint8_t *)eth_get_rx_packet( &length ) ) )
+	{
+		sfhip_netif_rx = pkt;
+		sfhip_netif_rx_sent = 0;
+		sfhip_accept_packet( hip, (sfhip_phy_packet_mtu *)pkt, length );
+		sfhip_netif_rx = NULL;
+		if ( !sfhip_netif_rx_sent )
+			eth_release_rx_packet();
+		n++;
+	}
+
+	// sfhip builds timer driven packets in the scratch buffer, make that a
+	// TX buffer. If they're all in flight, hold the time for the next call.
+	sfhip_netif_pending_ms += milliseconds;
+	sfhip_phy_packet_mtu * scratch = sfhip_netif_get_tx();
+	if ( scratch )
+	{
+		sfhip_tick( hip, scratch, sfhip_netif_pending_ms );
+		sfhip_netif_pending_ms = 0;
+	}
+	return n;
+}
+
+#elif SFHIP_NETIF_V307
+
+#ifndef SFHIP_NETIF_TXBUFS
+	#define SFHIP_NETIF_TXBUFS 4 // power of two, at most 8
+#endif
+
+#include "ch32v307gigabit.h"
+
+HIPSTATIC_ASSERT( CH32V307GIGABIT_BUFFSIZE >= sizeof( sfhip_phy_packet_mtu ), "ETH buffers must hold SFHIP_MTU" );
+HIPSTATIC_ASSERT( 256 % CH32V307GIGABIT_RXBUFNB == 0 && 256 % CH32V307GIGABIT_TXBUFNB == 0,
+                  "CH32V307GIGABIT_RXBUFNB and CH32V307GIGABIT_TXBUFNB must divide 256" );
+HIPSTATIC_ASSERT( SFHIP_NETIF_TXBUFS > 0 && SFHIP_NETIF_TXBUFS <= 8 && ( SFHIP_NETIF_TXBUFS & ( SFHIP_NETIF_TXBUFS - 1 ) ) == 0,
+                  "SFHIP_NETIF_TXBUFS must be a power of two, at most 8" );
+
+// RX: the interrupt keeps every good frame (suppress_own) and queues its
+// descriptor here, the main loop runs sfhip on it in place. The queue
+// indices wrap at 256, so the ring sizes have to divide that.
+typedef struct
+{
+	ETH_DMADESCTypeDef * desc;
+	int length;
+} sfhip_netif_rxent;
+
+static sfhip_netif_rxent sfhip_netif_rxq[CH32V307GIGABIT_RXBUFNB];
+static volatile uint8_t sfhip_netif_rxq_head;
+static uint8_t sfhip_netif_rxq_tail;
+
+// TX: what each in flight TX descriptor is sending from, so it can be
+// returned once the MAC is done. Reaped from the main loop only.
+typedef struct
+{
+	ETH_DMADESCTypeDef * tx;
+	ETH_DMADESCTypeDef * rx; // RX buffer to return, or NULL
+	int8_t txbuf;            // own TX buffer to free, or -1
+} sfhip_netif_txent;
+
+static sfhip_netif_txent sfhip_netif_txq[CH32V307GIGABIT_TXBUFNB];
+static uint8_t sfhip_netif_txq_head;
+static uint8_t sfhip_netif_txq_tail;
+
+// Padded so every buffer starts word aligned for the DMA.
+typedef union
+{
+	sfhip_phy_packet_mtu pkt;
+	uint32_t align[( sizeof( sfhip_phy_packet_mtu ) + 3 ) / 4];
+} sfhip_netif_txbuf;
+
+static sfhip_netif_txbuf sfhip_netif_txbufs[SFHIP_NETIF_TXBUFS];
+static uint8_t sfhip_netif_txbuf_used;
+static ETH_DMADESCTypeDef * sfhip_netif_rx;
+static int sfhip_netif_pending_ms;
+
+int ch32v307ethInitHandlePacket( uint8_t * data, int frame_length, ETH_DMADESCTypeDef * dmadesc )
+{
+	uint8_t h = sfhip_netif_rxq_head;
+	if ( (uint8_t)( h - sfhip_netif_rxq_tail ) >= CH32V307GIGABIT_RXBUFNB )
+		return 0; // Can't happen while each queued frame holds its descriptor, drop it rather than overrun.
+	sfhip_netif_rxent * e = &sfhip_netif_rxq[h % CH32V307GIGABIT_RXBUFNB];
+	e->desc = dmadesc;
+	e->length = frame_length;
+	sfhip_netif_rxq_head = h + 1;
+	return 1; // Keep it, sfhip_netif_poll() gives it back.
+}
+
+void ch32v307ethInitHandleTXC( void )
+{
+}
+
+void ch32v307ethHandleReconfig( int link, int speed, int duplex )
+{
+#ifdef SFHIP_NETIF_RECONFIG
+	SFHIP_NETIF_RECONFIG( link, speed, duplex );
+#endif
+}
+
+static void sfhip_netif_reap_tx( void )
+{
+	while ( sfhip_netif_txq_tail != sfhip_netif_txq_head )
+	{
+		sfhip_netif_txent * e = &sfhip_netif_txq[sfhip_netif_txq_tail % CH32V307GIGABIT_TXBUFNB];
+		if ( e->tx->Status & ETH_DMATxDesc_OWN )
+			break;
+		if ( e->rx )
+			ch32v307ethRxRelease( e->rx );
+		if ( e->txbuf >= 0 )
+			sfhip_netif_txbuf_used &= ~( 1 << e->txbuf );
+		sfhip_netif_txq_tail++;
+	}
+}
+
+void sfhip_netif_init( sfhip * hip )
+{
+	ch32v307ethInit();
+	int i;
+	for ( i = 0; i < 6; i++ )
+		hip->self_mac.mac[i] = ch32v307eth_mac[i];
+}
+
+sfhip_phy_packet_mtu * sfhip_netif_get_tx( void )
+{
+	int i;
+	for ( i = 0; i < SFHIP_NETIF_TXBUFS; i++ )
+		if ( !( sfhip_netif_txbuf_used & ( 1 << i ) ) )
+			return &sfhip_netif_txbufs[i].pkt;
+	return NULL;
+}
+
+int sfhip_send_packet( sfhip * hip, sfhip_phy_packet * data, int length )
+{
+	if ( (uint8_t)( sfhip_netif_txq_head - sfhip_netif_txq_tail ) >= CH32V307GIGABIT_TXBUFNB )
+		return -1;
+
+	sfhip_netif_txent * e = &sfhip_netif_txq[sfhip_netif_txq_head % CH32V307GIGABIT_TXBUFNB];
+	e->tx = pDMATxSet;
+	e->rx = NULL;
+	e->txbuf = -1;
+
+	uint32_t off = (uint32_t)data - (uint32_t)sfhip_netif_txbufs;
+	int b = off / sizeof( sfhip_netif_txbuf );
+	if ( sfhip_netif_rx && (uint32_t)data == sfhip_netif_rx->Buffer1Addr )
+		e->rx = sfhip_netif_rx;
+	else if ( b < SFHIP_NETIF_TXBUFS && off % sizeof( sfhip_netif_txbuf ) == 0 )
+		e->txbuf = b;
+	else
+	{
+		// Someone else's buffer, this is the one case that copies.
+		sfhip_phy_packet_mtu * t = sfhip_netif_get_tx();
+		if ( !t )
+			return -1;
+		memcpy( t, data, length );
+		data = (sfhip_phy_packet *)t;
+		e->txbuf = (sfhip_netif_txbuf *)t - sfhip_netif_txbufs;
+	}
+
+	if ( ch32v307ethTransmitStatic( (uint8_t *)data, length, 0 ) )
+		return -1;
+
+	if ( e->rx )
+		sfhip_netif_rx = NULL; // Now owned by the TX queue.
+	if ( e->txbuf >= 0 )
+		sfhip_netif_txbuf_used |= 1 << e->txbuf;
+	sfhip_netif_txq_head++;
+	return 0;
+}
+
+int sfhip_netif_poll( sfhip * hip, int milliseconds )
+{
+	int n = 0;
+
+	sfhip_netif_reap_tx();
+
+	while ( n < SFHIP_NETIF_RX_BUDGET && sfhip_netif_rxq_tail != sfhip_netif_rxq_head )
+	{
+		sfhip_netif_rxent * e = &sfhip_netif_rxq[sfhip_netif_rxq_tail % CH32V307GIGABIT_RXBUFNB];
+		sfhip_netif_rx = e->desc;
+		sfhip_accept_packet( hip, (sfhip_phy_packet_mtu *)e->desc->Buffer1Addr, e->length );
+		if ( sfhip_netif_rx )
+			ch32v307ethRxRelease( sfhip_netif_rx ); // No reply went out of it.
+		sfhip_netif_rx = NULL;
+		sfhip_netif_rxq_tail++;
+		n++;
+	}
+
+	sfhip_netif_pending_ms += milliseconds;
+	sfhip_phy_packet_mtu * scratch = sfhip_netif_get_tx();
+	if ( scratch )
+	{
+		sfhip_tick( hip, scratch, sfhip_netif_pending_ms );
+		sfhip_netif_pending_ms = 0;
+	}
+	return n;
+}
+
+#endif
+
+#endif // SFHIP_IMPLEMENTATION
+
+#endif
@@ -0,0 +1,312 @@
+/* Single-File-Header for driving up to 16 strings of WS2812B LEDs at once,
+   one per pin of a GPIO port, by timer triggered DMA to the port's BSHR.
+
+   The SPI driver (ws2812b_dma_spi_led_driver.h) drives one string. This one
+   sends a word to BSHR at every compare match of TIM1 channel 1, which
+   triggers DMA1 Channel 2 (as in examples/dma_gpio), three per bit: raise
+   every string's pin, drop the pins of the strings sending a 0, drop the
+   rest. At 2.4 MHz that's 417ns high for a 0, 833ns for a 1, 1.25us a bit,
+   for every string, so a frame takes as long as one string of the longest
+   length does: 8 strings of 300 LEDs in 9ms, about 106 frames a second
+   with the reset time.
+
+   The DMA buffer holds WS2812PAR_DMALEDS LEDs of every string, and is
+   refilled half at a time from the DMA interrupt. Per LED it turns the
+   colors of all the strings into the 24 bit planes the DMA sends with 8x8
+   bit matrix transposes, WS2812BParEncode(), so the cost barely depends on
+   how many of the 8 (or 16) strings are in use.
+
+   For parts with TIM1 and DMA1: the CH32V003, V00x, X03x, V10x, V20x, V30x.
+   Pins above 7 need a port with CFGHR, so not on the V003.
+
+   Copyright 2023 <>< Charles Lohr, under the MIT-x11 or NewBSD License, you choose!
+
+   If you are including this in main, simply
+	#define WS2812PAR_IMPLEMENTATION
+
+   Other defines include:
+	#define WS2812PAR_PORT GPIOC      // the port the strings are on
+	#define WS2812PAR_PIN0 0          // the pin of string 0
+	#define WS2812PAR_STRIPS 8        // strings on pins PIN0 to PIN0 + STRIPS - 1, at most 16
+	#define WS2812PAR_DMALEDS 2       // LEDs in the DMA buffer, 288 bytes each, must be even
+	#define WS2812PAR_RESET_LEDS 12   // low time before a frame, in LEDs of 30us
+	#define WS2812PAR_SLICE_HZ 2400000
+	#define WS2812B_ALLOW_INTERRUPT_NESTING
+
+   You will need to implement the following callback from the ISR. It fills
+   in colors[0] to colors[WS2812PAR_STRIPS-1] with LED ledno of each string,
+   as 0xGGRRBB, sent most significant bit first.
+	void WS2812BParLEDCallback( uint32_t * colors, int ledno );
+
+   You will also need to call
+	WS2812BParInit();
+
+   Then, when you want to update the LEDs, call:
+	WS2812BParStart( int num_leds );
+
+   WS2812BParLEDInUse is 1 until the frame is out. Starting a frame while
+   one goes out cuts that one short.
+*/
+
+#ifndef _WS2812_PARALLEL_DRIVER_H
+#define _WS2812_PARALLEL_DRIVER_H
+
+#include <stdint.h>
+
+#ifndef WS2812PAR_PORT
+#define WS2812PAR_PORT GPIOC
+#endif
+
+#ifndef WS2812PAR_PIN0
+#define WS2812PAR_PIN0 0
+#endif
+
+#ifndef WS2812PAR_STRIPS
+#define WS2812PAR_STRIPS 8
+#endif
+
+#ifndef WS2812PAR_DMALEDS
+#define WS2812PAR_DMALEDS 2
+#endif
+
+#ifndef WS2812PAR_RESET_LEDS
+#define WS2812PAR_RESET_LEDS 12
+#endif
+
+#ifndef WS2812PAR_SLICE_HZ
+#define WS2812PAR_SLICE_HZ 2400000
+#endif
+
+#if WS2812PAR_STRIPS < 1 || WS2812PAR_PIN0 + WS2812PAR_STRIPS > 16
+#error "WS2812PAR_STRIPS strings from WS2812PAR_PIN0 must fit in the 16 pins of a port"
+#endif
+
+#if WS2812PAR_DMALEDS < 2 || ( WS2812PAR_DMALEDS & 1 )
+#error "WS2812PAR_DMALEDS must be even"
+#endif
+
+// BSHR words per LED, per bit, and in the buffer.
+#define WS2812PAR_WORDS_PER_LED ( 24 * 3 )
+#define WS2812PAR_DMA_BUFFER_LEN ( WS2812PAR_DMALEDS * WS2812PAR_WORDS_PER_LED )
+
+// The strings' pins, in BSHR's set half.
+#define WS2812PAR_MASK ( ( ( 1u << WS2812PAR_STRIPS ) - 1 ) << WS2812PAR_PIN0 )
+
+// Use DMA and TIM1 to stream out WS2812B LED Data on pins of WS2812PAR_PORT.
+void WS2812BParInit( void );
+void WS2812BParStart( int leds );
+extern volatile int WS2812BParLEDInUse;
+
+// Callbacks that you must implement.
+void WS2812BParLEDCallback( uint32_t * colors, int ledno );
+
+// Transposes the 8x8 bit matrix with row i in byte i of x (0 to 3) and y
+// (4 to 7), so byte j ends up with bit j of every row, row i in bit i.
+// Three rounds of delta swaps, of bits, pairs, then nibbles.
+static inline void WS2812BParTranspose8( uint32_t * px, uint32_t * py )
+{
+	uint32_t x = *px, y = *py, t;
+	t = ( x ^ ( x >> 7 ) ) & 0x00aa00aa; x ^= t ^ ( t << 7 );
+	t = ( y ^ ( y >> 7 ) ) & 0x00aa00aa; y ^= t ^ ( t << 7 );
+	t = ( x ^ ( x >> 14 ) ) & 0x0000cccc; x ^= t ^ ( t << 14 );
+	t = ( y ^ ( y >> 14 ) ) & 0x0000cccc; y ^= t ^ ( t << 14 );
+	t = ( ( x >> 4 ) ^ y ) & 0x0f0f0f0f;
+	*px = x ^ ( t << 4 );
+	*py = y ^ t;
+}
+
+// One color byte (at bit sh) of 4 strings, string i in byte i.
+#define WS2812PAR_GATHER( c, sh ) \
+	( ( ( c[0] >> (sh) ) & 0xff ) | ( ( ( c[1] >> (sh) ) & 0xff ) << 8 ) | \
+	  ( ( ( c[2] >> (sh) ) & 0xff ) << 16 ) | ( ( c[3] >> (sh) ) << 24 ) )
+
+// The three words of a bit, from the strings sending a 1 in its plane.
+#define WS2812PAR_EMIT( o, plane ) { \
+	o[0] = WS2812PAR_MASK; \
+	o[1] = ( ~( (plane) << WS2812PAR_PIN0 ) & WS2812PAR_MASK ) << 16; \
+	o[2] = WS2812PAR_MASK << 16; \
+	o += 3; }
+
+// Turns one LED of every string, colors[0..7] (or [0..15] with more than 8
+// strings, whatever is in the ones past WS2812PAR_STRIPS doesn't matter),
+// into its 72 BSHR words at out.
+static void WS2812BParEncode( uint32_t * out, const uint32_t * colors )
+{
+	for( int sh = 16; sh >= 0; sh -= 8 )
+	{
+		uint32_t x = WS2812PAR_GATHER( colors, sh );
+		uint32_t y = WS2812PAR_GATHER( ( colors + 4 ), sh );
+		WS2812BParTranspose8( &x, &y );
+#if WS2812PAR_STRIPS > 8
+		uint32_t x2 = WS2812PAR_GATHER( ( colors + 8 ), sh );
+		uint32_t y2 = WS2812PAR_GATHER( ( colors + 12 ), sh );
+		WS2812BParTranspose8( &x2, &y2 );
+		// Interleave, so each halfword is a plane of all 16.
+		uint32_t ylo = ( y & 0xff ) | ( ( y2 & 0xff ) << 8 ) | ( ( y & 0xff00 ) << 8 ) | ( ( y2 & 0xff00 ) << 16 );
+		uint32_t yhi = ( ( y >> 16 ) & 0xff ) | ( ( y2 >> 8 ) & 0xff00 ) | ( ( y >> 8 ) & 0xff0000 ) | ( y2 & 0xff000000 );
+		uint32_t xlo = ( x & 0xff ) | ( ( x2 & 0xff ) << 8 ) | ( ( x & 0xff00 ) << 8 ) | ( ( x2 & 0xff00 ) << 16 );
+		uint32_t xhi = ( ( x >> 16 ) & 0xff ) | ( ( x2 >> 8 ) & 0xff00 ) | ( ( x >> 8 ) & 0xff0000 ) | ( x2 & 0xff000000 );
+		WS2812PAR_EMIT( out, ( yhi >> 16 ) );
+		WS2812PAR_EMIT( out, ( yhi & 0xffff ) );
+		WS2812PAR_EMIT( out, ( ylo >> 16 ) );
+		WS2812PAR_EMIT( out, ( ylo & 0xffff ) );
+		WS2812PAR_EMIT( out, ( xhi >> 16 ) );
+		WS2812PAR_EMIT( out, ( xhi & 0xffff ) );
+		WS2812PAR_EMIT( out, ( xlo >> 16 ) );
+		WS2812PAR_EMIT( out, ( xlo & 0xffff ) );
+#else
+		WS2812PAR_EMIT( out, ( y >> 24 ) );
+		WS2812PAR_EMIT( out, ( ( y >> 16 ) & 0xff ) );
+		WS2812PAR_EMIT( out, ( ( y >> 8 ) & 0xff ) );
+		WS2812PAR_EMIT( out, ( y & 0xff ) );
+		WS2812PAR_EMIT( out, ( x >> 24 ) );
+		WS2812PAR_EMIT( out, ( ( x >> 16 ) & 0xff ) );
+		WS2812PAR_EMIT( out, ( ( x >> 8 ) & 0xff ) );
+		WS2812PAR_EMIT( out, ( x & 0xff ) );
+#endif
+	}
+}
+
+#ifdef WS2812PAR_IMPLEMENTATION
+
+static uint32_t WS2812BPardmabuff[WS2812PAR_DMA_BUFFER_LEN];
+static uint32_t WS2812BParcolors[( WS2812PAR_STRIPS + 7 ) & ~7];
+static volatile int WS2812BParLEDs;
+static volatile int WS2812BParLEDPlace;
+volatile int WS2812BParLEDInUse;
+
+// Fills half the buffer, with the next WS2812PAR_DMALEDS / 2 LEDs, or low
+// before and after the frame.
+static void WS2812BParFillBuffSec( uint32_t * ptr )
+{
+	uint32_t * end = ptr + WS2812PAR_DMA_BUFFER_LEN / 2;
+	int place = WS2812BParLEDPlace;
+	int leds = WS2812BParLEDs;
+
+	while( ptr != end )
+	{
+		if( place < 0 || place >= leds )
+		{
+			uint32_t * le = ptr + WS2812PAR_WORDS_PER_LED;
+			do
+				(*ptr++) = WS2812PAR_MASK << 16;
+			while( ptr != le );
+		}
+		else
+		{
+			WS2812BParLEDCallback( WS2812BParcolors, place );
+			WS2812BParEncode( ptr, WS2812BParcolors );
+			ptr += WS2812PAR_WORDS_PER_LED;
+		}
+		place++;
+	}
+	WS2812BParLEDPlace = place;
+}
+
+void DMA1_Channel2_IRQHandler( void ) __attribute__((interrupt));
+void DMA1_Channel2_IRQHandler( void )
+{
+	volatile int intfr = DMA1->INTFR;
+	do
+	{
+		DMA1->INTFCR = DMA1_IT_GL2;
+
+		// Halfway, the DMA sends the second half, so refill the first. If
+		// the second is all low after the frame, it's the last thing to go
+		// out: take the DMA out of circular mode and let it expire.
+		if( intfr & DMA1_IT_HT2 )
+		{
+			if( WS2812BParLEDPlace >= WS2812BParLEDs + WS2812PAR_DMALEDS / 2 )
+			{
+				DMA1_Channel2->CFGR &= ~DMA_CFGR1_CIRC;
+				WS2812BParLEDInUse = 0;
+			}
+			else
+				WS2812BParFillBuffSec( WS2812BPardmabuff );
+		}
+
+		// Complete, it's back at the start, refill the second half.
+		if( ( intfr & DMA1_IT_TC2 ) && WS2812BParLEDInUse )
+			WS2812BParFillBuffSec( WS2812BPardmabuff + WS2812PAR_DMA_BUFFER_LEN / 2 );
+
+		intfr = DMA1->INTFR;
+	} while( intfr & DMA1_IT_GL2 );
+}
+
+void WS2812BParStart( int leds )
+{
+	// Enter critical section.
+	__disable_irq();
+	DMA1_Channel2->CFGR &= ~DMA_CFGR1_EN;
+	DMA1->INTFCR = DMA1_IT_GL2;
+	WS2812BParLEDInUse = 1;
+	WS2812BParLEDs = leds;
+	WS2812BParLEDPlace = -WS2812PAR_RESET_LEDS;
+
+	WS2812BParFillBuffSec( WS2812BPardmabuff );
+	WS2812BParFillBuffSec( WS2812BPardmabuff + WS2812PAR_DMA_BUFFER_LEN / 2 );
+	DMA1_Channel2->MADDR = (uint32_t)WS2812BPardmabuff;
+	DMA1_Channel2->CNTR = WS2812PAR_DMA_BUFFER_LEN;
+	DMA1_Channel2->CFGR |= DMA_CFGR1_CIRC | DMA_CFGR1_EN;
+	__enable_irq();
+}
+
+void WS2812BParInit( void )
+{
+	GPIO_TypeDef * port = WS2812PAR_PORT;
+
+	// Ports are 0x400 apart from GPIOA, as are their clock enables from IOPA.
+	RCC->AHBPCENR |= RCC_AHBPeriph_DMA1;
+	RCC->APB2PCENR |= RCC_APB2Periph_TIM1 |
+		( RCC_APB2Periph_GPIOA << ( ( (uint32_t)port - GPIOA_BASE ) / 0x400 ) );
+
+	// The strings' pins, low, push-pull outputs. Nothing else on the port
+	// is touched, the DMA only sets and resets these.
+	port->BSHR = WS2812PAR_MASK << 16;
+	for( int i = WS2812PAR_PIN0; i < WS2812PAR_PIN0 + WS2812PAR_STRIPS; i++ )
+	{
+#if WS2812PAR_PIN0 + WS2812PAR_STRIPS > 8
+		volatile uint32_t * cfg = i < 8 ? &port->CFGLR : &port->CFGHR;
+#else
+		volatile uint32_t * cfg = &port->CFGLR;
+#endif
+		int sh = 4 * ( i & 7 );
+		*cfg = ( *cfg & ~( 0xf << sh ) ) | ( GPIO_CFGLR_OUT_10Mhz_PP << sh );
+	}
+
+	// DMA1 Channel 2 is triggered by TIM1 CH1, words from the buffer to
+	// BSHR, circular, interrupts at half and all the way through.
+	DMA1_Channel2->CFGR = 0;
+	DMA1_Channel2->PADDR = (uint32_t)&port->BSHR;
+	DMA1_Channel2->MADDR = (uint32_t)WS2812BPardmabuff;
+	DMA1_Channel2->CFGR =
+		DMA_CFGR1_DIR |                      // MEM2PERIPHERAL
+		DMA_CFGR1_PL |                       // High priority.
+		DMA_CFGR1_MSIZE_1 |                  // 32-bit memory
+		DMA_CFGR1_PSIZE_1 |                  // 32-bit peripheral
+		DMA_CFGR1_MINC |                     // Increase memory.
+		DMA_CFGR1_HTIE |                     // Half-trigger
+		DMA_CFGR1_TCIE;                      // Whole-trigger
+
+	NVIC_EnableIRQ( DMA1_Channel2_IRQn );
+
+#ifdef WS2812B_ALLOW_INTERRUPT_NESTING
+	__set_INTSYSCR( __get_INTSYSCR() | 2 ); // Enable interrupt nesting.
+	NVIC_SetPriority( DMA1_Channel2_IRQn, 0<<4 ); // Preempts the rest.
+#endif
+
+	// Timer 1, running all the time, a compare match every slice, the DMA
+	// only takes them while it has something to send.
+	RCC->APB2PRSTR |= RCC_APB2Periph_TIM1;
+	RCC->APB2PRSTR &= ~RCC_APB2Periph_TIM1;
+	TIM1->PSC = 0x0000;
+	TIM1->ATRLR = ( FUNCONF_SYSTEM_CORE_CLOCK + WS2812PAR_SLICE_HZ / 2 ) / WS2812PAR_SLICE_HZ - 1;
+	TIM1->CH1CVR = 6;
+	TIM1->SWEVGR = TIM_UG;
+	TIM1->DMAINTENR = TIM_CC1DE;
+	TIM1->CTLR1 = TIM_CEN;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,318 @@
+/* Checks the CIC and boxcar decimators and the block statistics of
+	extralibs/lib_adc_decimate.h on the host against a reference in double
+	precision, the frequency response of the CIC against its formula, and
+	times them. See README.md.
+*/
+
+#include <getopt.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "lib_adc_decimate.h"
+
+#define MAXN ( 1 << 16 )
+#define MAXSTRIDE 4
+
+static int failures;
+
+static void fail( const char * what, double got, double want, int a, int b )
+{
+	if( failures++ < 10 ) printf( "FAIL %s: got %.3f, want %.3f (%d, %d)\n", what, got, want, a, b );
+}
+
+static uint64_t rng_state;
+
+static uint32_t rnd( void )
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state >> 32;
+}
+
+static double seconds( void )
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint16_t buf[MAXN * MAXSTRIDE];
+static int32_t out[MAXN];
+static double ref[MAXN];
+
+/* order moving sums of ratio samples, every ratio-th one, then >> shift.
+	In double it's exact: 12 bits and up to 32 of gain. The CIC's first
+	outputs are its start up, the sums of what came before count as 0. */
+static int ref_cic( const uint16_t * in, int n, int stride, int order, int ratio, int shift, double * y )
+{
+	static double s[ADC_CIC_MAX_ORDER + 1][MAXN];
+	for( int i = 0; i < n; i++ ) s[0][i] = in[i * stride];
+	for( int k = 1; k <= order; k++ )
+	{
+		double acc = 0;
+		for( int i = 0; i < n; i++ )
+		{
+			acc += s[k - 1][i];
+			if( i >= ratio ) acc -= s[k - 1][i - ratio];
+			s[k][i] = acc;
+		}
+	}
+	int outs = 0;
+	for( int i = ratio - 1; i < n; i += ratio )
+		y[outs++] = floor( s[order][i] / ldexp( 1, shift ) );
+	return outs;
+}
+
+// Fill the buffer: random, full scale, steps, a slow ramp, or a sine.
+static void fill( int n, int stride, int kind )
+{
+	for( int i = 0; i < n * stride; i++ )
+	{
+		int v;
+		switch( kind )
+		{
+		case 0: v = rnd() & 0xfff; break;
+		case 1: v = 4095; break;
+		case 2: v = ( i / stride / 37 ) & 1 ? 4095 : 0; break;
+		case 3: v = ( i / stride ) & 0xfff; break;
+		default: v = 2048 + (int)lrint( 2000 * sin( i / stride * 0.01 ) ); break;
+		}
+		buf[i] = v;
+	}
+}
+
+/* Orders and ratios with the full output within 32 bits, random shifts and
+	strides, the input fed in random blocks so the state is carried from one
+	to the next, as the DMA interrupt does with half buffers. */
+static void check_cic( int runs )
+{
+	static const int ratios[] = { 1, 2, 3, 4, 5, 8, 10, 16, 32, 64, 100, 256 };
+	for( int r = 0; r < runs; r++ )
+	{
+		int order = 1 + rnd() % ADC_CIC_MAX_ORDER, ratio = ratios[rnd() % 12];
+		double bits = 12 + order * log2( ratio );
+		if( bits > 32 ) continue;
+		int maxshift = (int)ceil( order * log2( ratio ) );
+		int shift = rnd() % 4 ? maxshift : rnd() % ( maxshift + 1 );
+		// And the outputs are int32_t.
+		if( bits - shift > 31 ) shift = (int)ceil( bits - 31 );
+		int stride = 1 + rnd() % MAXSTRIDE, n = 1000 + rnd() % ( MAXN - 1000 );
+		fill( n, stride, r % 5 );
+
+		CICDecimator c;
+		CIC_Init( &c, order, ratio, shift );
+		int outs = 0;
+		for( int i = 0; i < n; )
+		{
+			int blk = 1 + rnd() % 100;
+			if( blk > n - i ) blk = n - i;
+			outs += CIC_Block( &c, buf + i * stride, blk, stride, out + outs );
+			i += blk;
+		}
+		int want = ref_cic( buf, n, stride, order, ratio, shift, ref );
+		if( outs != want ) fail( "CIC_Block outputs", outs, want, order, ratio );
+		for( int i = 0; i < outs && i < want; i++ )
+			if( out[i] != ref[i] )
+			{
+				fail( "CIC_Block against the moving sums", out[i], ref[i], order, ratio );
+				break;
+			}
+	}
+
+	// 4095 for long enough that the integrators wrap over and over.
+	CICDecimator c;
+	CIC_Init( &c, 3, 64, 18 );
+	fill( MAXN, 1, 1 );
+	for( int pass = 0; pass < 200; pass++ )
+	{
+		int n = CIC_Block( &c, buf, MAXN, 1, out );
+		for( int i = 0; i < n; i++ )
+			if( ( pass || i >= 3 ) && out[i] != 4095 ) // past the start up
+			{
+				fail( "CIC_Block after the integrators wrap", out[i], 4095, pass, i );
+				break;
+			}
+	}
+
+	// Order and ratio out of range are clamped to what it can do.
+	CIC_Init( &c, 9, 4, 0 );
+	if( c.order != ADC_CIC_MAX_ORDER ) fail( "CIC_Init order clamp", c.order, ADC_CIC_MAX_ORDER, 9, 0 );
+	CIC_Init( &c, 0, 4, 0 );
+	if( c.order != 1 ) fail( "CIC_Init order clamp", c.order, 1, 0, 0 );
+}
+
+static void check_boxcar( int runs )
+{
+	for( int r = 0; r < runs; r++ )
+	{
+		int ratio = 1 + rnd() % 1000, shift = rnd() % 11;
+		int stride = 1 + rnd() % MAXSTRIDE, n = 1000 + rnd() % ( MAXN - 1000 );
+		fill( n, stride, r % 5 );
+
+		BoxcarDecimator b;
+		Boxcar_Init( &b, ratio, shift );
+		int outs = 0;
+		for( int i = 0; i < n; )
+		{
+			int blk = 1 + rnd() % 100;
+			if( blk > n - i ) blk = n - i;
+			outs += Boxcar_Block( &b, buf + i * stride, blk, stride, out + outs );
+			i += blk;
+		}
+		int want = ref_cic( buf, n, stride, 1, ratio, shift, ref );
+		if( outs != want ) fail( "Boxcar_Block outputs", outs, want, ratio, shift );
+		for( int i = 0; i < outs && i < want; i++ )
+			if( out[i] != ref[i] )
+			{
+				fail( "Boxcar_Block against the sums", out[i], ref[i], ratio, shift );
+				break;
+			}
+	}
+}
+
+static void check_stats( int runs )
+{
+	for( int r = 0; r < runs; r++ )
+	{
+		int stride = 1 + rnd() % MAXSTRIDE, n = 1 + rnd() % 5000, blocks = 1 + rnd() % 4;
+		ADCStats s;
+		ADCStats_Reset( &s );
+		double sum = 0;
+		int mn = 0xffff, mx = 0, count = 0;
+		for( int b = 0; b < blocks; b++ )
+		{
+			fill( n, stride, r % 5 );
+			ADCStats_Block( &s, buf, n, stride );
+			for( int i = 0; i < n; i++ )
+			{
+				int v = buf[i * stride];
+				sum += v;
+				count++;
+				if( v < mn ) mn = v;
+				if( v > mx ) mx = v;
+			}
+		}
+		if( s.min != mn || s.max != mx || s.count != count || s.sum != sum ) fail( "ADCStats_Block", s.sum, sum, s.min, mn );
+		if( ADCStats_Mean( &s ) != floor( sum / count ) ) fail( "ADCStats_Mean", ADCStats_Mean( &s ), floor( sum / count ), n, blocks );
+	}
+}
+
+/* A sine of 1500 counts through the CIC, the amplitude that comes out
+	against |sin( pi f R ) / ( R sin( pi f ) )|^order. f in cycles a sample
+	at the input rate. */
+static double cic_gain( int order, int ratio, double f )
+{
+	double h = fabs( sin( M_PI * f * ratio ) / ( ratio * sin( M_PI * f ) ) );
+	return pow( h, order );
+}
+
+static double measure( int order, int ratio, double f, int n )
+{
+	CICDecimator c;
+	CIC_Init( &c, order, ratio, (int)( order * log2( ratio ) ) );
+	for( int i = 0; i < n; i++ )
+		buf[i] = 2048 + (int)lrint( 1500 * sin( 2 * M_PI * f * i ) );
+	int outs = CIC_Block( &c, buf, n, 1, out );
+	// Least squares fit of a sine at the aliased frequency, past the start up.
+	double fo = f * ratio, ss = 0, sc = 0, s2 = 0, c2 = 0, sc2 = 0, m = 0;
+	int k0 = order + 1, k;
+	for( k = k0; k < outs; k++ ) m += out[k];
+	m /= outs - k0;
+	for( k = k0; k < outs; k++ )
+	{
+		// The output is at the end of each block of R inputs, delayed by
+		// order * ( R - 1 ) / 2 through the filter.
+		double t = 2 * M_PI * ( fo * k + f * ( ratio - 1 ) - f * order * ( ratio - 1 ) / 2.0 );
+		double s = sin( t ), co = cos( t ), y = out[k] - m;
+		ss += y * s; sc += y * co; s2 += s * s; c2 += co * co; sc2 += s * co;
+	}
+	double det = s2 * c2 - sc2 * sc2;
+	double a = ( ss * c2 - sc * sc2 ) / det, b = ( sc * s2 - ss * sc2 ) / det;
+	return hypot( a, b );
+}
+
+static void check_response( int print )
+{
+	// Passband, its edge at a quarter of the output rate, the output's
+	// Nyquist, and what aliases onto the passband.
+	static const double fr[] = { 0.05, 0.25, 0.45, 0.75, 1.25, 1.75 };
+	if( print ) printf( "CIC gain, dB, at f times the output rate, R = 16, measured and formula\n   f      order 1        order 2        order 3        order 4\n" );
+	for( int i = 0; i < 6; i++ )
+	{
+		if( print ) printf( "%5.2f ", fr[i] );
+		for( int order = 1; order <= 4; order++ )
+		{
+			double f = fr[i] / 16, want = cic_gain( order, 16, f ), got = measure( order, 16, f, 32768 ) / 1500;
+			// The output is rounded down to the input's counts, that's
+			// most of an LSB of noise on top of what's left of the sine.
+			if( fabs( got - want ) * 1500 > 0.5 + 1500 * want * 0.002 ) fail( "CIC response against the formula", got * 1500, want * 1500, order, (int)( fr[i] * 100 ) );
+			if( print ) printf( "  %6.1f %6.1f", 20 * log10( got + 1e-9 ), 20 * log10( want + 1e-9 ) );
+		}
+		if( print ) printf( "\n" );
+	}
+}
+
+static volatile int32_t sink;
+
+// 0 to 3 the CIC orders, 4 the boxcar, 5 the stats.
+static double time_kernel( int k, int n, int stride, int reps )
+{
+	CICDecimator c;
+	BoxcarDecimator b;
+	ADCStats s;
+	CIC_Init( &c, k + 1, 16, 4 * ( k + 1 ) );
+	Boxcar_Init( &b, 16, 4 );
+	ADCStats_Reset( &s );
+	double t0 = seconds();
+	for( int r = 0; r < reps; r++ )
+	{
+		if( k < 4 ) sink = CIC_Block( &c, buf, n, stride, out );
+		else if( k == 4 ) sink = Boxcar_Block( &b, buf, n, stride, out );
+		else ADCStats_Block( &s, buf, n, stride );
+	}
+	sink = s.sum;
+	return ( seconds() - t0 ) * 1e9 / ( (double)n * reps );
+}
+
+static void bench( void )
+{
+	static const char * names[] = { "CIC order 1, R 16", "CIC order 2, R 16", "CIC order 3, R 16", "CIC order 4, R 16", "boxcar, R 16", "ADCStats_Block" };
+	int n = 1024;
+	fill( n, 4, 0 );
+	printf( "host ns a sample, %d samples a call\n", n );
+	printf( "                    stride 1  stride 4\n" );
+	for( int k = 0; k < 6; k++ )
+		printf( "%-18s  %8.2f  %8.2f\n", names[k], time_kernel( k, n, 1, 20000 ), time_kernel( k, n, 4, 20000 ) );
+}
+
+int main( int argc, char ** argv )
+{
+	int runs = 400, do_bench = 0, c;
+	uint32_t seed = 1;
+	while( ( c = getopt( argc, argv, "n:r:b" ) ) != -1 )
+	{
+		switch( c )
+		{
+		case 'n': runs = atoi( optarg ); break;
+		case 'r': seed = strtoul( optarg, 0, 0 ); break;
+		case 'b': do_bench = 1; break;
+		default:
+			fprintf( stderr, "usage: %s [-n runs] [-r seed] [-b]\n", argv[0] );
+			return 1;
+		}
+	}
+	rng_state = seed * 0x9e3779b97f4a7c15ull + 1;
+
+	check_cic( runs );
+	check_boxcar( runs );
+	check_stats( runs );
+	check_response( do_bench );
+	if( do_bench ) bench();
+
+	printf( failures ? "FAILED\n" : "ok\n" );
+	return failures ? 2 : 0;
+}
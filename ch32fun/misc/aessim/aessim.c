@@ -0,0 +1,662 @@
+/* Checks lib_aes.h on the host: the NIST vectors for each mode, random
+	buffers against a plain reference in every way they can be split, and the
+	S-box circuit against the table. Built with AESSIM_HW, the code for the
+	CH5xx AES block, unmodified, against a model of the block on the
+	register traps of misc/ethsim. Then the throughput of each mode.
+	See README.md.
+*/
+
+#ifdef AESSIM_HW
+#include "ch32fun.h"
+#include "ethsim.h"
+#else
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#endif
+
+#include <getopt.h>
+#include <time.h>
+
+#include "lib_aes.h"
+
+static int failures;
+static uint32_t violations;
+
+static void fail( const char * what, uint32_t a, uint32_t b )
+{
+	if( failures++ < 10 ) printf( "FAIL %s (%u, %u)\n", what, a, b );
+}
+
+static void violation( const char * what )
+{
+	if( violations++ < 10 ) printf( "violation: %s\n", what );
+}
+
+static uint64_t rng_state;
+
+static uint32_t rnd( void )
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state >> 32;
+}
+
+static void rnd_fill( uint8_t * p, uint32_t n )
+{
+	while( n-- ) *p++ = rnd();
+}
+
+static int hex( const char * s, uint8_t * out )
+{
+	int n = 0;
+	for( ; s[0] && s[1]; s += 2 )
+	{
+		unsigned v;
+		sscanf( s, "%2x", &v );
+		out[n++] = v;
+	}
+	return n;
+}
+
+/* The reference, a byte at a time as FIPS-197 writes it, with tables. */
+
+static uint8_t ref_sbox[256], ref_inv_sbox[256];
+
+static uint8_t gmul( uint8_t a, uint8_t b )
+{
+	uint8_t r = 0;
+	for( ; b; b >>= 1, a = ( a << 1 ) ^ ( a & 0x80 ? 0x1b : 0 ) )
+		if( b & 1 ) r ^= a;
+	return r;
+}
+
+static void ref_init( void )
+{
+	for( int x = 0; x < 256; x++ )
+	{
+		uint8_t inv = 0, s, r;
+		for( int y = 1; x && y < 256; y++ )
+			if( gmul( x, y ) == 1 ) inv = y;
+		s = r = inv;
+		for( int i = 0; i < 4; i++ )
+		{
+			r = r << 1 | r >> 7;
+			s ^= r;
+		}
+		ref_sbox[x] = s ^ 0x63;
+		ref_inv_sbox[s ^ 0x63] = x;
+	}
+}
+
+static void ref_expand( const uint8_t * key, uint8_t rk[176] )
+{
+	uint8_t rcon = 1;
+	memcpy( rk, key, 16 );
+	for( int i = 16; i < 176; i += 4 )
+	{
+		uint8_t t[4] = { rk[i - 4], rk[i - 3], rk[i - 2], rk[i - 1] };
+		if( !( i & 15 ) )
+		{
+			uint8_t t0 = t[0];
+			t[0] = ref_sbox[t[1]] ^ rcon;
+			t[1] = ref_sbox[t[2]];
+			t[2] = ref_sbox[t[3]];
+			t[3] = ref_sbox[t0];
+			rcon = gmul( rcon, 2 );
+		}
+		for( int j = 0; j < 4; j++ ) rk[i + j] = rk[i + j - 16] ^ t[j];
+	}
+}
+
+// b[4 * c + r] is row r of column c.
+static void ref_encrypt( const uint8_t rk[176], uint8_t b[16] )
+{
+	uint8_t t[16];
+	for( int i = 0; i < 16; i++ ) b[i] ^= rk[i];
+	for( int round = 1; round <= 10; round++ )
+	{
+		for( int c = 0; c < 4; c++ )
+			for( int r = 0; r < 4; r++ ) t[4 * c + r] = ref_sbox[b[4 * ( ( c + r ) & 3 ) + r]];
+		for( int c = 0; c < 4; c++ )
+		{
+			uint8_t * a = t + 4 * c;
+			for( int r = 0; r < 4; r++ )
+				b[4 * c + r] = round == 10 ? a[r] :
+					gmul( a[r], 2 ) ^ gmul( a[( r + 1 ) & 3], 3 ) ^ a[( r + 2 ) & 3] ^ a[( r + 3 ) & 3];
+		}
+		for( int i = 0; i < 16; i++ ) b[i] ^= rk[16 * round + i];
+	}
+}
+
+static void ref_decrypt( const uint8_t rk[176], uint8_t b[16] )
+{
+	uint8_t t[16];
+	for( int round = 10; round >= 1; round-- )
+	{
+		for( int i = 0; i < 16; i++ ) t[i] = b[i] ^ rk[16 * round + i];
+		if( round < 10 )
+			for( int c = 0; c < 4; c++ )
+			{
+				uint8_t a[4] = { t[4 * c], t[4 * c + 1], t[4 * c + 2], t[4 * c + 3] };
+				for( int r = 0; r < 4; r++ )
+					t[4 * c + r] = gmul( a[r], 14 ) ^ gmul( a[( r + 1 ) & 3], 11 ) ^
+						gmul( a[( r + 2 ) & 3], 13 ) ^ gmul( a[( r + 3 ) & 3], 9 );
+			}
+		for( int c = 0; c < 4; c++ )
+			for( int r = 0; r < 4; r++ ) b[4 * ( ( c + r ) & 3 ) + r] = ref_inv_sbox[t[4 * c + r]];
+	}
+	for( int i = 0; i < 16; i++ ) b[i] ^= rk[i];
+}
+
+static void ref_cbc( const uint8_t * rk, int dec, uint8_t iv[16], uint8_t * p, uint32_t len )
+{
+	for( ; len >= 16; len -= 16, p += 16 )
+	{
+		uint8_t c[16];
+		memcpy( c, p, 16 );
+		if( dec )
+		{
+			ref_decrypt( rk, p );
+			for( int i = 0; i < 16; i++ ) p[i] ^= iv[i];
+			memcpy( iv, c, 16 );
+		}
+		else
+		{
+			for( int i = 0; i < 16; i++ ) p[i] ^= iv[i];
+			ref_encrypt( rk, p );
+			memcpy( iv, p, 16 );
+		}
+	}
+}
+
+static void ref_inc( uint8_t * c, int from )
+{
+	for( int i = 15; i >= from && !++c[i]; i-- );
+}
+
+static void ref_ctr( const uint8_t * rk, const uint8_t iv[16], uint8_t * p, uint32_t len )
+{
+	uint8_t c[16], k[16];
+	memcpy( c, iv, 16 );
+	for( uint32_t i = 0; i < len; i++ )
+	{
+		if( !( i & 15 ) )
+		{
+			memcpy( k, c, 16 );
+			ref_encrypt( rk, k );
+			ref_inc( c, 0 );
+		}
+		p[i] ^= k[i & 15];
+	}
+}
+
+// CCM as SP 800-38C formats it: B0, the encoded adata and the payload, each
+// padded to blocks, through CBC-MAC, then CTR from A1, the tag masked by A0.
+static void ref_ccm( const uint8_t * rk, const uint8_t * n, int nlen, const uint8_t * a, uint32_t alen,
+	uint8_t * p, uint32_t len, uint8_t * tag, int tlen )
+{
+	int q = 15 - nlen;
+	uint32_t blen = 16 + ( alen + 6 + 15 ) / 16 * 16 + ( len + 15 ) / 16 * 16, o = 16;
+	uint8_t * b = calloc( blen, 1 ), mac[16] = { 0 }, ctr[16] = { 0 }, s0[16];
+	b[0] = ( alen ? 64 : 0 ) | ( tlen - 2 ) / 2 << 3 | ( q - 1 );
+	memcpy( b + 1, n, nlen );
+	for( int i = 0; i < q && i < 4; i++ ) b[15 - i] = len >> 8 * i;
+	if( alen )
+	{
+		if( alen < 0xff00 )
+		{
+			b[o++] = alen >> 8;
+			b[o++] = alen;
+		}
+		else
+		{
+			b[o++] = 0xff;
+			b[o++] = 0xfe;
+			for( int i = 3; i >= 0; i-- ) b[o++] = alen >> 8 * i;
+		}
+		memcpy( b + o, a, alen );
+		o = ( o + alen + 15 ) / 16 * 16;
+	}
+	memcpy( b + o, p, len );
+	o += ( len + 15 ) / 16 * 16;
+	for( uint32_t i = 0; i < o; i += 16 )
+	{
+		for( int j = 0; j < 16; j++ ) mac[j] ^= b[i + j];
+		ref_encrypt( rk, mac );
+	}
+	free( b );
+
+	ctr[0] = q - 1;
+	memcpy( ctr + 1, n, nlen );
+	memcpy( s0, ctr, 16 );
+	ref_encrypt( rk, s0 );
+	for( int i = 0; i < tlen; i++ ) tag[i] = mac[i] ^ s0[i];
+	ref_inc( ctr, 16 - q );
+	ref_ctr( rk, ctr, p, len );
+}
+
+/* The model of the block. A write of CFG with the start bit runs AES-128 on
+	the data registers with the key registers, decrypting with bit 1, and the
+	result is there 1 to 3 reads of CFG later, when the start bit clears.
+	Until then the data registers read as nonsense. The key stays in its
+	registers. */
+
+#ifdef AESSIM_HW
+
+static uint8_t * aesr;
+static struct
+{
+	int on, busy;
+	uint8_t result[16];
+	uint32_t starts, key_loads, busy_polls;
+} hw;
+
+#define AES_REG( field ) ETHSIM_REG( aesr, AES_Type, field )
+
+static void aes_pre( uint32_t off )
+{
+	off -= AES_BASE & 0xfff;
+	if( off >= offsetof( AES_Type, data ) && hw.busy ) violation( "data or key registers while busy" );
+	if( off == offsetof( AES_Type, CFG ) && hw.busy )
+	{
+		hw.busy_polls++;
+		if( !--hw.busy )
+		{
+			memcpy( aesr + offsetof( AES_Type, data ), hw.result, 16 );
+			AES_REG( CFG ) &= ~AES_CFG_START;
+		}
+	}
+}
+
+static void aes_post( uint32_t off, const uint8_t * old )
+{
+	(void)old;
+	off -= AES_BASE & 0xfff;
+	if( off == offsetof( AES_Type, key[3] ) ) hw.key_loads++;
+	if( off != offsetof( AES_Type, CFG ) ) return;
+	uint32_t cfg = AES_REG( CFG );
+	if( cfg == AES_CFG_ON ) hw.on = 1;
+	if( !( cfg & AES_CFG_START ) ) return;
+	if( !hw.on ) violation( "started before CFG_ON" );
+	if( cfg & ~( AES_CFG_START | AES_CFG_DECRYPT ) ) violation( "CFG bits unknown" );
+
+	uint8_t key[16], rk[176];
+	for( int i = 0; i < 4; i++ )
+	{
+		uint32_t k = AES_REG( key[i] ), d = AES_REG( data[i] );
+		memcpy( key + 4 * i, &k, 4 );
+		memcpy( hw.result + 4 * i, &d, 4 );
+		AES_REG( data[i] ) = 0xdeadbeef;
+	}
+	ref_expand( key, rk );
+	if( cfg & AES_CFG_DECRYPT ) ref_decrypt( rk, hw.result );
+	else ref_encrypt( rk, hw.result );
+	hw.busy = 1 + rnd() % 3;
+	hw.starts++;
+}
+
+static void model_init( void )
+{
+	ethsim_init_traps();
+	aesr = ethsim_map( AES_BASE & ~0xfff, 0x1000, aes_pre, aes_post );
+	aesr += AES_BASE & 0xfff; // so offsets in AES_Type go from AES_BASE
+}
+
+#endif
+
+/* The S-box circuit and its inverse, on all 256 bytes, 16 at a time. */
+
+static void check_sbox( void )
+{
+#if !AES_HW
+	for( int x = 0; x < 256; x += 16 )
+		for( int inv = 0; inv < 2; inv++ )
+		{
+			uint32_t s[4];
+			uint8_t * b = (uint8_t *)s;
+			for( int i = 0; i < 16; i++ ) b[i] = x + i;
+			_aes_subbytes( s, inv );
+			for( int i = 0; i < 16; i++ )
+				if( b[i] != ( inv ? ref_inv_sbox : ref_sbox )[x + i] ) fail( inv ? "inverse S-box" : "S-box", x + i, b[i] );
+		}
+#endif
+}
+
+/* The NIST vectors: FIPS-197 C.1, SP 800-38A F.1, F.2 and F.5 both ways,
+	SP 800-38C C.1 to C.3, and the first packet of RFC 3610. */
+
+static const char * const sp38a_key = "2b7e151628aed2a6abf7158809cf4f3c";
+static const char * const sp38a_plain =
+	"6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51"
+	"30c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710";
+
+static const struct
+{
+	const char * key, * nonce, * adata, * plain, * out;
+	int tlen;
+} ccm_vectors[] = {
+	{ "404142434445464748494a4b4c4d4e4f", "10111213141516", "0001020304050607", "20212223",
+		"7162015b4dac255d", 4 },
+	{ "404142434445464748494a4b4c4d4e4f", "1011121314151617", "000102030405060708090a0b0c0d0e0f",
+		"202122232425262728292a2b2c2d2e2f", "d2a1f0e051ea5f62081a7792073d593d1fc64fbfaccd", 6 },
+	{ "404142434445464748494a4b4c4d4e4f", "101112131415161718191a1b", "000102030405060708090a0b0c0d0e0f10111213",
+		"202122232425262728292a2b2c2d2e2f3031323334353637",
+		"e3b201a9f5b71a7a9b1ceaeccd97e70b6176aad9a4428aa5484392fbc1b09951", 8 },
+	{ "c0c1c2c3c4c5c6c7c8c9cacbcccdcecf", "00000003020100a0a1a2a3a4a5", "0001020304050607",
+		"08090a0b0c0d0e0f101112131415161718191a1b1c1d1e",
+		"588c979a61c663d2f066d0c2c0f989806d5f6b61dac38417e8d12cfdf926e0", 8 },
+};
+
+static aes_ctx key;
+
+static void expect( const char * what, const uint8_t * got, const char * want_hex, int n )
+{
+	uint8_t want[128];
+	hex( want_hex, want );
+	if( memcmp( got, want, n ) ) fail( what, n, 0 );
+}
+
+static void check_nist( void )
+{
+	uint8_t k[16], b[64], c[64], iv[16];
+
+	hex( "000102030405060708090a0b0c0d0e0f", k );
+	hex( "00112233445566778899aabbccddeeff", b );
+	aes_setkey( &key, k );
+	aes_encrypt_block( &key, b, c );
+	expect( "FIPS-197 C.1", c, "69c4e0d86a7b0430d8cdb78070b4c55a", 16 );
+	aes_decrypt_block( &key, c, c );
+	expect( "FIPS-197 C.1 decrypt", c, "00112233445566778899aabbccddeeff", 16 );
+
+	hex( sp38a_key, k );
+	aes_setkey( &key, k );
+	hex( sp38a_plain, b );
+
+	aes_ecb_encrypt( &key, b, c, 64 );
+	expect( "ECB-AES128", c,
+		"3ad77bb40d7a3660a89ecaf32466ef97f5d3d58503b9699de785895a96fdbaaf"
+		"43b1cd7f598ece23881b00e3ed0306887b0c785e27e8ad3f8223207104725dd4", 64 );
+	aes_ecb_decrypt( &key, c, c, 64 );
+	expect( "ECB-AES128 decrypt", c, sp38a_plain, 64 );
+
+	static const char * const cbc =
+		"7649abac8119b246cee98e9b12e9197d5086cb9b507219ee95db113a917678b2"
+		"73bed6b8e3c1743b7116e69e222295163ff1caa1681fac09120eca307586e1a7";
+	hex( "000102030405060708090a0b0c0d0e0f", iv );
+	aes_cbc_encrypt( &key, iv, b, c, 64 );
+	expect( "CBC-AES128", c, cbc, 64 );
+	expect( "CBC-AES128 iv after", iv, cbc + 96, 16 );
+	hex( "000102030405060708090a0b0c0d0e0f", iv );
+	aes_cbc_decrypt( &key, iv, c, c, 32 );
+	aes_cbc_decrypt( &key, iv, c + 32, c + 32, 32 );
+	expect( "CBC-AES128 decrypt", c, sp38a_plain, 64 );
+
+	static const char * const ctr =
+		"874d6191b620e3261bef6864990db6ce9806f66b7970fdff8617187bb9fffdff"
+		"5ae4df3edbd5d35e5b4f09020db03eab1e031dda2fbe03d1792170a0f3009cee";
+	aes_ctr_state st;
+	hex( "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff", iv );
+	aes_ctr_start( &st, iv );
+	aes_ctr( &key, &st, b, c, 64 );
+	expect( "CTR-AES128", c, ctr, 64 );
+	aes_ctr_start( &st, iv );
+	for( int i = 0; i < 64; i += 7 ) aes_ctr( &key, &st, c + i, c + i, i + 7 > 64 ? 64 - i : 7 );
+	expect( "CTR-AES128 decrypt, 7 bytes at a time", c, sp38a_plain, 64 );
+
+	for( uint32_t v = 0; v < sizeof( ccm_vectors ) / sizeof( ccm_vectors[0] ); v++ )
+	{
+		uint8_t n[16], a[32], p[32], out[64], tag[16];
+		hex( ccm_vectors[v].key, k );
+		int nlen = hex( ccm_vectors[v].nonce, n ), alen = hex( ccm_vectors[v].adata, a );
+		int len = hex( ccm_vectors[v].plain, p ), tlen = ccm_vectors[v].tlen;
+		aes_setkey( &key, k );
+		if( aes_ccm_encrypt( &key, n, nlen, a, alen, p, out, len, out + len, tlen ) ) fail( "CCM encrypt refused", v, 0 );
+		expect( "CCM", out, ccm_vectors[v].out, len + tlen );
+		if( aes_ccm_decrypt( &key, n, nlen, a, alen, out, out, len, out + len, tlen ) ) fail( "CCM decrypt refused", v, 0 );
+		expect( "CCM decrypt", out, ccm_vectors[v].plain, len );
+		hex( ccm_vectors[v].out, out );
+		out[len + tlen - 1] ^= 1;
+		if( !aes_ccm_decrypt( &key, n, nlen, a, alen, out, tag, len, out + len, tlen ) ) fail( "CCM took a bad tag", v, 0 );
+	}
+}
+
+/* Random keys, lengths and alignments, in and out the same or not, each
+	call split in random pieces, against the reference. */
+
+#define MAXLEN 4096
+
+static uint8_t pbuf[MAXLEN + 64], obuf[MAXLEN + 64], rbuf[MAXLEN + 64];
+
+static void check_guard( const char * what, const uint8_t * out, uint32_t len )
+{
+	for( uint32_t i = 0; i < 8; i++ )
+		if( out[len + i] != 0xa5 ) fail( what, len, i );
+}
+
+static void check_modes( int iterations, uint32_t maxlen )
+{
+	for( int it = 0; it < iterations; it++ )
+	{
+		uint8_t k[16], rk[176], iv[16], iv2[16];
+		int mode = it % 5, inplace = rnd() & 1;
+		uint32_t len = rnd() % ( maxlen + 1 ), ioff = rnd() & 3, ooff = inplace ? ioff : rnd() & 3;
+		if( mode < 4 ) len &= ~15;
+		rnd_fill( k, 16 );
+		rnd_fill( iv, 16 );
+		memcpy( iv2, iv, 16 );
+		ref_expand( k, rk );
+		aes_setkey( &key, k );
+
+		uint8_t * in = pbuf + ioff, * out = inplace ? in : obuf + ooff;
+		rnd_fill( in, len );
+		memcpy( rbuf, in, len );
+		memset( out + len, 0xa5, 8 );
+
+		aes_ctr_state st;
+		if( mode == 4 ) aes_ctr_start( &st, iv2 );
+		for( uint32_t done = 0; done < len; )
+		{
+			uint32_t n = len - done;
+			if( rnd() & 1 ) n = rnd() % ( n + 1 );
+			if( mode < 4 ) n &= ~15;
+			if( !n ) n = mode < 4 ? 16 : 1;
+			const uint8_t * i = in + done;
+			uint8_t * o = out + done;
+			switch( mode )
+			{
+			case 0: aes_ecb_encrypt( &key, i, o, n ); break;
+			case 1: aes_ecb_decrypt( &key, i, o, n ); break;
+			case 2: aes_cbc_encrypt( &key, iv2, i, o, n ); break;
+			case 3: aes_cbc_decrypt( &key, iv2, i, o, n ); break;
+			default: aes_ctr( &key, &st, i, o, n ); break;
+			}
+			done += n;
+		}
+
+		switch( mode )
+		{
+		case 0: for( uint32_t i = 0; i < len; i += 16 ) ref_encrypt( rk, rbuf + i ); break;
+		case 1: for( uint32_t i = 0; i < len; i += 16 ) ref_decrypt( rk, rbuf + i ); break;
+		case 2: ref_cbc( rk, 0, iv, rbuf, len ); break;
+		case 3: ref_cbc( rk, 1, iv, rbuf, len ); break;
+		default: ref_ctr( rk, iv, rbuf, len ); break;
+		}
+		static const char * const names[] = { "ECB encrypt", "ECB decrypt", "CBC encrypt", "CBC decrypt", "CTR" };
+		if( memcmp( out, rbuf, len ) ) fail( names[mode], len, ioff << 4 | ooff );
+		if( mode == 2 || mode == 3 ) if( memcmp( iv, iv2, 16 ) ) fail( "CBC iv after", len, 0 );
+		check_guard( names[mode], out, len );
+	}
+}
+
+static void check_ccm( int iterations, uint32_t maxlen )
+{
+	static uint8_t adata[0xff00 + 64], plain[MAXLEN];
+	for( int it = 0; it < iterations; it++ )
+	{
+		uint8_t k[16], rk[176], n[16], tag[16], rtag[16];
+		int nlen = 7 + rnd() % 7, tlen = 4 + 2 * ( rnd() % 7 ), inplace = rnd() & 1;
+		uint32_t len = rnd() % ( maxlen + 1 ), alen = rnd() & 1 ? rnd() % 100 : 0;
+		if( nlen == 13 && len > 0xffff ) len = 0xffff;
+		if( it == 0 ) alen = 0xff00 + 5; // the 6 byte length
+		rnd_fill( k, 16 );
+		rnd_fill( n, nlen );
+		rnd_fill( adata, alen );
+		ref_expand( k, rk );
+		aes_setkey( &key, k );
+
+		uint8_t * in = pbuf + ( rnd() & 3 ), * out = inplace ? in : obuf + ( rnd() & 3 );
+		rnd_fill( in, len );
+		memcpy( rbuf, in, len );
+		memcpy( plain, in, len );
+		memset( out + len, 0xa5, 8 );
+		ref_ccm( rk, n, nlen, adata, alen, rbuf, len, rtag, tlen );
+		if( aes_ccm_encrypt( &key, n, nlen, adata, alen, in, out, len, tag, tlen ) ) fail( "CCM refused", nlen, tlen );
+		if( memcmp( out, rbuf, len ) ) fail( "CCM", len, alen );
+		if( memcmp( tag, rtag, tlen ) ) fail( "CCM tag", len, alen );
+		check_guard( "CCM", out, len );
+
+		// Back, then with one bit of something wrong
+		memcpy( rbuf, out, len );
+		uint8_t * dec = obuf + 8;
+		if( aes_ccm_decrypt( &key, n, nlen, adata, alen, rbuf, dec, len, tag, tlen ) ) fail( "CCM decrypt refused", len, alen );
+		if( memcmp( dec, plain, len ) ) fail( "CCM decrypt", len, alen );
+
+		int what = rnd() % 4;
+		uint32_t bit = rnd();
+		switch( what )
+		{
+		case 0: tag[bit / 8 % tlen] ^= 1 << bit % 8; break;
+		case 1: if( len ) rbuf[bit / 8 % len] ^= 1 << bit % 8; else tag[0] ^= 1; break;
+		case 2: if( alen ) adata[bit / 8 % alen] ^= 1 << bit % 8; else tag[0] ^= 1; break;
+		default: n[bit / 8 % nlen] ^= 1 << bit % 8; break;
+		}
+		memset( dec, 0x5a, len );
+		if( !aes_ccm_decrypt( &key, n, nlen, adata, alen, rbuf, dec, len, tag, tlen ) ) fail( "CCM took a forgery", len, what );
+		for( uint32_t i = 0; i < len; i++ )
+			if( dec[i] ) { fail( "CCM forgery not zeroed", len, i ); break; }
+	}
+
+	// What it must refuse
+	uint8_t n[16] = { 0 }, t[16];
+	if( !aes_ccm_encrypt( &key, n, 6, 0, 0, pbuf, obuf, 16, t, 4 ) ) fail( "CCM nonce of 6", 0, 0 );
+	if( !aes_ccm_encrypt( &key, n, 14, 0, 0, pbuf, obuf, 16, t, 4 ) ) fail( "CCM nonce of 14", 0, 0 );
+	if( !aes_ccm_encrypt( &key, n, 12, 0, 0, pbuf, obuf, 16, t, 5 ) ) fail( "CCM tag of 5", 0, 0 );
+	if( !aes_ccm_encrypt( &key, n, 12, 0, 0, pbuf, obuf, 16, t, 18 ) ) fail( "CCM tag of 18", 0, 0 );
+	if( !aes_ccm_encrypt( &key, n, 13, 0, 0, pbuf, obuf, 0x10000, t, 4 ) ) fail( "CCM 64 kB with a 13 byte nonce", 0, 0 );
+}
+
+/* The block: how often the key went in, and that the CPU had something to
+	do while it worked. */
+
+static void check_hw( void )
+{
+#ifdef AESSIM_HW
+	uint8_t k[16] = { 1 };
+	aes_setkey( &key, k );
+	uint32_t loads = hw.key_loads;
+	for( int i = 0; i < 4; i++ ) aes_ecb_encrypt( &key, pbuf, obuf, 64 );
+	aes_ecb_decrypt( &key, pbuf, obuf, 64 );
+	aes_ecb_encrypt( &key, pbuf, obuf, 64 );
+	uint32_t want = AES_HW_KEY_CACHE ? 3 : 6;
+	if( hw.key_loads - loads != want ) fail( "key loads", hw.key_loads - loads, want );
+	printf( "%u blocks, %u polls of a busy block\n", hw.starts, hw.busy_polls );
+#endif
+}
+
+// MB/s of each over sizes, on this host.
+static volatile uint32_t sink;
+
+static double seconds( void )
+{
+	struct timespec t;
+	clock_gettime( CLOCK_MONOTONIC, &t );
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static void bench( void )
+{
+	static const uint32_t sizes[] = { 16, 64, 256, 4096 };
+	static const char * names[] = { "ECB encrypt", "ECB decrypt", "CBC encrypt", "CBC decrypt", "CTR", "CCM, 4 byte tag" };
+	uint8_t k[16], iv[16] = { 0 }, tag[4];
+	rnd_fill( k, 16 );
+	aes_setkey( &key, k );
+	rnd_fill( pbuf, MAXLEN );
+
+	printf( "\nMB/s on this host%13s", "" );
+	for( int s = 0; s < 4; s++ ) printf( "%9u", sizes[s] );
+	printf( "\n" );
+	for( int f = 0; f < 6; f++ )
+	{
+		printf( "%-30s", names[f] );
+		for( int s = 0; s < 4; s++ )
+		{
+			uint32_t n = sizes[s], reps = ( 4 << 20 ) / n;
+			aes_ctr_state st;
+			aes_ctr_start( &st, iv );
+			double t0 = seconds();
+			for( uint32_t r = 0; r < reps; r++ )
+			{
+				switch( f )
+				{
+				case 0: aes_ecb_encrypt( &key, pbuf, pbuf, n ); break;
+				case 1: aes_ecb_decrypt( &key, pbuf, pbuf, n ); break;
+				case 2: aes_cbc_encrypt( &key, iv, pbuf, pbuf, n ); break;
+				case 3: aes_cbc_decrypt( &key, iv, pbuf, pbuf, n ); break;
+				case 4: aes_ctr( &key, &st, pbuf, pbuf, n ); break;
+				default: aes_ccm_encrypt( &key, iv, 13, iv, 2, pbuf, pbuf, n, tag, 4 ); break;
+				}
+			}
+			double t = seconds() - t0;
+			sink = pbuf[0];
+			printf( "%9.1f", (double)reps * n / t / 1e6 );
+		}
+		printf( "\n" );
+	}
+}
+
+int main( int argc, char ** argv )
+{
+#ifdef AESSIM_HW
+	int iterations = 600, do_bench = 0, c; // every register access is a trap
+#else
+	int iterations = 2000, do_bench = 0, c;
+#endif
+	uint32_t seed = 1;
+	while( ( c = getopt( argc, argv, "n:r:b" ) ) != -1 )
+	{
+		switch( c )
+		{
+		case 'n': iterations = atoi( optarg ); break;
+		case 'r': seed = atoi( optarg ); break;
+		case 'b': do_bench = 1; break;
+		default:
+			fprintf( stderr, "usage: aessim [-n iterations] [-r seed] [-b]\n" );
+			return 1;
+		}
+	}
+	rng_state = seed * 0x9e3779b97f4a7c15ull + 1;
+	ref_init();
+
+#ifdef AESSIM_HW
+	model_init();
+	printf( "AES block model, AES_HW_KEY_CACHE %d, %d buffers\n", AES_HW_KEY_CACHE, iterations );
+	uint32_t maxlen = 256;
+#else
+	printf( "software, %d buffers\n", iterations );
+	uint32_t maxlen = MAXLEN;
+#endif
+
+	check_sbox();
+	check_nist();
+	check_modes( iterations, maxlen );
+	check_ccm( iterations / 4 + 1, maxlen );
+	check_hw();
+
+	if( violations ) fail( "violations", violations, 0 );
+	printf( failures ? "FAILED\n" : "ok\n" );
+	if( do_bench && !failures ) bench();
+	return failures ? 2 : 0;
+}
@@ -0,0 +1,481 @@
+/* Checks lib_crc.h on the host: every CRC against a bit by bit reference,
+	the tables against ones made here from the polynomials and, built with
+	CRCSIM_HW, the CRC unit and DMA code unmodified against a model of both,
+	on the register traps of misc/ethsim. Then the throughput of each CRC.
+	See README.md.
+*/
+
+#ifdef CRCSIM_HW
+#include "ch32fun.h"
+#include "ethsim.h"
+#else
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#endif
+
+#include <getopt.h>
+#include <time.h>
+
+#include "lib_crc.h"
+
+static int failures;
+static uint32_t violations;
+
+static void fail( const char * what, uint32_t got, uint32_t want, uint32_t len )
+{
+	if( failures++ < 10 )
+		printf( "FAIL %s: got %08x, want %08x (%u bytes)\n", what, got, want, len );
+}
+
+static void violation( const char * what )
+{
+	if( violations++ < 10 ) printf( "violation: %s\n", what );
+}
+
+static uint64_t rng_state;
+
+static uint32_t rnd( void )
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state >> 32;
+}
+
+// The references, a bit at a time, straight from the polynomials.
+
+static uint32_t ref_crc32( uint32_t crc, const uint8_t * p, uint32_t n )
+{
+	crc = ~crc;
+	while( n-- )
+	{
+		crc ^= *p++;
+		for( int i = 0; i < 8; i++ ) crc = ( crc & 1 ) ? ( crc >> 1 ) ^ 0xedb88320 : crc >> 1;
+	}
+	return ~crc;
+}
+
+static uint32_t ref_msb( int bits, uint32_t poly, uint32_t crc, const uint8_t * p, uint32_t n )
+{
+	uint32_t top = 1u << ( bits - 1 ), mask = bits == 32 ? 0xffffffff : ( 1u << bits ) - 1;
+	while( n-- )
+	{
+		crc ^= (uint32_t)*p++ << ( bits - 8 );
+		for( int i = 0; i < 8; i++ ) crc = ( ( crc & top ) ? ( crc << 1 ) ^ poly : crc << 1 ) & mask;
+	}
+	return crc;
+}
+
+// The unit: a word, most significant bit first.
+static uint32_t unit_step( uint32_t crc, uint32_t w )
+{
+	crc ^= w;
+	for( int i = 0; i < 32; i++ ) crc = ( crc & 0x80000000 ) ? ( crc << 1 ) ^ 0x04c11db7 : crc << 1;
+	return crc;
+}
+
+static uint32_t le32( const uint8_t * p )
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint32_t ref_unit( const uint8_t * p, uint32_t n )
+{
+	uint32_t crc = 0xffffffff;
+	for( ; n >= 4; n -= 4, p += 4 ) crc = unit_step( crc, le32( p ) );
+	return ref_msb( 32, 0x04c11db7, crc, p, n );
+}
+
+// Table k of each: byte n then k zero bytes, from 0.
+static uint32_t table32( int k, int n )
+{
+	uint32_t c = n;
+	for( int i = 0; i < 8 * ( k + 1 ); i++ ) c = ( c & 1 ) ? ( c >> 1 ) ^ 0xedb88320 : c >> 1;
+	return c;
+}
+
+static uint32_t table_msb( int bits, uint32_t poly, int k, int n )
+{
+	static const uint8_t zero[8];
+	uint8_t b = n;
+	return ref_msb( bits, poly, ref_msb( bits, poly, 0, &b, 1 ), zero, k );
+}
+
+static uint32_t table_entry( int which, int k, int n )
+{
+	switch( which )
+	{
+	case 0: return table32( k, n );
+	case 1: return table_msb( 32, 0x04c11db7, k, n );
+	case 2: return table_msb( 16, 0x1021, k, n );
+	default: return table_msb( 8, 0x07, k, n );
+	}
+}
+
+static void check_tables( void )
+{
+	for( int k = 0; k < CRC_SLICES; k++ )
+		for( int n = 0; n < 256; n++ )
+		{
+			if( crc32_table[k][n] != table_entry( 0, k, n ) ) fail( "crc32_table", crc32_table[k][n], table_entry( 0, k, n ), k );
+			if( k >= CRC_SLICES4 ) continue;
+			if( crc32_mpeg2_table[k][n] != table_entry( 1, k, n ) ) fail( "crc32_mpeg2_table", crc32_mpeg2_table[k][n], table_entry( 1, k, n ), k );
+			if( crc16_table[k][n] != table_entry( 2, k, n ) ) fail( "crc16_table", crc16_table[k][n], table_entry( 2, k, n ), k );
+			if( crc8_table[k][n] != table_entry( 3, k, n ) ) fail( "crc8_table", crc8_table[k][n], table_entry( 3, k, n ), k );
+		}
+}
+
+// The tables as lib_crc.h has them.
+static void print_tables( void )
+{
+	static const char * decl[] = {
+		"static const uint32_t crc32_table[CRC_SLICES][256]",
+		"static const uint32_t crc32_mpeg2_table[CRC_SLICES4][256]",
+		"static const uint16_t crc16_table[CRC_SLICES4][256]",
+		"static const uint8_t crc8_table[CRC_SLICES4][256]",
+	};
+	static const int digits[] = { 8, 8, 4, 2 }, per[] = { 8, 8, 12, 16 };
+	for( int t = 0; t < 4; t++ )
+	{
+		printf( "%s%s = {\n", t ? "\n" : "", decl[t] );
+		for( int k = 0; k < ( t ? 4 : 8 ); k++ )
+		{
+			if( k == 1 ) printf( "#if CRC_SLICES > 1\n" );
+			if( k == 4 ) printf( "#if CRC_SLICES > 4\n" );
+			printf( "\t{\n" );
+			for( int n = 0; n < 256; n += per[t] )
+			{
+				printf( "\t\t" );
+				for( int i = n; i < n + per[t] && i < 256; i++ )
+					printf( "0x%0*x,%s", digits[t], table_entry( t, k, i ), i + 1 < n + per[t] && i < 255 ? " " : "" );
+				printf( "\n" );
+			}
+			printf( "\t},\n" );
+		}
+		printf( t ? "#endif\n};\n" : "#endif\n#endif\n};\n" );
+	}
+}
+
+#ifdef CRCSIM_HW
+
+/* The CRC unit and DMA1. The DMA moves dma_rate words each time the CPU
+	looks at a DMA register, about what it does while the CPU polls. */
+
+static uint8_t * rcc, * crcu, * dma;
+static uint32_t unit = 0xffffffff;
+static uint32_t dma_rate = 4;
+static struct
+{
+	int on;
+	uint32_t addr, left;
+} chan[7];
+
+#define CHAN( i, reg ) ( *(volatile uint32_t *)( dma + 8 + 20 * ( i ) + 4 * ( reg ) ) )
+
+static int clocked( uint32_t bit )
+{
+	return ETHSIM_REG( rcc, RCC_TypeDef, AHBPCENR ) & bit;
+}
+
+static int dma_busy( void )
+{
+	for( int i = 0; i < 7; i++ )
+		if( chan[i].on && chan[i].left ) return 1;
+	return 0;
+}
+
+static void dma_run( uint32_t words )
+{
+	for( int i = 0; i < 7; i++ )
+	{
+		if( !chan[i].on || !chan[i].left ) continue;
+		for( uint32_t n = 0; n < words && chan[i].left; n++ )
+		{
+			unit = unit_step( unit, *(uint32_t *)(uintptr_t)chan[i].addr );
+			chan[i].addr += 4;
+			chan[i].left--;
+		}
+		CHAN( i, 1 ) = chan[i].left;
+		if( !chan[i].left ) ETHSIM_REG( dma, DMA_TypeDef, INTFR ) |= 3u << ( 4 * i ); // GIF, TC
+	}
+	ETHSIM_REG( crcu, CRC_TypeDef, DATAR ) = unit;
+}
+
+static void crc_pre( uint32_t off )
+{
+	(void)off;
+	if( !clocked( RCC_AHBPeriph_CRC ) ) violation( "CRC unit not clocked" );
+	if( dma_busy() ) violation( "CPU at the CRC unit while the DMA feeds it" );
+}
+
+static void crc_post( uint32_t off, const uint8_t * old )
+{
+	(void)old;
+	if( off == offsetof( CRC_TypeDef, DATAR ) )
+		unit = unit_step( unit, ETHSIM_REG( crcu, CRC_TypeDef, DATAR ) );
+	else if( off == offsetof( CRC_TypeDef, CTLR ) && ( ETHSIM_REG( crcu, CRC_TypeDef, CTLR ) & CRC_CTLR_RESET ) )
+	{
+		unit = 0xffffffff;
+		ETHSIM_REG( crcu, CRC_TypeDef, CTLR ) &= ~CRC_CTLR_RESET;
+	}
+	ETHSIM_REG( crcu, CRC_TypeDef, DATAR ) = unit;
+}
+
+static void dma_pre( uint32_t off )
+{
+	(void)off;
+	if( !clocked( RCC_AHBPeriph_DMA1 ) ) violation( "DMA1 not clocked" );
+	dma_run( dma_rate );
+}
+
+static void dma_post( uint32_t off, const uint8_t * old )
+{
+	(void)old;
+	if( off == offsetof( DMA_TypeDef, INTFCR ) )
+	{
+		ETHSIM_REG( dma, DMA_TypeDef, INTFR ) &= ~ETHSIM_REG( dma, DMA_TypeDef, INTFCR );
+		ETHSIM_REG( dma, DMA_TypeDef, INTFCR ) = 0;
+		return;
+	}
+	if( off < 8 || off >= 8 + 20 * 7 ) return;
+	int i = ( off - 8 ) / 20, reg = ( off - 8 ) % 20 / 4;
+	if( reg > 0 )
+	{
+		if( chan[i].on ) violation( "DMA channel set up while enabled" );
+		if( reg == 1 ) CHAN( i, 1 ) &= 0xffff; // 16 bits
+		return;
+	}
+
+	uint32_t cfg = CHAN( i, 0 );
+	if( !( cfg & DMA_CFGR1_EN ) )
+	{
+		chan[i].on = 0;
+		return;
+	}
+	if( chan[i].on ) return;
+	uint32_t want = DMA_M2M_Enable | DMA_MemoryDataSize_Word | DMA_PeripheralDataSize_Word |
+		DMA_MemoryInc_Enable | DMA_DIR_PeripheralDST | DMA_CFGR1_EN;
+	if( ( cfg & ~DMA_CFGR1_PL ) != want ) violation( "DMA channel not words, memory to the unit" );
+	if( CHAN( i, 2 ) != (uint32_t)CRC_BASE ) violation( "DMA not to CRC->DATAR" );
+	if( CHAN( i, 3 ) & 3 ) violation( "DMA from an unaligned address" );
+	if( !CHAN( i, 1 ) ) violation( "DMA enabled with nothing to do" );
+	chan[i].on = 1;
+	chan[i].addr = CHAN( i, 3 );
+	chan[i].left = CHAN( i, 1 );
+}
+
+static void model_init( void )
+{
+	ethsim_init_traps();
+	rcc = ethsim_map( RCC_BASE, 0x1000, 0, 0 );
+	crcu = ethsim_map( CRC_BASE, 0x1000, crc_pre, crc_post );
+	dma = ethsim_map( DMA1_BASE, 0x1000, dma_pre, dma_post );
+	ETHSIM_REG( crcu, CRC_TypeDef, DATAR ) = unit;
+}
+
+#endif
+
+static uint8_t buf[( 1 << 16 ) + 64];
+#ifdef CRCSIM_HW
+static uint32_t big[200000];
+#endif
+
+static uint32_t pick_len( void )
+{
+	switch( rnd() % 4 )
+	{
+	case 0: return rnd() % 16;
+	case 1: return rnd() % 300;
+	case 2: return rnd() % 4096;
+	default: return rnd() % ( 1 << 16 );
+	}
+}
+
+// A CRC in up to 4 pieces, the cuts anywhere, or on words for the MPEG-2 one.
+static uint32_t in_pieces( int which, uint32_t crc, const uint8_t * p, uint32_t n )
+{
+	int pieces = 1 + rnd() % 4;
+	while( n )
+	{
+		uint32_t m = --pieces ? rnd() % ( n + 1 ) : n;
+		if( which == 1 && m < n ) m &= ~3;
+		switch( which )
+		{
+		case 0: crc = crc32_update( crc, p, m ); break;
+		case 1: crc = crc32_mpeg2_update( crc, p, m ); break;
+		case 2: crc = crc16_update( crc, p, m ); break;
+		default: crc = crc8_update( crc, p, m ); break;
+		}
+		p += m;
+		n -= m;
+	}
+	return crc;
+}
+
+static void check_known( void )
+{
+	static const uint8_t s[] = "123456789";
+	uint32_t c;
+
+	if( ( c = crc32_update( 0, s, 9 ) ) != 0xcbf43926 ) fail( "CRC-32 check", c, 0xcbf43926, 9 );
+	if( ( c = crc16_update( 0, s, 9 ) ) != 0x31c3 ) fail( "CRC-16/XMODEM check", c, 0x31c3, 9 );
+	if( ( c = crc16_update( 0xffff, s, 9 ) ) != 0x29b1 ) fail( "CRC-16/CCITT-FALSE check", c, 0x29b1, 9 );
+	if( ( c = crc8_update( 0, s, 9 ) ) != 0xf4 ) fail( "CRC-8/SMBUS check", c, 0xf4, 9 );
+
+	// Byte by byte, all tail, it's the catalog's CRC-32/MPEG-2.
+	c = CRC32_MPEG2_INIT;
+	for( int i = 0; i < 9; i++ ) c = crc32_mpeg2_update( c, s + i, 1 );
+	if( c != 0x0376e6e7 ) fail( "CRC-32/MPEG-2 check", c, 0x0376e6e7, 9 );
+
+	// The unit's usual example, on ST's parts as well.
+	CRC_init();
+	if( ( c = CRC_calculate32( 0x12345678 ) ) != 0xdf8a8a2b ) fail( "CRC_calculate32( 0x12345678 )", c, 0xdf8a8a2b, 4 );
+	if( ( c = CRC_calculate32( 0 ) ) != unit_step( 0xffffffff, 0 ) ) fail( "CRC_calculate32( 0 )", c, unit_step( 0xffffffff, 0 ), 4 );
+}
+
+static void check_random( int iterations )
+{
+	for( int it = 0; it < iterations && failures < 10; it++ )
+	{
+		uint32_t off = rnd() % 8, n = pick_len(), c, r;
+		uint8_t * p = buf + off;
+		for( uint32_t i = 0; i < n; i++ ) p[i] = rnd();
+		uint32_t init = rnd() & 1 ? 0 : rnd();
+
+		r = ref_crc32( init, p, n );
+		if( ( c = in_pieces( 0, init, p, n ) ) != r ) fail( "crc32_update", c, r, n );
+		r = ref_msb( 16, 0x1021, init & 0xffff, p, n );
+		if( ( c = in_pieces( 2, init & 0xffff, p, n ) ) != r ) fail( "crc16_update", c, r, n );
+		r = ref_msb( 8, 0x07, init & 0xff, p, n );
+		if( ( c = in_pieces( 3, init & 0xff, p, n ) ) != r ) fail( "crc8_update", c, r, n );
+
+		r = ref_unit( p, n );
+		if( ( c = in_pieces( 1, CRC32_MPEG2_INIT, p, n ) ) != r ) fail( "crc32_mpeg2_update", c, r, n );
+#ifdef CRCSIM_HW
+		// Every register access traps, the unit gets an eighth of the
+		// buffers, few of them long.
+		if( it % 8 || ( n > 1024 && rnd() % 8 ) ) continue;
+#endif
+		if( ( c = CRC_calculateBytes( p, n ) ) != r ) fail( "CRC_calculateBytes", c, r, n );
+		uint32_t * w = (uint32_t *)( buf + ( off & 4 ) );
+		r = ref_unit( (uint8_t *)w, n & ~3 );
+		if( ( c = CRC_calculateArray32( w, n / 4 ) ) != r ) fail( "CRC_calculateArray32", c, r, n );
+	}
+}
+
+#ifdef CRCSIM_HW
+static void check_dma( int iterations )
+{
+	for( uint32_t i = 0; i < sizeof( big ) / 4; i++ ) big[i] = rnd();
+	for( int it = 0; it < iterations && failures < 10; it++ )
+	{
+		static const uint32_t edges[] = { 0, 1, 65535, 65536, 131071, 200000 };
+		uint32_t first = rnd() % 1000, n;
+		n = it < 6 ? edges[it] : rnd() % 4 ? rnd() % 2048 : rnd() % ( 200000 - first );
+		if( first + n > 200000 ) first = 200000 - n;
+		dma_rate = 1 + rnd() % 64 + n / ( 64 + rnd() % 1024 ); // a few hundred polls at most
+
+		uint32_t r = ref_unit( (uint8_t *)( big + first ), n * 4 ), c;
+		CRC_startDMA( big + first, n );
+		if( rnd() % 2 ) c = CRC_waitDMA();
+		else
+		{
+			// Something else to do meanwhile.
+			while( CRC_busyDMA() ) rnd();
+			c = CRC_resultDMA();
+		}
+		if( c != r ) fail( "CRC by DMA", c, r, n * 4 );
+		if( dma_busy() ) violation( "DMA still going after the result" );
+
+		// And the CPU gets the unit back.
+		if( ( c = CRC_calculateBytes( buf, 10 ) ) != ref_unit( buf, 10 ) ) fail( "CRC_calculateBytes after DMA", c, ref_unit( buf, 10 ), 10 );
+	}
+}
+#endif
+
+// MB/s of each over sizes, on this host.
+static volatile uint32_t sink;
+
+static double seconds( void )
+{
+	struct timespec t;
+	clock_gettime( CLOCK_MONOTONIC, &t );
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static void bench( void )
+{
+	static const uint32_t sizes[] = { 16, 64, 256, 1024, 4096, 65536 };
+	static const char * names[] = { "bit by bit CRC-32", "crc32_update", "crc32_mpeg2_update", "crc16_update", "crc8_update" };
+	for( uint32_t i = 0; i < sizeof( buf ); i++ ) buf[i] = rnd();
+
+	printf( "\nCRC_SLICES %d, MB/s on this host\n%-20s", CRC_SLICES, "" );
+	for( int s = 0; s < 6; s++ ) printf( "%9u", sizes[s] );
+	printf( "\n" );
+	for( int f = 0; f < 5; f++ )
+	{
+		printf( "%-20s", names[f] );
+		for( int s = 0; s < 6; s++ )
+		{
+			uint32_t n = sizes[s], reps = ( f ? 64 << 20 : 4 << 20 ) / n, c = 0;
+			double t0 = seconds();
+			for( uint32_t r = 0; r < reps; r++ )
+			{
+				switch( f )
+				{
+				case 0: c += ref_crc32( c, buf, n ); break;
+				case 1: c += crc32_update( c, buf, n ); break;
+				case 2: c += crc32_mpeg2_update( c, buf, n ); break;
+				case 3: c += crc16_update( c, buf, n ); break;
+				default: c += crc8_update( c, buf, n ); break;
+				}
+			}
+			double t = seconds() - t0;
+			sink = c;
+			printf( "%9.0f", (double)reps * n / t / 1e6 );
+		}
+		printf( "\n" );
+	}
+}
+
+int main( int argc, char ** argv )
+{
+	int iterations = 3000, do_bench = 0, c;
+	uint32_t seed = 1;
+	while( ( c = getopt( argc, argv, "n:r:bt" ) ) != -1 )
+	{
+		switch( c )
+		{
+		case 'n': iterations = atoi( optarg ); break;
+		case 'r': seed = atoi( optarg ); break;
+		case 'b': do_bench = 1; break;
+		case 't': print_tables(); return 0;
+		default:
+			fprintf( stderr, "usage: crcsim [-n iterations] [-r seed] [-b] [-t]\n" );
+			return 1;
+		}
+	}
+	rng_state = seed * 0x9e3779b97f4a7c15ull + 1;
+
+#ifdef CRCSIM_HW
+	model_init();
+	const char * what = "unit and DMA model";
+#else
+	const char * what = "no unit";
+#endif
+	printf( "CRC_SLICES %d, %s, %d buffers\n", CRC_SLICES, what, iterations );
+
+	check_tables();
+	check_known();
+	check_random( iterations );
+#ifdef CRCSIM_HW
+	check_dma( iterations / 20 + 6 );
+#endif
+
+	if( violations ) fail( "violations", violations, 0, 0 );
+	printf( failures ? "FAILED\n" : "ok\n" );
+	if( do_bench && !failures ) bench();
+	return failures ? 2 : 0;
+}
@@ -0,0 +1,560 @@
+/* Runs ch32v208_eth.h or ch32v307gigabit.h, unmodified, against the
+	register model in ethsim.h, offers bursty traffic and reports where the
+	frames went. See README.md.
+*/
+
+#include "ch32fun.h"
+#include "ethsim.h"
+
+#include <getopt.h>
+
+#if defined( CH32V20x )
+#define ETH_ENABLE_STATS
+#define CH32V208_ETH_IMPLEMENTATION
+#include "ch32v208_eth.h"
+#include "ethsim_ch32v208.h"
+#define ETHSIM_CHIP "ch32v208"
+#define ETHSIM_RXBUFS ETH_RX_BUF_COUNT
+#define ETHSIM_TXBUFS ETH_TX_BUF_COUNT
+#elif defined( CH32V30x )
+static int ethsim_verbose;
+#ifndef CH32V307GIGABIT_RX_POLL
+#define CH32V307GIGABIT_RX_POLL 0
+#endif
+#define printf( ... ) ( ethsim_verbose ? printf( __VA_ARGS__ ) : 0 )
+#include "ch32v307gigabit.h"
+#undef printf
+#include "ethsim_ch32v307.h"
+#if CH32V307GIGABIT_RX_POLL
+#define ETHSIM_CHIP "ch32v307, polled RX"
+#else
+#define ETHSIM_CHIP "ch32v307"
+#endif
+#define ETHSIM_RXBUFS CH32V307GIGABIT_RXBUFNB
+#define ETHSIM_TXBUFS CH32V307GIGABIT_TXBUFNB
+#else
+#error "Build with CH32V20x or CH32V30x"
+#endif
+
+#define ETHERTYPE_TEST 0x88b5 // local experimental
+
+static struct
+{
+	int frames;
+	int size;
+	int burst;
+	uint64_t gap_ns;
+	uint64_t cost_ns;        // app time per frame
+	uint64_t loop_ns;        // main loop time with nothing to do
+	int budget;              // frames per main loop pass, 0 = all
+	int echo;
+	int in_isr;              // ch32v307: handle frames in the interrupt
+	int crc_every;
+	int variant;
+	uint64_t flap_at;
+	uint64_t flap_len;
+} opt = {
+	.frames = 2000,
+	.size = 1514,
+	.burst = 8,
+	.gap_ns = 2000000,
+	.cost_ns = 20000,
+	.loop_ns = 2000,
+	.variant = 1,
+};
+
+static struct
+{
+	uint8_t mac[6];
+	int sent;
+	uint64_t next;
+	uint64_t * arrive;
+	uint8_t * seen;
+	int bad_crc_sent;
+
+	uint32_t delivered;
+	uint32_t corrupt;
+	uint32_t duplicate;
+	uint32_t reordered;
+	uint32_t clobbered;
+	uint32_t rehanded;
+	int last_seq;
+	uint64_t lat_sum;
+	uint64_t lat_max;
+	int max_held;
+
+	uint32_t echo_sent;
+	uint32_t echo_dropped;
+	uint32_t echo_ok;
+	uint32_t echo_bad;
+	uint32_t txc;
+
+	uint32_t ptp_rx;
+	uint32_t ptp_tx;
+	uint32_t ptp_bad;
+} st = { .last_seq = -1 };
+
+static int link_mbps( void )
+{
+	return ethsim_phy0.speed;
+}
+
+static void make_frame( uint8_t * f, int seq )
+{
+	static const uint8_t src[6] = { 0x02, 0, 0, 0, 0, 0x01 };
+	int i;
+	memcpy( f, st.mac, 6 );
+	memcpy( f + 6, src, 6 );
+	f[12] = ETHERTYPE_TEST >> 8;
+	f[13] = ETHERTYPE_TEST & 0xff;
+	memcpy( f + 14, &seq, 4 );
+	for( i = 18; i < opt.size; i++ )
+		f[i] = seq + i;
+}
+
+// Sequence number of a good test frame, -1 if it's been damaged.
+static int parse_frame( const uint8_t * f, int len, int swapped )
+{
+	static const uint8_t src[6] = { 0x02, 0, 0, 0, 0, 0x01 };
+	int seq, i;
+	if( len != opt.size ) return -1;
+	if( memcmp( f + ( swapped ? 6 : 0 ), st.mac, 6 ) || memcmp( f + ( swapped ? 0 : 6 ), src, 6 ) ) return -1;
+	if( f[12] != ( ETHERTYPE_TEST >> 8 ) || f[13] != ( ETHERTYPE_TEST & 0xff ) ) return -1;
+	memcpy( &seq, f + 14, 4 );
+	if( seq < 0 || seq >= opt.frames ) return -1;
+	for( i = 18; i < len; i++ )
+		if( f[i] != (uint8_t)( seq + i ) ) return -1;
+	return seq;
+}
+
+static void swap_macs( uint8_t * f )
+{
+	uint8_t t[6];
+	memcpy( t, f, 6 );
+	memcpy( f, f + 6, 6 );
+	memcpy( f + 6, t, 6 );
+}
+
+// The application got a frame, check it and spend the time on it.
+static void app_frame( const uint8_t * f, int len )
+{
+	int seq = parse_frame( f, len, 0 );
+	if( seq < 0 )
+	{
+		st.corrupt++;
+	}
+	else
+	{
+		if( st.seen[seq] ) st.duplicate++;
+		st.seen[seq] = 1;
+		if( seq < st.last_seq ) st.reordered++;
+		st.last_seq = seq;
+		st.delivered++;
+		uint64_t lat = ethsim_now - st.arrive[seq];
+		st.lat_sum += lat;
+		if( lat > st.lat_max ) st.lat_max = lat;
+	}
+	ethsim_cpu( opt.cost_ns );
+}
+
+static void wire_tx( const uint8_t * f, int len )
+{
+	if( parse_frame( f, len, 1 ) >= 0 ) st.echo_ok++;
+	else st.echo_bad++;
+}
+
+// Traffic and link events.
+static uint64_t world_next( void )
+{
+	uint64_t t = st.sent < opt.frames ? st.next : ETHSIM_NEVER;
+	if( opt.flap_len )
+	{
+		if( ethsim_phy0.cable && opt.flap_at < t ) t = opt.flap_at;
+		if( !ethsim_phy0.cable && opt.flap_at + opt.flap_len < t ) t = opt.flap_at + opt.flap_len;
+	}
+	return t;
+}
+
+static void world_fire( void )
+{
+	static uint8_t f[2048];
+
+	if( opt.flap_len && ethsim_phy0.cable && opt.flap_at <= ethsim_now )
+	{
+		ethsim_phy_cable( 0 );
+		return;
+	}
+	if( opt.flap_len && !ethsim_phy0.cable && opt.flap_at + opt.flap_len <= ethsim_now )
+	{
+		ethsim_phy_cable( 1 );
+		opt.flap_len = 0;
+		return;
+	}
+
+	int seq = st.sent++;
+	int bad = opt.crc_every && ( seq % opt.crc_every ) == opt.crc_every - 1;
+	make_frame( f, seq );
+	st.arrive[seq] = ethsim_now;
+	if( bad ) st.bad_crc_sent++;
+	ethsim_mac_rx( f, opt.size, bad );
+
+	// Back to back within a burst, the next one finishes a wire time later.
+	st.next = ethsim_now + ethsim_wire_ns( opt.size, link_mbps() );
+	if( ( seq + 1 ) % opt.burst == 0 ) st.next += opt.gap_ns;
+}
+
+#if defined( CH32V20x )
+
+static void app_rx( const uint8_t * packet, uint16_t length )
+{
+	app_frame( packet, length );
+}
+
+static void app_init( void )
+{
+	// Echoing needs the zero-copy calls, otherwise it goes through
+	// eth_process_rx_budget().
+	eth_config_t cfg = { .broadcast_filter = true, .rx_callback = opt.echo ? 0 : app_rx };
+	ethsim_mac_window( g_mac_rx_bufs, sizeof( g_mac_rx_bufs ) );
+	ethsim_mac_window( g_mac_tx_bufs, sizeof( g_mac_tx_bufs ) );
+	eth_init( &cfg );
+	eth_get_mac_address( st.mac );
+}
+
+static void app_poll( void )
+{
+	uint16_t len;
+	uint8_t * p;
+	int n = 0;
+
+	if( !opt.echo )
+	{
+		eth_process_rx_budget( opt.budget );
+		return;
+	}
+
+	while( ( !opt.budget || n < opt.budget ) && ( p = (uint8_t *)eth_get_rx_packet( &len ) ) )
+	{
+		n++;
+		app_frame( p, len );
+		swap_macs( p );
+		if( eth_send_rx_packet( len ) < 0 )
+		{
+			st.echo_dropped++;
+			eth_release_rx_packet();
+		}
+		else
+		{
+			st.echo_sent++;
+		}
+	}
+}
+
+static void app_link( void )
+{
+	eth_poll_link();
+}
+
+static uint64_t app_link_period = 50000000;
+
+static void app_report( void )
+{
+	eth_stats_t s;
+	eth_get_stats( &s );
+	printf( "driver: rx %u, rx dropped (ring full) %u, rx errors %u, tx %u, tx dropped %u, tx errors %u\n",
+		s.rx_packets, s.rx_dropped, s.rx_errors, s.tx_packets, s.tx_dropped, s.tx_errors );
+	if( !opt.echo )
+		printf( "poll: %u polls with packets, %u used the whole budget\n", s.rx_polls, s.rx_poll_full );
+}
+
+#else
+
+// Frames held from the interrupt until the main loop gets to them, like
+// sfhip_netif.h does.
+static struct
+{
+	ETH_DMADESCTypeDef * desc;
+	uint8_t * data;
+	int len;
+	int seq;
+} held[CH32V307GIGABIT_RXBUFNB];
+static unsigned held_head, held_tail;
+
+static uint8_t echo_buf[CH32V307GIGABIT_TXBUFNB][CH32V307GIGABIT_BUFFSIZE] __attribute__( ( aligned( 4 ) ) );
+static ETH_DMADESCTypeDef * echo_desc[CH32V307GIGABIT_TXBUFNB];
+
+static void echo( const uint8_t * f, int len )
+{
+	int i;
+	for( i = 0; i < CH32V307GIGABIT_TXBUFNB; i++ )
+		if( !echo_desc[i] || !( echo_desc[i]->Status & ETH_DMATxDesc_OWN ) ) break;
+	ETH_DMADESCTypeDef * d = pDMATxSet;
+	if( i == CH32V307GIGABIT_TXBUFNB )
+	{
+		st.echo_dropped++;
+		return;
+	}
+#if CH32V307GIGABIT_PTP
+	// The stamp of what went out of this slot before.
+	int64_t t;
+	if( echo_desc[i] )
+	{
+		if( ch32v307ethTxTimestamp( echo_desc[i], &t ) || t != v307.tx_stamp[V307_STAMP_SLOT( (uint32_t)(uintptr_t)echo_desc[i] )] )
+			st.ptp_bad++;
+		st.ptp_tx++;
+	}
+#endif
+	memcpy( echo_buf[i], f, len );
+	swap_macs( echo_buf[i] );
+#if CH32V307GIGABIT_PTP
+	if( !ch32v307ethTransmitStaticTS( echo_buf[i], len, 1 ) )
+#else
+	if( ch32v307ethTransmitStatic( echo_buf[i], len, 1 ) )
+#endif
+	{
+		st.echo_dropped++;
+		return;
+	}
+	echo_desc[i] = d;
+	st.echo_sent++;
+}
+
+void ch32v307ethHandleReconfig( int link, int speed, int duplex )
+{
+	if( ethsim_verbose ) printf( "reconfig: link %d speed %d duplex %d\n", link, speed, duplex );
+}
+
+int ch32v307ethInitHandlePacket( uint8_t * data, int frame_length, ETH_DMADESCTypeDef * dmadesc )
+{
+#if CH32V307GIGABIT_PTP
+	if( ch32v307eth_rxtime != v307.rx_stamp[V307_STAMP_SLOT( (uint32_t)(uintptr_t)dmadesc )] ) st.ptp_bad++;
+	st.ptp_rx++;
+#endif
+	// Polled RX calls this from ch32v307ethPoll(), in the main loop.
+	if( opt.in_isr || CH32V307GIGABIT_RX_POLL )
+	{
+		app_frame( data, frame_length );
+		if( opt.echo ) echo( data, frame_length );
+		return 0;
+	}
+
+	unsigned n = held_head - held_tail;
+	if( n >= CH32V307GIGABIT_RXBUFNB )
+	{
+		// Every descriptor is already held and the ring walk handed one of
+		// them over again, it should stop at held ones. Keeping it would spin
+		// the interrupt forever, giving it back lets the DMA write over a
+		// frame that's still queued.
+		st.rehanded++;
+		return 0;
+	}
+	if( (int)n + 1 > st.max_held ) st.max_held = n + 1;
+	held[held_head % CH32V307GIGABIT_RXBUFNB].desc = dmadesc;
+	held[held_head % CH32V307GIGABIT_RXBUFNB].data = data;
+	held[held_head % CH32V307GIGABIT_RXBUFNB].len = frame_length;
+	held[held_head % CH32V307GIGABIT_RXBUFNB].seq = parse_frame( data, frame_length, 0 );
+	held_head++;
+	return 1;
+}
+
+void ch32v307ethInitHandleTXC( void )
+{
+	st.txc++;
+}
+
+#if CH32V307GIGABIT_PTP
+static uint64_t ptp_t0;
+static int64_t ptp_c0;
+#endif
+
+static void app_init( void )
+{
+	ethsim_mac_window( ch32v307eth_MACRxBuf, sizeof( ch32v307eth_MACRxBuf ) );
+	ethsim_mac_window( ch32v307eth_DMARxDscrTab, sizeof( ch32v307eth_DMARxDscrTab ) );
+	ethsim_mac_window( echo_buf, sizeof( echo_buf ) );
+	if( ch32v307ethInit() )
+	{
+		fprintf( stderr, "ch32v307ethInit failed\n" );
+		exit( 1 );
+	}
+	memcpy( st.mac, ch32v307eth_mac, 6 );
+#if CH32V307GIGABIT_PTP
+	// A step forward, one back, and the clock 100 ppm fast from here on.
+	uint64_t t0 = ethsim_now;
+	ch32v307ethPTPStep( 1750000000 );
+	ch32v307ethPTPStep( -500000000 );
+	ethsim_cpu( 1000 );
+	int64_t d = ch32v307ethPTPNow() - 1250000000 - (int64_t)( ethsim_now - t0 );
+	if( d < -20 || d > 20 ) st.ptp_bad++;
+	ch32v307ethPTPAdjust( 100000 );
+	ptp_t0 = ethsim_now;
+	ptp_c0 = ch32v307ethPTPNow();
+#endif
+}
+
+static void app_poll( void )
+{
+#if CH32V307GIGABIT_RX_POLL
+	ch32v307ethPoll( opt.budget );
+#else
+	int n = 0;
+	while( ( !opt.budget || n < opt.budget ) && held_tail != held_head )
+	{
+		typeof( held[0] ) * h = &held[held_tail % CH32V307GIGABIT_RXBUFNB];
+		n++;
+		// The DMA must not have touched it since the interrupt handed it over.
+		if( parse_frame( h->data, h->len, 0 ) != h->seq ) st.clobbered++;
+		app_frame( h->data, h->len );
+		if( opt.echo ) echo( h->data, h->len );
+		ch32v307ethRxRelease( h->desc );
+		held_tail++;
+	}
+#endif
+}
+
+static void app_link( void )
+{
+	ch32v307ethTickPhy();
+}
+
+static uint64_t app_link_period = 10000000;
+
+static void app_report( void )
+{
+	printf( "driver: tx complete interrupts %u, most frames held %d, held descriptor handed over again %u\n",
+		st.txc, st.max_held, st.rehanded );
+#if CH32V307GIGABIT_RX_POLL
+	printf( "poll: %u polls, %.2f frames each, %u used the whole budget, %u back to interrupts\n",
+		ch32v307eth_pollstats.polls,
+		ch32v307eth_pollstats.polls ? (double)ch32v307eth_pollstats.frames / ch32v307eth_pollstats.polls : 0,
+		ch32v307eth_pollstats.full, ch32v307eth_pollstats.rearms );
+#endif
+#if CH32V307GIGABIT_PTP
+	double ppm = ( (double)( ch32v307ethPTPNow() - ptp_c0 ) / ( ethsim_now - ptp_t0 ) - 1 ) * 1e6;
+	if( ppm < 99.99 || ppm > 100.01 ) st.ptp_bad++;
+	printf( "ptp: clock %.3f ppm fast (set to 100), rx stamps %u, tx stamps %u, wrong %u\n",
+		ppm, st.ptp_rx, st.ptp_tx, st.ptp_bad );
+#endif
+}
+
+#endif
+
+static void usage( const char * argv0 )
+{
+	fprintf( stderr,
+		"Usage: %s [options]\n"
+		"  -n frames     frames to offer (%d)\n"
+		"  -s bytes      frame size without FCS, 60..1514 (%d)\n"
+		"  -b frames     burst length, back to back at line rate (%d)\n"
+		"  -g us         gap between bursts (%d)\n"
+		"  -c us         application time per frame (%d)\n"
+		"  -l us         main loop time when idle (%d)\n"
+		"  -i us         interrupt entry + exit time (%d)\n"
+		"  -B frames     frames per main loop pass, 0 = all (%d)\n"
+		"  -e            echo every frame back\n"
+		"  -I            ch32v307: handle frames in the interrupt\n"
+		"  -x n          every nth frame has a bad CRC\n"
+		"  -L ms,ms      unplug the cable at, for\n"
+		"  -S mbps       ch32v307: link speed (1000)\n"
+		"  -E 0|1        ch32v307: part without / with the RBU errata (1)\n"
+		"  -v            driver printouts\n",
+		argv0, opt.frames, opt.size, opt.burst, (int)( opt.gap_ns / 1000 ), (int)( opt.cost_ns / 1000 ),
+		(int)( opt.loop_ns / 1000 ), (int)( ethsim_isr_ns / 1000 ), opt.budget );
+	exit( 1 );
+}
+
+int main( int argc, char ** argv )
+{
+	int c;
+	double a, b;
+	while( ( c = getopt( argc, argv, "n:s:b:g:c:l:i:B:eIx:L:S:E:v" ) ) != -1 )
+	{
+		switch( c )
+		{
+		case 'n': opt.frames = atoi( optarg ); break;
+		case 's': opt.size = atoi( optarg ); break;
+		case 'b': opt.burst = atoi( optarg ); break;
+		case 'g': opt.gap_ns = atof( optarg ) * 1000; break;
+		case 'c': opt.cost_ns = atof( optarg ) * 1000; break;
+		case 'l': opt.loop_ns = atof( optarg ) * 1000; break;
+		case 'i': ethsim_isr_ns = atof( optarg ) * 1000; break;
+		case 'B': opt.budget = atoi( optarg ); break;
+		case 'e': opt.echo = 1; break;
+		case 'I': opt.in_isr = 1; break;
+		case 'x': opt.crc_every = atoi( optarg ); break;
+		case 'L':
+			if( sscanf( optarg, "%lf,%lf", &a, &b ) != 2 ) usage( argv[0] );
+			opt.flap_at = a * 1000000;
+			opt.flap_len = b * 1000000;
+			break;
+		case 'S': ethsim_phy0.speed = atoi( optarg ); break;
+		case 'E': opt.variant = atoi( optarg ); break;
+#if defined( CH32V30x )
+		case 'v': ethsim_verbose = 1; break;
+#endif
+		default: usage( argv[0] );
+		}
+	}
+	if( opt.frames < 1 || opt.size < 60 || opt.size > 1514 || opt.burst < 1 || opt.loop_ns < 1 ) usage( argv[0] );
+
+	st.arrive = calloc( opt.frames, sizeof( *st.arrive ) );
+	st.seen = calloc( opt.frames, 1 );
+
+	ethsim_init_traps();
+	ethsim_init_systick();
+	ethsim_mac_init( opt.variant );
+	ethsim_isr = ETH_IRQHandler;
+	ethsim_wire_tx = wire_tx;
+
+	app_init();
+
+	// Let the link come up first.
+	uint64_t start = ethsim_now + 20000000;
+	uint64_t next_link = ethsim_now;
+	while( ethsim_now < start )
+	{
+		if( ethsim_now >= next_link )
+		{
+			app_link();
+			next_link += app_link_period;
+		}
+		ethsim_cpu( opt.loop_ns );
+	}
+	st.next = start;
+	opt.flap_at += start;
+	ethsim_world_next = world_next;
+	ethsim_world_fire = world_fire;
+
+	uint64_t end = ETHSIM_NEVER;
+	while( ethsim_now < end )
+	{
+		app_poll();
+		if( ethsim_now >= next_link )
+		{
+			app_link();
+			next_link += app_link_period;
+		}
+		ethsim_cpu( opt.loop_ns );
+		if( st.sent == opt.frames && end == ETHSIM_NEVER )
+			end = ethsim_now + 20000000;
+	}
+
+	uint64_t span = st.arrive[opt.frames - 1] - st.arrive[0] + ethsim_wire_ns( opt.size, link_mbps() );
+	int expected = opt.frames - st.bad_crc_sent;
+	printf( "%s, %d rx / %d tx descriptors, %d Mbit/s\n", ETHSIM_CHIP, ETHSIM_RXBUFS, ETHSIM_TXBUFS, link_mbps() );
+	printf( "offered: %d frames of %d bytes in bursts of %d, %.2f Mbit/s average, %d with bad CRC\n",
+		opt.frames, opt.size, opt.burst, (double)opt.frames * opt.size * 8000 / span, st.bad_crc_sent );
+	printf( "delivered: %u of %d (%.1f%%), %.2f Mbit/s, latency avg %.1f us max %.1f us\n",
+		st.delivered, expected, expected ? 100.0 * st.delivered / expected : 0, (double)st.delivered * opt.size * 8000 / span,
+		st.delivered ? st.lat_sum / 1000.0 / st.delivered : 0, st.lat_max / 1000.0 );
+	printf( "interrupts: %u, %.2f per delivered frame\n", ethsim_irq_count,
+		st.delivered ? (double)ethsim_irq_count / st.delivered : 0 );
+	if( opt.echo )
+		printf( "echo: sent %u, dropped %u, on the wire ok %u, bad %u\n", st.echo_sent, st.echo_dropped, st.echo_ok, st.echo_bad );
+	app_report();
+	ethsim_mac_report();
+	printf( "integrity: corrupt %u, duplicate %u, out of order %u, overwritten while held %u\n",
+		st.corrupt, st.duplicate, st.reordered, st.clobbered );
+
+	return ( st.corrupt || st.duplicate || st.reordered || st.clobbered || st.rehanded || st.echo_bad || st.ptp_bad ) ? 2 : 0;
+}
@@ -0,0 +1,342 @@
+#ifndef _ETHSIM_H
+#define _ETHSIM_H
+
+/* Host side register model for the ch32v208 / ch32v307 ethernet drivers.
+
+	The peripheral register blocks are mapped at their real addresses, with
+	no access rights. Every load or store the driver does to them faults,
+	the SIGSEGV handler runs the register's read side effects, opens the
+	page, and single steps the instruction, then the SIGTRAP handler runs
+	the write side effects and closes the page again. So write-1-to-clear
+	flags, self clearing command bits, MII busy bits and the like all behave,
+	and the drivers compile unmodified. x86_64 Linux only.
+
+	DMA descriptors and buffers are plain memory, the drivers cast pointers
+	to uint32_t, so build with -no-pie to keep everything below 4GB.
+
+	Time is virtual, in ns. Code "runs" for as long as it says it does by
+	calling ethsim_cpu(), hardware events (frames arriving, transmissions
+	finishing, autonegotiation) happen in between, and the interrupt is
+	taken whenever its line is up and it's enabled, like on the part.
+
+	Include after ch32fun.h and before the MAC model (ethsim_ch32v208.h or
+	ethsim_ch32v307.h), build with -D_GNU_SOURCE.
+*/
+
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#if !defined( __x86_64__ ) || !defined( __linux__ )
+#error "ethsim traps register accesses with x86_64 Linux signals"
+#endif
+
+#define ETHSIM_NEVER UINT64_MAX
+#define ETHSIM_MAX_REGIONS 8
+
+typedef struct
+{
+	uintptr_t base;
+	uint32_t size;
+	uint8_t * mem;                                       // always accessible alias
+	void ( *pre )( uint32_t off );                       // before any access, update what reads see
+	void ( *post )( uint32_t off, const uint8_t * old ); // after a store, old = the 16 aligned bytes before it
+} ethsim_region;
+
+static ethsim_region ethsim_regions[ETHSIM_MAX_REGIONS];
+static int ethsim_nregions;
+
+static struct
+{
+	ethsim_region * r;
+	uint32_t off;
+	int write;
+	uint8_t old[16];
+} ethsim_pending;
+
+static uint64_t ethsim_now;        // ns
+static uint64_t ethsim_isr_ns = 2000; // interrupt entry + exit cost
+static int ethsim_irq_enabled;
+static int ethsim_in_isr;
+static uint32_t ethsim_irq_count;
+
+// Filled in by the MAC model and the test.
+static uint64_t ( *ethsim_mac_next )( void );   // time of the next internal event
+static void ( *ethsim_mac_fire )( void );       // run internal events due now
+static int ( *ethsim_mac_irq )( void );         // interrupt line
+static uint64_t ( *ethsim_world_next )( void ); // next frame on the wire / link change
+static void ( *ethsim_world_fire )( void );
+static void ( *ethsim_isr )( void );
+static void ( *ethsim_wire_tx )( const uint8_t * frame, int len ); // frames the MAC sends, without FCS
+
+static void ethsim_cpu( uint64_t ns );
+
+static void ethsim_fault( int sig, siginfo_t * si, void * ctx )
+{
+	ucontext_t * uc = ctx;
+	uintptr_t a = (uintptr_t)si->si_addr;
+	int i;
+	(void)sig;
+
+	for( i = 0; i < ethsim_nregions; i++ )
+	{
+		ethsim_region * r = &ethsim_regions[i];
+		if( a < r->base || a >= r->base + r->size ) continue;
+
+		uint32_t off = a - r->base;
+		if( r->pre ) r->pre( off );
+		ethsim_pending.r = r;
+		ethsim_pending.off = off;
+		ethsim_pending.write = ( uc->uc_mcontext.gregs[REG_ERR] & 2 ) != 0;
+		memcpy( ethsim_pending.old, r->mem + ( off & ~15 ), 16 );
+
+		mprotect( (void *)r->base, r->size, PROT_READ | PROT_WRITE );
+		uc->uc_mcontext.gregs[REG_EFL] |= 0x100; // TF, trap after this one instruction
+		return;
+	}
+
+	fprintf( stderr, "ethsim: access to unmodelled address %p\n", si->si_addr );
+	signal( SIGSEGV, SIG_DFL );
+}
+
+static void ethsim_step( int sig, siginfo_t * si, void * ctx )
+{
+	ucontext_t * uc = ctx;
+	ethsim_region * r = ethsim_pending.r;
+	(void)sig; (void)si;
+
+	uc->uc_mcontext.gregs[REG_EFL] &= ~0x100;
+	if( !r ) return;
+	ethsim_pending.r = 0;
+	if( ethsim_pending.write && r->post )
+		r->post( ethsim_pending.off, ethsim_pending.old );
+	mprotect( (void *)r->base, r->size, PROT_NONE );
+}
+
+// Maps size bytes at the fixed address base. Trapped regions (pre or post
+// given) fault on every access, the others are plain memory. Returns the
+// alias the model itself uses.
+static uint8_t * ethsim_map( uintptr_t base, uint32_t size, void ( *pre )( uint32_t ), void ( *post )( uint32_t, const uint8_t * ) )
+{
+	int trapped = pre || post;
+	int fd = memfd_create( "ethsim", 0 );
+	if( fd < 0 || ftruncate( fd, size ) )
+	{
+		perror( "ethsim: memfd" );
+		exit( 1 );
+	}
+	void * p = mmap( (void *)base, size, trapped ? PROT_NONE : PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0 );
+	uint8_t * alias = mmap( 0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	close( fd );
+	if( p != (void *)base || alias == MAP_FAILED )
+	{
+		fprintf( stderr, "ethsim: can't map %08lx\n", (unsigned long)base );
+		exit( 1 );
+	}
+
+	if( trapped )
+	{
+		ethsim_region * r = &ethsim_regions[ethsim_nregions++];
+		r->base = base;
+		r->size = size;
+		r->mem = alias;
+		r->pre = pre;
+		r->post = post;
+	}
+	return alias;
+}
+
+static void ethsim_init_traps( void )
+{
+	struct sigaction sa;
+	memset( &sa, 0, sizeof( sa ) );
+	sa.sa_flags = SA_SIGINFO;
+	sa.sa_sigaction = ethsim_fault;
+	sigaction( SIGSEGV, &sa, 0 );
+	sa.sa_sigaction = ethsim_step;
+	sigaction( SIGTRAP, &sa, 0 );
+}
+
+// The drivers keep DMA addresses in uint32_t.
+static void ethsim_check_dma_ptr( const void * p )
+{
+	if( (uintptr_t)p >> 32 )
+	{
+		fprintf( stderr, "ethsim: %p is above 4GB, build with -no-pie\n", p );
+		exit( 1 );
+	}
+}
+
+#define ETHSIM_REG( mem, type, field ) ( *(volatile __typeof__( ( (type *)0 )->field ) *)( ( mem ) + offsetof( type, field ) ) )
+
+// SysTick, counting at the rate Delay_Us() assumes, straight off virtual time.
+static uint8_t * ethsim_systick;
+
+static void ethsim_systick_pre( uint32_t off )
+{
+	(void)off;
+	ETHSIM_REG( ethsim_systick, SysTick_Type, CNT ) = ethsim_now * DELAY_US_TIME / 1000;
+}
+
+static void ethsim_init_systick( void )
+{
+	ethsim_systick = ethsim_map( SysTick_BASE, 0x1000, ethsim_systick_pre, 0 );
+}
+
+// Takes the interrupt if it's pending and enabled, returns the time it took.
+static uint64_t ethsim_service_irq( void )
+{
+	uint64_t t0 = ethsim_now;
+	while( !ethsim_in_isr && ethsim_irq_enabled && ethsim_mac_irq() )
+	{
+		ethsim_in_isr = 1;
+		ethsim_irq_count++;
+		ethsim_cpu( ethsim_isr_ns );
+		ethsim_isr();
+		ethsim_in_isr = 0;
+	}
+	return ethsim_now - t0;
+}
+
+// Spend ns of CPU time, letting the hardware and the interrupt run. Time
+// taken by the interrupt pushes the end out, like it would on the part.
+static void ethsim_cpu( uint64_t ns )
+{
+	uint64_t end = ethsim_now + ns;
+	for( ;; )
+	{
+		end += ethsim_service_irq();
+
+		uint64_t t = ethsim_mac_next();
+		uint64_t w = ethsim_world_next ? ethsim_world_next() : ETHSIM_NEVER;
+		if( w < t ) t = w;
+		if( t > end ) break;
+		if( t > ethsim_now ) ethsim_now = t;
+
+		if( w <= ethsim_now ) ethsim_world_fire();
+		else ethsim_mac_fire();
+	}
+	if( end > ethsim_now ) ethsim_now = end;
+	ethsim_service_irq();
+}
+
+// What the drivers get from ch32fun on the part.
+void DelaySysTick( uint32_t n )
+{
+	ethsim_cpu( (uint64_t)n * 1000 / DELAY_US_TIME );
+}
+
+static void NVIC_EnableIRQ( IRQn_Type irq )
+{
+	if( irq == ETH_IRQn ) ethsim_irq_enabled = 1;
+}
+
+static void NVIC_DisableIRQ( IRQn_Type irq )
+{
+	if( irq == ETH_IRQn ) ethsim_irq_enabled = 0;
+}
+
+// Wire time of a frame (without FCS) at mbps, with preamble and gap.
+static uint64_t ethsim_wire_ns( int len, int mbps )
+{
+	if( len < 60 ) len = 60;
+	return (uint64_t)( len + 4 + 8 + 12 ) * 8000 / mbps;
+}
+
+static uint32_t ethsim_crc32( const uint8_t * d, int len )
+{
+	uint32_t crc = 0xffffffff;
+	int i, b;
+	for( i = 0; i < len; i++ )
+	{
+		crc ^= d[i];
+		for( b = 0; b < 8; b++ )
+			crc = ( crc >> 1 ) ^ ( 0xedb88320 & -( crc & 1 ) );
+	}
+	return ~crc;
+}
+
+/* PHY: clause 22 registers, enough of them for both drivers. The internal
+	10BASE-T PHY of the ch32v208 and the RTL8211E / RTL8211F of the ch32v307
+	only differ in where the speed / duplex / link status register is. */
+
+typedef struct
+{
+	uint16_t reg[32];
+	uint16_t id2;        // reg 3, 0xc915 RTL8211E, 0xc916 RTL8211F
+	uint16_t partner;    // ANLPAR once negotiated, 0 fakes a failed negotiation
+	int speed;           // Mbit/s
+	int cable;
+	uint64_t an_ns;      // autonegotiation time
+	uint64_t an_done;    // when it finishes, ETHSIM_NEVER = not running
+} ethsim_phy;
+
+static ethsim_phy ethsim_phy0 = {
+	.id2 = 0xc915,
+	.partner = 0x45e1, // ACK + everything up to 100FD
+	.speed = 1000,
+	.cable = 1,
+	.an_ns = 1000000,
+	.an_done = ETHSIM_NEVER,
+};
+
+static int ethsim_phy_link( void )
+{
+	return ethsim_phy0.cable && ethsim_phy0.an_done <= ethsim_now;
+}
+
+static void ethsim_phy_reset( void )
+{
+	memset( ethsim_phy0.reg, 0, sizeof( ethsim_phy0.reg ) );
+	ethsim_phy0.reg[0] = 0x1140; // AN enabled, full duplex
+	ethsim_phy0.reg[4] = 0x01e1; // 100 / 10, full / half
+	ethsim_phy0.an_done = ethsim_now + ethsim_phy0.an_ns;
+}
+
+static uint16_t ethsim_phy_read( int reg )
+{
+	int link = ethsim_phy_link();
+	int code = ethsim_phy0.speed >= 1000 ? 2 : ethsim_phy0.speed >= 100 ? 1 : 0;
+	switch( reg )
+	{
+	case 1: return 0x7849 | ( link ? 0x0024 : 0 ); // link + AN complete
+	case 2: return 0x001c;
+	case 3: return ethsim_phy0.id2;
+	case 5: return link ? ethsim_phy0.partner : 0;
+	case 0x11:
+		if( ethsim_phy0.id2 == 0xc916 ) break;
+		return link ? ( code << 14 ) | ( 1 << 13 ) | ( 1 << 11 ) | ( 1 << 10 ) : 0;
+	case 0x1a:
+		if( ethsim_phy0.id2 != 0xc916 ) break;
+		return link ? ( code << 4 ) | ( 1 << 3 ) | ( 1 << 2 ) : 0;
+	}
+	return ethsim_phy0.reg[reg & 31];
+}
+
+static void ethsim_phy_write( int reg, uint16_t val )
+{
+	reg &= 31;
+	if( reg == 0 && ( val & 0x8000 ) )
+	{
+		ethsim_phy_reset();
+		return;
+	}
+	if( reg == 0 && ( val & 0x0200 ) )
+		ethsim_phy0.an_done = ethsim_now + ethsim_phy0.an_ns;
+	ethsim_phy0.reg[reg] = val & ~0x0200; // restart bit clears itself
+}
+
+static void ethsim_phy_cable( int plugged )
+{
+	ethsim_phy0.cable = plugged;
+	if( plugged ) ethsim_phy0.an_done = ethsim_now + ethsim_phy0.an_ns;
+}
+
+#endif
@@ -0,0 +1,211 @@
+#ifndef _ETHSIM_CH32V208_H
+#define _ETHSIM_CH32V208_H
+
+/* ETH10M, the ch32v208 10BASE-T MAC, as ch32v208_eth.h sees it.
+
+	One receive pointer (ERXST) and one transmit pointer (ETXST), both 16
+	bits. The part only has 64kB of RAM, here they're resolved against the
+	windows handed to ethsim_mac_window().
+
+	A frame lands at ERXST with its length in ERXLN and RXIF set. If RXIF is
+	still set from the previous frame when the next one arrives, the MAC
+	writes over the same buffer and the previous frame is lost
+	(rx_overwritten), that's the cost of a slow interrupt on this part.
+	ERXLN doesn't include the FCS. Frames with a bad CRC only get through
+	when ERXFCON CRCEN is set, like the driver uses it for polarity
+	detection. No address filtering.
+*/
+
+static uint8_t * v208_regs;
+
+#define V208( field ) ETHSIM_REG( v208_regs, ETH10M_TypeDef, field )
+
+static struct
+{
+	uint8_t * win[4];
+	uint32_t winlen[4];
+	int nwin;
+	uint64_t tx_done;
+	int link;               // as last reported with LINKIF
+
+	uint32_t rx_frames;
+	uint32_t rx_overwritten;
+	uint32_t rx_disabled;
+	uint32_t rx_link_down;
+	uint32_t rx_crc_dropped;
+	uint32_t tx_frames;
+	uint32_t dma_faults;
+} v208;
+
+// Memory ERXST / ETXST may point into.
+static void ethsim_mac_window( void * p, uint32_t len )
+{
+	v208.win[v208.nwin] = p;
+	v208.winlen[v208.nwin++] = len;
+}
+
+static uint8_t * v208_dma( uint16_t a, int len )
+{
+	int i;
+	for( i = 0; i < v208.nwin; i++ )
+	{
+		uintptr_t lo = (uintptr_t)v208.win[i];
+		uintptr_t hi = lo + v208.winlen[i];
+		uintptr_t seg;
+		for( seg = lo >> 16; seg <= ( hi - 1 ) >> 16; seg++ )
+		{
+			uintptr_t p = ( seg << 16 ) | a;
+			if( p >= lo && p + len <= hi ) return (uint8_t *)p;
+		}
+	}
+	v208.dma_faults++;
+	return 0;
+}
+
+static void v208_pre( uint32_t off )
+{
+	if( off == offsetof( ETH10M_TypeDef, MIRD ) )
+		V208( MIRD ) = ethsim_phy_read( V208( MIERGADR ) & RB_ETH_MIREGADR_MASK );
+}
+
+static void v208_post( uint32_t off, const uint8_t * old )
+{
+	uint8_t was = old[off & 15];
+
+	if( off == offsetof( ETH10M_TypeDef, EIR ) )
+	{
+		V208( EIR ) = was & ~V208( EIR );
+	}
+	else if( off == offsetof( ETH10M_TypeDef, ESTAT ) )
+	{
+		V208( ESTAT ) = was & ~( V208( ESTAT ) & ( RB_ETH_ESTAT_INT | RB_ETH_ESTAT_BUFER ) );
+	}
+	else if( off == offsetof( ETH10M_TypeDef, ECON1 ) )
+	{
+		uint8_t v = V208( ECON1 );
+		if( v & RB_ETH_ECON1_TXRST )
+		{
+			v208.tx_done = ETHSIM_NEVER;
+			v &= ~RB_ETH_ECON1_TXRTS;
+		}
+		v &= ~( RB_ETH_ECON1_TXRST | RB_ETH_ECON1_RXRST );
+		if( ( v & RB_ETH_ECON1_TXRTS ) && !( was & RB_ETH_ECON1_TXRTS ) )
+			v208.tx_done = ethsim_now + ethsim_wire_ns( V208( ETXLN ), 10 );
+		V208( ECON1 ) = v;
+	}
+	else if( off == offsetof( ETH10M_TypeDef, MIERGADR ) )
+	{
+		// R32_ETH_MIWR, address, command and data in one store.
+		uint32_t v = *(uint32_t *)( v208_regs + off );
+		if( v & RB_ETH_MIWR_MIIWR )
+		{
+			ethsim_phy_write( v & RB_ETH_MIREGADR_MASK, v >> RB_ETH_MIWR_DATA_SHIFT );
+			*(uint32_t *)( v208_regs + off ) = v & ~RB_ETH_MIWR_MIIWR;
+		}
+	}
+}
+
+static uint64_t v208_next( void )
+{
+	int link = ethsim_phy_link();
+	if( link != v208.link ) return ethsim_now;
+	if( !link && ethsim_phy0.cable && ethsim_phy0.an_done < v208.tx_done )
+		return ethsim_phy0.an_done;
+	return v208.tx_done;
+}
+
+static void v208_fire( void )
+{
+	int link = ethsim_phy_link();
+	if( link != v208.link )
+	{
+		v208.link = link;
+		V208( EIR ) |= RB_ETH_EIR_LINKIF;
+	}
+
+	if( v208.tx_done <= ethsim_now )
+	{
+		int len = V208( ETXLN );
+		uint8_t * d = v208_dma( V208( ETXST ), len );
+		if( d && link ) ethsim_wire_tx( d, len );
+		v208.tx_frames++;
+		v208.tx_done = ETHSIM_NEVER;
+		V208( ECON1 ) &= ~RB_ETH_ECON1_TXRTS;
+		V208( EIR ) |= RB_ETH_EIR_TXIF;
+	}
+}
+
+static int v208_irq( void )
+{
+	uint8_t eie = V208( EIE );
+	return ( eie & RB_ETH_EIE_INTIE ) && ( V208( EIR ) & eie &
+		( RB_ETH_EIE_RXIE | RB_ETH_EIE_LINKIE | RB_ETH_EIE_TXIE | RB_ETH_EIE_TXERIE | RB_ETH_EIE_RXERIE ) );
+}
+
+// A frame (without FCS) finished arriving from the wire.
+static void ethsim_mac_rx( const uint8_t * f, int len, int bad_crc )
+{
+	if( !ethsim_phy_link() )
+	{
+		v208.rx_link_down++;
+		return;
+	}
+	if( !( V208( ECON1 ) & RB_ETH_ECON1_RXEN ) )
+	{
+		v208.rx_disabled++;
+		return;
+	}
+	if( bad_crc && !( V208( ERXFCON ) & RB_ETH_ERXFCON_CRCEN ) )
+	{
+		v208.rx_crc_dropped++;
+		return;
+	}
+
+	uint8_t * d = v208_dma( V208( ERXST ), len );
+	if( !d ) return;
+
+	if( V208( EIR ) & RB_ETH_EIR_RXIF )
+		v208.rx_overwritten++;
+	memcpy( d, f, len );
+	V208( ERXLN ) = len;
+	uint8_t estat = V208( ESTAT ) & ~( RB_ETH_ESTAT_RXCRCER | RB_ETH_ESTAT_RXMORE | RB_ETH_ESTAT_RXNIBBLE );
+	if( bad_crc ) estat |= RB_ETH_ESTAT_RXCRCER;
+	if( len > V208( MAMXFL ) ) estat |= RB_ETH_ESTAT_RXMORE;
+	V208( ESTAT ) = estat;
+	V208( EIR ) |= RB_ETH_EIR_RXIF;
+	v208.rx_frames++;
+}
+
+// 1ffff704 CHIPID and the MAC at 1ffff7e8 of a real CH32V208.
+static const uint8_t v208_rom_chipid[4] = { 0x1c, 0x05, 0x80, 0x20 };
+static const uint8_t v208_rom_mac[6] = { 0x7a, 0x8b, 0xd3, 0x7b, 0x54, 0x50 };
+
+static void ethsim_mac_init( int variant )
+{
+	(void)variant;
+	v208.tx_done = ETHSIM_NEVER;
+
+	uint8_t * rom = ethsim_map( 0x1ffff000, 0x1000, 0, 0 );
+	memcpy( rom + ( INFO_BASE & 0xfff ), v208_rom_chipid, 4 );
+	memcpy( rom + ( ROM_CFG_USERADR_ID & 0xfff ), v208_rom_mac, 6 );
+
+	ethsim_map( RCC_BASE & ~0xfff, 0x1000, 0, 0 );
+	ethsim_map( EXTEN_BASE & ~0xfff, 0x1000, 0, 0 );
+	v208_regs = ethsim_map( ETH10M_BASE, 0x1000, v208_pre, v208_post );
+
+	ethsim_mac_next = v208_next;
+	ethsim_mac_fire = v208_fire;
+	ethsim_mac_irq = v208_irq;
+	ethsim_phy0.speed = 10;
+	ethsim_phy0.partner = 0x4061; // ACK, 10BASE-T full / half
+}
+
+static void ethsim_mac_report( void )
+{
+	printf( "mac: rx %u, overwritten %u, rx disabled %u, link down %u, bad crc dropped %u, tx %u\n",
+		v208.rx_frames, v208.rx_overwritten, v208.rx_disabled, v208.rx_link_down, v208.rx_crc_dropped, v208.tx_frames );
+	if( v208.dma_faults )
+		printf( "mac: %u DMA pointers outside the buffers\n", v208.dma_faults );
+}
+
+#endif
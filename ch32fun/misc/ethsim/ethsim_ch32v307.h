@@ -0,0 +1,445 @@
+#ifndef _ETHSIM_CH32V307_H
+#define _ETHSIM_CH32V307_H
+
+/* The ch32v307 gigabit MAC and its descriptor DMA, as ch32v307gigabit.h
+	sees it.
+
+	Receive walks the descriptor chain from DMACHRDR: frames go into buffers
+	the DMA owns, spread over several descriptors if they don't fit, with the
+	FCS in the frame length like the part. Hitting a descriptor the CPU still
+	owns drops the frame, sets RBU and suspends. Without the errata the next
+	frame re-fetches the descriptor and carries on by itself.
+
+	The errata (CHIPID & 0xf0 == 0x10, most V307s around) is modelled the way
+	the driver's workaround reads: after RBU, DMACHRDR still points at the
+	last descriptor the DMA closed, and receive stays suspended until a
+	receive poll demand. The workaround hands DMACHRDR->next back to the DMA
+	whether or not the CPU is done with it.
+
+	Transmit runs from DMACHTDR on a poll demand, gathers buffers up to LS,
+	clears OWN when the frame is on the wire and stops at the first
+	descriptor it doesn't own. Checksum insertion and address filtering
+	aren't modelled.
+
+	The PTP clock runs off virtual time at the rate SSIR, the addend and
+	HCLK give it. With TSE, the last descriptor of every received frame, and
+	of a sent one with TTSE, gets the stamp over its buffer and next
+	addresses once the DMA has moved on, as normal descriptors do.
+*/
+
+static uint8_t * v307_regs;
+static uint8_t * v307_rcc;
+
+#define V307( field ) ETHSIM_REG( v307_regs, ETH_TypeDef, field )
+
+#define V307_DMASR_NORMAL ( ETH_DMA_IT_T | ETH_DMA_IT_TBU | ETH_DMA_IT_R | ETH_DMA_IT_ER )
+#define V307_DMASR_ABNORMAL ( ETH_DMA_IT_TPS | ETH_DMA_IT_TJT | ETH_DMA_IT_RO | ETH_DMA_IT_TU | \
+	ETH_DMA_IT_RBU | ETH_DMA_IT_RPS | ETH_DMA_IT_RWT | ETH_DMA_IT_ET | ETH_DMA_IT_FBE )
+
+static struct
+{
+	int errata;
+	uint32_t rx_cur;        // next descriptor receive uses
+	uint32_t rx_last;       // last one it closed
+	int rx_suspended;
+	int tx_poll;
+	uint64_t tx_done;
+	uint32_t tx_first;
+	uint32_t tx_last;
+	uint8_t txbuf[2048];
+	int txlen;
+
+	uint32_t rx_frames;
+	uint32_t rx_no_desc;
+	uint32_t rx_stopped;
+	uint32_t rx_link_down;
+	uint32_t rx_crc_dropped;
+	uint32_t tx_frames;
+
+	double ptp_base;        // ns on the PTP clock at ptp_t0
+	uint64_t ptp_t0;
+	uint32_t ptp_addend;
+	int64_t rx_stamp[64];   // what went into a descriptor, by address
+	int64_t tx_stamp[64];
+} v307;
+
+#define V307_STAMP_SLOT( a ) ( ( (a) >> 4 ) & 63 )
+
+static void ethsim_mac_window( void * p, uint32_t len )
+{
+	(void)len;
+	ethsim_check_dma_ptr( p );
+}
+
+static ETH_DMADESCTypeDef * v307_desc( uint32_t a )
+{
+	return (ETH_DMADESCTypeDef *)(uintptr_t)a;
+}
+
+static uint32_t v307_rx_next( uint32_t a )
+{
+	ETH_DMADESCTypeDef * d = v307_desc( a );
+	if( d->ControlBufferSize & ETH_DMARxDesc_RCH ) return d->Buffer2NextDescAddr;
+	if( d->ControlBufferSize & ETH_DMARxDesc_RER ) return V307( DMARDLAR );
+	return a + 16 + ( ( V307( DMABMR ) & ETH_DMABMR_DSL ) >> 2 ) * 4;
+}
+
+static uint32_t v307_tx_next( uint32_t a )
+{
+	ETH_DMADESCTypeDef * d = v307_desc( a );
+	if( d->Status & ETH_DMATxDesc_TCH ) return d->Buffer2NextDescAddr;
+	if( d->Status & ETH_DMATxDesc_TER ) return V307( DMATDLAR );
+	return a + 16 + ( ( V307( DMABMR ) & ETH_DMABMR_DSL ) >> 2 ) * 4;
+}
+
+static double v307_ptp_ns( void )
+{
+	uint32_t tscr = V307( PTPTSCR );
+	if( !( tscr & ETH_PTPTSCR_TSE ) ) return v307.ptp_base;
+	double incs = FUNCONF_SYSTEM_CORE_CLOCK / 1e9;    // per ns
+	if( tscr & ETH_PTPTSCR_TSFCU ) incs *= v307.ptp_addend / 4294967296.0;
+	return v307.ptp_base + ( ethsim_now - v307.ptp_t0 ) * incs * ( V307( PTPSSIR ) & ETH_PTPSSIR_STSSI ) * 1e9 / 2147483648.0;
+}
+
+static void v307_ptp_rebase( void )
+{
+	v307.ptp_base = v307_ptp_ns();
+	v307.ptp_t0 = ethsim_now;
+}
+
+static void v307_ptp_split( double ns, uint32_t * sec, uint32_t * sub )
+{
+	*sec = (uint32_t)( ns / 1e9 );
+	*sub = (uint32_t)( ( ns - *sec * 1e9 ) * 2147483648.0 / 1e9 );
+}
+
+// Writes the stamp over the addresses, returns it in ns the way the
+// driver reads it.
+static int64_t v307_ptp_stamp( ETH_DMADESCTypeDef * d )
+{
+	uint32_t sec, sub;
+	v307_ptp_split( v307_ptp_ns(), &sec, &sub );
+	d->Buffer1Addr = sub;
+	d->Buffer2NextDescAddr = sec;
+	return (int64_t)sec * 1000000000 + ( ( (uint64_t)sub * 1000000000 ) >> 31 );
+}
+
+static void v307_pre( uint32_t off )
+{
+	off &= ~3;
+	if( off == offsetof( ETH_TypeDef, PTPTSHR ) || off == offsetof( ETH_TypeDef, PTPTSLR ) )
+	{
+		uint32_t sec, sub;
+		v307_ptp_split( v307_ptp_ns(), &sec, &sub );
+		V307( PTPTSHR ) = sec;
+		V307( PTPTSLR ) = sub;
+	}
+}
+
+// Sets status bits and the summary bit they feed, if enabled.
+static void v307_status( uint32_t bits )
+{
+	uint32_t sr = V307( DMASR ) | bits;
+	uint32_t ier = V307( DMAIER );
+	if( bits & V307_DMASR_NORMAL & ier ) sr |= ETH_DMA_IT_NIS;
+	if( bits & V307_DMASR_ABNORMAL & ier ) sr |= ETH_DMA_IT_AIS;
+	V307( DMASR ) = sr;
+}
+
+static void v307_rcc_pre( uint32_t off )
+{
+	if( off == offsetof( RCC_TypeDef, CTLR ) )
+	{
+		// PLLs and HSE are ready as soon as they're on.
+		uint32_t * ctlr = (uint32_t *)( v307_rcc + off );
+		*ctlr |= ( *ctlr & ( RCC_HSEON | RCC_PLLON | RCC_PLL2ON | RCC_PLL3ON ) ) << 1;
+	}
+}
+
+static void v307_dma_reset( void )
+{
+	V307( DMABMR ) = 0x00002100;
+	V307( DMASR ) = 0;
+	V307( DMAOMR ) = 0;
+	V307( DMAIER ) = 0;
+	V307( DMACHRDR ) = 0;
+	V307( DMACHTDR ) = 0;
+	v307.rx_cur = v307.rx_last = 0;
+	v307.rx_suspended = 0;
+	v307.tx_poll = 0;
+	v307.tx_done = ETHSIM_NEVER;
+}
+
+static void v307_post( uint32_t off, const uint8_t * old )
+{
+	uint32_t was = *(const uint32_t *)( old + ( off & 12 ) );
+	off &= ~3;
+
+	if( off == offsetof( ETH_TypeDef, MACMIIAR ) )
+	{
+		uint32_t v = V307( MACMIIAR );
+		if( v & ETH_MACMIIAR_MB )
+		{
+			int reg = ( v & ETH_MACMIIAR_MR ) >> 6;
+			if( v & ETH_MACMIIAR_MW )
+				ethsim_phy_write( reg, V307( MACMIIDR ) );
+			else
+				V307( MACMIIDR ) = ethsim_phy_read( reg );
+			V307( MACMIIAR ) = v & ~ETH_MACMIIAR_MB;
+		}
+	}
+	else if( off == offsetof( ETH_TypeDef, DMABMR ) )
+	{
+		if( V307( DMABMR ) & ETH_DMABMR_SR ) v307_dma_reset();
+	}
+	else if( off == offsetof( ETH_TypeDef, DMASR ) )
+	{
+		V307( DMASR ) = was & ~( V307( DMASR ) & ( V307_DMASR_NORMAL | V307_DMASR_ABNORMAL | ETH_DMA_IT_NIS | ETH_DMA_IT_AIS ) );
+	}
+	else if( off == offsetof( ETH_TypeDef, DMAIER ) )
+	{
+		// Unmasking something that's already pending raises the summary.
+		v307_status( V307( DMASR ) & ( V307_DMASR_NORMAL | V307_DMASR_ABNORMAL ) );
+	}
+	else if( off == offsetof( ETH_TypeDef, DMARDLAR ) )
+	{
+		v307.rx_cur = V307( DMARDLAR );
+		V307( DMACHRDR ) = v307.rx_cur;
+	}
+	else if( off == offsetof( ETH_TypeDef, DMATDLAR ) )
+	{
+		V307( DMACHTDR ) = V307( DMATDLAR );
+	}
+	else if( off == offsetof( ETH_TypeDef, DMARPDR ) )
+	{
+		v307.rx_suspended = 0;
+	}
+	else if( off == offsetof( ETH_TypeDef, DMATPDR ) )
+	{
+		v307.tx_poll = 1;
+	}
+	else if( off == offsetof( ETH_TypeDef, DMAOMR ) )
+	{
+		uint32_t v = V307( DMAOMR );
+		if( ( v & ETH_DMAOMR_ST ) && !( was & ETH_DMAOMR_ST ) ) v307.tx_poll = 1;
+		if( ( v & ETH_DMAOMR_SR ) && !( was & ETH_DMAOMR_SR ) ) v307.rx_suspended = 0;
+	}
+	else if( off == offsetof( ETH_TypeDef, PTPTSCR ) )
+	{
+		// Everything up to now at the old settings.
+		uint32_t v = V307( PTPTSCR );
+		V307( PTPTSCR ) = was;
+		v307_ptp_rebase();
+		V307( PTPTSCR ) = v & ~( ETH_PTPTSCR_TSSTI | ETH_PTPTSCR_TSSTU | ETH_PTPTSCR_TSARU );
+		double upd = V307( PTPTSHUR ) * 1e9 + ( V307( PTPTSLUR ) & ETH_PTPTSLUR_TSUSS ) * 1e9 / 2147483648.0;
+		if( V307( PTPTSLUR ) & ETH_PTPTSLUR_TSUPNS ) upd = -upd;
+		if( v & ETH_PTPTSCR_TSSTI ) v307.ptp_base = upd;
+		if( v & ETH_PTPTSCR_TSSTU ) v307.ptp_base += upd;
+		if( v & ETH_PTPTSCR_TSARU ) v307.ptp_addend = V307( PTPTSAR );
+	}
+	else if( off == offsetof( ETH_TypeDef, PTPSSIR ) )
+	{
+		uint32_t v = V307( PTPSSIR );
+		V307( PTPSSIR ) = was;
+		v307_ptp_rebase();
+		V307( PTPSSIR ) = v;
+	}
+}
+
+static int v307_tx_mbps( void )
+{
+	int fes = ( V307( MACCR ) >> 14 ) & 3;
+	return fes == 2 ? 1000 : fes == 1 ? 100 : 10;
+}
+
+static uint64_t v307_next( void )
+{
+	if( v307.tx_done != ETHSIM_NEVER ) return v307.tx_done;
+	if( v307.tx_poll && ( V307( DMAOMR ) & ETH_DMAOMR_ST ) ) return ethsim_now;
+	return ETHSIM_NEVER;
+}
+
+static void v307_fire( void )
+{
+	if( v307.tx_done <= ethsim_now )
+	{
+		if( ethsim_phy_link() ) ethsim_wire_tx( v307.txbuf, v307.txlen );
+		v307.tx_frames++;
+
+		V307( DMACHTDR ) = v307_tx_next( v307.tx_last );
+		uint32_t a = v307.tx_first;
+		for( ;; )
+		{
+			ETH_DMADESCTypeDef * d = v307_desc( a );
+			d->Status &= ~ETH_DMATxDesc_OWN;
+			if( a == v307.tx_last ) break;
+			a = v307_tx_next( a );
+		}
+		ETH_DMADESCTypeDef * last = v307_desc( v307.tx_last );
+		if( ( last->Status & ETH_DMATxDesc_TTSE ) && ( V307( PTPTSCR ) & ETH_PTPTSCR_TSE ) )
+		{
+			v307.tx_stamp[V307_STAMP_SLOT( v307.tx_last )] = v307_ptp_stamp( last );
+			last->Status |= ETH_DMATxDesc_TTSS;
+		}
+		if( last->Status & ETH_DMATxDesc_IC )
+			v307_status( ETH_DMA_IT_T );
+		v307.tx_done = ETHSIM_NEVER;
+		return;
+	}
+
+	// Fetch the next frame.
+	uint32_t a = V307( DMACHTDR );
+	ETH_DMADESCTypeDef * d = v307_desc( a );
+	if( !( d->Status & ETH_DMATxDesc_OWN ) )
+	{
+		v307_status( ETH_DMA_IT_TBU );
+		v307.tx_poll = 0;
+		return;
+	}
+
+	v307.txlen = 0;
+	v307.tx_first = a;
+	for( ;; )
+	{
+		int n = d->ControlBufferSize & ETH_DMATxDesc_TBS1;
+		if( v307.txlen + n > (int)sizeof( v307.txbuf ) ) n = sizeof( v307.txbuf ) - v307.txlen;
+		memcpy( v307.txbuf + v307.txlen, (void *)(uintptr_t)d->Buffer1Addr, n );
+		v307.txlen += n;
+		if( d->Status & ETH_DMATxDesc_LS ) break;
+		uint32_t next = v307_tx_next( a );
+		if( !( v307_desc( next )->Status & ETH_DMATxDesc_OWN ) ) break;
+		a = next;
+		d = v307_desc( a );
+	}
+	v307.tx_last = a;
+	v307.tx_done = ethsim_now + ethsim_wire_ns( v307.txlen, v307_tx_mbps() );
+}
+
+static int v307_irq( void )
+{
+	return ( V307( DMASR ) & V307( DMAIER ) & ( ETH_DMA_IT_NIS | ETH_DMA_IT_AIS ) ) != 0;
+}
+
+static void v307_no_desc( void )
+{
+	v307.rx_no_desc++;
+	V307( DMAMFBOCR ) = ( V307( DMAMFBOCR ) + 1 ) & 0xffff;
+	if( v307.rx_suspended ) return;
+	v307.rx_suspended = 1;
+	V307( DMACHRDR ) = v307.errata ? v307.rx_last : v307.rx_cur;
+	v307_status( ETH_DMA_IT_RBU );
+}
+
+static void ethsim_mac_rx( const uint8_t * f, int len, int bad_crc )
+{
+	static uint8_t frame[2048];
+
+	if( !ethsim_phy_link() )
+	{
+		v307.rx_link_down++;
+		return;
+	}
+	if( !( V307( DMAOMR ) & ETH_DMAOMR_SR ) || !( V307( MACCR ) & ETH_MACCR_RE ) )
+	{
+		v307.rx_stopped++;
+		return;
+	}
+	if( bad_crc && !( V307( DMAOMR ) & ETH_DMAOMR_FEF ) )
+	{
+		v307.rx_crc_dropped++;
+		return;
+	}
+	if( v307.rx_suspended && v307.errata )
+	{
+		v307_no_desc();
+		return;
+	}
+
+	uint32_t a = v307.rx_cur;
+	if( !( v307_desc( a )->Status & ETH_DMARxDesc_OWN ) )
+	{
+		v307_no_desc();
+		return;
+	}
+	v307.rx_suspended = 0;
+
+	// FCS goes into the buffer too.
+	int total = len + 4;
+	uint32_t fcs = ethsim_crc32( f, len );
+	if( bad_crc ) fcs = ~fcs;
+	memcpy( frame, f, len );
+	memcpy( frame + len, &fcs, 4 );
+
+	int pos = 0;
+	uint32_t first = ETH_DMARxDesc_FS;
+	for( ;; )
+	{
+		ETH_DMADESCTypeDef * d = v307_desc( a );
+		int n = d->ControlBufferSize & ETH_DMARxDesc_RBS1;
+		if( n > total - pos ) n = total - pos;
+		memcpy( (void *)(uintptr_t)d->Buffer1Addr, frame + pos, n );
+		pos += n;
+
+		uint32_t next = v307_rx_next( a );
+		v307.rx_last = a;
+		if( pos == total )
+		{
+			uint32_t st = first | ETH_DMARxDesc_LS | ( (uint32_t)total << ETH_DMARXDESC_FRAME_LENGTHSHIFT );
+			if( bad_crc ) st |= ETH_DMARxDesc_ES | ETH_DMARxDesc_CE;
+			if( V307( PTPTSCR ) & ETH_PTPTSCR_TSE )
+				v307.rx_stamp[V307_STAMP_SLOT( a )] = v307_ptp_stamp( d );
+			d->Status = st;
+			a = next;
+			break;
+		}
+		if( !( v307_desc( next )->Status & ETH_DMARxDesc_OWN ) )
+		{
+			// Ran out of descriptors mid frame, what made it in is flagged.
+			d->Status = first | ETH_DMARxDesc_LS | ETH_DMARxDesc_ES | ETH_DMARxDesc_DE |
+				( (uint32_t)pos << ETH_DMARXDESC_FRAME_LENGTHSHIFT );
+			a = next;
+			break;
+		}
+		d->Status = first;
+		first = 0;
+		a = next;
+	}
+
+	v307.rx_cur = a;
+	V307( DMACHRDR ) = a;
+	v307.rx_frames++;
+	v307_status( ETH_DMA_IT_R );
+}
+
+// 1ffff704 CHIPID and the MAC at 1ffff7e8, a CH32V307WCU6 (has the RBU
+// errata) and a CH32V307VCT6 (doesn't).
+static const uint8_t v307_rom_chipid[2][4] = { { 0x28, 0x05, 0x70, 0x30 }, { 0x18, 0x05, 0x73, 0x30 } };
+static const uint8_t v307_rom_mac[6] = { 0xdb, 0x4a, 0xaa, 0x7b, 0x54, 0x50 };
+
+// variant 1 = a part with the RBU errata
+static void ethsim_mac_init( int variant )
+{
+	v307.errata = variant;
+
+	uint8_t * rom = ethsim_map( 0x1ffff000, 0x1000, 0, 0 );
+	memcpy( rom + ( INFO_BASE & 0xfff ), v307_rom_chipid[!!variant], 4 );
+	memcpy( rom + ( ROM_CFG_USERADR_ID & 0xfff ), v307_rom_mac, 6 );
+
+	ethsim_map( AFIO_BASE, 0x2000, 0, 0 ); // AFIO, GPIOA..E
+	ethsim_map( EXTEN_BASE & ~0xfff, 0x1000, 0, 0 );
+	v307_rcc = ethsim_map( RCC_BASE, 0x1000, v307_rcc_pre, 0 );
+	v307_regs = ethsim_map( ETH_BASE, 0x2000, v307_pre, v307_post );
+	v307_dma_reset();
+
+	ethsim_mac_next = v307_next;
+	ethsim_mac_fire = v307_fire;
+	ethsim_mac_irq = v307_irq;
+}
+
+static void ethsim_mac_report( void )
+{
+	printf( "mac: rx %u, no descriptor %u, rx stopped %u, link down %u, bad crc dropped %u, tx %u\n",
+		v307.rx_frames, v307.rx_no_desc, v307.rx_stopped, v307.rx_link_down, v307.rx_crc_dropped, v307.tx_frames );
+}
+
+#endif
@@ -0,0 +1,7 @@
+#ifndef _FUNCONFIG_H
+#define _FUNCONFIG_H
+
+// Only used for the Delay_Us() / Delay_Ms() to virtual time conversion.
+#define FUNCONF_SYSTEM_CORE_CLOCK 144000000
+
+#endif
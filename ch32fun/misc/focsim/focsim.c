@@ -0,0 +1,349 @@
+/* Checks the Q15 kernels of examples/bldc_gimbal/foc_q15.h on the host
+	against double precision, one by one and as the FOC interrupt of
+	bldc_gimbal.c puts them together, in voltage and current mode. Then the
+	time each takes on this host, in cycles. See README.md.
+*/
+
+#include <getopt.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <x86intrin.h>
+
+#include "foc_q15.h"
+
+// As in bldc_gimbal.c with BLDC_FOC.
+#define PWM_PERIOD_PO2 10
+#define FOC_VQ 12000
+#define FOC_IQ_TARGET 8000
+static const foc_pi pi_init = { 4000, 4, 18000, 0 };
+
+static int failures;
+
+static void fail( const char * what, double got, double want, double a, double b )
+{
+	if( failures++ < 10 ) printf( "FAIL %s: got %.3f, want %.3f (%.0f, %.0f)\n", what, got, want, a, b );
+}
+
+static uint64_t rng_state;
+
+static uint32_t rnd( void )
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state >> 32;
+}
+
+static int32_t srnd( int32_t lim ) // -lim..lim
+{
+	return (int32_t)( rnd() % ( 2 * (uint32_t)lim + 1 ) ) - lim;
+}
+
+// Worst error of each kernel, for the table.
+static double worst[20];
+static const char * names[20];
+
+static void err( int k, const char * name, double got, double want, double lim, double a, double b )
+{
+	double e = fabs( got - want );
+	names[k] = name;
+	if( e > worst[k] ) worst[k] = e;
+	if( e > lim ) fail( name, got, want, a, b );
+}
+
+#define TWO_PI ( 2 * M_PI )
+
+// The table itself, and every one of the 65536 angles.
+static void check_sin( void )
+{
+	for( int i = 0; i <= 256; i++ )
+	{
+		double want = round( sin( i * TWO_PI / 1024 ) * 32767 );
+		if( foc_sin_quarter[i] != want ) fail( "foc_sin_quarter[]", foc_sin_quarter[i], want, i, 0 );
+	}
+	for( uint32_t a = 0; a < 65536; a++ )
+	{
+		// 1024 steps a turn: 32/65536 of a turn of angle at most, 100.5 LSB.
+		err( 0, "foc_sin", foc_sin( a ), sin( a * TWO_PI / 65536 ) * 32767, 101.5, a, 0 );
+		err( 1, "foc_cos", foc_cos( a ), cos( a * TWO_PI / 65536 ) * 32767, 101.5, a, 0 );
+		// And what the table has, to the LSB, at the nearest of the 1024.
+		double q = ( ( a + 32 ) >> 6 ) * TWO_PI / 1024;
+		err( 2, "foc_sin, at the table's angle", foc_sin( a ), sin( q ) * 32767, 0.5 + 1e-9, a, 0 );
+		// Angles are uint32 in the interrupt, the top bits don't matter.
+		if( foc_sin( a + 0x10000u * ( rnd() & 0xffff ) ) != foc_sin( a ) ) fail( "foc_sin above 16 bits", foc_sin( a + 0x10000 ), foc_sin( a ), a, 0 );
+	}
+}
+
+// a * b >> 15 to within an LSB for everything the interrupt can give it,
+// and exactly what the truncating product is.
+static void check_mul( int n )
+{
+	static const int32_t edges[] = { 0, 1, -1, 32767, -32767, -32768, 65535, -65535 };
+	for( int i = 0; i < n; i++ )
+	{
+		int32_t a = i < 64 ? edges[i % 8] : srnd( 65535 );
+		int32_t b = i < 64 ? edges[i / 8] : i % 64 ? srnd( 32767 ) : -32768;
+		if( b == 65535 || b == -65535 ) b = b > 0 ? 32767 : -32767;
+		double want = (double)a * b / 32768;
+		int32_t got = foc_mul( a, b );
+		err( 3, "foc_mul", got, want, 1.0, a, b );
+		int64_t r = ( (int64_t)a * ( b < 0 ? -b : b ) ) >> 15; // floor of a*|b|, then the sign of b
+		if( got != ( b < 0 ? -r : r ) ) fail( "foc_mul against a*|b| >> 15", got, b < 0 ? -r : r, a, b );
+	}
+}
+
+// The constants by shifts, over the range the interrupt gives them.
+static void check_const( void )
+{
+	for( int32_t x = -98304; x <= 98304; x++ )
+	{
+		// An LSB for each shift that drops bits, and what the sum of the
+		// shifts is off by: 0.577332 and 0.866028.
+		err( 4, "foc_inv_sqrt3", foc_inv_sqrt3( x ), x / sqrt( 3 ), 8 + fabs( x ) * 2e-5, x, 0 );
+		if( x >= -65536 && x <= 65536 ) err( 5, "foc_sqrt3_2", foc_sqrt3_2( x ), x * sqrt( 3 ) / 2, 5 + fabs( x ) * 3e-6, x, 0 );
+	}
+}
+
+static void check_transforms( int n )
+{
+	for( int i = 0; i < n; i++ )
+	{
+		// Clarke from two phases of a balanced set, the third is -ia-ib.
+		int32_t ia = srnd( 32767 ), ib = srnd( 32767 );
+		if( abs( ia + ib ) > 32767 ) ib = -ib;
+		int32_t al, be;
+		foc_clarke( ia, ib, &al, &be );
+		err( 6, "foc_clarke alpha", al, ia, 0, ia, ib );
+		err( 7, "foc_clarke beta", be, ( ia + 2.0 * ib ) / sqrt( 3 ), 8 + fabs( ia + 2.0 * ib ) * 2e-5, ia, ib );
+
+		// Park and back, with the interrupt's sin and cos, against the
+		// exact angle.
+		uint32_t ang = rnd() & 0xffff;
+		int32_t s = foc_sin( ang ), c = foc_cos( ang );
+		double th = ang * TWO_PI / 65536, fs = sin( th ), fc = cos( th );
+		int32_t alpha = srnd( 32767 ), beta = srnd( 32767 ), d, q, a2, b2;
+		double mag = hypot( alpha, beta );
+		foc_park( alpha, beta, s, c, &d, &q );
+		// The table's angle is off by up to 0.3%, of the vector's length.
+		double lim = 2 + mag * 0.0031;
+		err( 8, "foc_park d", d, alpha * fc + beta * fs, lim, alpha, beta );
+		err( 9, "foc_park q", q, beta * fc - alpha * fs, lim, alpha, beta );
+		// Against the table's own angle it's only the products.
+		double fs2 = s / 32768.0, fc2 = c / 32768.0;
+		err( 10, "foc_park, table angle", d, alpha * fc2 + beta * fs2, 2, alpha, beta );
+
+		foc_inv_park( d, q, s, c, &a2, &b2 );
+		err( 11, "foc_park then foc_inv_park", a2, alpha, 4 + mag * 0.0001, alpha, beta );
+		err( 11, "foc_park then foc_inv_park", b2, beta, 4 + mag * 0.0001, alpha, beta );
+	}
+}
+
+// SVPWM by min/max injection, in double.
+static void ref_svpwm( double alpha, double beta, int top_po2, double * duty )
+{
+	double v[3] = { alpha, -alpha / 2 + beta * sqrt( 3 ) / 2, -alpha / 2 - beta * sqrt( 3 ) / 2 };
+	double mx = fmax( v[0], fmax( v[1], v[2] ) ), mn = fmin( v[0], fmin( v[1], v[2] ) );
+	double top = 1 << top_po2;
+	for( int i = 0; i < 3; i++ )
+		duty[i] = fmin( top, fmax( 0, top / 2 + ( v[i] - ( mx + mn ) / 2 ) * top / 32768 ) );
+}
+
+/* Errors in Q15 LSB at any top, and in counts at the interrupt's. Up to 5
+	LSB from foc_sqrt3_2(), up to 2 from the halvings, and the last shift
+	drops up to a count. Line to line has foc_sqrt3_2() twice. */
+static void check_svpwm( int n )
+{
+	for( int i = 0; i < n; i++ )
+	{
+		int po2 = i % 2 ? PWM_PERIOD_PO2 : 5 + rnd() % 11;
+		// Mostly in the linear range, a phase amplitude of 1/sqrt(3), some over.
+		double r = ( i % 8 ? 18918 : 40000 ) * sqrt( ( rnd() % 65536 ) / 65536.0 ), th = ( rnd() % 65536 ) * TWO_PI / 65536;
+		int32_t alpha = (int32_t)( r * cos( th ) ), beta = (int32_t)( r * sin( th ) ), duty[3];
+		double want[3], top = 1 << po2, lsb = 32768 / top;
+		foc_svpwm( alpha, beta, po2, duty );
+		ref_svpwm( alpha, beta, po2, want );
+		for( int k = 0; k < 3; k++ )
+		{
+			if( duty[k] < 0 || duty[k] > top ) fail( "foc_svpwm duty out of 0..top", duty[k], top, alpha, beta );
+			if( fabs( duty[k] - want[k] ) * lsb > 8 + lsb ) fail( "foc_svpwm duty, LSB", duty[k] * lsb, want[k] * lsb, alpha, beta );
+			if( po2 == PWM_PERIOD_PO2 ) err( 13, "foc_svpwm duty, counts", duty[k], want[k], 1 + 8 / lsb, alpha, beta );
+		}
+		if( r <= 18918 && po2 == PWM_PERIOD_PO2 )
+			for( int k = 0; k < 3; k++ )
+			{
+				// What the motor sees is line to line.
+				int j = ( k + 1 ) % 3;
+				err( 14, "foc_svpwm line to line, counts", duty[k] - duty[j], want[k] - want[j], 1 + 16 / lsb, alpha, beta );
+			}
+	}
+}
+
+// The PI one step at a time against the same in double from the same
+// state, and its clamps over a long run.
+static void check_pi( int n )
+{
+	foc_pi pi = pi_init;
+	for( int i = 0; i < n; i++ )
+	{
+		if( rnd() % 64 == 0 ) pi.integ = srnd( pi.limit );
+		int32_t e = rnd() % 8 ? srnd( 4000 ) : srnd( 60000 );
+		double fe = fmax( -32767, fmin( 32767, e ) );
+		double fi = fmax( -pi.limit, fmin( pi.limit, pi.integ + fe / ( 1 << pi.ki_shift ) ) );
+		double want = fmax( -pi.limit, fmin( pi.limit, fe * pi.kp / 32768 + fi ) );
+		int32_t got = foc_pi_step( &pi, e );
+		err( 15, "foc_pi_step", got, want, 2, e, pi.integ );
+		if( pi.integ > pi.limit || pi.integ < -pi.limit ) fail( "foc_pi integrator past the limit", pi.integ, pi.limit, e, 0 );
+	}
+}
+
+/* The interrupt of bldc_gimbal.c from foc_sin() on, in Q15 and in double
+	from the same ADC readings, offsets and PI state. ra and rb are 10 bit. */
+typedef struct
+{
+	foc_pi d, q;
+	int32_t ofs_a, ofs_b;
+} FocState;
+
+static void isr_q15( FocState * st, int current, uint32_t theta, int32_t ra, int32_t rb, int32_t * duty )
+{
+	int32_t s = foc_sin( theta ), c = foc_cos( theta ), vd, vq;
+	if( current )
+	{
+		int32_t alpha, beta, id, iq;
+		foc_clarke( ( ra - st->ofs_a ) << 6, ( rb - st->ofs_b ) << 6, &alpha, &beta );
+		foc_park( alpha, beta, s, c, &id, &iq );
+		vd = foc_pi_step( &st->d, -id );
+		vq = foc_pi_step( &st->q, FOC_IQ_TARGET - iq );
+	}
+	else
+	{
+		vd = 0;
+		vq = FOC_VQ;
+	}
+	int32_t alpha, beta;
+	foc_inv_park( vd, vq, s, c, &alpha, &beta );
+	foc_svpwm( alpha, beta, PWM_PERIOD_PO2, duty );
+}
+
+static double ref_pi( const foc_pi * pi, double e )
+{
+	e = fmax( -32767, fmin( 32767, e ) );
+	double i = fmax( -pi->limit, fmin( pi->limit, pi->integ + e / ( 1 << pi->ki_shift ) ) );
+	return fmax( -pi->limit, fmin( pi->limit, e * pi->kp / 32768 + i ) );
+}
+
+static void isr_ref( const FocState * st, int current, uint32_t theta, int32_t ra, int32_t rb, double * duty )
+{
+	double th = theta * TWO_PI / 65536, s = sin( th ), c = cos( th ), vd, vq;
+	if( current )
+	{
+		double ia = ( ra - st->ofs_a ) * 64.0, ib = ( rb - st->ofs_b ) * 64.0;
+		double alpha = ia, beta = ( ia + 2 * ib ) / sqrt( 3 );
+		double id = alpha * c + beta * s, iq = beta * c - alpha * s;
+		vd = ref_pi( &st->d, -id );
+		vq = ref_pi( &st->q, FOC_IQ_TARGET - iq );
+	}
+	else
+	{
+		vd = 0;
+		vq = FOC_VQ;
+	}
+	ref_svpwm( vd * c - vq * s, vd * s + vq * c, PWM_PERIOD_PO2, duty );
+}
+
+static void check_isr( int n )
+{
+	for( int current = 0; current < 2; current++ )
+		for( int i = 0; i < n; i++ )
+		{
+			FocState st = { pi_init, pi_init, 500 + srnd( 24 ), 500 + srnd( 24 ) };
+			st.d.integ = srnd( st.d.limit / 2 );
+			st.q.integ = srnd( st.q.limit / 2 );
+			// Currents of a balanced set up to a quarter of full scale, and
+			// sometimes out to the rails.
+			int32_t amp = rnd() % 8 ? 128 : 512;
+			uint32_t theta = current ? rnd() & 0xffff : (uint32_t)i * 65536 / n;
+			int32_t ra = st.ofs_a + srnd( amp ), rb = st.ofs_b + srnd( amp );
+			if( abs( ra - st.ofs_a + rb - st.ofs_b ) > amp ) rb = st.ofs_b - ( rb - st.ofs_b );
+			if( ra < 0 ) ra = 0;
+			if( ra > 1023 ) ra = 1023;
+			if( rb < 0 ) rb = 0;
+			if( rb > 1023 ) rb = 1023;
+			int32_t duty[3];
+			double want[3];
+			isr_ref( &st, current, theta, ra, rb, want );
+			isr_q15( &st, current, theta, ra, rb, duty );
+			// The angle's 0.3% is most of it: 37 LSB on a vector of 12000,
+			// twice that on a phase once the middle is taken off, 2.3 counts,
+			// and a count from the last shift.
+			for( int k = 0; k < 3; k++ )
+				err( 16 + current, current ? "interrupt, current mode, counts" : "interrupt, voltage mode, counts", duty[k], want[k],
+					current ? 5 : 4, ra, rb );
+		}
+}
+
+// Cycles on this host, the mean over many calls with varying inputs.
+static volatile int32_t sink;
+
+#define BENCH( name, setup, call ) do { \
+	int32_t va[256], vb[256]; \
+	for( int k = 0; k < 256; k++ ) { va[k] = srnd( 18000 ); vb[k] = srnd( 18000 ); } \
+	setup; \
+	uint64_t t0 = __rdtsc(); \
+	for( int k = 0; k < n; k++ ) { int32_t a = va[k & 255], b = vb[k & 255]; (void)a; (void)b; call; } \
+	printf( "%-28s %8.1f\n", name, (double)( __rdtsc() - t0 ) / n ); \
+} while( 0 )
+
+static void bench( int n )
+{
+	int32_t x, y, d[3];
+	FocState st = { pi_init, pi_init, 512, 512 };
+	printf( "host cycles a call (TSC)\n" );
+	BENCH( "foc_sin + foc_cos", , sink = foc_sin( a ) + foc_cos( b ) );
+	BENCH( "foc_mul", , sink = foc_mul( a, b ) );
+	BENCH( "a * b >> 15", , sink = ( a * b ) >> 15 );
+	BENCH( "foc_clarke", , ( foc_clarke( a, b, &x, &y ), sink = x + y ) );
+	BENCH( "foc_park", , ( foc_park( a, b, 23170, 23170, &x, &y ), sink = x + y ) );
+	BENCH( "foc_inv_park", , ( foc_inv_park( a, b, 23170, 23170, &x, &y ), sink = x + y ) );
+	BENCH( "foc_svpwm", , ( foc_svpwm( a, b, PWM_PERIOD_PO2, d ), sink = d[0] + d[1] + d[2] ) );
+	BENCH( "foc_pi_step", , sink = foc_pi_step( &st.q, a ) );
+	BENCH( "interrupt, voltage mode", , ( isr_q15( &st, 0, a, 0, 0, d ), sink = d[0] ) );
+	BENCH( "interrupt, current mode", , ( isr_q15( &st, 1, a, 512 + ( a >> 7 ), 512 + ( b >> 7 ), d ), sink = d[0] ) );
+}
+
+int main( int argc, char ** argv )
+{
+	int n = 200000, do_bench = 0, c;
+	uint32_t seed = 1;
+	while( ( c = getopt( argc, argv, "n:r:b" ) ) != -1 )
+	{
+		switch( c )
+		{
+		case 'n': n = atoi( optarg ); break;
+		case 'r': seed = strtoul( optarg, 0, 0 ); break;
+		case 'b': do_bench = 1; break;
+		default:
+			fprintf( stderr, "usage: %s [-n iterations] [-r seed] [-b]\n", argv[0] );
+			return 1;
+		}
+	}
+	rng_state = seed * 0x9e3779b97f4a7c15ull + 1;
+
+	check_sin();
+	check_mul( n );
+	check_const();
+	check_transforms( n );
+	check_svpwm( n );
+	check_pi( n );
+	check_isr( n / 4 );
+
+	printf( "worst error, LSB of Q15 or counts of %d\n", 1 << PWM_PERIOD_PO2 );
+	for( int k = 0; k < 20; k++ )
+		if( names[k] ) printf( "%-34s %8.2f\n", names[k], worst[k] );
+	if( do_bench ) bench( 20000000 );
+
+	printf( failures ? "FAILED\n" : "ok\n" );
+	return failures ? 2 : 0;
+}
@@ -0,0 +1,186 @@
+/* Runs lib_ipc.h with two host threads as the two cores, to check the rings,
+	the jobs and the locks under load. See README.md.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <getopt.h>
+#include <sched.h>
+
+static __thread int sim_core;
+
+#define IPC_CORE() sim_core
+#define IPC_FENCE() __atomic_thread_fence( __ATOMIC_SEQ_CST )
+#define IPC_IDLE() ( IPCPoll(), sched_yield() )
+#define IPC_SPIN() sched_yield()
+
+#include "lib_ipc.h"
+
+static int count = 100000;
+static volatile int go;
+static int failures;
+
+static uint64_t now_ns( void )
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void fail( const char * what, long a, long b )
+{
+	printf( "FAIL core %d: %s (%ld, %ld)\n", sim_core, what, a, b );
+	__atomic_add_fetch( &failures, 1, __ATOMIC_SEQ_CST );
+}
+
+// Both directions at once, in order and complete.
+static void messages( void )
+{
+	uint32_t sent = 0, got = 0;
+	while( sent < (uint32_t)count || got < (uint32_t)count )
+	{
+		ipc_msg_t m;
+		if( sent < (uint32_t)count )
+		{
+			m.type = sim_core;
+			m.arg[0] = sent;
+			m.arg[1] = ~sent;
+			m.arg[2] = sent * 2654435761u;
+			if( IPCSend( &m ) == 0 ) sent++;
+			else sched_yield();
+		}
+		if( IPCRecv( &m ) == 0 )
+		{
+			if( m.type != (uintptr_t)( sim_core ^ 1 ) || m.arg[0] != got ||
+				m.arg[1] != (uintptr_t)(uint32_t)~got || m.arg[2] != (uintptr_t)(uint32_t)( got * 2654435761u ) )
+			{
+				fail( "message out of order or torn", got, m.arg[0] );
+				return;
+			}
+			got++;
+		}
+		else if( sent == (uint32_t)count ) sched_yield();
+	}
+}
+
+// A shared counter that isn't atomic, under the lock.
+static ipc_lock_t lock;
+static volatile long counter;
+
+static void locks( void )
+{
+	for( int i = 0; i < count; i++ )
+	{
+		IPCLock( &lock );
+		long c = counter;
+		for( volatile int k = 0; k < 20; k++ );  // widen the window
+		counter = c + 1;
+		IPCUnlock( &lock );
+	}
+}
+
+// Jobs both ways: each writes its slot, the submitter checks it after
+// IPCWait() and the return value.
+#define JOBS 64
+static volatile uint32_t job_out[2][JOBS];
+typedef struct { int core; int i; uint32_t v; } job_arg_t;
+static job_arg_t job_args[2][JOBS];
+
+static int job( void * arg )
+{
+	job_arg_t * a = arg;
+	job_out[a->core][a->i] = a->v * 3 + 1;
+	return (int)a->v;
+}
+
+static void jobs( void )
+{
+	for( int n = 0; n < count / 16; n++ )
+	{
+		int i = n % JOBS;
+		job_arg_t * a = &job_args[sim_core][i];
+		a->core = sim_core;
+		a->i = i;
+		a->v = n * 7 + sim_core;
+		uint32_t t = IPCSubmit( job, a );
+		if( ( n & 3 ) == 3 || i == JOBS - 1 )
+		{
+			int r = IPCWait( t );
+			if( r != (int)a->v ) fail( "job result", r, a->v );
+			if( job_out[sim_core][i] != a->v * 3 + 1 ) fail( "job output", job_out[sim_core][i], a->v * 3 + 1 );
+		}
+		IPCPoll();
+	}
+	// Keep running the other core's jobs until it's done too.
+	__atomic_add_fetch( &go, 1, __ATOMIC_SEQ_CST );
+	while( __atomic_load_n( &go, __ATOMIC_SEQ_CST ) < 4 ) IPC_IDLE();
+}
+
+// Ping-pong through the message rings.
+static double roundtrip_ns;
+
+static void pingpong( void )
+{
+	int n = count / 10;
+	ipc_msg_t m = { 0 };
+	uint64_t t0 = now_ns();
+	for( int i = 0; i < n; i++ )
+	{
+		if( sim_core == 0 )
+		{
+			m.arg[0] = i;
+			while( IPCSend( &m ) ) sched_yield();
+			while( IPCRecv( &m ) ) sched_yield();
+			if( m.arg[0] != (uintptr_t)i + 1 ) { fail( "pong", m.arg[0], i + 1 ); return; }
+		}
+		else
+		{
+			while( IPCRecv( &m ) ) sched_yield();
+			m.arg[0]++;
+			while( IPCSend( &m ) ) sched_yield();
+		}
+	}
+	if( sim_core == 0 ) roundtrip_ns = (double)( now_ns() - t0 ) / n;
+}
+
+static pthread_barrier_t barrier;
+
+static void * core( void * arg )
+{
+	sim_core = (int)(intptr_t)arg;
+	messages();
+	pthread_barrier_wait( &barrier );
+	locks();
+	pthread_barrier_wait( &barrier );
+	jobs();
+	pthread_barrier_wait( &barrier );
+	pingpong();
+	return 0;
+}
+
+int main( int argc, char ** argv )
+{
+	int c;
+	while( ( c = getopt( argc, argv, "n:" ) ) != -1 )
+	{
+		if( c == 'n' ) count = atoi( optarg );
+		else { fprintf( stderr, "usage: ipcsim [-n count]\n" ); return 1; }
+	}
+
+	IPCInit();
+	go = 2;
+	pthread_barrier_init( &barrier, 0, 2 );
+	pthread_t t[2];
+	for( int i = 0; i < 2; i++ ) pthread_create( &t[i], 0, core, (void *)(intptr_t)i );
+	for( int i = 0; i < 2; i++ ) pthread_join( t[i], 0 );
+
+	if( counter != 2L * count ) fail( "lock lost increments", counter, 2L * count );
+	printf( "%d messages each way, %ld locked increments, %d jobs each way\n", count, counter, count / 16 );
+	printf( "host round trip %.0f ns\n", roundtrip_ns );
+	printf( failures ? "FAILED\n" : "ok\n" );
+	return failures ? 2 : 0;
+}
@@ -0,0 +1,325 @@
+/* Runs lib_kvstore.h against a NOR flash model with power cuts, checks
+	nothing acknowledged gets lost and reports throughput and wear. See
+	README.md.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <setjmp.h>
+#include <getopt.h>
+
+#ifndef KV_SECTOR_SIZE
+#define KV_SECTOR_SIZE 1024
+#endif
+#ifndef KV_SECTORS
+#define KV_SECTORS 4
+#endif
+#ifndef KV_FLASH_PAGE
+#define KV_FLASH_PAGE 256
+#endif
+
+#define KV_FLASH_BASE 0x08010000
+#define KV_FLASH_READ( addr, buf, len ) memcpy( ( buf ), nor + ( ( addr ) - KV_FLASH_BASE ), ( len ) )
+#define KV_FLASH_WRITE( addr, data, len ) nor_write( ( addr ) - KV_FLASH_BASE, ( data ), ( len ) )
+#define KV_FLASH_ERASE( addr ) nor_erase( ( addr ) - KV_FLASH_BASE )
+
+#ifndef KV_ERASED
+#define KV_ERASED 0xffffffff   // 0xe339e339 to model a ch32v20x / v30x
+#endif
+
+#define NOR_SIZE ( KV_SECTORS * KV_SECTOR_SIZE )
+
+static uint8_t nor[NOR_SIZE];
+static uint32_t nor_page_erases[NOR_SIZE / KV_FLASH_PAGE];
+
+static struct
+{
+	int ops;
+	int keys;
+	int maxlen;
+	int del_pct;
+	int cut_every;         // flash operations between power cuts, on average
+	int maintain;          // KVMaintain() calls between KVSet()s
+	uint64_t prog_ns;      // per half word
+	uint64_t erase_ns;     // per KV_FLASH_PAGE page
+	uint32_t endurance;
+	unsigned seed;
+	int verbose;
+} opt = {
+	.ops = 100000,
+	.keys = 16,
+	.maxlen = 16,
+	.del_pct = 5,
+	.maintain = 0,
+	.prog_ns = 40000,
+	.erase_ns = 2500000,
+	.endurance = 10000,
+	.seed = 1,
+};
+
+static struct
+{
+	uint64_t now_ns;
+	uint64_t prog;         // half words
+	uint64_t erases;       // pages
+	uint64_t user_bytes;
+	uint32_t overprogram;  // a 0 programmed back to 1, not possible on NOR
+	int countdown;         // flash operations to the next cut, 0 = none
+	jmp_buf cut;
+	uint32_t cuts;
+	uint32_t cut_in_erase;
+	uint32_t cut_in_prog;
+} nor_stats;
+
+// Erased cells read back as KV_ERASED and program to anything.
+static void nor_blank( uint32_t off, int len )
+{
+	uint32_t e = KV_ERASED;
+	for( ; len > 0; off += 4, len -= 4 )
+		memcpy( nor + off, &e, 4 );
+}
+
+static uint64_t rnd_state;
+static uint32_t rnd( void )
+{
+	rnd_state = rnd_state * 6364136223846793005ull + 1442695040888963407ull;
+	return rnd_state >> 33;
+}
+
+// Counts a flash operation, 1 if the power goes now.
+static int nor_tick( void )
+{
+	return nor_stats.countdown && --nor_stats.countdown == 0;
+}
+
+static int nor_write( uint32_t off, const void * data, int len )
+{
+	const uint8_t * d = data;
+	int i;
+	if( off + len > NOR_SIZE || ( off & 1 ) || ( len & 1 ) ) abort();
+	for( i = 0; i < len; i += 2 )
+	{
+		uint16_t old = nor[off + i] | ( nor[off + i + 1] << 8 );
+		uint16_t v = d[i] | ( d[i + 1] << 8 );
+		if( old == ( KV_ERASED & 0xffff ) ) old = 0xffff;
+		if( v & ~old ) nor_stats.overprogram++;
+		if( nor_tick() )
+		{
+			// Some of the bits that were going to be cleared are.
+			v = old & ( v | rnd() );
+			nor[off + i] = v;
+			nor[off + i + 1] = v >> 8;
+			nor_stats.cut_in_prog++;
+			longjmp( nor_stats.cut, 1 );
+		}
+		v &= old;
+		nor[off + i] = v;
+		nor[off + i + 1] = v >> 8;
+		nor_stats.prog++;
+		nor_stats.now_ns += opt.prog_ns;
+		if( v != ( d[i] | ( d[i + 1] << 8 ) ) ) return -1;
+	}
+	return 0;
+}
+
+static int nor_erase( uint32_t off )
+{
+	int p, i;
+	if( off % KV_SECTOR_SIZE ) abort();
+	for( p = 0; p < KV_SECTOR_SIZE; p += KV_FLASH_PAGE )
+	{
+		if( nor_tick() )
+		{
+			// Part way, some bits back to 1.
+			for( i = 0; i < KV_FLASH_PAGE; i++ )
+				nor[off + p + i] |= rnd();
+			nor_stats.cut_in_erase++;
+			longjmp( nor_stats.cut, 1 );
+		}
+		nor_blank( off + p, KV_FLASH_PAGE );
+		nor_page_erases[( off + p ) / KV_FLASH_PAGE]++;
+		nor_stats.erases++;
+		nor_stats.now_ns += opt.erase_ns;
+	}
+	return 0;
+}
+
+#include "lib_kvstore.h"
+
+// What the store has to give back: the last acknowledged value of each key,
+// and while a KVSet() / KVDelete() is going, either that or the new one.
+static struct
+{
+	int len;  // -1 not set
+	uint8_t v[KV_SECTOR_SIZE];
+} shadow[KV_KEYS], pending;
+static int pending_key = -1;
+static uint32_t lost, mismatched;
+
+static int matches( int key, int len, const uint8_t * v )
+{
+	int got;
+	uint8_t buf[KV_SECTOR_SIZE];
+	got = KVGet( key, buf, sizeof( buf ) );
+	return got == len && ( len < 0 || !memcmp( buf, v, len ) );
+}
+
+static void verify( void )
+{
+	int k;
+	for( k = 0; k < opt.keys; k++ )
+	{
+		if( matches( k, shadow[k].len, shadow[k].v ) ) continue;
+		if( k == pending_key && matches( k, pending.len, pending.v ) )
+		{
+			shadow[k] = pending;
+			continue;
+		}
+		if( opt.verbose ) printf( "key %d: expected len %d, got %d\n", k, shadow[k].len, KVGet( k, 0, 0 ) );
+		if( KVGet( k, 0, 0 ) < 0 ) lost++;
+		else mismatched++;
+		// Carry on from what's there.
+		shadow[k].len = KVGet( k, shadow[k].v, sizeof( shadow[k].v ) );
+	}
+	pending_key = -1;
+}
+
+static void schedule_cut( void )
+{
+	nor_stats.countdown = opt.cut_every ? 1 + rnd() % ( 2 * opt.cut_every ) : 0;
+}
+
+static void usage( void )
+{
+	fprintf( stderr,
+		"kvsim [options]\n"
+		"  -n ops        KVSet() / KVDelete() calls (%d)\n"
+		"  -k keys       keys in use, up to %d (%d)\n"
+		"  -s bytes      largest value, sizes are random 1..s (%d)\n"
+		"  -d percent    deletes (%d)\n"
+		"  -m n          KVMaintain() calls between writes (%d)\n"
+		"  -c ops        cut the power every ~ops flash operations, 0 = never (0)\n"
+		"  -p us         half word program time (%.0f)\n"
+		"  -e ms         page erase time (%.1f)\n"
+		"  -E cycles     erase endurance, for the lifetime estimate (%u)\n"
+		"  -r seed       (%u)\n"
+		"  -v            report each loss\n",
+		opt.ops, KV_KEYS, opt.keys, opt.maxlen, opt.del_pct, opt.maintain,
+		opt.prog_ns / 1000.0, opt.erase_ns / 1e6, opt.endurance, opt.seed );
+	exit( 1 );
+}
+
+static uint32_t set_fails, writes;
+static uint64_t max_op_ns, busy_ns;
+
+int main( int argc, char ** argv )
+{
+	int c, i, k, r;
+	uint64_t t0;
+	KVStats st;
+
+	while( ( c = getopt( argc, argv, "n:k:s:d:m:c:p:e:E:r:v" ) ) != -1 )
+	{
+		switch( c )
+		{
+		case 'n': opt.ops = atoi( optarg ); break;
+		case 'k': opt.keys = atoi( optarg ); break;
+		case 's': opt.maxlen = atoi( optarg ); break;
+		case 'd': opt.del_pct = atoi( optarg ); break;
+		case 'm': opt.maintain = atoi( optarg ); break;
+		case 'c': opt.cut_every = atoi( optarg ); break;
+		case 'p': opt.prog_ns = atof( optarg ) * 1000; break;
+		case 'e': opt.erase_ns = atof( optarg ) * 1e6; break;
+		case 'E': opt.endurance = atoi( optarg ); break;
+		case 'r': opt.seed = atoi( optarg ); break;
+		case 'v': opt.verbose = 1; break;
+		default: usage();
+		}
+	}
+	if( opt.keys < 1 || opt.keys > KV_KEYS || opt.maxlen < 1 || opt.maxlen > KV_SECTOR_SIZE - 24 ) usage();
+
+	rnd_state = opt.seed;
+	nor_blank( 0, sizeof( nor ) );
+	for( k = 0; k < KV_KEYS; k++ )
+		shadow[k].len = -1;
+
+	// Back here after every power cut, mount included.
+	if( setjmp( nor_stats.cut ) ) nor_stats.cuts++;
+	schedule_cut();
+	if( KVMount() < 0 ) printf( "mount failed\n" );
+	verify();
+
+	while( opt.ops > 0 )
+	{
+		t0 = nor_stats.now_ns;
+		for( i = 0; i < opt.maintain; i++ )
+			KVMaintain();
+		busy_ns += nor_stats.now_ns - t0;
+
+		t0 = nor_stats.now_ns;
+		k = rnd() % opt.keys;
+		pending_key = k;
+		if( (int)( rnd() % 100 ) < opt.del_pct )
+		{
+			pending.len = -1;
+			r = KVDelete( k );
+		}
+		else
+		{
+			pending.len = 1 + rnd() % opt.maxlen;
+			for( i = 0; i < pending.len; i++ )
+				pending.v[i] = rnd();
+			r = KVSet( k, pending.v, pending.len );
+		}
+		if( r == 0 )
+		{
+			shadow[k] = pending;
+			writes++;
+			if( pending.len > 0 ) nor_stats.user_bytes += pending.len;
+		}
+		else
+		{
+			set_fails++;
+		}
+		pending_key = -1;
+		opt.ops--;
+
+		if( nor_stats.now_ns - t0 > max_op_ns ) max_op_ns = nor_stats.now_ns - t0;
+		busy_ns += nor_stats.now_ns - t0;
+	}
+
+	nor_stats.countdown = 0;
+	KVMount();
+	verify();
+
+	KVGetStats( &st );
+	uint32_t pmin = ~0u, pmax = 0;
+	for( i = 0; i < NOR_SIZE / KV_FLASH_PAGE; i++ )
+	{
+		if( nor_page_erases[i] < pmin ) pmin = nor_page_erases[i];
+		if( nor_page_erases[i] > pmax ) pmax = nor_page_erases[i];
+	}
+	double secs = busy_ns / 1e9;
+	double sector_erases = nor_stats.erases / (double)( KV_SECTOR_SIZE / KV_FLASH_PAGE );
+
+	printf( "store: %d sectors of %d bytes, %d keys, values 1..%d bytes, %d%% deletes\n",
+		KV_SECTORS, KV_SECTOR_SIZE, opt.keys, opt.maxlen, opt.del_pct );
+	printf( "flash: %.0f us per half word, %.1f ms per %d byte page erase\n",
+		opt.prog_ns / 1000.0, opt.erase_ns / 1e6, KV_FLASH_PAGE );
+	printf( "throughput: %.0f writes/s, %.2f kB/s of values, slowest write %.1f ms\n",
+		secs > 0 ? writes / secs : 0, secs > 0 ? nor_stats.user_bytes / secs / 1024 : 0, max_op_ns / 1e6 );
+	printf( "written: %llu value bytes, %llu programmed (x%.2f), %u compaction copies, %u failed writes\n",
+		(unsigned long long)nor_stats.user_bytes, (unsigned long long)nor_stats.prog * 2,
+		nor_stats.user_bytes ? nor_stats.prog * 2.0 / nor_stats.user_bytes : 0, st.copies, set_fails );
+	printf( "wear: page erases min %u max %u, %.0f value bytes per sector erase\n",
+		pmin, pmax, sector_erases ? nor_stats.user_bytes / sector_erases : 0 );
+	if( pmax )
+		printf( "lifetime: %.3g value bytes or %.3g writes before a page reaches %u cycles\n",
+			nor_stats.user_bytes * (double)opt.endurance / pmax, writes * (double)opt.endurance / pmax, opt.endurance );
+	printf( "power cuts: %u (%u programming, %u erasing)\n", nor_stats.cuts, nor_stats.cut_in_prog, nor_stats.cut_in_erase );
+	printf( "integrity: lost %u, wrong value %u, 1 bits programmed over 0 %u\n", lost, mismatched, nor_stats.overprogram );
+
+	return ( lost || mismatched || nor_stats.overprogram ) ? 2 : 0;
+}
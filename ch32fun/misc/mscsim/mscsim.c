@@ -0,0 +1,671 @@
+// mscsim, lib_msc.h on the host, against a model of the USB bus and of the
+// flash behind it. See README.md.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#ifndef MSC_BLOCKS
+#define MSC_BLOCKS 4096
+#endif
+
+#ifdef SIM_INTERNAL
+#define MSC_BD_ERASE_SIZE 256
+#define MSC_BD_CLEAR_BITS 0
+#else
+#define MSC_BD_ERASE_SIZE 4096
+#endif
+#define MSC_BD_PAGE_SIZE 256
+#ifndef MSC_BD_ERASED
+#define MSC_BD_ERASED 0xffffffff   // 0xe339e339 for a ch32v20x / v30x
+#endif
+
+#ifdef SIM_HS
+#define MSC_PACKET 512
+#else
+#define MSC_PACKET 64
+#endif
+
+#define DISK ( MSC_BLOCKS * 512 )
+
+// Time in us. now is the device's main loop, bus the host's side.
+static double now, bus, blocked_until;
+static double cost;     // of the MSCPoll() call running
+static int blocking;    // and it keeps the USB interrupt out
+
+// Bus
+static double t_tok, t_byte, t_nak, t_isr, t_cmd, t_ctrl;
+// Device
+static double t_poll = 1;       // MSCPoll() with nothing to do
+static double t_spi = 0.25;     // per byte over SPI
+#ifndef SIM_INTERNAL
+static double t_spi_cmd = 2;    // per SPI flash command
+#endif
+static double t_prog;           // NOR: page, internal: half word
+static double t_erase;          // one erase unit
+
+static uint8_t flash[DISK];
+static double busy_until;
+static long violations, busy_access, naks;
+
+// Erased words read back as MSC_BD_ERASED.
+static void bd_blank( uint32_t addr, int len )
+{
+	uint32_t e = MSC_BD_ERASED;
+	for( ; len > 0; addr += 4, len -= 4 )
+		memcpy( flash + addr, &e, 4 );
+}
+
+static int bd_read( uint32_t addr, void * buf, int len )
+{
+#ifdef SIM_INTERNAL
+	cost += len * 0.01;
+#else
+	if( now + cost < busy_until ) busy_access++;
+	cost += t_spi_cmd + len * t_spi;
+#endif
+	memcpy( buf, flash + addr, len );
+	return 0;
+}
+
+static int bd_program( uint32_t addr, const uint8_t * d, int len )
+{
+	int i;
+	if( len != MSC_BD_PAGE_SIZE || addr % MSC_BD_PAGE_SIZE ) violations++;
+#ifdef SIM_INTERNAL
+	for( i = 0; i < len; i += 2 )
+	{
+		uint16_t o = flash[addr + i] | flash[addr + i + 1] << 8, v = d[i] | d[i + 1] << 8;
+		if( o == v ) continue;
+		if( o == ( ( i & 2 ? MSC_BD_ERASED >> 16 : MSC_BD_ERASED ) & 0xffff ) ) o = 0xffff;
+		else violations++;
+		o &= v;
+		flash[addr + i] = o;
+		flash[addr + i + 1] = o >> 8;
+		cost += t_prog;
+	}
+	blocking = 1;
+#else
+	if( now + cost < busy_until ) busy_access++;
+	for( i = 0; i < len; i++ )
+	{
+		if( d[i] & ~flash[addr + i] ) violations++;
+		flash[addr + i] &= d[i];
+	}
+	cost += t_spi_cmd + len * t_spi;
+	busy_until = now + cost + t_prog;
+#endif
+	return 0;
+}
+
+static int bd_erase( uint32_t addr )
+{
+	if( addr % MSC_BD_ERASE_SIZE ) violations++;
+	bd_blank( addr, MSC_BD_ERASE_SIZE );
+#ifdef SIM_INTERNAL
+	cost += t_erase;
+	blocking = 1;
+#else
+	if( now + cost < busy_until ) busy_access++;
+	cost += t_spi_cmd;
+	busy_until = now + cost + t_erase;
+#endif
+	return 0;
+}
+
+static int bd_busy( void )
+{
+#ifndef SIM_INTERNAL
+	cost += t_spi_cmd;  // read status register
+#endif
+	return now + cost < busy_until;
+}
+
+#define MSC_BD_READ( addr, buf, len ) bd_read( addr, buf, len )
+#define MSC_BD_PROGRAM( addr, data, len ) bd_program( addr, data, len )
+#define MSC_BD_ERASE( addr ) bd_erase( addr )
+#define MSC_BD_BUSY() bd_busy()
+
+// The endpoints, as fsusb leaves them after each interrupt.
+#define ACK   0
+#define NAK   1
+#define STALL 2
+
+static struct
+{
+	uint8_t buf[512];
+	int len;
+	int res;
+} ep_in = { .res = NAK };
+static int ep_out = ACK;
+
+#define MSC_IN_BUF       ep_in.buf
+#define MSC_IN_READY()   1
+#define MSC_IN_SEND( n ) ( ep_in.len = ( n ), ep_in.res = ACK )
+#define MSC_IN_STALL()   ( ep_in.res = STALL )
+#define MSC_IN_HALTED()  ( ep_in.res == STALL )
+#define MSC_OUT_ACK()    ( ep_out = ACK )
+#define MSC_OUT_NAK()    ( ep_out = NAK )
+#define MSC_OUT_STALL()  ( ep_out = STALL )
+#define MSC_LOCK()
+#define MSC_UNLOCK()
+#define MSC_TICKS()      ( (uint32_t)( now + cost ) )
+#define MSC_FLUSH_TICKS  500000
+
+#include "lib_msc.h"
+
+static void device_until( double t )
+{
+	while( now < t )
+	{
+		cost = t_poll;
+		blocking = 0;
+		MSCPoll();
+		now += cost;
+		if( blocking ) blocked_until = now;
+	}
+}
+
+// The interrupt for a transaction that just finished, it takes the CPU
+// from the main loop and holds up the endpoint.
+static void isr( int len )
+{
+	double t = t_isr + len * 0.005;
+	bus += t;
+	now += t;
+}
+
+static void stuck( void )
+{
+	fprintf( stderr, "stuck at %.0f us: state %d, tx %d, in %d, out %d\n", bus, msc.state, msc.tx, ep_in.res, ep_out );
+	exit( 2 );
+}
+
+// One OUT transaction, retried while it's NAKed. -1 if stalled.
+static int host_out( const uint8_t * d, int len )
+{
+	double start = bus;
+	for( ;; )
+	{
+		device_until( bus );
+		if( bus < blocked_until ) bus = blocked_until;
+		if( ep_out == STALL )
+		{
+			bus += t_nak;
+			return -1;
+		}
+		if( ep_out == ACK )
+		{
+			bus += t_tok + len * t_byte;
+			MSCRx( d, len );
+			isr( len );
+			return 0;
+		}
+		bus += t_nak;
+		naks++;
+		if( bus - start > 10e6 ) stuck();
+	}
+}
+
+// One IN transaction into buf (room for a packet), its length or -1 if
+// stalled.
+static int host_in( uint8_t * buf )
+{
+	double start = bus;
+	int n, k;
+	for( ;; )
+	{
+		device_until( bus );
+		if( bus < blocked_until ) bus = blocked_until;
+		if( ep_in.res == STALL )
+		{
+			bus += t_nak;
+			return -1;
+		}
+		if( ep_in.res == ACK )
+		{
+			n = ep_in.len;
+			memcpy( buf, ep_in.buf, n );
+			bus += t_tok + n * t_byte;
+			ep_in.res = NAK;
+			k = MSCTx( ep_in.buf );
+			if( k )
+			{
+				ep_in.len = k;
+				ep_in.res = ACK;
+			}
+			isr( k );
+			return n;
+		}
+		bus += t_nak;
+		naks++;
+		if( bus - start > 10e6 ) stuck();
+	}
+}
+
+// CLEAR_FEATURE(ENDPOINT_HALT), what fsusb does with it.
+static void clear_halt( int in )
+{
+	bus += t_ctrl;
+	device_until( bus );
+	if( in )
+		ep_in.res = NAK;
+	else
+		ep_out = ACK;
+}
+
+static int recoveries;
+
+static void recover( void )
+{
+	bus += t_ctrl;
+	device_until( bus );
+	MSCReset();
+	clear_halt( 1 );
+	clear_halt( 0 );
+	recoveries++;
+}
+
+static uint32_t le32( const uint8_t * p )
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint32_t tag;
+static uint32_t got, residue;
+
+// One command with len bytes in or out, as the host announces it. Returns
+// the CSW status, -1 if the CSW was bad. data has room for a packet more.
+static int bot_raw( const uint8_t * cdb, int cdblen, int in, uint8_t * data, uint32_t len, int cbwlen )
+{
+	uint8_t cbw[31] = { 'U', 'S', 'B', 'C' }, csw[512];
+	int n;
+
+	got = residue = 0;
+	bus += t_cmd;
+	tag++;
+	memcpy( cbw + 4, &tag, 4 );
+	memcpy( cbw + 8, &len, 4 );
+	cbw[12] = in ? 0x80 : 0;
+	cbw[14] = cdblen;
+	memcpy( cbw + 15, cdb, cdblen );
+	if( host_out( cbw, cbwlen ) < 0 )
+	{
+		recover();
+		return -1;
+	}
+
+	while( len && got < len )
+	{
+		if( in )
+		{
+			n = host_in( data + got );
+			if( n < 0 )
+			{
+				clear_halt( 1 );
+				break;
+			}
+			got += n;
+			if( n < MSC_PACKET ) break;
+		}
+		else
+		{
+			n = len - got < MSC_PACKET ? len - got : MSC_PACKET;
+			if( host_out( data + got, n ) < 0 )
+			{
+				clear_halt( 0 );
+				break;
+			}
+			got += n;
+		}
+	}
+
+	n = host_in( csw );
+	if( n < 0 )
+	{
+		clear_halt( 1 );
+		n = host_in( csw );
+	}
+	if( n != 13 || le32( csw ) != 0x53425355 || le32( csw + 4 ) != tag || csw[12] > 2 )
+	{
+		recover();
+		return -1;
+	}
+	residue = le32( csw + 8 );
+	if( csw[12] == 2 ) recover();
+	return csw[12];
+}
+
+static int bot( const uint8_t * cdb, int cdblen, int in, uint8_t * data, uint32_t len )
+{
+	return bot_raw( cdb, cdblen, in, data, len, 31 );
+}
+
+static int rw( int write, uint32_t lba, int n, uint8_t * data )
+{
+	uint8_t cdb[10] = { write ? 0x2a : 0x28, 0, lba >> 24, lba >> 16, lba >> 8, lba, 0, n >> 8, n, 0 };
+	int r = bot( cdb, 10, !write, data, n * 512 );
+	return r || got != n * 512u || residue ? -1 : 0;
+}
+
+static int sync_cache( void )
+{
+	uint8_t cdb[10] = { 0x35 };
+	return bot( cdb, 10, 0, 0, 0 );
+}
+
+static uint8_t sense_buf[512];
+
+static int sense( void )
+{
+	uint8_t cdb[6] = { 0x03, 0, 0, 0, 18, 0 };
+	if( bot( cdb, 6, 1, sense_buf, 18 ) || got != 18 ) return -1;
+	return sense_buf[2] << 16 | sense_buf[12] << 8 | sense_buf[13];
+}
+
+static int fails;
+
+#define CHECK( c, ... ) do { if( !( c ) ) { fails++; printf( "FAIL %s:%d: ", __FILE__, __LINE__ ); printf( __VA_ARGS__ ); printf( "\n" ); } } while( 0 )
+
+static uint8_t ref[DISK];
+static uint8_t buf[65536 + 512];
+
+static void protocol( void )
+{
+	uint8_t inq[6] = { 0x12, 0, 0, 0, 36, 0 };
+	uint8_t cap[10] = { 0x25 };
+	uint8_t ms6[6] = { 0x1a, 0, 0x3f, 0, 192, 0 };
+	uint8_t ms8[6] = { 0x1a, 0, 0x08, 0, 192, 0 };
+	uint8_t tur[6] = { 0 };
+	uint8_t bad[6] = { 0xff };
+	uint8_t fmt[10] = { 0x23, 0, 0, 0, 0, 0, 0, 0, 252, 0 };
+	uint8_t rd[10] = { 0x28, 0, 0, 0, 0, 0, 0, 0, 1, 0 };
+	uint8_t wr[10] = { 0x2a, 0, 0, 0, 0, 0, 0, 0, 1, 0 };
+	int r;
+
+	r = bot( inq, 6, 1, buf, 36 );
+	CHECK( !r && got == 36 && !residue, "INQUIRY %d got %u", r, got );
+	CHECK( buf[1] == 0x80 && !memcmp( buf + 8, "ch32fun Flash disk      1.0 ", 28 ), "INQUIRY data" );
+
+	r = bot( cap, 10, 1, buf, 8 );
+	CHECK( !r && got == 8, "READ CAPACITY %d", r );
+	CHECK( le32( buf ) == __builtin_bswap32( MSC_BLOCKS - 1 ) && buf[6] == 2, "capacity" );
+
+	r = bot( fmt, 10, 1, buf, 252 );
+	CHECK( !r && got == 12 && residue == 240 && buf[8] == 2, "READ FORMAT CAPACITIES %d got %u residue %u", r, got, residue );
+
+	r = bot( ms6, 6, 1, buf, 192 );
+	CHECK( !r && got == 24 && residue == 168 && buf[0] == 23 && buf[4] == 8 && ( buf[6] & 4 ), "MODE SENSE all pages %d got %u", r, got );
+	r = bot( ms8, 6, 1, buf, 192 );
+	CHECK( !r && got == 24, "MODE SENSE caching" );
+
+	r = bot( tur, 6, 0, 0, 0 );
+	CHECK( r == 0, "TEST UNIT READY %d", r );
+
+	r = bot( bad, 6, 0, 0, 0 );
+	CHECK( r == 1 && sense() == 0x052000, "unknown command %d sense %06x", r, sense() );
+	CHECK( sense() == 0, "sense cleared" );
+
+	// Failing with data expected: stall, then the CSW.
+	rd[2] = 0xff;
+	r = bot( rd, 10, 1, buf, 512 );
+	CHECK( r == 1 && got == 0 && residue == 512 && sense() == 0x052100, "READ out of range %d got %u residue %u", r, got, residue );
+	rd[2] = 0;
+	wr[2] = 0xff;
+	r = bot( wr, 10, 0, buf, 512 );
+	CHECK( r == 1 && got == 0 && residue == 512, "WRITE out of range %d got %u residue %u", r, got, residue );
+	wr[2] = 0;
+
+	// Host wants more than the command has: data, stall, CSW with residue.
+	r = bot( rd, 10, 1, buf, 1024 );
+	CHECK( r == 0 && got == 512 && residue == 512 && !memcmp( buf, ref, 512 ), "READ Hi > Di %d got %u residue %u", r, got, residue );
+
+	// Wrong direction or too little room: phase error.
+	r = bot( wr, 10, 1, buf, 512 );
+	CHECK( r == 2, "WRITE with data in %d", r );
+	r = bot( rd, 10, 0, buf, 512 );
+	CHECK( r == 2, "READ with data out %d", r );
+	r = bot( rd, 10, 1, buf, 256 );
+	CHECK( r == 2, "READ Hi < Di %d", r );
+	r = bot( rd, 10, 1, buf, 0 );
+	CHECK( r == 2, "READ Hn %d", r );
+
+	// Not a CBW: everything stalls until the reset recovery.
+	r = bot_raw( tur, 6, 0, 0, 0, 30 );
+	CHECK( r == -1 && recoveries, "short CBW %d", r );
+	r = bot( tur, 6, 0, 0, 0 );
+	CHECK( r == 0, "after recovery %d", r );
+
+	r = bot( inq, 6, 1, buf, 5 );
+	CHECK( r == 0 && got == 5 && residue == 0, "INQUIRY cut short %d got %u", r, got );
+
+	memcpy( buf, ref, 512 );
+	r = rw( 1, 0, 1, buf );
+	CHECK( !r, "WRITE" );
+	CHECK( sync_cache() == 0, "SYNCHRONIZE CACHE" );
+}
+
+static uint32_t rnd_state = 1;
+
+static uint32_t rnd( void )
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 17;
+	rnd_state ^= rnd_state << 5;
+	return rnd_state;
+}
+
+static void fill( uint8_t * p, int n )
+{
+	while( n-- ) *p++ = rnd();
+}
+
+static void workload( int ops )
+{
+	uint32_t lba = 0, n = 1;
+	int i, k, bad = 0;
+
+	for( i = 0; i < ops; i++ )
+	{
+		int r = rnd() % 100;
+		if( r < 40 )
+		{
+			if( rnd() & 1 ) lba = rnd() % MSC_BLOCKS;
+			n = 1 + rnd() % ( rnd() & 1 ? 8 : 64 );
+			if( lba + n > MSC_BLOCKS ) lba = MSC_BLOCKS - n;
+			memcpy( buf, ref + lba * 512, n * 512 );
+			switch( rnd() % 5 )
+			{
+			case 0: break;                          // same data again
+			case 1:                                 // only clears bits
+				for( k = 0; k < (int)n * 512; k++ ) buf[k] &= rnd() | rnd();
+				break;
+			case 2: memset( buf, 0xff, n * 512 ); break;
+			default: fill( buf, n * 512 ); break;
+			}
+			if( rw( 1, lba, n, buf ) ) bad++;
+			memcpy( ref + lba * 512, buf, n * 512 );
+			lba += n;
+		}
+		else if( r < 85 )
+		{
+			if( rnd() % 3 ) lba = rnd() % MSC_BLOCKS;
+			n = 1 + rnd() % 64;
+			if( lba + n > MSC_BLOCKS ) lba = MSC_BLOCKS - n;
+			if( rw( 0, lba, n, buf ) || memcmp( buf, ref + lba * 512, n * 512 ) )
+			{
+				if( !bad++ ) printf( "read %u+%u differs\n", lba, n );
+			}
+			lba += n;
+		}
+		else if( r < 90 )
+		{
+			CHECK( sync_cache() == 0, "SYNCHRONIZE CACHE" );
+			CHECK( !memcmp( flash, ref, DISK ), "flash after SYNCHRONIZE CACHE" );
+		}
+		else if( r < 92 )
+		{
+			bus += 700000;
+			device_until( bus );
+			CHECK( !msc_dirty() && !memcmp( flash, ref, DISK ), "flash after going idle" );
+		}
+		else
+		{
+			uint8_t tur[6] = { 0 };
+			CHECK( bot( tur, 6, 0, 0, 0 ) == 0, "TEST UNIT READY" );
+		}
+		if( fails > 10 ) break;
+	}
+	CHECK( !bad, "%d commands failed or read wrong data", bad );
+	CHECK( sync_cache() == 0, "final SYNCHRONIZE CACHE" );
+	CHECK( !memcmp( flash, ref, DISK ), "final flash image" );
+}
+
+static MSCStats stats0;
+static double bus0;
+
+static void bench_start( void )
+{
+	stats0 = msc_stats;
+	naks = 0;
+	bus0 = bus;
+}
+
+static void bench_end( const char * name, uint32_t bytes )
+{
+	double t = bus - bus0;
+	printf( "  %-24s %8u bytes %8.0f ms %7.3f MB/s  erases %5u pages %6u reads %5u out waits %5u\n", name, bytes, t / 1000, bytes / t,
+		msc_stats.erases - stats0.erases, msc_stats.programs - stats0.programs, msc_stats.bd_reads - stats0.bd_reads,
+		msc_stats.out_waits - stats0.out_waits );
+}
+
+static void bench( void )
+{
+	uint32_t i, lba;
+	int bad = 0;
+
+	bench_start();
+	for( i = 0; i < 2048; i += 128 )
+	{
+		fill( buf, 65536 );
+		memcpy( ref + i * 512, buf, 65536 );
+		bad += rw( 1, i, 128, buf );
+	}
+	bad += sync_cache();
+	bench_end( "write 64 kB commands", 1 << 20 );
+
+	bus += 700000;
+	device_until( bus );
+	bench_start();
+	for( i = 0; i < 2048; i += 128 )
+	{
+		bad += rw( 0, i, 128, buf );
+		bad += !!memcmp( buf, ref + i * 512, 65536 );
+	}
+	bench_end( "read 64 kB commands", 1 << 20 );
+
+	bench_start();
+	for( i = 0; i < 256; i++ )
+	{
+		lba = rnd() % ( MSC_BLOCKS / 8 ) * 8;
+		fill( buf, 4096 );
+		memcpy( ref + lba * 512, buf, 4096 );
+		bad += rw( 1, lba, 8, buf );
+	}
+	bad += sync_cache();
+	bench_end( "write 4 kB random", 256 * 4096 );
+
+	bench_start();
+	for( i = 0; i < 256; i++ )
+	{
+		lba = rnd() % ( MSC_BLOCKS / 8 ) * 8;
+		bad += rw( 0, lba, 8, buf );
+		bad += !!memcmp( buf, ref + lba * 512, 4096 );
+	}
+	bench_end( "read 4 kB random", 256 * 4096 );
+
+	bench_start();
+	for( i = 0; i < 512; i++ )
+	{
+		fill( buf, 512 );
+		memcpy( ref + ( 2048 + i ) * 512, buf, 512 );
+		bad += rw( 1, 2048 + i, 1, buf );
+	}
+	bad += sync_cache();
+	bench_end( "write 512 B commands", 512 * 512 );
+
+	CHECK( !bad, "%d benchmark commands failed", bad );
+	CHECK( !memcmp( flash, ref, DISK ), "flash after the benchmark" );
+}
+
+int main( int argc, char ** argv )
+{
+	int c, ops = 20000, fresh = 0, runbench = 1;
+
+#ifdef SIM_HS
+	t_tok = 1.1, t_byte = 8 / 480.0, t_nak = 1, t_cmd = 30, t_ctrl = 125;
+#else
+	t_tok = 5, t_byte = 0.75, t_nak = 10, t_cmd = 250, t_ctrl = 1000;
+#endif
+	t_isr = 2;
+#ifdef SIM_INTERNAL
+	t_prog = 40, t_erase = 2500;
+#else
+	t_prog = 700, t_erase = 45000;
+#endif
+
+	while( ( c = getopt( argc, argv, "n:r:p:e:s:c:fB" ) ) != -1 )
+	{
+		switch( c )
+		{
+		case 'n': ops = atoi( optarg ); break;
+		case 'r': rnd_state = atoi( optarg ) * 2654435761u | 1; break;
+		case 'p': t_prog = atof( optarg ); break;
+		case 'e': t_erase = atof( optarg ) * 1000; break;
+		case 's': t_spi = atof( optarg ); break;
+		case 'c': t_cmd = atof( optarg ); break;
+		case 'f': fresh = 1; break;
+		case 'B': runbench = 0; break;
+		default:
+			fprintf( stderr, "mscsim [-n ops] [-r seed] [-p prog us] [-e erase ms] [-s spi us/byte] [-c command us] [-f] [-B]\n" );
+			return 1;
+		}
+	}
+
+	if( fresh )
+		bd_blank( 0, DISK );
+	else
+		fill( flash, DISK );
+	memcpy( ref, flash, DISK );
+
+	printf( "%s, %s, %d lines of %d bytes, %d kB disk\n",
+#ifdef SIM_HS
+		"high speed",
+#else
+		"full speed",
+#endif
+#ifdef SIM_INTERNAL
+		"internal flash (blocking)",
+#else
+		"SPI NOR",
+#endif
+		MSC_LINES, MSC_LINE_SIZE, DISK / 1024 );
+
+	protocol();
+	workload( ops );
+	printf( "checks: %d commands, %d reset recoveries, %u flushes, %ld program violations, %ld accesses while busy\n",
+		msc_stats.cmds, recoveries, msc_stats.flushes, violations, busy_access );
+	CHECK( !violations && !busy_access, "flash misuse" );
+
+	if( runbench && !fails ) bench();
+
+	if( fails )
+	{
+		printf( "%d checks failed\n", fails );
+		return 2;
+	}
+	printf( "checks ok\n" );
+	return 0;
+}
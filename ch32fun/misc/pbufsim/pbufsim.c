@@ -0,0 +1,723 @@
+/* Runs extralibs/lib_pbuf.h on the host: threads sharing one pool the way
+	interrupts and the main loop do, a single threaded run that checks every
+	allocation against what's free, and the hand-off timed against a copy.
+	See README.md.
+*/
+
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+// Interrupts off is SIGALRM blocked when a timer signal plays the interrupt,
+// and one mutex over the pool when threads share it. Nothing for the single
+// threaded runs, so the bench sees the cost of the pool and not of the lock.
+enum { LOCK_NONE, LOCK_SIGNAL, LOCK_MUTEX };
+static int pbuf_lock_mode;
+static pthread_mutex_t pbuf_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void pbuf_lock( sigset_t * old )
+{
+	if( pbuf_lock_mode == LOCK_SIGNAL )
+	{
+		sigset_t s;
+		sigemptyset( &s );
+		sigaddset( &s, SIGALRM );
+		pthread_sigmask( SIG_BLOCK, &s, old );
+	}
+	else if( pbuf_lock_mode == LOCK_MUTEX )
+		pthread_mutex_lock( &pbuf_mutex );
+}
+
+static void pbuf_unlock( sigset_t * old )
+{
+	if( pbuf_lock_mode == LOCK_SIGNAL )
+		pthread_sigmask( SIG_SETMASK, old, 0 );
+	else if( pbuf_lock_mode == LOCK_MUTEX )
+		pthread_mutex_unlock( &pbuf_mutex );
+}
+
+#define PBUF_LOCK()   sigset_t pbuf_old; pbuf_lock( &pbuf_old )
+#define PBUF_UNLOCK() pbuf_unlock( &pbuf_old )
+
+#ifndef PBUF_COUNT
+#define PBUF_COUNT 32
+#endif
+#ifndef PBUF_HEADROOM
+#define PBUF_HEADROOM 16
+#endif
+
+#include "lib_pbuf.h"
+
+#define MAXBLOCKS 6              // longest packet, in blocks
+#define MAXLEN ( MAXBLOCKS * PBUF_SIZE - PBUF_HEADROOM )
+#define WANTMAX ( MAXBLOCKS * 2 * PBUF_SIZE + PBUF_HEADROOM ) // after joining two
+#define HOLD 4                   // packets a thread holds at most
+#define MAXTHREADS 16
+
+static int failures;
+
+static void fail( const char * what, long got, long want )
+{
+	if( __atomic_fetch_add( &failures, 1, __ATOMIC_SEQ_CST ) < 10 )
+		printf( "FAIL %s: got %ld, want %ld\n", what, got, want );
+}
+
+static __thread uint64_t rng_state;
+
+static uint32_t rnd( void )
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state >> 32;
+}
+
+static void seed_rnd( int seed, int n )
+{
+	rng_state = ( seed * 64 + n ) * 0x9e3779b97f4a7c15ull + 1;
+}
+
+static uint64_t now_ns( void )
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int blocks_for( int len )
+{
+	int room = PBUF_SIZE - PBUF_HEADROOM;
+	return len <= room ? 1 : 1 + ( len - room + PBUF_SIZE - 1 ) / PBUF_SIZE;
+}
+
+static int chain_blocks( const PBuf * p )
+{
+	int n = 0;
+	for( ; p; p = p->next ) n++;
+	return n;
+}
+
+// A packet and what has to be in it.
+typedef struct
+{
+	PBuf * p;
+	uint8_t * want;
+	int len;
+	int shared; // another thread has a reference, hands off
+} held_t;
+
+static void fill_pattern( uint8_t * d, int len )
+{
+	uint32_t x = rnd();
+	for( int i = 0; i < len; i++ )
+	{
+		x = x * 1103515245 + 12345;
+		d[i] = x >> 24;
+	}
+}
+
+static void check_chain( const char * what, const PBuf * p, int len )
+{
+	int tot = len, n = 0;
+	if( p->tot_len != len ) fail( what, p->tot_len, len );
+	for( ; p; p = p->next )
+	{
+		if( p->tot_len != tot ) { fail( "tot_len down the chain", p->tot_len, tot ); return; }
+		if( p->ref < 1 ) fail( "block in use with no reference", p->ref, 1 );
+		if( p->payload < p->data || p->payload + p->len > p->data + PBUF_SIZE )
+			fail( "payload outside its block", p->payload - p->data, p->len );
+		tot -= p->len;
+		if( ++n > PBUF_COUNT ) { fail( "chain loops", n, PBUF_COUNT ); return; }
+	}
+	if( tot ) fail( "len of the blocks adds up to", len - tot, len );
+}
+
+static void check_data( const char * what, const held_t * h )
+{
+	static __thread uint8_t got[WANTMAX];
+	check_chain( what, h->p, h->len );
+	if( PBufCopyOut( h->p, got, 0, h->len ) != h->len ) fail( "PBufCopyOut short", 0, h->len );
+	else if( memcmp( got, h->want, h->len ) )
+		fail( what, 0, h->len );
+}
+
+static int hold_new( held_t * h, int len )
+{
+	h->p = PBufAlloc( len );
+	if( !h->p ) return -1;
+	h->len = len;
+	h->shared = 0;
+	h->want = malloc( WANTMAX );
+	fill_pattern( h->want, len );
+	if( PBufCopyIn( h->p, h->want, 0, len ) != len ) fail( "PBufCopyIn short", 0, len );
+	return 0;
+}
+
+static void drop( held_t * h )
+{
+	PBufFree( h->p );
+	free( h->want );
+	h->p = 0;
+}
+
+/* The threads: each allocates, fills, trims, adds and strips headers, joins
+	packets and frees, and passes packets to the next thread with a second
+	reference, as an interrupt hands a frame to the main loop and keeps it
+	queued for TX too. Everything is checked before it goes back, so two
+	owners of one block show up as a pattern the other wrote. */
+
+#define MAILBOX 4
+
+static struct
+{
+	pthread_mutex_t m;
+	held_t slot[MAILBOX];
+	int head, tail;
+} mailbox[MAXTHREADS];
+
+static int nthreads = 4;
+static int ops = 200000;
+static int seed = 1;
+static long sent_total, received_total, alloc_fails_seen;
+
+static int post( int to, held_t * h )
+{
+	int ok = 0;
+	pthread_mutex_lock( &mailbox[to].m );
+	if( mailbox[to].head - mailbox[to].tail < MAILBOX )
+	{
+		held_t * s = &mailbox[to].slot[mailbox[to].head++ % MAILBOX];
+		*s = *h;
+		s->want = malloc( h->len );
+		memcpy( s->want, h->want, h->len );
+		ok = 1;
+	}
+	pthread_mutex_unlock( &mailbox[to].m );
+	return ok;
+}
+
+static int fetch( int me, held_t * h )
+{
+	int ok = 0;
+	pthread_mutex_lock( &mailbox[me].m );
+	if( mailbox[me].head != mailbox[me].tail )
+	{
+		*h = mailbox[me].slot[mailbox[me].tail++ % MAILBOX];
+		ok = 1;
+	}
+	pthread_mutex_unlock( &mailbox[me].m );
+	return ok;
+}
+
+static void * worker( void * arg )
+{
+	int me = (int)(intptr_t)arg;
+	held_t h[HOLD] = { 0 };
+	long sent = 0, received = 0, fails = 0;
+	seed_rnd( seed, me + 1 );
+
+	for( int op = 0; op < ops; op++ )
+	{
+		int i = rnd() % HOLD;
+		held_t * x = &h[i];
+		held_t * y = &h[( i + 1 + rnd() % ( HOLD - 1 ) ) % HOLD];
+		int r = rnd() % 100;
+
+		// One CPU runs a thread for a whole time slice, swap more often.
+		if( !( rnd() & 31 ) ) sched_yield();
+
+		if( r < 15 )
+		{
+			held_t in;
+			if( fetch( me, &in ) )
+			{
+				check_data( "data handed over", &in );
+				drop( &in );
+				received++;
+			}
+		}
+		else if( !x->p )
+		{
+			// Out of blocks, let the others run and give some back.
+			if( r < 70 && hold_new( x, 1 + rnd() % ( r < 50 ? PBUF_SIZE : MAXLEN / 2 ) ) )
+			{
+				fails++;
+				sched_yield();
+			}
+		}
+		else if( r < 35 )
+		{
+			check_data( "data at free", x );
+			drop( x );
+		}
+		else if( r < 45 )
+		{
+			// A second reference to the next thread, which checks and frees it.
+			PBufRef( x->p );
+			if( post( ( me + 1 ) % nthreads, x ) )
+			{
+				x->shared = 1;
+				sent++;
+			}
+			else
+			{
+				PBufFree( x->p );
+				sched_yield(); // It's full, let it catch up.
+			}
+		}
+		else if( x->shared )
+			check_data( "data while shared", x );
+		else if( r < 60 )
+		{
+			int len = rnd() % ( x->len + 1 );
+			PBufTrim( x->p, len );
+			x->len = len;
+			check_data( "data after PBufTrim", x );
+		}
+		else if( r < 75 )
+		{
+			// A header on, or one off.
+			int d = rnd() % ( PBUF_HEADROOM + 1 );
+			int off = x->p->payload - x->p->data, first = x->p->len;
+			if( rnd() & 1 )
+			{
+				if( PBufHeader( x->p, d ) != ( d <= off ? 0 : -1 ) ) fail( "PBufHeader adding", d, off );
+				else if( d <= off )
+				{
+					memmove( x->want + d, x->want, x->len );
+					fill_pattern( x->want, d );
+					PBufCopyIn( x->p, x->want, 0, d );
+					x->len += d;
+				}
+			}
+			else
+			{
+				if( PBufHeader( x->p, -d ) != ( d <= first ? 0 : -1 ) ) fail( "PBufHeader stripping", d, first );
+				else if( d <= first )
+				{
+					x->len -= d;
+					memmove( x->want, x->want + d, x->len );
+				}
+			}
+			check_data( "data after PBufHeader", x );
+		}
+		else if( r < 85 )
+		{
+			if( y->p && !y->shared && x->len + y->len <= WANTMAX - PBUF_HEADROOM &&
+				chain_blocks( x->p ) + chain_blocks( y->p ) <= MAXBLOCKS * 2 )
+			{
+				PBufCat( x->p, y->p );
+				memcpy( x->want + x->len, y->want, y->len );
+				x->len += y->len;
+				free( y->want );
+				y->p = 0;
+				check_data( "data after PBufCat", x );
+			}
+		}
+		else
+		{
+			// Rewrite a stretch of it.
+			int off = rnd() % ( x->len + 1 );
+			int len = rnd() % ( x->len - off + 1 );
+			fill_pattern( x->want + off, len );
+			if( PBufCopyIn( x->p, x->want + off, off, len ) != len ) fail( "PBufCopyIn in range", 0, len );
+			check_data( "data after PBufCopyIn", x );
+		}
+	}
+
+	for( int i = 0; i < HOLD; i++ )
+		if( h[i].p )
+		{
+			check_data( "data at the end", &h[i] );
+			drop( &h[i] );
+		}
+	__atomic_add_fetch( &sent_total, sent, __ATOMIC_SEQ_CST );
+	__atomic_add_fetch( &received_total, received, __ATOMIC_SEQ_CST );
+	__atomic_add_fetch( &alloc_fails_seen, fails, __ATOMIC_SEQ_CST );
+	return 0;
+}
+
+// Every block free, once each, with no references left.
+static void check_pool( const char * what )
+{
+	static uint8_t seen[PBUF_COUNT];
+	int n = 0;
+	memset( seen, 0, sizeof( seen ) );
+	for( PBuf * p = pbuf_free_list; p; p = p->next )
+	{
+		int i = p - pbuf_pool;
+		if( i < 0 || i >= PBUF_COUNT ) { fail( "free list outside the pool", i, PBUF_COUNT ); return; }
+		if( seen[i]++ ) { fail( "block on the free list twice", i, 0 ); return; }
+		if( p->ref ) fail( "free block with references", p->ref, 0 );
+		n++;
+	}
+	if( n != PBUF_COUNT ) fail( what, n, PBUF_COUNT );
+	if( PBufFreeCount() != PBUF_COUNT ) fail( "PBufFreeCount", PBufFreeCount(), PBUF_COUNT );
+}
+
+static void concurrency( void )
+{
+	pthread_t t[MAXTHREADS];
+	PBufInit();
+	pbuf_lock_mode = LOCK_MUTEX;
+	for( int i = 0; i < nthreads; i++ ) pthread_mutex_init( &mailbox[i].m, 0 );
+	for( int i = 0; i < nthreads; i++ ) pthread_create( &t[i], 0, worker, (void *)(intptr_t)i );
+	for( int i = 0; i < nthreads; i++ ) pthread_join( t[i], 0 );
+	pbuf_lock_mode = LOCK_NONE;
+
+	// What's left in the mailboxes.
+	for( int i = 0; i < nthreads; i++ )
+	{
+		held_t in;
+		while( fetch( i, &in ) )
+		{
+			check_data( "data left in a mailbox", &in );
+			drop( &in );
+			received_total++;
+		}
+	}
+	if( received_total != sent_total ) fail( "handed over and received", received_total, sent_total );
+	if( (long)pbuf_alloc_fails != alloc_fails_seen ) fail( "pbuf_alloc_fails", pbuf_alloc_fails, alloc_fails_seen );
+	check_pool( "blocks free after the threads" );
+	printf( "threads: %d of %d ops, %ld handed over, %ld allocations failed, low water %d of %d\n",
+		nthreads, ops, sent_total, alloc_fails_seen, pbuf_min_free, PBUF_COUNT );
+}
+
+/* A timer signal as the interrupt, every few us in the middle of whatever
+	the main loop is doing, on the one CPU. It receives frames into new
+	packets for the main loop, and frees the ones the main loop queued for
+	TX once they're "sent". The main loop handles the frames, queues some
+	with a second reference, and allocates and frees its own in between.
+	Here a missing or short lock does show: the interrupt lands inside the
+	pool's free list updates. */
+
+#define IRQ_RING 8
+
+static PBuf * volatile irq_rx[IRQ_RING];
+static volatile unsigned irq_rx_head, irq_rx_tail;
+static PBuf * volatile irq_tx[IRQ_RING];
+static volatile unsigned irq_tx_head, irq_tx_tail;
+static volatile unsigned irq_seq, irq_count, irq_rx_drops, irq_bad;
+
+// The frame's bytes follow from its number, kept in flags as well.
+static uint8_t frame_byte( unsigned seq, int at )
+{
+	return seq * 31 + at * 7 + ( at >> 8 );
+}
+
+static void frame_fill( PBuf * p, uint8_t seq )
+{
+	int at = 0;
+	p->flags = seq; // nothing in the pool uses it
+	for( PBuf * q = p; q; q = q->next )
+		for( int i = 0; i < q->len; i++ )
+			q->payload[i] = frame_byte( seq, at++ );
+}
+
+static int frame_ok( const PBuf * p )
+{
+	int at = 0;
+	if( p->ref < 1 ) return 0;
+	for( const PBuf * q = p; q; q = q->next )
+		for( int i = 0; i < q->len; i++ )
+			if( q->payload[i] != frame_byte( p->flags, at++ ) ) return 0;
+	return at == p->tot_len;
+}
+
+static void irq_handler( int sig )
+{
+	irq_count++;
+
+	// TX complete, the MAC's reference goes.
+	if( irq_tx_tail != irq_tx_head )
+	{
+		PBuf * p = irq_tx[irq_tx_tail % IRQ_RING];
+		if( !frame_ok( p ) ) irq_bad++;
+		PBufFree( p );
+		irq_tx_tail++;
+	}
+
+	// A frame in, if there's a block for it and room in the queue.
+	if( irq_rx_head - irq_rx_tail < IRQ_RING )
+	{
+		unsigned seq = irq_seq;
+		int len = 60 + seq * 97 % ( PBUF_SIZE * 2 );
+		PBuf * p = PBufAlloc( len );
+		if( !p )
+		{
+			irq_rx_drops++;
+			return;
+		}
+		frame_fill( p, seq );
+		irq_rx[irq_rx_head % IRQ_RING] = p;
+		irq_rx_head++;
+		irq_seq++;
+	}
+}
+
+static void interrupts( void )
+{
+	held_t h[HOLD] = { 0 };
+	unsigned expect = 0, handled = 0, queued = 0;
+	struct itimerval it = { { 0, 20 }, { 0, 20 } }, off = { { 0, 0 }, { 0, 0 } };
+
+	seed_rnd( seed, 63 );
+	PBufInit();
+	pbuf_lock_mode = LOCK_SIGNAL;
+	signal( SIGALRM, irq_handler );
+	setitimer( ITIMER_REAL, &it, 0 );
+
+	// ops / 10 interrupts, a signal costs the host a lot more than an op.
+	while( irq_count < (unsigned)ops / 10 )
+	{
+		held_t * x = &h[rnd() % HOLD];
+		int r = rnd() % 100;
+		if( irq_rx_tail != irq_rx_head && r < 40 )
+		{
+			PBuf * p = irq_rx[irq_rx_tail % IRQ_RING];
+			irq_rx_tail++;
+			int seq = p->flags;
+			if( (uint8_t)seq != (uint8_t)expect ) fail( "frame number from the interrupt", seq, expect & 0xff );
+			expect++;
+			if( !frame_ok( p ) ) fail( "frame from the interrupt", seq, p->tot_len );
+			handled++;
+			// Sometimes queued for TX as well, the interrupt frees that reference.
+			if( r < 15 && irq_tx_head - irq_tx_tail < IRQ_RING )
+			{
+				PBufRef( p );
+				irq_tx[irq_tx_head % IRQ_RING] = p;
+				irq_tx_head++;
+				queued++;
+			}
+			PBufFree( p );
+		}
+		else if( !x->p )
+		{
+			hold_new( x, 1 + rnd() % ( PBUF_SIZE * 2 ) );
+		}
+		else if( r < 70 )
+		{
+			check_data( "main loop data at free", x );
+			drop( x );
+		}
+		else
+		{
+			int len = rnd() % ( x->len + 1 );
+			PBufTrim( x->p, len );
+			x->len = len;
+			check_data( "main loop data after PBufTrim", x );
+		}
+	}
+
+	setitimer( ITIMER_REAL, &off, 0 );
+	signal( SIGALRM, SIG_DFL );
+	pbuf_lock_mode = LOCK_NONE;
+	while( irq_rx_tail != irq_rx_head ) PBufFree( irq_rx[irq_rx_tail++ % IRQ_RING] );
+	while( irq_tx_tail != irq_tx_head ) PBufFree( irq_tx[irq_tx_tail++ % IRQ_RING] );
+	for( int i = 0; i < HOLD; i++ )
+		if( h[i].p ) drop( &h[i] );
+	if( irq_bad ) fail( "frames changed before TX complete", irq_bad, 0 );
+	check_pool( "blocks free after the interrupts" );
+	printf( "interrupt: %u interrupts, %u frames handled, %u queued for TX, %u dropped for no block\n",
+		irq_count, handled, queued, irq_rx_drops );
+}
+
+/* One thread, the pool's own accounting. An allocation has to succeed
+	whenever there are enough free blocks whatever was freed in between,
+	and every call has to put back exactly the blocks it says. */
+static void fragmentation( void )
+{
+	held_t h[PBUF_COUNT] = { 0 };
+	int held_blocks = 0, failed = 0, allocs = 0;
+	seed_rnd( seed, 0 );
+	PBufInit();
+
+	for( int op = 0; op < ops; op++ )
+	{
+		held_t * x = &h[rnd() % PBUF_COUNT];
+		int r = rnd() % 100;
+		if( !x->p )
+		{
+			// Mostly small, sometimes as big as what's free, or past it.
+			int len = r < 60 ? 1 + rnd() % ( PBUF_SIZE - PBUF_HEADROOM ) : 1 + rnd() % MAXLEN;
+			int need = blocks_for( len ), free_before = PBufFreeCount();
+			if( hold_new( x, len ) )
+			{
+				failed++;
+				if( need <= free_before ) fail( "alloc failed with enough blocks free", need, free_before );
+				if( PBufFreeCount() != free_before ) fail( "failed alloc took blocks", PBufFreeCount(), free_before );
+				continue;
+			}
+			allocs++;
+			if( need > free_before ) fail( "alloc with too few blocks free", need, free_before );
+			if( chain_blocks( x->p ) != need ) fail( "blocks allocated", chain_blocks( x->p ), need );
+			if( x->p->payload != x->p->data + PBUF_HEADROOM ) fail( "headroom", x->p->payload - x->p->data, PBUF_HEADROOM );
+			for( PBuf * p = x->p->next; p; p = p->next )
+				if( p->payload != p->data || ( p->next && p->len != PBUF_SIZE ) ) fail( "block after the first not full", p->len, PBUF_SIZE );
+			held_blocks += need;
+			check_data( "data after alloc", x );
+		}
+		else if( r < 40 )
+		{
+			int n = chain_blocks( x->p );
+			check_data( "data at free", x );
+			PBuf * p = x->p;
+			free( x->want );
+			x->p = 0;
+			int back = PBufFree( p );
+			if( back != n ) fail( "PBufFree gave back", back, n );
+			held_blocks -= n;
+		}
+		else if( r < 60 )
+		{
+			int n = chain_blocks( x->p ), len = rnd() % ( x->len + 1 );
+			PBufTrim( x->p, len );
+			x->len = len;
+			held_blocks -= n - chain_blocks( x->p );
+			check_data( "data after PBufTrim", x );
+		}
+		else if( r < 80 )
+		{
+			// Pointers into the data find the block, others don't.
+			PBuf * p = x->p;
+			int k = rnd() % chain_blocks( x->p );
+			while( k-- ) p = p->next;
+			if( PBufFromPayload( p->data + rnd() % PBUF_SIZE ) != p ) fail( "PBufFromPayload of the data", 0, p - pbuf_pool );
+			if( PBufFromPayload( (uint8_t *)p + rnd() % ( p->data - (uint8_t *)p ) ) ) fail( "PBufFromPayload of the header", 1, 0 );
+			if( PBufFromPayload( (uint8_t *)pbuf_pool - 1 - rnd() % 64 ) ||
+				PBufFromPayload( (uint8_t *)( pbuf_pool + PBUF_COUNT ) + rnd() % 64 ) )
+				fail( "PBufFromPayload outside the pool", 1, 0 );
+		}
+		else
+		{
+			// Random stretches in and out across the block edges.
+			static uint8_t got[WANTMAX];
+			int off = rnd() % ( x->len + 16 ), len = rnd() % ( x->len + 16 );
+			int want = off >= x->len ? 0 : len < x->len - off ? len : x->len - off;
+			int n = PBufCopyOut( x->p, got, off, len );
+			if( n != want ) fail( "PBufCopyOut count", n, want );
+			else if( memcmp( got, x->want + off, n ) ) fail( "PBufCopyOut data", off, len );
+			fill_pattern( got, want );
+			n = PBufCopyIn( x->p, got, off, len );
+			if( n != want ) fail( "PBufCopyIn count", n, want );
+			memcpy( x->want + off, got, want );
+			check_data( "data after PBufCopyIn", x );
+		}
+		if( PBufFreeCount() != PBUF_COUNT - held_blocks ) fail( "blocks free", PBufFreeCount(), PBUF_COUNT - held_blocks );
+	}
+	for( int i = 0; i < PBUF_COUNT; i++ )
+		if( h[i].p ) drop( &h[i] );
+	check_pool( "blocks free after the run" );
+	if( (int)pbuf_alloc_fails != failed ) fail( "pbuf_alloc_fails", pbuf_alloc_fails, failed );
+
+	// Chains, as lwIP: PBufChain() keeps the tail's owner's reference, so
+	// freeing the head only takes the head's blocks.
+	PBuf * a = PBufAlloc( PBUF_SIZE * 2 );
+	PBuf * b = PBufAlloc( 10 );
+	int na = chain_blocks( a );
+	PBufChain( a, b );
+	if( b->ref != 2 ) fail( "PBufChain reference", b->ref, 2 );
+	check_chain( "PBufChain tot_len", a, PBUF_SIZE * 2 + 10 );
+	if( PBufFree( a ) != na ) fail( "PBufFree of a chained head", 0, na );
+	if( b->ref != 1 || PBufFree( b ) != 1 ) fail( "PBufFree of the chained tail", b->ref, 1 );
+	// And with another reference on the head nothing goes back.
+	a = PBufAlloc( 1 );
+	PBufRef( a );
+	if( PBufFree( a ) != 0 || PBufFree( a ) != 1 ) fail( "PBufFree with two references", 0, 1 );
+	if( PBufHeader( a = PBufAlloc( 1 ), PBUF_HEADROOM + 1 ) != -1 ) fail( "PBufHeader past the headroom", 0, -1 );
+	PBufFree( a );
+	check_pool( "blocks free after the chains" );
+
+	// A double free is refused and the free list stays as it was, for a
+	// block and for a chain.
+	a = PBufAlloc( 1 );
+	PBufFree( a );
+	if( PBufFree( a ) != -1 ) fail( "PBufFree of a free block", 0, -1 );
+	a = PBufAlloc( PBUF_SIZE * 2 );
+	na = chain_blocks( a );
+	if( PBufFree( a ) != na || PBufFree( a ) != -1 ) fail( "PBufFree of a free chain", 0, -1 );
+	check_pool( "blocks free after the double frees" );
+
+	printf( "one thread: %d allocations, %d failed, all for too few free blocks\n", allocs, failed );
+}
+
+/* A frame from a USB endpoint buffer to the MAC's TX buffer. The copy path
+	is a memcpy between two static buffers; with the pool the endpoint DMAs
+	into a block and the MAC sends from it, so it's an alloc, finding the
+	block again from the descriptor's address at TX complete, and the free. */
+static void bench( void )
+{
+	static uint8_t ep[MAXLEN], mac[MAXLEN];
+	static const int sizes[] = { 64, 256, 1514, 4000 };
+	const int reps = 2000000;
+	volatile uint32_t sink = 0;
+
+	PBufInit();
+	printf( "host ns a frame, %d byte blocks\n", PBUF_SIZE );
+	printf( "bytes   memcpy   pbuf   blocks\n" );
+	for( unsigned s = 0; s < sizeof( sizes ) / sizeof( sizes[0] ); s++ )
+	{
+		int len = sizes[s];
+		if( len > MAXLEN ) continue;
+		fill_pattern( ep, len );
+
+		uint64_t t0 = now_ns();
+		for( int i = 0; i < reps; i++ )
+		{
+			ep[i & 63] = i;
+			memcpy( mac, ep, len );
+			sink += mac[len - 1];
+		}
+		double copy = (double)( now_ns() - t0 ) / reps;
+
+		t0 = now_ns();
+		for( int i = 0; i < reps; i++ )
+		{
+			PBuf * p = PBufAlloc( len );
+			p->payload[i & 63] = i;
+			uint8_t * txaddr = p->payload;
+			PBufFree( PBufFromPayload( txaddr ) );
+		}
+		double pool = (double)( now_ns() - t0 ) / reps;
+		printf( "%5d %8.1f %6.1f %8d\n", len, copy, pool, blocks_for( len ) );
+	}
+	(void)sink;
+}
+
+int main( int argc, char ** argv )
+{
+	int c, do_bench = 0;
+	while( ( c = getopt( argc, argv, "n:r:t:b" ) ) != -1 )
+	{
+		switch( c )
+		{
+		case 'n': ops = atoi( optarg ); break;
+		case 'r': seed = atoi( optarg ); break;
+		case 't': nthreads = atoi( optarg ); break;
+		case 'b': do_bench = 1; break;
+		default:
+			fprintf( stderr, "usage: pbufsim [-n ops] [-r seed] [-t threads] [-b]\n" );
+			return 1;
+		}
+	}
+	if( nthreads < 2 || nthreads > MAXTHREADS ) nthreads = nthreads < 2 ? 2 : MAXTHREADS;
+
+	if( do_bench )
+		bench();
+	else
+	{
+		printf( "%d blocks of %d bytes, %d headroom\n", PBUF_COUNT, PBUF_SIZE, PBUF_HEADROOM );
+		fragmentation();
+		interrupts();
+		concurrency();
+	}
+	printf( failures ? "FAILED\n" : "ok\n" );
+	return failures ? 2 : 0;
+}
@@ -0,0 +1,18 @@
+#!/usr/bin/env bash
+# Samples the PC of a running program through the minichlink command server
+# (minichlink -baG, or any mode that starts it on port 4444): halt, read dpc,
+# resume. Writes one PC per line, for placement.py.
+
+SAMPLES=${1:-2000}
+OUT=${2:-profile.txt}
+
+: > $OUT
+for (( i = 0; i < SAMPLES; i++ )); do
+	commands=" -s 0x10 0x80000001"   # Halt
+	commands+=" -s 0x17 0x002207b1"  # Abstract command: dpc to DATA0
+	commands+=" -m 0x04"             # Read DATA0
+	commands+=" -s 0x10 0x40000001"  # Resume
+	echo $commands | nc -q 1 localhost 4444 | awk '/^04:/ { print "0x"$2 }' >> $OUT
+	sleep 0.0$(( RANDOM % 10 ))    # Don't sample in step with the program
+done
+echo "$(wc -l < $OUT) samples in $OUT"
@@ -0,0 +1,185 @@
+#!/usr/bin/env python3
+# Picks the functions to run from RAM, from an execution profile and the
+# linker map of the build that was profiled, and writes them as a
+# placement.ld for ch32fun.ld. See README.md.
+
+import argparse
+import bisect
+import re
+import sys
+
+# These run before the copy to RAM, or are the vector table.
+NEVER = { ".text.handle_reset", ".text.vector_handler", ".text.InterruptVector" }
+
+def read_map( path ):
+	"""Input sections of the link, list of [name, addr, size, symbols, object],
+	and the memory regions, { name: length }."""
+	sections = []
+	regions = {}
+	in_mem = False
+	in_map = False
+	pending = None
+	with open( path ) as f:
+		for line in f:
+			line = line.rstrip( "\n" )
+			if line.startswith( "Memory Configuration" ):
+				in_mem = True
+				continue
+			if line.startswith( "Linker script and memory map" ):
+				in_mem = False
+				in_map = True
+				continue
+			if in_mem:
+				m = re.match( r"^(\w+)\s+0x[0-9a-fA-F]+\s+0x([0-9a-fA-F]+)", line )
+				if m:
+					regions[m.group( 1 )] = int( m.group( 2 ), 16 )
+				continue
+			if not in_map:
+				continue
+			m = re.match( r"^ (\.\S+)\s+0x([0-9a-fA-F]+)\s+0x([0-9a-fA-F]+)\s+(\S.*)$", line )
+			if m:
+				sections.append( [ m.group( 1 ), int( m.group( 2 ), 16 ), int( m.group( 3 ), 16 ), [], m.group( 4 ) ] )
+				pending = None
+				continue
+			m = re.match( r"^ (\.\S+)$", line )
+			if m:
+				pending = m.group( 1 )
+				continue
+			m = re.match( r"^\s+0x([0-9a-fA-F]+)\s+0x([0-9a-fA-F]+)\s+(\S.*)$", line )
+			if m and pending:
+				sections.append( [ pending, int( m.group( 1 ), 16 ), int( m.group( 2 ), 16 ), [], m.group( 3 ) ] )
+				pending = None
+				continue
+			pending = None
+			m = re.match( r"^\s+0x([0-9a-fA-F]+)\s+([A-Za-z_.$][\w.$]*)$", line )
+			if m and sections:
+				sections[-1][3].append( m.group( 2 ) )
+	code = [ s for s in sections if s[2] > 0 and ( s[0].startswith( ".text" ) or s[0].startswith( ".highcode" ) or s[0].startswith( ".itcm" ) ) ]
+	return code, regions
+
+def file_pattern( obj ):
+	"""The object a section came from, as a linker script file pattern that
+	also matches the next build. The program is compiled and linked in one
+	gcc call, so its objects are temporaries (ccXXXXXX.o, or the LTO
+	partitions x.elf.XXXXXX.ltrans0.ltrans.o): the random part becomes ?s,
+	in any directory. Archive members are *archive:member. Other objects keep
+	their path, with backslashes and colons as ? so a Windows path isn't
+	read as escapes or as an archive."""
+	obj = obj.strip()
+	m = re.match( r"^(.*)\(([^()]*)\)$", obj )
+	if m:
+		return "*%s:%s" % ( re.split( r"[\\/]", m.group( 1 ) )[-1], m.group( 2 ) )
+	base = re.split( r"[\\/]", obj )[-1]
+	temp = re.sub( r"^cc[A-Za-z0-9]{6}\.o$", "cc??????.o", base )
+	temp = re.sub( r"\.[A-Za-z0-9]{6}(\.ltrans\d+\.ltrans\.o)$", r".??????\1", temp )
+	if temp != base:
+		return "*" + temp
+	return obj.replace( "\\", "?" ).replace( ":", "?" )
+
+def read_profile( path, sections ):
+	"""Samples per section. Lines are a PC ("0x1234") or "function count"."""
+	by_addr = sorted( range( len( sections ) ), key=lambda i: sections[i][1] )
+	starts = [ sections[i][1] for i in by_addr ]
+	by_name = {}
+	for i, s in enumerate( sections ):
+		for n in set( [ s[0][len( ".text." ):] if s[0].startswith( ".text." ) else s[0] ] + s[3] ):
+			by_name.setdefault( n, [] ).append( i )
+	counts = {}
+	total = 0
+	unknown = 0
+	with open( path ) as f:
+		for line in f:
+			line = line.split( "#" )[0].strip()
+			if not line:
+				continue
+			fields = line.split()
+			if len( fields ) == 1:
+				try:
+					pc = int( fields[0], 16 )
+				except ValueError:
+					continue
+				n = 1
+				k = bisect.bisect_right( starts, pc ) - 1
+				s = by_addr[k] if k >= 0 and pc < sections[by_addr[k]][1] + sections[by_addr[k]][2] else None
+			else:
+				try:
+					n = int( float( fields[-1] ) )
+				except ValueError:
+					continue
+				# A static that's in more than one file can't be told apart.
+				s = by_name.get( fields[0], [] )
+				s = s[0] if len( s ) == 1 else None
+			total += n
+			if s is None:
+				unknown += n
+				continue
+			counts[s] = counts.get( s, 0 ) + n
+	return counts, total, unknown
+
+def main():
+	ap = argparse.ArgumentParser( description="profile-guided RAM placement for ch32fun" )
+	ap.add_argument( "profile", help="PC samples, or function counts" )
+	ap.add_argument( "-m", "--map", required=True, help="linker map of the profiled build" )
+	ap.add_argument( "-b", "--budget", type=int, help="bytes of RAM for code, an eighth of the map's RAM by default" )
+	ap.add_argument( "-r", "--ratio", type=float, default=1.5, help="time from flash / time from RAM" )
+	ap.add_argument( "-o", "--output", default="-", help="placement.ld to write" )
+	args = ap.parse_args()
+
+	sections, regions = read_map( args.map )
+	counts, total, unknown = read_profile( args.profile, sections )
+	if total == 0:
+		sys.exit( "placement: no samples in " + args.profile )
+	if args.budget is None:
+		# The ITCM only holds code, what's already in it aside. RAM is shared
+		# with .data, .bss and the stack.
+		if "ITCM" in regions:
+			args.budget = regions["ITCM"] - sum( s[2] for s in sections if s[0].startswith( ".itcm" ) )
+		elif "RAM" in regions:
+			args.budget = regions["RAM"] // 8
+		else:
+			sys.exit( "placement: no RAM in the memory configuration of " + args.map + ", give -b" )
+	name = [ s[0] for s in sections ]
+	size = [ s[2] for s in sections ]
+	where = [ file_pattern( s[4] ) for s in sections ]
+	ident = {}
+	for i in range( len( sections ) ):
+		ident.setdefault( ( where[i], name[i] ), [] ).append( i )
+
+	# Greedy by samples per byte. Sections that aren't one function each
+	# (libgcc's .text, the startup code) can't be moved by name, nor can
+	# two that the file pattern doesn't tell apart.
+	movable = [ i for i in counts if name[i].startswith( ".text." ) and name[i] not in NEVER and
+		len( ident[( where[i], name[i] )] ) == 1 ]
+	movable.sort( key=lambda i: ( -counts[i] / ( ( size[i] + 3 ) & ~3 ), name[i], where[i] ) )
+	chosen = []
+	used = 0
+	for n in movable:
+		sz = ( size[n] + 3 ) & ~3
+		if used + sz <= args.budget:
+			chosen.append( n )
+			used += sz
+
+	moved = sum( counts[n] for n in chosen )
+	f = moved / total
+	expected = 1 / ( ( 1 - f ) + f / args.ratio )
+
+	out = sys.stdout if args.output == "-" else open( args.output, "w" )
+	out.write( "/* Generated by misc/placement/placement.py from %s, %d samples.\n" % ( args.profile, total ) )
+	out.write( "   %d of %d bytes, %.1f%% of the samples, expected %.3fx at a flash/RAM ratio of %.2f */\n" %
+		( used, args.budget, 100 * f, expected, args.ratio ) )
+	for i in chosen:
+		out.write( "%s(%s) /* %d bytes, %.1f%% */\n" % ( where[i], name[i], size[i], 100 * counts[i] / total ) )
+	if out is not sys.stdout:
+		out.close()
+
+	sys.stderr.write( "%-40s %6s %7s\n" % ( "  function", "bytes", "share" ) )
+	for i in sorted( counts, key=lambda i: -counts[i] )[:20]:
+		mark = "*" if i in chosen else ( "-" if i not in movable else " " )
+		sys.stderr.write( "%s %-38s %6d %6.1f%%  %s\n" % ( mark, name[i], size[i], 100 * counts[i] / total, where[i] ) )
+	if unknown:
+		sys.stderr.write( "  %.1f%% of the samples outside the map's code\n" % ( 100 * unknown / total ) )
+	sys.stderr.write( "%d functions, %d/%d bytes, %.1f%% of the samples, expected speedup %.3fx\n" %
+		( len( chosen ), used, args.budget, 100 * f, expected ) )
+
+if __name__ == "__main__":
+	main()
@@ -0,0 +1,596 @@
+// ptpsim, lib_ptp.h on the host, as the slave of model masters over a model
+// network, with a model of the MAC's clock under it. See README.md.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+
+// True time, ns. Every clock is a function of it.
+static int64_t now;
+
+// The slave's clock, what the MAC's PTP clock would be: it runs ppm off
+// (plus the temperature's part), and ADJUST and STEP work on it. Stamps
+// have the 8 ns or so of its subsecond counter.
+static struct
+{
+	double base;
+	int64_t tbase;
+	double ppm;
+	double ppb;
+	int64_t tx_at;     // The Delay_Req goes out then, -1 when none is queued.
+	int64_t tx_stamp;
+	int tx_ok;
+} clk;
+
+static long violations;
+
+static void violation( const char * what )
+{
+	if( violations++ < 10 ) fprintf( stderr, "%.3f s: %s\n", now * 1e-9, what );
+}
+
+static double local_at( int64_t t )
+{
+	return clk.base + (double)( t - clk.tbase ) * ( 1 + clk.ppm * 1e-6 + clk.ppb * 1e-9 );
+}
+
+static void rebase( void )
+{
+	clk.base = local_at( now );
+	clk.tbase = now;
+}
+
+// Clocks are kept as doubles from an epoch in late 2023, that keeps them
+// to well under a ns. PTP sees them with the epoch.
+#define EPOCH 1700000000000000000LL
+
+static int64_t stamp( double t )
+{
+	return EPOCH + (int64_t)floor( t / 8 ) * 8;
+}
+
+static int64_t sim_now( void )
+{
+	return stamp( local_at( now ) );
+}
+
+static int sim_send( uint8_t * frame, int len );
+static void sim_adjust( int32_t ppb );
+
+#define PTP_SEND( frame, len ) sim_send( frame, len )
+#define PTP_TX_TIME( t )       ( clk.tx_ok ? ( *( t ) = clk.tx_stamp, clk.tx_ok = 0, 1 ) : 0 )
+#define PTP_NOW()              sim_now()
+#define PTP_STEP( ns )         ( rebase(), clk.base += ( ns ) )
+#define PTP_ADJUST( ppb )      sim_adjust( ppb )
+
+#include "lib_ptp.h"
+
+static void sim_adjust( int32_t ppb )
+{
+	rebase();
+	clk.ppb = ppb;
+	if( ppb > PTP_MAX_PPB || ppb < -PTP_MAX_PPB ) violation( "rate out of range" );
+}
+
+static double rnd( void )
+{
+	return ( rand() + 0.5 ) / ( RAND_MAX + 1.0 );
+}
+
+// How a scenario goes. Path delays and jitter in ns, the jitter exponential
+// with that mean, residence is what transparent clocks on the way add, up
+// to that, and put in the correction field.
+struct scenario
+{
+	const char * name;
+	double ppm, wander, wander_s;
+	double offset;
+	int two_step;
+	int8_t log_sync, log_delay;
+	double to_slave, to_master, jitter, residence;
+	int vlan;
+	int seconds;
+	int event;         // 1 a better master at half time, 2 the master stops
+};
+
+static const struct scenario scenarios[] = {
+	{ "two step, 1 Sync/s, +40 ppm, 3 s off", 40, 0, 1, 3e9, 1, 0, 0, 5000, 5000, 50, 0, 0, 300, 0 },
+	{ "one step, 8 Sync/s, -80 ppm, 20 ms behind", -80, 0, 1, -20e6, 0, -3, 0, 5000, 5000, 50, 0, 0, 300, 0 },
+	{ "temperature: 10 ppm, 2 ppm up and down over 2 min", 10, 2, 120, 1e6, 1, 0, 0, 5000, 5000, 50, 0, 0, 600, 0 },
+	{ "transparent clocks: up to 100 us residence", 25, 0, 1, 5e8, 1, 0, 0, 2000, 2000, 50, 100000, 0, 300, 0 },
+	{ "switch queues: 300 ns mean jitter, 4 Sync/s", 25, 0, 1, 5e8, 1, -2, 0, 5000, 5000, 300, 0, 0, 300, 0 },
+	{ "VLAN, 16 Sync/s, 4 Delay_Req/s", -5, 0, 1, 1e5, 1, -4, -2, 5000, 5000, 50, 0, 1, 300, 0 },
+	{ "asymmetry: 3 us there, 1 us back", 40, 0, 1, 3e9, 1, 0, 0, 3000, 1000, 50, 0, 0, 300, 0 },
+	{ "a better master at 150 s, 1 s off", 40, 0, 1, 3e9, 1, 0, 0, 5000, 5000, 50, 0, 0, 300, 1 },
+	{ "the master stops at 150 s", 40, 0, 1, 3e9, 1, 0, 0, 5000, 5000, 50, 0, 0, 300, 2 },
+};
+
+static const struct scenario * sc;
+
+// Masters. A is the one, B comes in better in scenario 7, C is in another
+// domain and D is worse than A, the slave has to ignore both.
+struct master
+{
+	int on;
+	uint8_t mac[6];
+	uint8_t ds[14];
+	int domain;
+	double offset;     // Its clock minus true time.
+	int8_t log_sync, log_announce;
+	uint16_t sync_seq, announce_seq;
+	int64_t next_sync, next_announce;
+};
+
+static struct master masters[4];
+
+static int64_t master_time( struct master * m )
+{
+	return stamp( now + m->offset );
+}
+
+static uint8_t slave_mac[6] = { 0x02, 0x00, 0x00, 0x07, 0x03, 0x07 };
+
+// Frames on the wire, each way first in first out.
+#define FRAMES 64
+static struct
+{
+	int64_t at;
+	int to_slave;
+	int len;
+	uint8_t data[96];
+} wire[FRAMES];
+static int wired;
+static int64_t last_at[2];
+
+static void put( int to_slave, const uint8_t * data, int len, double delay )
+{
+	if( wired == FRAMES )
+	{
+		violation( "wire full" );
+		return;
+	}
+	int64_t at = now + (int64_t)delay;
+	if( at <= last_at[to_slave] ) at = last_at[to_slave] + 100;
+	last_at[to_slave] = at;
+	wire[wired].at = at;
+	wire[wired].to_slave = to_slave;
+	wire[wired].len = len;
+	memcpy( wire[wired].data, data, len );
+	wired++;
+}
+
+static double path( int to_slave, double * residence )
+{
+	double d = to_slave ? sc->to_slave : sc->to_master;
+	d += -sc->jitter * log( rnd() );
+	*residence = sc->residence * rnd();
+	return d + *residence;
+}
+
+static void put_be( uint8_t * p, uint64_t v, int n )
+{
+	for( int i = n - 1; i >= 0; i-- )
+	{
+		p[i] = v;
+		v >>= 8;
+	}
+}
+
+static void put_time( uint8_t * p, int64_t t )
+{
+	put_be( p, t / 1000000000, 6 );
+	put_be( p + 6, t % 1000000000, 4 );
+}
+
+// A PTP frame from m, the message at what it returns.
+static uint8_t * frame( uint8_t * f, int * len, struct master * m, int type, int mlen, uint16_t seq, int8_t log, double correction )
+{
+	static const uint8_t dst[6] = { 0x01, 0x1b, 0x19, 0x00, 0x00, 0x00 };
+	memset( f, 0, 96 );
+	memcpy( f, dst, 6 );
+	memcpy( f + 6, m->mac, 6 );
+	int at = 12;
+	if( sc->vlan )
+	{
+		f[12] = 0x81;
+		f[15] = 7;
+		at = 16;
+	}
+	f[at] = 0x88;
+	f[at + 1] = 0xf7;
+	uint8_t * p = f + at + 2;
+	p[0] = type;
+	p[1] = 2;
+	put_be( p + 2, mlen, 2 );
+	p[4] = m->domain;
+	if( type == PTP_SYNC && sc->two_step ) p[6] = PTP_TWO_STEP;
+	put_be( p + 8, (uint64_t)(int64_t)llround( correction * 65536 ), 8 );
+	memcpy( p + 20, m->mac, 3 );
+	p[23] = 0xff;
+	p[24] = 0xfe;
+	memcpy( p + 25, m->mac + 3, 3 );
+	p[29] = 1;
+	put_be( p + 30, seq, 2 );
+	p[32] = type == PTP_SYNC ? 0 : type == PTP_FOLLOW_UP ? 2 : type == PTP_DELAY_RESP ? 3 : 5;
+	p[33] = log;
+	*len = at + 2 + mlen < 60 ? 60 : at + 2 + mlen;
+	return p;
+}
+
+static void send_sync( struct master * m )
+{
+	uint8_t f[96];
+	int len;
+	double res;
+	double d = path( 1, &res );
+	int64_t t1 = master_time( m );
+	uint8_t * p = frame( f, &len, m, PTP_SYNC, 44, m->sync_seq, m->log_sync, sc->two_step ? 0 : res );
+	if( !sc->two_step ) put_time( p + 34, t1 );
+	put( 1, f, len, d );
+	if( sc->two_step )
+	{
+		// A Follow_Up of the Sync before, late, between the two.
+		p = frame( f, &len, m, PTP_FOLLOW_UP, 44, m->sync_seq - 1, m->log_sync, 0 );
+		put_time( p + 34, t1 - 1000000 );
+		put( 1, f, len, d + 10000 );
+		p = frame( f, &len, m, PTP_FOLLOW_UP, 44, m->sync_seq, m->log_sync, res );
+		put_time( p + 34, t1 );
+		put( 1, f, len, d + 30000 );
+	}
+	m->sync_seq++;
+}
+
+static void send_announce( struct master * m )
+{
+	uint8_t f[96];
+	int len;
+	double res;
+	uint8_t * p = frame( f, &len, m, PTP_ANNOUNCE, 64, m->announce_seq++, m->log_announce, 0 );
+	put_time( p + 34, master_time( m ) );
+	p[45] = 37;
+	memcpy( p + 47, m->ds, 14 );
+	p[63] = 0x20;
+	put( 1, f, len, path( 1, &res ) );
+}
+
+// The slave's frames reach the masters here.
+static long delay_reqs;
+
+static void master_rx( const uint8_t * f, int len )
+{
+	static const uint8_t dst[6] = { 0x01, 0x1b, 0x19, 0x00, 0x00, 0x00 };
+	const uint8_t * p = f + 14;
+	if( len != 60 || memcmp( f, dst, 6 ) || memcmp( f + 6, slave_mac, 6 ) || f[12] != 0x88 || f[13] != 0xf7 ||
+		p[0] != PTP_DELAY_REQ || p[1] != 2 || p[2] != 0 || p[3] != 44 || p[4] != PTP_DOMAIN || p[32] != 1 )
+	{
+		violation( "bad Delay_Req" );
+		return;
+	}
+	static const uint8_t id[10] = { 0x02, 0x00, 0x00, 0xff, 0xfe, 0x07, 0x03, 0x07, 0x00, 0x01 };
+	if( memcmp( p + 20, id, 10 ) ) violation( "Delay_Req from the wrong port identity" );
+	static uint16_t seq;
+	uint16_t s = ( p[30] << 8 ) | p[31];
+	if( delay_reqs && s != (uint16_t)( seq + 1 ) ) violation( "Delay_Req sequence" );
+	seq = s;
+	delay_reqs++;
+
+	// Every master answers what comes in (it's multicast), the slave takes
+	// its own master's. Another slave's Delay_Req with the same sequence
+	// number is answered first. The Delay_Req's correction goes back in the
+	// Delay_Resp.
+	uint64_t corr = 0;
+	for( int i = 0; i < 8; i++ ) corr = ( corr << 8 ) | p[8 + i];
+	double res = (int64_t)corr / 65536.0;
+	for( int i = 0; i < 2; i++ )
+	{
+		struct master * m = &masters[i];
+		if( !m->on ) continue;
+		uint8_t r[96];
+		int rlen;
+		double r2;
+		uint8_t * q = frame( r, &rlen, m, PTP_DELAY_RESP, 54, s, sc->log_delay, 0 );
+		put_time( q + 34, master_time( m ) + 1000000 );
+		memcpy( q + 44, "\x02\x00\x00\xff\xfe\x00\x00\x01\x00\x01", 10 );
+		put( 1, r, rlen, 10000 );
+		q = frame( r, &rlen, m, PTP_DELAY_RESP, 54, s, sc->log_delay, res );
+		put_time( q + 34, master_time( m ) );
+		memcpy( q + 44, p + 20, 10 );
+		put( 1, r, rlen, path( 1, &r2 ) + 20000 );
+	}
+}
+
+// The slave's Delay_Req: the MAC stamps it when it leaves, it goes on the
+// wire then. Transparent clocks add their residence to its correction.
+static uint8_t tx_frame[96];
+static int tx_len;
+
+static int sim_send( uint8_t * f, int len )
+{
+	if( clk.tx_at >= 0 || len > 96 ) return -1;
+	memcpy( tx_frame, f, len );
+	tx_len = len;
+	clk.tx_at = now + 2000 + (int64_t)( rnd() * 10000 );
+	clk.tx_ok = 0;
+	return 0;
+}
+
+static void slave_tx( void )
+{
+	double res;
+	clk.tx_stamp = stamp( local_at( now ) );
+	clk.tx_ok = 1;
+	clk.tx_at = -1;
+	double d = path( 0, &res );
+	put_be( tx_frame + 14 + 8, (uint64_t)llround( res * 65536 ), 8 );
+	put( 0, tx_frame, tx_len, d );
+}
+
+// Frames the slave has to ignore or count as bad. Returns what it should
+// count.
+static int noise( void )
+{
+	uint8_t f[96];
+	int len;
+	double res;
+	struct master * a = &masters[0];
+	uint8_t * p;
+	switch( rand() % 7 )
+	{
+	case 0: // Another domain, better and 5 s off.
+		send_announce( &masters[2] );
+		send_sync( &masters[2] );
+		return 0;
+	case 1: // Cut short.
+		p = frame( f, &len, a, PTP_SYNC, 44, a->sync_seq - 1, 0, 0 );
+		len = 14 + ( sc->vlan ? 4 : 0 ) + rand() % 44;
+		put_be( p + 2, 44, 2 );
+		put( 1, f, len, path( 1, &res ) );
+		return 1;
+	case 2: // PTPv1
+		p = frame( f, &len, a, PTP_FOLLOW_UP, 44, a->sync_seq - 1, 0, 0 );
+		p[1] = 1;
+		put_time( p + 34, master_time( a ) + 1000000 );
+		put( 1, f, len, path( 1, &res ) );
+		return 1;
+	case 3: // Not PTP.
+		p = frame( f, &len, a, PTP_SYNC, 44, 0, 0, 0 );
+		p[-2] = 0x08;
+		p[-1] = 0x00;
+		put( 1, f, len, path( 1, &res ) );
+		return 0;
+	case 4: // For another slave, the same sequence number.
+		p = frame( f, &len, a, PTP_DELAY_RESP, 54, ptp.req_seq, 0, 0 );
+		put_time( p + 34, master_time( a ) + 1000000 );
+		memcpy( p + 44, "\x02\x00\x00\xff\xfe\x00\x00\x01\x00\x01", 10 );
+		put( 1, f, len, path( 1, &res ) );
+		return 0;
+	case 5: // A Follow_Up for another Sync.
+		p = frame( f, &len, a, PTP_FOLLOW_UP, 44, a->sync_seq + 100, 0, 0 );
+		put_time( p + 34, master_time( a ) + 1000000 );
+		put( 1, f, len, path( 1, &res ) );
+		return 0;
+	default: // A worse master, 5 s off, while there's a better one.
+		if( !a->on ) return 0;
+		send_announce( &masters[3] );
+		send_sync( &masters[3] );
+		return 0;
+	}
+}
+
+static const char * state_names[] = { "listening", "uncalibrated", "slave" };
+
+int main( int argc, char ** argv )
+{
+	int seed = 1, only = -1, verbose = 0, c;
+	while( ( c = getopt( argc, argv, "r:s:v" ) ) != -1 )
+	{
+		switch( c )
+		{
+		case 'r': seed = atoi( optarg ); break;
+		case 's': only = atoi( optarg ); break;
+		case 'v': verbose = 1; break;
+		default:
+			fprintf( stderr, "usage: ptpsim [-r seed] [-s scenario] [-v]\n"
+				"  -v prints the slave once a second\n" );
+			return 1;
+		}
+	}
+	srand( seed );
+
+	int failed = 0;
+	for( int n = 0; n < (int)( sizeof( scenarios ) / sizeof( scenarios[0] ) ); n++ )
+	{
+		if( only >= 0 && n != only ) continue;
+		sc = &scenarios[n];
+		memset( masters, 0, sizeof( masters ) );
+		memset( &clk, 0, sizeof( clk ) );
+		wired = 0;
+		last_at[0] = last_at[1] = 0;
+		violations = 0;
+		delay_reqs = 0;
+		now = 0;
+
+		static const uint8_t ds_a[14] = { 128, 6, 0x21, 0x43, 0x6a, 128, 0, 0x11, 0x22, 0xff, 0xfe, 0x33, 0x44, 0x55 };
+		static const uint8_t ds_b[14] = { 100, 6, 0x21, 0x43, 0x6a, 128, 0, 0x66, 0x77, 0xff, 0xfe, 0x88, 0x99, 0xaa };
+		static const uint8_t ds_d[14] = { 128, 248, 0xfe, 0xff, 0xff, 128, 0, 0xdd, 0xdd, 0xff, 0xfe, 0xdd, 0xdd, 0xdd };
+		for( int i = 0; i < 4; i++ )
+		{
+			struct master * m = &masters[i];
+			static const uint8_t macs[4][6] = {
+				{ 0x00, 0x11, 0x22, 0x33, 0x44, 0x55 }, { 0x00, 0x66, 0x77, 0x88, 0x99, 0xaa },
+				{ 0x00, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc }, { 0x00, 0xdd, 0xdd, 0xdd, 0xdd, 0xdd } };
+			memcpy( m->mac, macs[i], 6 );
+			memcpy( m->ds, i == 0 ? ds_a : i == 3 ? ds_d : ds_b, 14 );
+			m->domain = i == 2 ? 1 : PTP_DOMAIN;
+			m->offset = i == 0 ? 0 : i == 1 ? 1e9 : 5e9;
+			m->log_sync = sc->log_sync;
+			m->log_announce = 1;
+			m->next_sync = (int64_t)( rnd() * ptp_interval( m->log_sync ) );
+			m->next_announce = (int64_t)( rnd() * 1e9 );
+			m->on = i == 0;
+		}
+		clk.base = masters[0].offset + sc->offset;
+		clk.tx_at = -1;
+
+		uint8_t mac[6];
+		memcpy( mac, slave_mac, 6 );
+		PTPInit( mac );
+
+		int64_t end = (int64_t)sc->seconds * 1000000000;
+		int64_t half = end / 2;
+		int64_t next_poll = 0, next_noise = 250000000, next_print = 0;
+		int64_t locked_at = -1, from = sc->event == 1 ? half + 60000000000LL : sc->event == 2 ? half / 2 : end / 2;
+		int64_t to = sc->event == 2 ? half : end;
+		int bad = 0, lost = 0;
+		double expect = -( sc->to_slave - sc->to_master ) / 2;
+		double sum = 0, sq = 0, worst = 0, at_loss = 0;
+		long samples = 0;
+		uint32_t steps_before = 0;
+
+		while( now < end )
+		{
+			// The next thing to happen.
+			int64_t t = next_poll;
+			int what = 0, w = -1;
+			if( next_noise < t ) t = next_noise, what = 1;
+			if( clk.tx_at >= 0 && clk.tx_at < t ) t = clk.tx_at, what = 2;
+			for( int i = 0; i < wired; i++ )
+				if( wire[i].at < t ) t = wire[i].at, what = 3, w = i;
+			for( int i = 0; i < 4; i++ )
+			{
+				if( !masters[i].on || i >= 2 ) continue;
+				if( masters[i].next_sync < t ) t = masters[i].next_sync, what = 4, w = i;
+				if( masters[i].next_announce < t ) t = masters[i].next_announce, what = 5, w = i;
+			}
+			now = t;
+
+			switch( what )
+			{
+			case 0:
+			{
+				// The main loop, and the temperature.
+				next_poll = now + 1000000;
+				rebase();
+				clk.ppm = sc->ppm + sc->wander * sin( 2 * M_PI * now * 1e-9 / sc->wander_s );
+
+				if( sc->event == 1 && now >= half && !masters[1].on )
+				{
+					masters[1].on = 1;
+					masters[1].next_sync = now + (int64_t)( rnd() * ptp_interval( masters[1].log_sync ) );
+					masters[1].next_announce = now;
+					steps_before = ptp.steps;
+				}
+				if( sc->event == 2 && now >= half && masters[0].on )
+				{
+					masters[0].on = 0;
+					at_loss = local_at( now ) - ( now + masters[0].offset );
+				}
+
+				PTPPoll();
+
+				struct master * m = &masters[sc->event == 1 && now >= half ? 1 : 0];
+				double err = local_at( now ) - ( now + m->offset );
+				if( ptp.state == PTP_SLAVE && locked_at < 0 ) locked_at = now;
+				if( now >= from && now < to )
+				{
+					double e = err - expect;
+					sum += e;
+					sq += e * e;
+					if( fabs( e ) > worst ) worst = fabs( e );
+					samples++;
+				}
+				if( sc->event == 2 && now >= half + 3 * 2 * 1000000000LL + 100000000 && ptp.state != PTP_LISTENING && !lost )
+				{
+					violation( "master not given up" );
+					lost = 1;
+				}
+				if( verbose && now >= next_print )
+				{
+					next_print += 1000000000;
+					printf( "%4.0f s  %-12s  offset %9lld ns  error %12.0f ns  delay %6lld ns  %7d ppb\n",
+						now * 1e-9, state_names[ptp.state], (long long)ptp.offset, err, (long long)ptp.delay, ptp.ppb );
+				}
+				break;
+			}
+			case 1:
+				next_noise = now + 50000000 + (int64_t)( rnd() * 400000000 );
+				bad += noise();
+				break;
+			case 2:
+				slave_tx();
+				break;
+			case 3:
+			{
+				uint8_t data[96];
+				int len = wire[w].len, to_slave = wire[w].to_slave;
+				memcpy( data, wire[w].data, len );
+				wire[w] = wire[--wired];
+				if( to_slave )
+					PTPRx( data, len, stamp( local_at( now ) ) );
+				else
+					master_rx( data, len );
+				break;
+			}
+			case 4:
+				masters[w].next_sync += ptp_interval( masters[w].log_sync );
+				send_sync( &masters[w] );
+				break;
+			case 5:
+				masters[w].next_announce += ptp_interval( masters[w].log_announce );
+				send_announce( &masters[w] );
+				break;
+			}
+		}
+
+		printf( "%s\n", sc->name );
+		double rms = samples ? sqrt( sq / samples ) : 0;
+		double mean = samples ? sum / samples : 0;
+		double true_delay = ( sc->to_slave + sc->to_master ) / 2 + sc->jitter;
+		printf( "  locked after %.0f s, %u steps, error %+.0f ns mean, %.0f ns rms, %.0f ns max, delay %lld ns (%.0f), %ld Delay_Reqs\n",
+			locked_at < 0 ? -1 : locked_at * 1e-9, ptp.steps, mean, rms, worst, (long long)ptp.delay, true_delay, delay_reqs );
+		if( sc->event == 2 )
+			printf( "  %s at the end, %.0f ns off when the master stopped, %.0f ns after %d s on its own\n",
+				state_names[ptp.state], at_loss, local_at( now ) - ( now + masters[0].offset ), sc->seconds / 2 );
+
+		if( locked_at < 0 || locked_at > 60000000000LL ) violation( "didn't lock within 60 s" );
+		if( sc->event != 2 && ptp.state != PTP_SLAVE ) violation( "not locked at the end" );
+		if( !samples || worst > 1000 ) violation( "error over 1 us" );
+		if( sc->event == 1 && ptp.steps == steps_before ) violation( "didn't step onto the better master" );
+		if( sc->event != 2 && ( ptp.delay - true_delay > 300 || ptp.delay - true_delay < -300 ) ) violation( "path delay" );
+		if( (int)ptp.bad != bad ) violation( "bad frames counted wrong" );
+		if( violations )
+		{
+			printf( "  FAILED, %ld violations\n", violations );
+			failed = 1;
+		}
+	}
+
+	// Anything at all into PTPRx(), for the sanitizers.
+	if( only < 0 )
+	{
+		sc = &scenarios[5];
+		memset( masters, 0, sizeof( masters ) );
+		memcpy( masters[0].ds, "\x80\x06\x21\x43\x6a\x80\x00\x11\x22\xff\xfe\x33\x44\x55", 14 );
+		PTPInit( slave_mac );
+		violations = 0;
+		for( long i = 0; i < 1000000; i++ )
+		{
+			uint8_t f[96];
+			int len;
+			uint8_t * p = frame( f, &len, &masters[0], ( rand() % 12 ), 34 + rand() % 40, rand() % 4, rand() % 256 - 128, rnd() * 1e9 );
+			for( int k = rand() % 4; k > 0; k-- )
+				p[rand() % 64] = rand();
+			put_time( p + 34, EPOCH + (int64_t)( rnd() * 1e18 ) );
+			now += 1000000;
+			PTPRx( f, rand() % ( len + 1 ), stamp( local_at( now ) ) );
+			if( i % 8 == 0 ) PTPPoll();
+			if( clk.tx_at >= 0 ) slave_tx(), wired = 0;
+		}
+		printf( "1000000 random frames, %u bad, %u steps\n", ptp.bad, ptp.steps );
+		if( violations ) failed = 1;
+	}
+	return failed ? 2 : 0;
+}
@@ -0,0 +1,593 @@
+/* Tests the generators of lib_rand.h on the host: known answers, the fill
+	functions against the generators, and a few statistical tests on each.
+	Built with RANDSIM_RNG, the RNG code of the CH32V30x runs unmodified
+	against a model of the RNG, on the register traps of misc/ethsim. Then
+	the speed of each. See README.md.
+*/
+
+#ifdef RANDSIM_RNG
+#include "ch32fun.h"
+#include "ethsim.h"
+#else
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#endif
+
+#include <getopt.h>
+#include <math.h>
+#include <time.h>
+
+// A clock for SysTick, and, without the RNG, a noisy ADC: a level that
+// wanders, plus a bit or two of noise.
+static uint32_t ticks;
+static uint64_t adc_state = 88172645463325252ull;
+static uint32_t adc_reads;
+
+static int adc_read( void )
+{
+	adc_state ^= adc_state << 13;
+	adc_state ^= adc_state >> 7;
+	adc_state ^= adc_state << 17;
+	adc_reads++;
+	ticks += 200 + ( adc_state & 7 );
+	return 2048 + ( adc_reads >> 10 & 15 ) + ( adc_state >> 40 & 3 );
+}
+
+#define RANDOM_TICKS() ( ticks += 3 )
+#ifndef RANDSIM_RNG
+#define RANDOM_ADC_READ() adc_read()
+#endif
+
+// lib_rand.h's rand() and seed() aren't the C library's.
+#define rand rand_lib
+#define seed seed_lib
+#include "lib_rand.h"
+#undef rand
+#undef seed
+
+static int failures;
+static uint32_t violations;
+
+static void fail( const char * what, uint64_t got, uint64_t want )
+{
+	if( failures++ < 10 )
+		printf( "FAIL %s: got %llx, want %llx\n", what, (unsigned long long)got, (unsigned long long)want );
+}
+
+static void violation( const char * what )
+{
+	if( violations++ < 10 ) printf( "violation: %s\n", what );
+}
+
+// The references, as their authors have them.
+
+static uint32_t ref_rotl( uint32_t x, int k )
+{
+	return ( x << k ) | ( x >> ( 32 - k ) );
+}
+
+static uint32_t ref_xoshiro_s[4];
+
+static uint32_t ref_xoshiro( void )
+{
+	uint32_t * s = ref_xoshiro_s;
+	const uint32_t result = ref_rotl( s[1] * 5, 7 ) * 9;
+	const uint32_t t = s[1] << 9;
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = ref_rotl( s[3], 11 );
+	return result;
+}
+
+static void check_known( void )
+{
+	// pcg32-demo, pcg32_srandom_r( &rng, 42, 54 )
+	static const uint32_t pcg[6] = { 0xa15c02b7, 0x7b47f409, 0xba1d3330, 0x83d2f293, 0xbfa4784b, 0xcbed606e };
+	pcg32_state p;
+	pcg32_seed( &p, 42, 54 );
+	for( int i = 0; i < 6; i++ )
+	{
+		uint32_t v = pcg32( &p );
+		if( v != pcg[i] ) fail( "pcg32( 42, 54 )", v, pcg[i] );
+	}
+
+	// Marsaglia's first from 1
+	uint32_t x = 1;
+	if( xorshift32( &x ) != 270369 ) fail( "xorshift32 from 1", x, 270369 );
+
+	xoshiro128_state s;
+	for( uint32_t seedv = 0; seedv < 1000; seedv++ )
+	{
+		xoshiro128_seed( &s, seedv * 0x01000193 );
+		if( !( s.s[0] | s.s[1] | s.s[2] | s.s[3] ) ) fail( "xoshiro128_seed gave 0", seedv, 1 );
+		memcpy( ref_xoshiro_s, s.s, 16 );
+		for( int i = 0; i < 100; i++ )
+		{
+			uint32_t a = xoshiro128( &s ), b = ref_xoshiro();
+			if( a != b ) fail( "xoshiro128", a, b );
+		}
+		uint32_t xs;
+		xorshift32_seed( &xs, seedv );
+		if( !xs ) fail( "xorshift32_seed gave 0", seedv, 1 );
+	}
+	xorshift32_seed( &x, 0x61c88646 ); // the one seed that mixes to 0
+	if( !x ) fail( "xorshift32_seed gave 0", 0x61c88646, 1 );
+
+#ifdef RANDOM_STRENGTH
+	// examples/random_numbers
+	static const uint32_t lfsr[4] = { 3443170572u, 2761041505u, 3238759778u, 3045866432u };
+	seed_lib( 0x12345678 );
+	for( int i = 0; i < 4; i++ )
+	{
+		uint32_t v = rand_lib();
+		if( v != lfsr[i] ) fail( "LFSR strength 2 from 0x12345678", v, lfsr[i] );
+	}
+#endif
+}
+
+// The fills against the generators, at every alignment and tail.
+static void check_fill( void )
+{
+	static uint8_t buf[80], want[80];
+	for( int off = 0; off < 4; off++ )
+		for( uint32_t len = 0; len < 70; len++ )
+		{
+			uint32_t x0, x1;
+			xorshift32_seed( &x0, len );
+			x1 = x0;
+			memset( buf, 0xa5, sizeof( buf ) );
+			memcpy( want, buf, sizeof( want ) );
+			xorshift32_fill( &x0, buf + off, len );
+			for( uint32_t i = 0; i < len; i += 4 )
+			{
+				uint32_t w = xorshift32( &x1 );
+				for( uint32_t j = i; j < len && j < i + 4; j++, w >>= 8 ) want[off + j] = w;
+			}
+			if( memcmp( buf, want, sizeof( buf ) ) || x0 != x1 ) fail( "xorshift32_fill", off, len );
+
+			xoshiro128_state s0, s1;
+			xoshiro128_seed( &s0, len );
+			s1 = s0;
+			memset( buf, 0xa5, sizeof( buf ) );
+			memcpy( want, buf, sizeof( want ) );
+			xoshiro128_fill( &s0, buf + off, len );
+			for( uint32_t i = 0; i < len; i += 4 )
+			{
+				uint32_t w = xoshiro128( &s1 );
+				for( uint32_t j = i; j < len && j < i + 4; j++, w >>= 8 ) want[off + j] = w;
+			}
+			if( memcmp( buf, want, sizeof( buf ) ) || memcmp( &s0, &s1, sizeof( s0 ) ) ) fail( "xoshiro128_fill", off, len );
+
+			pcg32_state p0, p1;
+			pcg32_seed( &p0, len, off );
+			p1 = p0;
+			memset( buf, 0xa5, sizeof( buf ) );
+			memcpy( want, buf, sizeof( want ) );
+			pcg32_fill( &p0, buf + off, len );
+			for( uint32_t i = 0; i < len; i += 4 )
+			{
+				uint32_t w = pcg32( &p1 );
+				for( uint32_t j = i; j < len && j < i + 4; j++, w >>= 8 ) want[off + j] = w;
+			}
+			if( memcmp( buf, want, sizeof( buf ) ) || p0.state != p1.state ) fail( "pcg32_fill", off, len );
+		}
+}
+
+/* The statistical tests. Each gives a z score, about normal for a good
+	generator, or for the linear complexity the distance from n/2. */
+
+// Linear complexity of n bits, Berlekamp-Massey.
+static int linear_complexity( const uint8_t * s, int n )
+{
+	static uint8_t b[4096], c[4096], t[4096];
+	int l = 0, m = -1;
+	memset( b, 0, n );
+	memset( c, 0, n );
+	b[0] = c[0] = 1;
+	for( int i = 0; i < n; i++ )
+	{
+		int d = s[i];
+		for( int j = 1; j <= l; j++ ) d ^= c[j] & s[i - j];
+		if( !d ) continue;
+		memcpy( t, c, n );
+		for( int j = 0; j + i - m < n; j++ ) c[j + i - m] ^= b[j];
+		if( 2 * l <= i )
+		{
+			l = i + 1 - l;
+			m = i;
+			memcpy( b, t, n );
+		}
+	}
+	return l;
+}
+
+#define NTESTS 7
+static const char * test_names[NTESTS] = {
+	"ones", "worst bit", "bytes", "pairs", "correlation", "LC bit 0", "LC bit 31",
+};
+
+static void stat_tests( uint32_t ( *gen )( void ), uint32_t n, double * z )
+{
+	static uint32_t pairs[65536];
+	uint64_t ones = 0, bit[32] = { 0 }, bytes[256] = { 0 };
+	double sx = 0, sxx = 0, sxy = 0, prev = 0, first = 0;
+	uint32_t last = 0;
+	static uint8_t lc0[2000], lc31[2000];
+
+	memset( pairs, 0, sizeof( pairs ) );
+	for( uint32_t i = 0; i < n; i++ )
+	{
+		uint32_t w = gen();
+		ones += __builtin_popcount( w );
+		for( int b = 0; b < 32; b++ ) bit[b] += w >> b & 1;
+		for( int b = 0; b < 4; b++ ) bytes[w >> ( 8 * b ) & 255]++;
+		if( i ) pairs[( last >> 24 ) << 8 | w >> 24]++;
+		double x = w / 4294967296.0;
+		if( i ) sxy += prev * x;
+		else first = x;
+		sx += x;
+		sxx += x * x;
+		prev = x;
+		last = w;
+		if( i < 2000 )
+		{
+			lc0[i] = w & 1;
+			lc31[i] = w >> 31;
+		}
+	}
+
+	z[0] = ( ones - 16.0 * n ) / sqrt( 8.0 * n );
+	z[1] = 0;
+	for( int b = 0; b < 32; b++ )
+	{
+		double zb = ( bit[b] - n / 2.0 ) / sqrt( n / 4.0 );
+		if( fabs( zb ) > fabs( z[1] ) ) z[1] = zb;
+	}
+	double chi = 0, e = n * 4.0 / 256;
+	for( int i = 0; i < 256; i++ ) chi += ( bytes[i] - e ) * ( bytes[i] - e ) / e;
+	z[2] = ( chi - 255 ) / sqrt( 2 * 255.0 );
+	chi = 0;
+	e = ( n - 1 ) / 65536.0;
+	for( int i = 0; i < 65536; i++ ) chi += ( pairs[i] - e ) * ( pairs[i] - e ) / e;
+	z[3] = e >= 5 ? ( chi - 65535 ) / sqrt( 2 * 65535.0 ) : 0; // too few words for it
+	sxy += prev * first; // circular
+	double r = ( n * sxy - sx * sx ) / ( n * sxx - sx * sx );
+	z[4] = r * sqrt( n );
+	z[5] = n >= 2000 ? ( linear_complexity( lc0, 2000 ) - 1000 ) / 2.0 : 0;
+	z[6] = n >= 2000 ? ( linear_complexity( lc31, 2000 ) - 1000 ) / 2.0 : 0;
+}
+
+// The generators under test, as functions of nothing.
+static uint32_t g_x32;
+static xoshiro128_state g_xo;
+static pcg32_state g_pcg;
+
+static uint32_t gen_lfsr1( void )
+{
+	_rand_lfsr_update();
+	return _rand_lfsr;
+}
+
+static uint32_t gen_lfsr2( void )
+{
+	return _rand_gen_32b();
+}
+
+static uint32_t gen_lfsr3( void )
+{
+	return _rand_gen_32b() ^ _rand_gen_32b();
+}
+
+static uint32_t gen_xorshift32( void )
+{
+	return xorshift32( &g_x32 );
+}
+
+static uint32_t gen_xoshiro128( void )
+{
+	return xoshiro128( &g_xo );
+}
+
+static uint32_t gen_pcg32( void )
+{
+	return pcg32( &g_pcg );
+}
+
+static struct
+{
+	const char * name;
+	uint32_t ( *gen )( void );
+	int must_pass; // the others are known to fail some
+	int entropy;   // slow, fewer words
+} gens[] = {
+	{ "LFSR strength 1", gen_lfsr1, 0, 0 },
+	{ "LFSR strength 2", gen_lfsr2, 0, 0 },
+	{ "LFSR strength 3", gen_lfsr3, 0, 0 },
+	{ "xorshift32", gen_xorshift32, 0, 0 },
+	{ "xoshiro128**", gen_xoshiro128, 1, 0 },
+	{ "pcg32", gen_pcg32, 1, 0 },
+	{ "rand()", rand_lib, 0, 0 },
+	{ "rand_entropy()", rand_entropy, 1, 1 },
+};
+#define NGENS ( sizeof( gens ) / sizeof( gens[0] ) )
+
+// rand_entropy() gets a share of the words, it's slow, more so through traps.
+#ifdef RANDSIM_RNG
+#define ENTROPY_SHARE 256
+#else
+#define ENTROPY_SHARE 16
+#endif
+
+static void check_stats( uint32_t n, uint32_t seedv, int verbose )
+{
+	_rand_lfsr = seedv | 1;
+	xorshift32_seed( &g_x32, seedv );
+	xoshiro128_seed( &g_xo, seedv );
+	pcg32_seed( &g_pcg, seedv, 1 );
+	seed_lib( seedv );
+
+#ifdef RANDOM_STRENGTH
+	gens[6].must_pass = 0;
+#else
+	gens[6].must_pass = 1;
+#endif
+
+	if( verbose )
+	{
+		printf( "\n%-16s", "" );
+		for( int t = 0; t < NTESTS; t++ ) printf( "%12s", test_names[t] );
+		printf( "\n" );
+	}
+	for( uint32_t g = 0; g < NGENS; g++ )
+	{
+		double z[NTESTS];
+		int bad = 0;
+		if( !gens[g].gen ) continue;
+		stat_tests( gens[g].gen, gens[g].entropy ? n / ENTROPY_SHARE : n, z );
+		for( int t = 0; t < NTESTS; t++ )
+			if( fabs( z[t] ) > 5 ) bad |= 1 << t;
+		if( verbose )
+		{
+			printf( "%-16s", gens[g].name );
+			for( int t = 0; t < NTESTS; t++ ) printf( "%11.1f%s", z[t], bad >> t & 1 ? "*" : " " );
+			printf( "\n" );
+		}
+		if( bad && gens[g].must_pass ) fail( gens[g].name, bad, 0 );
+	}
+}
+
+#ifdef RANDSIM_RNG
+
+/* The RNG of the CH32V30x. A word is ready a few SR reads after the one
+	before was taken. Now and then a seed error, which holds DRDY off until
+	RNGEN goes off and on, or a word the same as the one before. -f stops
+	it for good, to see the SysTick fallback. */
+
+static uint8_t * rcc, * rng;
+static struct
+{
+	int on, ready_in, seed_error, stuck, taken;
+	uint32_t last, words, errors, repeats, since_error;
+	double p_error, p_repeat;
+} m = { .p_error = 0.001, .p_repeat = 0.001 };
+static uint64_t m_state = 0x2545f4914f6cdd1dull;
+
+static uint32_t m_rand( void )
+{
+	m_state ^= m_state >> 12;
+	m_state ^= m_state << 25;
+	m_state ^= m_state >> 27;
+	return ( m_state * 0x2545f4914f6cdd1dull ) >> 32;
+}
+
+static void rng_next( void )
+{
+	if( m.stuck ) return;
+	if( m_rand() < m.p_error * 4294967296.0 )
+	{
+		m.seed_error = 1;
+		m.errors++;
+		ETHSIM_REG( rng, RNG_TypeDef, SR ) = RNG_SR_SECS | RNG_SR_SEIS;
+		return;
+	}
+	uint32_t w = m_rand();
+	if( m_rand() < m.p_repeat * 4294967296.0 )
+	{
+		w = m.last;
+		m.repeats++;
+	}
+	ETHSIM_REG( rng, RNG_TypeDef, DR ) = m.last = w;
+	m.ready_in = 1 + m_rand() % 4;
+}
+
+static void rng_pre( uint32_t off )
+{
+	off -= RNG_BASE & 0xfff;
+	if( !( ETHSIM_REG( rcc, RCC_TypeDef, AHBPCENR ) & RCC_AHBPeriph_RNG ) ) violation( "RNG not clocked" );
+	if( m.taken && m.on && !m.seed_error )
+	{
+		m.taken = 0;
+		rng_next();
+	}
+	uint32_t sr = ETHSIM_REG( rng, RNG_TypeDef, SR );
+	if( off == offsetof( RNG_TypeDef, SR ) && m.on && !m.seed_error && !( sr & RNG_SR_DRDY ) && m.ready_in && !--m.ready_in )
+		ETHSIM_REG( rng, RNG_TypeDef, SR ) = sr | RNG_SR_DRDY;
+	if( off == offsetof( RNG_TypeDef, DR ) )
+	{
+		if( !( sr & RNG_SR_DRDY ) ) violation( "DR read without DRDY" );
+		else
+		{
+			// DR reads as it is, the next word comes after
+			m.words++;
+			m.taken = 1;
+			ETHSIM_REG( rng, RNG_TypeDef, SR ) = sr & ~RNG_SR_DRDY;
+		}
+	}
+}
+
+static void rng_post( uint32_t off, const uint8_t * old )
+{
+	(void)old;
+	off -= RNG_BASE & 0xfff;
+	if( off == offsetof( RNG_TypeDef, SR ) )
+	{
+		// SEIS is cleared by writing 0, the rest are read only
+		uint32_t w = ETHSIM_REG( rng, RNG_TypeDef, SR );
+		ETHSIM_REG( rng, RNG_TypeDef, SR ) = m.seed_error ? RNG_SR_SECS | ( w & RNG_SR_SEIS ) : 0;
+		return;
+	}
+	if( off != offsetof( RNG_TypeDef, CR ) ) return;
+	int on = ( ETHSIM_REG( rng, RNG_TypeDef, CR ) & RNG_CR_RNGEN ) != 0;
+	if( !on )
+	{
+		m.on = 0;
+		m.seed_error = 0;
+		ETHSIM_REG( rng, RNG_TypeDef, SR ) &= RNG_SR_SEIS;
+	}
+	else if( !m.on )
+	{
+		m.on = 1;
+		m.taken = 0;
+		rng_next();
+	}
+}
+
+// Every word from the RNG, none the same as the one before, and none while
+// it's in a seed error.
+static void check_rng( uint32_t n )
+{
+	uint32_t prev = 0, from_rng = 0;
+	for( uint32_t i = 0; i < n && failures < 10; i++ )
+	{
+		uint32_t w;
+		if( _rand_rng_word( &w ) )
+		{
+			from_rng++;
+			if( w == prev && i ) fail( "a word the same as the one before", w, 0 );
+			prev = w;
+		}
+		else if( !m.stuck ) fail( "no word from the RNG", i, 0 );
+	}
+	if( m.stuck && from_rng > 1 ) fail( "words from a stopped RNG", from_rng, 1 );
+	printf( "%u words read, %u given, %u seed errors, %u repeats, %u thrown away\n",
+		m.words, from_rng, m.errors, m.repeats, rand_entropy_errors );
+	if( !m.stuck && rand_entropy_errors < m.errors + m.repeats ) fail( "errors not counted", rand_entropy_errors, m.errors + m.repeats );
+}
+
+static void model_init( void )
+{
+	ethsim_init_traps();
+	rcc = ethsim_map( RCC_BASE, 0x1000, 0, 0 );
+	rng = ethsim_map( RNG_BASE & ~0xfff, 0x1000, rng_pre, rng_post ) + ( RNG_BASE & 0xfff );
+}
+
+#endif
+
+// Speed on this host: ns a word, and fill rates.
+static volatile uint32_t sink;
+
+static double seconds( void )
+{
+	struct timespec t;
+	clock_gettime( CLOCK_MONOTONIC, &t );
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static void bench( void )
+{
+	static uint32_t buf[16384 + 1];
+	printf( "\nns a word on this host\n" );
+	for( uint32_t g = 0; g < NGENS - 1; g++ )
+	{
+		uint32_t n = g < 3 ? 1 << 20 : 1 << 26, c = 0;
+		double t0 = seconds();
+		for( uint32_t i = 0; i < n; i++ ) c += gens[g].gen();
+		double t = seconds() - t0;
+		sink = c;
+		printf( "  %-16s %6.2f\n", gens[g].name, t / n * 1e9 );
+	}
+
+	static const uint32_t sizes[] = { 16, 64, 256, 4096, 65536 };
+	printf( "\nfill, MB/s on this host%10s", "" );
+	for( int s = 0; s < 5; s++ ) printf( "%9u", sizes[s] );
+	printf( "\n" );
+	for( int f = 0; f < 3; f++ )
+	{
+		static const char * names[] = { "xorshift32_fill", "xoshiro128_fill", "pcg32_fill" };
+		printf( "  %-31s", names[f] );
+		for( int s = 0; s < 5; s++ )
+		{
+			uint32_t n = sizes[s], reps = ( 256 << 20 ) / n;
+			double t0 = seconds();
+			for( uint32_t r = 0; r < reps; r++ )
+			{
+				if( f == 0 ) xorshift32_fill( &g_x32, buf, n );
+				else if( f == 1 ) xoshiro128_fill( &g_xo, buf, n );
+				else pcg32_fill( &g_pcg, buf, n );
+				sink = buf[r & 3];
+			}
+			printf( "%9.0f", (double)reps * n / ( seconds() - t0 ) / 1e6 );
+		}
+		printf( "\n" );
+	}
+}
+
+int main( int argc, char ** argv )
+{
+	uint32_t n = 1 << 22, seedv = 1;
+	int do_bench = 0, verbose = 1, c;
+	while( ( c = getopt( argc, argv, "n:r:bqf" ) ) != -1 )
+	{
+		switch( c )
+		{
+		case 'n': n = atoi( optarg ); break;
+		case 'r': seedv = atoi( optarg ); break;
+		case 'b': do_bench = 1; break;
+		case 'q': verbose = 0; break;
+#ifdef RANDSIM_RNG
+		case 'f': m.stuck = 1; break;
+#endif
+		default:
+			fprintf( stderr, "usage: randsim [-n words] [-r seed] [-b] [-q] [-f]\n" );
+			return 1;
+		}
+	}
+	if( n < 65536 ) n = 65536;
+	adc_state += seedv;
+
+#ifdef RANDSIM_RNG
+	m_state += seedv;
+	model_init();
+	printf( "RNG model, %s\n", m.stuck ? "stopped" : "seed errors and repeats" );
+#elif defined( RANDOM_STRENGTH )
+	printf( "rand() the LFSR, strength %d\n", RANDOM_STRENGTH );
+#else
+	printf( "rand() xoshiro128**, entropy from an ADC model\n" );
+#endif
+
+	check_known();
+	check_fill();
+
+#ifdef RANDSIM_RNG
+	check_rng( m.stuck ? 20 : n / 64 );
+	if( m.stuck ) gens[NGENS - 1].gen = 0; // only SysTick, nothing to test
+#endif
+	check_stats( n, seedv, verbose );
+
+#ifndef RANDOM_STRENGTH
+	rand_seed_entropy();
+	if( !( _rand_state.s[0] | _rand_state.s[1] | _rand_state.s[2] | _rand_state.s[3] ) ) fail( "rand_seed_entropy gave 0", 0, 1 );
+	uint8_t b[7];
+	rand_fill( b, 7 );
+#endif
+
+	if( violations ) fail( "violations", violations, 0 );
+	printf( failures ? "FAILED\n" : "ok\n" );
+	if( do_bench && !failures ) bench();
+	return failures ? 2 : 0;
+}
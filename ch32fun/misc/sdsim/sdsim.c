@@ -0,0 +1,875 @@
+/* Runs lib_sdcard.h against a model of an SD card, to check the protocol
+	and the data, and to see what throughput and write latency the driver
+	gets out of a card. See README.md.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+
+static uint64_t now;            // ns, virtual
+
+static void card_power_on( void );
+static void card_clock( int div, int wide );
+static int card_cmd( int cmd, uint32_t arg, int flags, uint32_t * r );
+static void card_data( const void * buf, int blocks, int to_card );
+static int card_data_busy( void );
+static void card_data_abort( void );
+static void stream_done( uint32_t lba, uint32_t blocks, uint32_t ticks );
+
+#define SD_TICKS() ( (uint32_t)( now / 1000 ) )
+#define SD_TICKS_MS( ms ) ( ( ms ) * 1000 )
+#define SD_HW_INIT()                    card_power_on()
+#define SD_HW_CLOCK( div, wide )        card_clock( div, wide )
+#define SD_HW_CMD( cmd, arg, flags, r ) card_cmd( cmd, arg, flags, r )
+#define SD_HW_DATA( buf, n, to_card )   card_data( buf, n, to_card )
+#define SD_HW_DATA_BUSY()               card_data_busy()
+#define SD_HW_DATA_ABORT()              card_data_abort()
+#define SD_STREAM_DONE( lba, n, t )     stream_done( lba, n, t )
+#define SD_CLK_DIV 4                    // 24 MHz from 144 MHz
+
+#include "lib_sdcard.h"
+
+#define HCLK 144000000.0
+
+// The card. Its timing, ns:
+static uint64_t t_nac = 100000;       // a read command to its first block
+static uint64_t t_prog = 34000;       // programming a block, about 15 MB/s
+static int buf_blocks = 8;            // blocks the card takes before it holds busy
+static uint64_t t_open = 150000;      // a write command
+static uint64_t t_single = 500000;    // extra for CMD24, a partial page
+static uint64_t t_seg = 1000000;      // erasing a 64 kB segment while writing
+static uint64_t t_seg_pre = 100000;   // the same when told ahead (ACMD23, CMD38)
+static uint64_t t_stall_max = 40000000; // now and then on a new 4 MB unit
+static double err_rate;               // response and data CRC errors, per command / block
+
+#define SEG_BLOCKS 128
+#define AU_BLOCKS  8192
+
+enum { IDLE, READY, IDENT, STBY, TRAN, DATA, RCV, PRG };
+enum { CARD_HC, CARD_SC2, CARD_SC1 };
+
+static struct
+{
+	int type;
+	uint32_t blocks;
+	uint8_t * mem;
+	uint8_t * seg;          // per segment: 0 written, 1 erased, 2 being written
+	int state;
+	uint32_t rca;
+	int app;
+	int hcs;                // the host asked for high capacity
+	int polls;              // ACMD41 answers busy this many more times
+	uint32_t pending;       // errors for the next R1
+	int wide;               // bus width set on the card
+	int host_wide;          // and on the host
+	double clk;             // ns per bus clock
+	uint32_t addr;          // block of the next read or write
+	uint32_t xfer_addr;     // where the command started
+	int multi;
+	uint32_t hint;          // ACMD23
+	uint32_t erase_start, erase_end;
+	int erase_set;
+	uint64_t prog_end;      // programming done
+	uint64_t busy_until;    // holds DAT0 low until then
+	uint64_t xfer_end;      // a CMD17 or CMD24 is done with its block
+	uint32_t last_au;
+	int write_err;
+	int inject;
+} card;
+
+static struct
+{
+	int active;
+	int to_card;
+	int started;
+	uint8_t * buf;
+	uint32_t blocks;
+	uint32_t ok;            // blocks through before an error
+	int err;
+	uint32_t addr;
+	uint64_t end;
+	uint64_t timeout;
+	uint64_t * block_end;
+} dma;
+
+static struct
+{
+	uint32_t cmds[64];
+	uint32_t acmd23;
+	uint32_t crc_injected;
+	uint32_t violations;
+} stats;
+
+static uint64_t rng_state = 1;
+static uint32_t rnd( void )
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return (uint32_t)( rng_state >> 16 );
+}
+static double rndf( void ) { return rnd() / 4294967296.0; }
+static int inject( void ) { return card.inject && err_rate > 0 && rndf() < err_rate; }
+static int errors_on( void ) { return card.inject && err_rate > 0; }
+
+static void violation( const char * what )
+{
+	if( stats.violations++ < 10 ) printf( "VIOLATION at %.3f ms: %s\n", now / 1e6, what );
+}
+
+static void card_new( int type, uint32_t blocks )
+{
+	free( card.mem );
+	free( card.seg );
+	memset( &card, 0, sizeof( card ) );
+	card.type = type;
+	card.blocks = blocks;
+	card.mem = malloc( (size_t)blocks * 512 );
+	card.seg = calloc( blocks / SEG_BLOCKS + 1, 1 );
+	for( size_t i = 0; i < (size_t)blocks * 512; i++ ) card.mem[i] = rnd();
+	card.last_au = ~0u;
+}
+
+static void card_power_on( void )
+{
+	card.state = IDLE;
+	card.rca = 0;
+	card.app = card.wide = card.host_wide = 0;
+	card.polls = 3;
+	card.pending = 0;
+	card.clk = 1e9 / 400000;
+	memset( &dma, 0, sizeof( dma ) );
+	now += 2000000;
+}
+
+static void card_clock( int div, int wide )
+{
+	card.clk = 1e9 * ( div + 2 ) / HCLK;
+	card.host_wide = wide;
+}
+
+static void card_close_segments( void );
+
+static void card_tick( void )
+{
+	if( card.state == PRG && now >= card.prog_end ) card.state = TRAN;
+	if( card.state == DATA && !card.multi && now >= card.xfer_end ) card.state = TRAN;
+	if( card.state == RCV && !card.multi && card.addr != card.xfer_addr && now >= card.xfer_end )
+	{
+		card.state = PRG;
+		card.busy_until = card.prog_end;
+		card_close_segments();
+	}
+}
+
+static uint32_t card_status( uint32_t err )
+{
+	int ready = card.state != PRG && now >= card.busy_until;
+	uint32_t s = card.pending | err | (uint32_t)card.state << 9 | ( ready ? SD_R1_READY : 0 ) | ( card.app ? 0x20 : 0 );
+	card.pending = 0;
+	return s;
+}
+
+static uint64_t block_ns( void )
+{
+	return (uint64_t)( ( card.wide ? 1024 + 16 + 2 + 8 : 4096 + 16 + 2 + 8 ) * card.clk );
+}
+
+// Block address from a command argument, or ~0 with the error bits set.
+static uint32_t card_addr( uint32_t arg, uint32_t * err )
+{
+	uint32_t a = arg;
+	if( card.type != CARD_HC )
+	{
+		if( arg & 511 ) { *err |= 0x40000000; return ~0u; }   // ADDRESS_ERROR
+		a = arg / 512;
+	}
+	if( a >= card.blocks ) { *err |= 0x80000000; return ~0u; } // OUT_OF_RANGE
+	return a;
+}
+
+static void card_csd( uint32_t * r )
+{
+	// Bits hi..lo of the 128 bit register, r[0] most significant.
+	#define SET( hi, lo, v ) for( int b = lo; b <= hi; b++ ) if( ( ( v ) >> ( b - lo ) ) & 1 ) r[3 - b / 32] |= 1u << ( b % 32 )
+	memset( r, 0, 16 );
+	if( card.type == CARD_HC )
+	{
+		SET( 127, 126, 1 );
+		SET( 69, 48, card.blocks / 1024 - 1 );
+	}
+	else if( card.type == CARD_SC2 )
+	{
+		// 1024 byte READ_BL_LEN, as 2 GB cards have
+		SET( 83, 80, 10 );
+		SET( 49, 47, 7 );
+		SET( 73, 62, card.blocks / 1024 - 1 );
+	}
+	else
+	{
+		SET( 83, 80, 9 );
+		SET( 49, 47, 7 );
+		SET( 73, 62, card.blocks / 512 - 1 );
+	}
+	#undef SET
+}
+
+// What programming a block costs, with the erases and stalls it brings.
+static uint64_t card_prog( uint32_t lba )
+{
+	uint64_t t = t_prog;
+	uint8_t * s = &card.seg[lba / SEG_BLOCKS];
+	if( *s == 0 ) t += t_seg;
+	*s = 2;
+	if( lba / AU_BLOCKS != card.last_au )
+	{
+		// Every fourth unit, the same ones each time, so runs compare.
+		uint32_t h = ( lba / AU_BLOCKS + 1 ) * 2654435761u;
+		card.last_au = lba / AU_BLOCKS;
+		if( h % 4 == 0 ) t += t_stall_max / 8 + ( h >> 8 ) % ( t_stall_max * 7 / 8 );
+	}
+	return t;
+}
+
+static void card_close_segments( void )
+{
+	for( uint32_t i = 0; i <= card.blocks / SEG_BLOCKS; i++ )
+		if( card.seg[i] == 2 ) card.seg[i] = 0;
+}
+
+static void card_start_read( void )
+{
+	if( !dma.active || dma.to_card || dma.started )
+	{
+		violation( "read data without the DPSM armed for it" );
+		return;
+	}
+	if( !card.multi && dma.blocks != 1 ) violation( "CMD17 with more than one block armed" );
+	if( !card.host_wide || !card.wide ) violation( "data on a 1 bit bus" );
+	dma.started = 1;
+	dma.addr = card.addr;
+	dma.ok = dma.blocks;
+	uint64_t t = now + t_nac;
+	for( uint32_t i = 0; i < dma.blocks; i++ )
+	{
+		t += block_ns();
+		if( card.addr + i >= card.blocks )
+		{
+			dma.ok = i;
+			dma.err = SD_ERR_TIMEOUT;
+			t += 100000000;
+			break;
+		}
+		if( inject() )
+		{
+			stats.crc_injected++;
+			dma.ok = i;
+			dma.err = SD_ERR_CRC;
+			break;
+		}
+	}
+	dma.end = t;
+	card.addr += dma.blocks;
+	card.xfer_end = t;
+}
+
+static int card_cmd( int cmd, uint32_t arg, int flags, uint32_t * r )
+{
+	int bits = ( flags & SD_R_LONG ) ? 136 : ( flags & SD_R_SHORT ) ? 48 : 0;
+	now += (uint64_t)( ( 48 + 8 + bits ) * card.clk ) + 1000;
+	card_tick();
+	stats.cmds[cmd & 63]++;
+
+	if( dma.active && dma.started && now < dma.end && cmd != 12 && cmd != 13 )
+		violation( "command during a data transfer" );
+
+	int app = card.app;
+	card.app = 0;
+	uint32_t err = 0, resp = 0, a;
+	uint32_t * out = r;
+	int type = 1;           // 0 none, 1 R1 (and R1b), 2 R2, 3 R3, 6 R6, 7 R7, -1 illegal
+
+	switch( app ? 100 + cmd : cmd )
+	{
+	case 0:
+		card_power_on();
+		now -= 2000000;
+		type = 0;
+		break;
+	case 8:
+		if( card.type == CARD_SC1 || card.state != IDLE ) { type = -1; break; }
+		resp = arg & 0xfff;
+		type = 7;
+		break;
+	case 55:
+	case 155:
+		if( card.state > IDLE && arg != card.rca ) { type = -1; break; }
+		resp = card_status( 0 ) | 0x20;
+		card.app = 1;
+		type = 6;       // R1, the status already taken
+		break;
+	case 141:
+		if( card.state != IDLE ) { type = -1; break; }
+		if( !( arg & 0x00ff8000 ) ) { type = -1; break; }
+		card.hcs = !!( arg & 0x40000000 );
+		resp = 0x00ff8000;
+		if( card.polls > 0 ) card.polls--;
+		else if( card.type == CARD_SC1 || card.type == CARD_SC2 || card.hcs )
+		{
+			resp |= 0x80000000 | ( card.type == CARD_HC ? 0x40000000 : 0 );
+			card.state = READY;
+		}
+		type = 3;
+		break;
+	case 2:
+		if( card.state != READY ) { type = -1; break; }
+		card.state = IDENT;
+		memset( r, 0, 16 );
+		r[0] = 0x03534453;      // MID, OID, "SD"
+		type = 2;
+		break;
+	case 3:
+		if( card.state != IDENT && card.state != STBY ) { type = -1; break; }
+		card.state = STBY;
+		card.rca = 0x4d2a0000;
+		resp = card.rca | (uint32_t)STBY << 9 | SD_R1_READY;
+		type = 7;
+		break;
+	case 9:
+		if( card.state != STBY || arg != card.rca ) { type = -1; break; }
+		card_csd( r );
+		type = 2;
+		break;
+	case 7:
+		if( arg != card.rca ) { type = -1; break; }
+		if( card.state != STBY ) { type = -1; break; }
+		resp = card_status( 0 );
+		card.state = TRAN;
+		break;
+	case 13:
+		if( card.state < STBY || arg != card.rca ) { type = -1; break; }
+		resp = card_status( 0 );
+		break;
+	case 106:
+		if( card.state != TRAN || ( arg != 0 && arg != 2 ) ) { type = -1; break; }
+		resp = card_status( 0 ) | 0x20;
+		card.wide = arg == 2;
+		break;
+	case 16:
+		if( card.state != TRAN ) { type = -1; break; }
+		resp = card_status( card.type != CARD_HC && arg != 512 ? 0x20000000 : 0 );
+		break;
+	case 17:
+	case 18:
+		if( card.state != TRAN ) { type = -1; break; }
+		a = card_addr( arg, &err );
+		resp = card_status( err );
+		if( err ) break;
+		card.state = DATA;
+		card.addr = a;
+		card.multi = cmd == 18;
+		card_start_read();
+		break;
+	case 12:
+		if( card.state == DATA )
+		{
+			resp = card_status( 0 );
+			card.state = TRAN;
+		}
+		else if( card.state == RCV )
+		{
+			resp = card_status( 0 );
+			card.state = PRG;
+			if( card.prog_end < now ) card.prog_end = now;
+			card.busy_until = card.prog_end;
+			card_close_segments();
+		}
+		else type = -1;
+		break;
+	case 123:
+		if( card.state != TRAN ) { type = -1; break; }
+		resp = card_status( 0 ) | 0x20;
+		card.hint = arg & 0x7fffff;
+		stats.acmd23++;
+		break;
+	case 24:
+	case 25:
+		if( card.state != TRAN ) { type = -1; break; }
+		a = card_addr( arg, &err );
+		resp = card_status( err );
+		if( err ) break;
+		card.state = RCV;
+		card.addr = card.xfer_addr = a;
+		card.multi = cmd == 25;
+		card.write_err = 0;
+		if( card.prog_end < now ) card.prog_end = now;
+		card.prog_end += t_open + ( cmd == 24 ? t_single : 0 );
+		for( uint32_t s = a / SEG_BLOCKS; cmd == 25 && card.hint && s <= ( a + card.hint - 1 ) / SEG_BLOCKS && s <= card.blocks / SEG_BLOCKS; s++ )
+		{
+			if( card.seg[s] == 0 )
+			{
+				card.seg[s] = 1;
+				card.prog_end += t_seg_pre;
+			}
+		}
+		card.hint = 0;
+		break;
+	case 32:
+	case 33:
+		if( card.state != TRAN ) { type = -1; break; }
+		a = card_addr( arg, &err );
+		resp = card_status( err );
+		if( err ) break;
+		if( cmd == 32 ) card.erase_start = a, card.erase_set = 1;
+		else if( card.erase_set ) card.erase_end = a, card.erase_set = 2;
+		break;
+	case 38:
+		if( card.state != TRAN ) { type = -1; break; }
+		if( card.erase_set != 2 || card.erase_end < card.erase_start )
+		{
+			resp = card_status( 0x10000000 );     // ERASE_SEQ_ERROR
+			card.erase_set = 0;
+			break;
+		}
+		resp = card_status( 0 );
+		memset( card.mem + (size_t)card.erase_start * 512, 0, (size_t)( card.erase_end - card.erase_start + 1 ) * 512 );
+		if( card.prog_end < now ) card.prog_end = now;
+		card.prog_end += 2000000;
+		for( uint32_t s = card.erase_start / SEG_BLOCKS; s <= card.erase_end / SEG_BLOCKS; s++ )
+		{
+			card.seg[s] = 1;
+			card.prog_end += 50000;
+		}
+		card.busy_until = card.prog_end;
+		card.state = PRG;
+		card.erase_set = 0;
+		break;
+	default:
+		type = -1;
+	}
+
+	if( type == -1 )
+	{
+		card.pending |= SD_R1_ILLEGAL;
+		now += (uint64_t)( 64 * card.clk );
+		return SD_ERR_TIMEOUT;
+	}
+	if( type == 0 ) return 0;
+
+	int want = type == 2 ? SD_R_LONG : SD_R_SHORT;
+	if( !( flags & want ) ) violation( "wrong response type asked for" );
+	if( type == 3 && !( flags & SD_R_NOCRC ) ) violation( "R3 without SD_R_NOCRC" );
+
+	if( type != 3 && inject() )
+	{
+		stats.crc_injected++;
+		return SD_ERR_CRC;
+	}
+	if( type != 2 ) out[0] = resp;
+	if( ( flags & SD_R_STATUS ) && ( resp & SD_R1_ERRORS ) ) return 0; // the library checks
+	return 0;
+}
+
+static void card_data( const void * buf, int blocks, int to_card )
+{
+	if( dma.active && now < dma.end ) violation( "DMA restarted while it was running" );
+	free( dma.block_end );
+	memset( &dma, 0, sizeof( dma ) );
+	if( blocks < 1 || blocks > 511 ) violation( "DMA block count" );
+	if( (uintptr_t)buf & 3 ) violation( "unaligned DMA buffer" );
+	dma.active = 1;
+	dma.to_card = to_card;
+	dma.buf = (uint8_t *)buf;
+	dma.blocks = blocks;
+	dma.end = ~0ull;
+	dma.timeout = now + 500000000;
+	now += 1000;
+	if( !to_card ) return;
+
+	dma.started = 1;
+	card_tick();
+	if( card.state != RCV || card.write_err )
+	{
+		violation( "write data the card isn't waiting for" );
+		dma.err = SD_ERR_TIMEOUT;
+		dma.end = now + 250000000;
+		return;
+	}
+	if( !card.host_wide || !card.wide ) violation( "data on a 1 bit bus" );
+	if( !card.multi && blocks != 1 ) violation( "CMD24 with more than one block" );
+	dma.addr = card.addr;
+	dma.ok = blocks;
+	dma.block_end = calloc( blocks, sizeof( uint64_t ) );
+	uint64_t t = now;
+	for( int i = 0; i < blocks; i++ )
+	{
+		if( t < card.busy_until ) t = card.busy_until;
+		t += block_ns();
+		if( card.addr + i >= card.blocks || inject() )
+		{
+			if( card.addr + i < card.blocks ) stats.crc_injected++;
+			dma.ok = i;
+			dma.err = SD_ERR_CRC;
+			card.write_err = 1;
+			break;
+		}
+		dma.block_end[i] = t;
+		if( card.prog_end < t ) card.prog_end = t;
+		card.prog_end += card_prog( card.addr + i );
+		card.busy_until = card.prog_end - buf_blocks * t_prog;
+	}
+	dma.end = t;
+	card.xfer_end = t;
+	card.addr += dma.ok;
+}
+
+static void dma_finish( int upto_now )
+{
+	uint32_t n = dma.ok;
+	if( dma.to_card )
+	{
+		if( upto_now )
+			for( n = 0; n < dma.ok && dma.block_end[n] <= now; n++ );
+		memcpy( card.mem + (size_t)dma.addr * 512, dma.buf, (size_t)n * 512 );
+	}
+	else if( dma.started )
+	{
+		if( upto_now ) n = 0;
+		memcpy( dma.buf, card.mem + (size_t)dma.addr * 512, (size_t)n * 512 );
+	}
+	dma.active = 0;
+}
+
+static int card_data_busy( void )
+{
+	if( !dma.active ) { violation( "data status without a transfer" ); return SD_ERR_TIMEOUT; }
+	if( !dma.started )
+	{
+		now += 500;
+		if( now < dma.timeout ) return 1;
+		dma.active = 0;
+		return SD_ERR_TIMEOUT;
+	}
+	if( now < dma.end )
+	{
+		now += 500;     // a poll of the status register
+		return 1;
+	}
+	dma_finish( 0 );
+	return dma.err;
+}
+
+static void card_data_abort( void )
+{
+	if( dma.active ) dma_finish( now < dma.end );
+}
+
+// Stream latencies, us
+static uint32_t * lat;
+static uint32_t nlat, maxlat;
+
+static void stream_done( uint32_t lba, uint32_t blocks, uint32_t ticks )
+{
+	if( nlat < maxlat ) lat[nlat++] = ticks;
+}
+
+static int failures;
+
+static void fail( const char * what, long a, long b )
+{
+	if( failures++ < 20 ) printf( "FAIL: %s (%ld, %ld)\n", what, a, b );
+}
+
+// The reference: what each block should hold, and whether that's known.
+static uint8_t * shadow;
+static uint8_t * known;
+static uint8_t * iobuf;
+#define MAX_IO 300
+
+static void fill( uint8_t * p, uint32_t n )
+{
+	for( uint32_t i = 0; i < n * 128; i++ ) ( (uint32_t *)p )[i] = rnd();
+}
+
+static void set_known( uint32_t lba, uint32_t n, const uint8_t * data, int ok )
+{
+	if( data ) memcpy( shadow + (size_t)lba * 512, data, (size_t)n * 512 );
+	else memset( shadow + (size_t)lba * 512, 0, (size_t)n * 512 );
+	memset( known + lba, ok, n );
+}
+
+static void check_read( uint32_t lba, uint32_t n, const uint8_t * data )
+{
+	for( uint32_t i = 0; i < n; i++ )
+		if( known[lba + i] && memcmp( data + i * 512, shadow + (size_t)( lba + i ) * 512, 512 ) )
+		{
+			fail( "read data differs", lba + i, n );
+			return;
+		}
+}
+
+static void params( void )
+{
+	uint32_t b = card.blocks;
+	if( SDRead( 0, iobuf + 1, 1 ) != SD_ERR_PARAM ) fail( "unaligned buffer", 0, 0 );
+	if( SDRead( b - 1, iobuf, 2 ) != SD_ERR_RANGE ) fail( "read past the end", b - 1, 2 );
+	if( SDWrite( b, iobuf, 1 ) != SD_ERR_RANGE ) fail( "write past the end", b, 1 );
+	if( SDRead( b, iobuf, 0 ) != 0 ) fail( "empty read at the end", b, 0 );
+	if( SDStreamSubmit( 1 ) != SD_ERR_PARAM ) fail( "submit without a stream", 0, 0 );
+	if( SDStreamClose() != SD_ERR_PARAM ) fail( "close without a stream", 0, 0 );
+	if( SDStreamOpen( 0, 0 ) ) fail( "stream open", 0, 0 );
+	if( SDRead( 0, iobuf, 1 ) != SD_ERR_PARAM ) fail( "read during a stream", 0, 0 );
+	if( SDStreamOpen( 0, 0 ) != SD_ERR_PARAM ) fail( "second stream", 0, 0 );
+	if( SDStreamClose() ) fail( "empty stream close", 0, 0 );
+	if( SDStreamOpen( b - 1, 0 ) ) fail( "stream open at the end", 0, 0 );
+	if( !SDStreamBuffer() || SDStreamSubmit( 2 ) != SD_ERR_RANGE ) fail( "stream past the end", 0, 0 );
+	if( SDStreamClose() != SD_ERR_RANGE ) fail( "stream close after range", 0, 0 );
+}
+
+static void stream( uint32_t lba, uint32_t n, int hint )
+{
+	uint32_t c25 = stats.cmds[25];
+	int e = SDStreamOpen( lba, hint ? n : 0 );
+	if( e )
+	{
+		if( !errors_on() ) fail( "stream open", lba, e );
+		return;
+	}
+	static uint8_t data[512 * 2048];
+	uint32_t done = 0;
+	while( done < n )
+	{
+		uint8_t * p = SDStreamBuffer();
+		if( !p )
+		{
+			if( sd.err ) break;
+			now += 1000;
+			continue;
+		}
+		uint32_t k = n - done < SD_STREAM_BLOCKS ? n - done : SD_STREAM_BLOCKS;
+		fill( p, k );
+		memcpy( data + done * 512, p, k * 512 );
+		if( SDStreamSubmit( k ) ) break;
+		done += k;
+		now += 2000;
+	}
+	e = SDStreamClose();
+	if( stats.cmds[25] != c25 + 1 ) fail( "a stream is one CMD25", stats.cmds[25] - c25, 1 );
+	if( e )
+	{
+		if( !errors_on() ) fail( "stream", lba, e );
+		if( sd.sent < lba || sd.sent > lba + n ) fail( "stream error position", sd.sent, lba );
+		set_known( lba, sd.sent - lba, data, 1 );
+		set_known( sd.sent, lba + n - sd.sent, 0, 0 );
+		return;
+	}
+	set_known( lba, n, data, 1 );
+}
+
+static void random_io( int ops )
+{
+	uint32_t b = card.blocks;
+	for( int op = 0; op < ops; op++ )
+	{
+		uint32_t r = rnd() % 100;
+		uint32_t n = rnd() % 4 ? 1 + rnd() % 16 : 1 + rnd() % MAX_IO;
+		uint32_t lba = rnd() % ( b - n );
+		if( r < 45 )
+		{
+			fill( iobuf, n );
+			int e = SDWrite( lba, iobuf, n );
+			if( e && !errors_on() ) fail( "write", lba, e );
+			set_known( lba, n, iobuf, !e );
+		}
+		else if( r < 90 )
+		{
+			int e = SDRead( lba, iobuf, n );
+			if( e && !errors_on() ) fail( "read", lba, e );
+			if( !e ) check_read( lba, n, iobuf );
+		}
+		else if( r < 93 )
+		{
+			int e = SDErase( lba, n );
+			if( e && !errors_on() ) fail( "erase", lba, e );
+			set_known( lba, n, 0, !e );
+		}
+		else stream( lba, n, rnd() & 1 );
+		if( failures ) return;
+	}
+}
+
+static void verify_all( void )
+{
+	int inj = card.inject;
+	card.inject = 0;
+	for( uint32_t lba = 0; lba < card.blocks; lba += MAX_IO )
+	{
+		uint32_t n = card.blocks - lba < MAX_IO ? card.blocks - lba : MAX_IO;
+		int e = SDRead( lba, iobuf, n );
+		if( e ) { fail( "verify read", lba, e ); break; }
+		check_read( lba, n, iobuf );
+		if( memcmp( iobuf, card.mem + (size_t)lba * 512, (size_t)n * 512 ) ) fail( "read differs from the card", lba, n );
+		if( failures ) break;
+	}
+	card.inject = inj;
+}
+
+static int cmp_u32( const void * a, const void * b )
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static double mbs( uint64_t bytes, uint64_t ns )
+{
+	return bytes * 1e3 / ns;
+}
+
+static void bench_io( void )
+{
+	static const int sizes[] = { 1, 8, 64, 128 };
+	printf( "\nblocks   read MB/s   write MB/s\n" );
+	for( int s = 0; s < 4; s++ )
+	{
+		uint32_t n = sizes[s], total = 8192, lba = 0;
+		uint64_t t0 = now;
+		for( uint32_t i = 0; i < total; i += n ) SDRead( lba + i, iobuf, n );
+		double rd = mbs( (uint64_t)total * 512, now - t0 );
+		t0 = now;
+		for( uint32_t i = 0; i < total; i += n ) SDWrite( lba + i, iobuf, n );
+		double wr = mbs( (uint64_t)total * 512, now - t0 );
+		printf( "%6u %11.2f %12.2f\n", n, rd, wr );
+	}
+}
+
+static void percentiles( const char * name, double rate, uint32_t * l, uint32_t n )
+{
+	if( !n ) return;
+	qsort( l, n, sizeof( *l ), cmp_u32 );
+	#define P( p ) ( l[(uint32_t)( ( n - 1 ) * ( p ) )] / 1000.0 )
+	printf( "%-26s %6.2f %8.2f %8.2f %8.2f %8.2f %8.2f\n", name, rate, P( 0.5 ), P( 0.9 ), P( 0.99 ), P( 0.999 ), l[n - 1] / 1000.0 );
+	#undef P
+}
+
+// Writes mb MB as fast as the card takes it. mode 0: a stream with the
+// hint, 1: without, 2: SDWrite() of each buffer.
+static void bench_stream( int mode, uint32_t mb )
+{
+	uint32_t n = mb * 2048, lba = 4096, done = 0;
+	nlat = 0;
+	uint64_t t0 = now;
+	if( mode == 2 )
+	{
+		for( ; done < n; done += SD_STREAM_BLOCKS )
+		{
+			uint64_t t = now;
+			SDWrite( lba + done, sd_stream_buf[0], SD_STREAM_BLOCKS );
+			if( nlat < maxlat ) lat[nlat++] = ( now - t ) / 1000;
+		}
+	}
+	else
+	{
+		SDStreamOpen( lba, mode ? 0 : n );
+		while( done < n )
+		{
+			if( !SDStreamBuffer() ) { now += 500; continue; }
+			SDStreamSubmit( SD_STREAM_BLOCKS );
+			done += SD_STREAM_BLOCKS;
+		}
+		SDStreamClose();
+	}
+	static const char * names[] = { "stream, ACMD23 hint", "stream, no hint", "SDWrite() per buffer" };
+	percentiles( names[mode], mbs( (uint64_t)n * 512, now - t0 ), lat, nlat );
+}
+
+// Data comes in at a fixed rate. Counts the buffers that had nowhere to go.
+static uint32_t bench_log( double rate, uint32_t ms )
+{
+	uint64_t per = (uint64_t)( SD_STREAM_BLOCKS * 512 * 1e3 / rate );   // ns per buffer
+	uint64_t t_end = now + ms * 1000000ull, next = now + per;
+	uint32_t dropped = 0, lba = 4096;
+	SDStreamOpen( lba, 0 );
+	while( now < t_end )
+	{
+		SDStreamPoll();
+		if( now >= next )
+		{
+			if( SDStreamBuffer() ) SDStreamSubmit( SD_STREAM_BLOCKS );
+			else dropped++;
+			next += per;
+		}
+		now += 500;
+	}
+	SDStreamClose();
+	return dropped;
+}
+
+int main( int argc, char ** argv )
+{
+	int ops = 1000, bench = 1, type = CARD_HC, c;
+	uint32_t mb = 16, seed = 1;
+	while( ( c = getopt( argc, argv, "n:r:e:c:m:B" ) ) != -1 )
+	{
+		switch( c )
+		{
+		case 'n': ops = atoi( optarg ); break;
+		case 'r': seed = atoi( optarg ); break;
+		case 'e': err_rate = atof( optarg ); break;
+		case 'c': type = !strcmp( optarg, "sc1" ) ? CARD_SC1 : !strcmp( optarg, "sc2" ) ? CARD_SC2 : CARD_HC; break;
+		case 'm': mb = atoi( optarg ); break;
+		case 'B': bench = 0; break;
+		default:
+			fprintf( stderr, "usage: sdsim [-n ops] [-r seed] [-e error rate] [-c hc|sc2|sc1] [-m MB] [-B]\n" );
+			return 1;
+		}
+	}
+	if( mb > 30 ) mb = 30;
+	rng_state = seed * 0x9e3779b97f4a7c15ull + 1;
+
+	uint32_t blocks = 65536;        // 32 MB
+	card_new( type, blocks );
+	shadow = malloc( (size_t)blocks * 512 );
+	known = calloc( blocks, 1 );
+	iobuf = aligned_alloc( 4, MAX_IO * 512 + 4 );
+	maxlat = 1 << 20;
+	lat = malloc( maxlat * sizeof( *lat ) );
+
+	int e = SDInit();
+	if( e ) fail( "init", e, 0 );
+	if( SDBlocks() != blocks ) fail( "capacity", SDBlocks(), blocks );
+	if( !card.wide || ( card.type == CARD_HC ) != sd.hc ) fail( "card setup", card.wide, sd.hc );
+	if( failures ) goto out;
+
+	memcpy( shadow, card.mem, (size_t)blocks * 512 );
+	memset( known, 1, blocks );
+	params();
+	card.inject = 1;
+	random_io( ops );
+	if( !failures ) verify_all();
+	card.inject = 0;
+
+	uint32_t cmds = 0;
+	for( int i = 0; i < 64; i++ ) cmds += stats.cmds[i];
+	printf( "%d ops, card %s, error rate %g: %u CRC errors injected, %u commands, %u ACMD23\n",
+		ops, type == CARD_HC ? "SDHC" : type == CARD_SC2 ? "SDSC v2" : "SDSC v1", err_rate,
+		stats.crc_injected, cmds, stats.acmd23 );
+
+	if( bench && !failures )
+	{
+		bench_io();
+		printf( "\n%u MB, %d block buffers       MB/s  latency ms: p50      p90      p99    p99.9      max\n", mb, SD_STREAM_BLOCKS );
+		for( int m = 0; m < 3; m++ ) bench_stream( m, mb );
+		printf( "\nlogging for 2 s, %d block buffers\n", SD_STREAM_BLOCKS );
+		static const double rates[] = { 1, 2, 4, 6, 8, 10 };
+		for( int i = 0; i < 6; i++ )
+			printf( "%5.1f MB/s: %u buffers dropped\n", rates[i], bench_log( rates[i], 2000 ) );
+	}
+
+out:
+	if( stats.violations ) fail( "protocol violations", stats.violations, 0 );
+	printf( failures ? "FAILED\n" : "ok\n" );
+	return failures ? 2 : 0;
+}
@@ -0,0 +1,571 @@
+/* Checks lib_stepper.h on the host: the engine unmodified, on a simulated
+	timer with interrupt latency, the coil pins or PWM duties decoded back
+	into steps. Then the step timing of the ramps against the ideal
+	trapezoid. See README.md.
+*/
+
+#include <getopt.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef STEPPER_TICK_HZ
+#define STEPPER_TICK_HZ 48000000
+#endif
+#define STEPPER_CUSTOM_TIMER
+
+// The port is a word per pin group, the model sees every store.
+struct StepperAxis;
+typedef uint32_t * StepperPort;
+static uint32_t sim_ports[4];
+#define STEPPER_PORT_OF( pin ) ( &sim_ports[( pin ) >> 5] )
+#define STEPPER_PIN_MASK( pin ) ( 1u << ( ( pin ) & 31 ) )
+#define STEPPER_PORT_WRITE( a, bits ) sim_port_write( a, bits )
+static void sim_port_write( struct StepperAxis * a, uint32_t bits );
+
+#if STEPPER_MICROSTEPS > 2
+static void sim_pwm( struct StepperAxis * a, int ia, int ib );
+#define STEPPER_PWM_HOOK( axis, ia, ib ) sim_pwm( axis, ia, ib )
+#endif
+
+static int irq_off;
+#define __disable_irq() ( irq_off++ )
+#define __enable_irq() ( irq_off-- )
+
+#include "lib_stepper.h"
+
+static int failures;
+static uint32_t violations;
+
+static void fail( const char * what, double got, double want )
+{
+	if( failures++ < 10 ) printf( "FAIL %s: got %.3f, want %.3f\n", what, got, want );
+}
+
+static void violation( const char * what )
+{
+	if( violations++ < 10 ) printf( "violation: %s\n", what );
+}
+
+static uint64_t rng_state;
+
+static uint32_t rnd( void )
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state >> 32;
+}
+
+/* The timer: a free running counter from near its wrap, a compare, and the
+	interrupt taken up to latency ticks after the compare matches. The
+	handler is the SysTick one of lib_stepper.h. */
+
+static uint32_t sim_now;
+static uint64_t sim_ticks; // sim_now without the wrap
+static uint32_t sim_cmp;
+static uint32_t latency;
+static uint8_t sim_armed;
+
+static uint32_t Stepper_Now( void )
+{
+	return sim_now;
+}
+
+static void Stepper_Kick( void )
+{
+	sim_armed = 1;
+	sim_cmp = sim_now + STEPPER_GROUP_TICKS + 1;
+}
+
+/* What the model knows of each axis, only from the pins: where it is, when it
+	last stepped and which way. */
+typedef struct
+{
+	StepperAxis * a;
+	int32_t pos;             // steps
+	int elec;                // electrical position, microsteps
+	int steps;
+	uint32_t t[3], dl[3];    // the last three step times, and their deadlines
+	int32_t dirs[3];
+	int released;
+	uint32_t worst_late;     // ticks
+	double worst_accel;      // of what's allowed
+	double peak_accel;       // of the limit, where a tick doesn't matter
+	uint32_t fastest;        // shortest interval, ticks
+	uint32_t * log;          // deadlines, for the shared timer check
+	int log_n, log_max;
+} Model;
+
+#define AXES 3
+static StepperAxis axis[AXES];
+static Model model[AXES];
+static uint32_t accel_limit[AXES], speed_limit[AXES];
+
+static Model * model_of( struct StepperAxis * a )
+{
+	for( int i = 0; i < AXES; i++ )
+		if( model[i].a == a ) return &model[i];
+	return 0;
+}
+
+// Deadline of the step being issued: the axis' own, or its lead's.
+static StepperAxis * lead_of( StepperAxis * a )
+{
+	if( a->state != STEPPER_FOLLOW ) return a;
+	for( int i = 0; i < AXES; i++ )
+		for( StepperAxis * f = axis[i].follower; f && axis[i].state != STEPPER_FOLLOW; f = f->follower )
+			if( f == a ) return &axis[i];
+	return a;
+}
+
+static void model_step( Model * m, int elec )
+{
+	int d = ( elec - m->elec ) & ( STEPPER_PHASES - 1 );
+	m->released = 0; // coils on again, the rotor stayed where they left it
+	if( d == 0 ) return; // same position, holding
+	if( d != 1 && d != STEPPER_PHASES - 1 )
+	{
+		violation( "a step of more than one position" );
+		m->elec = elec;
+		return;
+	}
+	int dir = d == 1 ? 1 : -1;
+	m->elec = elec;
+	m->pos += dir;
+	m->steps++;
+
+	StepperAxis * lead = lead_of( m->a );
+	uint32_t deadline = lead->next;
+	if( (int32_t)( sim_now - deadline ) > (int32_t)m->worst_late ) m->worst_late = sim_now - deadline;
+	if( (int32_t)( sim_now - deadline ) > (int32_t)latency ) violation( "a step later than the interrupt latency" );
+	if( (int32_t)( deadline - sim_now ) > (int32_t)STEPPER_GROUP_TICKS ) violation( "a step early" );
+	if( irq_off ) violation( "a step with interrupts off" );
+	if( m->log && m->log_n < m->log_max ) m->log[m->log_n++] = deadline;
+
+	memmove( m->t, m->t + 1, sizeof( m->t[0] ) * 2 );
+	memmove( m->dl, m->dl + 1, sizeof( m->dl[0] ) * 2 );
+	memmove( m->dirs, m->dirs + 1, sizeof( m->dirs[0] ) * 2 );
+	m->t[2] = sim_now;
+	m->dl[2] = deadline;
+	m->dirs[2] = dir;
+	if( m->steps < 2 || lead != m->a ) return;
+
+	// Speed and acceleration from the deadlines, jitter is checked above.
+	int i = m - model;
+	uint32_t d1 = m->dl[2] - m->dl[1];
+	if( m->dirs[1] == dir && d1 < m->fastest ) m->fastest = d1;
+	if( m->dirs[1] == dir && d1 + 1 < STEPPER_TICK_HZ / speed_limit[i] ) violation( "faster than the speed limit" );
+	if( m->steps < 3 || m->dirs[0] != dir || m->dirs[1] != dir ) return;
+	uint32_t d0 = m->dl[1] - m->dl[0];
+	if( d0 > STEPPER_TICK_HZ / 4 || d1 > STEPPER_TICK_HZ / 4 ) return; // stopped in between
+	double v0 = (double)STEPPER_TICK_HZ / d0, v1 = (double)STEPPER_TICK_HZ / d1;
+	double acc = fabs( v1 - v0 ) / ( ( d0 + d1 ) * 0.5 / STEPPER_TICK_HZ );
+	// An interval is whole ticks, at speed a tick is a lot of acceleration.
+	double quant = 2.0 * STEPPER_TICK_HZ * (double)STEPPER_TICK_HZ / ( (double)d1 * d1 * d1 ) * 2;
+	double rel = acc / ( accel_limit[i] * 1.05 + quant );
+	if( rel > m->worst_accel ) m->worst_accel = rel;
+	if( quant < accel_limit[i] * 0.01 && acc / accel_limit[i] > m->peak_accel ) m->peak_accel = acc / accel_limit[i];
+	if( rel > 1 ) violation( "more than the acceleration limit" );
+}
+
+static void sim_port_write( struct StepperAxis * a, uint32_t bits )
+{
+	Model * m = model_of( a );
+	uint32_t * port = a->port;
+	if( bits & ~a->mask ) violation( "pins outside the axis written" );
+	*port = ( *port & ~a->mask ) | bits;
+	if( !m ) return; // Stepper_Init()
+	if( !bits )
+	{
+		m->released = 1;
+		return;
+	}
+#if STEPPER_MICROSTEPS > 2
+	violation( "the port written in PWM mode" );
+#else
+	for( int k = 0; k < 8; k++ )
+		if( a->pattern[k] == bits )
+		{
+			if( STEPPER_MICROSTEPS == 1 && ( k & 1 ) ) violation( "a half step in full step mode" );
+			model_step( m, k * STEPPER_MICROSTEPS / 2 );
+			return;
+		}
+	violation( "pins not in the step sequence" );
+#endif
+}
+
+#if STEPPER_MICROSTEPS > 2
+static void sim_pwm( struct StepperAxis * a, int ia, int ib )
+{
+	Model * m = model_of( a );
+	if( !m ) return;
+	if( !ia && !ib )
+	{
+		m->released = 1;
+		return;
+	}
+	// Sine and cosine of the electrical angle, 255 at the peak.
+	double mag = sqrt( (double)ia * ia + (double)ib * ib );
+	if( mag < 255 * 0.97 || mag > 255 * 1.03 ) violation( "coil currents not on the circle" );
+	double turn = atan2( ib, ia ) / ( 2 * M_PI ) * STEPPER_PHASES - STEPPER_MICROSTEPS / 2; // starts at 45 degrees
+	int elec = (int)floor( turn + 0.5 );
+	if( fabs( turn - elec ) > 0.05 ) violation( "coil currents between microsteps" );
+	model_step( m, elec & ( STEPPER_PHASES - 1 ) );
+}
+#endif
+
+static void sim_isr( void )
+{
+	uint32_t deadline;
+	while( Stepper_Service( Stepper_Now(), &deadline ) )
+	{
+		sim_cmp = deadline;
+		if( (int32_t)( deadline - Stepper_Now() ) > 0 ) return;
+	}
+	sim_armed = 0;
+}
+
+// Linear moves in progress, checked after every interrupt.
+static struct
+{
+	int lead, n, idx[AXES];
+	int32_t start[AXES], delta[AXES];
+	uint32_t most;
+} line;
+
+static void check_line( void )
+{
+	if( !line.n ) return;
+	int32_t done = abs( model[line.lead].pos - line.start[line.lead] );
+	for( int j = 0; j < line.n; j++ )
+	{
+		int i = line.idx[j];
+		int64_t f = model[i].pos - line.start[i];
+		if( llabs( f * (int64_t)line.most - (int64_t)done * line.delta[i] ) > (int64_t)line.most )
+			violation( "a linear move off the line" );
+	}
+}
+
+// Time goes on to t, the interrupt is taken whenever the compare is due.
+static void run_until( uint32_t t )
+{
+	while( sim_armed && (int32_t)( sim_cmp - t ) <= 0 )
+	{
+		uint32_t at = sim_cmp + ( latency ? rnd() % ( latency + 1 ) : 0 );
+		if( (int32_t)( at - sim_now ) > 0 ) sim_ticks += at - sim_now, sim_now = at;
+		sim_isr();
+		check_line();
+	}
+	if( (int32_t)( t - sim_now ) > 0 ) sim_ticks += t - sim_now, sim_now = t;
+}
+
+static int any_busy( void )
+{
+	for( int i = 0; i < AXES; i++ )
+		if( Stepper_Busy( &axis[i] ) ) return 1;
+	return 0;
+}
+
+// Until every axis stops, false if that takes more than five minutes.
+static int run_idle( void )
+{
+	for( int ms = 0; any_busy(); ms++ )
+	{
+		if( ms > 300000 ) return 0;
+		run_until( sim_now + STEPPER_TICK_HZ / 1000 );
+	}
+	return 1;
+}
+
+static void setup( void )
+{
+	static const uint32_t pins[AXES][4] = { { 6, 7, 10, 11 }, { 2, 3, 4, 5 }, { 32 + 0, 32 + 1, 32 + 8, 32 + 9 } };
+	memset( sim_ports, 0, sizeof( sim_ports ) );
+	memset( model, 0, sizeof( model ) );
+	stepper_axis_count = 0;
+	sim_now = -(uint32_t)( rnd() % ( 4 * STEPPER_TICK_HZ ) ); // wraps during the test
+	sim_armed = 0;
+	line.n = 0;
+	for( int i = 0; i < AXES; i++ )
+	{
+		Stepper_Init( &axis[i], pins[i][0], pins[i][1], pins[i][2], pins[i][3] );
+		accel_limit[i] = 200 + rnd() % 20000;
+		speed_limit[i] = 100 + rnd() % 5000;
+		Stepper_SetLimits( &axis[i], accel_limit[i], speed_limit[i] );
+		model[i].a = &axis[i];
+		model[i].released = 1;
+		model[i].fastest = ~0u;
+		Stepper_Release( &axis[i] );
+	}
+}
+
+static void check_at( int i, int32_t where, const char * what )
+{
+	if( Stepper_Busy( &axis[i] ) ) fail( what, 1, 0 );
+	if( model[i].pos != where ) fail( what, model[i].pos, where );
+	if( axis[i].position != where ) fail( what, axis[i].position, where );
+}
+
+// The trapezoid, or triangle, time for steps at accel and speed.
+static double ideal_time( uint32_t steps, uint32_t accel, uint32_t speed )
+{
+	double d = steps, a = accel, v = speed;
+	return d >= v * v / a ? d / v + v / a : 2 * sqrt( d / a );
+}
+
+static double move_time( int i, int32_t steps )
+{
+	uint64_t t0 = sim_ticks;
+	Stepper_Move( &axis[i], steps );
+	if( !run_idle() ) fail( "move never finished", steps, 0 );
+	return (double)( sim_ticks - t0 - ( sim_now - model[i].dl[2] ) ) / STEPPER_TICK_HZ;
+}
+
+// Moves of every size from standstill, they end where they should and take
+// the trapezoid's time, give or take the first step.
+static void check_moves( int n )
+{
+	for( int it = 0; it < n && failures < 10; it++ )
+	{
+		setup();
+		int i = rnd() % AXES;
+		int32_t steps = rnd() % 4 ? (int32_t)( rnd() % 2000 ) - 1000 : (int32_t)( rnd() % 40000 ) - 20000;
+		if( !steps ) steps = 1;
+		int32_t start = model[i].pos;
+		double t = move_time( i, steps );
+		check_at( i, start + steps, "position after a move" );
+		double want = ideal_time( abs( steps ), accel_limit[i], speed_limit[i] );
+		double slack = 2.0 * axis[i].c0 / (double)STEPPER_TICK_HZ + 0.02 * want;
+		if( fabs( t - want ) > slack ) fail( "time of a move, s", t, want );
+		if( steps > 0 && steps % 2 == 0 && abs( steps ) > 4 )
+		{
+			// And back, another way.
+			Stepper_MoveTo( &axis[i], start );
+			if( !run_idle() ) fail( "move back never finished", steps, 0 );
+			check_at( i, start, "position after moving back" );
+		}
+	}
+}
+
+// Jogging: gets to the speed exactly, reverses only from standstill, speed 0
+// stops it.
+static void check_jog( int n )
+{
+	for( int it = 0; it < n && failures < 10; it++ )
+	{
+		setup();
+		int i = rnd() % AXES;
+		int32_t speed = 50 + rnd() % 6000;
+		if( rnd() % 2 ) speed = -speed;
+		Stepper_Run( &axis[i], speed );
+		double ramp = (double)speed_limit[i] / accel_limit[i];
+		run_until( sim_now + (uint32_t)( ( ramp + 0.2 ) * STEPPER_TICK_HZ ) );
+		uint32_t want = STEPPER_TICK_HZ / (uint32_t)abs( speed );
+		if( want < axis[i].min_delay ) want = axis[i].min_delay;
+		uint32_t got = model[i].dl[2] - model[i].dl[1];
+		if( got != want ) fail( "jog interval, ticks", got, want );
+		if( model[i].dirs[2] != ( speed > 0 ? 1 : -1 ) ) fail( "jog direction", model[i].dirs[2], speed );
+
+		// Reverse: the last step one way and the first the other both at
+		// the slowest of the ramp.
+		int32_t turns = model[i].steps;
+		Stepper_Run( &axis[i], -speed );
+		int turned = 0;
+		while( !turned && sim_now - model[i].dl[2] < 4u * STEPPER_TICK_HZ )
+		{
+			run_until( sim_now + STEPPER_TICK_HZ / 10000 );
+			if( model[i].steps > turns + 1 && model[i].dirs[2] != model[i].dirs[1] )
+			{
+				turned = 1;
+				uint32_t before = model[i].dl[1] - model[i].dl[0], after = model[i].dl[2] - model[i].dl[1];
+				if( before < axis[i].c0 * 0.9 ) fail( "interval before turning, ticks", before, axis[i].c0 );
+				if( after < axis[i].c0 * 0.9 ) fail( "interval after turning, ticks", after, axis[i].c0 );
+			}
+		}
+		if( !turned && abs( speed ) > 0 ) fail( "jog never turned", 0, 1 );
+
+		Stepper_Run( &axis[i], 0 );
+		if( !run_idle() ) fail( "jog never stopped", 0, 1 );
+		if( axis[i].position != model[i].pos ) fail( "position after a jog", axis[i].position, model[i].pos );
+	}
+}
+
+// Anything at any time: moves, jogs and retargets on a running axis, then a
+// move to somewhere, which is where it ends up.
+static void check_retarget( int n )
+{
+	for( int it = 0; it < n && failures < 10; it++ )
+	{
+		setup();
+		int i = rnd() % AXES;
+		for( int k = 0; k < 20; k++ )
+		{
+			switch( rnd() % 4 )
+			{
+			case 0: Stepper_Move( &axis[i], (int32_t)( rnd() % 4000 ) - 2000 ); break;
+			case 1: Stepper_MoveTo( &axis[i], (int32_t)( rnd() % 4000 ) - 2000 ); break;
+			case 2: Stepper_Run( &axis[i], (int32_t)( rnd() % 8000 ) - 4000 ); break;
+			default: Stepper_Run( &axis[i], 0 ); break;
+			}
+			run_until( sim_now + rnd() % ( STEPPER_TICK_HZ / 2 ) );
+		}
+		int32_t where = (int32_t)( rnd() % 4000 ) - 2000;
+		Stepper_MoveTo( &axis[i], where );
+		if( !run_idle() ) fail( "retargeted move never finished", where, 0 );
+		check_at( i, where, "position after retargeting" );
+	}
+}
+
+// Linear moves over two and three axes, all stay on the line and arrive
+// together.
+static void check_linear( int n )
+{
+	for( int it = 0; it < n && failures < 10; it++ )
+	{
+		setup();
+		StepperAxis * axes[AXES];
+		int32_t delta[AXES];
+		int count = 2 + rnd() % 2;
+		uint32_t most = 0;
+		line.n = 0;
+		for( int j = 0; j < count; j++ )
+		{
+			axes[j] = &axis[j];
+			delta[j] = (int32_t)( rnd() % 6000 ) - 3000;
+			if( rnd() % 8 == 0 ) delta[j] = 0;
+			line.start[j] = model[j].pos;
+			line.delta[j] = delta[j];
+			if( (uint32_t)abs( delta[j] ) > most ) { most = abs( delta[j] ); line.lead = j; }
+		}
+		line.most = most;
+		for( int j = 0; j < count; j++ )
+			if( j != line.lead ) line.idx[line.n++] = j;
+		if( !most ) { line.n = 0; continue; }
+
+		Stepper_MoveLinear( axes, delta, count );
+		if( !run_idle() ) fail( "linear move never finished", most, 0 );
+		check_line();
+		for( int j = 0; j < count; j++ )
+			check_at( j, line.start[j] + delta[j], "position after a linear move" );
+		line.n = 0;
+	}
+}
+
+// One timer for all: an axis steps on the same deadlines alone and with the
+// others running whatever they like.
+static void check_shared( int n )
+{
+	static uint32_t alone[50000], shared[50000];
+	for( int it = 0; it < n && failures < 10; it++ )
+	{
+		uint64_t seed = rng_state;
+		setup();
+		int32_t steps = 1 + rnd() % 20000;
+		uint64_t after = rng_state;
+		model[0].log = alone;
+		model[0].log_max = 50000;
+		Stepper_Move( &axis[0], steps );
+		run_idle();
+		int n_alone = model[0].log_n;
+
+		rng_state = seed;
+		setup();
+		rnd();
+		model[0].log = shared;
+		model[0].log_max = 50000;
+		Stepper_Move( &axis[0], steps );
+		rng_state = after ^ 0x5555;
+		for( int k = 1; k < AXES; k++ ) Stepper_Run( &axis[k], (int32_t)( rnd() % 8000 ) - 4000 );
+		while( Stepper_Busy( &axis[0] ) ) run_until( sim_now + STEPPER_TICK_HZ / 1000 );
+		for( int k = 1; k < AXES; k++ ) Stepper_Run( &axis[k], 0 );
+		run_idle();
+
+		if( model[0].log_n != n_alone ) fail( "steps with other axes running", model[0].log_n, n_alone );
+		for( int k = 0; k < n_alone && k < model[0].log_n; k++ )
+			if( shared[k] != alone[k] )
+			{
+				fail( "deadline with other axes running, ticks", shared[k] - alone[k], 0 );
+				break;
+			}
+		model[0].log = 0;
+	}
+}
+
+static double seconds( void )
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Move times against the trapezoid, the worst acceleration seen, and the
+// engine's cost per step on this host.
+static void bench( void )
+{
+	static const uint32_t acc[] = { 500, 5000 }, spd[] = { 500, 5000 };
+	static const int32_t dist[] = { 10, 100, 1000, 10000 };
+	latency = 0;
+	printf( "accel  speed  steps   ideal, ms   engine, ms   off, %%   peak accel, %%\n" );
+	for( int a = 0; a < 2; a++ )
+		for( int s = 0; s < 2; s++ )
+			for( int d = 0; d < 4; d++ )
+			{
+				setup();
+				accel_limit[0] = acc[a];
+				speed_limit[0] = spd[s];
+				Stepper_SetLimits( &axis[0], acc[a], spd[s] );
+				double t = move_time( 0, dist[d] ), want = ideal_time( dist[d], acc[a], spd[s] );
+				printf( "%5u  %5u  %5d  %10.2f  %11.2f  %6.2f  %13.1f\n", acc[a], spd[s], dist[d], want * 1000, t * 1000,
+					( t - want ) / want * 100, model[0].peak_accel * 100 );
+			}
+
+	setup();
+	for( int i = 0; i < 2; i++ )
+	{
+		accel_limit[i] = 1000000;
+		speed_limit[i] = 100000;
+		Stepper_SetLimits( &axis[i], accel_limit[i], speed_limit[i] );
+	}
+	double t0 = seconds();
+	Stepper_Move( &axis[0], 2000000 );
+	Stepper_Move( &axis[1], -2000000 );
+	run_idle();
+	double dt = seconds() - t0;
+	printf( "host, two axes: %.0f ns a step, with the model\n", dt / ( model[0].steps + model[1].steps ) * 1e9 );
+}
+
+int main( int argc, char ** argv )
+{
+	int n = 200, do_bench = 0, c;
+	uint32_t seed = 1;
+	while( ( c = getopt( argc, argv, "n:r:b" ) ) != -1 )
+	{
+		switch( c )
+		{
+		case 'n': n = atoi( optarg ); break;
+		case 'r': seed = strtoul( optarg, 0, 0 ); break;
+		case 'b': do_bench = 1; break;
+		default:
+			fprintf( stderr, "usage: %s [-n iterations] [-r seed] [-b]\n", argv[0] );
+			return 1;
+		}
+	}
+	rng_state = seed * 0x9e3779b97f4a7c15ull + 1;
+	latency = rnd() % ( STEPPER_TICK_HZ / 100000 + 1 ); // up to 10 us
+
+	check_moves( n );
+	check_jog( n / 4 );
+	check_retarget( n / 4 );
+	check_linear( n / 2 );
+	check_shared( n / 10 );
+	if( irq_off ) violation( "interrupts left off" );
+	if( do_bench ) bench();
+
+	if( violations ) failures++;
+	printf( failures ? "FAILED\n" : "ok\n" );
+	return failures ? 2 : 0;
+}
@@ -0,0 +1,423 @@
+/* Replays touch traces through lib_touch_filter.h on the host and checks
+	the presses and releases against what the trace says the fingers did.
+	The traces are either read from a file or made up by a model of the
+	TOUCH_SCAN readings of ch32v003_touch.h: drift, noise, spikes, light
+	touches and crosstalk from the pads next door. See README.md.
+*/
+
+#include <getopt.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lib_touch_filter.h"
+
+#define MAXPADS 8
+
+// How long after the finger the filter may take: TOUCH_SIG_SHIFT smoothing
+// and TOUCH_DEBOUNCE, from a touch of 1.5 thresholds that ramps up over 4
+// frames.
+#define LATENCY ( TOUCH_DEBOUNCE + 6 )
+
+// What the trace says about each pad in each frame.
+#define FINGER_OFF   0 // nothing there, no press allowed
+#define FINGER_PRESS 1 // a press, it has to be seen
+#define FINGER_LIGHT 2 // a touch too light to count, no press allowed
+#define FINGER_ANY   3 // either way
+
+static int failures, quiet;
+
+static void fail( const char * what, int pad, long frame )
+{
+	if( failures++ < 10 && !quiet ) printf( "FAIL %s (pad %d, frame %ld)\n", what, pad, frame );
+}
+
+static uint64_t rng_state;
+
+static uint32_t rnd( void )
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state >> 32;
+}
+
+static double frnd( void )
+{
+	return rnd() / 4294967296.0;
+}
+
+static double gauss( void )
+{
+	return sqrt( -2 * log( 1 - frnd() ) ) * cos( 2 * M_PI * frnd() );
+}
+
+typedef struct
+{
+	int pads;
+	int threshold[MAXPADS];
+	long frames;
+	int32_t * raw;   // frames * pads
+	uint8_t * label; // frames * pads, FINGER_*
+} Trace;
+
+/* The model. Each pad sits at its own level, 1500 to 3500 of the summed
+	reading, and drifts on a slow sine whose steepest is drift thresholds
+	a thousand frames. Gaussian noise of noise thresholds, and now and then a
+	spike of up to 2.5 thresholds for a frame either way. Touches of 1.5 to 4
+	thresholds and 10 frames to 3 s that ramp on and off over 1 to 4 frames,
+	light ones of 0.2 to 0.4, a twentieth of each on the pads either side, and
+	once in a while one held past TOUCH_MAX_HOLD. The first pad may have a
+	finger on it at power up. */
+static void model_trace( Trace * t, int pads, long frames, int threshold, double noise, double drift )
+{
+	t->pads = pads;
+	t->frames = frames;
+	t->raw = malloc( frames * pads * sizeof( *t->raw ) );
+	t->label = malloc( frames * pads );
+	double * touch = calloc( frames * pads, sizeof( double ) );
+	for( int p = 0; p < pads; p++ )
+	{
+		t->threshold[p] = threshold;
+		long f = 0;
+		if( p == 0 && rnd() % 2 )
+		{
+			// On the pad before the first reading, lifted a second in.
+			for( ; f < 100; f++ )
+			{
+				touch[f * pads] = 2.0 * threshold;
+				t->label[f * pads] = FINGER_ANY;
+			}
+		}
+		while( f < frames )
+		{
+			long gap = 50 + rnd() % 300, len, ramp_on = 1 + rnd() % 4, ramp_off = 1 + rnd() % 4;
+			for( ; gap-- && f < frames; f++ ) t->label[f * pads + p] = FINGER_OFF;
+			int light = rnd() % 4 == 0;
+			double amp = ( light ? 0.2 + 0.2 * frnd() : 1.5 + 2.5 * frnd() ) * threshold;
+			len = rnd() % 64 == 0 && !light ? TOUCH_MAX_HOLD + 200 + rnd() % 500 : 10 + rnd() % 290;
+			for( long k = 0; k < len + ramp_off && f < frames; k++, f++ )
+			{
+				double a = k < ramp_on ? amp * ( k + 1 ) / ramp_on : k < len ? amp : amp * ( len + ramp_off - k ) / ( ramp_off + 1 );
+				touch[f * pads + p] += a;
+				if( p > 0 ) touch[f * pads + p - 1] += a / 20;
+				if( p < pads - 1 ) touch[f * pads + p + 1] += a / 20;
+				t->label[f * pads + p] = light ? FINGER_LIGHT : k < len ? FINGER_PRESS : FINGER_ANY;
+			}
+		}
+	}
+	// A light touch with the one next door on as well can add up to a
+	// press.
+	for( long i = 0; i < frames * pads; i++ )
+		if( t->label[i] != FINGER_PRESS && touch[i] >= 0.6 * threshold ) t->label[i] = FINGER_ANY;
+	for( int p = 0; p < pads; p++ )
+	{
+		double level = 1500 + rnd() % 2000, period = 2000 + rnd() % 20000, phase = frnd() * 2 * M_PI;
+		// Steepest slope of a sine is its amplitude times 2 pi / period.
+		double amp = drift * threshold / 1000 * period / ( 2 * M_PI );
+		for( long f = 0; f < frames; f++ )
+		{
+			double x = level + amp * sin( 2 * M_PI * f / period + phase ) + touch[f * pads + p] + gauss() * noise * threshold;
+			if( rnd() % 1000 == 0 ) x += ( rnd() % 2 ? 1 : -1 ) * ( 0.5 + 2 * frnd() ) * threshold;
+			t->raw[f * pads + p] = (int32_t)lrint( x );
+		}
+	}
+	free( touch );
+}
+
+/* pads N
+	threshold t0 t1 ..
+	then a frame a line, the N readings and the N FINGER_* labels. # to the
+	end of a line is a comment. */
+static int read_trace( Trace * t, const char * path )
+{
+	FILE * f = fopen( path, "r" );
+	if( !f ) { perror( path ); return -1; }
+	char line[1024];
+	long cap = 0;
+	memset( t, 0, sizeof( *t ) );
+	while( fgets( line, sizeof( line ), f ) )
+	{
+		char * c = strchr( line, '#' ), * s = line, * e;
+		if( c ) *c = 0;
+		if( sscanf( line, " pads %d", &t->pads ) == 1 )
+		{
+			if( t->pads < 1 || t->pads > MAXPADS ) { fprintf( stderr, "%s: 1 to %d pads\n", path, MAXPADS ); return -1; }
+			continue;
+		}
+		if( ( s = strstr( line, "threshold" ) ) )
+		{
+			s += 9;
+			for( int p = 0; p < t->pads; p++, s = e )
+				t->threshold[p] = strtol( s, &e, 0 );
+			continue;
+		}
+		int32_t v[MAXPADS * 2];
+		int n = 0;
+		for( s = line; n < t->pads * 2; n++, s = e )
+		{
+			v[n] = strtol( s, &e, 0 );
+			if( e == s ) break;
+		}
+		if( n == 0 ) continue;
+		if( !t->pads || n != t->pads * 2 ) { fprintf( stderr, "%s: bad frame %ld\n", path, t->frames ); return -1; }
+		if( t->frames == cap )
+		{
+			cap = cap ? cap * 2 : 4096;
+			t->raw = realloc( t->raw, cap * t->pads * sizeof( *t->raw ) );
+			t->label = realloc( t->label, cap * t->pads );
+		}
+		for( int p = 0; p < t->pads; p++ )
+		{
+			t->raw[t->frames * t->pads + p] = v[p];
+			t->label[t->frames * t->pads + p] = v[t->pads + p];
+		}
+		t->frames++;
+	}
+	fclose( f );
+	return 0;
+}
+
+static void write_trace( const Trace * t, const char * path, const char * how )
+{
+	FILE * f = fopen( path, "w" );
+	if( !f ) { perror( path ); exit( 1 ); }
+	fprintf( f, "# %s\n# readings, then 0 off, 1 press, 2 light, 3 either\npads %d\nthreshold", how, t->pads );
+	for( int p = 0; p < t->pads; p++ ) fprintf( f, " %d", t->threshold[p] );
+	fprintf( f, "\n" );
+	for( long i = 0; i < t->frames; i++ )
+	{
+		for( int p = 0; p < t->pads; p++ ) fprintf( f, "%d ", t->raw[i * t->pads + p] );
+		for( int p = 0; p < t->pads; p++ ) fprintf( f, p ? " %d" : "%d", t->label[i * t->pads + p] );
+		fprintf( f, "\n" );
+	}
+	fclose( f );
+}
+
+typedef struct
+{
+	long touches, presses, missed, false_presses, stuck, hold_releases;
+	long latency_sum, release_sum, releases;
+	int latency_worst, release_worst;
+} Stats;
+
+static int touching( int label )
+{
+	return label == FINGER_PRESS || label == FINGER_ANY;
+}
+
+/* One frame at a time through TouchFilterUpdate(), as the DMA interrupt
+	does, events through the queue to a main loop that sometimes doesn't
+	look for a while.
+
+	A touch is a run of FINGER_PRESS and FINGER_ANY frames. A press is only
+	allowed in a touch or LATENCY frames after one, a release anywhere but
+	in FINGER_PRESS, unless it's TOUCH_MAX_HOLD letting go. LATENCY frames
+	into a run of FINGER_PRESS the pad has to be pressed, and LATENCY frames
+	after a touch it has to be released. */
+static void replay( const Trace * t, Stats * st )
+{
+	TouchChannel ch[MAXPADS];
+	TouchEventQueue q = { 0 };
+	TouchEvent want[TOUCH_EVENT_QUEUE];
+	long want_head = 0, want_tail = 0, stall = 0;
+
+	// Per pad: where the current touch and run of FINGER_PRESS started, and
+	// when the last touch ended. -1 when there isn't one.
+	long touch_start[MAXPADS], press_start[MAXPADS], touch_end[MAXPADS], pressed_at[MAXPADS];
+	memset( st, 0, sizeof( *st ) );
+	for( int p = 0; p < t->pads; p++ )
+	{
+		TouchFilterInit( &ch[p], t->threshold[p] );
+		touch_start[p] = press_start[p] = touch_end[p] = pressed_at[p] = -1;
+	}
+
+	for( long f = 0; f < t->frames; f++ )
+	{
+		for( int p = 0; p < t->pads; p++ )
+		{
+			int l = t->label[f * t->pads + p];
+			// A finger there before the filter has settled can't be told
+			// from the pad.
+			if( l == FINGER_PRESS && f < TOUCH_WARMUP + LATENCY ) l = FINGER_ANY;
+			if( touching( l ) && touch_start[p] < 0 ) touch_start[p] = f;
+			if( !touching( l ) && touch_start[p] >= 0 )
+			{
+				touch_start[p] = -1;
+				touch_end[p] = f;
+			}
+			if( l == FINGER_PRESS && press_start[p] < 0 )
+			{
+				press_start[p] = f;
+				st->touches++;
+			}
+			if( l != FINGER_PRESS ) press_start[p] = -1;
+
+			int ev = TouchFilterUpdate( &ch[p], t->raw[f * t->pads + p] );
+			if( ev == TOUCH_EV_PRESS )
+			{
+				st->presses++;
+				if( pressed_at[p] >= 0 ) fail( "pressed twice", p, f );
+				pressed_at[p] = f;
+				if( touch_start[p] >= 0 )
+				{
+					int lat = f - touch_start[p];
+					st->latency_sum += lat;
+					if( lat > st->latency_worst ) st->latency_worst = lat;
+				}
+				else if( touch_end[p] < 0 || f - touch_end[p] > LATENCY )
+				{
+					st->false_presses++;
+					fail( l == FINGER_LIGHT ? "pressed by a light touch" : "pressed without a finger", p, f );
+				}
+			}
+			else if( ev == TOUCH_EV_RELEASE )
+			{
+				if( pressed_at[p] < 0 ) fail( "released without a press", p, f );
+				else if( l == FINGER_PRESS && f - pressed_at[p] >= TOUCH_MAX_HOLD - 1 ) st->hold_releases++;
+				else if( l == FINGER_PRESS ) fail( "released with the finger on", p, f );
+				else if( touch_start[p] < 0 && touch_end[p] >= 0 )
+				{
+					int lat = f - touch_end[p];
+					st->release_sum += lat;
+					st->releases++;
+					if( lat > st->release_worst ) st->release_worst = lat;
+				}
+				pressed_at[p] = -1;
+			}
+			else if( ev )
+				fail( "unknown event", p, ev );
+
+			if( press_start[p] >= 0 && f - press_start[p] == LATENCY && !ch[p].pressed && pressed_at[p] < 0 )
+			{
+				// Unless TOUCH_MAX_HOLD let go of it already.
+				st->missed++;
+				fail( "missed a press", p, f );
+			}
+			if( touch_start[p] < 0 && touch_end[p] >= 0 && f - touch_end[p] == LATENCY && ch[p].pressed )
+			{
+				st->stuck++;
+				fail( "not released", p, f );
+			}
+
+			// What the queue should hand out, unless it's full.
+			if( ev )
+			{
+				if( (uint8_t)( q.head - q.tail ) < TOUCH_EVENT_QUEUE ) want[want_head++ % TOUCH_EVENT_QUEUE] = (TouchEvent){ p, ev };
+				TouchEventPush( &q, p, ev );
+			}
+		}
+
+		// The main loop, now and then busy for up to half a second.
+		if( stall ) stall--;
+		else if( rnd() % 500 == 0 ) stall = rnd() % 50;
+		TouchEvent e;
+		while( !stall && TouchEventPop( &q, &e ) )
+		{
+			TouchEvent w = want[want_tail++ % TOUCH_EVENT_QUEUE];
+			if( want_tail > want_head || e.channel != w.channel || e.type != w.type ) fail( "queue out of order", e.channel, f );
+		}
+	}
+}
+
+static void report( const char * name, const Stats * st )
+{
+	printf( "%s: %ld touches, %ld presses, %ld missed, %ld false, %ld not released, %ld released by TOUCH_MAX_HOLD\n",
+		name, st->touches, st->presses, st->missed, st->false_presses, st->stuck, st->hold_releases );
+	if( st->presses && st->releases )
+		printf( "%s: press after %.1f frames, worst %d, release after %.1f, worst %d\n", name,
+			(double)st->latency_sum / st->presses, st->latency_worst,
+			(double)st->release_sum / st->releases, st->release_worst );
+}
+
+// Misses and false presses over noise and drift, 100 pads for 10 minutes
+// at 100 frames/s each.
+static void bench( void )
+{
+	static const double noises[] = { 0.05, 0.1, 0.15, 0.2, 0.25 };
+	static const double drifts[] = { 0.1, 0.2, 0.5, 1, 2 };
+	printf( "threshold 40, misses and false presses a 1000 touches\n" );
+	printf( "drift, th/1000 frames " );
+	for( int d = 0; d < 5; d++ ) printf( "  %11.1f", drifts[d] );
+	printf( "\nnoise, th             " );
+	for( int d = 0; d < 5; d++ ) printf( "  %5s %5s", "miss", "false" );
+	printf( "\n" );
+	for( int n = 0; n < 5; n++ )
+	{
+		printf( "%9.2f             ", noises[n] );
+		for( int d = 0; d < 5; d++ )
+		{
+			Stats sum = { 0 };
+			for( int r = 0; r < 25; r++ )
+			{
+				Trace t;
+				Stats st;
+				model_trace( &t, 4, 60000, 40, noises[n], drifts[d] );
+				int fails = failures;
+				quiet = 1;
+				replay( &t, &st );
+				quiet = 0;
+				failures = fails;
+				sum.touches += st.touches;
+				sum.missed += st.missed;
+				sum.false_presses += st.false_presses;
+				free( t.raw );
+				free( t.label );
+			}
+			printf( "  %5.1f %5.1f", 1000.0 * sum.missed / sum.touches, 1000.0 * sum.false_presses / sum.touches );
+		}
+		printf( "\n" );
+	}
+}
+
+int main( int argc, char ** argv )
+{
+	long frames = 60000;
+	int pads = 8, do_bench = 0, c;
+	uint32_t seed = 1;
+	const char * in = 0, * out = 0;
+	while( ( c = getopt( argc, argv, "n:p:r:t:w:b" ) ) != -1 )
+	{
+		switch( c )
+		{
+		case 'n': frames = atol( optarg ); break;
+		case 'p': pads = atoi( optarg ); break;
+		case 'r': seed = strtoul( optarg, 0, 0 ); break;
+		case 't': in = optarg; break;
+		case 'w': out = optarg; break;
+		case 'b': do_bench = 1; break;
+		default:
+			fprintf( stderr, "usage: %s [-n frames] [-p pads] [-r seed] [-t trace] [-w trace] [-b]\n", argv[0] );
+			return 1;
+		}
+	}
+	if( pads < 1 || pads > MAXPADS ) pads = MAXPADS;
+	rng_state = seed * 0x9e3779b97f4a7c15ull + 1;
+
+	Trace t;
+	Stats st;
+	if( in )
+	{
+		if( read_trace( &t, in ) ) return 1;
+		replay( &t, &st );
+		report( in, &st );
+	}
+	else
+	{
+		model_trace( &t, pads, frames, 40, 0.1, 0.1 );
+		if( out )
+		{
+			char how[64];
+			snprintf( how, sizeof( how ), "touchsim -r %u -p %d -n %ld", seed, pads, frames );
+			write_trace( &t, out, how );
+		}
+		replay( &t, &st );
+		report( "model", &st );
+	}
+	if( do_bench ) bench();
+
+	printf( failures ? "FAILED\n" : "ok\n" );
+	return failures ? 2 : 0;
+}
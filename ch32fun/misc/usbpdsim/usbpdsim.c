@@ -0,0 +1,1424 @@
+/* Checks examples_x035/usbpd_sink/usbpd.h on the host: its interrupt and
+	policy engine, unmodified, against a model of the CH32X035 USBPD
+	peripheral on the register traps of misc/ethsim, with a simulated PD
+	source at the other end of the CC line. The source loses messages,
+	answers Wait and Reject, resets, changes its capabilities, and drops a
+	PPS contract that isn't kept up. Then the negotiation latency and the
+	PPS response time. See README.md.
+*/
+
+#include "ch32fun.h"
+
+#define ETH_IRQn USBPD_IRQn
+#include "ethsim.h"
+
+#include <getopt.h>
+#include <time.h>
+
+// What ch32fun has on the part. The model takes the interrupt only between
+// calls to USBPD_SinkNegotiate() and in Delay_Us(), never inside a critical
+// section.
+static void __disable_irq( void ) { }
+static void __enable_irq( void ) { }
+
+#define USBPD_IMPLEMENTATION
+#include "usbpd.h"
+
+#define US 1000ull
+#define MS 1000000ull
+#define NEVER ETHSIM_NEVER
+
+static int failures;
+static uint32_t violations;
+
+static void fail( const char * what, uint32_t a, uint32_t b )
+{
+	if( failures++ < 10 ) printf( "FAIL %s (%u, %u) at %.3fms\n", what, a, b, ethsim_now / 1e6 );
+}
+
+static void violation( const char * what )
+{
+	if( violations++ < 10 ) printf( "violation: %s at %.3fms\n", what, ethsim_now / 1e6 );
+}
+
+static uint64_t rng_state;
+
+static uint32_t rnd( void )
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state >> 32;
+}
+
+static uint32_t rnd_range( uint32_t lo, uint32_t hi )
+{
+	return lo + rnd() % ( hi - lo + 1 );
+}
+
+static int chance( int permille )
+{
+	return (int)( rnd() % 1000 ) < permille;
+}
+
+static double seconds( void )
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t min64( uint64_t a, uint64_t b )
+{
+	return a < b ? a : b;
+}
+
+typedef struct
+{
+	uint64_t sum, worst;
+	uint32_t n;
+} stat;
+
+static stat st_caps_request, st_attach, st_pps_request, st_pps_ready;
+
+static void stat_add( stat * s, uint64_t ns )
+{
+	s->sum += ns;
+	s->n++;
+	if( ns > s->worst ) s->worst = ns;
+}
+
+// BMC at 300 kbit/s: preamble, SOP, the bytes and the CRC 4b5b coded, EOP.
+static uint64_t wire_ns( int len )
+{
+	return ( 64 + 20 + ( len + 4 ) * 10 + 5 ) * 10000ull / 3;
+}
+
+#define HARD_RESET_NS ( ( 64 + 20 ) * 10000ull / 3 )
+#define T_TRANSMIT ( 195 * US )          // GoodCRC has to start this soon after the message
+#define T_RECEIVE ( 1 * MS )             // and be in by then
+#define T_RECEIVER_RESPONSE ( 15 * MS )  // answer to Get_Sink_Cap and the like
+#define T_SENDER_RESPONSE ( 27 * MS )
+#define T_PPS_TIMEOUT ( 12000 * MS )
+#define T_SINK_REQUEST ( 100 * MS )
+
+/* The peripheral. STATUS flags live here, reads of STATUS and PORT_CCx
+	are filled in before every access. */
+
+static uint8_t * pd_page;
+static uint8_t * rcc_page;
+
+#define PD( field ) ETHSIM_REG( pd_page + ( USBPD_BASE & 0xfff ), USBPD_DETAILED_TypeDef, field )
+#define PD_OFF( field ) ( ( USBPD_BASE & 0xfff ) + offsetof( USBPD_DETAILED_TypeDef, field ) )
+
+static struct
+{
+	uint8_t flags; // IF_* and BUF_ERR
+	uint8_t aux;
+	int rx;        // receiver started
+	int tx;        // transmitting
+	int hard_reset;
+	int line;
+	int corrupt;
+	uint8_t buf[40];
+	int len;
+	uintptr_t dma;
+	uint64_t start, end;
+	uint32_t overruns;
+} phy;
+
+// The source's transmitter
+static struct
+{
+	int active;
+	int goodcrc;
+	int hard_reset;
+	int corrupt;
+	uint8_t buf[32];
+	int len;
+	uint64_t start, end;
+} wsrc;
+
+static int phy_line( void )
+{
+	return ( PD( CONFIG ) & CC_SEL ) ? 2 : 1;
+}
+
+static uint32_t collisions;
+
+static void src_rx( void );
+static int src_cc( void );
+static uint64_t src_line_free( void );
+
+static void pd_pre( uint32_t off )
+{
+	(void)off;
+	if( !( ETHSIM_REG( rcc_page + ( RCC_BASE & 0xfff ), RCC_TypeDef, AHBPCENR ) & RCC_USBPD ) )
+		violation( "USBPD used without its clock" );
+
+	PD( STATUS ) = phy.flags | phy.aux;
+
+	// Rp on the line the source is on, with the odd low reading while BMC goes by
+	for( int line = 1; line <= 2; line++ )
+	{
+		volatile uint16_t * cc = line == 1 ? &PD( PORT_CC1 ) : &PD( PORT_CC2 );
+		int rp = src_cc() == line && ( *cc & CC_CMP_MASK );
+		if( rp && ( wsrc.active || phy.tx ) && ( rnd() & 1 ) ) rp = 0;
+		*cc = ( *cc & ~PA_CC_AI ) | ( rp ? PA_CC_AI : 0 );
+	}
+}
+
+static void phy_start_tx( void )
+{
+	if( !( PD( CONFIG ) & PD_DMA_EN ) ) violation( "transmission with DMA off" );
+	if( PD( BMC_CLK_CNT ) != UPD_TMR_TX ) violation( "transmission with the receive bit clock" );
+	if( phy.tx ) violation( "transmission started while one is going out" );
+
+	phy.hard_reset = PD( TX_SEL ) == UPD_HARD_RESET;
+	if( !phy.hard_reset && PD( TX_SEL ) != UPD_SOP0 ) violation( "TX_SEL neither SOP nor Hard Reset" );
+	phy.len = phy.hard_reset ? 0 : PD( BMC_TX_SZ );
+	if( !phy.hard_reset && ( phy.len < 2 || phy.len > 30 ) )
+	{
+		violation( "transmission size" );
+		phy.len = 2;
+	}
+	phy.dma = PD( DMA );
+	memcpy( phy.buf, (void *)phy.dma, phy.len );
+	phy.tx = 1;
+	phy.rx = 0;
+	phy.line = phy_line();
+	phy.start = ethsim_now;
+	phy.end = ethsim_now + ( phy.hard_reset ? HARD_RESET_NS : wire_ns( phy.len ) );
+	phy.corrupt = 0;
+
+	if( src_cc() && phy.line != src_cc() ) violation( "transmission on the CC line without Rp" );
+
+	// Both ends talking at once, neither gets through. Hard Reset signalling wins.
+	if( wsrc.active && src_cc() == phy.line )
+	{
+		wsrc.corrupt = 1;
+		phy.corrupt = !phy.hard_reset && !wsrc.hard_reset;
+		collisions++;
+	}
+}
+
+static void pd_post( uint32_t off, const uint8_t * old )
+{
+	(void)old;
+	if( off == PD_OFF( STATUS ) )
+	{
+		phy.flags &= ~( PD( STATUS ) & 0xfc );
+		PD( STATUS ) = phy.flags | phy.aux;
+	}
+	else if( off == PD_OFF( CONTROL ) )
+	{
+		uint8_t c = PD( CONTROL );
+		if( !( c & BMC_START ) ) return;
+		PD( CONTROL ) = c & ~BMC_START;
+		if( c & PD_TX_EN )
+		{
+			phy_start_tx();
+		}
+		else
+		{
+			if( phy.tx ) violation( "receiver started while transmitting" );
+			if( PD( BMC_CLK_CNT ) != UPD_TMR_RX ) violation( "receiver started with the transmit bit clock" );
+			phy.rx = 1;
+		}
+	}
+	else if( off == PD_OFF( CONFIG ) )
+	{
+		if( phy.tx && phy_line() != phy.line ) violation( "CC_SEL changed while transmitting" );
+	}
+}
+
+static uint64_t phy_next( void )
+{
+	return phy.tx ? phy.end : NEVER;
+}
+
+static void phy_fire( void )
+{
+	phy.tx = 0;
+	phy.flags |= IF_TX_END;
+	if( !phy.hard_reset && memcmp( phy.buf, (void *)phy.dma, phy.len ) )
+		violation( "transmit buffer changed while it went out" );
+	src_rx();
+}
+
+static int phy_irq( void )
+{
+	uint16_t cfg = PD( CONFIG );
+	return ( ( cfg & IE_TX_END ) && ( phy.flags & IF_TX_END ) ) || ( ( cfg & IE_RX_ACT ) && ( phy.flags & IF_RX_ACT ) ) ||
+		   ( ( cfg & IE_RX_RESET ) && ( phy.flags & IF_RX_RESET ) );
+}
+
+// What the source sent, arriving at the sink.
+static void phy_deliver( void )
+{
+	if( phy_line() != src_cc() || wsrc.corrupt ) return;
+	if( wsrc.hard_reset )
+	{
+		phy.flags |= IF_RX_RESET;
+		phy.aux = BMC_AUX_SOP1_HRST;
+		return;
+	}
+	if( !phy.rx ) return;
+	if( !( PD( CONFIG ) & PD_DMA_EN ) ) return;
+	if( phy.flags & IF_RX_ACT ) phy.overruns++;
+	if( PD( DMA ) != (uint32_t)(uintptr_t)s_rxBuffer ) violation( "receiving into the transmit buffer" );
+
+	uint8_t * p = (uint8_t *)(uintptr_t)PD( DMA );
+	uint32_t crc = ethsim_crc32( wsrc.buf, wsrc.len );
+	memcpy( p, wsrc.buf, wsrc.len );
+	memcpy( p + wsrc.len, &crc, 4 );
+	PD( BMC_BYTE_CNT ) = wsrc.len + 4;
+	phy.aux = BMC_AUX_SOP0;
+	phy.flags |= IF_RX_ACT;
+}
+
+/* The source: a protocol layer with GoodCRC, retries and duplicate
+	detection, and a policy engine that offers its capabilities, takes
+	Requests, and resets when things go wrong. */
+
+enum
+{
+	S_OFF,
+	S_STARTUP,       // VBUS on, Source_Capabilities after tFirstSourceCap
+	S_SEND_CAPS,
+	S_WAIT_REQUEST,
+	S_TRANSITION,    // Accepted, PS_RDY when the supply is there
+	S_READY,
+	S_ACCEPT_RESET,  // Accepting the sink's Soft_Reset
+	S_SOFT_RESET,    // Sent Soft_Reset, waiting for Accept
+	S_HARD_RESET,    // VBUS off
+	S_DISABLED,
+};
+
+typedef struct
+{
+	uint8_t buf[32];
+	int len;
+	uint64_t at;
+} src_msg;
+
+static struct
+{
+	// Set up by the tests
+	int cc;
+	int rev;
+	uint32_t caps[7];
+	int ncaps;
+	int p_drop;          // per mille of the sink's messages not seen
+	int p_corrupt;       // of the source's messages the sink doesn't see
+	int p_lose_goodcrc;  // of the source's GoodCRCs
+	int p_goodcrc_once;  // of the GoodCRCs either way, the first try only
+	int p_wait, p_reject;
+	int no_caps, no_accept;
+
+	// Protocol layer
+	int tx_id, rx_last;
+	src_msg out[8];
+	int nout;
+	int out_state; // 0 idle, 1 to start at out_at, 2 on the wire, 3 waiting for GoodCRC until out_at
+	uint64_t out_at;
+	int retries;
+	uint64_t last_end;
+	int goodcrc_id;
+	uint64_t goodcrc_at;
+	int goodcrc_lost;
+	int hr_pending;
+
+	// Policy engine
+	int state;
+	uint64_t timer;
+	int caps_count;
+	int await;
+	uint64_t await_at, await_deadline;
+	int p_index, p_pps, p_mv, p_ma;
+	uint64_t p_transition;
+	int contract, index, pps, mv, ma;
+	uint64_t pps_deadline;
+	int vbus_mv;
+
+	// What the tests look at
+	uint64_t caps_end, request_start, wait_sent;
+	uint32_t requests, accepts, waits, rejects;
+	uint32_t sink_soft_resets, sink_hard_resets, soft_resets, hard_resets;
+	uint32_t dropped, duplicates, retried, tx_failures, lapsed;
+	uint32_t sink_caps, not_supported;
+	uint64_t goodcrc_worst, response_worst;
+} src;
+
+static int src_cc( void )
+{
+	return src.cc;
+}
+
+static uint32_t pdo_word( USBPD_SourcePDO_t p )
+{
+	uint32_t w;
+	memcpy( &w, &p, 4 );
+	return w;
+}
+
+static uint32_t pdo_fixed( int mv, int ma )
+{
+	return pdo_word( ( USBPD_SourcePDO_t ){
+		.FixedSupply = { .VoltageIn50mV = mv / 50, .MaxCurrentIn10mA = ma / 10, .PDOType = eUSBPD_PDO_FIXED } } );
+}
+
+static uint32_t pdo_pps( int min_mv, int max_mv, int ma )
+{
+	return pdo_word( ( USBPD_SourcePDO_t ){ .SPR_PPS = { .MinVoltageIn100mV = min_mv / 100,
+												.MaxVoltageIn100mV = max_mv / 100,
+												.MaxCurrentIn50mA = ma / 50,
+												.AugmentedType = eUSBPD_APDO_SPR_PPS,
+												.PDOType = eUSBPD_PDO_AUGMENTED } } );
+}
+
+static USBPD_SourcePDO_t src_pdo( int i )
+{
+	USBPD_SourcePDO_t p;
+	memcpy( &p, &src.caps[i], 4 );
+	return p;
+}
+
+static void src_wire( const uint8_t * buf, int len, int goodcrc, int hard_reset, int corrupt )
+{
+	wsrc.active = 1;
+	wsrc.goodcrc = goodcrc;
+	wsrc.hard_reset = hard_reset;
+	wsrc.corrupt = corrupt;
+	memcpy( wsrc.buf, buf, len );
+	wsrc.len = len;
+	wsrc.start = ethsim_now;
+	wsrc.end = ethsim_now + ( hard_reset ? HARD_RESET_NS : wire_ns( len ) );
+	if( phy.rx && phy_line() == src.cc ) phy.flags |= IF_RX_BIT | IF_RX_BYTE;
+	if( phy.tx && phy.line == src.cc )
+	{
+		wsrc.corrupt = !hard_reset && !phy.hard_reset;
+		phy.corrupt = 1;
+		collisions++;
+	}
+}
+
+static void src_queue( int type, int ndo, const uint32_t * data, uint64_t delay )
+{
+	if( src.nout == 8 )
+	{
+		violation( "source queue full" );
+		return;
+	}
+	src_msg * m = &src.out[src.nout++];
+	USBPD_MessageHeader_t h = {
+		.MessageType = type,
+		.NumberOfDataObjects = ndo,
+		.SpecificationRevision = src.rev,
+		.PortPowerRole = eUSBPD_PORTPOWEROLE_SOURCE,
+	};
+	memcpy( m->buf, &h, 2 );
+	if( ndo ) memcpy( m->buf + 2, data, ndo * 4 );
+	m->len = 2 + ndo * 4;
+	m->at = ethsim_now + delay;
+	if( src.out_state == 0 )
+	{
+		src.out_state = 1;
+		src.out_at = m->at;
+	}
+}
+
+static void src_flush( void )
+{
+	src.nout = 0;
+	src.out_state = 0;
+	src.retries = 0;
+	src.tx_id = 0;
+	src.rx_last = -1;
+}
+
+static void src_send_caps( void )
+{
+	src.state = S_SEND_CAPS;
+	src.timer = NEVER;
+	if( !src.no_caps ) src_queue( eUSBPD_DATA_MSG_SOURCE_CAP, src.ncaps, src.caps, 0 );
+	else src.timer = ethsim_now + 150 * MS;
+}
+
+static void src_enter_hard_reset( void )
+{
+	src_flush();
+	src.hr_pending = 0;
+	src.goodcrc_at = NEVER;
+	src.state = S_HARD_RESET;
+	src.contract = 0;
+	src.pps_deadline = NEVER;
+	src.await = 0;
+	src.await_deadline = NEVER;
+	src.vbus_mv = 0;
+	src.timer = ethsim_now + rnd_range( 700, 1300 ) * MS; // tSrcRecover and VBUS back to vSafe5V
+}
+
+static void src_hard_reset( void )
+{
+	src.hard_resets++;
+	src_enter_hard_reset();
+	src.hr_pending = 1;
+}
+
+static void src_soft_reset( void )
+{
+	src.soft_resets++;
+	src_flush();
+	src.state = S_SOFT_RESET;
+	src.timer = NEVER;
+	src_queue( eUSBPD_CTRL_MSG_SOFT_RESET, 0, 0, 0 );
+}
+
+static void src_attach( int cc )
+{
+	memset( &wsrc, 0, sizeof( wsrc ) );
+	src_flush();
+	src.cc = cc;
+	src.goodcrc_at = NEVER;
+	src.hr_pending = 0;
+	src.contract = 0;
+	src.pps_deadline = NEVER;
+	src.await = 0;
+	src.await_deadline = NEVER;
+	src.wait_sent = NEVER;
+	src.vbus_mv = 5000;
+	src.caps_end = 0;
+	src.state = S_STARTUP;
+	src.timer = ethsim_now + rnd_range( 30000, 150000 ) * US; // tFirstSourceCap after VBUS
+}
+
+static void src_detach( void )
+{
+	src_flush();
+	src.cc = 0;
+	src.state = S_OFF;
+	src.timer = NEVER;
+	src.goodcrc_at = NEVER;
+	src.hr_pending = 0;
+	src.contract = 0;
+	src.pps_deadline = NEVER;
+	src.await_deadline = NEVER;
+	src.vbus_mv = 0;
+	wsrc.active = 0;
+}
+
+// A message of ours got its GoodCRC, or failed.
+static void src_sent( int type, int ndo )
+{
+	if( ndo && type == eUSBPD_DATA_MSG_SOURCE_CAP )
+	{
+		src.state = S_WAIT_REQUEST;
+		src.timer = ethsim_now + T_SENDER_RESPONSE;
+		src.caps_end = src.last_end;
+		src.caps_count = 0;
+	}
+	else if( ndo ) {}
+	else if( type == eUSBPD_CTRL_MSG_ACCEPT && src.state == S_TRANSITION )
+		src.timer = ethsim_now + src.p_transition;
+	else if( type == eUSBPD_CTRL_MSG_ACCEPT && src.state == S_ACCEPT_RESET )
+		src_send_caps();
+	else if( type == eUSBPD_CTRL_MSG_PS_RDY )
+	{
+		src.state = S_READY;
+		src.contract = 1;
+		src.index = src.p_index;
+		src.pps = src.p_pps;
+		src.mv = src.p_mv;
+		src.ma = src.p_ma;
+		src.pps_deadline = src.pps ? ethsim_now + T_PPS_TIMEOUT : NEVER;
+	}
+	else if( type == eUSBPD_CTRL_MSG_SOFT_RESET )
+	{
+		src.timer = ethsim_now + T_SENDER_RESPONSE;
+	}
+	else if( type == eUSBPD_CTRL_MSG_GET_SINK_CAP || type == eUSBPD_CTRL_MSG_GET_SOURCE_CAP )
+	{
+		src.await = type;
+		src.await_at = src.last_end;
+		src.await_deadline = ethsim_now + T_RECEIVER_RESPONSE;
+	}
+	else if( type == eUSBPD_CTRL_MSG_WAIT )
+	{
+		src.wait_sent = src.last_end;
+	}
+}
+
+static void src_failed( int type, int ndo )
+{
+	src.tx_failures++;
+	if( ndo && type == eUSBPD_DATA_MSG_SOURCE_CAP && !src.contract )
+	{
+		// No PD sink yet, try again after tTypeCSendSourceCap, give up after nCapsCount
+		if( ++src.caps_count < 50 )
+		{
+			src.state = S_SEND_CAPS;
+			src.timer = ethsim_now + 150 * MS;
+		}
+		else
+		{
+			src.state = S_DISABLED;
+		}
+	}
+	else if( !ndo && type == eUSBPD_CTRL_MSG_SOFT_RESET )
+	{
+		src_hard_reset();
+	}
+	else
+	{
+		src_soft_reset();
+	}
+}
+
+static void src_pop( int ok )
+{
+	USBPD_MessageHeader_t h;
+	memcpy( &h, src.out[0].buf, 2 );
+	src.tx_id = ( src.tx_id + 1 ) & 7;
+	src.retries = 0;
+	memmove( &src.out[0], &src.out[1], --src.nout * sizeof( src_msg ) );
+	src.out_state = src.nout ? 1 : 0;
+	if( src.nout ) src.out_at = src.out[0].at > ethsim_now + 30 * US ? src.out[0].at : ethsim_now + 30 * US;
+	if( ok ) src_sent( h.MessageType, h.NumberOfDataObjects );
+	else src_failed( h.MessageType, h.NumberOfDataObjects );
+}
+
+static void src_request( uint32_t rdo )
+{
+	src.requests++;
+	src.request_start = phy.start;
+	if( src.wait_sent != NEVER && phy.start - src.wait_sent < T_SINK_REQUEST )
+		violation( "Request within tSinkRequest of a Wait" );
+	src.wait_sent = NEVER;
+	if( src.contract && src.pps ) src.pps_deadline = ethsim_now + T_PPS_TIMEOUT;
+
+	if( src.state == S_TRANSITION )
+	{
+		violation( "Request while the supply is changing" );
+		src_hard_reset();
+		return;
+	}
+	// Crossed a reset or new capabilities on the wire, they sort it out
+	if( src.state != S_WAIT_REQUEST && src.state != S_READY ) return;
+	if( src.state == S_WAIT_REQUEST ) stat_add( &st_caps_request, phy.start - src.caps_end );
+	src.timer = NEVER;
+	if( src.no_accept ) return;
+
+	int pos = rdo >> 28, ok = pos >= 1 && pos <= src.ncaps, pps = 0, mv = 0, ma = 0;
+	if( ok )
+	{
+		USBPD_SourcePDO_t p = src_pdo( pos - 1 );
+		if( USBPD_IsPPS( &p ) )
+		{
+			int v20 = rdo >> 9 & 0xfff, i50 = rdo & 0x7f;
+			pps = 1;
+			mv = v20 * 20;
+			ma = i50 * 50;
+			ok = mv >= p.SPR_PPS.MinVoltageIn100mV * 100 && mv <= p.SPR_PPS.MaxVoltageIn100mV * 100 && i50 >= 1 &&
+				 i50 <= (int)p.SPR_PPS.MaxCurrentIn50mA && !( rdo & ( 3 << 7 | 1 << 21 | 1 << 27 ) );
+		}
+		else
+		{
+			int op = rdo >> 10 & 0x3ff, max = rdo & 0x3ff;
+			mv = p.FixedSupply.VoltageIn50mV * 50;
+			ma = op * 10;
+			ok = op <= (int)p.FixedSupply.MaxCurrentIn10mA && max <= (int)p.FixedSupply.MaxCurrentIn10mA &&
+				 !( rdo & ( 3 << 20 | 1 << 27 ) );
+		}
+	}
+	if( !ok )
+	{
+		violation( "bad Request" );
+		src_queue( eUSBPD_CTRL_MSG_REJECT, 0, 0, rnd_range( 200, 2000 ) * US );
+		return;
+	}
+
+	if( src.contract && chance( src.p_wait ) )
+	{
+		src.waits++;
+		src.state = S_READY;
+		src_queue( eUSBPD_CTRL_MSG_WAIT, 0, 0, rnd_range( 200, 2000 ) * US );
+		return;
+	}
+	if( src.contract && chance( src.p_reject ) )
+	{
+		src.rejects++;
+		src.state = S_READY;
+		src_queue( eUSBPD_CTRL_MSG_REJECT, 0, 0, rnd_range( 200, 2000 ) * US );
+		return;
+	}
+
+	// Small PPS steps settle within tPpsSrcTransSmall, the rest take longer
+	int dv = abs( mv - src.vbus_mv );
+	if( pps && src.contract && src.pps && src.index == pos - 1 )
+		src.p_transition = ( dv <= 500 ? rnd_range( 5, 20 ) : rnd_range( 30, 150 ) ) * MS;
+	else
+		src.p_transition = ( dv == 0 ? rnd_range( 1, 3 ) : rnd_range( 30, 100 ) ) * MS;
+	src.p_index = pos - 1;
+	src.p_pps = pps;
+	src.p_mv = mv;
+	src.p_ma = ma;
+	src.accepts++;
+	src.state = S_TRANSITION;
+	src_queue( eUSBPD_CTRL_MSG_ACCEPT, 0, 0, rnd_range( 200, 2000 ) * US );
+}
+
+static void src_message( USBPD_MessageHeader_t h, const uint32_t * data )
+{
+	int type = h.MessageType;
+	if( h.NumberOfDataObjects == 0 ) switch( type )
+	{
+	case eUSBPD_CTRL_MSG_SOFT_RESET:
+		src.sink_soft_resets++;
+		src.nout = 0;
+		src.out_state = 0;
+		src.tx_id = 0;
+		src.state = S_ACCEPT_RESET;
+		src.timer = NEVER;
+		src.await = 0;
+		src.await_deadline = NEVER;
+		src_queue( eUSBPD_CTRL_MSG_ACCEPT, 0, 0, rnd_range( 200, 1000 ) * US );
+		return;
+	case eUSBPD_CTRL_MSG_ACCEPT:
+		if( src.state == S_SOFT_RESET )
+		{
+			src_send_caps();
+			return;
+		}
+		break;
+	case eUSBPD_CTRL_MSG_NOT_SUPPORTED:
+	case eUSBPD_CTRL_MSG_REJECT:
+		if( src.await == eUSBPD_CTRL_MSG_GET_SOURCE_CAP )
+		{
+			if( type != ( src.rev >= eUSBPD_REV_30 ? eUSBPD_CTRL_MSG_NOT_SUPPORTED : eUSBPD_CTRL_MSG_REJECT ) )
+				violation( "Not_Supported before PD 3.0, or Reject after" );
+			src.not_supported++;
+			src.response_worst = src.response_worst > phy.start - src.await_at ? src.response_worst : phy.start - src.await_at;
+			src.await = 0;
+			src.await_deadline = NEVER;
+			return;
+		}
+		break;
+	}
+	else switch( type )
+	{
+	case eUSBPD_DATA_MSG_REQUEST:
+		if( h.NumberOfDataObjects != 1 ) violation( "Request with more than one object" );
+		src_request( data[0] );
+		return;
+	case eUSBPD_DATA_MSG_SINK_CAP:
+		if( src.await == eUSBPD_CTRL_MSG_GET_SINK_CAP )
+		{
+			USBPD_SinkPDO_t p;
+			memcpy( &p, data, 4 );
+			if( p.FixedSupply.PDOType != eUSBPD_PDO_FIXED || p.FixedSupply.VoltageIn50mV != 100 )
+				violation( "first sink PDO isn't vSafe5V" );
+			src.sink_caps++;
+			src.response_worst = src.response_worst > phy.start - src.await_at ? src.response_worst : phy.start - src.await_at;
+			src.await = 0;
+			src.await_deadline = NEVER;
+			return;
+		}
+		break;
+	}
+	printf( "  sink sent %s %d in source state %d\n", h.NumberOfDataObjects ? "data" : "control", type, src.state );
+	violation( "unexpected message from the sink" );
+}
+
+// The sink's transmission just ended.
+static void src_rx( void )
+{
+	if( !src.cc || phy.line != src.cc || src.state == S_OFF ) return;
+	if( phy.hard_reset )
+	{
+		src.sink_hard_resets++;
+		src_enter_hard_reset();
+		return;
+	}
+	if( phy.corrupt ) return;
+	if( src.state == S_HARD_RESET || src.state == S_STARTUP ) return;
+
+	USBPD_MessageHeader_t h;
+	uint32_t data[7];
+	memcpy( &h, phy.buf, 2 );
+	memcpy( data, phy.buf + 2, phy.len - 2 );
+	if( phy.len != 2 + 4 * h.NumberOfDataObjects ) violation( "size doesn't match the header" );
+	if( h.PortPowerRole != eUSBPD_PORTPOWEROLE_SINK ) violation( "message not from a sink" );
+	if( h.Extended ) violation( "extended message" );
+	if( h.MessageType != eUSBPD_CTRL_MSG_GOODCRC || h.NumberOfDataObjects )
+		if( src.caps_end && h.SpecificationRevision != src.rev ) violation( "sink not on the source's revision" );
+
+	if( h.NumberOfDataObjects == 0 && h.MessageType == eUSBPD_CTRL_MSG_GOODCRC )
+	{
+		uint64_t turn = phy.start - src.last_end;
+		if( turn > src.goodcrc_worst ) src.goodcrc_worst = turn;
+		if( ( src.out_state == 3 ) && h.MessageID == src.tx_id )
+		{
+			if( src.retries == 0 && chance( src.p_goodcrc_once ) ) return;
+			if( turn > T_TRANSMIT ) violation( "GoodCRC later than tTransmit" );
+			src_pop( 1 );
+		}
+		return;
+	}
+
+	if( chance( src.p_drop ) )
+	{
+		src.dropped++;
+		return;
+	}
+
+	src.goodcrc_id = h.MessageID;
+	src.goodcrc_at = ethsim_now + rnd_range( 30, 150 ) * US;
+	src.goodcrc_lost = chance( src.p_lose_goodcrc ) || ( h.MessageID != src.rx_last && chance( src.p_goodcrc_once ) );
+
+	if( h.NumberOfDataObjects == 0 && h.MessageType == eUSBPD_CTRL_MSG_SOFT_RESET ) src.rx_last = -1;
+	if( h.MessageID == src.rx_last )
+	{
+		src.duplicates++;
+		return;
+	}
+	src.rx_last = h.MessageID;
+
+	// A message coming in means ours got there, even if its GoodCRC didn't
+	if( src.out_state == 3 ) src_pop( 1 );
+
+	src_message( h, data );
+}
+
+static void src_timeout( void )
+{
+	switch( src.state )
+	{
+	case S_STARTUP:
+	case S_SEND_CAPS: src_send_caps(); break;
+	case S_WAIT_REQUEST: src_hard_reset(); break;
+	case S_TRANSITION:
+		src.vbus_mv = src.p_mv;
+		src_queue( eUSBPD_CTRL_MSG_PS_RDY, 0, 0, 0 );
+		break;
+	case S_SOFT_RESET: src_hard_reset(); break;
+	case S_HARD_RESET:
+		src.state = S_STARTUP;
+		src.vbus_mv = 5000;
+		src.timer = ethsim_now + rnd_range( 30000, 150000 ) * US;
+		break;
+	}
+}
+
+static uint64_t src_next( void )
+{
+	uint64_t t = NEVER;
+	if( wsrc.active ) t = min64( t, wsrc.end );
+	t = min64( t, src.goodcrc_at );
+	if( src.hr_pending ) t = min64( t, src_line_free() ? src_line_free() : ethsim_now );
+	if( src.out_state == 1 || src.out_state == 3 ) t = min64( t, src.out_at );
+	t = min64( t, src.timer );
+	t = min64( t, src.await_deadline );
+	t = min64( t, src.pps_deadline );
+	return t;
+}
+
+static uint64_t src_line_free( void )
+{
+	if( phy.tx && phy.line == src.cc ) return phy.end + 30 * US;
+	if( wsrc.active ) return wsrc.end + 30 * US;
+	return 0;
+}
+
+static void src_fire( void )
+{
+	uint64_t now = ethsim_now, free;
+
+	if( wsrc.active && wsrc.end <= now )
+	{
+		wsrc.active = 0;
+		phy_deliver();
+		if( !wsrc.goodcrc && !wsrc.hard_reset )
+		{
+			src.last_end = wsrc.end;
+			src.out_state = 3;
+			src.out_at = now + T_RECEIVE;
+		}
+		return;
+	}
+	if( src.hr_pending && !src_line_free() )
+	{
+		src.hr_pending = 0;
+		uint8_t none[2] = { 0 };
+		src_wire( none, 0, 0, 1, 0 );
+		return;
+	}
+	if( src.goodcrc_at <= now )
+	{
+		if( ( free = src_line_free() ) )
+		{
+			src.goodcrc_at = free;
+			return;
+		}
+		USBPD_MessageHeader_t h = {
+			.MessageType = eUSBPD_CTRL_MSG_GOODCRC,
+			.MessageID = src.goodcrc_id,
+			.SpecificationRevision = src.rev,
+			.PortPowerRole = eUSBPD_PORTPOWEROLE_SOURCE,
+		};
+		src.goodcrc_at = NEVER;
+		src_wire( (uint8_t *)&h, 2, 1, 0, src.goodcrc_lost );
+		return;
+	}
+	if( src.out_state == 1 && src.out_at <= now )
+	{
+		if( ( free = src_line_free() ) || src.goodcrc_at != NEVER )
+		{
+			src.out_at = free ? free : src.goodcrc_at + 1;
+			return;
+		}
+		USBPD_MessageHeader_t h;
+		memcpy( &h, src.out[0].buf, 2 );
+		h.MessageID = src.tx_id;
+		memcpy( src.out[0].buf, &h, 2 );
+		src.out_state = 2;
+		src_wire( src.out[0].buf, src.out[0].len, 0, 0, chance( src.p_corrupt ) );
+		return;
+	}
+	if( src.out_state == 3 && src.out_at <= now )
+	{
+		if( src.retries < 2 )
+		{
+			src.retries++;
+			src.retried++;
+			src.out_state = 1;
+			src.out_at = now;
+		}
+		else
+		{
+			src_pop( 0 );
+		}
+		return;
+	}
+	if( src.timer <= now )
+	{
+		src.timer = NEVER;
+		src_timeout();
+		return;
+	}
+	if( src.await_deadline <= now )
+	{
+		src.await_deadline = NEVER;
+		src.await = 0;
+		violation( "no answer within tReceiverResponse" );
+		return;
+	}
+	if( src.pps_deadline <= now )
+	{
+		src.pps_deadline = NEVER;
+		src.lapsed++;
+		violation( "PPS contract lapsed" );
+		src_hard_reset();
+	}
+}
+
+
+/* The application: USBPD_SinkNegotiate() every poll_ns, the tests steer it
+	with USBPD_SelectPDO() and USBPD_SelectPPS() in between. */
+
+static uint64_t poll_ns;
+static USBPD_Result_e result;
+static int error_expected;
+static USBPD_Contract_t target;
+
+static int same( const USBPD_Contract_t * a, const USBPD_Contract_t * b )
+{
+	return a->index == b->index && a->pps == b->pps && a->millivolts == b->millivolts && a->milliamps == b->milliamps;
+}
+
+// Both ends ready have to agree on the contract.
+static void agreement( void )
+{
+	USBPD_Contract_t c;
+	if( USBPD_GetState() != eSTATE_PS_RDY || src.state != S_READY || !src.contract || !USBPD_GetContract( &c ) ) return;
+	if( c.index != src.index || c.pps != src.pps || c.millivolts != src.mv || c.milliamps != src.ma )
+		fail( "sink and source disagree on the contract", c.millivolts, src.mv );
+}
+
+static void poll( void )
+{
+	result = USBPD_SinkNegotiate();
+	if( result == eUSBPD_ERROR && !error_expected ) fail( "policy engine gave up", USBPD_GetState(), src.state );
+	agreement();
+	ethsim_cpu( poll_ns );
+}
+
+static int run( uint64_t ns, int ( *done )( void ) )
+{
+	uint64_t end = ethsim_now + ns;
+	while( ethsim_now < end )
+	{
+		poll();
+		if( done && done() ) return 1;
+	}
+	return !done;
+}
+
+static int at_target( void )
+{
+	USBPD_Contract_t c;
+	return USBPD_GetState() == eSTATE_PS_RDY && src.state == S_READY && USBPD_GetContract( &c ) && same( &c, &target );
+}
+
+static int sink_idle( void )
+{
+	return USBPD_GetState() == eSTATE_IDLE;
+}
+
+static int has_contract( void )
+{
+	return USBPD_GetContract( 0 );
+}
+
+static int sink_error( void )
+{
+	return result == eUSBPD_ERROR;
+}
+
+static const uint32_t * caps_a( void )
+{
+	static uint32_t c[6];
+	c[0] = pdo_fixed( 5000, 3000 );
+	c[1] = pdo_fixed( 9000, 3000 );
+	c[2] = pdo_fixed( 15000, 3000 );
+	c[3] = pdo_fixed( 20000, 2250 );
+	c[4] = pdo_pps( 3300, 11000, 3000 );
+	c[5] = pdo_pps( 3300, 21000, 2000 );
+	return c;
+}
+
+static const uint32_t * caps_b( void )
+{
+	static uint32_t c[2];
+	c[0] = pdo_fixed( 5000, 3000 );
+	c[1] = pdo_fixed( 9000, 2000 );
+	return c;
+}
+
+static const uint32_t * caps_c( void )
+{
+	static uint32_t c[3];
+	c[0] = pdo_fixed( 5000, 3000 );
+	c[1] = pdo_fixed( 9000, 3000 );
+	c[2] = pdo_pps( 3300, 16000, 3000 );
+	return c;
+}
+
+static void src_caps( const uint32_t * caps, int n )
+{
+	memcpy( src.caps, caps, n * 4 );
+	src.ncaps = n;
+}
+
+static USBPD_Contract_t fixed_contract( int index )
+{
+	USBPD_SourcePDO_t p = src_pdo( index );
+	return ( USBPD_Contract_t ){ .index = index,
+		.millivolts = p.FixedSupply.VoltageIn50mV * 50,
+		.milliamps = p.FixedSupply.MaxCurrentIn10mA * 10 };
+}
+
+// What the sink should end up with for a SelectPPS(), clamped the long way round
+static USBPD_Contract_t pps_contract( int index, uint32_t v20, uint32_t i50 )
+{
+	USBPD_SourcePDO_t p = src_pdo( index );
+	uint32_t mv = v20 * 20, ma = i50 * 50;
+	if( mv < p.SPR_PPS.MinVoltageIn100mV * 100u ) mv = p.SPR_PPS.MinVoltageIn100mV * 100;
+	if( mv > p.SPR_PPS.MaxVoltageIn100mV * 100u ) mv = p.SPR_PPS.MaxVoltageIn100mV * 100;
+	if( ma == 0 || ma > p.SPR_PPS.MaxCurrentIn50mA * 50u ) ma = p.SPR_PPS.MaxCurrentIn50mA * 50;
+	return ( USBPD_Contract_t ){ .index = index, .pps = true, .millivolts = mv, .milliamps = ma };
+}
+
+static void detach( void )
+{
+	src_detach();
+	if( !run( 100 * MS, sink_idle ) ) fail( "no detach", USBPD_GetState(), 0 );
+}
+
+// Plug in a source, the sink settles on vSafe5V unless asked for more.
+static int attach( void )
+{
+	uint64_t t0 = ethsim_now;
+	src_attach( rnd_range( 1, 2 ) );
+	if( !run( 3000 * MS, has_contract ) )
+	{
+		fail( "no contract after attach", USBPD_GetState(), src.state );
+		return 0;
+	}
+	stat_add( &st_attach, ethsim_now - t0 );
+	return 1;
+}
+
+static int reach( USBPD_Contract_t want, uint64_t timeout, const char * what )
+{
+	target = want;
+	if( run( timeout, at_target ) ) return 1;
+	fail( what, want.index, want.millivolts );
+	return 0;
+}
+
+static int pps_step( int index, uint32_t v20, uint32_t i50, uint64_t timeout )
+{
+	uint64_t t0 = ethsim_now;
+	uint32_t requests = src.requests;
+	int seen = 0;
+
+	if( USBPD_SelectPPS( index, v20, i50 ) != eUSBPD_OK )
+	{
+		fail( "SelectPPS", index, v20 );
+		return 0;
+	}
+	target = pps_contract( index, v20, i50 );
+	ethsim_cpu( rnd() % poll_ns ); // the application calls at any point between two polls
+	while( ethsim_now - t0 < timeout )
+	{
+		poll();
+		if( !seen && src.requests != requests && src.request_start >= t0 )
+		{
+			seen = 1;
+			stat_add( &st_pps_request, src.request_start - t0 );
+		}
+		if( seen && at_target() )
+		{
+			stat_add( &st_pps_ready, ethsim_now - t0 );
+			return 1;
+		}
+	}
+	fail( "PPS contract not reached", target.millivolts, target.milliamps );
+	return 0;
+}
+
+static void pps_random( int index, uint64_t timeout )
+{
+	USBPD_SourcePDO_t p = src_pdo( index );
+	uint32_t lo = p.SPR_PPS.MinVoltageIn100mV * 5, hi = p.SPR_PPS.MaxVoltageIn100mV * 5;
+	uint32_t v20 = rnd_range( lo - 20, hi + 20 ), i50 = rnd_range( 0, p.SPR_PPS.MaxCurrentIn50mA + 5 );
+	// Make sure it's a change
+	USBPD_Contract_t c;
+	if( USBPD_GetContract( &c ) && c.pps && c.index == index && c.millivolts == pps_contract( index, v20, i50 ).millivolts )
+		v20 = v20 > lo + 10 ? v20 - 10 : v20 + 10;
+	pps_step( index, v20, i50, timeout );
+}
+
+static void test_negotiate( void )
+{
+	for( int i = 0; i < 4; i++ )
+	{
+		detach();
+		if( !attach() ) return;
+		reach( fixed_contract( 0 ), 100 * MS, "vSafe5V" );
+
+		uint32_t n = src.sink_caps;
+		src_queue( eUSBPD_CTRL_MSG_GET_SINK_CAP, 0, 0, 1 * MS );
+		run( 50 * MS, 0 );
+		if( src.sink_caps != n + 1 ) fail( "no Sink_Capabilities", src.sink_caps, n );
+
+		n = src.not_supported;
+		src_queue( eUSBPD_CTRL_MSG_GET_SOURCE_CAP, 0, 0, 1 * MS );
+		run( 50 * MS, 0 );
+		if( src.not_supported != n + 1 ) fail( "no Not_Supported to Get_Source_Cap", src.not_supported, n );
+
+		uint64_t t0 = ethsim_now;
+		detach();
+		uint64_t t = ethsim_now - t0;
+		if( t < 15 * MS || t > 15 * MS + 3 * poll_ns + 1 * MS ) fail( "detach not after tPDDebounce", t / US, 0 );
+	}
+}
+
+static void test_fixed( void )
+{
+	for( int i = 0; i < 8; i++ )
+	{
+		int index = rnd_range( 0, 3 );
+		if( USBPD_SelectPDO( index, 0 ) != eUSBPD_OK ) fail( "SelectPDO", index, 0 );
+		reach( fixed_contract( index ), 1000 * MS, "fixed PDO not reached" );
+	}
+	if( USBPD_SelectPDO( 6, 0 ) != eUSBPD_ERROR_ARGS ) fail( "SelectPDO past the end", 6, 0 );
+	if( USBPD_SelectPPS( 1, 250, 0 ) != eUSBPD_ERROR_ARGS ) fail( "SelectPPS on a fixed PDO", 1, 0 );
+}
+
+static void test_pps( int n )
+{
+	for( int i = 0; i < n; i++ )
+		pps_random( rnd_range( 4, 5 ), 1000 * MS );
+
+	// SelectPDO() on an APDO asks for its maximum current
+	if( USBPD_SelectPDO( 5, 120 ) != eUSBPD_OK ) fail( "SelectPDO on PPS", 5, 120 );
+	reach( pps_contract( 5, 600, 0 ), 1000 * MS, "SelectPDO on PPS" );
+}
+
+// A charger calling SelectPPS() every ms: the requests coalesce and the last one sticks.
+static void test_ramp( void )
+{
+	pps_step( 4, 250, 40, 1000 * MS );
+	uint32_t requests = src.requests, calls = 0;
+	for( uint32_t v20 = 250; v20 < 550; v20++, calls++ )
+	{
+		if( USBPD_SelectPPS( 4, v20, 40 ) != eUSBPD_OK ) fail( "SelectPPS", 4, v20 );
+		run( 1 * MS, 0 );
+	}
+	reach( pps_contract( 4, 549, 40 ), 1000 * MS, "end of the ramp" );
+	if( src.requests - requests > calls / 4 ) fail( "requests didn't coalesce", src.requests - requests, calls );
+}
+
+// A PPS contract held for 30s, requested again before the source's tPPSTimeout.
+static void test_keepalive( void )
+{
+	uint64_t keep = poll_ns;
+	pps_step( 5, 750, 0, 1000 * MS );
+	uint32_t requests = src.requests, lapsed = src.lapsed;
+	poll_ns = 1 * MS;
+	run( 30000 * MS, 0 );
+	poll_ns = keep;
+	if( src.lapsed != lapsed ) fail( "PPS contract lapsed", src.lapsed, lapsed );
+	if( src.requests - requests < 30000 / USBPD_PPS_REQUEST_MS - 1 || src.requests - requests > 30000 / USBPD_PPS_REQUEST_MS + 1 )
+		fail( "PPS requests while idle", src.requests - requests, 30000 / USBPD_PPS_REQUEST_MS );
+	reach( pps_contract( 5, 750, 0 ), 10 * MS, "PPS contract after 30s" );
+}
+
+// The sink gets back to what it asked for after the source resets.
+static void test_resets( void )
+{
+	USBPD_Contract_t want = target;
+	uint32_t n = src.soft_resets;
+	src_soft_reset();
+	reach( want, 1000 * MS, "contract after Soft_Reset" );
+	if( src.soft_resets != n + 1 ) fail( "Soft_Reset", src.soft_resets, n );
+
+	src_hard_reset();
+	run( 10 * MS, 0 );
+	if( USBPD_GetContract( 0 ) ) fail( "contract kept through Hard Reset", 0, 0 );
+	reach( want, 3000 * MS, "contract after Hard Reset" );
+}
+
+// New capabilities without the PDO in use: vSafe5V, and back when it returns.
+static void test_caps_change( void )
+{
+	USBPD_Contract_t want = target;
+	src_caps( caps_c(), 3 );
+	src_send_caps();
+	reach( fixed_contract( 0 ), 1000 * MS, "vSafe5V with the PDO gone" );
+	pps_random( 2, 1000 * MS );
+
+	USBPD_SelectPPS( 2, want.millivolts / 20, want.milliamps / 50 );
+	src_caps( caps_a(), 6 );
+	src_send_caps();
+	reach( ( USBPD_Contract_t ){ .index = 0, .millivolts = 5000, .milliamps = 3000 }, 1000 * MS, "vSafe5V again" );
+	USBPD_SelectPPS( want.index, want.millivolts / 20, want.milliamps / 50 );
+	reach( want, 1000 * MS, "PPS back with the capabilities" );
+}
+
+static void test_wait_reject( void )
+{
+	uint32_t waits = src.waits;
+	src.p_wait = 500;
+	for( int i = 0; i < 6 || ( src.waits - waits < 2 && i < 30 ); i++ )
+		pps_random( rnd_range( 4, 5 ), 3000 * MS );
+	src.p_wait = 0;
+	if( src.waits - waits < 2 ) fail( "no Wait", src.waits - waits, 0 );
+
+	USBPD_Contract_t old = target;
+	uint32_t rejects = src.rejects;
+	src.p_reject = 1000;
+	USBPD_SelectPPS( 4, 400, 0 );
+	target = old;
+	run( 200 * MS, 0 );
+	if( src.rejects != rejects + 1 ) fail( "Reject", src.rejects, rejects );
+	if( !at_target() ) fail( "contract lost to a Reject", USBPD_GetState(), src.state );
+	src.p_reject = 0;
+	pps_step( 4, 400, 0, 1000 * MS );
+}
+
+static void test_lossy( int n )
+{
+	src.p_drop = src.p_corrupt = src.p_lose_goodcrc = 100;
+	for( int i = 0; i < 2 * n; i++ )
+	{
+		if( rnd() & 1 )
+		{
+			pps_random( rnd_range( 4, 5 ), 6000 * MS );
+		}
+		else
+		{
+			int index = rnd_range( 0, 3 );
+			USBPD_SelectPDO( index, 0 );
+			reach( fixed_contract( index ), 6000 * MS, "fixed PDO on a lossy line" );
+		}
+	}
+	src.p_drop = src.p_corrupt = src.p_lose_goodcrc = 0;
+	pps_step( 5, 500, 20, 3000 * MS );
+}
+
+// GoodCRCs lost once at most: retries only, both ends have to take them as such.
+static void test_retries( int n )
+{
+	uint32_t soft = src.sink_soft_resets, hard = src.sink_hard_resets, retries = src.duplicates + src.retried;
+	src.p_goodcrc_once = 200;
+	for( int i = 0; i < n; i++ )
+		pps_random( rnd_range( 4, 5 ), 1000 * MS );
+	src.p_goodcrc_once = 0;
+	if( src.sink_soft_resets != soft || src.sink_hard_resets != hard )
+		fail( "sink reset over a retry", src.sink_soft_resets - soft, src.sink_hard_resets - hard );
+	if( src.duplicates + src.retried == retries ) fail( "no retries", 0, 0 );
+}
+
+// A source that never sends capabilities: Hard Reset nHardResetCount + 1 times, then give up.
+static void test_no_caps( void )
+{
+	uint32_t n = src.sink_hard_resets;
+	detach();
+	src.no_caps = 1;
+	error_expected = 1;
+	src_attach( rnd_range( 1, 2 ) );
+	if( !run( 12000 * MS, sink_error ) ) fail( "no error without capabilities", USBPD_GetState(), 0 );
+	if( src.sink_hard_resets - n != eUSBPD_N_HARD_RESET_COUNT + 1 ) fail( "Hard Resets", src.sink_hard_resets - n, 3 );
+	src.no_caps = 0;
+	USBPD_Reset();
+	poll();
+	error_expected = 0;
+	if( !run( 3000 * MS, has_contract ) ) fail( "no contract after USBPD_Reset", USBPD_GetState(), src.state );
+}
+
+// A source that doesn't answer a Request: Hard Reset, and the request again.
+static void test_no_accept( void )
+{
+	reach( fixed_contract( 0 ), 1000 * MS, "vSafe5V" );
+	uint32_t n = src.sink_hard_resets;
+	src.no_accept = 1;
+	USBPD_SelectPDO( 2, 0 );
+	run( 100 * MS, 0 );
+	src.no_accept = 0;
+	if( src.sink_hard_resets != n + 1 ) fail( "Hard Reset for a missing Accept", src.sink_hard_resets, n );
+	reach( fixed_contract( 2 ), 3000 * MS, "contract after Hard Reset" );
+}
+
+static void test_rev20( void )
+{
+	detach();
+	src.rev = eUSBPD_REV_20;
+	src_caps( caps_b(), 2 );
+	attach();
+	if( USBPD_GetVersion() != eUSBPD_REV_20 ) fail( "PD revision", USBPD_GetVersion(), eUSBPD_REV_20 );
+	USBPD_SelectPDO( 1, 0 );
+	reach( fixed_contract( 1 ), 1000 * MS, "PD 2.0 source" );
+	uint32_t n = src.not_supported;
+	src_queue( eUSBPD_CTRL_MSG_GET_SOURCE_CAP, 0, 0, 1 * MS );
+	run( 50 * MS, 0 );
+	if( src.not_supported != n + 1 ) fail( "no Reject to Get_Source_Cap", src.not_supported, n );
+	if( USBPD_SelectPPS( 1, 250, 0 ) != eUSBPD_ERROR_ARGS ) fail( "SelectPPS without an APDO", 1, 0 );
+
+	detach();
+	src.rev = eUSBPD_REV_30;
+	src_caps( caps_a(), 6 );
+}
+
+static void print_stat( const char * what, const stat * s, double unit )
+{
+	if( s->n ) printf( "  %-30s %9.1f %9.1f\n", what, s->sum / (double)s->n / unit, s->worst / unit );
+}
+
+static void bench( int n )
+{
+	static const uint32_t polls[] = { 50, 100, 250, 500, 1000 };
+	printf( "poll, us   attach to contract, ms   Source_Cap to Request, us   SelectPPS to Request, us   to PS_RDY, ms\n" );
+	printf( "                mean    worst             mean    worst               mean    worst      mean  worst\n" );
+	for( unsigned i = 0; i < sizeof( polls ) / sizeof( polls[0] ); i++ )
+	{
+		poll_ns = polls[i] * US;
+		st_attach = st_caps_request = st_pps_request = st_pps_ready = ( stat ){ 0 };
+		for( int k = 0; k < n / 4 + 1; k++ )
+		{
+			detach();
+			attach();
+		}
+		for( int k = 0; k < n; k++ )
+			pps_random( 4, 1000 * MS );
+		printf( "%8u %10.1f %8.1f %16.1f %8.1f %18.1f %8.1f %9.1f %6.1f\n", polls[i], st_attach.sum / (double)st_attach.n / MS,
+			st_attach.worst / (double)MS, st_caps_request.sum / (double)st_caps_request.n / US, st_caps_request.worst / (double)US,
+			st_pps_request.sum / (double)st_pps_request.n / US, st_pps_request.worst / (double)US,
+			st_pps_ready.sum / (double)st_pps_ready.n / MS, st_pps_ready.worst / (double)MS );
+	}
+}
+
+int main( int argc, char ** argv )
+{
+	int seed = 1, n = 20, do_bench = 0, c;
+	while( ( c = getopt( argc, argv, "n:r:b" ) ) != -1 )
+	{
+		switch( c )
+		{
+		case 'n': n = atoi( optarg ); break;
+		case 'r': seed = atoi( optarg ); break;
+		case 'b': do_bench = 1; break;
+		default: fprintf( stderr, "usage: %s [-n steps] [-r seed] [-b]\n", argv[0] ); return 1;
+		}
+	}
+	rng_state = seed * 0x9e3779b97f4a7c15ull + 1;
+
+	ethsim_init_traps();
+	ethsim_init_systick();
+	rcc_page = ethsim_map( RCC_BASE & ~0xfff, 0x1000, 0, 0 );
+	ethsim_map( AFIO_BASE & ~0xfff, 0x1000, 0, 0 );
+	ethsim_map( GPIOC_BASE & ~0xfff, 0x1000, 0, 0 );
+	pd_page = ethsim_map( USBPD_BASE & ~0xfff, 0x1000, pd_pre, pd_post );
+	ethsim_check_dma_ptr( s_rxBuffer );
+	ethsim_mac_next = phy_next;
+	ethsim_mac_fire = phy_fire;
+	ethsim_mac_irq = phy_irq;
+	ethsim_world_next = src_next;
+	ethsim_world_fire = src_fire;
+	ethsim_isr = USBPD_IRQHandler;
+
+	src.rev = eUSBPD_REV_30;
+	src_caps( caps_a(), 6 );
+	src_detach();
+	poll_ns = rnd_range( 50, 300 ) * US;
+
+	if( USBPD_Init( eUSBPD_VCC_5V0 ) != eUSBPD_OK ) fail( "USBPD_Init", 0, 0 );
+
+	double t0 = seconds();
+	test_negotiate();
+	attach();
+	test_fixed();
+	test_pps( n );
+	test_ramp();
+	test_keepalive();
+	test_resets();
+	test_caps_change();
+	test_wait_reject();
+	test_retries( n );
+	test_lossy( n );
+	test_no_caps();
+	test_no_accept();
+	test_rev20();
+
+	printf( "seed %d, poll every %uus, %.1fs simulated in %.1fs\n", seed, (unsigned)( poll_ns / US ), ethsim_now / 1e9, seconds() - t0 );
+	printf( "  %-30s %9s %9s\n", "", "mean", "worst" );
+	print_stat( "attach to contract, ms", &st_attach, MS );
+	print_stat( "Source_Cap to Request, us", &st_caps_request, US );
+	print_stat( "SelectPPS to Request, us", &st_pps_request, US );
+	print_stat( "SelectPPS to PS_RDY, ms", &st_pps_ready, MS );
+	printf( "  GoodCRC turnaround worst %.1fus, Get_*_Cap answered within %.1fms\n", src.goodcrc_worst / (double)US,
+		src.response_worst / (double)MS );
+	printf( "  requests %u, accepted %u, waits %u, rejects %u\n", src.requests, src.accepts, src.waits, src.rejects );
+	printf( "  dropped %u, duplicates %u, source retries %u, gave up %u, collisions %u, overruns %u\n", src.dropped,
+		src.duplicates, src.retried, src.tx_failures, collisions, phy.overruns );
+	printf( "  Soft_Reset sink %u source %u, Hard Reset sink %u source %u\n", src.sink_soft_resets, src.soft_resets,
+		src.sink_hard_resets, src.hard_resets );
+
+	if( do_bench ) bench( n );
+
+	if( violations ) fail( "protocol violations", violations, 0 );
+	printf( "%s\n", failures ? "FAILED" : "ok" );
+	return failures ? 2 : 0;
+}
@@ -0,0 +1,529 @@
+// uvcsim, lib_uvc.h on the host, between a model of the DVP and a USB host
+// that reads the video stream like uvcvideo does. See README.md.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+// Time in us. cam is the camera's next event, bus the host's, poll the
+// device's main loop's, now the one that's running.
+static double now, bus, cam, poll;
+static double t_tok = 1.1, t_byte = 1.0 / 60, t_nak = 2;    // high speed bulk
+static double t_isr = 1.5;      // USB interrupt, per packet
+static double t_row_isr = 1;    // DVP interrupt, per row
+static double t_poll = 2;       // UVCPoll()
+static double cpu_isr;
+
+#define ACK 0
+#define NAK 1
+
+static struct
+{
+	const uint8_t * dma;
+	int len;
+	int res;
+} ep = { 0, 0, NAK };
+
+#define UVC_TICKS()      ( (uint32_t)( now * 144 ) )
+#define UVC_CLOCK        144000000
+#define UVC_SOF()        ( (uint32_t)( now / 125 ) )
+#define UVC_IN_DMA( a )  ( ep.dma = ( a ) )
+#define UVC_IN_SEND( n ) ( ep.len = ( n ), ep.res = ACK )
+#define UVC_IN_READY()   1
+#define UVC_IN_NAKED()   ( ep.res == NAK )
+#define UVC_IN_ABORT()   ( ep.res = NAK )
+#define UVC_LOCK()
+#define UVC_UNLOCK()
+
+#include "lib_uvc.h"
+
+static long violations;
+
+static void violation( const char * what )
+{
+	if( violations++ < 10 ) fprintf( stderr, "%.0f us: %s\n", bus, what );
+}
+
+// The image. Byte i of frame f; the first 4 bytes are the frame number,
+// the 4 after them its length.
+static uint8_t pattern( uint32_t f, uint32_t i )
+{
+	return ( f * 37 + i * 13 + ( i >> 9 ) ) & 0xff;
+}
+
+static void fill( uint8_t * d, uint32_t f, uint32_t len, uint32_t from, uint32_t n )
+{
+	for( uint32_t k = 0; k < n; k++ )
+	{
+		uint32_t i = from + k;
+		if( i < 4 ) d[k] = f >> ( i * 8 );
+		else if( i < 8 ) d[k] = len >> ( ( i - 4 ) * 8 );
+		else d[k] = pattern( f, i );
+	}
+}
+
+// Camera and DVP
+static struct
+{
+	double period, row;        // us
+	uint32_t frame;            // number of the one coming
+	uint32_t len;              // its bytes
+	uint32_t rows;             // its rows, the last one may be partial
+	uint32_t r;                // next row
+	uint8_t * buf[2];
+	int state;                 // 0 vsync next, 1 rows
+	int running;
+	double fifo_ov;            // chance per frame
+	long overflows;
+} dvp;
+
+// The DVP DMA writes a row. It mustn't be in a slot the USB side has.
+static void dvp_write( uint8_t * d, uint32_t from, uint32_t n )
+{
+	if( d >= &uvc_ring[0][0] && d < &uvc_ring[0][0] + sizeof( uvc_ring ) )
+	{
+		uint32_t i = ( d - &uvc_ring[0][0] ) / UVC_PAYLOAD;
+		for( uint32_t s = uvc.get; s != uvc.put; s++ )
+			if( s % UVC_SLOTS == i ) violation( "DVP writes a slot the USB side has" );
+		if( ( d - &uvc_ring[0][0] ) % UVC_PAYLOAD < UVC_HEADER ) violation( "DVP writes a header" );
+	}
+	else if( d != uvc_scratch ) violation( "DVP writes outside the ring" );
+	fill( d, dvp.frame, dvp.len, from, n );
+}
+
+static void cam_event( void )
+{
+	if( dvp.state == 0 )
+	{
+		if( !dvp.running )
+		{
+			cam = 1e18;
+			return;
+		}
+#if UVC_MJPEG
+		dvp.len = UVC_FRAME_BYTES / 4 + rand() % ( UVC_FRAME_BYTES * 3 / 4 - 8 );
+		dvp.len &= ~1;
+#else
+		dvp.len = UVC_FRAME_BYTES;
+#endif
+		dvp.rows = ( dvp.len + UVC_LINE - 1 ) / UVC_LINE;
+		dvp.r = 0;
+		UVCFrameStart();
+		dvp.buf[0] = UVCRowAddr();
+		dvp.buf[1] = UVCRowAddr();
+		cpu_isr += t_row_isr;
+		dvp.state = 1;
+		cam += dvp.period * 0.1 + dvp.row;
+		return;
+	}
+	uint32_t r = dvp.r++;
+	uint32_t n = dvp.len - r * UVC_LINE;
+	if( n > UVC_LINE ) n = UVC_LINE;
+	dvp_write( dvp.buf[r & 1], r * UVC_LINE, n );
+	cpu_isr += t_row_isr;
+	if( n == UVC_LINE )
+	{
+		UVCRowDone();
+		dvp.buf[r & 1] = UVCRowAddr();
+	}
+	if( dvp.r == dvp.rows / 2 && rand() < dvp.fifo_ov * RAND_MAX )
+	{
+		UVCFrameError();
+		dvp.overflows++;
+	}
+	if( dvp.r == dvp.rows )
+	{
+		UVCFrameEnd( n < UVC_LINE );
+		dvp.frame++;
+		dvp.state = 0;
+		cam += dvp.period - dvp.period * 0.1 - dvp.rows * dvp.row;
+		return;
+	}
+	cam += dvp.row;
+}
+
+// Host
+static struct
+{
+	int streaming;
+	uint32_t max_payload;
+	double cap;                // MB/s, 0 for the bus
+	double stalls;             // per second, up to 15 ms each
+	uint8_t payload[UVC_PAYLOAD + UVC_PACKET];
+	uint32_t plen;
+	uint8_t frame[UVC_FRAME_BYTES + UVC_PAYLOAD];
+	uint32_t flen;
+	int in_frame, fid, bad;
+	uint32_t pts, stc;
+	int last_fid;              // -1 after a start
+	int64_t last_frame;
+	long frames, err_frames, payloads, zlps;
+} host;
+
+static void host_frame_done( void )
+{
+	host.in_frame = 0;
+	host.last_fid = host.fid;
+	if( host.bad )
+	{
+		host.err_frames++;
+		return;
+	}
+	uint32_t f = 0, len = 0;
+	for( int i = 0; i < 4; i++ ) f |= (uint32_t)host.frame[i] << ( i * 8 );
+	for( int i = 0; i < 4; i++ ) len |= (uint32_t)host.frame[4 + i] << ( i * 8 );
+#if UVC_MJPEG
+	if( host.flen != ( len + UVC_LINE - 1 ) / UVC_LINE * UVC_LINE ) violation( "JPEG frame size" );
+#else
+	if( host.flen != UVC_FRAME_BYTES || len != UVC_FRAME_BYTES ) violation( "frame size" );
+#endif
+	if( host.flen < len ) len = host.flen;
+	if( (int64_t)f <= host.last_frame ) violation( "frame number doesn't go up" );
+	for( uint32_t i = 8; i < len; i++ )
+		if( host.frame[i] != pattern( f, i ) )
+		{
+			violation( "frame content" );
+			break;
+		}
+	host.last_frame = f;
+	host.frames++;
+}
+
+static void host_payload( void )
+{
+	uint8_t * h = host.payload;
+	host.payloads++;
+	if( host.plen < 2 || h[0] != UVC_HEADER || h[0] > host.plen )
+	{
+		violation( "header length" );
+		return;
+	}
+	if( ( h[1] & ( UVC_EOH | UVC_PTS | UVC_SCR ) ) != ( UVC_EOH | UVC_PTS | UVC_SCR ) || ( h[1] & 0x30 ) )
+		violation( "header bits" );
+	int fid = h[1] & UVC_FID;
+	uint32_t pts = h[2] | h[3] << 8 | h[4] << 16 | (uint32_t)h[5] << 24;
+	uint32_t stc = h[6] | h[7] << 8 | h[8] << 16 | (uint32_t)h[9] << 24;
+	if( host.stc && (int32_t)( stc - host.stc ) < 0 ) violation( "SCR goes back" );
+	host.stc = stc;
+	if( host.in_frame && fid != host.fid )
+	{
+		violation( "new FID before EOF" );
+		host.in_frame = 0;
+	}
+	if( !host.in_frame )
+	{
+		if( fid == host.last_fid ) violation( "FID didn't toggle" );
+		host.in_frame = 1;
+		host.fid = fid;
+		host.pts = pts;
+		host.flen = 0;
+		host.bad = 0;
+	}
+	else if( pts != host.pts ) violation( "PTS changes within a frame" );
+	uint32_t n = host.plen - UVC_HEADER;
+	if( host.flen + n > sizeof( host.frame ) )
+	{
+		violation( "frame too long" );
+		host.bad = 1;
+	}
+	else
+	{
+		memcpy( host.frame + host.flen, h + UVC_HEADER, n );
+		host.flen += n;
+	}
+	if( h[1] & UVC_ERR ) host.bad = 1;
+	if( h[1] & UVC_EOF ) host_frame_done();
+}
+
+// One IN transaction, retried while it's NAKed.
+static void host_in( void )
+{
+	if( ep.res != ACK )
+	{
+		bus += t_nak;
+		return;
+	}
+	int n = ep.len;
+	if( n > UVC_PACKET ) violation( "packet too long" );
+	if( n && ( ep.dma < &uvc_ring[0][0] || ep.dma + n > &uvc_ring[0][0] + sizeof( uvc_ring ) ) ) violation( "packet not from the ring" );
+	if( host.plen + n <= sizeof( host.payload ) ) memcpy( host.payload + host.plen, ep.dma, n );
+	host.plen += n;
+	if( !n ) host.zlps++;
+	double t = t_tok + n * t_byte;
+	if( host.cap > 0 && t < ( n + 12 ) / host.cap ) t = ( n + 12 ) / host.cap;
+	if( host.stalls > 0 && rand() < t * 1e-6 * host.stalls * RAND_MAX ) t += rand() % 15000;
+	bus += t;
+
+	// hsusb's interrupt
+	cpu_isr += t_isr;
+	int k = UVCTx();
+	if( k )
+	{
+		ep.len = k > 0 ? k : 0;
+		ep.res = ACK;
+	}
+	else ep.res = NAK;
+
+	if( host.plen > host.max_payload ) violation( "payload longer than dwMaxPayloadTransferSize" );
+	if( n < UVC_PACKET || host.plen >= host.max_payload )
+	{
+		if( !host.plen ) violation( "empty payload" );
+		else host_payload();
+		host.plen = 0;
+	}
+}
+
+static int control( int req, int cs, int iface, uint8_t * data, int len )
+{
+	return UVCRequest( req, cs << 8, iface, data, len );
+}
+
+static uint32_t get32( const uint8_t * p )
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// What a host finds in the descriptor and the probe.
+static void check_descriptors( void )
+{
+	const uint8_t * d = uvc_config_descriptor;
+	int len = sizeof( uvc_config_descriptor );
+	int i, vc_total = 0, vs_total = 0, vc_len = -1, vs_len = -1, iface = -1, ifaces = 0, ep_found = 0, frame_found = 0;
+	if( len != UVC_CONFIG_LEN || ( d[2] | d[3] << 8 ) != len ) violation( "wTotalLength" );
+	if( len > 255 ) violation( "configuration too long for hsusb's descriptor list" );
+	for( i = 0; i < len; i += d[i] )
+	{
+		if( d[i] < 2 || i + d[i] > len )
+		{
+			violation( "descriptor length" );
+			return;
+		}
+		const uint8_t * p = d + i;
+		if( p[1] == 0x04 )
+		{
+			iface = p[2];
+			ifaces++;
+			if( p[5] != 0x0e ) violation( "interface class" );
+			if( ( iface == UVC_IF_VC ) != ( p[6] == 0x01 ) ) violation( "interface subclass" );
+		}
+		if( p[1] == 0x24 )
+		{
+			if( iface == UVC_IF_VC )
+			{
+				vc_total += p[0];
+				if( p[2] == 0x01 ) vc_len = p[5] | p[6] << 8;
+			}
+			else
+			{
+				vs_total += p[0];
+				if( p[2] == 0x01 )
+				{
+					vs_len = p[4] | p[5] << 8;
+					if( p[6] != ( 0x80 | UVC_EP_IN ) ) violation( "input header endpoint" );
+				}
+				if( p[2] == UVC_FRAME_TYPE )
+				{
+					frame_found = 1;
+					if( ( p[5] | p[6] << 8 ) != UVC_WIDTH || ( p[7] | p[8] << 8 ) != UVC_HEIGHT ) violation( "frame size" );
+					if( get32( p + 17 ) != UVC_FRAME_BYTES ) violation( "dwMaxVideoFrameBufferSize" );
+					if( get32( p + 21 ) != 10000000 / UVC_FPS || p[25] != 1 || get32( p + 26 ) != get32( p + 21 ) ) violation( "frame interval" );
+				}
+			}
+		}
+		if( p[1] == 0x05 )
+		{
+			ep_found = 1;
+			if( p[2] != ( 0x80 | UVC_EP_IN ) || p[3] != 2 || ( p[4] | p[5] << 8 ) != UVC_PACKET ) violation( "endpoint" );
+		}
+	}
+	if( i != len ) violation( "descriptors run past wTotalLength" );
+	if( ifaces != d[4] ) violation( "bNumInterfaces" );
+	if( vc_len != vc_total ) violation( "VC header wTotalLength" );
+	if( vs_len != vs_total ) violation( "VS input header wTotalLength" );
+	if( !ep_found || !frame_found ) violation( "no endpoint or frame descriptor" );
+}
+
+// Probe and commit, like uvcvideo: GET_DEF, SET_CUR, GET_CUR, SET_CUR commit.
+static void host_start( void )
+{
+	uint8_t p[64], q[UVC_PROBE_LEN];
+	memset( p, 0xee, sizeof( p ) );
+	if( control( UVC_GET_LEN, UVC_VS_PROBE, UVC_IF_VS, p, 2 ) != 2 || p[0] != UVC_PROBE_LEN || p[1] ) violation( "GET_LEN" );
+	if( control( UVC_GET_INFO, UVC_VS_PROBE, UVC_IF_VS, p, 1 ) != 1 || p[0] != 3 ) violation( "GET_INFO" );
+	if( control( UVC_GET_DEF, UVC_VS_PROBE, UVC_IF_VS, p, UVC_PROBE_LEN ) != UVC_PROBE_LEN ) violation( "GET_DEF" );
+	memcpy( q, p, UVC_PROBE_LEN );
+	q[2] = 1;
+	q[3] = 1;
+	if( control( UVC_SET_CUR, UVC_VS_PROBE, UVC_IF_VS, q, UVC_PROBE_LEN ) ) violation( "SET_CUR probe" );
+	if( control( UVC_GET_CUR, UVC_VS_PROBE, UVC_IF_VS, p, 26 ) != 26 ) violation( "GET_CUR probe, 26 bytes" );
+	if( control( UVC_GET_CUR, UVC_VS_PROBE, UVC_IF_VS, p, UVC_PROBE_LEN ) != UVC_PROBE_LEN ) violation( "GET_CUR probe" );
+	if( p[2] != 1 || p[3] != 1 || get32( p + 4 ) != 10000000 / UVC_FPS ) violation( "probe format" );
+	if( get32( p + 18 ) != UVC_FRAME_BYTES ) violation( "dwMaxVideoFrameSize" );
+	host.max_payload = get32( p + 22 );
+	if( host.max_payload != UVC_PAYLOAD ) violation( "dwMaxPayloadTransferSize" );
+	if( get32( p + 26 ) != UVC_CLOCK ) violation( "dwClockFrequency" );
+	if( control( UVC_SET_CUR, UVC_VS_COMMIT, UVC_IF_VS, p, UVC_PROBE_LEN ) ) violation( "SET_CUR commit" );
+	host.streaming = 1;
+	host.plen = 0;
+	host.in_frame = 0;
+	host.last_fid = -1;
+	host.stc = 0;
+}
+
+// uvcvideo's STREAMOFF on a bulk camera: clear the halt on the endpoint.
+static void host_stop( void )
+{
+	host.streaming = 0;
+	ep.res = NAK;
+	host.plen = 0;
+	host.in_frame = 0;
+}
+
+static void check_requests( void )
+{
+	uint8_t p[64];
+	if( control( UVC_GET_CUR, UVC_VS_PROBE, UVC_IF_VC, p, 34 ) >= 0 ) violation( "request to the VC interface not stalled" );
+	if( control( UVC_GET_CUR, 3, UVC_IF_VS, p, 34 ) >= 0 ) violation( "unknown control not stalled" );
+	if( control( UVC_SET_CUR, UVC_VS_PROBE, UVC_IF_VS, p, 10 ) >= 0 ) violation( "short SET_CUR not stalled" );
+	if( control( UVC_GET_RES, UVC_VS_PROBE, UVC_IF_VS, p, 34 ) >= 0 ) violation( "GET_RES not stalled" );
+}
+
+static void run( double seconds, int restart )
+{
+	double end = bus + seconds * 1e6, stop_at = restart ? bus + seconds * 0.5e6 : 1e18, restart_at = 1e18;
+	dvp.running = 1;
+	cam = poll = bus;
+	while( bus < end || dvp.state == 1 || uvc.get != uvc.put || uvc.tx_busy )
+	{
+		if( bus >= end ) dvp.running = 0;
+		if( bus > end + 2e6 )
+		{
+			violation( "doesn't drain" );
+			break;
+		}
+		if( cam <= bus && cam <= poll )
+		{
+			now = cam;
+			cam_event();
+			continue;
+		}
+		if( poll <= bus )
+		{
+			now = poll;
+			UVCPoll();
+			poll += t_poll;
+			continue;
+		}
+		now = bus;
+		if( bus >= stop_at )
+		{
+			host_stop();
+			stop_at = 1e18;
+			restart_at = bus + 20000;
+		}
+		if( !host.streaming )
+		{
+			bus += 100;
+			if( bus >= restart_at )
+			{
+				restart_at = 1e18;
+				host_start();
+			}
+			continue;
+		}
+		host_in();
+	}
+}
+
+static void report( const char * what, double seconds, long frames0, uint64_t bytes0, long dropped0, double cpu0 )
+{
+	long frames = host.frames - frames0;
+	printf( "  %-22s %6.2f fps  %6.2f MB/s  dropped %4ld  USB+DVP interrupts %4.1f%% CPU\n", what,
+		frames / seconds, ( uvc.bytes - bytes0 ) / seconds / 1e6, (long)uvc.dropped - dropped0,
+		( cpu_isr - cpu0 ) / ( seconds * 1e4 ) );
+}
+
+static void bench( void )
+{
+	static const double caps[] = { 0, 20, 10, 5, 4, 3 };
+	printf( "%dx%d %s at %d fps, %d slots of %d bytes, %u kB\n", UVC_WIDTH, UVC_HEIGHT, UVC_MJPEG ? "MJPEG" : "YUY2",
+		UVC_FPS, UVC_SLOTS, UVC_PAYLOAD, (unsigned)( sizeof( uvc_ring ) / 1024 ) );
+	for( int i = 0; i < 6; i++ )
+	{
+		char what[32];
+		long f0 = host.frames, d0 = uvc.dropped;
+		uint64_t b0 = uvc.bytes;
+		double c0 = cpu_isr;
+		host.cap = caps[i];
+		run( 4, 0 );
+		if( caps[i] > 0 ) snprintf( what, sizeof( what ), "host at %2.0f MB/s", caps[i] );
+		else snprintf( what, sizeof( what ), "host at bus speed" );
+		report( what, 4, f0, b0, d0, c0 );
+	}
+}
+
+int main( int argc, char ** argv )
+{
+	int c, bench_on = 1;
+	double seconds = 4;
+	unsigned seed = 1;
+	dvp.fifo_ov = 0.02;
+	while( ( c = getopt( argc, argv, "Br:s:b:f:" ) ) != -1 )
+	{
+		switch( c )
+		{
+		case 'B': bench_on = 0; break;
+		case 'r': seed = atoi( optarg ); break;
+		case 's': seconds = atof( optarg ); break;
+		case 'b': host.cap = atof( optarg ); break;
+		case 'f': dvp.fifo_ov = atof( optarg ); break;
+		default:
+			fprintf( stderr, "uvcsim [-B] [-r seed] [-s seconds] [-b host MB/s] [-f FIFO overflows per frame]\n" );
+			return 1;
+		}
+	}
+	srand( seed );
+	dvp.period = 1e6 / UVC_FPS;
+	dvp.row = dvp.period * 0.85 / UVC_ROWS;
+	host.last_frame = -1;
+
+	check_descriptors();
+	check_requests();
+	host_start();
+
+	// A host that keeps up, then one that's just fast enough and stalls
+	// 20 times a second, each stopping and starting once in the middle.
+	double cap = host.cap;
+	if( !cap ) cap = UVC_FRAME_BYTES * UVC_FPS / 1e6 * 1.2;
+	run( seconds, 1 );
+	long f1 = host.frames, e1 = host.err_frames;
+	host.cap = cap;
+	host.stalls = 20;
+	run( seconds, 1 );
+	host.cap = 0;
+	host.stalls = 0;
+
+	if( uvc.captured != uvc.frames + uvc.dropped ) violation( "captured frames don't add up" );
+	if( host.frames != (long)uvc.frames ) violation( "frames the host got and the device sent differ" );
+	// The stalling host may get none, with a small ring.
+	if( !f1 ) violation( "no frames" );
+	printf( "captured %u, sent %u, dropped %u (FIFO overflows %ld), host: %ld frames, %ld with ERR, %ld payloads, %ld ZLPs\n",
+		(unsigned)uvc.captured, (unsigned)uvc.frames, (unsigned)uvc.dropped, dvp.overflows,
+		host.frames, host.err_frames, host.payloads, host.zlps );
+	printf( "  fast host: %ld frames, %ld with ERR; stalling host: %ld, %ld\n", f1, e1, host.frames - f1, host.err_frames - e1 );
+	if( violations )
+	{
+		printf( "%ld violations\n", violations );
+		return 2;
+	}
+	printf( "ok\n" );
+
+	if( bench_on )
+	{
+		dvp.fifo_ov = 0;
+		bench();
+	}
+	return 0;
+}
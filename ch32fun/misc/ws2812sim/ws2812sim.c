@@ -0,0 +1,537 @@
+/* Checks ws2812b_dma_gpio_parallel.h on the host: WS2812BParEncode()
+	against a bit at a time reference, then the driver, unmodified, on a
+	model of TIM1, DMA1 Channel 2 and the port on the register traps of
+	misc/ethsim, with what comes out of each pin decoded the way a string of
+	WS2812Bs would. Then the speed of the encoder, and the frame time.
+	See README.md.
+*/
+
+#include "ch32fun.h"
+#include "ethsim.h"
+
+#include <getopt.h>
+#include <time.h>
+
+// What ch32fun has on the part. The model takes interrupts only between
+// DMA words, never inside the driver.
+static int irq_masked, irq_enabled;
+static void __disable_irq( void ) { irq_masked = 1; }
+static void __enable_irq( void ) { irq_masked = 0; }
+static void sim_nvic_enable( IRQn_Type irq ) { if( irq == DMA1_Channel2_IRQn ) irq_enabled = 1; }
+#define NVIC_EnableIRQ sim_nvic_enable
+
+#define WS2812PAR_IMPLEMENTATION
+#include "ws2812b_dma_gpio_parallel.h"
+
+#define MAXLEDS 400
+#define SLICE_NS ( 1e9 / WS2812PAR_SLICE_HZ )
+#define RESET_SLICES ( 280 * WS2812PAR_SLICE_HZ / 1000000 ) // a WS2812B latches after 280us low
+
+static int failures;
+static uint32_t violations;
+
+static void fail( const char * what, uint32_t a, uint32_t b )
+{
+	if( failures++ < 10 ) printf( "FAIL %s (%u, %u)\n", what, a, b );
+}
+
+static void violation( const char * what )
+{
+	if( violations++ < 10 ) printf( "violation: %s\n", what );
+}
+
+static uint64_t rng_state;
+
+static uint32_t rnd( void )
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state >> 32;
+}
+
+static double seconds( void )
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// A bit at a time: for each bit, the strings with a 1 in it.
+static void ref_encode( uint32_t * out, const uint32_t * colors )
+{
+	for( int b = 23; b >= 0; b-- )
+	{
+		uint32_t ones = 0;
+		for( int s = 0; s < WS2812PAR_STRIPS; s++ )
+			if( colors[s] >> b & 1 ) ones |= 1u << ( WS2812PAR_PIN0 + s );
+		*out++ = WS2812PAR_MASK;
+		*out++ = ( WS2812PAR_MASK & ~ones ) << 16;
+		*out++ = WS2812PAR_MASK << 16;
+	}
+}
+
+static void check_encode( int iterations )
+{
+	uint32_t colors[16], got[WS2812PAR_WORDS_PER_LED], want[WS2812PAR_WORDS_PER_LED];
+	for( int i = 0; i < iterations; i++ )
+	{
+		for( int s = 0; s < 16; s++ )
+		{
+			switch( i % 4 )
+			{
+			case 0: colors[s] = rnd(); break; // junk above the 24 bits too
+			case 1: colors[s] = rnd() & 0xffffff; break;
+			case 2: colors[s] = 1u << ( ( i / 4 + s ) % 24 ); break; // one bit
+			default: colors[s] = ( rnd() & 1 ) ? 0xffffff : 0; break;
+			}
+		}
+		// Past WS2812PAR_STRIPS the colors are junk, they mustn't matter.
+		ref_encode( want, colors );
+		WS2812BParEncode( got, colors );
+		for( int w = 0; w < WS2812PAR_WORDS_PER_LED; w++ )
+			if( got[w] != want[w] )
+			{
+				fail( "encode, word", w, got[w] ^ want[w] );
+				break;
+			}
+	}
+}
+
+/* TIM1, DMA1 and the port. The timer only has to be running, with CC1DE,
+	for the channel to move a word a slice. The channel takes MADDR and CNTR
+	when it's enabled, and sees CIRC when it wraps, as the driver counts on.
+	Interrupts are taken some words after their flag comes up, up to a
+	quarter of the buffer later. */
+
+static uint8_t * rcc, * tim, * dma, * gpio;
+static struct
+{
+	int on;
+	uint32_t addr, left, count;
+} chan;
+static uint32_t irq_delay;
+static uint64_t slices;
+
+#define PORT_BASE ( (uintptr_t)WS2812PAR_PORT )
+#define CHAN2( field ) ETHSIM_REG( dma + 0x1c - offsetof( DMA_Channel_TypeDef, CFGR ), DMA_Channel_TypeDef, field )
+#define PORTREG( field ) ETHSIM_REG( gpio + ( PORT_BASE & 0xfff ), GPIO_TypeDef, field )
+#define TIMREG( field ) ETHSIM_REG( tim + ( TIM1_BASE & 0xfff ), TIM_TypeDef, field )
+
+static uint32_t odr;
+static uint32_t cfg_before[2];
+
+static int clocked_ahb( uint32_t bit ) { return ETHSIM_REG( rcc, RCC_TypeDef, AHBPCENR ) & bit; }
+static int clocked_apb2( uint32_t bit ) { return ETHSIM_REG( rcc, RCC_TypeDef, APB2PCENR ) & bit; }
+
+static void tim_pre( uint32_t off )
+{
+	if( off >= ( TIM1_BASE & 0xfff ) && off < ( TIM1_BASE & 0xfff ) + 0x400 && !clocked_apb2( RCC_APB2Periph_TIM1 ) )
+		violation( "TIM1 not clocked" );
+}
+
+static void gpio_pre( uint32_t off )
+{
+	uint32_t o = off - ( PORT_BASE & 0xfff );
+	if( o < 0x400 && !clocked_apb2( RCC_APB2Periph_GPIOA << ( ( PORT_BASE - GPIOA_BASE ) / 0x400 ) ) )
+		violation( "port not clocked" );
+}
+
+static void gpio_post( uint32_t off, const uint8_t * old )
+{
+	(void)old;
+	uint32_t o = off - ( PORT_BASE & 0xfff );
+	if( o == offsetof( GPIO_TypeDef, BSHR ) )
+	{
+		uint32_t w = PORTREG( BSHR );
+		if( w & ~( WS2812PAR_MASK | WS2812PAR_MASK << 16 ) ) violation( "CPU sets or resets another pin" );
+		odr = ( odr & ~( w >> 16 ) ) | ( w & 0xffff );
+		PORTREG( BSHR ) = 0;
+	}
+}
+
+static void dma_pre( uint32_t off )
+{
+	(void)off;
+	if( !clocked_ahb( RCC_AHBPeriph_DMA1 ) ) violation( "DMA1 not clocked" );
+}
+
+static void dma_post( uint32_t off, const uint8_t * old )
+{
+	uint32_t was;
+	memcpy( &was, old + ( off & 0xf ), 4 );
+	if( off == offsetof( DMA_TypeDef, INTFCR ) )
+	{
+		// Clearing a channel's GIF clears all its flags.
+		uint32_t clr = ETHSIM_REG( dma, DMA_TypeDef, INTFCR );
+		for( int i = 0; i < 7; i++ )
+			if( clr >> ( 4 * i ) & 1 ) clr |= 0xfu << ( 4 * i );
+		ETHSIM_REG( dma, DMA_TypeDef, INTFR ) &= ~clr;
+		ETHSIM_REG( dma, DMA_TypeDef, INTFCR ) = 0;
+		return;
+	}
+	if( off < 0x1c || off >= 0x1c + 0x10 ) return; // only channel 2 is ours
+	uint32_t cfg = CHAN2( CFGR );
+	if( off != 0x1c )
+	{
+		if( chan.on ) violation( "channel 2 set up while enabled" );
+		if( off == 0x1c + 4 ) CHAN2( CNTR ) &= 0xffff;
+		return;
+	}
+	if( !( cfg & DMA_CFGR1_EN ) )
+	{
+		chan.on = 0;
+		return;
+	}
+	if( chan.on )
+	{
+		if( ( cfg ^ was ) & ~DMA_CFGR1_CIRC ) violation( "channel 2 changed while enabled, other than CIRC" );
+		return;
+	}
+	uint32_t want = DMA_CFGR1_DIR | DMA_CFGR1_MSIZE_1 | DMA_CFGR1_PSIZE_1 | DMA_CFGR1_MINC | DMA_CFGR1_EN;
+	if( ( cfg & ( want | DMA_CFGR1_MEM2MEM | DMA_CFGR1_PINC | DMA_CFGR1_MSIZE | DMA_CFGR1_PSIZE ) ) != want )
+		violation( "channel 2 not words, memory to the port" );
+	if( CHAN2( PADDR ) != PORT_BASE + offsetof( GPIO_TypeDef, BSHR ) ) violation( "channel 2 not to BSHR" );
+	if( CHAN2( MADDR ) & 3 ) violation( "channel 2 from an unaligned address" );
+	if( !CHAN2( CNTR ) ) violation( "channel 2 enabled with nothing to do" );
+	chan.on = 1;
+	chan.addr = CHAN2( MADDR );
+	chan.left = chan.count = CHAN2( CNTR );
+}
+
+/* What the strings see. Each pin is decoded as a WS2812B would: a high of
+	one slice is a 0, of two a 1, every bit three slices, and RESET_SLICES
+	low latch what came before. Anything else spoils the frame. */
+
+static struct
+{
+	int level, hi, lo, bits, bad;
+	uint32_t acc;
+	uint32_t got[MAXLEDS];
+	// The frames latched, the last two
+	int frames, frame_leds[2], frame_bad[2];
+	uint32_t last[2][MAXLEDS];
+} pin[WS2812PAR_STRIPS];
+
+static void latch( int s )
+{
+	if( !pin[s].bits ) return;
+	pin[s].frames++;
+	pin[s].frame_leds[1] = pin[s].frame_leds[0];
+	pin[s].frame_bad[1] = pin[s].frame_bad[0];
+	memcpy( pin[s].last[1], pin[s].last[0], sizeof( pin[s].got ) );
+	pin[s].frame_leds[0] = pin[s].bits / 24;
+	pin[s].frame_bad[0] = pin[s].bad || pin[s].bits % 24;
+	memcpy( pin[s].last[0], pin[s].got, sizeof( pin[s].got ) );
+	pin[s].bits = pin[s].bad = 0;
+}
+
+static void sample( void )
+{
+	for( int s = 0; s < WS2812PAR_STRIPS; s++ )
+	{
+		int level = odr >> ( WS2812PAR_PIN0 + s ) & 1;
+		if( level && !pin[s].level )
+		{
+			if( pin[s].lo < RESET_SLICES && ( !pin[s].bits || pin[s].hi + pin[s].lo != 3 ) ) pin[s].bad = 1;
+			pin[s].hi = 0;
+		}
+		else if( !level && pin[s].level )
+		{
+			if( pin[s].hi != 1 && pin[s].hi != 2 ) pin[s].bad = 1;
+			pin[s].acc = pin[s].acc << 1 | ( pin[s].hi == 2 );
+			if( pin[s].bits < MAXLEDS * 24 && ++pin[s].bits % 24 == 0 ) pin[s].got[pin[s].bits / 24 - 1] = pin[s].acc & 0xffffff;
+			pin[s].lo = 0;
+		}
+		pin[s].level = level;
+		if( level ) pin[s].hi++;
+		else if( ++pin[s].lo == RESET_SLICES ) latch( s );
+	}
+}
+
+static int irq_line( void )
+{
+	uint32_t f = ETHSIM_REG( dma, DMA_TypeDef, INTFR ), c = CHAN2( CFGR );
+	return ( ( f & DMA1_IT_HT2 ) && ( c & DMA_CFGR1_HTIE ) ) || ( ( f & DMA1_IT_TC2 ) && ( c & DMA_CFGR1_TCIE ) );
+}
+
+static uint32_t pending;
+
+// One slice: a word from the channel, if it has one, then the pins.
+static void slice( void )
+{
+	slices++;
+	int running = ( TIMREG( CTLR1 ) & TIM_CEN ) && ( TIMREG( DMAINTENR ) & TIM_CC1DE );
+	if( chan.on && chan.left && running )
+	{
+		uint32_t w = *(uint32_t *)(uintptr_t)chan.addr;
+		if( w & ~( WS2812PAR_MASK | WS2812PAR_MASK << 16 ) ) violation( "DMA sets or resets another pin" );
+		odr = ( odr & ~( w >> 16 ) ) | ( w & 0xffff );
+		chan.addr += 4;
+		chan.left--;
+		if( chan.left == chan.count / 2 ) ETHSIM_REG( dma, DMA_TypeDef, INTFR ) |= DMA1_IT_GL2 | DMA1_IT_HT2;
+		if( !chan.left )
+		{
+			ETHSIM_REG( dma, DMA_TypeDef, INTFR ) |= DMA1_IT_GL2 | DMA1_IT_TC2;
+			if( CHAN2( CFGR ) & DMA_CFGR1_CIRC )
+			{
+				chan.addr = CHAN2( MADDR );
+				chan.left = chan.count;
+			}
+		}
+		CHAN2( CNTR ) = chan.left;
+	}
+	sample();
+
+	if( irq_enabled && !irq_masked && irq_line() )
+	{
+		if( !pending ) pending = 1 + ( irq_delay ? rnd() % irq_delay : 0 );
+		if( !--pending ) DMA1_Channel2_IRQHandler();
+	}
+}
+
+static int chan_busy( void )
+{
+	return chan.on && chan.left;
+}
+
+static uint32_t frame[MAXLEDS][WS2812PAR_STRIPS];
+static int next_led, callback_order_bad;
+
+void WS2812BParLEDCallback( uint32_t * colors, int ledno )
+{
+	if( ledno != next_led++ ) callback_order_bad = 1;
+	for( int s = 0; s < WS2812PAR_STRIPS; s++ ) colors[s] = frame[ledno][s];
+}
+
+static void new_frame( int leds )
+{
+	for( int l = 0; l < leds; l++ )
+		for( int s = 0; s < WS2812PAR_STRIPS; s++ )
+			frame[l][s] = rnd() & 0xffffff;
+}
+
+static void start( int leds )
+{
+	next_led = 0;
+	WS2812BParStart( leds );
+}
+
+// Until the channel is done, then long enough low for the strings to latch.
+static uint64_t run_out( void )
+{
+	uint64_t t0 = slices;
+	while( chan_busy() )
+	{
+		slice();
+		if( slices - t0 > ( MAXLEDS + WS2812PAR_RESET_LEDS + WS2812PAR_DMALEDS * 2 ) * WS2812PAR_WORDS_PER_LED )
+		{
+			fail( "channel never stops", 0, 0 );
+			chan.on = 0;
+		}
+	}
+	uint64_t t = slices - t0;
+	for( int i = 0; i < RESET_SLICES + 1; i++ ) slice();
+	return t;
+}
+
+// The frame latched which frames ago (0 the last) on every string is
+// exactly f, and there were that many.
+static void expect_frame( uint32_t f[][WS2812PAR_STRIPS], int leds, int which, int frames, const char * what )
+{
+	for( int s = 0; s < WS2812PAR_STRIPS; s++ )
+	{
+		if( pin[s].frames != frames ) fail( what, s, pin[s].frames );
+		else if( !leds ) continue;
+		else if( pin[s].frame_bad[which] ) fail( what, s, 1000 );
+		else if( pin[s].frame_leds[which] != leds ) fail( what, s, pin[s].frame_leds[which] );
+		else
+			for( int l = 0; l < leds; l++ )
+				if( pin[s].last[which][l] != f[l][s] )
+				{
+					fail( what, s, l );
+					break;
+				}
+	}
+}
+
+static void expect( int leds, int frames, const char * what )
+{
+	expect_frame( frame, leds, 0, frames, what );
+	if( WS2812BParLEDInUse ) fail( what, 2000, 0 );
+	if( callback_order_bad ) fail( what, 3000, 0 );
+	callback_order_bad = 0;
+}
+
+static void clear_frames( void )
+{
+	for( int s = 0; s < WS2812PAR_STRIPS; s++ ) pin[s].frames = 0;
+}
+
+static int pick_leds( void )
+{
+	switch( rnd() % 4 )
+	{
+	case 0: return rnd() % 4;
+	case 1: return rnd() % 20;
+	case 2: return 300;
+	default: return rnd() % MAXLEDS;
+	}
+}
+
+static void model_init( void )
+{
+	ethsim_init_traps();
+	rcc = ethsim_map( RCC_BASE, 0x1000, 0, 0 );
+	tim = ethsim_map( TIM1_BASE & ~0xfff, 0x1000, tim_pre, 0 );
+	dma = ethsim_map( DMA1_BASE, 0x1000, dma_pre, dma_post );
+	gpio = ethsim_map( PORT_BASE & ~0xfff, 0x1000, gpio_pre, gpio_post );
+
+	// Pins of the port the driver shouldn't touch, as something else set them.
+	PORTREG( CFGLR ) = cfg_before[0] = 0x4b4b4b4b;
+	PORTREG( CFGHR ) = cfg_before[1] = 0xb4b4b4b4;
+}
+
+static void check_init( void )
+{
+	WS2812BParInit();
+	for( int p = 0; p < 16; p++ )
+	{
+		uint32_t cfg = ( p < 8 ? PORTREG( CFGLR ) : PORTREG( CFGHR ) ) >> ( 4 * ( p & 7 ) ) & 0xf;
+		uint32_t was = cfg_before[p / 8] >> ( 4 * ( p & 7 ) ) & 0xf;
+		int ours = WS2812PAR_MASK >> p & 1;
+		if( ours && cfg != GPIO_CFGLR_OUT_10Mhz_PP ) fail( "init, string pin not an output", p, cfg );
+		if( !ours && cfg != was ) fail( "init, another pin changed", p, cfg );
+	}
+	if( odr & WS2812PAR_MASK ) fail( "init, pins not low", odr, 0 );
+	uint32_t rate = FUNCONF_SYSTEM_CORE_CLOCK / ( TIMREG( ATRLR ) + 1 );
+	if( rate < WS2812PAR_SLICE_HZ / 50 * 49 || rate > WS2812PAR_SLICE_HZ / 50 * 51 ) fail( "init, slice rate", rate, WS2812PAR_SLICE_HZ );
+	if( TIMREG( CH1CVR ) > TIMREG( ATRLR ) ) fail( "init, compare never matches", TIMREG( CH1CVR ), 0 );
+	if( !irq_enabled ) fail( "init, interrupt not enabled", 0, 0 );
+	if( chan.on ) fail( "init, channel running", 0, 0 );
+}
+
+static uint64_t frame_slices_300;
+
+static void check_frames( int iterations )
+{
+	// Single frames, with and without the interrupt running late.
+	for( int i = 0; i < iterations; i++ )
+	{
+		int leds = pick_leds();
+		irq_delay = i % 2 ? WS2812PAR_DMA_BUFFER_LEN / 4 : 0;
+		new_frame( leds );
+		clear_frames();
+		start( leds );
+		uint64_t t = run_out();
+		expect( leds, leds ? 1 : 0, "frame" );
+		if( leds == 300 && !irq_delay ) frame_slices_300 = t;
+	}
+
+	// A frame cut short by the next: only the second has to arrive whole.
+	for( int i = 0; i < iterations / 4 + 1; i++ )
+	{
+		int leds = pick_leds();
+		irq_delay = WS2812PAR_DMA_BUFFER_LEN / 4;
+		new_frame( leds );
+		start( leds );
+		uint32_t cut = rnd() % ( ( leds + WS2812PAR_RESET_LEDS ) * WS2812PAR_WORDS_PER_LED + 1 );
+		for( uint32_t n = 0; n < cut && chan_busy(); n++ ) slice();
+		// What there is of the first, and a bit it was cut in, latches in the
+		// second's reset time.
+		int had[WS2812PAR_STRIPS];
+		for( int s = 0; s < WS2812PAR_STRIPS; s++ ) had[s] = pin[s].bits > 0 || pin[s].level;
+		leds = pick_leds();
+		new_frame( leds );
+		clear_frames();
+		start( leds );
+		run_out();
+		for( int s = 0; s < WS2812PAR_STRIPS; s++ ) pin[s].frames -= had[s];
+		expect( leds, leds ? 1 : 0, "frame after a cut short one" );
+	}
+
+	// Frames back to back, each started as soon as WS2812BParLEDInUse drops.
+	for( int i = 0; i < iterations / 4 + 1; i++ )
+	{
+		static uint32_t first[MAXLEDS][WS2812PAR_STRIPS];
+		int a = 1 + rnd() % 40, b = 1 + rnd() % 40;
+		irq_delay = i % 2 ? WS2812PAR_DMA_BUFFER_LEN / 4 : 0;
+		clear_frames();
+		new_frame( a );
+		memcpy( first, frame, sizeof( first ) );
+		start( a );
+		for( uint64_t t0 = slices; WS2812BParLEDInUse && slices - t0 < ( 40 + 2 * WS2812PAR_RESET_LEDS ) * WS2812PAR_WORDS_PER_LED; ) slice();
+		expect( 0, 0, "back to back, before the first" );
+		new_frame( b );
+		start( b );
+		run_out();
+		expect_frame( first, a, 1, 2, "back to back, the first" );
+		expect( b, 2, "back to back, the second" );
+	}
+}
+
+static void bench( void )
+{
+	static uint32_t colors[MAXLEDS][16], out[WS2812PAR_WORDS_PER_LED];
+	for( int l = 0; l < MAXLEDS; l++ )
+		for( int s = 0; s < 16; s++ ) colors[l][s] = rnd() & 0xffffff;
+
+	int reps = 20000;
+	double t0 = seconds();
+	for( int r = 0; r < reps; r++ )
+		for( int l = 0; l < 300; l++ ) WS2812BParEncode( out, colors[( l + r ) % MAXLEDS] );
+	double enc = ( seconds() - t0 ) / reps / 300;
+	t0 = seconds();
+	for( int r = 0; r < reps / 10; r++ )
+		for( int l = 0; l < 300; l++ ) ref_encode( out, colors[( l + r ) % MAXLEDS] );
+	double ref = ( seconds() - t0 ) / ( reps / 10 ) / 300;
+
+	printf( "\n%d strings, ns an LED of every string on this host\n", WS2812PAR_STRIPS );
+	printf( "WS2812BParEncode   %8.1f\n", enc * 1e9 );
+	printf( "bit at a time      %8.1f\n", ref * 1e9 );
+	if( frame_slices_300 )
+	{
+		double us = frame_slices_300 * SLICE_NS / 1000;
+		printf( "300 LEDs a string, Start to the last word %.0fus, %.1f frames/s\n", us, 1e6 / us );
+	}
+}
+
+int main( int argc, char ** argv )
+{
+	int iterations = 200, do_bench = 0, c; // every register access is a trap
+	uint32_t seed = 1;
+	while( ( c = getopt( argc, argv, "n:r:b" ) ) != -1 )
+	{
+		switch( c )
+		{
+		case 'n': iterations = atoi( optarg ); break;
+		case 'r': seed = atoi( optarg ); break;
+		case 'b': do_bench = 1; break;
+		default:
+			fprintf( stderr, "usage: ws2812sim [-n iterations] [-r seed] [-b]\n" );
+			return 1;
+		}
+	}
+	rng_state = seed * 0x9e3779b97f4a7c15ull + 1;
+
+	printf( "%d strings from pin %d, %d LEDs in the buffer, %d iterations\n",
+		WS2812PAR_STRIPS, WS2812PAR_PIN0, WS2812PAR_DMALEDS, iterations );
+	check_encode( iterations * 100 );
+	model_init();
+	check_init();
+	check_frames( iterations );
+
+	// One 300 LED frame on time, for the frame rate, if the random ones had none.
+	if( !frame_slices_300 )
+	{
+		irq_delay = 0;
+		new_frame( 300 );
+		start( 300 );
+		frame_slices_300 = run_out();
+	}
+
+	if( violations ) fail( "violations", violations, 0 );
+	printf( failures ? "FAILED\n" : "ok\n" );
+	if( do_bench && !failures ) bench();
+	return failures ? 2 : 0;
+}
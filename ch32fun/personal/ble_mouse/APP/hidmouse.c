@@ -31,23 +31,32 @@
 // HID mouse input report length
 #define HID_MOUSE_IN_RPT_LEN                 4
 
+// Reports waiting for the link layer, motion merges into the last one
+#define HID_RPT_QUEUE_LEN                    8
+
+// Reports handed to the link layer and not acked yet
+#define HID_RPT_INFLIGHT_LEN                 BLE_BUFF_NUM
+
+// Latency print period (units of 625us); set to zero to disable
+#define HID_LATENCY_PRINT_PERIOD             8000
+
 /*********************************************************************
  * CONSTANTS
  */
-// Param update delay
-#define START_PARAM_UPDATE_EVT_DELAY         12800
+// Param update delay, early so the fast interval applies from the first input
+#define START_PARAM_UPDATE_EVT_DELAY         1600
 
-// Param update delay
-#define START_PHY_UPDATE_DELAY               1600
+// PHY update delay, after the param update
+#define START_PHY_UPDATE_DELAY               3200
 
 // HID idle timeout in msec; set to zero to disable timeout
 #define DEFAULT_HID_IDLE_TIMEOUT             60000
 
 // Minimum connection interval (units of 1.25ms)
-#define DEFAULT_DESIRED_MIN_CONN_INTERVAL    8
+#define DEFAULT_DESIRED_MIN_CONN_INTERVAL    6
 
 // Maximum connection interval (units of 1.25ms)
-#define DEFAULT_DESIRED_MAX_CONN_INTERVAL    8
+#define DEFAULT_DESIRED_MAX_CONN_INTERVAL    6
 
 // Slave latency to use if parameter update request
 #define DEFAULT_DESIRED_SLAVE_LATENCY        0
@@ -77,6 +86,15 @@
  * TYPEDEFS
  */
 
+// A queued mouse report, x and y carry what doesn't fit into one report
+typedef struct
+{
+    int16_t  x;
+    int16_t  y;
+    uint8_t  buttons;
+    uint32_t time; // system clock of the first motion
+} hidEmuRpt_t;
+
 /*********************************************************************
  * GLOBAL VARIABLES
  */
@@ -112,9 +130,9 @@ static uint8_t scanRspData[] = {
     // connection interval range
     0x05, // length of this data
     GAP_ADTYPE_SLAVE_CONN_INTERVAL_RANGE,
-    LO_UINT16(DEFAULT_DESIRED_MIN_CONN_INTERVAL), // 100ms
+    LO_UINT16(DEFAULT_DESIRED_MIN_CONN_INTERVAL), // 7.5ms
     HI_UINT16(DEFAULT_DESIRED_MIN_CONN_INTERVAL),
-    LO_UINT16(DEFAULT_DESIRED_MAX_CONN_INTERVAL), // 1s
+    LO_UINT16(DEFAULT_DESIRED_MAX_CONN_INTERVAL), // 7.5ms
     HI_UINT16(DEFAULT_DESIRED_MAX_CONN_INTERVAL),
 
     // service UUIDs
@@ -155,12 +173,30 @@ static hidDevCfg_t hidEmuCfg = {
 
 static uint16_t hidEmuConnHandle = GAP_CONNHANDLE_INIT;
 
+// Input reports
+static hidEmuRpt_t hidEmuRptQ[HID_RPT_QUEUE_LEN];
+static uint8_t     hidEmuRptHead = 0;
+static uint8_t     hidEmuRptCount = 0;
+static uint8_t     hidEmuButtons = MOUSE_BUTTON_NONE;
+static uint8_t     hidEmuNotifyOn = FALSE;
+
+// Queue times of the reports in the link layer
+static uint32_t hidEmuSentTime[HID_RPT_INFLIGHT_LEN];
+static uint8_t  hidEmuSentHead = 0;
+static uint8_t  hidEmuSentCount = 0;
+
+static volatile uint8_t hidEmuConnEvt = FALSE;
+static hidEmuLatency_t  hidEmuLat = {0, 0, 0xFFFF, 0, 0};
+
 /*********************************************************************
  * LOCAL FUNCTIONS
  */
 
 static void    hidEmu_ProcessTMOSMsg(tmos_event_hdr_t *pMsg);
-static void    hidEmuSendMouseReport(uint8_t buttons, uint8_t X_data, uint8_t Y_data);
+static uint8_t hidEmuSendMouseReport(uint8_t buttons, uint8_t X_data, uint8_t Y_data);
+static void    hidEmuSendReports(uint8_t connEvt);
+static void    hidEmuRptReset(void);
+static void    hidEmuConnEventCB(uint32_t timeUs);
 static uint8_t hidEmuRptCB(uint8_t id, uint8_t type, uint16_t uuid,
                            uint8_t oper, uint16_t *pLen, uint8_t *pData);
 static void    hidEmuEvtCB(uint8_t evt);
@@ -232,6 +268,9 @@ void HidEmu_Init()
     // Register for HID Dev callback
     HidDev_Register(&hidEmuCfg, &hidEmuHidCBs);
 
+    // Refill the link layer after each connection event
+    LL_ConnectEventRegister(hidEmuConnEventCB);
+
     // Setup a delayed profile startup
     tmos_set_event(hidEmuTaskId, START_DEVICE_EVT);
 }
@@ -296,13 +335,223 @@ uint16_t HidEmu_ProcessEvent(uint8_t task_id, uint16_t events)
 
     if(events & START_REPORT_EVT)
     {
-        hidEmuSendMouseReport(MOUSE_BUTTON_NONE, 2, 2);
+        HidEmu_MouseMove(2, 2, MOUSE_BUTTON_NONE);
         tmos_start_task(hidEmuTaskId, START_REPORT_EVT, 800);
         return (events ^ START_REPORT_EVT);
     }
+
+    if(events & SEND_REPORT_EVT)
+    {
+        uint8_t connEvt = hidEmuConnEvt;
+
+        hidEmuConnEvt = FALSE;
+        hidEmuSendReports(connEvt);
+        return (events ^ SEND_REPORT_EVT);
+    }
+
+    if(events & LATENCY_PRINT_EVT)
+    {
+        if(hidEmuLat.count)
+        {
+            PRINT("Latency %d rpts, min %d avg %d max %d us, %d merged\n",
+                  (int)hidEmuLat.count, hidEmuLat.min * 625,
+                  (int)(hidEmuLat.total / hidEmuLat.count * 625),
+                  hidEmuLat.max * 625, (int)hidEmuLat.merged);
+        }
+        tmos_start_task(hidEmuTaskId, LATENCY_PRINT_EVT, HID_LATENCY_PRINT_PERIOD);
+        return (events ^ LATENCY_PRINT_EVT);
+    }
     return 0;
 }
 
+/*********************************************************************
+ * @fn      HidEmu_MouseMove
+ *
+ * @brief   Queue mouse motion and button state.  Motion merges into
+ *          the last queued report as long as the buttons are the same,
+ *          so whatever arrives between two connection events goes out
+ *          as one report.  A button change starts a new report, so that
+ *          clicks are never merged away.
+ *
+ * @param   dx - X axis motion
+ * @param   dy - Y axis motion
+ * @param   buttons - Mouse button state
+ *
+ * @return  none
+ */
+void HidEmu_MouseMove(int16_t dx, int16_t dy, uint8_t buttons)
+{
+    hidEmuRpt_t *pRpt = NULL;
+    int32_t      x, y;
+
+    // not connected: the report starts advertising or is dropped
+    if(!hidEmuNotifyOn)
+    {
+        hidEmuSendMouseReport(buttons, (uint8_t)dx, (uint8_t)dy);
+        return;
+    }
+
+    if(hidEmuRptCount)
+    {
+        pRpt = &hidEmuRptQ[(hidEmuRptHead + hidEmuRptCount - 1) % HID_RPT_QUEUE_LEN];
+    }
+
+    // a button change gets its own report, unless the queue is full
+    if(pRpt == NULL || (pRpt->buttons != buttons && hidEmuRptCount < HID_RPT_QUEUE_LEN))
+    {
+        if(pRpt == NULL && dx == 0 && dy == 0 && buttons == hidEmuButtons)
+        {
+            return;
+        }
+        pRpt = &hidEmuRptQ[(hidEmuRptHead + hidEmuRptCount) % HID_RPT_QUEUE_LEN];
+        pRpt->x = 0;
+        pRpt->y = 0;
+        pRpt->time = TMOS_GetSystemClock();
+        hidEmuRptCount++;
+    }
+    else
+    {
+        hidEmuLat.merged++;
+    }
+
+    x = pRpt->x + dx;
+    y = pRpt->y + dy;
+    pRpt->x = (x > 32767) ? 32767 : (x < -32767) ? -32767 : x;
+    pRpt->y = (y > 32767) ? 32767 : (y < -32767) ? -32767 : y;
+    pRpt->buttons = buttons;
+    hidEmuButtons = buttons;
+
+    tmos_set_event(hidEmuTaskId, SEND_REPORT_EVT);
+}
+
+/*********************************************************************
+ * @fn      HidEmu_GetLatency
+ *
+ * @brief   Read the input latency counters.
+ *
+ * @param   pLat - where to copy the counters
+ * @param   clear - TRUE to restart the counters
+ *
+ * @return  none
+ */
+void HidEmu_GetLatency(hidEmuLatency_t *pLat, uint8_t clear)
+{
+    *pLat = hidEmuLat;
+    if(clear)
+    {
+        tmos_memset(&hidEmuLat, 0, sizeof(hidEmuLat));
+        hidEmuLat.min = 0xFFFF;
+    }
+}
+
+/*********************************************************************
+ * @fn      hidEmuSendReports
+ *
+ * @brief   Hand queued reports to the link layer, up to the number it
+ *          sends in one connection event (BLE_TX_NUM_EVENT).  The rest
+ *          stays in the queue, where new motion can still merge into
+ *          it.  After a connection event the reports the link layer no
+ *          longer holds are acked, and their latency is counted.
+ *
+ * @param   connEvt - TRUE if called after a connection event
+ *
+ * @return  none
+ */
+static void hidEmuSendReports(uint8_t connEvt)
+{
+    uint32_t unack = LL_GetNumberOfUnAckPacket(hidEmuConnHandle);
+    uint32_t now = TMOS_GetSystemClock();
+
+    if(unack == 0xFFFFFFFF)
+    {
+        return;
+    }
+
+    while(connEvt && hidEmuSentCount > unack)
+    {
+        uint32_t t = hidEmuSentTime[hidEmuSentHead];
+
+        hidEmuSentHead = (hidEmuSentHead + 1) % HID_RPT_INFLIGHT_LEN;
+        hidEmuSentCount--;
+
+        // skip the clock wrap
+        if(now >= t && now - t <= 0xFFFF)
+        {
+            hidEmuLat.count++;
+            hidEmuLat.total += now - t;
+            if(now - t < hidEmuLat.min)
+            {
+                hidEmuLat.min = now - t;
+            }
+            if(now - t > hidEmuLat.max)
+            {
+                hidEmuLat.max = now - t;
+            }
+        }
+    }
+
+    while(hidEmuRptCount && unack < BLE_TX_NUM_EVENT &&
+          hidEmuSentCount < HID_RPT_INFLIGHT_LEN)
+    {
+        hidEmuRpt_t *pRpt = &hidEmuRptQ[hidEmuRptHead];
+        int8_t       x = (pRpt->x > 127) ? 127 : (pRpt->x < -127) ? -127 : pRpt->x;
+        int8_t       y = (pRpt->y > 127) ? 127 : (pRpt->y < -127) ? -127 : pRpt->y;
+
+        if(hidEmuSendMouseReport(pRpt->buttons, (uint8_t)x, (uint8_t)y) != SUCCESS)
+        {
+            break;
+        }
+        hidEmuSentTime[(hidEmuSentHead + hidEmuSentCount) % HID_RPT_INFLIGHT_LEN] = pRpt->time;
+        hidEmuSentCount++;
+        unack++;
+
+        // motion beyond 127 goes out in the next report
+        pRpt->x -= x;
+        pRpt->y -= y;
+        if(pRpt->x == 0 && pRpt->y == 0)
+        {
+            hidEmuRptHead = (hidEmuRptHead + 1) % HID_RPT_QUEUE_LEN;
+            hidEmuRptCount--;
+        }
+    }
+}
+
+/*********************************************************************
+ * @fn      hidEmuRptReset
+ *
+ * @brief   Drop the queued and in flight reports.
+ *
+ * @return  none
+ */
+static void hidEmuRptReset(void)
+{
+    hidEmuNotifyOn = FALSE;
+    hidEmuRptHead = 0;
+    hidEmuRptCount = 0;
+    hidEmuSentHead = 0;
+    hidEmuSentCount = 0;
+    hidEmuButtons = MOUSE_BUTTON_NONE;
+    tmos_stop_task(hidEmuTaskId, LATENCY_PRINT_EVT);
+}
+
+/*********************************************************************
+ * @fn      hidEmuConnEventCB
+ *
+ * @brief   Called by the link layer after each connection event.
+ *
+ * @param   timeUs - unused
+ *
+ * @return  none
+ */
+static void hidEmuConnEventCB(uint32_t timeUs)
+{
+    if(hidEmuSentCount || hidEmuRptCount)
+    {
+        hidEmuConnEvt = TRUE;
+        tmos_set_event(hidEmuTaskId, SEND_REPORT_EVT);
+    }
+}
+
 /*********************************************************************
  * @fn      hidEmu_ProcessTMOSMsg
  *
@@ -330,9 +579,9 @@ static void hidEmu_ProcessTMOSMsg(tmos_event_hdr_t *pMsg)
  *					X_data - X axis move data
  *					Y_data - Y axis move data
  *
- * @return  none
+ * @return  SUCCESS or the reason the report wasn't sent
  */
-static void hidEmuSendMouseReport(uint8_t buttons, uint8_t X_data, uint8_t Y_data)
+static uint8_t hidEmuSendMouseReport(uint8_t buttons, uint8_t X_data, uint8_t Y_data)
 {
     uint8_t buf[HID_MOUSE_IN_RPT_LEN];
 
@@ -341,8 +590,8 @@ static void hidEmuSendMouseReport(uint8_t buttons, uint8_t X_data, uint8_t Y_dat
     buf[2] = Y_data;  // Y
     buf[3] = 0;       // Wheel
 
-    HidDev_Report(HID_RPT_ID_MOUSE_IN, HID_REPORT_TYPE_INPUT,
-                  HID_MOUSE_IN_RPT_LEN, buf);
+    return HidDev_Report(HID_RPT_ID_MOUSE_IN, HID_REPORT_TYPE_INPUT,
+                         HID_MOUSE_IN_RPT_LEN, buf);
 }
 
 /*********************************************************************
@@ -382,6 +631,7 @@ static void hidEmuStateCB(gapRole_States_t newState, gapRoleEvent_t *pEvent)
                 // get connection handle
                 hidEmuConnHandle = event->connectionHandle;
                 tmos_start_task(hidEmuTaskId, START_PARAM_UPDATE_EVT, START_PARAM_UPDATE_EVT_DELAY);
+                tmos_start_task(hidEmuTaskId, START_PHY_UPDATE_EVT, START_PHY_UPDATE_DELAY);
                 PRINT("Connected..\n");
             }
             break;
@@ -400,6 +650,9 @@ static void hidEmuStateCB(gapRole_States_t newState, gapRoleEvent_t *pEvent)
             }
             else if(pEvent->gap.opcode == GAP_LINK_TERMINATED_EVENT)
             {
+                hidEmuRptReset();
+                tmos_stop_task(hidEmuTaskId, START_PARAM_UPDATE_EVT);
+                tmos_stop_task(hidEmuTaskId, START_PHY_UPDATE_EVT);
                 PRINT("Disconnected.. Reason:%x\n", pEvent->linkTerminate.reason);
             }
             else if(pEvent->gap.opcode == GAP_LINK_ESTABLISHED_EVENT)
@@ -455,7 +708,16 @@ static uint8_t hidEmuRptCB(uint8_t id, uint8_t type, uint16_t uuid,
     // notifications enabled
     else if(oper == HID_DEV_OPER_ENABLE)
     {
+        hidEmuNotifyOn = TRUE;
         tmos_start_task(hidEmuTaskId, START_REPORT_EVT, 500);
+#if HID_LATENCY_PRINT_PERIOD
+        tmos_start_task(hidEmuTaskId, LATENCY_PRINT_EVT, HID_LATENCY_PRINT_PERIOD);
+#endif
+    }
+    // notifications disabled
+    else if(oper == HID_DEV_OPER_DISABLE)
+    {
+        hidEmuRptReset();
     }
     return status;
 }
@@ -30,10 +30,28 @@ extern "C" {
 #define START_REPORT_EVT          0x0002
 #define START_PARAM_UPDATE_EVT    0x0004
 #define START_PHY_UPDATE_EVT      0x0008
+#define SEND_REPORT_EVT           0x0010
+#define LATENCY_PRINT_EVT         0x0020
+
 /*********************************************************************
  * MACROS
  */
 
+/*********************************************************************
+ * TYPEDEFS
+ */
+
+// Input latency, from the first motion of a report to the link layer ack,
+// in system clock ticks (0.625ms)
+typedef struct
+{
+    uint32_t count;   // reports acked
+    uint32_t total;   // sum of the latencies
+    uint16_t min;
+    uint16_t max;
+    uint32_t merged;  // motion events merged into a pending report
+} hidEmuLatency_t;
+
 /*********************************************************************
  * FUNCTIONS
  */
@@ -52,6 +70,16 @@ extern void HidEmu_Init(void);
  */
 extern uint16_t HidEmu_ProcessEvent(uint8_t task_id, uint16_t events);
 
+/*
+ * Queue mouse motion and button state for the next connection event
+ */
+extern void HidEmu_MouseMove(int16_t dx, int16_t dy, uint8_t buttons);
+
+/*
+ * Read and optionally clear the input latency counters
+ */
+extern void HidEmu_GetLatency(hidEmuLatency_t *pLat, uint8_t clear);
+
 /*********************************************************************
 *********************************************************************/
 
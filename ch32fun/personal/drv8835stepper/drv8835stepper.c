@@ -15,84 +15,36 @@
 #define M2_BIN1 PA4
 #define M2_BIN2 PA5
 
-typedef struct {
-  uint32_t pin_a1;
-  uint32_t pin_a2;
-  uint32_t pin_b1;
-  uint32_t pin_b2;
-
-  int step_phase;
-  uint8_t speed;  // 0-255
-  uint8_t dir;    // 0 or 1
-  uint8_t enable; // 0 or 1
-
-  uint32_t tick_counter;
-  uint32_t current_interval_ticks; // Derived from speed
-} Stepper;
-
-Stepper motor1 = {M1_AIN1, M1_AIN2, M1_BIN1, M1_BIN2, 0, 0, 0, 0, 0, 0};
-Stepper motor2 = {M2_AIN1, M2_AIN2, M2_BIN1, M2_BIN2, 0, 0, 0, 0, 0, 0};
-
-void set_stepper_pins(Stepper *s, int a1, int a2, int b1, int b2) {
-  funDigitalWrite(s->pin_a1, a1);
-  funDigitalWrite(s->pin_a2, a2);
-  funDigitalWrite(s->pin_b1, b1);
-  funDigitalWrite(s->pin_b2, b2);
-}
+// Half stepping, the coil pins aren't all on PWM channels on this board.
+#define STEPPER_MICROSTEPS 2
+#include "lib_stepper.h"
 
-void step_sequence(Stepper *s) {
-  if (s->dir == 0) {
-    s->step_phase++;
-    if (s->step_phase > 3)
-      s->step_phase = 0;
-  } else {
-    s->step_phase--;
-    if (s->step_phase < 0)
-      s->step_phase = 3;
-  }
+#define STEP_ACCEL 2000 // half steps/s^2
 
-  // Double coil excitation for more torque? Or single? Keeping original
-  // single/mixed logic Original Sequence: 0: 1010 1: 0110 2: 0101 3: 1001
-  switch (s->step_phase) {
-  case 0:
-    set_stepper_pins(s, 1, 0, 1, 0);
-    break;
-  case 1:
-    set_stepper_pins(s, 0, 1, 1, 0);
-    break;
-  case 2:
-    set_stepper_pins(s, 0, 1, 0, 1);
-    break;
-  case 3:
-    set_stepper_pins(s, 1, 0, 0, 1);
-    break;
-  }
-}
+StepperAxis motor1;
+StepperAxis motor2;
 
-void run_stepper(Stepper *s) {
-  if (!s->enable) {
-    set_stepper_pins(s, 0, 0, 0, 0);
-    return;
-  }
+// Set by a disable, the main loop releases the coils once the ramp down is
+// over.
+uint8_t motor1_release;
+uint8_t motor2_release;
 
-  // Calculate interval. Speed 0-255.
-  // Slowest: Speed 1 -> ~20ms. Fastest: Speed 255 -> ~2ms.
-  // Ticks are 100us (0.1ms).
-  // 20ms = 200 ticks. 2ms = 20 ticks.
-  // Formula: 200 - (speed * 180 / 255)
-  // Safety clamp
+// Same range as the old tick loop, 20ms..2ms per full step, in half steps/s.
+int32_t radio_speed(uint8_t speed, uint8_t dir) {
+  int32_t sps = 2 * 255000 / (5100 - 18 * speed);
+  return dir ? -sps : sps;
+}
 
-  uint32_t target = 200;
-  if (s->speed > 0) {
-    target = 200 - ((s->speed * 180) / 255);
-  }
-  if (target < 20)
-    target = 20; // Max speed cap (2ms)
+void apply_command(StepperAxis *s, uint8_t *release, uint8_t speed,
+                   uint8_t dir, uint8_t enable) {
+  *release = !enable;
+  Stepper_Run(s, enable ? radio_speed(speed, dir) : 0);
+}
 
-  s->tick_counter++;
-  if (s->tick_counter >= target) {
-    s->tick_counter = 0;
-    step_sequence(s);
+void release_stopped(StepperAxis *s, uint8_t *release) {
+  if (*release && !Stepper_Busy(s)) {
+    Stepper_Release(s);
+    *release = 0;
   }
 }
 
@@ -111,8 +63,13 @@ void setup() {
   funPinMode(M2_BIN1, GPIO_CFGLR_OUT_10Mhz_PP);
   funPinMode(M2_BIN2, GPIO_CFGLR_OUT_10Mhz_PP);
 
-  set_stepper_pins(&motor1, 0, 0, 0, 0);
-  set_stepper_pins(&motor2, 0, 0, 0, 0);
+  Stepper_Init(&motor1, M1_AIN1, M1_AIN2, M1_BIN1, M1_BIN2);
+  Stepper_Init(&motor2, M2_AIN1, M2_AIN2, M2_BIN1, M2_BIN2);
+  Stepper_SetLimits(&motor1, STEP_ACCEL, radio_speed(255, 0));
+  Stepper_SetLimits(&motor2, STEP_ACCEL, radio_speed(255, 0));
+  Stepper_Release(&motor1);
+  Stepper_Release(&motor2);
+  Stepper_TimerInit();
 
   RFCoreInit(LL_TX_POWER_0_DBM);
 }
@@ -123,19 +80,12 @@ int main() {
   setup();
 
   // Test Wiggle
-  motor1.enable = 1;
-  motor1.speed = 100;
-  motor2.enable = 1;
-  motor2.speed = 100;
-  for (int i = 0; i < 500; i++) { // Run for a bit
-    run_stepper(&motor1);
-    run_stepper(&motor2);
-    Delay_Us(100);
-  }
-  motor1.enable = 0;
-  motor2.enable = 0;
-  set_stepper_pins(&motor1, 0, 0, 0, 0);
-  set_stepper_pins(&motor2, 0, 0, 0, 0);
+  Stepper_Move(&motor1, 100);
+  Stepper_Move(&motor2, 100);
+  while (Stepper_Busy(&motor1) || Stepper_Busy(&motor2))
+    ;
+  Stepper_Release(&motor1);
+  Stepper_Release(&motor2);
 
   // Disable Whitening
   BB->CTRL_CFG |= (1 << 6);
@@ -160,24 +110,19 @@ int main() {
 
       if (found_idx != -1) {
         // [S1, D1, E1, S2, D2, E2] at offset +2
-        motor1.speed = pBuf[found_idx + 2];
-        motor1.dir = pBuf[found_idx + 3];
-        motor1.enable = pBuf[found_idx + 4];
-
-        motor2.speed = pBuf[found_idx + 5];
-        motor2.dir = pBuf[found_idx + 6];
-        motor2.enable = pBuf[found_idx + 7];
+        apply_command(&motor1, &motor1_release, pBuf[found_idx + 2],
+                      pBuf[found_idx + 3], pBuf[found_idx + 4]);
+        apply_command(&motor2, &motor2_release, pBuf[found_idx + 5],
+                      pBuf[found_idx + 6], pBuf[found_idx + 7]);
       }
 
       // Re-arm RX
       Frame_RX(ACCESS_ADDRESS, 37, PHY_1M);
     }
 
-    // 2. Run Motors
-    run_stepper(&motor1);
-    run_stepper(&motor2);
-
-    // 3. Tick Delay
-    Delay_Us(100); // 0.1ms tick
+    // Stepping runs from the SysTick compare interrupt, coils of a disabled
+    // motor go off once it has ramped down.
+    release_stopped(&motor1, &motor1_release);
+    release_stopped(&motor2, &motor2_release);
   }
 }
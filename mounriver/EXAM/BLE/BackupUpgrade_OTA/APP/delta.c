@@ -0,0 +1,817 @@
+/********************************** (C) COPYRIGHT *******************************
+ * File Name          : delta.c
+ * Description        : Delta OTA, rebuilds the new image in image B from a patch
+ *                      against the running image A
+ *********************************************************************************
+ * Patch format and relocation in delta.h. The patch is parsed a byte at a
+ * time as packets come in, so an op may span packets. COPY needs no input and
+ * can produce a whole image from three bytes, so DELTA_Process() returns after
+ * every page it programs and the caller runs it again from a TMOS event,
+ * which keeps each pass as short as one step of the block erase.
+ *******************************************************************************/
+
+#include "CONFIG.h"
+#include "ota.h"
+#include "delta.h"
+
+#define DS_IDLE                0
+#define DS_HEADER              1
+#define DS_MAP                 2
+#define DS_OP                  3
+#define DS_ARG                 4
+#define DS_COPY                5
+#define DS_ADD                 6
+#define DS_INSERT              7
+#define DS_DONE                8
+#define DS_FAIL                9
+
+#define DELTA_WIN              64          // image A read window
+
+typedef struct
+{
+    uint32_t base;          /* link address of both images */
+    uint32_t old_gp;
+    uint32_t new_gp;
+    uint32_t old_size;
+    uint32_t new_size;
+    uint32_t new_crc;
+    uint32_t opos;          /* position in image A */
+    uint32_t npos;          /* bytes produced */
+    uint32_t page_addr;     /* image B offset of page[0] */
+    uint32_t arg;           /* argument of the current op, what's left of it */
+    uint32_t win_start;     /* image A offset of win[0] */
+    uint16_t map_count;
+    uint16_t map_fill;
+    uint16_t fill;          /* bytes in page */
+    uint16_t seq;           /* next packet */
+    uint8_t  state;
+    uint8_t  op;
+    uint8_t  shift;         /* of the next argument bits */
+    uint8_t  got;           /* bytes in hdr */
+    uint8_t  status;
+    uint8_t  in_len;
+    uint8_t  in_pos;
+} delta_state_t;
+
+static delta_state_t g_delta;
+
+static DeltaSeg_t g_delta_map[DELTA_MAP_MAX];
+
+/* the page being filled, COPY may run 7 bytes over */
+__attribute__((aligned(4))) static uint8_t g_delta_page[DELTA_PAGE + 8];
+__attribute__((aligned(4))) static uint8_t g_delta_win[DELTA_WIN];
+__attribute__((aligned(4))) static uint8_t g_delta_hdr[DELTA_HEADER_LEN];
+static uint8_t g_delta_in[IAP_LEN - 4];
+
+static const uint32_t delta_crc_nibble[16] =
+{
+    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+    0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+};
+
+/*********************************************************************
+ * @fn      DELTA_Crc32
+ *
+ * @brief   CRC-32 (zlib), pass 0 to start and the last result to go on.
+ *
+ * @return  crc
+ */
+uint32_t DELTA_Crc32(uint32_t crc, const uint8_t *p, uint32_t len)
+{
+    crc = ~crc;
+    while(len--)
+    {
+        crc ^= *p++;
+        crc = (crc >> 4) ^ delta_crc_nibble[crc & 15];
+        crc = (crc >> 4) ^ delta_crc_nibble[crc & 15];
+    }
+    return ~crc;
+}
+
+static uint32_t delta_get32(const uint8_t *p)
+{
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void delta_put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static int32_t delta_sext(uint32_t v, uint8_t bits)
+{
+    return (int32_t)(v << (32 - bits)) >> (32 - bits);
+}
+
+/* immediates of I-type and S-type instructions */
+static int32_t delta_imm_i(uint32_t w)
+{
+    return (int32_t)w >> 20;
+}
+
+static int32_t delta_imm_s(uint32_t w)
+{
+    return (int32_t)(w & 0xfe000000) >> 20 | (int32_t)((w >> 7) & 0x1f);
+}
+
+/*********************************************************************
+ * @fn      DELTA_SetMap
+ *
+ * @brief   Sets the relocation map for DELTA_Xlat().
+ *
+ * @param   base        - link address of the images
+ * @param   old_gp      - gp of the old image, 0 if unknown
+ * @param   new_gp      - gp of the new image
+ * @param   map         - segments, sorted by old_start, NULL if count is 0
+ * @param   count       - number of segments, at most DELTA_MAP_MAX
+ *
+ * @return  none
+ */
+void DELTA_SetMap(uint32_t base, uint32_t old_gp, uint32_t new_gp, const DeltaSeg_t *map, uint16_t count)
+{
+    g_delta.base = base;
+    g_delta.old_gp = old_gp;
+    g_delta.new_gp = new_gp;
+    g_delta.map_count = count;
+    if(map != g_delta_map)
+    {
+        tmos_memcpy(g_delta_map, map, count * sizeof(DeltaSeg_t));
+    }
+}
+
+/*********************************************************************
+ * @fn      delta_move
+ *
+ * @brief   Where an address of the old image is in the new one.
+ *
+ * @return  0 if the map doesn't move it
+ */
+static uint8_t delta_move(uint32_t addr, uint32_t *moved)
+{
+    uint16_t lo = 0, hi = g_delta.map_count;
+
+    if(hi == 0 || addr < g_delta_map[0].old_start)
+    {
+        return 0;
+    }
+    while(hi - lo > 1)
+    {
+        uint16_t mid = (lo + hi) / 2;
+
+        if(g_delta_map[mid].old_start <= addr)
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    *moved = addr + g_delta_map[lo].delta;
+    return 1;
+}
+
+/*********************************************************************
+ * @fn      delta_pair
+ *
+ * @brief   Whether w2 is the low half of an AUIPC/LUI that sets rd: ADDI,
+ *          JALR, a load or a store based on rd.
+ *
+ * @return  0 no, 1 I-type immediate, 2 S-type immediate
+ */
+static uint8_t delta_pair(uint32_t w2, uint8_t rd)
+{
+    if(rd == 0 || ((w2 >> 15) & 31) != rd)
+    {
+        return 0;
+    }
+    switch(w2 & 0x7f)
+    {
+        case 0x13:
+            return ((w2 >> 12) & 7) == 0;
+        case 0x03:
+        case 0x67:
+            return 1;
+        case 0x23:
+            return 2;
+        default:
+            return 0;
+    }
+}
+
+/*********************************************************************
+ * @fn      DELTA_Xlat
+ *
+ * @brief   Copies one instruction (or AUIPC/LUI pair) from old offset opos
+ *          to new offset npos, moving what it points to with the map.
+ *          Anything that isn't a jump or an address, or doesn't fit after
+ *          moving, is copied as it is. Data gets decoded as instructions too; both sides do
+ *          the same, the patch fixes whatever comes out wrong.
+ *
+ * @param   p       - the old bytes, min(avail, 8) of them
+ * @param   avail   - bytes left in this copy
+ * @param   opos    - old offset of p[0]
+ * @param   npos    - new offset it goes to
+ * @param   out     - the new bytes
+ *
+ * @return  bytes taken and written, 1 to 8
+ */
+uint8_t DELTA_Xlat(const uint8_t *p, uint32_t avail, uint32_t opos, uint32_t npos, uint8_t *out)
+{
+    uint32_t pc = g_delta.base + opos, npc = g_delta.base + npos;
+    uint32_t w, w2, t, v;
+    int32_t  imm;
+    uint16_t h;
+    uint8_t  n, i, kind;
+
+    if(avail < 2)
+    {
+        out[0] = p[0];
+        return 1;
+    }
+
+    h = p[0] | p[1] << 8;
+    if((h & 3) != 3)
+    {
+        out[0] = p[0];
+        out[1] = p[1];
+        if((h & 3) != 1)
+        {
+            return 2;
+        }
+        switch(h >> 13)
+        {
+            case 1: /* C.JAL */
+            case 5: /* C.J */
+                imm = delta_sext(((h >> 12) & 1) << 11 | ((h >> 11) & 1) << 4 | ((h >> 9) & 3) << 8 |
+                                 ((h >> 8) & 1) << 10 | ((h >> 7) & 1) << 6 | ((h >> 6) & 1) << 7 |
+                                 ((h >> 3) & 7) << 1 | ((h >> 2) & 1) << 5, 12);
+                if(!delta_move(pc + imm, &t))
+                {
+                    break;
+                }
+                imm = t - npc;
+                if(imm < -2048 || imm > 2046)
+                {
+                    break;
+                }
+                h = (h & 0xe003) | ((imm >> 11) & 1) << 12 | ((imm >> 4) & 1) << 11 | ((imm >> 8) & 3) << 9 |
+                    ((imm >> 10) & 1) << 8 | ((imm >> 6) & 1) << 7 | ((imm >> 7) & 1) << 6 |
+                    ((imm >> 1) & 7) << 3 | ((imm >> 5) & 1) << 2;
+                break;
+            case 6: /* C.BEQZ */
+            case 7: /* C.BNEZ */
+                imm = delta_sext(((h >> 12) & 1) << 8 | ((h >> 10) & 3) << 3 | ((h >> 5) & 3) << 6 |
+                                 ((h >> 3) & 3) << 1 | ((h >> 2) & 1) << 5, 9);
+                if(!delta_move(pc + imm, &t))
+                {
+                    break;
+                }
+                imm = t - npc;
+                if(imm < -256 || imm > 254)
+                {
+                    break;
+                }
+                h = (h & 0xe383) | ((imm >> 8) & 1) << 12 | ((imm >> 3) & 3) << 10 | ((imm >> 6) & 3) << 5 |
+                    ((imm >> 1) & 3) << 3 | ((imm >> 5) & 1) << 2;
+                break;
+            default:
+                break;
+        }
+        out[0] = h;
+        out[1] = h >> 8;
+        return 2;
+    }
+
+    if(avail < 4)
+    {
+        for(i = 0; i < avail; i++)
+        {
+            out[i] = p[i];
+        }
+        return avail;
+    }
+
+    w = delta_get32(p);
+    n = 4;
+    switch(w & 0x7f)
+    {
+        case 0x6f: /* JAL */
+            imm = delta_sext(((w >> 31) & 1) << 20 | ((w >> 21) & 0x3ff) << 1 | ((w >> 20) & 1) << 11 |
+                             ((w >> 12) & 0xff) << 12, 21);
+            if(delta_move(pc + imm, &t))
+            {
+                imm = t - npc;
+                if(imm >= -(1 << 20) && imm < (1 << 20))
+                {
+                    w = (w & 0xfff) | ((imm >> 20) & 1) << 31 | ((imm >> 1) & 0x3ff) << 21 |
+                        ((imm >> 11) & 1) << 20 | ((imm >> 12) & 0xff) << 12;
+                }
+            }
+            break;
+
+        case 0x63: /* branches */
+            imm = delta_sext(((w >> 31) & 1) << 12 | ((w >> 25) & 0x3f) << 5 | ((w >> 8) & 0xf) << 1 |
+                             ((w >> 7) & 1) << 11, 13);
+            if(delta_move(pc + imm, &t))
+            {
+                imm = t - npc;
+                if(imm >= -4096 && imm < 4096)
+                {
+                    w = (w & 0x01fff07f) | ((imm >> 12) & 1) << 31 | ((imm >> 5) & 0x3f) << 25 |
+                        ((imm >> 1) & 0xf) << 8 | ((imm >> 11) & 1) << 7;
+                }
+            }
+            break;
+
+        case 0x17: /* AUIPC */
+        case 0x37: /* LUI */
+            if(avail < 8)
+            {
+                break;
+            }
+            w2 = delta_get32(p + 4);
+            kind = delta_pair(w2, (w >> 7) & 31);
+            if(kind == 0)
+            {
+                break;
+            }
+            delta_put32(out + 4, w2);
+            n = 8;
+            imm = kind == 1 ? delta_imm_i(w2) : delta_imm_s(w2);
+            v = (w & 0xfffff000) + imm;
+            if((w & 0x7f) == 0x17)
+            {
+                if(!delta_move(pc + v, &t))
+                {
+                    break;
+                }
+                v = t - npc;
+            }
+            else
+            {
+                if(!delta_move(v, &t))
+                {
+                    break;
+                }
+                v = t;
+            }
+            w = (w & 0xfff) | ((v + 0x800) & 0xfffff000);
+            imm = v - ((v + 0x800) & 0xfffff000);
+            if(kind == 1)
+            {
+                w2 = (w2 & 0x000fffff) | (uint32_t)imm << 20;
+            }
+            else
+            {
+                w2 = (w2 & 0x01fff07f) | ((imm >> 5) & 0x7f) << 25 | (imm & 0x1f) << 7;
+            }
+            delta_put32(out + 4, w2);
+            break;
+
+        case 0x13: /* ADDI, loads and stores off gp */
+        case 0x03:
+        case 0x23:
+            if(((w >> 15) & 31) != 3 || g_delta.old_gp == 0 || ((w & 0x7f) == 0x13 && ((w >> 12) & 7)))
+            {
+                break;
+            }
+            imm = (w & 0x7f) != 0x23 ? delta_imm_i(w) : delta_imm_s(w);
+            if(!delta_move(g_delta.old_gp + imm, &t))
+            {
+                break;
+            }
+            imm = t - g_delta.new_gp;
+            if(imm < -2048 || imm > 2047)
+            {
+                break;
+            }
+            if((w & 0x7f) != 0x23)
+            {
+                w = (w & 0x000fffff) | (uint32_t)imm << 20;
+            }
+            else
+            {
+                w = (w & 0x01fff07f) | ((imm >> 5) & 0x7f) << 25 | (imm & 0x1f) << 7;
+            }
+            break;
+
+        default:
+            break;
+    }
+    delta_put32(out, w);
+    return n;
+}
+
+/*********************************************************************
+ * @fn      delta_old
+ *
+ * @brief   Image A from offset opos on, at least 8 bytes of it.
+ *
+ * @return  pointer into the read window
+ */
+static const uint8_t *delta_old(uint32_t opos)
+{
+    if(opos < g_delta.win_start || opos + 8 > g_delta.win_start + DELTA_WIN)
+    {
+        g_delta.win_start = opos & ~3;
+        FLASH_ROM_READ(IMAGE_A_START_ADD + g_delta.win_start, g_delta_win, DELTA_WIN);
+    }
+    return g_delta_win + (opos - g_delta.win_start);
+}
+
+/*********************************************************************
+ * @fn      delta_crc_flash
+ *
+ * @brief   CRC-32 of len bytes of flash from addr.
+ *
+ * @return  crc
+ */
+static uint32_t delta_crc_flash(uint32_t addr, uint32_t len)
+{
+    uint32_t crc = 0, n;
+
+    for(; len; len -= n, addr += n)
+    {
+        n = len < DELTA_WIN ? len : DELTA_WIN;
+        FLASH_ROM_READ(addr, g_delta_win, DELTA_WIN);
+        crc = DELTA_Crc32(crc, g_delta_win, n);
+    }
+    g_delta.win_start = 0xffffffff;
+    return crc;
+}
+
+static uint8_t delta_fail(uint8_t status)
+{
+    g_delta.state = DS_FAIL;
+    g_delta.status = status;
+    return status;
+}
+
+/*********************************************************************
+ * @fn      delta_flush
+ *
+ * @brief   Programs the full page, keeps what ran over it.
+ *
+ * @return  DELTA_BUSY, or the flash status
+ */
+static uint8_t delta_flush(void)
+{
+    uint8_t s;
+
+    s = FLASH_ROM_WRITE(IMAGE_B_START_ADD + g_delta.page_addr, g_delta_page, DELTA_PAGE);
+    if(s)
+    {
+        return delta_fail(s);
+    }
+    g_delta.page_addr += DELTA_PAGE;
+    g_delta.fill -= DELTA_PAGE;
+    tmos_memcpy(g_delta_page, g_delta_page + DELTA_PAGE, g_delta.fill);
+    return DELTA_BUSY;
+}
+
+/*********************************************************************
+ * @fn      delta_finish
+ *
+ * @brief   Programs the last page and checks image B.
+ *
+ * @return  DELTA_OK, DELTA_ERR_HASH or the flash status
+ */
+static uint8_t delta_finish(void)
+{
+    uint8_t s;
+
+    if(g_delta.in_pos != g_delta.in_len)
+    {
+        return delta_fail(DELTA_ERR_FORMAT);
+    }
+    while(g_delta.fill & 3)
+    {
+        g_delta_page[g_delta.fill++] = 0xff;
+    }
+    if(g_delta.fill)
+    {
+        s = FLASH_ROM_WRITE(IMAGE_B_START_ADD + g_delta.page_addr, g_delta_page, g_delta.fill);
+        if(s)
+        {
+            return delta_fail(s);
+        }
+        g_delta.fill = 0;
+    }
+    if(delta_crc_flash(IMAGE_B_START_ADD, g_delta.new_size) != g_delta.new_crc)
+    {
+        PRINT("DELTA crc err\r\n");
+        return delta_fail(DELTA_ERR_HASH);
+    }
+    PRINT("DELTA ok %d bytes\r\n", (int)g_delta.new_size);
+    g_delta.state = DS_DONE;
+    return DELTA_OK;
+}
+
+/*********************************************************************
+ * @fn      delta_header
+ *
+ * @brief   Checks the header and that image A is the patch's old image.
+ *
+ * @return  DELTA_OK or an error
+ */
+static uint8_t delta_header(void)
+{
+    const uint8_t *h = g_delta_hdr;
+
+    if(delta_get32(h) != DELTA_MAGIC)
+    {
+        return DELTA_ERR_FORMAT;
+    }
+    g_delta.base = delta_get32(h + 4);
+    g_delta.old_size = delta_get32(h + 8);
+    g_delta.new_size = delta_get32(h + 16);
+    g_delta.new_crc = delta_get32(h + 20);
+    g_delta.old_gp = delta_get32(h + 24);
+    g_delta.new_gp = delta_get32(h + 28);
+    g_delta.map_count = h[32] | h[33] << 8;
+    PRINT("DELTA old:%d new:%d map:%d\r\n", (int)g_delta.old_size, (int)g_delta.new_size, g_delta.map_count);
+
+    if(g_delta.old_size > IMAGE_A_SIZE || g_delta.new_size > IMAGE_B_SIZE || g_delta.new_size == 0 ||
+       g_delta.map_count > DELTA_MAP_MAX)
+    {
+        return DELTA_ERR_SIZE;
+    }
+    if(delta_crc_flash(IMAGE_A_START_ADD, g_delta.old_size) != delta_get32(h + 12))
+    {
+        return DELTA_ERR_BASE;
+    }
+    return DELTA_OK;
+}
+
+/*********************************************************************
+ * @fn      delta_op
+ *
+ * @brief   The op and its argument are complete, checks and starts it.
+ *
+ * @return  DELTA_OK or DELTA_ERR_FORMAT
+ */
+static uint8_t delta_op(void)
+{
+    uint32_t n = g_delta.arg;
+
+    switch(g_delta.op)
+    {
+        case DELTA_OP_SEEK:
+            g_delta.opos += (n & 1) ? ~(n >> 1) : (n >> 1);
+            if(g_delta.opos > g_delta.old_size)
+            {
+                return DELTA_ERR_FORMAT;
+            }
+            g_delta.state = DS_OP;
+            return DELTA_OK;
+
+        case DELTA_OP_COPY:
+        case DELTA_OP_ADD:
+            if(n > g_delta.old_size - g_delta.opos)
+            {
+                return DELTA_ERR_FORMAT;
+            }
+            break;
+
+        default:
+            break;
+    }
+    if(n > g_delta.new_size - g_delta.npos)
+    {
+        return DELTA_ERR_FORMAT;
+    }
+    g_delta.state = DS_COPY + g_delta.op;
+    return DELTA_OK;
+}
+
+/*********************************************************************
+ * @fn      delta_byte
+ *
+ * @brief   Takes one byte of the patch.
+ *
+ * @return  DELTA_OK or an error
+ */
+static uint8_t delta_byte(uint8_t b)
+{
+    switch(g_delta.state)
+    {
+        case DS_HEADER:
+            g_delta_hdr[g_delta.got++] = b;
+            if(g_delta.got < DELTA_HEADER_LEN)
+            {
+                return DELTA_OK;
+            }
+            g_delta.got = 0;
+            g_delta.state = DS_MAP;
+            return delta_header();
+
+        case DS_MAP:
+            g_delta_hdr[g_delta.got++] = b;
+            if(g_delta.got < sizeof(DeltaSeg_t))
+            {
+                return DELTA_OK;
+            }
+            g_delta.got = 0;
+            g_delta_map[g_delta.map_fill].old_start = delta_get32(g_delta_hdr);
+            g_delta_map[g_delta.map_fill].delta = delta_get32(g_delta_hdr + 4);
+            if(g_delta.map_fill && g_delta_map[g_delta.map_fill].old_start <= g_delta_map[g_delta.map_fill - 1].old_start)
+            {
+                return DELTA_ERR_FORMAT;
+            }
+            g_delta.map_fill++;
+            return DELTA_OK;
+
+        case DS_OP:
+            g_delta.op = b >> 6;
+            g_delta.arg = b & 0x1f;
+            g_delta.shift = 5;
+            if(b & 0x20)
+            {
+                g_delta.state = DS_ARG;
+                return DELTA_OK;
+            }
+            return delta_op();
+
+        case DS_ARG:
+            if(g_delta.shift > 31)
+            {
+                return DELTA_ERR_FORMAT;
+            }
+            g_delta.arg |= (uint32_t)(b & 0x7f) << g_delta.shift;
+            g_delta.shift += 7;
+            if(b & 0x80)
+            {
+                return DELTA_OK;
+            }
+            return delta_op();
+
+        case DS_ADD:
+            b += delta_old(g_delta.opos)[0];
+            g_delta.opos++;
+            /* fall through */
+        case DS_INSERT:
+            g_delta_page[g_delta.fill++] = b;
+            g_delta.npos++;
+            g_delta.arg--;
+            return DELTA_OK;
+
+        default:
+            return DELTA_ERR_FORMAT;
+    }
+}
+
+/*********************************************************************
+ * @fn      DELTA_Start
+ *
+ * @brief   Starts a new patch.
+ *
+ * @return  none
+ */
+void DELTA_Start(void)
+{
+    tmos_memset(&g_delta, 0, sizeof(g_delta));
+    g_delta.win_start = 0xffffffff;
+    g_delta.state = DS_HEADER;
+}
+
+/*********************************************************************
+ * @fn      DELTA_Cancel
+ *
+ * @brief   Forgets the patch, whatever state it was in.
+ *
+ * @return  none
+ */
+void DELTA_Cancel(void)
+{
+    g_delta.state = DS_IDLE;
+}
+
+/*********************************************************************
+ * @fn      DELTA_Input
+ *
+ * @brief   Takes the next packet of the patch, packet 0 starts a new one.
+ *          DELTA_Process() then works through it.
+ *
+ * @param   seq     - packet number
+ * @param   p       - patch bytes
+ * @param   len     - how many, at most IAP_LEN - 4
+ *
+ * @return  DELTA_OK, DELTA_ERR_SEQ, or the error the patch already failed with
+ */
+uint8_t DELTA_Input(uint16_t seq, const uint8_t *p, uint8_t len)
+{
+    if(seq == 0)
+    {
+        DELTA_Start();
+    }
+    if(g_delta.state == DS_FAIL)
+    {
+        return g_delta.status;
+    }
+    if(g_delta.state == DS_IDLE || seq != g_delta.seq || g_delta.in_pos != g_delta.in_len || len > sizeof(g_delta_in))
+    {
+        return DELTA_ERR_SEQ;
+    }
+    tmos_memcpy(g_delta_in, p, len);
+    g_delta.in_len = len;
+    g_delta.in_pos = 0;
+    g_delta.seq++;
+    return DELTA_OK;
+}
+
+/*********************************************************************
+ * @fn      DELTA_Process
+ *
+ * @brief   Works through the current packet and the COPY it may have
+ *          started. Returns after each page write so the caller can let
+ *          the BLE stack run.
+ *
+ * @return  DELTA_BUSY to be called again, DELTA_OK when the packet is done
+ *          (and after the last one, image B is verified), otherwise an error
+ */
+uint8_t DELTA_Process(void)
+{
+    __attribute__((aligned(4))) uint8_t out[8];
+    uint8_t n, i, s;
+
+    for(;;)
+    {
+        if(g_delta.state == DS_DONE)
+        {
+            return g_delta.in_pos == g_delta.in_len ? DELTA_OK : delta_fail(DELTA_ERR_FORMAT);
+        }
+        if(g_delta.state == DS_FAIL || g_delta.state == DS_IDLE)
+        {
+            return g_delta.state == DS_FAIL ? g_delta.status : DELTA_ERR_SEQ;
+        }
+        if(g_delta.fill >= DELTA_PAGE)
+        {
+            return delta_flush();
+        }
+        if(g_delta.state >= DS_COPY && g_delta.arg == 0)
+        {
+            g_delta.state = DS_OP;
+        }
+        if(g_delta.state == DS_OP && g_delta.npos == g_delta.new_size)
+        {
+            return delta_finish();
+        }
+
+        if(g_delta.state == DS_COPY)
+        {
+            n = DELTA_Xlat(delta_old(g_delta.opos), g_delta.arg, g_delta.opos, g_delta.npos, out);
+            for(i = 0; i < n; i++)
+            {
+                g_delta_page[g_delta.fill++] = out[i];
+            }
+            g_delta.opos += n;
+            g_delta.npos += n;
+            g_delta.arg -= n;
+            continue;
+        }
+
+        if(g_delta.in_pos == g_delta.in_len)
+        {
+            return DELTA_OK;
+        }
+        s = delta_byte(g_delta_in[g_delta.in_pos++]);
+        if(s)
+        {
+            return delta_fail(s);
+        }
+        if(g_delta.state == DS_MAP && g_delta.map_fill == g_delta.map_count)
+        {
+            DELTA_SetMap(g_delta.base, g_delta.old_gp, g_delta.new_gp, g_delta_map, g_delta.map_count);
+            g_delta.state = DS_OP;
+        }
+    }
+}
+
+/*********************************************************************
+ * @fn      DELTA_Check
+ *
+ * @brief   Whether image B may be switched to.
+ *
+ * @return  0 if no patch was started or the last one is in image B and
+ *          verified, otherwise its error (DELTA_BUSY while under way)
+ */
+uint8_t DELTA_Check(void)
+{
+    switch(g_delta.state)
+    {
+        case DS_IDLE:
+        case DS_DONE:
+            return DELTA_OK;
+        case DS_FAIL:
+            return g_delta.status;
+        default:
+            return DELTA_BUSY;
+    }
+}
+
+/*********************************************************************
+*********************************************************************/
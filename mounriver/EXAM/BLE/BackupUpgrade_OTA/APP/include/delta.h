@@ -0,0 +1,115 @@
+/********************************** (C) COPYRIGHT *******************************
+ * File Name          : delta.h
+ * Description        : Delta OTA, rebuilds the new image in image B from a patch
+ *                      against the running image A
+ *********************************************************************************
+ * The patch is made on the host (BackupUpgrade_OTA_Host/wchdelta) and streamed
+ * with CMD_IAP_DELTA after image B has been erased with CMD_IAP_ERASE. Nothing
+ * but the patch crosses the radio; the unchanged parts come out of image A.
+ * RAM use is fixed: one flash page, the relocation map and a few words.
+ *
+ * All fields are little endian.
+ *
+ *   header  'W' 'D' 'L' 'T' base(4) old_size(4) old_crc(4) new_size(4)
+ *           new_crc(4) old_gp(4) new_gp(4) map_count(2)
+ *   map     map_count x { old_start(4) delta(4) }, sorted by old_start
+ *   ops     until new_size bytes are out, each one a header byte
+ *           tt m nnnnn (type, more, low bits of the argument) followed by
+ *           7 bit groups of the rest of the argument while 'more' is set
+ *
+ *     COPY   n   n bytes from image A at the old position, relocated
+ *     ADD    n   n bytes from image A plus the n patch bytes that follow
+ *     INSERT n   the n patch bytes that follow
+ *     SEEK   n   moves the old position by n (zigzag coded)
+ *
+ * Relocation: code that moved keeps calling code that moved by a different
+ * amount, and reaching globals that moved in RAM, so its offsets change
+ * although the instructions didn't. COPY decodes the RISC-V instructions it
+ * copies and moves what a JAL, branch, C.J/C.JAL/C.BEQZ/C.BNEZ, AUIPC pair,
+ * LUI pair or gp relative ADDI/load/store points at with the map, then
+ * re-encodes it for the new address (and new gp). The map is a step function
+ * over the whole address space: an address moves by the delta of the last
+ * entry at or below it, and not at all below the first one. The host builds
+ * it from where the code went and what the references in the matching code
+ * turned into, and computes exactly what COPY does with DELTA_Xlat(), so it
+ * only sends what still differs.
+ *
+ * old_crc has to match image A before anything is written, new_crc is
+ * checked over image B once the last op is done. The usual CRC-32 (zlib).
+ *******************************************************************************/
+
+#ifndef __DELTA_H
+#define __DELTA_H
+
+#include <stdint.h>
+
+#define DELTA_MAGIC            0x544c4457   // "WDLT"
+#define DELTA_VERSION          1
+#define DELTA_HEADER_LEN       34
+#define DELTA_MAP_MAX          32           // segments the device can hold
+#define DELTA_PAGE             256          // FLASH_ROM_WRITE page
+
+/* op types, top two bits of the op byte */
+#define DELTA_OP_COPY          0
+#define DELTA_OP_ADD           1
+#define DELTA_OP_INSERT        2
+#define DELTA_OP_SEEK          3
+
+/* DELTA_Process() results, anything else is a flash routine status */
+#define DELTA_OK               0x00         // the packet is done
+#define DELTA_BUSY             0xA0         // a page was written, call again
+#define DELTA_ERR_FORMAT       0xA1         // not a patch, or an op past the images
+#define DELTA_ERR_BASE         0xA2         // image A isn't the image the patch was made against
+#define DELTA_ERR_SIZE         0xA3         // an image doesn't fit its bank
+#define DELTA_ERR_HASH         0xA4         // image B came out wrong
+#define DELTA_ERR_SEQ          0xA5         // packet out of order
+
+typedef struct
+{
+    uint32_t old_start;
+    int32_t  delta;
+} DeltaSeg_t;
+
+/*
+ * Starts a new patch, forgetting any previous one.
+ */
+extern void DELTA_Start(void);
+
+/*
+ * Forgets the patch, image B is being erased for something else.
+ */
+extern void DELTA_Cancel(void);
+
+/*
+ * Hands over the next patch packet, copied. seq counts packets from 0,
+ * packet 0 starts a new patch.
+ */
+extern uint8_t DELTA_Input(uint16_t seq, const uint8_t *p, uint8_t len);
+
+/*
+ * Works through the packet, at most one page write per call.
+ */
+extern uint8_t DELTA_Process(void);
+
+/*
+ * 0 if no patch was started or the last one is in image B and verified.
+ */
+extern uint8_t DELTA_Check(void);
+
+/*
+ * One instruction (or pair) at old offset opos copied to new offset npos,
+ * relocated. avail is how many bytes of the copy are left. Returns the
+ * number of bytes taken from p and written to out, 1 to 8.
+ */
+extern uint8_t DELTA_Xlat(const uint8_t *p, uint32_t avail, uint32_t opos, uint32_t npos, uint8_t *out);
+
+/*
+ * The relocation map DELTA_Xlat() works with, base is the link address of
+ * the images, old_gp/new_gp their gp (0 leaves gp relative code alone). The
+ * device fills it from the patch header, the host sets it directly.
+ */
+extern void DELTA_SetMap(uint32_t base, uint32_t old_gp, uint32_t new_gp, const DeltaSeg_t *map, uint16_t count);
+
+extern uint32_t DELTA_Crc32(uint32_t crc, const uint8_t *p, uint32_t len);
+
+#endif
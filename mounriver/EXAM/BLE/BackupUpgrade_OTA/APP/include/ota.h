@@ -45,6 +45,7 @@
 #define CMD_IAP_VERIFY         0x82               // IAPУ
 #define CMD_IAP_END            0x83               // IAP־
 #define CMD_IAP_INFO           0x84               // IAPȡ豸Ϣ
+#define CMD_IAP_DELTA          0x85               // delta patch packet, see delta.h
 
 /* ֡ȶ */
 #define IAP_LEN                36
@@ -98,6 +99,13 @@ typedef union
         unsigned char buf[IAP_LEN - 2]; /*  */
     } info;                             /*  */
     struct
+    {
+        unsigned char cmd;              /* 0x85 */
+        unsigned char len;              /* patch bytes in buf */
+        unsigned char seq[2];           /* packet number, 0 starts a patch */
+        unsigned char buf[IAP_LEN - 4]; /* patch bytes */
+    } delta;                            /* delta patch */
+    struct
     {
         unsigned char buf[IAP_LEN]; /* ݰ*/
     } other;
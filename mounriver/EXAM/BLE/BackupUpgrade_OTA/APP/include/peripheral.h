@@ -29,6 +29,7 @@ extern "C" {
 #define SBP_START_DEVICE_EVT    0x0001
 #define SBP_PERIODIC_EVT        0x0002
 #define OTA_FLASH_ERASE_EVT     0x0004  //OTA Flash
+#define OTA_DELTA_EVT           0x0008  // applies the delta packet, see delta.h
 
 /*********************************************************************
  * MACROS
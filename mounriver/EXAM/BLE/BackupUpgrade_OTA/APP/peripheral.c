@@ -19,6 +19,7 @@
 #include "Peripheral.h"
 #include "OTA.h"
 #include "OTAprofile.h"
+#include "delta.h"
 
 /*********************************************************************
  * MACROS
@@ -383,6 +384,20 @@ uint16_t Peripheral_ProcessEvent(uint8_t task_id, uint16_t events)
         return (events);
     }
 
+    // OTA_DELTA_EVT, one page per pass like the erase
+    if(events & OTA_DELTA_EVT)
+    {
+        uint8_t status;
+
+        status = DELTA_Process();
+        if(status == DELTA_BUSY)
+        {
+            return (events);
+        }
+        OTA_IAP_SendCMDDealSta(status);
+        return (events ^ OTA_DELTA_EVT);
+    }
+
     // Discard unknown events
     return 0;
 }
@@ -656,6 +671,9 @@ void Rec_OTA_IAP_DataDeal(void)
             EraseAdd = OpAdd;
             EraseBlockCnt = 0;
 
+            /* a full image follows, or a new patch */
+            DELTA_Cancel();
+
             /* ͷڲ0 */
             VerifyStatus = 0;
 
@@ -702,6 +720,13 @@ void Rec_OTA_IAP_DataDeal(void)
         {
             PRINT("IAP_END \r\n");
 
+            /* a delta that isn't complete and verified must not be switched to */
+            if(DELTA_Check())
+            {
+                OTA_IAP_SendCMDDealSta(DELTA_Check());
+                break;
+            }
+
             /* ǰImageA */
             /* رյǰʹжϣ߷һֱȫر */
             DisableAllIRQ();
@@ -736,6 +761,9 @@ void Rec_OTA_IAP_DataDeal(void)
 
             send_buf[7] = CHIP_ID&0xFF;
             send_buf[8] = (CHIP_ID>>8)&0xFF;
+
+            /* CMD_IAP_DELTA version */
+            send_buf[9] = DELTA_VERSION;
             /* Ҫ */
 
             /* Ϣ */
@@ -743,6 +771,24 @@ void Rec_OTA_IAP_DataDeal(void)
 
             break;
         }
+        /* delta patch, image B has to be erased first */
+        case CMD_IAP_DELTA:
+        {
+            uint8_t status;
+
+            status = DELTA_Input(iap_rec_data.delta.seq[0] | iap_rec_data.delta.seq[1] << 8,
+                                 iap_rec_data.delta.buf, iap_rec_data.delta.len);
+            if(status)
+            {
+                PRINT("IAP_DELTA err %02x\r\n", status);
+                OTA_IAP_SendCMDDealSta(status);
+            }
+            else
+            {
+                tmos_set_event(Peripheral_TaskID, OTA_DELTA_EVT);
+            }
+            break;
+        }
 
         default:
         {
@@ -0,0 +1,19 @@
+/* Stands in for the BLE and CH57x headers when delta.c is built on the host
+ * by wchdelta.c, the flash routines are the simulated ones there. */
+#ifndef __CONFIG_H
+#define __CONFIG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define PRINT(...)
+#define tmos_memcpy     memcpy
+#define tmos_memset     memset
+
+#define FLASH_ROM_MAX_SIZE  0x03C000
+
+extern uint8_t FLASH_ROM_WRITE(uint32_t StartAddr, void *Buffer, uint32_t Length);
+extern void FLASH_ROM_READ(uint32_t StartAddr, void *Buffer, uint32_t len);
+
+#endif
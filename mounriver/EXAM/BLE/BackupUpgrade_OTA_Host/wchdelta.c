@@ -0,0 +1,933 @@
+/* Delta patches for BackupUpgrade_OTA (CMD_IAP_DELTA, see
+ * ../BackupUpgrade_OTA/APP/include/delta.h).
+ *
+ *   wchdelta diff [-r] [-b base] old new patch    make a patch, -r: no relocation map
+ *   wchdelta apply old patch new                   run the device side on simulated flash
+ *   wchdelta test old new                          both, with and without the map, and
+ *                                                  the checks the device does
+ *
+ * Images are .hex (Intel hex, the base comes from the file) or raw .bin
+ * (base 0x1000, the image A link address, unless -b says otherwise).
+ *
+ * The matching is bsdiff's, done on a copy of both images with the address
+ * fields of the instructions cleared, so code that moved still lines up.
+ * Where the references in the lined up code point before and after gives
+ * the relocation map, and the ops are made by running the device's
+ * DELTA_Xlat() over each match and sending only what it doesn't get right.
+ */
+#include "CONFIG.h"
+#include "ota.h"
+#include "delta.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MAP_KEEP        2       /* references a map entry has to get right */
+#define COPY_MIN        4       /* shorter matching runs go out as ADD */
+#define PACKET          (IAP_LEN - 4)
+
+typedef struct
+{
+    uint8_t *data;
+    uint32_t size;
+    uint32_t base;
+    uint32_t gp;            /* 0 if not found */
+    uint8_t *norm;          /* address fields cleared */
+    uint8_t *bnd;           /* 1 where an instruction starts */
+} image_t;
+
+typedef struct
+{
+    uint32_t addr;          /* old address referred to */
+    int32_t  delta;         /* what the same reference in new says minus that */
+} sample_t;
+
+typedef struct
+{
+    int32_t nstart, ostart, len, extra;
+} block_t;
+
+/* ---- simulated flash for delta.c ---- */
+
+static uint8_t flash[FLASH_ROM_MAX_SIZE];
+static uint32_t flash_writes;
+
+uint8_t FLASH_ROM_WRITE(uint32_t addr, void *buf, uint32_t len)
+{
+    const uint8_t *p = buf;
+    uint32_t i;
+
+    if (len & 3 || addr + len > sizeof(flash))
+        return 1;
+    for (i = 0; i < len; i++)
+    {
+        if (p[i] & ~flash[addr + i])
+            return 2;
+        flash[addr + i] = p[i];
+    }
+    flash_writes++;
+    return 0;
+}
+
+void FLASH_ROM_READ(uint32_t addr, void *buf, uint32_t len)
+{
+    memcpy(buf, flash + addr, len);
+}
+
+/* ---- images ---- */
+
+static void prepare(image_t *img);
+
+static int hex_byte(const char *s)
+{
+    int v;
+    return sscanf(s, "%2x", &v) == 1 ? v : -1;
+}
+
+static int load_hex(FILE *f, image_t *img)
+{
+    static uint8_t mem[0x40000];
+    char line[600];
+    uint32_t upper = 0, lo = 0xffffffff, hi = 0;
+    int n, type, i;
+
+    memset(mem, 0xff, sizeof(mem));
+    while (fgets(line, sizeof(line), f))
+    {
+        uint32_t a;
+
+        if (line[0] != ':')
+            continue;
+        n = hex_byte(line + 1);
+        a = hex_byte(line + 3) << 8 | hex_byte(line + 5);
+        type = hex_byte(line + 7);
+        if (type == 1)
+            break;
+        if (type == 2)
+            upper = (hex_byte(line + 9) << 8 | hex_byte(line + 11)) << 4;
+        if (type == 4)
+            upper = (hex_byte(line + 9) << 8 | hex_byte(line + 11)) << 16;
+        if (type != 0)
+            continue;
+        a += upper;
+        if (a + n > sizeof(mem))
+            return -1;
+        for (i = 0; i < n; i++)
+            mem[a + i] = hex_byte(line + 9 + i * 2);
+        if (a < lo)
+            lo = a;
+        if (a + n > hi)
+            hi = a + n;
+    }
+    if (hi <= lo)
+        return -1;
+    img->base = lo;
+    img->size = hi - lo;
+    img->data = malloc(img->size + 8);
+    memcpy(img->data, mem + lo, img->size);
+    return 0;
+}
+
+static int load(const char *name, image_t *img, uint32_t base)
+{
+    FILE *f = fopen(name, "rb");
+    const char *ext = strrchr(name, '.');
+    int r = 0;
+
+    if (!f)
+    {
+        perror(name);
+        return -1;
+    }
+    if (ext && !strcmp(ext, ".hex"))
+        r = load_hex(f, img);
+    else
+    {
+        fseek(f, 0, SEEK_END);
+        img->size = ftell(f);
+        rewind(f);
+        img->data = malloc(img->size + 8);
+        img->base = base;
+        if (fread(img->data, 1, img->size, f) != img->size)
+            r = -1;
+    }
+    fclose(f);
+    if (r < 0)
+        fprintf(stderr, "%s: can't read it\n", name);
+    else if (img->size > IMAGE_SIZE)
+    {
+        fprintf(stderr, "%s: %u bytes, an image is at most %u\n", name, img->size, IMAGE_SIZE);
+        r = -1;
+    }
+    else
+        prepare(img);
+    return r;
+}
+
+static int save(const char *name, const uint8_t *p, uint32_t len)
+{
+    FILE *f = fopen(name, "wb");
+
+    if (!f || fwrite(p, 1, len, f) != len)
+    {
+        perror(name);
+        return -1;
+    }
+    return fclose(f);
+}
+
+/* ---- matching ---- */
+
+static uint32_t get32(const uint8_t *p)
+{
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static int32_t sext(uint32_t v, int bits)
+{
+    return (int32_t)(v << (32 - bits)) >> (32 - bits);
+}
+
+/* The instruction (or AUIPC/LUI pair) at p, decoded the way DELTA_Xlat()
+ * does: its length, and whether it refers to an address and which. */
+static int decode(const uint8_t *p, uint32_t avail, uint32_t pc, uint32_t gp, uint32_t *t, int *unit)
+{
+    uint32_t w, w2;
+    uint16_t h;
+    int32_t lo;
+
+    *unit = avail < 2 ? 1 : 2;
+    if (avail < 2)
+        return 0;
+    h = p[0] | p[1] << 8;
+    if ((h & 3) != 3)
+    {
+        if ((h & 3) != 1)
+            return 0;
+        if ((h >> 13) == 1 || (h >> 13) == 5)
+            *t = pc + sext(((h >> 12) & 1) << 11 | ((h >> 11) & 1) << 4 | ((h >> 9) & 3) << 8 |
+                ((h >> 8) & 1) << 10 | ((h >> 7) & 1) << 6 | ((h >> 6) & 1) << 7 |
+                ((h >> 3) & 7) << 1 | ((h >> 2) & 1) << 5, 12);
+        else if ((h >> 13) >= 6)
+            *t = pc + sext(((h >> 12) & 1) << 8 | ((h >> 10) & 3) << 3 | ((h >> 5) & 3) << 6 |
+                ((h >> 3) & 3) << 1 | ((h >> 2) & 1) << 5, 9);
+        else
+            return 0;
+        return 1;
+    }
+    if (avail < 4)
+    {
+        *unit = avail;
+        return 0;
+    }
+    *unit = 4;
+    w = get32(p);
+    switch (w & 0x7f)
+    {
+    case 0x6f:
+        *t = pc + sext(((w >> 31) & 1) << 20 | ((w >> 21) & 0x3ff) << 1 | ((w >> 20) & 1) << 11 |
+            ((w >> 12) & 0xff) << 12, 21);
+        return 1;
+    case 0x63:
+        *t = pc + sext(((w >> 31) & 1) << 12 | ((w >> 25) & 0x3f) << 5 | ((w >> 8) & 0xf) << 1 |
+            ((w >> 7) & 1) << 11, 13);
+        return 1;
+    case 0x17:
+    case 0x37:
+        if (avail < 8)
+            return 0;
+        w2 = get32(p + 4);
+        if (((w >> 7) & 31) == 0 || ((w2 >> 15) & 31) != ((w >> 7) & 31))
+            return 0;
+        if ((w2 & 0x7f) == 0x23)
+            lo = ((int32_t)w2 >> 25) << 5 | ((w2 >> 7) & 0x1f);
+        else if (((w2 & 0x7f) == 0x13 && ((w2 >> 12) & 7) == 0) || (w2 & 0x7f) == 0x03 || (w2 & 0x7f) == 0x67)
+            lo = (int32_t)w2 >> 20;
+        else
+            return 0;
+        *t = ((w & 0x7f) == 0x17 ? pc : 0) + (w & 0xfffff000) + lo;
+        *unit = 8;
+        return 1;
+    case 0x13:
+    case 0x03:
+    case 0x23:
+        if (((w >> 15) & 31) != 3 || gp == 0 || ((w & 0x7f) == 0x13 && ((w >> 12) & 7)))
+            return 0;
+        *t = gp + ((w & 0x7f) != 0x23 ? (int32_t)w >> 20 : ((int32_t)w >> 25) << 5 | ((w >> 7) & 0x1f));
+        return 1;
+    }
+    return 0;
+}
+
+/* Decodes the image from the start: where the instructions begin, its gp
+ * (from the la gp in the startup code), and a copy with the fields
+ * DELTA_Xlat() rewrites cleared to match on. */
+static void prepare(image_t *img)
+{
+    uint32_t i, w, t;
+    uint8_t *p;
+    int unit;
+
+    p = img->norm = malloc(img->size + 8);
+    img->bnd = calloc(img->size + 8, 1);
+    memcpy(p, img->data, img->size);
+    memset(p + img->size, 0, 8);
+    img->gp = 0;
+
+    for (i = 0; i < img->size; i += unit)
+    {
+        img->bnd[i] = 1;
+        decode(img->data + i, img->size - i, img->base + i, 0, &t, &unit);
+        if (unit == 2)
+        {
+            uint16_t h = p[i] | p[i + 1] << 8;
+
+            if ((h & 3) == 1 && ((h >> 13) == 1 || (h >> 13) == 5))
+                h &= 0xe003;
+            if ((h & 3) == 1 && (h >> 13) >= 6)
+                h &= 0xe383;
+            p[i] = h;
+            p[i + 1] = h >> 8;
+        }
+        if (unit < 4)
+            continue;
+        w = get32(p + i);
+        if (unit == 8)
+        {
+            if ((w & 0x7f) == 0x17 && ((w >> 7) & 31) == 3 && img->gp == 0)
+                img->gp = t;
+            put32(p + i, w & 0xfff);
+            w = get32(p + i + 4);
+            put32(p + i + 4, (w & 0x7f) == 0x23 ? w & 0x01fff07f : w & 0x000fffff);
+            continue;
+        }
+        switch (w & 0x7f)
+        {
+        case 0x6f:
+            put32(p + i, w & 0xfff);
+            break;
+        case 0x63:
+            put32(p + i, w & 0x01fff07f);
+            break;
+        case 0x13:
+        case 0x03:
+        case 0x23:
+            if (((w >> 15) & 31) == 3)
+                put32(p + i, (w & 0x7f) == 0x23 ? w & 0x01fff07f : w & 0x000fffff);
+            break;
+        }
+    }
+}
+
+static const uint8_t *sa_text;
+static int32_t sa_n, sa_k, *sa_rank;
+
+static int sa_cmp(const void *a, const void *b)
+{
+    int32_t i = *(const int32_t *)a, j = *(const int32_t *)b;
+    int32_t ri, rj;
+
+    if (sa_rank[i] != sa_rank[j])
+        return sa_rank[i] < sa_rank[j] ? -1 : 1;
+    ri = i + sa_k < sa_n ? sa_rank[i + sa_k] : -1;
+    rj = j + sa_k < sa_n ? sa_rank[j + sa_k] : -1;
+    return ri < rj ? -1 : ri > rj;
+}
+
+/* Suffix array by prefix doubling. */
+static int32_t *suffix_array(const uint8_t *t, int32_t n)
+{
+    int32_t *sa = malloc(n * sizeof(*sa)), *tmp = malloc(n * sizeof(*sa)), i;
+
+    sa_text = t;
+    sa_n = n;
+    sa_rank = malloc(n * sizeof(*sa));
+    for (i = 0; i < n; i++)
+    {
+        sa[i] = i;
+        sa_rank[i] = t[i];
+    }
+    for (sa_k = 1;; sa_k *= 2)
+    {
+        qsort(sa, n, sizeof(*sa), sa_cmp);
+        tmp[sa[0]] = 0;
+        for (i = 1; i < n; i++)
+            tmp[sa[i]] = tmp[sa[i - 1]] + (sa_cmp(&sa[i - 1], &sa[i]) < 0);
+        memcpy(sa_rank, tmp, n * sizeof(*sa));
+        if (sa_rank[sa[n - 1]] == n - 1)
+            break;
+    }
+    free(tmp);
+    free(sa_rank);
+    return sa;
+}
+
+static int32_t match_len(const uint8_t *a, int32_t an, const uint8_t *b, int32_t bn)
+{
+    int32_t i;
+
+    for (i = 0; i < an && i < bn && a[i] == b[i]; i++)
+        ;
+    return i;
+}
+
+static int32_t search(const int32_t *sa, const uint8_t *old, int32_t oldsize,
+    const uint8_t *nw, int32_t newsize, int32_t st, int32_t en, int32_t *pos)
+{
+    int32_t x, y;
+
+    while (en - st >= 2)
+    {
+        x = st + (en - st) / 2;
+        y = oldsize - sa[x] < newsize ? oldsize - sa[x] : newsize;
+        if (memcmp(old + sa[x], nw, y) < 0)
+            st = x;
+        else
+            en = x;
+    }
+    x = match_len(old + sa[st], oldsize - sa[st], nw, newsize);
+    y = match_len(old + sa[en], oldsize - sa[en], nw, newsize);
+    *pos = x > y ? sa[st] : sa[en];
+    return x > y ? x : y;
+}
+
+/* bsdiff's scan: each block is lenf bytes of new lined up with old (to be
+ * diffed) followed by extra bytes that have to be sent. */
+static int diff_blocks(const uint8_t *old, int32_t oldsize, const uint8_t *nw, int32_t newsize, block_t **out)
+{
+    int32_t *sa = suffix_array(old, oldsize);
+    int32_t scan = 0, len = 0, pos = 0, lastscan = 0, lastpos = 0, lastoffset = 0;
+    int32_t oldscore, scsc, s, sf, lenf, sb, lenb, overlap, ss, lens, i;
+    int count = 0, cap = 64;
+    block_t *b = malloc(cap * sizeof(*b));
+
+    while (scan < newsize)
+    {
+        oldscore = 0;
+        for (scsc = scan += len; scan < newsize; scan++)
+        {
+            len = search(sa, old, oldsize, nw + scan, newsize - scan, 0, oldsize - 1, &pos);
+            for (; scsc < scan + len; scsc++)
+                if (scsc + lastoffset < oldsize && old[scsc + lastoffset] == nw[scsc])
+                    oldscore++;
+            if ((len == oldscore && len != 0) || len > oldscore + 8)
+                break;
+            if (scan + lastoffset < oldsize && old[scan + lastoffset] == nw[scan])
+                oldscore--;
+        }
+        if (len == oldscore && scan != newsize)
+            continue;
+
+        s = sf = lenf = 0;
+        for (i = 0; lastscan + i < scan && lastpos + i < oldsize;)
+        {
+            if (old[lastpos + i] == nw[lastscan + i])
+                s++;
+            i++;
+            if (s * 2 - i > sf * 2 - lenf)
+            {
+                sf = s;
+                lenf = i;
+            }
+        }
+        lenb = 0;
+        if (scan < newsize)
+        {
+            s = sb = 0;
+            for (i = 1; scan >= lastscan + i && pos >= i; i++)
+            {
+                if (old[pos - i] == nw[scan - i])
+                    s++;
+                if (s * 2 - i > sb * 2 - lenb)
+                {
+                    sb = s;
+                    lenb = i;
+                }
+            }
+        }
+        if (lastscan + lenf > scan - lenb)
+        {
+            overlap = lastscan + lenf - (scan - lenb);
+            s = ss = lens = 0;
+            for (i = 0; i < overlap; i++)
+            {
+                if (nw[lastscan + lenf - overlap + i] == old[lastpos + lenf - overlap + i])
+                    s++;
+                if (nw[scan - lenb + i] == old[pos - lenb + i])
+                    s--;
+                if (s > ss)
+                {
+                    ss = s;
+                    lens = i + 1;
+                }
+            }
+            lenf += lens - overlap;
+            lenb -= lens;
+        }
+
+        if (count == cap)
+            b = realloc(b, (cap *= 2) * sizeof(*b));
+        b[count].nstart = lastscan;
+        b[count].ostart = lastpos;
+        b[count].len = lenf;
+        b[count].extra = scan - lenb - (lastscan + lenf);
+        count++;
+
+        lastscan = scan - lenb;
+        lastpos = pos - lenb;
+        lastoffset = pos - scan;
+    }
+    free(sa);
+    *out = b;
+    return count;
+}
+
+/* ---- relocation map ---- */
+
+static int sample_cmp(const void *a, const void *b)
+{
+    const sample_t *x = a, *y = b;
+
+    if (x->addr != y->addr)
+        return x->addr < y->addr ? -1 : 1;
+    return x->delta < y->delta ? -1 : x->delta > y->delta;
+}
+
+/* Every reference in the lined up code that is the same instruction on both
+ * sides tells where its target went. */
+static int collect(const image_t *old, const image_t *nw, const block_t *blk, int count, sample_t **out)
+{
+    int n = 0, cap = 4096, unit, unit2, b;
+    sample_t *sm = malloc(cap * sizeof(*sm));
+    uint32_t to, tn;
+    int32_t i, o, k;
+
+    for (b = 0; b < count; b++)
+    {
+        o = blk[b].ostart;
+        k = blk[b].nstart;
+        for (i = 0; i < blk[b].len; i += unit)
+        {
+            unit = 1;
+            if (!old->bnd[o + i] ||
+                !decode(old->data + o + i, blk[b].len - i, old->base + o + i, old->gp, &to, &unit) ||
+                memcmp(old->norm + o + i, nw->norm + k + i, unit) ||
+                !decode(nw->data + k + i, blk[b].len - i, nw->base + k + i, nw->gp, &tn, &unit2) ||
+                unit2 != unit)
+                continue;
+            if (n == cap)
+                sm = realloc(sm, (cap *= 2) * sizeof(*sm));
+            sm[n].addr = to;
+            sm[n].delta = tn - to;
+            n++;
+        }
+    }
+    qsort(sm, n, sizeof(*sm), sample_cmp);
+    *out = sm;
+    return n;
+}
+
+/* What each entry is worth: the references it gets right, less those the
+ * entry before it would get right without it. */
+static void map_cost(const DeltaSeg_t *map, int m, const sample_t *sm, int n, int *cost)
+{
+    int e = -1, i;
+
+    memset(cost, 0, m * sizeof(*cost));
+    for (i = 0; i < n; i++)
+    {
+        while (e + 1 < m && map[e + 1].old_start <= sm[i].addr)
+            e++;
+        if (e < 0)
+            continue;
+        if (sm[i].delta == map[e].delta)
+            cost[e]++;
+        if (sm[i].delta == (e ? map[e - 1].delta : 0))
+            cost[e]--;
+    }
+}
+
+/* A step at every address where the most common delta changes, then the
+ * entries worth least dropped until it fits the device and every one left
+ * pays for its 8 bytes. */
+static int make_map(const sample_t *sm, int n, DeltaSeg_t *map)
+{
+    DeltaSeg_t *tmp = malloc((n + 1) * sizeof(*tmp));
+    int *cost = malloc((n + 1) * sizeof(*cost));
+    int m = 0, i, j, best, run, best_run;
+    int32_t d, cur = 0;
+
+    for (i = 0; i < n; i = j)
+    {
+        d = sm[i].delta;
+        best_run = 0;
+        for (j = i; j < n && sm[j].addr == sm[i].addr; j += run)
+        {
+            for (run = 1; j + run < n && sm[j + run].addr == sm[j].addr && sm[j + run].delta == sm[j].delta; run++)
+                ;
+            if (run > best_run)
+            {
+                best_run = run;
+                d = sm[j].delta;
+            }
+        }
+        if (d == cur)
+            continue;
+        tmp[m].old_start = sm[i].addr;
+        tmp[m].delta = cur = d;
+        m++;
+    }
+
+    while (m)
+    {
+        map_cost(tmp, m, sm, n, cost);
+        best = 0;
+        for (i = 1; i < m; i++)
+            if (cost[i] < cost[best])
+                best = i;
+        if (m <= DELTA_MAP_MAX && cost[best] >= MAP_KEEP)
+            break;
+        memmove(tmp + best, tmp + best + 1, (m - best - 1) * sizeof(*tmp));
+        m--;
+    }
+    memcpy(map, tmp, m * sizeof(*tmp));
+    free(cost);
+    free(tmp);
+    return m;
+}
+
+/* ---- patch ---- */
+
+typedef struct
+{
+    uint8_t *p;
+    uint32_t len, cap;
+    uint32_t ops[4], bytes[4];
+} patch_t;
+
+static void emit_byte(patch_t *pt, uint8_t b)
+{
+    if (pt->len == pt->cap)
+        pt->p = realloc(pt->p, pt->cap = pt->cap ? pt->cap * 2 : 4096);
+    pt->p[pt->len++] = b;
+}
+
+static void emit_op(patch_t *pt, int type, uint32_t arg)
+{
+    emit_byte(pt, type << 6 | (arg & 0x1f) | (arg >> 5 ? 0x20 : 0));
+    for (arg >>= 5; arg; arg >>= 7)
+        emit_byte(pt, (arg & 0x7f) | (arg >> 7 ? 0x80 : 0));
+    pt->ops[type]++;
+}
+
+static void emit_add(patch_t *pt, const image_t *old, const image_t *nw, int32_t o, int32_t n, int32_t len)
+{
+    int32_t i;
+
+    if (len == 0)
+        return;
+    emit_op(pt, DELTA_OP_ADD, len);
+    for (i = 0; i < len; i++)
+        emit_byte(pt, nw->data[n + i] - old->data[o + i]);
+    pt->bytes[DELTA_OP_ADD] += len;
+}
+
+/* One lined up region: walk it the way COPY will, instruction by
+ * instruction, COPY what comes out right and ADD the rest. A COPY only
+ * starts where an instruction of the old image does, so the device decodes
+ * the same instructions the host did. */
+static void emit_region(patch_t *pt, const image_t *old, const image_t *nw, int32_t o, int32_t n, int32_t len)
+{
+    uint8_t out[8];
+    int32_t i = 0, k, add = 0, unit;
+
+    while (i < len)
+    {
+        if (!old->bnd[o + i])
+        {
+            i++;
+            continue;
+        }
+        for (k = i; k < len; k += unit)
+        {
+            unit = DELTA_Xlat(old->data + o + k, len - k, o + k, n + k, out);
+            if (memcmp(out, nw->data + n + k, unit))
+                break;
+        }
+        if (k - i >= COPY_MIN || (k > i && k == len && add == i))
+        {
+            emit_add(pt, old, nw, o + add, n + add, i - add);
+            emit_op(pt, DELTA_OP_COPY, k - i);
+            pt->bytes[DELTA_OP_COPY] += k - i;
+            i = add = k;
+            continue;
+        }
+        /* too short to be worth an op, or nothing: into the ADD, with the
+         * instruction that didn't match */
+        i = k;
+        if (i < len)
+            i += DELTA_Xlat(old->data + o + i, len - i, o + i, n + i, out);
+    }
+    emit_add(pt, old, nw, o + add, n + add, len - add);
+}
+
+static patch_t make_patch(const image_t *old, const image_t *nw, int reloc, int *map_count)
+{
+    DeltaSeg_t map[DELTA_MAP_MAX];
+    patch_t pt = { 0 };
+    block_t *blk;
+    sample_t *sm;
+    int count, n, m = 0, i;
+    int32_t opos = 0, d;
+
+    count = diff_blocks(old->norm, old->size, nw->norm, nw->size, &blk);
+    if (reloc)
+    {
+        n = collect(old, nw, blk, count, &sm);
+        m = make_map(sm, n, map);
+        free(sm);
+    }
+    DELTA_SetMap(old->base, old->gp, nw->gp, map, m);
+
+    put32(pt.p = malloc(pt.cap = 4096), DELTA_MAGIC);
+    put32(pt.p + 4, old->base);
+    put32(pt.p + 8, old->size);
+    put32(pt.p + 12, DELTA_Crc32(0, old->data, old->size));
+    put32(pt.p + 16, nw->size);
+    put32(pt.p + 20, DELTA_Crc32(0, nw->data, nw->size));
+    put32(pt.p + 24, old->gp);
+    put32(pt.p + 28, nw->gp);
+    pt.p[32] = m;
+    pt.p[33] = m >> 8;
+    pt.len = DELTA_HEADER_LEN;
+    for (i = 0; i < m; i++)
+    {
+        put32(pt.p + pt.len, map[i].old_start);
+        put32(pt.p + pt.len + 4, map[i].delta);
+        pt.len += 8;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        if (blk[i].len)
+        {
+            d = blk[i].ostart - opos;
+            if (d)
+                emit_op(&pt, DELTA_OP_SEEK, d < 0 ? ~((uint32_t)d << 1) : (uint32_t)d << 1);
+            emit_region(&pt, old, nw, blk[i].ostart, blk[i].nstart, blk[i].len);
+            opos = blk[i].ostart + blk[i].len;
+        }
+        if (blk[i].extra)
+        {
+            emit_op(&pt, DELTA_OP_INSERT, blk[i].extra);
+            for (d = 0; d < blk[i].extra; d++)
+                emit_byte(&pt, nw->data[blk[i].nstart + blk[i].len + d]);
+            pt.bytes[DELTA_OP_INSERT] += blk[i].extra;
+        }
+    }
+    free(blk);
+    *map_count = m;
+    return pt;
+}
+
+/* ---- device side ---- */
+
+/* Image A holds old, image B was erased with CMD_IAP_ERASE, the patch goes
+ * in packet by packet as it would over the air. Returns the first status
+ * that isn't DELTA_OK, or what DELTA_Check() says at the end. */
+static int run_device(const image_t *old, const uint8_t *patch, uint32_t len, uint32_t *pages)
+{
+    uint32_t off, n;
+    uint16_t seq = 0;
+    uint8_t s;
+
+    memset(flash, 0xff, sizeof(flash));
+    memcpy(flash + IMAGE_A_START_ADD, old->data, old->size);
+    flash_writes = 0;
+
+    for (off = 0; off < len; off += n, seq++)
+    {
+        n = len - off < PACKET ? len - off : PACKET;
+        s = DELTA_Input(seq, patch + off, n);
+        if (s)
+            return s;
+        while ((s = DELTA_Process()) == DELTA_BUSY)
+            ;
+        if (s)
+            return s;
+    }
+    *pages = flash_writes;
+    return DELTA_Check();
+}
+
+static int cmd_apply(int argc, char **argv)
+{
+    image_t old, nw;
+    uint8_t *patch;
+    uint32_t len, pages;
+    FILE *f;
+    int s;
+
+    if (argc != 4 || load(argv[1], &old, IMAGE_A_START_ADD) < 0)
+        return 1;
+    if (!(f = fopen(argv[2], "rb")))
+    {
+        perror(argv[2]);
+        return 1;
+    }
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    rewind(f);
+    patch = malloc(len);
+    if (fread(patch, 1, len, f) != len)
+        return 1;
+    fclose(f);
+
+    s = run_device(&old, patch, len, &pages);
+    if (s)
+    {
+        fprintf(stderr, "%s: device status %02x\n", argv[2], s);
+        return 1;
+    }
+    nw.size = get32(patch + 16);
+    return save(argv[3], flash + IMAGE_B_START_ADD, nw.size) < 0;
+}
+
+static void report(const char *what, const patch_t *pt, int m, const image_t *nw)
+{
+    printf("  %-9s %6u bytes %5.1f%% %5u packets, map %2d, copy %u/%u add %u/%u insert %u/%u seek %u\n",
+        what, pt->len, 100.0 * pt->len / nw->size, (pt->len + PACKET - 1) / PACKET, m,
+        pt->ops[DELTA_OP_COPY], pt->bytes[DELTA_OP_COPY], pt->ops[DELTA_OP_ADD], pt->bytes[DELTA_OP_ADD],
+        pt->ops[DELTA_OP_INSERT], pt->bytes[DELTA_OP_INSERT], pt->ops[DELTA_OP_SEEK]);
+}
+
+/* patch, apply and compare */
+static int check(const image_t *old, const image_t *nw, const patch_t *pt)
+{
+    uint32_t pages;
+    int s = run_device(old, pt->p, pt->len, &pages);
+
+    if (s)
+    {
+        printf("  FAIL: device status %02x\n", s);
+        return 1;
+    }
+    if (memcmp(flash + IMAGE_B_START_ADD, nw->data, nw->size))
+    {
+        printf("  FAIL: image B differs\n");
+        return 1;
+    }
+    return 0;
+}
+
+static int cmd_test(int argc, char **argv)
+{
+    image_t old, nw;
+    patch_t pt, raw;
+    uint32_t pages;
+    int m, fail = 0, s;
+
+    if (argc != 3 || load(argv[1], &old, IMAGE_A_START_ADD) < 0 || load(argv[2], &nw, IMAGE_A_START_ADD) < 0)
+        return 1;
+    printf("%s (%u) -> %s (%u), full image %u packets\n", argv[1], old.size, argv[2], nw.size,
+        (nw.size + PACKET - 1) / PACKET);
+    if (old.base != nw.base)
+    {
+        printf("  FAIL: linked at %08x and %08x\n", old.base, nw.base);
+        return 1;
+    }
+
+    raw = make_patch(&old, &nw, 0, &m);
+    report("no map", &raw, m, &nw);
+    fail |= check(&old, &nw, &raw);
+
+    pt = make_patch(&old, &nw, 1, &m);
+    report("relocated", &pt, m, &nw);
+    fail |= check(&old, &nw, &pt);
+
+    /* made against another image: rejected before anything is written */
+    old.data[old.size / 2] ^= 1;
+    s = run_device(&old, pt.p, pt.len, &pages);
+    old.data[old.size / 2] ^= 1;
+    if (s != DELTA_ERR_BASE || flash_writes)
+    {
+        printf("  FAIL: wrong old image gave %02x, %u pages written\n", s, flash_writes);
+        fail = 1;
+    }
+
+    /* the last packet lost: END must be refused */
+    s = run_device(&old, pt.p, pt.len - 1, &pages);
+    if (s != DELTA_BUSY)
+    {
+        printf("  FAIL: short patch gave %02x\n", s);
+        fail = 1;
+    }
+
+    /* a flipped patch byte comes out as a CRC error (or a format error) */
+    pt.p[pt.len / 2] ^= 0x10;
+    s = run_device(&old, pt.p, pt.len, &pages);
+    if (s == DELTA_OK)
+    {
+        printf("  FAIL: corrupted patch accepted\n");
+        fail = 1;
+    }
+    if (!fail)
+        printf("  ok\n");
+    return fail;
+}
+
+static int cmd_diff(int argc, char **argv)
+{
+    uint32_t base = IMAGE_A_START_ADD;
+    int reloc = 1, m;
+    image_t old, nw;
+    patch_t pt;
+
+    for (; argc > 1 && argv[1][0] == '-'; argc--, argv++)
+    {
+        if (!strcmp(argv[1], "-r"))
+            reloc = 0;
+        else if (!strcmp(argv[1], "-b") && argc > 2)
+        {
+            base = strtoul(argv[2], NULL, 0);
+            argc--, argv++;
+        }
+        else
+            return 1;
+    }
+    if (argc != 4 || load(argv[1], &old, base) < 0 || load(argv[2], &nw, base) < 0)
+        return 1;
+    if (old.base != nw.base)
+    {
+        fprintf(stderr, "linked at %08x and %08x\n", old.base, nw.base);
+        return 1;
+    }
+    pt = make_patch(&old, &nw, reloc, &m);
+    if (check(&old, &nw, &pt))
+        return 1;
+    report(argv[3], &pt, m, &nw);
+    return save(argv[3], pt.p, pt.len) < 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && !strcmp(argv[1], "diff"))
+        return cmd_diff(argc - 1, argv + 1);
+    if (argc > 1 && !strcmp(argv[1], "apply"))
+        return cmd_apply(argc - 1, argv + 1);
+    if (argc > 1 && !strcmp(argv[1], "test"))
+        return cmd_test(argc - 1, argv + 1);
+    fprintf(stderr,
+        "usage: wchdelta diff [-r] [-b base] old new patch\n"
+        "       wchdelta apply old patch new\n"
+        "       wchdelta test old new\n");
+    return 1;
+}
@@ -12,6 +12,7 @@
 
 #include "CH57x_common.h"
 #include "iap.h"
+#include "iap2.h"
 
 /*********************************************************************
  * @fn      Main_Circulation
@@ -29,7 +30,7 @@ void Main_Circulation()
     while (1)
     {
         j++;
-        if (j > 5)//100usһ
+        if (j > 5 || IAP2_Busy())//100usһ
         {
             j = 0;
             USB_DevTransProcess();//òѯʽusbʹжϡ
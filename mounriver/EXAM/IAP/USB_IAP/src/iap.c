@@ -10,6 +10,7 @@
  * microcontroller manufactured by Nanjing Qinheng Microelectronics.
  *******************************************************************************/
 #include "iap.h"
+#include "iap2.h"
 
 #undef pSetupReqPak     /* ͷļͻ  */
 #define pSetupReqPak          ((PUSB_SETUP_REQ)EP0_Databuf)
@@ -96,8 +97,19 @@ void USB_DevTransProcess(void)
                 {
                     // ͬݰ
                     len = R8_USB_RX_LEN;
+                    if (IAP2_Busy())
+                    {
+                        /* v2 data, already in the page buffer. Re-arms the endpoint itself. */
+                        IAP2_Data(len);
+                        return;
+                    }
                     my_memcpy(g_iap_cmd.other.buf, EP2_Databuf, len);
                     myDevEP2_OUT_Deal(len);
+                    if (IAP2_Busy())
+                    {
+                        /* v2 WRITE, the endpoint is already re-armed on the page buffer */
+                        return;
+                    }
                 }
             }
             break;
@@ -391,6 +403,11 @@ void myDevEP2_OUT_Deal(uint8_t l)
 		s = FLASH_ROM_VERIFY(addr, g_write_buf, g_iap_cmd.verify.len);
         myDevEP2_IN_Deal(s);
         break;
+    case CMD_IAP2_INFO:
+    case CMD_IAP2_WRITE:
+    case CMD_IAP2_CRC:
+        IAP2_Command(g_iap_cmd.other.buf, l);
+        break;
     case CMD_IAP_END:
         /*λUSBתapp*/
         R8_USB_CTRL = RB_UC_RESET_SIE;
@@ -420,6 +437,38 @@ void myDevEP2_IN_Deal(uint8_t s)
     R8_UEP2_CTRL = (R8_UEP2_CTRL & ~MASK_UEP_T_RES) | UEP_T_RES_ACK; //enable send
 }
 
+/*********************************************************************
+ * @fn      IAP2_PortRearm
+ *
+ * @brief   v2: the next EP2 OUT packet goes to dma (NULL for EP2_Databuf),
+ *          and is accepted from now on.
+ *
+ * @return  None.
+ */
+__attribute__((section(".highcode")))
+void IAP2_PortRearm(uint8_t *dma)
+{
+    R16_UEP2_DMA = (uint16_t)(uint32_t)(dma ? dma : EP2_Databuf);
+    R8_USB_INT_FG = RB_UIF_TRANSFER;
+}
+
+/*********************************************************************
+ * @fn      IAP2_PortReply
+ *
+ * @brief   v2: EP2 IN reply. The IN buffer follows the OUT buffer, so EP2
+ *          goes back to EP2_Databuf.
+ *
+ * @return  None.
+ */
+__attribute__((section(".highcode")))
+void IAP2_PortReply(const uint8_t *buf, uint8_t len)
+{
+    R16_UEP2_DMA = (uint16_t)(uint32_t)EP2_Databuf;
+    my_memcpy(EP2_Databuf + 64, buf, len);
+    R8_UEP2_T_LEN = len;
+    R8_UEP2_CTRL = (R8_UEP2_CTRL & ~MASK_UEP_T_RES) | UEP_T_RES_ACK;
+}
+
 /*********************************************************************
  * @fn      my_memcpy
  *
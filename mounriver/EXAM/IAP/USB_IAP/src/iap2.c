@@ -0,0 +1,266 @@
+/********************************** (C) COPYRIGHT *******************************
+ * File Name          : iap2.c
+ * Description        : USB IAP v2, streamed programming with CRC32 verify
+ *********************************************************************************
+ * Protocol in iap2.h. Runs from RAM like the rest of the IAP, the flash is
+ * busy while it's being written.
+ *******************************************************************************/
+#include "iap.h"
+#include "iap2.h"
+
+typedef struct
+{
+    uint32_t addr;      /* flash address of the page being filled */
+    uint32_t left;      /* bytes of the window still to come, 0 when idle */
+    uint16_t fill;      /* bytes in the page being filled */
+    uint8_t  cur;       /* page buffer being filled */
+    uint8_t  status;    /* first error in this window */
+} iap2_state_t;
+
+static iap2_state_t g_iap2;
+
+/* EP2 OUT DMAs straight into these */
+__attribute__((aligned(4))) static uint8_t g_iap2_page[2][IAP2_PAGE];
+
+static const uint32_t crc_nibble[16] =
+{
+    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+    0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+};
+
+/*********************************************************************
+ * @fn      IAP2_Crc32
+ *
+ * @brief   CRC-32 (zlib), pass 0 to start and the last result to go on.
+ *
+ * @return  crc
+ */
+__attribute__((section(".highcode")))
+uint32_t IAP2_Crc32(uint32_t crc, const uint8_t *p, uint32_t len)
+{
+    crc = ~crc;
+    while (len--)
+    {
+        crc ^= *p++;
+        crc = (crc >> 4) ^ crc_nibble[crc & 15];
+        crc = (crc >> 4) ^ crc_nibble[crc & 15];
+    }
+    return ~crc;
+}
+
+__attribute__((section(".highcode")))
+static uint32_t iap2_get32(const uint8_t *p)
+{
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+__attribute__((section(".highcode")))
+static void iap2_reply(uint8_t cmd, uint8_t status, uint32_t v)
+{
+    __attribute__((aligned(4))) uint8_t r[8];
+
+    r[0] = cmd;
+    r[1] = status;
+    r[2] = 0;
+    r[3] = 0;
+    r[4] = v;
+    r[5] = v >> 8;
+    r[6] = v >> 16;
+    r[7] = v >> 24;
+    IAP2_PortReply(r, sizeof(r));
+}
+
+/*********************************************************************
+ * @fn      iap2_program
+ *
+ * @brief   Writes one page, erasing its block first if it's the first page
+ *          of one. Skipped once the window has failed.
+ *
+ * @return  None.
+ */
+__attribute__((section(".highcode")))
+static void iap2_program(uint8_t *buf, uint32_t addr, uint16_t len)
+{
+    uint8_t s = 0;
+
+    if (g_iap2.status)
+    {
+        return;
+    }
+    if ((addr & (IAP2_BLOCK - 1)) == 0)
+    {
+        s = FLASH_ROM_ERASE(addr, IAP2_BLOCK);
+    }
+    while (len & 3)
+    {
+        buf[len++] = 0xff;
+    }
+    if (s == 0)
+    {
+        s = FLASH_ROM_WRITE(addr, buf, len);
+    }
+    g_iap2.status = s;
+}
+
+/*********************************************************************
+ * @fn      IAP2_Busy
+ *
+ * @brief   Whether a WRITE window is being received, EP2 OUT packets are
+ *          then data for IAP2_Data().
+ *
+ * @return  1 if so.
+ */
+__attribute__((section(".highcode")))
+uint8_t IAP2_Busy(void)
+{
+    return g_iap2.left != 0;
+}
+
+/*********************************************************************
+ * @fn      IAP2_Command
+ *
+ * @brief   A v2 request. WRITE only sets up the window, its reply comes
+ *          from IAP2_Data() once the data is in flash.
+ *
+ * @param   cmd - the request packet
+ * @param   len - its length
+ *
+ * @return  None.
+ */
+__attribute__((section(".highcode")))
+void IAP2_Command(const uint8_t *cmd, uint8_t len)
+{
+    __attribute__((aligned(4))) uint8_t buf[IAP2_EP_SIZE];
+    uint32_t addr, n, crc, i;
+
+    addr = len >= 12 ? iap2_get32(cmd + 4) : 0;
+    n = len >= 12 ? iap2_get32(cmd + 8) : 0;
+
+    switch (cmd[0])
+    {
+    case CMD_IAP2_INFO:
+        buf[0] = CMD_IAP2_INFO;
+        buf[1] = 0;
+        buf[2] = IAP2_VERSION;
+        buf[3] = 0;
+        buf[4] = (uint8_t)IAP2_PAGE;
+        buf[5] = IAP2_PAGE >> 8;
+        buf[6] = (uint8_t)IAP2_WINDOW;
+        buf[7] = IAP2_WINDOW >> 8;
+        for (i = 0; i < 4; i++)
+        {
+            buf[8 + i] = (uint32_t)APP_CODE_START_ADDR >> (i * 8);
+            buf[12 + i] = (uint32_t)APP_CODE_END_ADDR >> (i * 8);
+        }
+        IAP2_PortReply(buf, 16);
+        break;
+
+    case CMD_IAP2_WRITE:
+        if (len < 12 || n == 0 || n > IAP2_WINDOW || (addr & (IAP2_PAGE - 1)) ||
+            addr < APP_CODE_START_ADDR || addr + n > APP_CODE_END_ADDR ||
+            (addr & (IAP2_BLOCK - 1)) + n > IAP2_BLOCK)
+        {
+            iap2_reply(CMD_IAP2_WRITE, IAP2_ERR_PARAM, addr);
+            break;
+        }
+        g_iap2.addr = addr;
+        g_iap2.left = n;
+        g_iap2.fill = 0;
+        g_iap2.cur = 0;
+        g_iap2.status = 0;
+        IAP2_PortRearm(g_iap2_page[0]);
+        break;
+
+    case CMD_IAP2_CRC:
+        if (len < 12 || addr + n > FLASH_ROM_MAX_SIZE || addr + n < addr)
+        {
+            iap2_reply(CMD_IAP2_CRC, IAP2_ERR_PARAM, 0);
+            break;
+        }
+        for (crc = 0; n; n -= i, addr += i)
+        {
+            i = n < sizeof(buf) ? n : sizeof(buf);
+            FLASH_ROM_READ(addr, buf, i);
+            crc = IAP2_Crc32(crc, buf, i);
+        }
+        iap2_reply(CMD_IAP2_CRC, 0, crc);
+        break;
+
+    default:
+        iap2_reply(cmd[0], IAP2_ERR_PARAM, 0);
+        break;
+    }
+}
+
+/*********************************************************************
+ * @fn      IAP2_Data
+ *
+ * @brief   A data packet of the current window has landed in the page
+ *          buffer. Re-arms EP2 OUT itself: when a page is complete the
+ *          next packet is let in (into the other buffer) before the page is
+ *          programmed, so the caller must not touch the endpoint after this.
+ *
+ * @param   len - packet length
+ *
+ * @return  None.
+ */
+__attribute__((section(".highcode")))
+void IAP2_Data(uint8_t len)
+{
+    uint8_t *page = g_iap2_page[g_iap2.cur];
+    uint32_t addr;
+    uint16_t n;
+
+    if (len > g_iap2.left)
+    {
+        len = g_iap2.left;
+    }
+
+    /* Only the last packet of a window may be short. After a short one the
+     * next would be DMA'd past the end of the page buffer, so the rest of
+     * the window is still counted off to stay in step with the host, into
+     * the start of the buffer, and the window fails. */
+    if ((len < IAP2_EP_SIZE && len < g_iap2.left) || g_iap2.fill + len > IAP2_PAGE)
+    {
+        g_iap2.status = IAP2_ERR_DATA;
+    }
+    if (g_iap2.status == IAP2_ERR_DATA)
+    {
+        g_iap2.left -= len;
+        if (g_iap2.left)
+        {
+            IAP2_PortRearm(page);
+            return;
+        }
+        iap2_reply(CMD_IAP2_WRITE, g_iap2.status, g_iap2.addr);
+        IAP2_PortRearm(NULL);
+        return;
+    }
+
+    g_iap2.fill += len;
+    g_iap2.left -= len;
+
+    if (g_iap2.left && g_iap2.fill < IAP2_PAGE)
+    {
+        IAP2_PortRearm(page + g_iap2.fill);
+        return;
+    }
+
+    addr = g_iap2.addr;
+    n = g_iap2.fill;
+    g_iap2.addr += n;
+    g_iap2.fill = 0;
+    g_iap2.cur ^= 1;
+
+    if (g_iap2.left)
+    {
+        IAP2_PortRearm(g_iap2_page[g_iap2.cur]);
+        iap2_program(page, addr, n);
+        return;
+    }
+
+    /* Last page of the window, the reply has to wait for it. */
+    iap2_program(page, addr, n);
+    iap2_reply(CMD_IAP2_WRITE, g_iap2.status, g_iap2.addr);
+    IAP2_PortRearm(NULL);
+}
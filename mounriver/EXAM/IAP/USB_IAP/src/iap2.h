@@ -0,0 +1,64 @@
+/********************************** (C) COPYRIGHT *******************************
+ * File Name          : iap2.h
+ * Description        : USB IAP v2, streamed programming with CRC32 verify
+ *********************************************************************************
+ * The v1 commands (iap.h) move 62 bytes per round trip and verify by sending
+ * the image again. v2 sends a WRITE command followed by up to IAP2_WINDOW
+ * bytes of raw data on EP2 OUT and only answers once the whole window is in
+ * flash. The data is DMA'd straight into one of two page buffers; when a page
+ * is full the endpoint is re-armed on the other one before the page is
+ * programmed, so the next packet comes in while the flash is busy. Blocks are
+ * erased as the first page of each one gets programmed. Verify is one CRC32
+ * over the written region, computed on the device.
+ *
+ * All fields are little endian. Every request is one packet on EP2 OUT, every
+ * reply one packet on EP2 IN.
+ *
+ *   INFO   84                              -> 84 st ver 0 page(2) window(2) start(4) end(4)
+ *   WRITE  85 0 0 0 addr(4) len(4) <data>  -> 85 st 0 0 next(4)
+ *   CRC    86 0 0 0 addr(4) len(4)         -> 86 st 0 0 crc(4)
+ *   END    83                              (v1, starts the application)
+ *
+ * WRITE: addr page aligned, the window may not cross an erase block and is
+ * at most IAP2_WINDOW bytes. The data follows as full 64 byte packets, the
+ * last one may be short. A window that starts on a block boundary erases the
+ * block, so a failed window is retried from the start of its block. The last
+ * page of the image is padded with 0xff.
+ *
+ * CRC is the usual CRC-32 (zlib, reflected 0xedb88320, init and final xor
+ * 0xffffffff). st is 0 for success, 0xfe for a bad request, 0xfd for a
+ * short data packet before the end of the window, otherwise what the flash
+ * routine returned.
+ *******************************************************************************/
+#ifndef _IAP2_H_
+#define _IAP2_H_
+
+#include <stdint.h>
+
+#define CMD_IAP2_INFO       0x84
+#define CMD_IAP2_WRITE      0x85
+#define CMD_IAP2_CRC        0x86
+
+#define IAP2_VERSION        2
+#define IAP2_PAGE           256     /* FLASH_ROM_WRITE page */
+#define IAP2_BLOCK          4096    /* FLASH_ROM_ERASE block */
+#define IAP2_WINDOW         IAP2_BLOCK
+#define IAP2_EP_SIZE        64
+
+#define IAP2_ERR_PARAM      0xfe
+#define IAP2_ERR_DATA       0xfd
+
+/* What the USB side provides, see iap.c.
+ * PortRearm: the next EP2 OUT packet goes to dma (NULL: the command buffer)
+ * and is let in now.
+ * PortReply: queues an EP2 IN packet. Also moves EP2 OUT back to the command
+ * buffer, without letting the next packet in. */
+extern void IAP2_PortRearm(uint8_t *dma);
+extern void IAP2_PortReply(const uint8_t *buf, uint8_t len);
+
+extern uint8_t IAP2_Busy(void);
+extern void IAP2_Command(const uint8_t *cmd, uint8_t len);
+extern void IAP2_Data(uint8_t len);
+extern uint32_t IAP2_Crc32(uint32_t crc, const uint8_t *p, uint32_t len);
+
+#endif /* _IAP2_H_ */
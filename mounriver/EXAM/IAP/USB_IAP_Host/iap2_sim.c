@@ -0,0 +1,549 @@
+/* Runs the v2 IAP engine (../USB_IAP/src/iap2.c, unmodified) and, for
+ * comparison, the v1 commands of iap.c against simulated flash and a full
+ * speed USB link, in virtual time, and reports the effective upload rate.
+ * See README.md.
+ */
+#include "iap.h"
+#include "iap2.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <getopt.h>
+
+static struct
+{
+    uint32_t size;      /* image bytes */
+    double page_us;     /* 256 byte page write */
+    double erase_us;    /* 4k block erase */
+    double host_us;     /* host turnaround, reply in to next request out */
+    double nak_us;      /* host controller retry interval on NAK */
+    double crc_ns;      /* per byte, device CRC32 over flash */
+    int fail_page;      /* make the nth page write fail once, 0 = never */
+    int short_window;   /* the nth v2 window has a short packet in the middle, 0 = never */
+    unsigned seed;
+} opt =
+{
+    .size = 120 * 1024,
+    .page_us = 1000,
+    .erase_us = 8000,
+    .host_us = 250,
+    .nak_us = 20,
+    .crc_ns = 200,
+};
+
+static double now;      /* device time, us */
+static int v2_run;
+
+/* ---- flash ---- */
+
+static uint8_t flash[FLASH_ROM_MAX_SIZE];
+static struct
+{
+    uint32_t erases;
+    uint32_t pages;
+    uint32_t overprogram;   /* a 0 written back to 1, the block wasn't erased */
+    uint32_t writes;
+    double busy;
+} fl;
+
+uint8_t FLASH_ROM_ERASE(uint32_t StartAddr, uint32_t Length)
+{
+    if ((StartAddr | Length) & 4095 || StartAddr + Length > FLASH_ROM_MAX_SIZE)
+        return 1;
+    memset(flash + StartAddr, 0xff, Length);
+    fl.erases += Length / 4096;
+    fl.busy += Length / 4096 * opt.erase_us;
+    now += Length / 4096 * opt.erase_us;
+    return 0;
+}
+
+uint8_t FLASH_ROM_WRITE(uint32_t StartAddr, void *Buffer, uint32_t Length)
+{
+    const uint8_t *b = Buffer;
+    uint32_t i, pages = (Length + 255) / 256;
+    uint8_t s = 0;
+
+    if ((StartAddr | Length) & 3 || StartAddr + Length > FLASH_ROM_MAX_SIZE)
+        return 1;
+    fl.pages += pages;
+    fl.busy += pages * opt.page_us;
+    now += pages * opt.page_us;
+    if (++fl.writes == (uint32_t)opt.fail_page && v2_run)
+        return 0x10;
+    for (i = 0; i < Length; i++)
+    {
+        if (b[i] & ~flash[StartAddr + i])
+        {
+            fl.overprogram++;
+            s = 2;
+        }
+        flash[StartAddr + i] &= b[i];
+    }
+    return s;
+}
+
+uint8_t FLASH_ROM_VERIFY(uint32_t StartAddr, void *Buffer, uint32_t Length)
+{
+    now += Length * 0.01;
+    return memcmp(flash + StartAddr, Buffer, Length) ? 1 : 0;
+}
+
+void FLASH_ROM_READ(uint32_t StartAddr, void *Buffer, uint32_t len)
+{
+    /* only the CRC reads, charge it for that */
+    now += len * opt.crc_ns / 1000;
+    memcpy(Buffer, flash + StartAddr, len);
+}
+
+/* ---- EP2 and the bus ---- */
+
+__attribute__((aligned(4))) static uint8_t ep2_buf[64];
+
+static struct
+{
+    int flag;           /* RB_UIF_TRANSFER pending, the SIE NAKs */
+    double open_at;     /* when it was last cleared */
+    double arrival;
+    uint8_t *dma;
+    int len;
+    int in_armed;
+    double in_at;
+    uint8_t in[64];
+    int in_len;
+} sie;
+
+static uint8_t *page_bufs;      /* where a WRITE first armed EP2, g_iap2_page */
+static uint32_t overruns;       /* packets that would have landed past them */
+
+typedef struct
+{
+    uint8_t d[64];
+    int len;
+} pkt_t;
+
+static pkt_t *q;
+static int qn, qhead, qmax;
+static double host_ready;
+static uint32_t round_trips, naks;
+
+/* Bus time of a bulk transaction: token, data, handshake, bit stuffing. */
+static double pkt_us(int len)
+{
+    return (len + 9) * 8 * 7.0 / 6 / 12;
+}
+
+static void host_send(const void *data, int len)
+{
+    const uint8_t *d = data;
+    do
+    {
+        int n = len < 64 ? len : 64;
+        if (qn == qmax)
+        {
+            qmax = qmax ? qmax * 2 : 256;
+            q = realloc(q, qmax * sizeof(*q));
+        }
+        memcpy(q[qn].d, d, n);
+        q[qn++].len = n;
+        d += n;
+        len -= n;
+    } while (len > 0);
+}
+
+void IAP2_PortRearm(uint8_t *dma)
+{
+    sie.dma = dma ? dma : ep2_buf;
+    sie.flag = 0;
+    sie.open_at = now;
+}
+
+void IAP2_PortReply(const uint8_t *buf, uint8_t len)
+{
+    sie.dma = ep2_buf;
+    memcpy(sie.in, buf, len);
+    sie.in_len = len;
+    sie.in_armed = 1;
+    sie.in_at = now;
+}
+
+/* ---- v1, as myDevEP2_OUT_Deal() does it ---- */
+
+__attribute__((aligned(4))) static uint8_t g_write_buf[256 + 64];
+static uint16_t g_buf_write_ptr;
+static uint32_t g_flash_write_ptr;
+
+static void v1_status(uint8_t s)
+{
+    uint8_t r[2] = { s, 0 };
+    IAP2_PortReply(r, 2);
+}
+
+static void v1_out_deal(iap_cmd_t *c)
+{
+    uint8_t s = 0;
+    uint32_t addr;
+
+    switch (c->other.buf[0])
+    {
+    case CMD_IAP_PROM:
+        if (c->program.len == 0)
+        {
+            if (g_buf_write_ptr != 0)
+            {
+                g_buf_write_ptr = (g_buf_write_ptr + 3) & ~3;
+                s = FLASH_ROM_WRITE(g_flash_write_ptr, g_write_buf, g_buf_write_ptr);
+                g_buf_write_ptr = 0;
+            }
+        }
+        else
+        {
+            memcpy(g_write_buf + g_buf_write_ptr, c->program.buf, c->program.len);
+            g_buf_write_ptr += c->program.len;
+            if (g_buf_write_ptr >= 256)
+            {
+                s = FLASH_ROM_WRITE(g_flash_write_ptr, g_write_buf, 256);
+                g_flash_write_ptr += 256;
+                g_buf_write_ptr -= 256;
+                memcpy(g_write_buf, g_write_buf + 256, g_buf_write_ptr);
+            }
+        }
+        break;
+    case CMD_IAP_ERASE:
+        s = FLASH_ROM_ERASE(APP_CODE_START_ADDR, APP_CODE_END_ADDR - APP_CODE_START_ADDR);
+        g_buf_write_ptr = 0;
+        g_flash_write_ptr = APP_CODE_START_ADDR;
+        break;
+    case CMD_IAP_VERIFY:
+        memcpy(&addr, c->verify.addr, 4);
+        s = FLASH_ROM_VERIFY(addr, c->verify.buf, c->verify.len);
+        break;
+    default:
+        s = 0xfe;
+        break;
+    }
+    v1_status(s);
+}
+
+/* One EP2 OUT packet, the way USB_DevTransProcess() hands it on. */
+static void device_out(void)
+{
+    __attribute__((aligned(4))) iap_cmd_t cmd;
+    int len = sie.len;
+
+    if (IAP2_Busy())
+    {
+        IAP2_Data(len);
+        return;
+    }
+    memcpy(cmd.other.buf, ep2_buf, len);
+    if (cmd.other.buf[0] >= CMD_IAP2_INFO && cmd.other.buf[0] <= CMD_IAP2_CRC)
+    {
+        IAP2_Command(cmd.other.buf, len);
+        if (IAP2_Busy())
+            page_bufs = sie.dma;
+    }
+    else
+        v1_out_deal(&cmd);
+    if (IAP2_Busy())
+        return;
+    IAP2_PortRearm(sie.dma);    /* R8_USB_INT_FG = RB_UIF_TRANSFER */
+}
+
+/* ---- hosts ---- */
+
+static uint8_t *image;
+static int (*host_reply)(const uint8_t *r, int len);
+static uint32_t h_addr, h_verify, retries, h_windows;
+static int failed;
+
+static void put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint32_t image_end(void)
+{
+    return APP_CODE_START_ADDR + opt.size;
+}
+
+static void v2_write(void)
+{
+    uint8_t c[12] = { CMD_IAP2_WRITE };
+    uint32_t n = image_end() - h_addr;
+    uint32_t room = IAP2_WINDOW - (h_addr & (IAP2_BLOCK - 1));
+
+    if (n > room)
+        n = room;
+    put32(c + 4, h_addr);
+    put32(c + 8, n);
+    host_send(c, sizeof(c));
+    if (++h_windows == (uint32_t)opt.short_window && n > IAP2_PAGE + 100)
+    {
+        /* 36 bytes in the second page: the device has to refuse the window */
+        host_send(image + h_addr - APP_CODE_START_ADDR, IAP2_PAGE + 100);
+        host_send(image + h_addr - APP_CODE_START_ADDR + IAP2_PAGE + 100, n - IAP2_PAGE - 100);
+        return;
+    }
+    host_send(image + h_addr - APP_CODE_START_ADDR, n);
+}
+
+static int v2_reply(const uint8_t *r, int len)
+{
+    uint8_t c[12] = { CMD_IAP2_CRC };
+
+    switch (r[0])
+    {
+    case CMD_IAP2_INFO:
+        if (len < 16 || r[1] || r[2] != IAP2_VERSION)
+            return failed = 1, 0;
+        h_addr = APP_CODE_START_ADDR;
+        v2_write();
+        return 1;
+    case CMD_IAP2_WRITE:
+        if (r[1])
+        {
+            /* From the start of the block, the window erases it again. */
+            if (++retries > 8)
+                return failed = 1, 0;
+            h_addr &= ~(IAP2_BLOCK - 1);
+        }
+        else
+        {
+            h_addr = get32(r + 4);
+        }
+        if (h_addr < image_end())
+        {
+            v2_write();
+            return 1;
+        }
+        put32(c + 4, APP_CODE_START_ADDR);
+        put32(c + 8, opt.size);
+        host_send(c, sizeof(c));
+        return 1;
+    case CMD_IAP2_CRC:
+        if (r[1] || get32(r + 4) != IAP2_Crc32(0, image, opt.size))
+            failed = 1;
+        return 0;
+    }
+    return failed = 1, 0;
+}
+
+static void v1_prom(void)
+{
+    uint8_t c[64] = { CMD_IAP_PROM };
+    uint32_t n = image_end() - h_addr;
+
+    if (n > IAP_LEN - 2)
+        n = IAP_LEN - 2;
+    c[1] = n;
+    memcpy(c + 2, image + h_addr - APP_CODE_START_ADDR, n);
+    host_send(c, 2 + n);
+    h_addr += n;
+}
+
+static void v1_verify(void)
+{
+    uint8_t c[64] = { CMD_IAP_VERIFY };
+    uint32_t n = image_end() - h_verify;
+
+    if (n > IAP_LEN - 6)
+        n = IAP_LEN - 6;
+    c[1] = n;
+    put32(c + 2, h_verify);
+    memcpy(c + 6, image + h_verify - APP_CODE_START_ADDR, n);
+    host_send(c, 6 + n);
+    h_verify += n;
+}
+
+static int v1_reply(const uint8_t *r, int len)
+{
+    uint8_t c[2] = { CMD_IAP_PROM, 0 };
+
+    (void)len;
+    if (r[0])
+        return failed = 1, 0;
+    if (h_addr < image_end())
+    {
+        v1_prom();
+    }
+    else if (h_verify == 0)
+    {
+        host_send(c, 2);    /* flush */
+        h_verify = APP_CODE_START_ADDR;
+    }
+    else if (h_verify < image_end())
+    {
+        v1_verify();
+    }
+    else
+    {
+        return 0;
+    }
+    return 1;
+}
+
+/* ---- run ---- */
+
+static double run(int v2)
+{
+    uint8_t c[8] = { 0 };
+    double end = 0;
+    uint32_t i;
+
+    v2_run = v2;
+    srand(opt.seed);
+    for (i = 0; i < sizeof(flash); i++)
+        flash[i] = rand();      /* the old application */
+    memset(&fl, 0, sizeof(fl));
+    memset(&sie, 0, sizeof(sie));
+    sie.dma = ep2_buf;
+    now = host_ready = 0;
+    qn = qhead = 0;
+    round_trips = naks = retries = h_windows = overruns = 0;
+    h_addr = APP_CODE_START_ADDR;
+    h_verify = 0;
+    failed = 0;
+
+    if (v2)
+    {
+        c[0] = CMD_IAP2_INFO;
+        host_reply = v2_reply;
+        host_send(c, 1);
+    }
+    else
+    {
+        c[0] = CMD_IAP_ERASE;
+        c[1] = 4;
+        put32(c + 2, APP_CODE_START_ADDR);
+        host_reply = v1_reply;
+        host_send(c, 6);
+    }
+
+    for (;;)
+    {
+        if (!sie.flag && qhead < qn)
+        {
+            double t = host_ready;
+            if (t < sie.open_at)
+            {
+                /* It was getting NAKs, in on the next retry. */
+                t = sie.open_at + opt.nak_us / 2;
+                naks++;
+            }
+            sie.arrival = t + pkt_us(q[qhead].len);
+            /* A packet may be a full 64 bytes, it has to fit the page buffers. */
+            if (IAP2_Busy() && (sie.dma < page_bufs || sie.dma + 64 > page_bufs + 2 * IAP2_PAGE))
+                overruns++;
+            else
+                memcpy(sie.dma, q[qhead].d, q[qhead].len);
+            sie.len = q[qhead].len;
+            sie.flag = 1;
+            qhead++;
+            host_ready = sie.arrival;
+        }
+        if (sie.flag)
+        {
+            /* Main_Circulation(): every pass in a v2 window, else every sixth, 20us each */
+            double p = IAP2_Busy() ? 20 : 120;
+            now = ceil((sie.arrival > now ? sie.arrival : now) / p) * p;
+            device_out();
+            continue;
+        }
+        if (sie.in_armed)
+        {
+            sie.in_armed = 0;
+            end = sie.in_at + pkt_us(sie.in_len);
+            host_ready = end + opt.host_us;
+            round_trips++;
+            if (!host_reply(sie.in, sie.in_len))
+                break;
+            continue;
+        }
+        failed = 1;     /* stuck */
+        break;
+    }
+
+    if (memcmp(flash + APP_CODE_START_ADDR, image, opt.size) || overruns)
+        failed = 1;
+    return end;
+}
+
+static void report(const char *name, double us)
+{
+    printf("%s: %.3f s, %.1f kB/s, %u round trips, flash busy %.0f%% (%u block erases, %u page writes), %u NAKed, %u retries%s%s\n",
+        name, us / 1e6, opt.size / 1024.0 / (us / 1e6), round_trips, 100 * fl.busy / us,
+        fl.erases, fl.pages, naks, retries, overruns ? ", EP2 past the page buffers" : "", failed ? ", FAILED" : "");
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "iap2_sim [options]\n"
+        "  -s bytes   image size (%u)\n"
+        "  -p us      256 byte page write (%.0f)\n"
+        "  -e us      4k block erase (%.0f)\n"
+        "  -h us      host turnaround from a reply to the next request (%.0f)\n"
+        "  -n us      host controller NAK retry interval (%.0f)\n"
+        "  -c ns      device CRC32 time per byte (%.0f)\n"
+        "  -x n       the nth page write fails once (0)\n"
+        "  -k n       the nth v2 window has a short packet in the middle (0)\n"
+        "  -r seed\n",
+        opt.size, opt.page_us, opt.erase_us, opt.host_us, opt.nak_us, opt.crc_ns);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int c, bad = 0;
+    uint32_t i;
+    double t;
+
+    while ((c = getopt(argc, argv, "s:p:e:h:n:c:x:k:r:")) != -1)
+    {
+        switch (c)
+        {
+        case 's': opt.size = atoi(optarg); break;
+        case 'p': opt.page_us = atof(optarg); break;
+        case 'e': opt.erase_us = atof(optarg); break;
+        case 'h': opt.host_us = atof(optarg); break;
+        case 'n': opt.nak_us = atof(optarg); break;
+        case 'c': opt.crc_ns = atof(optarg); break;
+        case 'x': opt.fail_page = atoi(optarg); break;
+        case 'k': opt.short_window = atoi(optarg); break;
+        case 'r': opt.seed = atoi(optarg); break;
+        default: usage();
+        }
+    }
+    if (opt.size == 0 || opt.size > APP_CODE_END_ADDR - APP_CODE_START_ADDR)
+        usage();
+
+    image = malloc(opt.size);
+    srand(opt.seed + 1);
+    for (i = 0; i < opt.size; i++)
+        image[i] = rand();
+
+    printf("%u byte image, page write %.0f us, block erase %.0f us, host turnaround %.0f us\n",
+        opt.size, opt.page_us, opt.erase_us, opt.host_us);
+    printf("flash bound: %.1f kB/s\n", opt.size / 1024.0 /
+        ((opt.size + 255) / 256 * opt.page_us * 1e-6 + (opt.size + 4095) / 4096 * opt.erase_us * 1e-6));
+
+    t = run(0);
+    report("v1", t);
+    bad |= failed;
+    t = run(1);
+    /* A fault that was asked for has to have been hit, and retried. */
+    if ((opt.fail_page || opt.short_window) && !retries)
+        failed = 1;
+    report("v2", t);
+    bad |= failed || fl.overprogram;
+    return bad ? 2 : 0;
+}
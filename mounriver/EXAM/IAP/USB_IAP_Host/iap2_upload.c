@@ -0,0 +1,250 @@
+/* Uploads an application to the USB IAP with the v2 protocol (iap2.h).
+ * Linux, through usbfs, needs write access to the device node (udev rule or
+ * root).
+ *
+ *   iap2_upload app.bin        program, check the CRC, start the application
+ *   iap2_upload -n app.bin     don't start it
+ */
+#include "iap2.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/usbdevice_fs.h>
+
+#define IAP_VID         0x1a86
+#define IAP_PID         0x55e0
+#define EP_OUT          0x02
+#define EP_IN           0x82
+#define CMD_IAP_END     0x83
+#define TIMEOUT_MS      3000
+
+static int usb_fd = -1;
+
+static int read_hex(const char *dir, const char *name)
+{
+    char path[512];
+    unsigned v = 0;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/sys/bus/usb/devices/%s/%s", dir, name);
+    f = fopen(path, "r");
+    if (!f)
+        return -1;
+    if (fscanf(f, "%x", &v) != 1)
+        v = -1;
+    fclose(f);
+    return v;
+}
+
+static int read_dec(const char *dir, const char *name)
+{
+    char path[512];
+    int v = -1;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/sys/bus/usb/devices/%s/%s", dir, name);
+    f = fopen(path, "r");
+    if (!f)
+        return -1;
+    if (fscanf(f, "%d", &v) != 1)
+        v = -1;
+    fclose(f);
+    return v;
+}
+
+static int usb_open(void)
+{
+    DIR *d = opendir("/sys/bus/usb/devices");
+    struct dirent *e;
+    char path[64];
+    unsigned iface = 0;
+
+    if (!d)
+        return -1;
+    while ((e = readdir(d)))
+    {
+        if (read_hex(e->d_name, "idVendor") != IAP_VID || read_hex(e->d_name, "idProduct") != IAP_PID)
+            continue;
+        snprintf(path, sizeof(path), "/dev/bus/usb/%03d/%03d",
+            read_dec(e->d_name, "busnum"), read_dec(e->d_name, "devnum"));
+        closedir(d);
+        usb_fd = open(path, O_RDWR);
+        if (usb_fd < 0)
+        {
+            fprintf(stderr, "%s: %s\n", path, strerror(errno));
+            return -1;
+        }
+        if (ioctl(usb_fd, USBDEVFS_CLAIMINTERFACE, &iface) < 0)
+        {
+            fprintf(stderr, "claim interface: %s\n", strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+    closedir(d);
+    fprintf(stderr, "no IAP device (%04x:%04x) found\n", IAP_VID, IAP_PID);
+    return -1;
+}
+
+static int bulk(int ep, void *data, int len)
+{
+    struct usbdevfs_bulktransfer b;
+
+    b.ep = ep;
+    b.len = len;
+    b.timeout = TIMEOUT_MS;
+    b.data = data;
+    return ioctl(usb_fd, USBDEVFS_BULK, &b);
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/* Sends a request (and data), waits for the reply. */
+static int request(uint8_t cmd, uint32_t addr, uint32_t len, const uint8_t *data, uint8_t *reply)
+{
+    uint8_t c[12] = { cmd };
+    int n;
+
+    put32(c + 4, addr);
+    put32(c + 8, len);
+    if (bulk(EP_OUT, c, cmd == CMD_IAP2_INFO ? 1 : sizeof(c)) < 0)
+        return -1;
+    if (data && bulk(EP_OUT, (void *)data, len) != (int)len)
+        return -1;
+    n = bulk(EP_IN, reply, IAP2_EP_SIZE);
+    if (n < 2 || reply[0] != cmd)
+        return -1;
+    return n;
+}
+
+/* Same as IAP2_Crc32() on the device. */
+static uint32_t crc32(uint32_t crc, const uint8_t *p, uint32_t len)
+{
+    int i;
+
+    crc = ~crc;
+    while (len--)
+    {
+        crc ^= *p++;
+        for (i = 0; i < 8; i++)
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+static double seconds(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv)
+{
+    uint8_t r[IAP2_EP_SIZE], end = CMD_IAP_END;
+    uint32_t start, limit, size, addr, n, window, crc;
+    int run = 1, retries = 0;
+    uint8_t *image;
+    double t0;
+    FILE *f;
+
+    if (argc > 1 && !strcmp(argv[1], "-n"))
+    {
+        run = 0;
+        argv++;
+        argc--;
+    }
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: iap2_upload [-n] app.bin\n");
+        return 1;
+    }
+
+    f = fopen(argv[1], "rb");
+    if (!f)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    rewind(f);
+    image = malloc(size + 4);
+    if (fread(image, 1, size, f) != size)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+    fclose(f);
+
+    if (usb_open() < 0)
+        return 1;
+
+    if (request(CMD_IAP2_INFO, 0, 0, NULL, r) < 16 || r[1] || r[2] < IAP2_VERSION)
+    {
+        fprintf(stderr, "the IAP doesn't do v2\n");
+        return 1;
+    }
+    window = r[6] | r[7] << 8;
+    start = get32(r + 8);
+    limit = get32(r + 12);
+    if (size == 0 || size > limit - start)
+    {
+        fprintf(stderr, "%u bytes don't fit in %08x..%08x\n", size, start, limit);
+        return 1;
+    }
+
+    t0 = seconds();
+    for (addr = start; addr < start + size;)
+    {
+        n = start + size - addr;
+        if (n > window - (addr & (IAP2_BLOCK - 1)))
+            n = window - (addr & (IAP2_BLOCK - 1));
+        if (request(CMD_IAP2_WRITE, addr, n, image + addr - start, r) < 8)
+        {
+            fprintf(stderr, "\nno reply writing %08x\n", addr);
+            return 1;
+        }
+        if (r[1])
+        {
+            fprintf(stderr, "\nwriting %08x failed (%02x), again from the block\n", addr, r[1]);
+            if (++retries > 8)
+                return 1;
+            addr &= ~(IAP2_BLOCK - 1);
+            continue;
+        }
+        addr = get32(r + 4);
+        fprintf(stderr, "\r%u / %u", addr - start, size);
+    }
+
+    crc = crc32(0, image, size);
+    if (request(CMD_IAP2_CRC, start, size, NULL, r) < 8 || r[1] || get32(r + 4) != crc)
+    {
+        fprintf(stderr, "\nCRC mismatch, flash %08x, image %08x\n", get32(r + 4), crc);
+        return 1;
+    }
+    fprintf(stderr, "\r%u bytes in %.2f s, %.1f kB/s, CRC %08x ok\n",
+        size, seconds() - t0, size / 1024.0 / (seconds() - t0), crc);
+
+    if (run)
+        bulk(EP_OUT, &end, 1);
+    return 0;
+}
@@ -0,0 +1,20 @@
+/* Stands in for the CH57x headers when iap2.c is built on the host by
+ * iap2_sim.c, the flash routines are the simulated ones there. */
+#ifndef __CH57x_COMMON_H__
+#define __CH57x_COMMON_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+typedef uint32_t *PUINT32;
+typedef uint8_t *PUINT8;
+
+#define FLASH_ROM_MAX_SIZE  0x03C000
+
+extern uint8_t FLASH_ROM_ERASE(uint32_t StartAddr, uint32_t Length);
+extern uint8_t FLASH_ROM_WRITE(uint32_t StartAddr, void *Buffer, uint32_t Length);
+extern uint8_t FLASH_ROM_VERIFY(uint32_t StartAddr, void *Buffer, uint32_t Length);
+extern void FLASH_ROM_READ(uint32_t StartAddr, void *Buffer, uint32_t len);
+
+#endif
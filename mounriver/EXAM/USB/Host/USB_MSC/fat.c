@@ -0,0 +1,1496 @@
+/********************************** (C) COPYRIGHT *******************************
+ * File Name          : fat.c
+ * Description        : FAT12/FAT16/FAT32 file system with a write-back
+ *                      sector cache, see fat.h
+ *********************************************************************************
+ * Plain C on top of MSC_Read()/MSC_Write(), nothing here touches the USB
+ * host, so U_DISK_Host builds this file unmodified against disk images.
+ *******************************************************************************/
+
+#include <string.h>
+#include "msc.h"
+#include "fat.h"
+
+#define FAT_SECTOR           MSC_SECTOR_SIZE
+#define FAT_NO_SECTOR        0xFFFFFFFF
+#define FAT_FREE_UNKNOWN     0xFFFFFFFF
+#define FAT_CHAIN_END        0xFF          // internal, fat_locate() ran off the chain
+
+/* fat_cache() modes */
+#define CACHE_FILL           0x01          // read the sector in, else start from zeros
+#define CACHE_DATA           0x02          // file data, only pushes out other file data
+
+#define DIR_ATTR             11
+#define DIR_NTRES            12
+#define DIR_CRT_TIME         14
+#define DIR_CRT_DATE         16
+#define DIR_ACC_DATE         18
+#define DIR_CLUST_HI         20
+#define DIR_WRT_TIME         22
+#define DIR_WRT_DATE         24
+#define DIR_CLUST_LO         26
+#define DIR_SIZE             28
+#define DIR_ENTRY            32
+
+uint8_t FAT_Type;
+
+static struct
+{
+    uint32_t fat_lba;      // first FAT
+    uint32_t fat_size;     // sectors per FAT
+    uint32_t root_lba;     // FAT12/FAT16 root directory
+    uint32_t data_lba;     // cluster 2
+    uint32_t root_clust;   // FAT32 root directory, 0 otherwise
+    uint32_t nclust;       // clusters 2 .. nclust + 1 exist
+    uint32_t eoc;          // chain end, this value and above
+    uint32_t free_hint;    // where the next allocation starts looking
+    uint32_t free_count;
+    uint32_t fsinfo_lba;   // 0 without FSInfo
+    uint16_t root_secs;
+    uint8_t  spc_shift;    // sectors per cluster, log2
+    uint8_t  nfats;
+    uint8_t  fsinfo_dirty;
+} fs;
+
+static uint8_t  cache_buf[FAT_CACHE_SECTORS][FAT_SECTOR] __attribute__((aligned(4)));
+static uint32_t cache_lba[FAT_CACHE_SECTORS];
+static uint32_t cache_used[FAT_CACHE_SECTORS];
+static uint8_t  cache_dirty[FAT_CACHE_SECTORS];
+static uint8_t  cache_data[FAT_CACHE_SECTORS];
+static uint32_t cache_clock;
+
+static uint16_t ld16(const uint8_t *p)
+{
+    return (p[0] | (uint16_t)p[1] << 8);
+}
+
+static uint32_t ld32(const uint8_t *p)
+{
+    return (p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+}
+
+static void st16(uint8_t *p, uint16_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static void st32(uint8_t *p, uint32_t v)
+{
+    st16(p, (uint16_t)v);
+    st16(p + 2, (uint16_t)(v >> 16));
+}
+
+/*********************************************************************
+ * @fn      fat_flush
+ *
+ * @brief   Writes a dirty cache slot back, a FAT sector to every FAT
+ *
+ * @return  FAT_OK or the MSC status
+ */
+static uint8_t fat_flush(uint8_t i)
+{
+    uint8_t  s, k;
+    uint32_t lba = cache_lba[i];
+
+    if(!cache_dirty[i])
+    {
+        return (FAT_OK);
+    }
+    s = MSC_Write(lba, 1, cache_buf[i]);
+    if(lba >= fs.fat_lba && lba < fs.fat_lba + fs.fat_size)
+    {
+        for(k = 1; s == FAT_OK && k < fs.nfats; k++)
+        {
+            s = MSC_Write(lba + k * fs.fat_size, 1, cache_buf[i]);
+        }
+    }
+    if(s == FAT_OK)
+    {
+        cache_dirty[i] = 0;
+    }
+    return (s);
+}
+
+/*********************************************************************
+ * @fn      fat_cache
+ *
+ * @brief   Sector lba in the cache. On a miss the least recently used
+ *          slot is written back and reused; file data reuses the least
+ *          recently used slot holding file data if there is one, so a
+ *          file read or written in small pieces keeps to one slot and
+ *          leaves the FAT and directory sectors alone.
+ *
+ * @param   mode    - CACHE_FILL unless the caller overwrites all of it,
+ *                    CACHE_DATA for file data
+ * @param   p       - the cached sector
+ *
+ * @return  FAT_OK or the MSC status
+ */
+static uint8_t fat_cache(uint32_t lba, uint8_t mode, uint8_t **p)
+{
+    uint8_t i, v = 0, d = 0xFF, s;
+
+    for(i = 0; i != FAT_CACHE_SECTORS; i++)
+    {
+        if(cache_lba[i] == lba)
+        {
+            cache_used[i] = ++cache_clock;
+            cache_data[i] = mode & CACHE_DATA;
+            *p = cache_buf[i];
+            return (FAT_OK);
+        }
+        if(cache_used[i] < cache_used[v])
+        {
+            v = i;
+        }
+        if(cache_data[i] && (d == 0xFF || cache_used[i] < cache_used[d]))
+        {
+            d = i;
+        }
+    }
+    if((mode & CACHE_DATA) && d != 0xFF && cache_used[v] != 0)
+    {
+        v = d;
+    }
+    s = fat_flush(v);
+    if(s != FAT_OK)
+    {
+        return (s);
+    }
+    cache_lba[v] = FAT_NO_SECTOR;
+    cache_used[v] = 0;
+    cache_data[v] = 0;
+    if(mode & CACHE_FILL)
+    {
+        s = MSC_Read(lba, 1, cache_buf[v]);
+        if(s != FAT_OK)
+        {
+            return (s);
+        }
+    }
+    else
+    {
+        memset(cache_buf[v], 0, FAT_SECTOR);
+    }
+    cache_lba[v] = lba;
+    cache_used[v] = ++cache_clock;
+    cache_data[v] = mode & CACHE_DATA;
+    *p = cache_buf[v];
+    return (FAT_OK);
+}
+
+/*********************************************************************
+ * @fn      fat_mark
+ *
+ * @brief   The cached sector p points into was changed
+ *
+ * @return  none
+ */
+static void fat_mark(const uint8_t *p)
+{
+    cache_dirty[(p - cache_buf[0]) / FAT_SECTOR] = 1;
+}
+
+/*********************************************************************
+ * @fn      fat_cache_range
+ *
+ * @brief   Before file data moves around the cache: cached sectors in
+ *          lba .. lba + n - 1 are written back (drop = 0, they are about
+ *          to be read) or forgotten (drop = 1, they are about to be
+ *          overwritten)
+ *
+ * @return  FAT_OK or the MSC status
+ */
+static uint8_t fat_cache_range(uint32_t lba, uint32_t n, uint8_t drop)
+{
+    uint8_t i, s;
+
+    for(i = 0; i != FAT_CACHE_SECTORS; i++)
+    {
+        if(cache_lba[i] == FAT_NO_SECTOR || cache_lba[i] - lba >= n)
+        {
+            continue;
+        }
+        if(drop)
+        {
+            cache_dirty[i] = 0;
+            cache_lba[i] = FAT_NO_SECTOR;
+            cache_used[i] = 0;
+        }
+        else
+        {
+            s = fat_flush(i);
+            if(s != FAT_OK)
+            {
+                return (s);
+            }
+        }
+    }
+    return (FAT_OK);
+}
+
+static uint32_t clust_lba(uint32_t c)
+{
+    return (fs.data_lba + ((c - 2) << fs.spc_shift));
+}
+
+/*********************************************************************
+ * @fn      fat_get
+ *
+ * @brief   FAT entry of cluster c
+ *
+ * @return  FAT_OK, FAT_ERR_FAT for a cluster that doesn't exist, or the
+ *          MSC status
+ */
+static uint8_t fat_get(uint32_t c, uint32_t *v)
+{
+    uint8_t *p, s;
+    uint32_t off;
+
+    if(c < 2 || c > fs.nclust + 1)
+    {
+        return (FAT_ERR_FAT);
+    }
+    if(FAT_Type == 12)
+    {
+        off = c + (c >> 1);
+        s = fat_cache(fs.fat_lba + off / FAT_SECTOR, CACHE_FILL, &p);
+        if(s != FAT_OK)
+        {
+            return (s);
+        }
+        *v = p[off % FAT_SECTOR];
+        off++;
+        s = fat_cache(fs.fat_lba + off / FAT_SECTOR, CACHE_FILL, &p); // may be the next sector
+        if(s != FAT_OK)
+        {
+            return (s);
+        }
+        *v |= (uint32_t)p[off % FAT_SECTOR] << 8;
+        *v = (c & 1) ? *v >> 4 : *v & 0xFFF;
+    }
+    else if(FAT_Type == 16)
+    {
+        off = c * 2;
+        s = fat_cache(fs.fat_lba + off / FAT_SECTOR, CACHE_FILL, &p);
+        if(s != FAT_OK)
+        {
+            return (s);
+        }
+        *v = ld16(p + off % FAT_SECTOR);
+    }
+    else
+    {
+        off = c * 4;
+        s = fat_cache(fs.fat_lba + off / FAT_SECTOR, CACHE_FILL, &p);
+        if(s != FAT_OK)
+        {
+            return (s);
+        }
+        *v = ld32(p + off % FAT_SECTOR) & 0x0FFFFFFF;
+    }
+    return (FAT_OK);
+}
+
+/*********************************************************************
+ * @fn      fat_set
+ *
+ * @brief   Sets the FAT entry of cluster c, in the cache
+ *
+ * @return  FAT_OK or the MSC status
+ */
+static uint8_t fat_set(uint32_t c, uint32_t v)
+{
+    uint8_t *p, s;
+    uint32_t off;
+
+    if(c < 2 || c > fs.nclust + 1)
+    {
+        return (FAT_ERR_FAT);
+    }
+    if(FAT_Type == 12)
+    {
+        off = c + (c >> 1);
+        s = fat_cache(fs.fat_lba + off / FAT_SECTOR, CACHE_FILL, &p);
+        if(s != FAT_OK)
+        {
+            return (s);
+        }
+        p += off % FAT_SECTOR;
+        *p = (c & 1) ? (*p & 0x0F) | (uint8_t)(v << 4) : (uint8_t)v;
+        fat_mark(p);
+        off++;
+        s = fat_cache(fs.fat_lba + off / FAT_SECTOR, CACHE_FILL, &p);
+        if(s != FAT_OK)
+        {
+            return (s);
+        }
+        p += off % FAT_SECTOR;
+        *p = (c & 1) ? (uint8_t)(v >> 4) : (*p & 0xF0) | ((v >> 8) & 0x0F);
+        fat_mark(p);
+    }
+    else if(FAT_Type == 16)
+    {
+        off = c * 2;
+        s = fat_cache(fs.fat_lba + off / FAT_SECTOR, CACHE_FILL, &p);
+        if(s != FAT_OK)
+        {
+            return (s);
+        }
+        st16(p + off % FAT_SECTOR, (uint16_t)v);
+        fat_mark(p);
+    }
+    else
+    {
+        off = c * 4;
+        s = fat_cache(fs.fat_lba + off / FAT_SECTOR, CACHE_FILL, &p);
+        if(s != FAT_OK)
+        {
+            return (s);
+        }
+        p += off % FAT_SECTOR;
+        st32(p, (ld32(p) & 0xF0000000) | v);
+        fat_mark(p);
+    }
+    return (FAT_OK);
+}
+
+/*********************************************************************
+ * @fn      fat_alloc
+ *
+ * @brief   Allocates up to want consecutive clusters and links them after
+ *          prev (0 starts a new chain). The search starts right after prev
+ *          so a growing file stays in one piece.
+ *
+ * @param   first   - the first new cluster
+ * @param   got     - how many, at least 1
+ *
+ * @return  FAT_OK, FAT_ERR_FULL or the MSC status
+ */
+static uint8_t fat_alloc(uint32_t prev, uint32_t want, uint32_t *first, uint32_t *got)
+{
+    uint8_t  s;
+    uint32_t c, v, n, i;
+
+    c = prev ? prev + 1 : fs.free_hint;
+    for(n = 0;; n++, c++)
+    {
+        if(n == fs.nclust)
+        {
+            return (FAT_ERR_FULL);
+        }
+        if(c < 2 || c > fs.nclust + 1)
+        {
+            c = 2;
+        }
+        s = fat_get(c, &v);
+        if(s != FAT_OK)
+        {
+            return (s);
+        }
+        if(v == 0)
+        {
+            break;
+        }
+    }
+    for(n = 1; n < want && c + n <= fs.nclust + 1; n++)
+    {
+        s = fat_get(c + n, &v);
+        if(s != FAT_OK)
+        {
+            return (s);
+        }
+        if(v != 0)
+        {
+            break;
+        }
+    }
+    for(i = 0; i != n; i++)
+    {
+        s = fat_set(c + i, i + 1 < n ? c + i + 1 : fs.eoc | 7);
+        if(s != FAT_OK)
+        {
+            return (s);
+        }
+    }
+    if(prev)
+    {
+        s = fat_set(prev, c);
+        if(s != FAT_OK)
+        {
+            return (s);
+        }
+    }
+    fs.free_hint = c + n;
+    if(fs.free_count != FAT_FREE_UNKNOWN)
+    {
+        fs.free_count -= n;
+    }
+    fs.fsinfo_dirty = 1;
+    *first = c;
+    *got = n;
+    return (FAT_OK);
+}
+
+/*********************************************************************
+ * @fn      fat_free_chain
+ *
+ * @brief   Frees the chain starting at cluster c
+ *
+ * @return  FAT_OK or the MSC status
+ */
+static uint8_t fat_free_chain(uint32_t c)
+{
+    uint8_t  s;
+    uint32_t v;
+
+    while(c >= 2 && c <= fs.nclust + 1)
+    {
+        s = fat_get(c, &v);
+        if(s == FAT_OK)
+        {
+            s = fat_set(c, 0);
+        }
+        if(s != FAT_OK)
+        {
+            return (s);
+        }
+        if(c < fs.free_hint)
+        {
+            fs.free_hint = c;
+        }
+        if(fs.free_count != FAT_FREE_UNKNOWN)
+        {
+            fs.free_count++;
+        }
+        fs.fsinfo_dirty = 1;
+        c = v;
+    }
+    return (FAT_OK);
+}
+
+/*********************************************************************
+ * @fn      fat_locate
+ *
+ * @brief   Moves f->clust to the cluster with index idx in the chain,
+ *          forward from where it is if it can
+ *
+ * @return  FAT_OK, FAT_CHAIN_END with f->clust on the last cluster, or
+ *          an error
+ */
+static uint8_t fat_locate(FAT_File_t *f, uint32_t idx)
+{
+    uint8_t  s;
+    uint32_t v;
+
+    if(f->start == 0)
+    {
+        return (FAT_CHAIN_END);
+    }
+    if(idx < f->clust_idx || f->clust == 0)
+    {
+        f->clust = f->start;
+        f->clust_idx = 0;
+    }
+    while(f->clust_idx < idx)
+    {
+        s = fat_get(f->clust, &v);
+        if(s != FAT_OK)
+        {
+            return (s);
+        }
+        if(v >= fs.eoc)
+        {
+            return (FAT_CHAIN_END);
+        }
+        f->clust = v;
+        f->clust_idx++;
+    }
+    return (FAT_OK);
+}
+
+/*********************************************************************
+ * @fn      fat_run
+ *
+ * @brief   Prefetches the chain: how many sectors from sector sec of
+ *          f->clust on lie one after the other on the disk, up to max.
+ *          f->clust is left on the cluster of the last one.
+ *
+ * @return  FAT_OK or an error
+ */
+static uint8_t fat_run(FAT_File_t *f, uint32_t sec, uint32_t max, uint32_t *n)
+{
+    uint8_t  s;
+    uint32_t v, cnt = (1UL << fs.spc_shift) - sec;
+
+    while(cnt < max)
+    {
+        s = fat_get(f->clust, &v);
+        if(s != FAT_OK)
+        {
+            return (s);
+        }
+        if(v != f->clust + 1)
+        {
+            break;
+        }
+        f->clust = v;
+        f->clust_idx++;
+        cnt += 1UL << fs.spc_shift;
+    }
+    *n = cnt < max ? cnt : max;
+    return (FAT_OK);
+}
+
+/*********************************************************************
+ * @fn      fat_is_bpb
+ *
+ * @brief   Whether sector 0 of a disk is a boot sector rather than an MBR
+ *
+ * @return  1 if it is
+ */
+static uint8_t fat_is_bpb(const uint8_t *p)
+{
+    uint16_t bps = ld16(p + 11);
+
+    return ((p[0] == 0xEB || p[0] == 0xE9) && p[13] != 0 && (bps & (bps - 1)) == 0 && bps >= 512 && bps <= 4096);
+}
+
+/*********************************************************************
+ * @fn      FAT_Mount
+ *
+ * @brief   Finds the FAT volume, partition 1 of an MBR or a volume that
+ *          starts at LBA 0, and forgets anything cached
+ *
+ * @return  FAT_OK, FAT_ERR_MBR, FAT_ERR_BPB or the MSC status
+ */
+uint8_t FAT_Mount(void)
+{
+    uint8_t *p, s, i, t;
+    uint32_t base = 0, tot, fatsz, rsvd, max;
+    uint16_t rootent;
+
+    FAT_Type = 0;
+    memset(&fs, 0, sizeof(fs));
+    for(i = 0; i != FAT_CACHE_SECTORS; i++)
+    {
+        cache_lba[i] = FAT_NO_SECTOR;
+        cache_used[i] = 0;
+        cache_dirty[i] = 0;
+        cache_data[i] = 0;
+    }
+
+    s = fat_cache(0, CACHE_FILL, &p);
+    if(s != FAT_OK)
+    {
+        return (s);
+    }
+    if(ld16(p + 510) != 0xAA55)
+    {
+        return (FAT_ERR_MBR);
+    }
+    if(!fat_is_bpb(p))
+    {
+        for(i = 0; i != 4; i++)
+        {
+            t = p[446 + i * 16 + 4];
+            if(t == 0x01 || t == 0x04 || t == 0x06 || t == 0x0B || t == 0x0C || t == 0x0E)
+            {
+                base = ld32(p + 446 + i * 16 + 8);
+                break;
+            }
+        }
+        if(i == 4)
+        {
+            return (FAT_ERR_MBR);
+        }
+        s = fat_cache(base, CACHE_FILL, &p);
+        if(s != FAT_OK)
+        {
+            return (s);
+        }
+        if(ld16(p + 510) != 0xAA55 || !fat_is_bpb(p))
+        {
+            return (FAT_ERR_BPB);
+        }
+    }
+
+    rsvd = ld16(p + 14);
+    rootent = ld16(p + 17);
+    tot = ld16(p + 19) ? ld16(p + 19) : ld32(p + 32);
+    fatsz = ld16(p + 22) ? ld16(p + 22) : ld32(p + 36);
+    if(ld16(p + 11) != FAT_SECTOR || (p[13] & (p[13] - 1)) || rsvd == 0 || p[16] == 0 || fatsz == 0)
+    {
+        return (FAT_ERR_BPB);
+    }
+    while((1 << fs.spc_shift) != p[13])
+    {
+        fs.spc_shift++;
+    }
+    fs.nfats = p[16];
+    fs.fat_lba = base + rsvd;
+    fs.fat_size = fatsz;
+    fs.root_secs = (rootent * DIR_ENTRY + FAT_SECTOR - 1) / FAT_SECTOR;
+    fs.root_lba = fs.fat_lba + fs.nfats * fatsz;
+    fs.data_lba = fs.root_lba + fs.root_secs;
+    if(tot <= fs.data_lba - base)
+    {
+        return (FAT_ERR_BPB);
+    }
+    fs.nclust = (tot - (fs.data_lba - base)) >> fs.spc_shift;
+
+    /* the type follows from the cluster count alone */
+    if(fs.nclust < 4085)
+    {
+        t = 12;
+        fs.eoc = 0xFF8;
+        max = fatsz * FAT_SECTOR * 2 / 3;
+    }
+    else if(fs.nclust < 65525)
+    {
+        t = 16;
+        fs.eoc = 0xFFF8;
+        max = fatsz * FAT_SECTOR / 2;
+    }
+    else
+    {
+        if(rootent != 0)
+        {
+            return (FAT_ERR_BPB);
+        }
+        t = 32;
+        fs.eoc = 0x0FFFFFF8;
+        max = fatsz * (FAT_SECTOR / 4);
+        fs.root_clust = ld32(p + 44);
+        if(ld16(p + 48) != 0 && ld16(p + 48) < rsvd)
+        {
+            fs.fsinfo_lba = base + ld16(p + 48);
+        }
+    }
+    if(fs.nclust > max - 2)
+    {
+        fs.nclust = max - 2; // the FAT can't describe more
+    }
+
+    FAT_Type = t;
+    fs.free_hint = 2;
+    fs.free_count = FAT_FREE_UNKNOWN;
+    if(fs.fsinfo_lba)
+    {
+        s = fat_cache(fs.fsinfo_lba, CACHE_FILL, &p);
+        if(s != FAT_OK)
+        {
+            FAT_Type = 0;
+            return (s);
+        }
+        if(ld32(p) == 0x41615252 && ld32(p + 484) == 0x61417272)
+        {
+            if(ld32(p + 488) <= fs.nclust)
+            {
+                fs.free_count = ld32(p + 488);
+            }
+            if(ld32(p + 492) >= 2 && ld32(p + 492) <= fs.nclust + 1)
+            {
+                fs.free_hint = ld32(p + 492);
+            }
+        }
+        else
+        {
+            fs.fsinfo_lba = 0;
+        }
+    }
+    return (FAT_OK);
+}
+
+/*********************************************************************
+ * @fn      FAT_Sync
+ *
+ * @brief   Writes back every dirty cache slot and FSInfo
+ *
+ * @return  FAT_OK or the MSC status
+ */
+uint8_t FAT_Sync(void)
+{
+    uint8_t *p, s, i;
+
+    if(fs.fsinfo_lba && fs.fsinfo_dirty)
+    {
+        s = fat_cache(fs.fsinfo_lba, CACHE_FILL, &p);
+        if(s != FAT_OK)
+        {
+            return (s);
+        }
+        st32(p + 488, fs.free_count);
+        st32(p + 492, fs.free_hint);
+        fat_mark(p);
+        fs.fsinfo_dirty = 0;
+    }
+    for(i = 0; i != FAT_CACHE_SECTORS; i++)
+    {
+        s = fat_flush(i);
+        if(s != FAT_OK)
+        {
+            return (s);
+        }
+    }
+    return (FAT_OK);
+}
+
+/*********************************************************************
+ * @fn      dir_start
+ *
+ * @brief   Points d at the first entry of the directory at cluster clust
+ *          (0 for the FAT12/FAT16 root directory)
+ *
+ * @return  none
+ */
+static void dir_start(FAT_Dir_t *d, uint32_t clust)
+{
+    d->clust = clust;
+    d->lba = clust ? clust_lba(clust) : fs.root_lba;
+    d->sec = 0;
+    d->off = 0;
+}
+
+/*********************************************************************
+ * @fn      dir_next
+ *
+ * @brief   Moves d to the next entry
+ *
+ * @param   extend  - add a zeroed cluster at the end of the directory
+ *                    instead of stopping
+ *
+ * @return  FAT_OK, FAT_ERR_MISS_FILE at the end, FAT_ERR_FDT_OVER if a
+ *          fixed root directory is full, or an error
+ */
+static uint8_t dir_next(FAT_Dir_t *d, uint8_t extend)
+{
+    uint8_t *p, s;
+    uint32_t v, n, i;
+
+    d->off += DIR_ENTRY;
+    if(d->off < FAT_SECTOR)
+    {
+        return (FAT_OK);
+    }
+    d->off = 0;
+    d->sec++;
+    if(d->clust == 0)
+    {
+        if(d->sec == fs.root_secs)
+        {
+            return (extend ? FAT_ERR_FDT_OVER : FAT_ERR_MISS_FILE);
+        }
+        d->lba++;
+        return (FAT_OK);
+    }
+    if(d->sec < (1U << fs.spc_shift))
+    {
+        d->lba++;
+        return (FAT_OK);
+    }
+    s = fat_get(d->clust, &v);
+    if(s != FAT_OK)
+    {
+        return (s);
+    }
+    if(v >= fs.eoc)
+    {
+        if(!extend)
+        {
+            return (FAT_ERR_MISS_FILE);
+        }
+        s = fat_alloc(d->clust, 1, &v, &n);
+        if(s != FAT_OK)
+        {
+            return (s);
+        }
+        for(i = 0; i != (1U << fs.spc_shift); i++)
+        {
+            s = fat_cache(clust_lba(v) + i, 0, &p);
+            if(s != FAT_OK)
+            {
+                return (s);
+            }
+            fat_mark(p);
+        }
+    }
+    d->clust = v;
+    d->sec = 0;
+    d->lba = clust_lba(v);
+    return (FAT_OK);
+}
+
+/*********************************************************************
+ * @fn      dir_entry
+ *
+ * @brief   The entry d points at, in the cache. Only valid until the next
+ *          cache access.
+ *
+ * @return  FAT_OK or the MSC status
+ */
+static uint8_t dir_entry(const FAT_Dir_t *d, uint8_t **e)
+{
+    uint8_t s = fat_cache(d->lba, CACHE_FILL, e);
+
+    *e += d->off;
+    return (s);
+}
+
+static uint32_t dir_clust(const uint8_t *e)
+{
+    return ((uint32_t)ld16(e + DIR_CLUST_HI) << 16 | ld16(e + DIR_CLUST_LO));
+}
+
+/*********************************************************************
+ * @fn      dir_find
+ *
+ * @brief   Looks up an 8.3 name in the directory at cluster clust
+ *
+ * @param   d       - left on the entry
+ * @param   lfn     - if not NULL, left on the first long name entry
+ *                    belonging to it, or on the entry itself
+ *
+ * @return  FAT_OK, FAT_ERR_MISS_FILE or an error
+ */
+static uint8_t dir_find(uint32_t clust, const uint8_t *name, FAT_Dir_t *d, FAT_Dir_t *lfn)
+{
+    uint8_t *e, s, in_lfn = 0;
+
+    dir_start(d, clust);
+    for(;;)
+    {
+        s = dir_entry(d, &e);
+        if(s != FAT_OK)
+        {
+            return (s);
+        }
+        if(e[0] == 0x00)
+        {
+            return (FAT_ERR_MISS_FILE);
+        }
+        if(e[0] != 0xE5 && e[DIR_ATTR] == 0x0F)
+        {
+            if(!in_lfn && lfn)
+            {
+                *lfn = *d;
+            }
+            in_lfn = 1;
+        }
+        else
+        {
+            if(e[0] != 0xE5 && !(e[DIR_ATTR] & FAT_ATTR_VOLUME_ID) && memcmp(e, name, 11) == 0)
+            {
+                if(!in_lfn && lfn)
+                {
+                    *lfn = *d;
+                }
+                return (FAT_OK);
+            }
+            in_lfn = 0;
+        }
+        s = dir_next(d, 0);
+        if(s != FAT_OK)
+        {
+            return (s);
+        }
+    }
+}
+
+/*********************************************************************
+ * @fn      dir_add
+ *
+ * @brief   Finds a free entry in the directory at cluster clust, growing
+ *          the directory if there is none
+ *
+ * @return  FAT_OK, FAT_ERR_FDT_OVER, FAT_ERR_FULL or an error
+ */
+static uint8_t dir_add(uint32_t clust, FAT_Dir_t *d)
+{
+    uint8_t *e, s;
+
+    dir_start(d, clust);
+    for(;;)
+    {
+        s = dir_entry(d, &e);
+        if(s != FAT_OK)
+        {
+            return (s);
+        }
+        if(e[0] == 0x00 || e[0] == 0xE5)
+        {
+            return (FAT_OK);
+        }
+        s = dir_next(d, 1);
+        if(s != FAT_OK)
+        {
+            return (s);
+        }
+    }
+}
+
+/*********************************************************************
+ * @fn      fat_name
+ *
+ * @brief   The next path component as an 11 byte directory name, path is
+ *          moved past it and the '/' after it
+ *
+ * @return  FAT_OK or FAT_ERR_NAME
+ */
+static uint8_t fat_name(const char **path, uint8_t *name)
+{
+    uint8_t i = 0, max = 8, c;
+
+    memset(name, ' ', 11);
+    while(**path && **path != '/')
+    {
+        c = (uint8_t)**path;
+        (*path)++;
+        if(c == '.')
+        {
+            if(i == 0 || max == 11)
+            {
+                return (FAT_ERR_NAME);
+            }
+            i = 8;
+            max = 11;
+            continue;
+        }
+        if(i == max || c <= ' ' || strchr("\"*+,:;<=>?[\\]|", c))
+        {
+            return (FAT_ERR_NAME);
+        }
+        name[i++] = (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c;
+    }
+    if(name[0] == ' ')
+    {
+        return (FAT_ERR_NAME);
+    }
+    if(name[0] == 0xE5)
+    {
+        name[0] = 0x05;
+    }
+    while(**path == '/')
+    {
+        (*path)++;
+    }
+    return (FAT_OK);
+}
+
+/*********************************************************************
+ * @fn      fat_path
+ *
+ * @brief   Walks the directories of path
+ *
+ * @param   name    - the last component
+ * @param   dir     - cluster of the directory it is in
+ *
+ * @return  FAT_OK, FAT_ERR_MISS_DIR, FAT_ERR_NAME or an error
+ */
+static uint8_t fat_path(const char *path, uint8_t *name, uint32_t *dir)
+{
+    uint8_t  *e, s;
+    FAT_Dir_t d;
+
+    if(!FAT_Type)
+    {
+        return (FAT_ERR_BPB);
+    }
+    *dir = fs.root_clust;
+    while(*path == '/')
+    {
+        path++;
+    }
+    for(;;)
+    {
+        s = fat_name(&path, name);
+        if(s != FAT_OK || *path == 0)
+        {
+            return (s);
+        }
+        s = dir_find(*dir, name, &d, NULL);
+        if(s == FAT_OK)
+        {
+            s = dir_entry(&d, &e);
+        }
+        if(s != FAT_OK)
+        {
+            return (s == FAT_ERR_MISS_FILE ? FAT_ERR_MISS_DIR : s);
+        }
+        if(!(e[DIR_ATTR] & FAT_ATTR_DIRECTORY))
+        {
+            return (FAT_ERR_MISS_DIR);
+        }
+        *dir = dir_clust(e);
+        if(*dir == 0)
+        {
+            *dir = fs.root_clust; // ".." of a first level directory
+        }
+    }
+}
+
+/*********************************************************************
+ * @fn      FAT_Open
+ *
+ * @brief   Opens a file, FAT_CREATE creates it or truncates it
+ *
+ * @return  FAT_OK, FAT_ERR_MISS_FILE, FAT_ERR_OPEN_DIR or an error
+ */
+uint8_t FAT_Open(FAT_File_t *f, const char *path, uint8_t mode)
+{
+    uint8_t  *e, s, name[11];
+    uint32_t  dir;
+    FAT_Dir_t d;
+
+    f->mode = 0;
+    s = fat_path(path, name, &dir);
+    if(s != FAT_OK)
+    {
+        return (s);
+    }
+    s = dir_find(dir, name, &d, NULL);
+    if(s == FAT_ERR_MISS_FILE && (mode & FAT_CREATE))
+    {
+        s = dir_add(dir, &d);
+        if(s == FAT_OK)
+        {
+            s = dir_entry(&d, &e);
+        }
+        if(s != FAT_OK)
+        {
+            return (s);
+        }
+        memset(e, 0, DIR_ENTRY);
+        memcpy(e, name, 11);
+        e[DIR_ATTR] = FAT_ATTR_ARCHIVE;
+        st16(e + DIR_CRT_TIME, FAT_TIME);
+        st16(e + DIR_CRT_DATE, FAT_DATE);
+        st16(e + DIR_ACC_DATE, FAT_DATE);
+        st16(e + DIR_WRT_TIME, FAT_TIME);
+        st16(e + DIR_WRT_DATE, FAT_DATE);
+        fat_mark(e);
+    }
+    else if(s == FAT_OK)
+    {
+        s = dir_entry(&d, &e);
+        if(s != FAT_OK)
+        {
+            return (s);
+        }
+        if(e[DIR_ATTR] & (FAT_ATTR_DIRECTORY | FAT_ATTR_VOLUME_ID))
+        {
+            return (FAT_ERR_OPEN_DIR);
+        }
+    }
+    else
+    {
+        return (s);
+    }
+
+    f->start = dir_clust(e);
+    f->size = ld32(e + DIR_SIZE);
+    f->pos = 0;
+    f->clust = f->start;
+    f->clust_idx = 0;
+    f->dir_lba = d.lba;
+    f->dir_off = d.off;
+    f->dirty = 0;
+    if((mode & FAT_CREATE) && (f->start || f->size))
+    {
+        s = fat_free_chain(f->start);
+        if(s != FAT_OK)
+        {
+            return (s);
+        }
+        f->start = f->clust = 0;
+        f->size = 0;
+        f->dirty = 1;
+    }
+    f->mode = (mode & FAT_CREATE) ? mode | FAT_WRITE : mode;
+    return (FAT_OK);
+}
+
+/*********************************************************************
+ * @fn      FAT_Read
+ *
+ * @brief   Reads up to len bytes. Whole sectors go straight into buf,
+ *          as many consecutive ones per READ(10) as the chain allows.
+ *
+ * @return  FAT_OK or an error
+ */
+uint8_t FAT_Read(FAT_File_t *f, void *buf, uint32_t len, uint32_t *done)
+{
+    uint8_t  *p = buf, *q, s = FAT_OK;
+    uint32_t  n, off, sec, lba;
+
+    *done = 0;
+    if(!(f->mode & FAT_READ))
+    {
+        return (FAT_ERR_FILE_CLOSE);
+    }
+    if(len > f->size - f->pos)
+    {
+        len = f->size - f->pos;
+    }
+    while(len)
+    {
+        s = fat_locate(f, f->pos >> (fs.spc_shift + 9));
+        if(s != FAT_OK)
+        {
+            return (s == FAT_CHAIN_END ? FAT_ERR_FAT : s);
+        }
+        off = f->pos % FAT_SECTOR;
+        sec = (f->pos / FAT_SECTOR) & ((1UL << fs.spc_shift) - 1);
+        lba = clust_lba(f->clust) + sec;
+        if(off == 0 && len >= FAT_SECTOR)
+        {
+            n = len / FAT_SECTOR;
+            s = fat_run(f, sec, n < FAT_BURST_SECTORS ? n : FAT_BURST_SECTORS, &n);
+            if(s == FAT_OK)
+            {
+                s = fat_cache_range(lba, n, 0);
+            }
+            if(s == FAT_OK)
+            {
+                s = MSC_Read(lba, n, p);
+            }
+            n *= FAT_SECTOR;
+        }
+        else
+        {
+            n = FAT_SECTOR - off < len ? FAT_SECTOR - off : len;
+            s = fat_cache(lba, CACHE_FILL | CACHE_DATA, &q);
+            if(s == FAT_OK)
+            {
+                memcpy(p, q + off, n);
+            }
+        }
+        if(s != FAT_OK)
+        {
+            return (s);
+        }
+        p += n;
+        f->pos += n;
+        len -= n;
+        *done += n;
+    }
+    return (FAT_OK);
+}
+
+/*********************************************************************
+ * @fn      FAT_Write
+ *
+ * @brief   Writes len bytes at the position. Clusters for the part past
+ *          the end are allocated up front in one run, whole sectors go
+ *          out straight from buf.
+ *
+ * @return  FAT_OK, FAT_ERR_FULL or an error
+ */
+uint8_t FAT_Write(FAT_File_t *f, const void *buf, uint32_t len, uint32_t *done)
+{
+    const uint8_t *p = buf;
+    uint8_t       *q, s = FAT_OK;
+    uint32_t       n, off, sec, lba, first, shift = fs.spc_shift + 9;
+
+    *done = 0;
+    if(!(f->mode & FAT_WRITE))
+    {
+        return (FAT_ERR_FILE_CLOSE);
+    }
+    if(len > 0xFFFFFFFF - f->pos)
+    {
+        len = 0xFFFFFFFF - f->pos; // FAT file size limit
+    }
+    while(len)
+    {
+        s = fat_locate(f, f->pos >> shift);
+        if(s == FAT_CHAIN_END)
+        {
+            n = ((f->pos + len - 1) >> shift) + 1 - (f->start ? f->clust_idx + 1 : 0);
+            s = fat_alloc(f->start ? f->clust : 0, n, &first, &n);
+            if(s != FAT_OK)
+            {
+                return (s);
+            }
+            if(f->start == 0)
+            {
+                f->start = f->clust = first;
+                f->clust_idx = 0;
+            }
+            f->dirty = 1;
+            continue;
+        }
+        if(s != FAT_OK)
+        {
+            return (s);
+        }
+        off = f->pos % FAT_SECTOR;
+        sec = (f->pos / FAT_SECTOR) & ((1UL << fs.spc_shift) - 1);
+        lba = clust_lba(f->clust) + sec;
+        if(off == 0 && len >= FAT_SECTOR)
+        {
+            n = len / FAT_SECTOR;
+            s = fat_run(f, sec, n < FAT_BURST_SECTORS ? n : FAT_BURST_SECTORS, &n);
+            if(s == FAT_OK)
+            {
+                s = fat_cache_range(lba, n, 1);
+            }
+            if(s == FAT_OK)
+            {
+                s = MSC_Write(lba, n, p);
+            }
+            n *= FAT_SECTOR;
+        }
+        else
+        {
+            n = FAT_SECTOR - off < len ? FAT_SECTOR - off : len;
+            s = fat_cache(lba, (f->pos - off < f->size ? CACHE_FILL : 0) | CACHE_DATA, &q); // nothing to keep past the end
+            if(s == FAT_OK)
+            {
+                memcpy(q + off, p, n);
+                fat_mark(q);
+            }
+        }
+        if(s != FAT_OK)
+        {
+            return (s);
+        }
+        p += n;
+        f->pos += n;
+        len -= n;
+        *done += n;
+        if(f->pos > f->size)
+        {
+            f->size = f->pos;
+        }
+        f->dirty = 1;
+    }
+    return (FAT_OK);
+}
+
+/*********************************************************************
+ * @fn      FAT_Seek
+ *
+ * @brief   Moves the position, at most to the end of the file
+ *
+ * @return  FAT_OK or FAT_ERR_FILE_CLOSE
+ */
+uint8_t FAT_Seek(FAT_File_t *f, uint32_t pos)
+{
+    if(!f->mode)
+    {
+        return (FAT_ERR_FILE_CLOSE);
+    }
+    f->pos = pos < f->size ? pos : f->size;
+    return (FAT_OK);
+}
+
+/*********************************************************************
+ * @fn      FAT_Close
+ *
+ * @brief   Updates the directory entry of a changed file and syncs
+ *
+ * @return  FAT_OK or an error
+ */
+uint8_t FAT_Close(FAT_File_t *f)
+{
+    uint8_t *e, s;
+
+    if(!f->mode)
+    {
+        return (FAT_ERR_FILE_CLOSE);
+    }
+    f->mode = 0;
+    if(f->dirty)
+    {
+        s = fat_cache(f->dir_lba, CACHE_FILL, &e);
+        if(s != FAT_OK)
+        {
+            return (s);
+        }
+        e += f->dir_off;
+        st16(e + DIR_CLUST_HI, (uint16_t)(f->start >> 16));
+        st16(e + DIR_CLUST_LO, (uint16_t)f->start);
+        st32(e + DIR_SIZE, f->size);
+        st16(e + DIR_WRT_TIME, FAT_TIME);
+        st16(e + DIR_WRT_DATE, FAT_DATE);
+        st16(e + DIR_ACC_DATE, FAT_DATE);
+        e[DIR_ATTR] |= FAT_ATTR_ARCHIVE;
+        fat_mark(e);
+        f->dirty = 0;
+    }
+    return (FAT_Sync());
+}
+
+/*********************************************************************
+ * @fn      FAT_Delete
+ *
+ * @brief   Removes a file, its long name entries and its clusters
+ *
+ * @return  FAT_OK, FAT_ERR_MISS_FILE, FAT_ERR_OPEN_DIR or an error
+ */
+uint8_t FAT_Delete(const char *path)
+{
+    uint8_t  *e, s, name[11];
+    uint32_t  dir, clust;
+    FAT_Dir_t d, l;
+
+    s = fat_path(path, name, &dir);
+    if(s == FAT_OK)
+    {
+        s = dir_find(dir, name, &d, &l);
+    }
+    if(s == FAT_OK)
+    {
+        s = dir_entry(&d, &e);
+    }
+    if(s != FAT_OK)
+    {
+        return (s);
+    }
+    if(e[DIR_ATTR] & (FAT_ATTR_DIRECTORY | FAT_ATTR_VOLUME_ID))
+    {
+        return (FAT_ERR_OPEN_DIR);
+    }
+    clust = dir_clust(e);
+    for(;;)
+    {
+        s = dir_entry(&l, &e);
+        if(s != FAT_OK)
+        {
+            return (s);
+        }
+        e[0] = 0xE5;
+        fat_mark(e);
+        if(l.lba == d.lba && l.off == d.off)
+        {
+            break;
+        }
+        s = dir_next(&l, 0);
+        if(s != FAT_OK)
+        {
+            return (s);
+        }
+    }
+    s = fat_free_chain(clust);
+    if(s != FAT_OK)
+    {
+        return (s);
+    }
+    return (FAT_Sync());
+}
+
+/*********************************************************************
+ * @fn      FAT_OpenDir
+ *
+ * @brief   Starts listing a directory, "/" for the root directory
+ *
+ * @return  FAT_OK, FAT_ERR_MISS_DIR or an error
+ */
+uint8_t FAT_OpenDir(FAT_Dir_t *d, const char *path)
+{
+    uint8_t *e, s, name[11];
+    uint32_t dir;
+    const char *p = path;
+
+    while(*p == '/')
+    {
+        p++;
+    }
+    if(*p == 0)
+    {
+        if(!FAT_Type)
+        {
+            return (FAT_ERR_BPB);
+        }
+        dir_start(d, fs.root_clust);
+        return (FAT_OK);
+    }
+    s = fat_path(path, name, &dir);
+    if(s == FAT_OK)
+    {
+        s = dir_find(dir, name, d, NULL);
+    }
+    if(s == FAT_OK)
+    {
+        s = dir_entry(d, &e);
+    }
+    if(s != FAT_OK)
+    {
+        return (s == FAT_ERR_MISS_FILE ? FAT_ERR_MISS_DIR : s);
+    }
+    if(!(e[DIR_ATTR] & FAT_ATTR_DIRECTORY))
+    {
+        return (FAT_ERR_MISS_DIR);
+    }
+    dir_start(d, dir_clust(e) ? dir_clust(e) : fs.root_clust);
+    return (FAT_OK);
+}
+
+/*********************************************************************
+ * @fn      FAT_ReadDir
+ *
+ * @brief   The next file or directory, long name, volume label, "." and
+ *          ".." entries are skipped
+ *
+ * @return  FAT_OK, FAT_ERR_MISS_FILE after the last one, or an error
+ */
+uint8_t FAT_ReadDir(FAT_Dir_t *d, FAT_Info_t *info)
+{
+    uint8_t *e, s, i, n, found;
+
+    do
+    {
+        if(d->off == 0xFFFF)
+        {
+            return (FAT_ERR_MISS_FILE);
+        }
+        s = dir_entry(d, &e);
+        if(s != FAT_OK)
+        {
+            return (s);
+        }
+        if(e[0] == 0x00)
+        {
+            d->off = 0xFFFF;
+            return (FAT_ERR_MISS_FILE);
+        }
+        found = e[0] != 0xE5 && e[0] != '.' && !(e[DIR_ATTR] & FAT_ATTR_VOLUME_ID);
+        if(found)
+        {
+            for(i = n = 0; i != 11; i++)
+            {
+                if(i == 8 && e[8] != ' ')
+                {
+                    info->name[n++] = '.';
+                }
+                if(e[i] == ' ')
+                {
+                    continue;
+                }
+                info->name[n] = (i == 0 && e[0] == 0x05) ? 0xE5 : e[i];
+                if(info->name[n] >= 'A' && info->name[n] <= 'Z' && (e[DIR_NTRES] & (i < 8 ? 0x08 : 0x10)))
+                {
+                    info->name[n] += 'a' - 'A';
+                }
+                n++;
+            }
+            info->name[n] = 0;
+            info->attr = e[DIR_ATTR];
+            info->size = ld32(e + DIR_SIZE);
+            info->date = ld16(e + DIR_WRT_DATE);
+            info->time = ld16(e + DIR_WRT_TIME);
+        }
+        s = dir_next(d, 0);
+        if(s == FAT_ERR_MISS_FILE)
+        {
+            d->off = 0xFFFF;
+        }
+        else if(s != FAT_OK)
+        {
+            return (s);
+        }
+    } while(!found);
+    return (FAT_OK);
+}
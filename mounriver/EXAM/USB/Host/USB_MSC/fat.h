@@ -0,0 +1,141 @@
+/********************************** (C) COPYRIGHT *******************************
+ * File Name          : fat.h
+ * Description        : FAT12/FAT16/FAT32 on top of msc.h, with a small
+ *                      write-back sector cache
+ *********************************************************************************
+ * FAT, directory and partial data sectors go through FAT_CACHE_SECTORS
+ * cache slots and are written back when a slot is needed, on FAT_Close() and
+ * on FAT_Sync(). FAT sectors are written to every copy of the FAT then.
+ * Partial data sectors only push out other data sectors once the cache is
+ * full, so small reads and writes don't keep re-reading the FAT.
+ *
+ * File data in whole sectors bypasses the cache. FAT_Read() and FAT_Write()
+ * follow the cluster chain ahead of the position while the clusters are
+ * consecutive, and move the whole run with one MSC_Read()/MSC_Write()
+ * straight to or from the caller's buffer, up to FAT_BURST_SECTORS. Writes
+ * that extend a file allocate the clusters they need in one consecutive
+ * run where the free space allows it, so the data written by one call
+ * normally goes out as a single WRITE(10).
+ *
+ * Names are 8.3, paths absolute with '/' ("/LOGS/DAY1.CSV"). Long names are
+ * skipped when reading directories and removed along with their file.
+ * Return codes match those of libRV3UFI where there is one.
+ *******************************************************************************/
+
+#ifndef __FAT_H
+#define __FAT_H
+
+#include <stdint.h>
+
+#ifndef FAT_CACHE_SECTORS
+#define FAT_CACHE_SECTORS    4             // 512 bytes of RAM each, at least 1
+#endif
+#ifndef FAT_BURST_SECTORS
+#define FAT_BURST_SECTORS    64            // most sectors of file data per MSC call
+#endif
+
+/* dates for new and written files, FAT encoding */
+#ifndef FAT_DATE
+#define FAT_DATE             ((2021 - 1980) << 9 | 1 << 5 | 1)
+#endif
+#ifndef FAT_TIME
+#define FAT_TIME             0
+#endif
+
+#define FAT_OK               0x00
+#define FAT_ERR_OPEN_DIR     0x41          // the path is a directory
+#define FAT_ERR_MISS_FILE    0x42          // no such file, or no more directory entries
+#define FAT_ERR_MBR          0x91          // no FAT partition found
+#define FAT_ERR_BPB          0xA1          // not formatted, or not 512 byte sectors
+#define FAT_ERR_FAT          0xA3          // broken cluster chain
+#define FAT_ERR_FULL         0xB1          // no free cluster left
+#define FAT_ERR_FDT_OVER     0xB2          // FAT12/FAT16 root directory is full
+#define FAT_ERR_MISS_DIR     0xB3          // a directory on the path doesn't exist
+#define FAT_ERR_FILE_CLOSE   0xB4          // file not open, or not open for this
+#define FAT_ERR_NAME         0xB5          // not a valid 8.3 name
+/* anything else comes from MSC_Read()/MSC_Write() */
+
+/* FAT_Open() modes */
+#define FAT_READ             0x01
+#define FAT_WRITE            0x02
+#define FAT_CREATE           0x04          // create the file, or truncate it if it exists
+
+#define FAT_ATTR_READ_ONLY   0x01
+#define FAT_ATTR_HIDDEN      0x02
+#define FAT_ATTR_SYSTEM      0x04
+#define FAT_ATTR_VOLUME_ID   0x08
+#define FAT_ATTR_DIRECTORY   0x10
+#define FAT_ATTR_ARCHIVE     0x20
+
+typedef struct
+{
+    uint32_t size;
+    uint32_t pos;
+    uint32_t start;        // first cluster, 0 while the file is empty
+    uint32_t clust;        // a cluster of the chain and its index, where the
+    uint32_t clust_idx;    // last access left off
+    uint32_t dir_lba;      // directory entry, rewritten if dirty
+    uint16_t dir_off;
+    uint8_t  mode;
+    uint8_t  dirty;
+} FAT_File_t;
+
+typedef struct
+{
+    uint32_t clust;        // 0 for the FAT12/FAT16 root directory
+    uint32_t lba;
+    uint16_t sec;          // sector within the cluster (or the root directory)
+    uint16_t off;          // byte offset of the next entry in the sector
+} FAT_Dir_t;
+
+typedef struct
+{
+    char     name[13];     // "NAME.EXT"
+    uint8_t  attr;
+    uint32_t size;
+    uint16_t date;
+    uint16_t time;
+} FAT_Info_t;
+
+extern uint8_t FAT_Type; // 12, 16 or 32 once mounted, else 0
+
+/*
+ * Finds the FAT volume (partition 1 of an MBR, or a bare volume at LBA 0).
+ */
+extern uint8_t FAT_Mount(void);
+
+extern uint8_t FAT_Open(FAT_File_t *f, const char *path, uint8_t mode);
+
+/*
+ * Up to len bytes from the position, done is how many were read (less at
+ * the end of the file).
+ */
+extern uint8_t FAT_Read(FAT_File_t *f, void *buf, uint32_t len, uint32_t *done);
+
+extern uint8_t FAT_Write(FAT_File_t *f, const void *buf, uint32_t len, uint32_t *done);
+
+/*
+ * pos is clamped to the file size.
+ */
+extern uint8_t FAT_Seek(FAT_File_t *f, uint32_t pos);
+
+/*
+ * Rewrites the directory entry if the file changed, and syncs.
+ */
+extern uint8_t FAT_Close(FAT_File_t *f);
+
+extern uint8_t FAT_Delete(const char *path);
+
+extern uint8_t FAT_OpenDir(FAT_Dir_t *d, const char *path);
+
+/*
+ * The next file or directory, FAT_ERR_MISS_FILE after the last one.
+ */
+extern uint8_t FAT_ReadDir(FAT_Dir_t *d, FAT_Info_t *info);
+
+/*
+ * Writes back every dirty cache slot and the FAT32 FSInfo sector.
+ */
+extern uint8_t FAT_Sync(void);
+
+#endif
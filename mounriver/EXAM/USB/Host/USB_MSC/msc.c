@@ -0,0 +1,391 @@
+/********************************** (C) COPYRIGHT *******************************
+ * File Name          : msc.c
+ * Description        : USB mass storage host, Bulk-Only transport
+ *********************************************************************************
+ * One command is CBW out, the data stage, CSW in. Data packets go through
+ * R16_UH_RX_DMA/R16_UH_TX_DMA pointed into the caller's buffer when it is
+ * word aligned, so a sector costs 8 USBHostTransact() calls and no copying.
+ * Toggles are kept here per endpoint, a STALL clears the endpoint and resets
+ * its toggle, and a bad CSW gets the Bulk-Only reset recovery.
+ *******************************************************************************/
+
+#include "CH57x_common.h"
+#include "msc.h"
+
+#define MSC_NAK_TIMEOUT      (2000000 / 20) // a flash disk NAKs while it programs, 2 s
+#define MSC_RETRY            3
+
+#define SCSI_TEST_UNIT_READY 0x00
+#define SCSI_REQUEST_SENSE   0x03
+#define SCSI_INQUIRY         0x12
+#define SCSI_READ_CAPACITY   0x25
+#define SCSI_READ10          0x28
+#define SCSI_WRITE10         0x2A
+
+#define MSC_CSW_FAILED       0x80           // command failed, sense data explains
+
+uint32_t MSC_Capacity;
+
+static uint8_t  msc_ep_in, msc_ep_out;
+static uint8_t  msc_tog_in, msc_tog_out;
+static uint32_t msc_tag;
+
+static UDISK_BOC_CBW msc_cbw __attribute__((aligned(4)));
+static UDISK_BOC_CSW msc_csw __attribute__((aligned(4)));
+static uint8_t       msc_sense[36] __attribute__((aligned(4)));
+
+/*********************************************************************
+ * @fn      MSC_BulkOut
+ *
+ * @brief   Sends len bytes in full sized packets, the last one short
+ *
+ * @return  USBHostTransact() status
+ */
+static uint8_t MSC_BulkOut(const uint8_t *p, uint32_t len)
+{
+    uint8_t  s = ERR_SUCCESS;
+    uint32_t n;
+
+    while(len)
+    {
+        n = len > MAX_PACKET_SIZE ? MAX_PACKET_SIZE : len;
+        if(((uint32_t)p & 3) == 0)
+        {
+            R16_UH_TX_DMA = (uint32_t)p;
+        }
+        else
+        {
+            R16_UH_TX_DMA = (uint32_t)pHOST_TX_RAM_Addr;
+            memcpy(pHOST_TX_RAM_Addr, p, n);
+        }
+        R8_UH_TX_LEN = n;
+        s = USBHostTransact(USB_PID_OUT << 4 | msc_ep_out, msc_tog_out ? RB_UH_T_TOG : 0, MSC_NAK_TIMEOUT);
+        if(s != ERR_SUCCESS)
+        {
+            break;
+        }
+        msc_tog_out ^= 1;
+        p += n;
+        len -= n;
+    }
+    R16_UH_TX_DMA = (uint32_t)pHOST_TX_RAM_Addr;
+    return (s);
+}
+
+/*********************************************************************
+ * @fn      MSC_BulkIn
+ *
+ * @brief   Receives up to len bytes, stops early on a short packet. The
+ *          last partial packet goes through pHOST_RX_RAM_Addr so the device
+ *          can't write past the end of p.
+ *
+ * @return  USBHostTransact() status
+ */
+static uint8_t MSC_BulkIn(uint8_t *p, uint32_t len)
+{
+    uint8_t  s = ERR_SUCCESS;
+    uint8_t  direct;
+    uint32_t n;
+
+    while(len)
+    {
+        direct = ((uint32_t)p & 3) == 0 && len >= MAX_PACKET_SIZE;
+        R16_UH_RX_DMA = direct ? (uint32_t)p : (uint32_t)pHOST_RX_RAM_Addr;
+        s = USBHostTransact(USB_PID_IN << 4 | msc_ep_in, msc_tog_in ? RB_UH_R_TOG : 0, MSC_NAK_TIMEOUT);
+        if(s != ERR_SUCCESS)
+        {
+            break;
+        }
+        msc_tog_in ^= 1;
+        n = R8_USB_RX_LEN < len ? R8_USB_RX_LEN : len;
+        if(!direct)
+        {
+            memcpy(p, pHOST_RX_RAM_Addr, n);
+        }
+        p += n;
+        len -= n;
+        if(R8_USB_RX_LEN < MAX_PACKET_SIZE)
+        {
+            break; // short packet
+        }
+    }
+    R16_UH_RX_DMA = (uint32_t)pHOST_RX_RAM_Addr;
+    return (s);
+}
+
+/*********************************************************************
+ * @fn      MSC_ClearStall
+ *
+ * @brief   Clears a halted bulk endpoint, its toggle starts over at DATA0
+ *
+ * @return  control transfer status
+ */
+static uint8_t MSC_ClearStall(uint8_t in)
+{
+    if(in)
+    {
+        msc_tog_in = 0;
+        return (CtrlClearEndpStall(msc_ep_in | USB_ENDP_DIR_MASK));
+    }
+    msc_tog_out = 0;
+    return (CtrlClearEndpStall(msc_ep_out));
+}
+
+/*********************************************************************
+ * @fn      MSC_ResetRecovery
+ *
+ * @brief   Bulk-Only Mass Storage Reset, then both endpoints cleared
+ *
+ * @return  none
+ */
+static void MSC_ResetRecovery(void)
+{
+    pSetupReq->bRequestType = USB_REQ_TYP_OUT | USB_REQ_TYP_CLASS | USB_REQ_RECIP_INTERF;
+    pSetupReq->bRequest = 0xFF;
+    pSetupReq->wValue = 0;
+    pSetupReq->wIndex = 0;
+    pSetupReq->wLength = 0;
+    HostCtrlTransfer(NULL, NULL);
+    MSC_ClearStall(1);
+    MSC_ClearStall(0);
+}
+
+/*********************************************************************
+ * @fn      MSC_Command
+ *
+ * @brief   One Bulk-Only command: CBW, data stage of len bytes to or from
+ *          data, CSW
+ *
+ * @param   cb      - SCSI command block, cb_len bytes
+ * @param   in      - data stage direction
+ *
+ * @return  ERR_SUCCESS, MSC_CSW_FAILED or a transfer error
+ */
+static uint8_t MSC_Command(const uint8_t *cb, uint8_t cb_len, uint8_t in, uint8_t *data, uint32_t len)
+{
+    uint8_t s, i;
+
+    memset(&msc_cbw, 0, sizeof(msc_cbw));
+    msc_cbw.mCBW_Sig = USB_BO_CBW_SIG;
+    msc_cbw.mCBW_Tag = ++msc_tag;
+    msc_cbw.mCBW_DataLen = len;
+    msc_cbw.mCBW_Flag = in ? 0x80 : 0x00;
+    msc_cbw.mCBW_CB_Len = cb_len;
+    memcpy(msc_cbw.mCBW_CB_Buf, cb, cb_len);
+
+    s = MSC_BulkOut((uint8_t *)&msc_cbw, USB_BO_CBW_SIZE);
+    if(s != ERR_SUCCESS)
+    {
+        if(s == (USB_PID_STALL | ERR_USB_TRANSFER))
+        {
+            MSC_ResetRecovery();
+        }
+        return (s);
+    }
+
+    if(len)
+    {
+        s = in ? MSC_BulkIn(data, len) : MSC_BulkOut(data, len);
+        if(s == (USB_PID_STALL | ERR_USB_TRANSFER))
+        {
+            MSC_ClearStall(in); // the CSW still follows
+        }
+        else if(s != ERR_SUCCESS)
+        {
+            return (s);
+        }
+    }
+
+    for(i = 0; i != 2; i++)
+    {
+        s = MSC_BulkIn((uint8_t *)&msc_csw, USB_BO_CSW_SIZE);
+        if(s != (USB_PID_STALL | ERR_USB_TRANSFER))
+        {
+            break;
+        }
+        MSC_ClearStall(1);
+    }
+    if(s != ERR_SUCCESS)
+    {
+        return (s);
+    }
+    if(msc_csw.mCSW_Sig != USB_BO_CSW_SIG || msc_csw.mCSW_Tag != msc_tag || msc_csw.mCSW_Status > 1)
+    {
+        MSC_ResetRecovery(); // phase error or garbage
+        return (MSC_ERR_DISK);
+    }
+    return (msc_csw.mCSW_Status ? MSC_CSW_FAILED : ERR_SUCCESS);
+}
+
+/*********************************************************************
+ * @fn      MSC_Sense
+ *
+ * @brief   REQUEST SENSE after a failed command, clears the unit attention
+ *          a freshly plugged disk reports
+ *
+ * @return  sense key, 0xFF if the sense data couldn't be read
+ */
+static uint8_t MSC_Sense(void)
+{
+    uint8_t cb[6] = {SCSI_REQUEST_SENSE, 0, 0, 0, 18, 0};
+
+    if(MSC_Command(cb, 6, 1, msc_sense, 18) != ERR_SUCCESS)
+    {
+        return (0xFF);
+    }
+    return (msc_sense[2] & 0x0F);
+}
+
+/*********************************************************************
+ * @fn      MSC_Init
+ *
+ * @brief   Takes over the storage device InitRootDevice() configured
+ *
+ * @return  ERR_SUCCESS, MSC_ERR_UNSUPPORT or a transfer error
+ */
+uint8_t MSC_Init(void)
+{
+    uint8_t s, i;
+    uint8_t cb[10];
+
+    if(ThisUsbDev.DeviceType != USB_DEV_CLASS_STORAGE)
+    {
+        return (MSC_ERR_UNSUPPORT);
+    }
+    s = CtrlGetConfigDescr();
+    if(s != ERR_SUCCESS)
+    {
+        return (s);
+    }
+    AnalyzeBulkEndp(Com_Buffer, 0);
+    msc_ep_in = ThisUsbDev.GpVar[0];
+    msc_ep_out = ThisUsbDev.GpVar[2];
+    if(msc_ep_in == 0 || msc_ep_out == 0)
+    {
+        return (MSC_ERR_UNSUPPORT);
+    }
+    msc_tog_in = msc_tog_out = 0;
+
+    memset(cb, 0, sizeof(cb));
+    cb[0] = SCSI_INQUIRY;
+    cb[4] = 36;
+    s = MSC_Command(cb, 6, 1, msc_sense, 36);
+    if(s != ERR_SUCCESS)
+    {
+        return (s == MSC_CSW_FAILED ? MSC_ERR_DISK : s);
+    }
+    if((msc_sense[0] & 0x1F) != 0x00)
+    {
+        return (MSC_ERR_UNSUPPORT); // not a direct access block device
+    }
+
+    for(i = 0; i != 10; i++)
+    {
+        memset(cb, 0, sizeof(cb));
+        cb[0] = SCSI_TEST_UNIT_READY;
+        s = MSC_Command(cb, 6, 0, NULL, 0);
+        if(s == ERR_SUCCESS)
+        {
+            break;
+        }
+        if(s != MSC_CSW_FAILED)
+        {
+            return (s);
+        }
+        MSC_Sense();
+        mDelaymS(50);
+    }
+    if(s != ERR_SUCCESS)
+    {
+        return (MSC_ERR_DISK);
+    }
+
+    memset(cb, 0, sizeof(cb));
+    cb[0] = SCSI_READ_CAPACITY;
+    s = MSC_Command(cb, 10, 1, msc_sense, 8);
+    if(s != ERR_SUCCESS)
+    {
+        return (s == MSC_CSW_FAILED ? MSC_ERR_DISK : s);
+    }
+    if(msc_sense[4] != 0 || msc_sense[5] != 0 || msc_sense[6] != (MSC_SECTOR_SIZE >> 8) || msc_sense[7] != 0)
+    {
+        return (MSC_ERR_UNSUPPORT);
+    }
+    MSC_Capacity = ((uint32_t)msc_sense[0] << 24 | (uint32_t)msc_sense[1] << 16 | (uint32_t)msc_sense[2] << 8 | msc_sense[3]) + 1;
+    return (ERR_SUCCESS);
+}
+
+/*********************************************************************
+ * @fn      MSC_Transfer
+ *
+ * @brief   READ(10)/WRITE(10) in bursts of up to MSC_BURST_MAX sectors,
+ *          each retried with a REQUEST SENSE in between
+ *
+ * @return  ERR_SUCCESS, MSC_ERR_DISK or a transfer error
+ */
+static uint8_t MSC_Transfer(uint8_t op, uint32_t lba, uint32_t count, uint8_t *buf)
+{
+    uint8_t  s = ERR_SUCCESS, retry;
+    uint8_t  cb[10];
+    uint32_t n;
+
+    while(count)
+    {
+        n = count > MSC_BURST_MAX ? MSC_BURST_MAX : count;
+        cb[0] = op;
+        cb[1] = 0;
+        cb[2] = (uint8_t)(lba >> 24);
+        cb[3] = (uint8_t)(lba >> 16);
+        cb[4] = (uint8_t)(lba >> 8);
+        cb[5] = (uint8_t)(lba);
+        cb[6] = 0;
+        cb[7] = (uint8_t)(n >> 8);
+        cb[8] = (uint8_t)(n);
+        cb[9] = 0;
+        for(retry = 0; retry != MSC_RETRY; retry++)
+        {
+            s = MSC_Command(cb, 10, op == SCSI_READ10, buf, n * MSC_SECTOR_SIZE);
+            if(s == ERR_SUCCESS)
+            {
+                break;
+            }
+            if(s == ERR_USB_DISCON || s == ERR_USB_CONNECT)
+            {
+                return (s);
+            }
+            MSC_Sense();
+        }
+        if(s != ERR_SUCCESS)
+        {
+            return (MSC_ERR_DISK);
+        }
+        lba += n;
+        buf += n * MSC_SECTOR_SIZE;
+        count -= n;
+    }
+    return (s);
+}
+
+/*********************************************************************
+ * @fn      MSC_Read
+ *
+ * @brief   Reads count sectors from lba
+ *
+ * @return  ERR_SUCCESS, MSC_ERR_DISK or a transfer error
+ */
+uint8_t MSC_Read(uint32_t lba, uint32_t count, uint8_t *buf)
+{
+    return (MSC_Transfer(SCSI_READ10, lba, count, buf));
+}
+
+/*********************************************************************
+ * @fn      MSC_Write
+ *
+ * @brief   Writes count sectors to lba
+ *
+ * @return  ERR_SUCCESS, MSC_ERR_DISK or a transfer error
+ */
+uint8_t MSC_Write(uint32_t lba, uint32_t count, const uint8_t *buf)
+{
+    return (MSC_Transfer(SCSI_WRITE10, lba, count, (uint8_t *)buf));
+}
@@ -0,0 +1,45 @@
+/********************************** (C) COPYRIGHT *******************************
+ * File Name          : msc.h
+ * Description        : USB mass storage host, Bulk-Only transport and the few
+ *                      SCSI commands a FAT file system needs
+ *********************************************************************************
+ * Open replacement for the sector layer of libRV3UFI. It runs over the host
+ * routines of CH57x_usbhostBase.c (USBHostTransact() and the control
+ * transfers) on the device InitRootDevice() found, and moves data straight
+ * between the caller's buffer and the bus: a READ(10)/WRITE(10) covers as
+ * many sectors as the caller asks for, and aligned buffers are handed to the
+ * USB DMA packet by packet without a copy.
+ *
+ * fat.c is the only user. It sees nothing but MSC_Read(), MSC_Write() and
+ * MSC_Capacity, which is what the host test (U_DISK_Host) replaces with a
+ * disk image.
+ *******************************************************************************/
+
+#ifndef __MSC_H
+#define __MSC_H
+
+#include <stdint.h>
+
+#define MSC_SECTOR_SIZE      512           // the only sector size fat.c handles
+#define MSC_BURST_MAX        128           // sectors per READ(10)/WRITE(10), larger requests are split
+
+/* besides the USBHostTransact() codes */
+#define MSC_ERR_DISK         0x1F          // command failed after retries (ERR_USB_DISK_ERR)
+#define MSC_ERR_UNSUPPORT    0xFB          // not a disk, or not 512 byte sectors (ERR_USB_UNSUPPORT)
+
+extern uint32_t MSC_Capacity;              // sectors, valid after MSC_Init()
+
+/*
+ * Takes over the storage device InitRootDevice() just configured: finds the
+ * bulk endpoints, waits for the medium and reads the capacity.
+ */
+extern uint8_t MSC_Init(void);
+
+/*
+ * count sectors from lba, one READ(10) per MSC_BURST_MAX sectors.
+ */
+extern uint8_t MSC_Read(uint32_t lba, uint32_t count, uint8_t *buf);
+
+extern uint8_t MSC_Write(uint32_t lba, uint32_t count, const uint8_t *buf);
+
+#endif
@@ -0,0 +1,210 @@
+/********************************** (C) COPYRIGHT *******************************
+ * File Name          : Main.c
+ * Description        : U disk through the open USB_MSC stack instead of
+ *                      libRV3UFI: lists the root directory, then writes and
+ *                      reads back /SPEED.BIN and prints the throughput
+ * Supports: FAT12/FAT16/FAT32, 512 byte sectors
+ *******************************************************************************/
+
+/** Built with DISK_LIB_ENABLE=0, USB_MSC takes the place of USB_LIB */
+
+#include "CH57x_common.h"
+#include "msc.h"
+#include "fat.h"
+
+#define TEST_SIZE     (1024 * 1024)  // bytes written and read by the speed test
+#define TEST_CHUNK    4096           // bytes per FAT_Write()/FAT_Read()
+
+__attribute__((aligned(4))) uint8_t RxBuffer[MAX_PACKET_SIZE]; // IN, must even address
+__attribute__((aligned(4))) uint8_t TxBuffer[MAX_PACKET_SIZE]; // OUT, must even address
+
+/* aligned, so whole sectors go between the USB DMA and this buffer directly */
+__attribute__((aligned(4))) uint8_t DataBuf[TEST_CHUNK];
+
+/*********************************************************************
+ * @fn      ListRoot
+ *
+ * @brief   Prints the root directory
+ *
+ * @return  FAT_OK or the error
+ */
+uint8_t ListRoot(void)
+{
+    FAT_Dir_t  d;
+    FAT_Info_t info;
+    uint8_t    s;
+
+    s = FAT_OpenDir(&d, "/");
+    while(s == FAT_OK)
+    {
+        s = FAT_ReadDir(&d, &info);
+        if(s == FAT_OK)
+        {
+            if(info.attr & FAT_ATTR_DIRECTORY)
+            {
+                PRINT("  %-12s <DIR>\n", info.name);
+            }
+            else
+            {
+                PRINT("  %-12s %lu\n", info.name, info.size);
+            }
+        }
+    }
+    return (s == FAT_ERR_MISS_FILE ? FAT_OK : s);
+}
+
+/*********************************************************************
+ * @fn      SpeedTest
+ *
+ * @brief   Writes TEST_SIZE bytes to /SPEED.BIN in TEST_CHUNK pieces,
+ *          reads them back and checks them, timing both with SysTick
+ *
+ * @return  FAT_OK or the error
+ */
+uint8_t SpeedTest(void)
+{
+    FAT_File_t f;
+    uint32_t   i, n, done, t;
+    uint8_t    s;
+
+    SysTick->CMP = 0xFFFFFFFF;
+    SysTick->CTLR = SysTick_CTLR_STCLK | SysTick_CTLR_STE;
+
+    s = FAT_Open(&f, "/SPEED.BIN", FAT_WRITE | FAT_CREATE);
+    if(s != FAT_OK)
+    {
+        return (s);
+    }
+    t = SYS_GetSysTickCnt();
+    for(n = 0; n < TEST_SIZE && s == FAT_OK; n += TEST_CHUNK)
+    {
+        for(i = 0; i < TEST_CHUNK; i += 4)
+        {
+            *(uint32_t *)&DataBuf[i] = n + i;
+        }
+        s = FAT_Write(&f, DataBuf, TEST_CHUNK, &done);
+    }
+    if(s == FAT_OK)
+    {
+        s = FAT_Close(&f);
+    }
+    t = SYS_GetSysTickCnt() - t;
+    if(s != FAT_OK)
+    {
+        return (s);
+    }
+    PRINT("write %lu bytes: %lu KB/s\n", (uint32_t)TEST_SIZE,
+          (uint32_t)((uint64_t)TEST_SIZE * (GetSysClock() / 1024) / t));
+
+    s = FAT_Open(&f, "/SPEED.BIN", FAT_READ);
+    if(s != FAT_OK)
+    {
+        return (s);
+    }
+    t = SYS_GetSysTickCnt();
+    for(n = 0; n < TEST_SIZE && s == FAT_OK; n += TEST_CHUNK)
+    {
+        s = FAT_Read(&f, DataBuf, TEST_CHUNK, &done);
+        if(s == FAT_OK && done != TEST_CHUNK)
+        {
+            s = FAT_ERR_FAT;
+        }
+    }
+    t = SYS_GetSysTickCnt() - t;
+    FAT_Close(&f);
+    if(s != FAT_OK)
+    {
+        return (s);
+    }
+    PRINT("read %lu bytes: %lu KB/s\n", (uint32_t)TEST_SIZE,
+          (uint32_t)((uint64_t)TEST_SIZE * (GetSysClock() / 1024) / t));
+
+    /* the last chunk read is the last one written */
+    for(i = 0; i < TEST_CHUNK; i += 4)
+    {
+        if(*(uint32_t *)&DataBuf[i] != TEST_SIZE - TEST_CHUNK + i)
+        {
+            PRINT("data mismatch at %lu\n", TEST_SIZE - TEST_CHUNK + i);
+            break;
+        }
+    }
+    return (FAT_OK);
+}
+
+/*********************************************************************
+ * @fn      main
+ *
+ * @brief   Main function
+ *
+ * @return  none
+ */
+int main()
+{
+    uint8_t s;
+
+    HSECFG_Capacitance(HSECap_18p);
+    SetSysClock(CLK_SOURCE_HSE_PLL_100MHz);
+    DelayMs(5);
+    /* supply voltage monitor */
+    PowerMonitor(ENABLE, LPLevel_2V0);
+
+    GPIOA_SetBits(bTXD_0);
+    GPIOA_ModeCfg(bTXD_0, GPIO_ModeOut_PP_5mA); // TXD push-pull, drive it high first
+    UART_Remap(ENABLE, UART_TX_REMAP_PA3, UART_RX_REMAP_PA2);
+    UART_DefInit();
+    PRINT("Start @ChipID=%02X\n", R8_CHIP_ID);
+
+    pHOST_RX_RAM_Addr = RxBuffer;
+    pHOST_TX_RAM_Addr = TxBuffer;
+    R16_PIN_ALTERNATE &= ~RB_PIN_DEBUG_EN; // USB needs the two wire debug interface off
+    USB_HostInit();
+    PRINT("Wait Device In\n");
+    while(1)
+    {
+        s = ERR_SUCCESS;
+        if(R8_USB_INT_FG & RB_UIF_DETECT)
+        { // attach or detach
+            R8_USB_INT_FG = RB_UIF_DETECT;
+            s = AnalyzeRootHub();
+            if(s == ERR_USB_CONNECT)
+                FoundNewDev = 1;
+        }
+
+        if(FoundNewDev || s == ERR_USB_CONNECT)
+        { // a new device
+            FoundNewDev = 0;
+            mDelaymS(200); // let the device settle after plugging in
+            s = InitRootDevice();
+            if(s != ERR_SUCCESS || ThisUsbDev.DeviceType != USB_DEV_CLASS_STORAGE)
+            {
+                PRINT("Not a U disk, %02X\n", (uint16_t)s);
+                continue;
+            }
+            s = MSC_Init();
+            if(s != ERR_SUCCESS)
+            {
+                PRINT("MSC_Init err = %02X\n", (uint16_t)s);
+                continue;
+            }
+            PRINT("%lu sectors\n", MSC_Capacity);
+            s = FAT_Mount();
+            if(s != FAT_OK)
+            {
+                PRINT("FAT_Mount err = %02X\n", (uint16_t)s);
+                continue;
+            }
+            PRINT("FAT%d\n", FAT_Type);
+            s = ListRoot();
+            if(s == FAT_OK)
+            {
+                s = SpeedTest();
+            }
+            if(s != FAT_OK)
+            {
+                PRINT("err = %02X\n", (uint16_t)s);
+            }
+            PRINT("Done, take the disk out\n");
+        }
+        mDelaymS(10);
+    }
+}
@@ -0,0 +1,861 @@
+/*
+ * fattest: ../USB_MSC/fat.c against FAT12, FAT16 and FAT32 disk images.
+ *
+ * MSC_Read()/MSC_Write() are replaced by an image in memory that counts
+ * commands and sectors. Throughput is worked out from those counts with a
+ * model of a full speed Bulk-Only disk: a fixed cost per command (CBW, CSW
+ * and the disk's own latency) plus a cost per 64 byte packet. On top of the
+ * timed runs it checks the file system after every step with a checker of
+ * its own, and the file contents against a model.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "msc.h"
+#include "fat.h"
+
+/* ---- disk image and counters ---- */
+
+static uint8_t *disk;
+static uint32_t disk_sectors;
+static uint32_t n_read, n_write;            // commands
+static uint64_t s_read, s_write;            // sectors
+
+static unsigned cmd_us = 500, pkt_us = 50;
+
+uint32_t MSC_Capacity;
+
+uint8_t MSC_Read(uint32_t lba, uint32_t count, uint8_t *buf)
+{
+    if(lba >= disk_sectors || count > disk_sectors - lba)
+        return MSC_ERR_DISK;
+    memcpy(buf, disk + (uint64_t)lba * MSC_SECTOR_SIZE, (size_t)count * MSC_SECTOR_SIZE);
+    n_read += (count + MSC_BURST_MAX - 1) / MSC_BURST_MAX;
+    s_read += count;
+    return 0;
+}
+
+uint8_t MSC_Write(uint32_t lba, uint32_t count, const uint8_t *buf)
+{
+    if(lba >= disk_sectors || count > disk_sectors - lba)
+        return MSC_ERR_DISK;
+    memcpy(disk + (uint64_t)lba * MSC_SECTOR_SIZE, buf, (size_t)count * MSC_SECTOR_SIZE);
+    n_write += (count + MSC_BURST_MAX - 1) / MSC_BURST_MAX;
+    s_write += count;
+    return 0;
+}
+
+static void counters_reset(void)
+{
+    n_read = n_write = 0;
+    s_read = s_write = 0;
+}
+
+static double model_us(void)
+{
+    return (double)(n_read + n_write) * cmd_us + (double)(s_read + s_write) * (MSC_SECTOR_SIZE / 64) * pkt_us;
+}
+
+#define CHECK(x)                                                                 \
+    do {                                                                         \
+        uint8_t s_ = (x);                                                        \
+        if(s_ != FAT_OK) {                                                       \
+            fprintf(stderr, "%s:%d: %s = %02X\n", __FILE__, __LINE__, #x, s_);   \
+            exit(1);                                                             \
+        }                                                                        \
+    } while(0)
+
+#define EXPECT(x, want)                                                          \
+    do {                                                                         \
+        uint8_t s_ = (x);                                                        \
+        if(s_ != (want)) {                                                       \
+            fprintf(stderr, "%s:%d: %s = %02X, want %02X\n", __FILE__, __LINE__, \
+                    #x, s_, (want));                                             \
+            exit(1);                                                             \
+        }                                                                        \
+    } while(0)
+
+static void fail(const char *what)
+{
+    fprintf(stderr, "%s\n", what);
+    exit(1);
+}
+
+/* ---- little endian ---- */
+
+static uint16_t g16(const uint8_t *p) { return p[0] | p[1] << 8; }
+static uint32_t g32(const uint8_t *p) { return g16(p) | (uint32_t)g16(p + 2) << 16; }
+static void p16(uint8_t *p, uint16_t v) { p[0] = v; p[1] = v >> 8; }
+static void p32(uint8_t *p, uint32_t v) { p16(p, v); p16(p + 2, v >> 16); }
+
+/* ---- formatter ---- */
+
+typedef struct
+{
+    const char *name;
+    int         type;
+    uint32_t    sectors;
+    uint32_t    part;       // partition start, 0 for a bare volume
+    uint8_t     spc;
+    uint16_t    rootent;
+    uint16_t    rsvd;
+} Geometry;
+
+static const Geometry geometries[] = {
+    {"FAT12", 12, 2880, 0, 1, 224, 1},         // a 1.44 MB floppy, no MBR
+    {"FAT16", 16, 131072, 2048, 4, 512, 4},    // 64 MB, 2 kB clusters
+    {"FAT32", 32, 614400, 2048, 8, 0, 32},     // 300 MB, 4 kB clusters
+};
+
+static void fat_entry_set(const Geometry *g, uint32_t fat_lba, uint32_t fatsz, uint32_t c, uint32_t v)
+{
+    int      k;
+    uint8_t *fat;
+
+    for(k = 0; k < 2; k++)
+    {
+        fat = disk + (uint64_t)(fat_lba + k * fatsz) * MSC_SECTOR_SIZE;
+        if(g->type == 12)
+        {
+            uint32_t off = c + c / 2;
+            if(c & 1)
+            {
+                fat[off] = (fat[off] & 0x0F) | (v << 4);
+                fat[off + 1] = v >> 4;
+            }
+            else
+            {
+                fat[off] = v;
+                fat[off + 1] = (fat[off + 1] & 0xF0) | ((v >> 8) & 0x0F);
+            }
+        }
+        else if(g->type == 16)
+            p16(fat + c * 2, v);
+        else
+            p32(fat + c * 4, v);
+    }
+}
+
+static void dirent(uint8_t *e, const char *name11, uint8_t attr, uint32_t clust, uint32_t size)
+{
+    memset(e, 0, 32);
+    memcpy(e, name11, 11);
+    e[11] = attr;
+    p16(e + 20, clust >> 16);
+    p16(e + 26, clust);
+    p32(e + 28, size);
+}
+
+static uint8_t lfn_sum(const uint8_t *name11)
+{
+    uint8_t s = 0;
+    int     i;
+
+    for(i = 0; i < 11; i++)
+        s = ((s & 1) ? 0x80 : 0) + (s >> 1) + name11[i];
+    return s;
+}
+
+/*
+ * A fresh volume with /DATA (a directory) and /LONGFI~1.TXT, a 3 byte file
+ * with a two entry long name, to see FAT_Delete() take the long name along.
+ */
+static void mkfs(const Geometry *g)
+{
+    uint8_t *b, *root, *e;
+    uint32_t fatsz = 1, need, nclust, fat_lba, root_lba, data_lba, rootsecs, tot, c;
+    uint32_t data_dir, file_clust;
+    int      i, j;
+    const char *lname = "Long file name.txt";
+
+    free(disk);
+    disk_sectors = g->sectors;
+    disk = calloc(disk_sectors, MSC_SECTOR_SIZE);
+    if(!disk)
+        fail("out of memory");
+    MSC_Capacity = disk_sectors;
+
+    tot = g->sectors - g->part;
+    rootsecs = (g->rootent * 32 + 511) / 512;
+    for(;;)
+    {
+        nclust = (tot - g->rsvd - 2 * fatsz - rootsecs) / g->spc;
+        need = g->type == 12 ? ((nclust + 2) * 3 / 2 + 511) / 512 : ((nclust + 2) * (g->type / 8) + 511) / 512;
+        if(need <= fatsz)
+            break;
+        fatsz = need;
+    }
+    fat_lba = g->part + g->rsvd;
+    root_lba = fat_lba + 2 * fatsz;
+    data_lba = root_lba + rootsecs;
+
+    if(g->part)
+    {
+        b = disk;
+        b[446 + 4] = g->type == 32 ? 0x0C : 0x06;
+        p32(b + 446 + 8, g->part);
+        p32(b + 446 + 12, tot);
+        p16(b + 510, 0xAA55);
+    }
+    b = disk + (uint64_t)g->part * 512;
+    b[0] = 0xEB;
+    b[1] = 0x3C;
+    b[2] = 0x90;
+    memcpy(b + 3, "MSWIN4.1", 8);
+    p16(b + 11, 512);
+    b[13] = g->spc;
+    p16(b + 14, g->rsvd);
+    b[16] = 2;
+    p16(b + 17, g->rootent);
+    if(tot < 65536 && g->type != 32)
+        p16(b + 19, tot);
+    else
+        p32(b + 32, tot);
+    b[21] = 0xF8;
+    if(g->type == 32)
+    {
+        p32(b + 36, fatsz);
+        p32(b + 44, 2);
+        p16(b + 48, 1);
+        p16(b + 50, 6);
+        b[66] = 0x29;
+        memcpy(b + 71, "NO NAME    FAT32   ", 19);
+    }
+    else
+    {
+        p16(b + 22, fatsz);
+        b[38] = 0x29;
+        memcpy(b + 43, g->type == 12 ? "NO NAME    FAT12   " : "NO NAME    FAT16   ", 19);
+    }
+    p16(b + 510, 0xAA55);
+
+    fat_entry_set(g, fat_lba, fatsz, 0, g->type == 12 ? 0xFF8 : g->type == 16 ? 0xFFF8 : 0x0FFFFFF8);
+    fat_entry_set(g, fat_lba, fatsz, 1, g->type == 12 ? 0xFFF : g->type == 16 ? 0xFFFF : 0x0FFFFFFF);
+
+    c = 2;
+    if(g->type == 32)
+    {
+        fat_entry_set(g, fat_lba, fatsz, c++, 0x0FFFFFFF); // root directory
+        root = disk + (uint64_t)data_lba * 512;
+    }
+    else
+        root = disk + (uint64_t)root_lba * 512;
+    data_dir = c++;
+    fat_entry_set(g, fat_lba, fatsz, data_dir, g->type == 12 ? 0xFFF : g->type == 16 ? 0xFFFF : 0x0FFFFFFF);
+    file_clust = c++;
+    fat_entry_set(g, fat_lba, fatsz, file_clust, g->type == 12 ? 0xFFF : g->type == 16 ? 0xFFFF : 0x0FFFFFFF);
+
+    e = root;
+    dirent(e, "USBDISK    ", 0x08, 0, 0);
+    e += 32;
+    dirent(e, "DATA       ", 0x10, data_dir, 0);
+    e += 32;
+    /* two long name entries, last one first */
+    for(i = 2; i >= 1; i--)
+    {
+        static const int pos[13] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+        memset(e, 0, 32);
+        e[0] = i | (i == 2 ? 0x40 : 0);
+        e[11] = 0x0F;
+        e[13] = lfn_sum((const uint8_t *)"LONGFI~1TXT");
+        for(j = 0; j < 13; j++)
+        {
+            int      k = (i - 1) * 13 + j;
+            uint16_t ch = k < (int)strlen(lname) ? (uint8_t)lname[k] : k == (int)strlen(lname) ? 0 : 0xFFFF;
+            p16(e + pos[j], ch);
+        }
+        e += 32;
+    }
+    dirent(e, "LONGFI~1TXT", 0x20, file_clust, 3);
+    memcpy(disk + (uint64_t)(data_lba + (file_clust - 2) * g->spc) * 512, "abc", 3);
+
+    b = disk + (uint64_t)(data_lba + (data_dir - 2) * g->spc) * 512;
+    dirent(b, ".          ", 0x10, data_dir, 0);
+    dirent(b + 32, "..         ", 0x10, 0, 0);
+
+    if(g->type == 32)
+    {
+        b = disk + (uint64_t)(g->part + 1) * 512;
+        p32(b, 0x41615252);
+        p32(b + 484, 0x61417272);
+        p32(b + 488, nclust - 3);
+        p32(b + 492, c);
+        p16(b + 510, 0xAA55);
+        memcpy(disk + (uint64_t)(g->part + 6) * 512, disk + (uint64_t)g->part * 512, 512 * 2);
+    }
+}
+
+/* ---- model of what the files should contain ---- */
+
+#define MODEL_MAX 256
+
+static struct
+{
+    char     path[64];
+    uint8_t *data;
+    uint32_t size;
+} model[MODEL_MAX];
+static int model_n;
+
+static int model_find(const char *path)
+{
+    int i;
+
+    for(i = 0; i < model_n; i++)
+        if(strcmp(model[i].path, path) == 0)
+            return i;
+    return -1;
+}
+
+static void model_truncate(const char *path)
+{
+    int i = model_find(path);
+
+    if(i < 0)
+    {
+        if(model_n == MODEL_MAX)
+            fail("model full");
+        i = model_n++;
+        snprintf(model[i].path, sizeof(model[i].path), "%s", path);
+        model[i].data = NULL;
+    }
+    free(model[i].data);
+    model[i].data = NULL;
+    model[i].size = 0;
+}
+
+static void model_write(const char *path, uint32_t pos, const void *p, uint32_t len)
+{
+    int i = model_find(path);
+
+    if(pos + len > model[i].size)
+    {
+        model[i].data = realloc(model[i].data, pos + len);
+        model[i].size = pos + len;
+    }
+    memcpy(model[i].data + pos, p, len);
+}
+
+static void model_delete(const char *path)
+{
+    int i = model_find(path);
+
+    free(model[i].data);
+    model[i] = model[--model_n];
+}
+
+/* ---- checker, independent of fat.c ---- */
+
+static struct
+{
+    int      type;
+    uint32_t fat_lba, fatsz, root_lba, rootsecs, data_lba, nclust, spc, root_clust, fsinfo, eoc;
+} v;
+
+static uint8_t *used;
+static int      errors;
+static int      seen_n;
+
+static void chk_error(const char *fmt, const char *arg)
+{
+    fprintf(stderr, "check: ");
+    fprintf(stderr, fmt, arg);
+    fprintf(stderr, "\n");
+    errors++;
+}
+
+static uint8_t *sector(uint32_t lba)
+{
+    return disk + (uint64_t)lba * 512;
+}
+
+static uint32_t chk_fat(uint32_t c)
+{
+    uint8_t *fat = sector(v.fat_lba);
+
+    if(v.type == 12)
+    {
+        uint32_t x = g16(fat + c + c / 2);
+        return (c & 1) ? x >> 4 : x & 0xFFF;
+    }
+    if(v.type == 16)
+        return g16(fat + c * 2);
+    return g32(fat + c * 4) & 0x0FFFFFFF;
+}
+
+static void chk_volume(void)
+{
+    uint8_t *b = disk;
+    uint32_t base = 0, tot, rsvd;
+
+    if(!(b[0] == 0xEB || b[0] == 0xE9))
+        base = g32(b + 446 + 8);
+    b = sector(base);
+    rsvd = g16(b + 14);
+    tot = g16(b + 19) ? g16(b + 19) : g32(b + 32);
+    v.fatsz = g16(b + 22) ? g16(b + 22) : g32(b + 36);
+    v.spc = b[13];
+    v.fat_lba = base + rsvd;
+    v.root_lba = v.fat_lba + b[16] * v.fatsz;
+    v.rootsecs = (g16(b + 17) * 32 + 511) / 512;
+    v.data_lba = v.root_lba + v.rootsecs;
+    v.nclust = (tot - (v.data_lba - base)) / v.spc;
+    v.type = v.nclust < 4085 ? 12 : v.nclust < 65525 ? 16 : 32;
+    v.eoc = v.type == 12 ? 0xFF8 : v.type == 16 ? 0xFFF8 : 0x0FFFFFF8;
+    v.root_clust = v.type == 32 ? g32(b + 44) : 0;
+    v.fsinfo = v.type == 32 ? base + g16(b + 48) : 0;
+}
+
+/* marks the chain, returns its length in clusters */
+static uint32_t chk_chain(uint32_t c, const char *path)
+{
+    uint32_t n = 0;
+
+    if(c == 0)
+        return 0;
+    while(c >= 2 && c <= v.nclust + 1)
+    {
+        if(used[c])
+        {
+            chk_error("%s: cluster used twice", path);
+            return n;
+        }
+        used[c] = 1;
+        n++;
+        c = chk_fat(c);
+    }
+    if(c < v.eoc)
+        chk_error("%s: chain doesn't end", path);
+    return n;
+}
+
+static void chk_file_data(const char *path, uint32_t c, uint32_t size)
+{
+    int      i = model_find(path);
+    uint32_t csize = v.spc * 512, pos = 0, n;
+
+    if(i < 0)
+        return;
+    if(model[i].size != size)
+    {
+        chk_error("%s: wrong size", path);
+        return;
+    }
+    while(pos < size)
+    {
+        n = size - pos < csize ? size - pos : csize;
+        if(memcmp(sector(v.data_lba + (c - 2) * v.spc), model[i].data + pos, n) != 0)
+        {
+            chk_error("%s: wrong data", path);
+            return;
+        }
+        pos += n;
+        c = chk_fat(c);
+    }
+}
+
+static void chk_dir(uint32_t clust, const char *path)
+{
+    uint32_t lba, n, i, c = clust, lfn_sum_want = 0;
+    uint8_t *e;
+    int      lfn = 0;
+    char     sub[64], name[13];
+
+    for(;;)
+    {
+        lba = c ? v.data_lba + (c - 2) * v.spc : v.root_lba;
+        n = c ? v.spc * 16 : v.rootsecs * 16;
+        for(i = 0; i < n; i++)
+        {
+            e = sector(lba) + i * 32;
+            if(e[0] == 0)
+                goto end;
+            if(e[0] == 0xE5)
+            {
+                if(lfn)
+                    chk_error("%s: long name without its entry", path);
+                lfn = 0;
+                continue;
+            }
+            if(e[11] == 0x0F)
+            {
+                if(!lfn)
+                    lfn_sum_want = e[13];
+                lfn = 1;
+                continue;
+            }
+            if(lfn && lfn_sum(e) != lfn_sum_want)
+                chk_error("%s: long name for a different entry", path);
+            lfn = 0;
+            if(e[11] & 0x08 || e[0] == '.')
+                continue;
+            {
+                int k, m = 0;
+                for(k = 0; k < 11; k++)
+                {
+                    if(k == 8 && e[8] != ' ')
+                        name[m++] = '.';
+                    if(e[k] != ' ')
+                        name[m++] = e[k];
+                }
+                name[m] = 0;
+            }
+            snprintf(sub, sizeof(sub), "%s/%s", clust == v.root_clust ? "" : path, name);
+            {
+                uint32_t start = g16(e + 20) << 16 | g16(e + 26), size = g32(e + 28), len;
+                len = chk_chain(start, sub);
+                if(e[11] & 0x10)
+                    chk_dir(start, sub);
+                else
+                {
+                    if(len != (size + v.spc * 512 - 1) / (v.spc * 512))
+                        chk_error("%s: chain length doesn't match the size", sub);
+                    if(model_find(sub) >= 0)
+                        seen_n++;
+                    chk_file_data(sub, start, size);
+                }
+            }
+        }
+        if(!c)
+            break;
+        c = chk_fat(c);
+        if(c >= v.eoc)
+            break;
+    }
+end:
+    if(lfn)
+        chk_error("%s: long name at the end", path);
+}
+
+static void check(const char *when)
+{
+    uint32_t c, nfree = 0;
+
+    errors = 0;
+    seen_n = 0;
+    chk_volume();
+    free(used);
+    used = calloc(v.nclust + 2, 1);
+    if(memcmp(sector(v.fat_lba), sector(v.fat_lba + v.fatsz), v.fatsz * 512) != 0)
+        chk_error("%s: FAT copies differ", when);
+    if(v.root_clust)
+        chk_chain(v.root_clust, "/");
+    chk_dir(v.root_clust, "");
+    for(c = 2; c <= v.nclust + 1; c++)
+    {
+        if(chk_fat(c) == 0)
+            nfree++;
+        else if(!used[c])
+        {
+            chk_error("%s: lost cluster", when);
+            break;
+        }
+    }
+    if(v.fsinfo && g32(sector(v.fsinfo) + 488) != 0xFFFFFFFF && g32(sector(v.fsinfo) + 488) != nfree)
+        chk_error("%s: FSInfo free count is off", when);
+    if(seen_n != model_n)
+        chk_error("%s: files missing", when);
+    if(errors)
+    {
+        fprintf(stderr, "check failed after %s\n", when);
+        exit(1);
+    }
+}
+
+/* ---- tests ---- */
+
+static void pattern(uint8_t *p, uint32_t len, uint32_t seed)
+{
+    uint32_t i;
+
+    for(i = 0; i < len; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        p[i] = seed >> 16;
+    }
+}
+
+static void report(const char *what, uint64_t bytes)
+{
+    printf("  %-26s %8llu bytes %6u cmds %8llu sectors %6.2f MB/s\n", what, (unsigned long long)bytes,
+           n_read + n_write, (unsigned long long)(s_read + s_write), bytes / model_us());
+}
+
+/* writes len bytes to path in calls of chunk bytes, timed */
+static void timed_write(const char *path, uint32_t len, uint32_t chunk, const char *what)
+{
+    FAT_File_t f;
+    uint8_t   *buf = malloc(len);
+    uint32_t   pos, n, done;
+
+    pattern(buf, len, len ^ chunk);
+    model_truncate(path);
+    model_write(path, 0, buf, len);
+    counters_reset();
+    CHECK(FAT_Open(&f, path, FAT_CREATE));
+    for(pos = 0; pos < len; pos += n)
+    {
+        n = len - pos < chunk ? len - pos : chunk;
+        CHECK(FAT_Write(&f, buf + pos, n, &done));
+        if(done != n)
+            fail("short write");
+    }
+    CHECK(FAT_Close(&f));
+    report(what, len);
+    free(buf);
+}
+
+static void timed_read(const char *path, uint32_t chunk, const char *what)
+{
+    FAT_File_t f;
+    int        i = model_find(path);
+    uint8_t   *buf = malloc(model[i].size + chunk);
+    uint32_t   pos = 0, done;
+
+    counters_reset();
+    CHECK(FAT_Open(&f, path, FAT_READ));
+    do
+    {
+        CHECK(FAT_Read(&f, buf + pos, chunk, &done));
+        pos += done;
+    } while(done == chunk);
+    CHECK(FAT_Close(&f));
+    report(what, pos);
+    if(pos != model[i].size || memcmp(buf, model[i].data, pos) != 0)
+        fail("read back wrong");
+    free(buf);
+}
+
+/* the files FAT_ReadDir() lists in dir are the ones the model has there */
+static void check_listing(const char *dir)
+{
+    FAT_Dir_t  d;
+    FAT_Info_t info;
+    int        i, n = 0, want = 0;
+    char       path[64];
+    uint8_t    s;
+
+    CHECK(FAT_OpenDir(&d, dir));
+    while((s = FAT_ReadDir(&d, &info)) == FAT_OK)
+    {
+        if(info.attr & FAT_ATTR_DIRECTORY)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", strcmp(dir, "/") ? dir : "", info.name);
+        i = model_find(path);
+        if(i < 0 || model[i].size != info.size)
+            fail("listing doesn't match");
+        n++;
+    }
+    EXPECT(s, FAT_ERR_MISS_FILE);
+    for(i = 0; i < model_n; i++)
+    {
+        const char *slash = strrchr(model[i].path, '/');
+        if((size_t)(slash - model[i].path) == strlen(strcmp(dir, "/") ? dir : "") &&
+           strncmp(model[i].path, dir, slash - model[i].path) == 0)
+            want++;
+    }
+    if(n != want)
+        fail("listing has the wrong number of files");
+}
+
+/* reads every file back through fat.c */
+static void verify_all(void)
+{
+    FAT_File_t f;
+    uint8_t   *buf;
+    uint32_t   done;
+    int        i;
+
+    for(i = 0; i < model_n; i++)
+    {
+        buf = malloc(model[i].size + 1);
+        CHECK(FAT_Open(&f, model[i].path, FAT_READ));
+        CHECK(FAT_Read(&f, buf, model[i].size + 1, &done));
+        if(done != model[i].size || memcmp(buf, model[i].data, done) != 0)
+            fail("file reads back wrong after a new mount");
+        CHECK(FAT_Close(&f));
+        free(buf);
+    }
+}
+
+static void functional(void)
+{
+    FAT_File_t f, g;
+    uint8_t    a[3000], b[3000], r[700];
+    uint32_t   done, i, pos;
+    char       path[64];
+
+    /* the file mkfs made, then take it away along with its long name */
+    model_truncate("/LONGFI~1.TXT");
+    model_write("/LONGFI~1.TXT", 0, "abc", 3);
+    check("mount");
+    CHECK(FAT_Open(&f, "/longfi~1.txt", FAT_READ));
+    CHECK(FAT_Read(&f, r, sizeof(r), &done));
+    if(done != 3 || memcmp(r, "abc", 3))
+        fail("LONGFI~1.TXT reads wrong");
+    CHECK(FAT_Close(&f));
+    CHECK(FAT_Delete("/LONGFI~1.TXT"));
+    model_delete("/LONGFI~1.TXT");
+    check("delete");
+
+    EXPECT(FAT_Open(&f, "/NOPE.TXT", FAT_READ), FAT_ERR_MISS_FILE);
+    EXPECT(FAT_Open(&f, "/NODIR/A.TXT", FAT_CREATE), FAT_ERR_MISS_DIR);
+    EXPECT(FAT_Open(&f, "/DATA", FAT_READ), FAT_ERR_OPEN_DIR);
+    EXPECT(FAT_Open(&f, "/TOOLONGNAME.TXT", FAT_CREATE), FAT_ERR_NAME);
+
+    /* two files growing in turns end up interleaved on the disk */
+    model_truncate("/DATA/A.BIN");
+    model_truncate("/DATA/B.BIN");
+    CHECK(FAT_Open(&f, "/DATA/A.BIN", FAT_CREATE));
+    CHECK(FAT_Open(&g, "/DATA/B.BIN", FAT_CREATE));
+    for(i = 0; i < 40; i++)
+    {
+        pattern(a, sizeof(a), i);
+        pattern(b, sizeof(b), ~i);
+        CHECK(FAT_Write(&f, a, sizeof(a) - i * 7, &done));
+        model_write("/DATA/A.BIN", f.pos - done, a, done);
+        CHECK(FAT_Write(&g, b, sizeof(b) - i * 13, &done));
+        model_write("/DATA/B.BIN", g.pos - done, b, done);
+    }
+    CHECK(FAT_Close(&f));
+    CHECK(FAT_Close(&g));
+    check("interleaved writes");
+
+    /* overwrite and extend at odd places */
+    CHECK(FAT_Open(&f, "/DATA/A.BIN", FAT_READ | FAT_WRITE));
+    for(i = 0; i < 30; i++)
+    {
+        pos = (i * 7919u) % (f.size + 1);
+        pattern(a, sizeof(a), i * 31);
+        CHECK(FAT_Seek(&f, pos));
+        CHECK(FAT_Write(&f, a, 100 + i * 97, &done));
+        model_write("/DATA/A.BIN", pos, a, done);
+    }
+    CHECK(FAT_Seek(&f, f.size));
+    CHECK(FAT_Write(&f, a, sizeof(a), &done));
+    model_write("/DATA/A.BIN", f.pos - done, a, done);
+    for(i = 0; i < 30; i++)
+    {
+        pos = (i * 104729u) % f.size;
+        CHECK(FAT_Seek(&f, pos));
+        CHECK(FAT_Read(&f, r, sizeof(r), &done));
+        if(memcmp(r, model[model_find("/DATA/A.BIN")].data + pos, done))
+            fail("read after seek wrong");
+    }
+    CHECK(FAT_Close(&f));
+    check("overwrites");
+
+    /* enough files to make /DATA grow, then some of them gone again */
+    for(i = 0; i < 40; i++)
+    {
+        snprintf(path, sizeof(path), "/DATA/F%u.TXT", i);
+        model_truncate(path);
+        CHECK(FAT_Open(&f, path, FAT_CREATE));
+        pattern(a, i, i);
+        CHECK(FAT_Write(&f, a, i, &done));
+        model_write(path, 0, a, i);
+        CHECK(FAT_Close(&f));
+    }
+    check("many files");
+    for(i = 0; i < 40; i += 3)
+    {
+        snprintf(path, sizeof(path), "/DATA/F%u.TXT", i);
+        CHECK(FAT_Delete(path));
+        model_delete(path);
+    }
+    check("deletes");
+    check_listing("/DATA");
+    check_listing("/");
+
+    /* truncate on create */
+    CHECK(FAT_Open(&f, "/DATA/B.BIN", FAT_CREATE));
+    CHECK(FAT_Write(&f, "new", 3, &done));
+    CHECK(FAT_Close(&f));
+    model_truncate("/DATA/B.BIN");
+    model_write("/DATA/B.BIN", 0, "new", 3);
+    check("truncate");
+}
+
+/* fills the volume, FAT_ERR_FULL has to leave it consistent */
+static void fill(void)
+{
+    FAT_File_t f;
+    uint8_t   *buf = malloc(65536);
+    uint32_t   done;
+    uint8_t    s;
+
+    pattern(buf, 65536, 7);
+    model_truncate("/FULL.BIN");
+    CHECK(FAT_Open(&f, "/FULL.BIN", FAT_CREATE));
+    do
+    {
+        s = FAT_Write(&f, buf, 65536, &done);
+        model_write("/FULL.BIN", f.pos - done, buf, done);
+    } while(s == FAT_OK);
+    EXPECT(s, FAT_ERR_FULL);
+    CHECK(FAT_Close(&f));
+    check("disk full");
+    CHECK(FAT_Delete("/FULL.BIN"));
+    model_delete("/FULL.BIN");
+    check("delete after disk full");
+    free(buf);
+}
+
+static void run(const Geometry *g)
+{
+    uint32_t big = g->type == 12 ? 512 * 1024 : 4 * 1024 * 1024;
+    int      i;
+
+    for(i = 0; i < model_n; i++)
+        free(model[i].data);
+    model_n = 0;
+    mkfs(g);
+    CHECK(FAT_Mount());
+    if(FAT_Type != g->type)
+        fail("mounted as the wrong type");
+
+    printf("%s, %u kB, %u byte clusters\n", g->name, g->sectors / 2, g->spc * 512);
+    timed_write("/SPEED.BIN", big, 4096, "write, 4096 byte calls");
+    timed_read("/SPEED.BIN", 4096, "read, 4096 byte calls");
+    timed_write("/DATA/LOG.CSV", 256 * 1024, 100, "write, 100 byte calls");
+    timed_read("/DATA/LOG.CSV", 100, "read, 100 byte calls");
+    check("timed runs");
+
+    CHECK(FAT_Delete("/SPEED.BIN"));
+    model_delete("/SPEED.BIN");
+    functional();
+    if(g->type != 32)
+        fill();
+
+    /* everything again from a fresh mount */
+    CHECK(FAT_Mount());
+    verify_all();
+    check_listing("/DATA");
+    printf("  checks ok\n");
+}
+
+int main(int argc, char **argv)
+{
+    int i, c;
+
+    while((c = getopt(argc, argv, "c:p:")) != -1)
+    {
+        switch(c)
+        {
+            case 'c': cmd_us = atoi(optarg); break;
+            case 'p': pkt_us = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: fattest [-c us per command] [-p us per 64 byte packet]\n");
+                return 2;
+        }
+    }
+    printf("cache %u x 512 bytes, up to %u sectors per command, %u us per command, %u us per packet\n",
+           FAT_CACHE_SECTORS, FAT_BURST_SECTORS, cmd_us, pkt_us);
+    for(i = 0; i < (int)(sizeof(geometries) / sizeof(geometries[0])); i++)
+        run(&geometries[i]);
+    return 0;
+}
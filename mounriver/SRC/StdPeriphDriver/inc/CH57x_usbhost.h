@@ -264,6 +264,17 @@ uint8_t SETorOFFNumLock(uint8_t *buf); // NumLock
  */
 uint8_t InitRootDevice(void);
 
+/**
+ * @brief   Finds the bulk endpoints in a configuration descriptor, IN in
+ *          GpVar[0..1] and OUT in GpVar[2..3]
+ *
+ * @param   buf             - configuration descriptor
+ * @param   HubPortIndex    - 0 for the root port, else the external hub port
+ *
+ * @return  0
+ */
+uint8_t AnalyzeBulkEndp(uint8_t *buf, uint8_t HubPortIndex);
+
 /**
  * @brief   ȡHID豸,TxBuffer
  *
@@ -1,20 +1,22 @@
 #include "CH59x_common.h"
+#include "oled_driver.h"
+#include "motion.h"
+#include "ev_config.h"
+#include <stdio.h>
 
-#define Right_Enable GPIO_Pin_13 // right motor
+#define Right_Enable GPIO_Pin_13 // right motor, PA13 (PWM5)
 #define Right_Phase GPIO_Pin_15
 #define right_Correction 1 // easily switch motor direction, should remove later
 
-#define Left_Enable GPIO_Pin_12 // left motor
-#define Left_Phase GPIO_Pin_14 
+#define Left_Enable GPIO_Pin_12 // left motor, PA12 (PWM4)
+#define Left_Phase GPIO_Pin_14
 #define left_Correction 1 //easily be able to switch motor direction if code is off
 
 #define Left_Encoder_A  GPIO_Pin_6 // B Left motor
 #define Left_Encoder_B  GPIO_Pin_0 // B
-volatile int32_t count_left = 0;
 
-#define Right_Encoder_A  GPIO_Pin_4 //right motor
-#define Right_Encoder_B  GPIO_Pin_5 
-volatile int32_t count_right = 0;
+#define Right_Encoder_A  GPIO_Pin_4 // A right motor
+#define Right_Encoder_B  GPIO_Pin_5 // A
 
 // connects to screen, also to the buttons for counting
 #define SDA GPIO_Pin_4 // B
@@ -22,157 +24,265 @@ volatile int32_t count_right = 0;
 #define Boot_Button GPIO_Pin_22 // B
 //buttons all pulled to ground, pullup should be used. SDA/SCL also connect to the screen, so it can be funky
 
-// distances (meters)
-volatile int32_t targetdistance = 0;
+// control loop, anything from 1kHz to 10kHz works, gains are in per second units
+#define CONTROL_HZ 2000
+
+// distances (mm)
+volatile int32_t targetdistance = 8000;
 volatile int32_t currentdistance = 0;
 
-// time (seconds)
-volatile int32_t targettime = 0;
+// time (ms)
+volatile int32_t targettime = 10000;
 volatile int32_t currenttime = 0;
 
-// max speed, gotten in calibration
+// max speed, gotten in calibration (ticks/s)
 static int32_t leftmotormaxspeed = 0;
 static int32_t rightmotormaxspeed = 0;
 static int32_t combinedmaxspeed = 0;
 
-// speed (PWM)
-volatile int32_t leftmotorspeed = 0;
-volatile int32_t rightmotorspeed = 0;
+// PID gains from ev_config.h, ks/kv/ka get filled in by calibration
+static MotorGains gains_left = EV_GAINS;
+static MotorGains gains_right = EV_GAINS;
+
+static QuadEncoder enc_left;
+static QuadEncoder enc_right;
+static int8_t enc_left_sign = 1; // fixed up by calibration if the encoder runs backwards
+static int8_t enc_right_sign = 1;
+
+static MotionProfile profile;
+static MotionSetpoint setpoint;
+static MotorCtrl ctrl_left;
+static MotorCtrl ctrl_right;
 
+volatile uint32_t timer_ticks = 0; // CONTROL_HZ
+volatile uint8_t running = 0;
+static uint32_t settle_ticks = 0;
+
+__HIGH_CODE
+static void Motor_SetDuty(int32_t left, int32_t right)
+{
+    left *= left_Correction;
+    right *= right_Correction;
 
+    if(left < 0) { GPIOA_ResetBits(Left_Phase); left = -left; }
+    else         GPIOA_SetBits(Left_Phase);
+    if(right < 0) { GPIOA_ResetBits(Right_Phase); right = -right; }
+    else          GPIOA_SetBits(Right_Phase);
 
-__INTERRUPT // this is a interupt 
+    // PH/EN mode, 0 duty on enable brakes the motor
+    R16_PWM4_DATA = left;
+    R16_PWM5_DATA = right;
+}
+
+__INTERRUPT // this is a interupt
 __HIGH_CODE // keep this in ram ready to go since its important
-void TMR0_IRQHandler(void) 
+void TMR0_IRQHandler(void)
 {
     // Check if the interrupt was caused by the timer cycle ending
     if(TMR0_GetITFlag(TMR0_3_IT_CYC_END))
     {
-        TMR0_ClearITFlag(TMR0_3_IT_CYC_END); 
-        // do stuff
+        TMR0_ClearITFlag(TMR0_3_IT_CYC_END);
+        timer_ticks++;
+        if(!running) return;
+
+        Motion_Step(&profile, &setpoint);
+        int32_t l = MotorCtrl_Update(&ctrl_left, &setpoint, enc_left.count * enc_left_sign);
+        int32_t r = MotorCtrl_Update(&ctrl_right, &setpoint, enc_right.count * enc_right_sign);
+
+        if(setpoint.done && ++settle_ticks >= SETTLE_MS * CONTROL_HZ / 1000)
+        {
+            running = 0;
+            l = r = 0;
+        }
+        Motor_SetDuty(l, r);
     }
 }
 
-__INTERRUPT // this is a interupt 
-__HIGH_CODE // keep this in ram ready to go since its important
-void calibrationIRQ(void) {
-if(GPIOB_ReadITFlagBit(M3ENCA)) 
+// The pins only interrupt on one edge, so both A and B get re-armed for the
+// edge opposite their current level, that gives full x4 decoding. Sample again
+// after re-arming so an edge landing in between isn't lost.
+__HIGH_CODE
+static void Encoder_ServiceLeft(void)
+{
+    uint32_t pins = R32_PB_PIN;
+    uint8_t ab;
+    do
     {
-        uint8_t a = (GPIOB_ReadPortPin(M3ENCA) != 0); // figure out which encoder was edging
-        uint8_t b = (GPIOB_ReadPortPin(Lb) != 0);
-
-        if (a == b) cal_count++; //count up/down (up=clockwise)
-        else        cal_count--;
-
-        if (a) GPIOB_ITModeCfg(La, GPIO_ITMode_FallEdge); // go onto the next closest encoder reading
-        else   GPIOB_ITModeCfg(La, GPIO_ITMode_RiseEdge);
-
-        GPIOB_ClearITFlagBit(La); //clear interupt register
-    }
+        ab = ((pins & Left_Encoder_A) ? 2 : 0) | ((pins & Left_Encoder_B) ? 1 : 0);
+        Quad_Update(&enc_left, ab);
+        GPIOB_ITModeCfg(Left_Encoder_A, (ab & 2) ? GPIO_ITMode_FallEdge : GPIO_ITMode_RiseEdge);
+        GPIOB_ITModeCfg(Left_Encoder_B, (ab & 1) ? GPIO_ITMode_FallEdge : GPIO_ITMode_RiseEdge);
+        pins = R32_PB_PIN;
+    } while((((pins & Left_Encoder_A) ? 2 : 0) | ((pins & Left_Encoder_B) ? 1 : 0)) != ab);
+}
 
-    if(GPIOB_ReadITFlagBit(Ra)) 
+__HIGH_CODE
+static void Encoder_ServiceRight(void)
+{
+    uint32_t pins = R32_PA_PIN;
+    uint8_t ab;
+    do
     {
-        uint8_t a = (GPIOB_ReadPortPin(Ra) != 0); // figure out which encoder got edged
-        uint8_t b = (GPIOB_ReadPortPin(Rb) != 0);
+        ab = ((pins & Right_Encoder_A) ? 2 : 0) | ((pins & Right_Encoder_B) ? 1 : 0);
+        Quad_Update(&enc_right, ab);
+        GPIOA_ITModeCfg(Right_Encoder_A, (ab & 2) ? GPIO_ITMode_FallEdge : GPIO_ITMode_RiseEdge);
+        GPIOA_ITModeCfg(Right_Encoder_B, (ab & 1) ? GPIO_ITMode_FallEdge : GPIO_ITMode_RiseEdge);
+        pins = R32_PA_PIN;
+    } while((((pins & Right_Encoder_A) ? 2 : 0) | ((pins & Right_Encoder_B) ? 1 : 0)) != ab);
+}
 
-        if (a == b) count_m4++; //count up motors spin
-        else        count_m4--;
+__INTERRUPT
+__HIGH_CODE
+void GPIOB_IRQHandler(void)
+{
+    Encoder_ServiceLeft();
+}
 
-        if (a) GPIOB_ITModeCfg(Ra, GPIO_ITMode_FallEdge); // read for the closest step
-        else   GPIOB_ITModeCfg(Ra, GPIO_ITMode_RiseEdge);
+__INTERRUPT
+__HIGH_CODE
+void GPIOA_IRQHandler(void)
+{
+    Encoder_ServiceRight();
+}
 
-        GPIOB_ClearITFlagBit(Ra); // clear
-    }
+static void Encoder_Init(void)
+{
+    GPIOB_ModeCfg(Left_Encoder_A | Left_Encoder_B, GPIO_ModeIN_PU); // make the encoders bits configured for input (pulled up)
+    GPIOA_ModeCfg(Right_Encoder_A | Right_Encoder_B, GPIO_ModeIN_PU);
+    DelayUs(10);
+
+    PFIC_DisableIRQ(GPIO_B_IRQn);
+    PFIC_DisableIRQ(GPIO_A_IRQn);
+    Quad_Reset(&enc_left, 0);
+    Quad_Reset(&enc_right, 0);
+    Encoder_ServiceLeft(); // samples the pins and arms both edges
+    Encoder_ServiceRight();
+    Quad_Reset(&enc_left, enc_left.state);
+    Quad_Reset(&enc_right, enc_right.state);
+    PFIC_EnableIRQ(GPIO_B_IRQn); // turn on interupt
+    PFIC_EnableIRQ(GPIO_A_IRQn);
 }
-__INTERRUPT // this is a interupt 
-__HIGH_CODE // keep this in ram ready to go since its important
-void runIRQ(void)
+
+static void Motor_Init(void)
 {
-    if(GPIOB_ReadITFlagBit(M3ENCA)) 
-    {
-        uint8_t a = (GPIOB_ReadPortPin(M3ENCA) != 0); // figure out which encoder was edging
-        uint8_t b = (GPIOB_ReadPortPin(Lb) != 0);
+    GPIOA_ModeCfg(Left_Enable | Left_Phase | Right_Enable | Right_Phase, GPIO_ModeOut_PP_5mA); // make the motors bits configured for output
+    GPIOA_ResetBits(Left_Enable | Right_Enable);
 
-        if (a == b) count_m3++; //count up/down (up=clockwise)
-        else        count_m3--;
+    PWMX_CLKCfg(PWM_CLK_DIV);
+    PWMX_16bit_CycleCfg(PWM_PERIOD);
+    PWMX_16bit_ACTOUT(CH_PWM4, 0, High_Level, ENABLE);
+    PWMX_16bit_ACTOUT(CH_PWM5, 0, High_Level, ENABLE);
+    Motor_SetDuty(0, 0);
+}
 
-        if (a) GPIOB_ITModeCfg(La, GPIO_ITMode_FallEdge); // go onto the next closest encoder reading
-        else   GPIOB_ITModeCfg(La, GPIO_ITMode_RiseEdge);
+static void Control_Init(void)
+{
+    TMR0_TimerInit(FREQ_SYS / CONTROL_HZ);
+    TMR0_ClearITFlag(TMR0_3_IT_CYC_END);
+    TMR0_ITCfg(ENABLE, TMR0_3_IT_CYC_END);
+    PFIC_EnableIRQ(TMR0_IRQn);
+}
 
-        GPIOB_ClearITFlagBit(La); //clear interupt register
-    }
+// Open loop sweep that fits duty = ks + kv * speed for each wheel, also finds
+// out if an encoder counts backwards. Run it with the wheels off the ground.
+int speedcalibration(void)
+{
+    static const float cal_duty[NUM_CAL_POINTS] = CAL_DUTY;
+    float speed_left[NUM_CAL_POINTS];
+    float speed_right[NUM_CAL_POINTS];
 
-    if(GPIOB_ReadITFlagBit(Ra)) 
+    for(int i = 0; i < NUM_CAL_POINTS; i++)
     {
-        uint8_t a = (GPIOB_ReadPortPin(Ra) != 0); // figure out which encoder got edged
-        uint8_t b = (GPIOB_ReadPortPin(Rb) != 0);
-
-        if (a == b) count_m4++; //count up motors spin
-        else        count_m4--;
-
-        if (a) GPIOB_ITModeCfg(Ra, GPIO_ITMode_FallEdge); // read for the closest step
-        else   GPIOB_ITModeCfg(Ra, GPIO_ITMode_RiseEdge);
-
-        GPIOB_ClearITFlagBit(Ra); // clear
+        int32_t duty = (int32_t)(cal_duty[i] * PWM_PERIOD);
+        Motor_SetDuty(duty, duty);
+        DelayMs(200); // let it get up to speed
+
+        int32_t l0 = enc_left.count, r0 = enc_right.count;
+        uint32_t t0 = timer_ticks;
+        DelayMs(200);
+        int32_t dl = enc_left.count - l0, dr = enc_right.count - r0;
+        uint32_t dt = timer_ticks - t0;
+
+        speed_left[i] = (float)dl * CONTROL_HZ / (float)dt;
+        speed_right[i] = (float)dr * CONTROL_HZ / (float)dt;
     }
+    Motor_SetDuty(0, 0);
+    DelayMs(300);
+
+    leftmotormaxspeed = Motor_Calibrate(cal_duty, speed_left, NUM_CAL_POINTS, MOTOR_TAU_S, TOP_SPEED_DUTY,
+                                        &gains_left, &enc_left_sign);
+    rightmotormaxspeed = Motor_Calibrate(cal_duty, speed_right, NUM_CAL_POINTS, MOTOR_TAU_S, TOP_SPEED_DUTY,
+                                         &gains_right, &enc_right_sign);
+    combinedmaxspeed = min(leftmotormaxspeed, rightmotormaxspeed);
+    return (combinedmaxspeed > 0) ? 0 : -1;
+}
+
+static void WaitForButton(void)
+{
+    while(GPIOB_ReadPortPin(Boot_Button) == 0) DelayMs(10); // let go first
+    while(GPIOB_ReadPortPin(Boot_Button) != 0) DelayMs(10);
+    DelayMs(500); // hands off the car
 }
 
 int main() {
+    char buf[24];
+
     // Pre run
     SetSysClock(CLK_SOURCE_PLL_60MHz);
+    GPIOB_ModeCfg(Boot_Button, GPIO_ModeIN_PU);
 
-    GPIOA_ModeCfg(Left_Enable | Left_Phase | Right_Enable | Right_Phase, GPIO_ModeOut_PP_5mA); // make the motors bits configured for output
-    GPIOB_ModeCfg(Left_Encoder_A | Left_Encoder_B | Right_Encoder_A | Right_Encoder_B, GPIO_ModeIN_PU); // make the encoders bits configured for input (pulled up)
-
-    GPIOB_ITModeCfg(Left_Encoder_A, GPIO_ITMode_FallEdge); // setup the interupts, start at falling edge 
-    GPIOA_ITModeCfg(Right_Encoder_A, GPIO_ITMode_FallEdge);
-    
-
-
-
-
-
-
-    rightmotormaxspeed = 
-    combinedmaxspeed = min(leftmotormaxspeed, rightmotormaxspeed); 
+    OLED_Init();
+    Motor_Init();
+    Encoder_Init();
+    Control_Init();
 
+    OLED_ShowString(0, 0, "CALIBRATING");
+    if(speedcalibration())
+    {
+        OLED_ShowString(0, 1, "ENCODER FAIL");
+        while(1) DelayMs(1000);
+    }
 
+    sprintf(buf, "VMAX %d MM/S", (int)(combinedmaxspeed * 1000 / TICKS_PER_METER));
+    OLED_ShowString(0, 1, buf);
 
+    // Plan, both wheels follow the same profile so the car stays straight
+    MotorCtrl_Init(&ctrl_left, &gains_left, CONTROL_HZ, PWM_PERIOD);
+    MotorCtrl_Init(&ctrl_right, &gains_right, CONTROL_HZ, PWM_PERIOD);
+    float planned = Motion_Plan(&profile, targetdistance * TICKS_PER_METER / 1000, targettime / 1000.0f,
+                                (float)MAX_ACCEL_MM_S2 * TICKS_PER_METER / 1000, (float)combinedmaxspeed, CONTROL_HZ);
+    sprintf(buf, "PLAN %dMS", (int)(planned * 1000));
+    OLED_ShowString(0, 2, buf);
+    OLED_ShowString(0, 3, "PRESS TO RUN");
+    WaitForButton();
 
     // Run
-    PFIC_EnableIRQ(GPIO_B_IRQn); // turn on interupt
-    PFIC_EnableIRQ(GPIO_A_IRQn);
-
-
-
-
-    If targetdistance/targettime <= 
+    enc_left.count = 0;
+    enc_right.count = 0;
+    MotorCtrl_Reset(&ctrl_left, 0);
+    MotorCtrl_Reset(&ctrl_right, 0);
+    settle_ticks = 0;
+    timer_ticks = 0;
+    running = 1;
+
+    while(running) {
+        DelayMs(10);
+    }
 
-    // slow down 
     // Post Run
-
-    GPIOA_SetBits(PH2A3); // turn all phases on
-    GPIOA_SetBits(PH2B4); 
-    GPIOA_SetBits(EN2A3); // turn all motors on
-    GPIOA_SetBits(EN2B4);
-
-    // --- PWM Setup ---
-    PWMX_CLKCfg(4); 
-    PWMX_CycleCfg(100000-1); // speeds of 0-100000
-    PWMX_16bit_ACTOUT(CH_PWM4, 100000, High_Level, ENABLE);
+    currenttime = (int32_t)((uint64_t)(timer_ticks - settle_ticks) * 1000 / CONTROL_HZ);
+    currentdistance = (enc_left.count * enc_left_sign + enc_right.count * enc_right_sign) * 500 / TICKS_PER_METER;
+
+    OLED_Clear();
+    OLED_ShowString(0, 0, "FINISHED");
+    sprintf(buf, "D %dMM", (int)currentdistance);
+    OLED_ShowString(0, 1, buf);
+    sprintf(buf, "T %dMS", (int)currenttime);
+    OLED_ShowString(0, 2, buf);
+    sprintf(buf, "ERR %dMM", (int)(currentdistance - targetdistance));
+    OLED_ShowString(0, 3, buf);
 
     while(1) {
-        if (count_m3 > 5000) {
-            GPIOA_ResetBits(EN2A3);
-        }
-        if (count_m4 > 5000) {
-            GPIOA_ResetBits(EN2B4);
-        }
-        DelayMs(10);
+        DelayMs(1000);
     }
 }
-
-int speedcalibration() {
-    // spin the motors for a little bit at like 1%, 5% 10%, 25%, 50%, 100%. calibrate speed for those stages
-    return 1;
-}
@@ -0,0 +1,29 @@
+#ifndef __EV_CONFIG_H
+#define __EV_CONFIG_H
+
+// The EV's numbers: geometry, limits and gains. Main.c runs on them, and
+// ../../ScienceOlympiadEV_Host checks motion.c against a motor model with the
+// same ones, so a change here is tested there.
+
+// PWM4/PWM5 at 60MHz / 3 / 1000 = 20kHz, out of earshot
+#define PWM_CLK_DIV 3
+#define PWM_PERIOD 1000
+
+// N20 300RPM 50:1 with 7 pulse hall encoder, 90mm wheels. x4 decoding.
+#define TICKS_PER_REV (50 * 7 * 4)
+#define WHEEL_CIRCUMFERENCE_MM 283 // 90mm * pi
+#define TICKS_PER_METER ((TICKS_PER_REV * 1000) / WHEEL_CIRCUMFERENCE_MM)
+
+#define MAX_ACCEL_MM_S2 1500 // keeps the wheels from slipping on launch
+#define MOTOR_TAU_S 0.05f    // mechanical time constant, sets the acceleration feed-forward
+#define TOP_SPEED_DUTY 0.9f  // plan below full duty so the PID has headroom
+#define SETTLE_MS 250        // hold position after the profile ends
+
+// Calibration sweep, duty fractions, slowest first
+#define NUM_CAL_POINTS 4
+#define CAL_DUTY { 0.25f, 0.5f, 0.75f, 1.0f }
+
+// PID gains for both wheels, ks/kv/ka get filled in by calibration
+#define EV_GAINS { .kp = 0.01f, .ki = 0.05f, .kd = 0.00005f, .i_max = 0.2f }
+
+#endif
@@ -0,0 +1,213 @@
+#include "motion.h"
+
+// The control ISR path goes in RAM with the rest of the __HIGH_CODE on the
+// CH592, a host build just gets plain functions.
+#ifdef __riscv
+#define MOTION_HIGH_CODE __attribute__((section(".highcode")))
+#else
+#define MOTION_HIGH_CODE
+#endif
+
+const int8_t QUAD_TABLE[16] = {
+     0, +1, -1,  0, // from 00
+    -1,  0,  0, +1, // from 01
+    +1,  0,  0, -1, // from 10
+     0, -1, +1,  0, // from 11
+};
+
+// Only used at plan time, avoids pulling in libm for one call.
+static float Motion_Sqrt(float x)
+{
+    float r = x > 1.0f ? x : 1.0f;
+    if(x <= 0.0f) return 0.0f;
+    for(int i = 0; i < 24; i++)
+    {
+        float n = 0.5f * (r + x / r);
+        if(n >= r) break;
+        r = n;
+    }
+    return r;
+}
+
+// --- Trapezoidal Planner ---
+
+float Motion_Plan(MotionProfile *p, int32_t distance_ticks, float time_s,
+                  float accel, float vmax, uint32_t rate)
+{
+    float d = (float)(distance_ticks < 0 ? -distance_ticks : distance_ticks);
+    float a = accel / ((float)rate * (float)rate); // ticks/period^2
+    float vm = vmax / (float)rate;                 // ticks/period
+    float n = time_s * (float)rate;                // periods
+    float v;
+
+    p->distance = (int64_t)distance_ticks << 24;
+    p->step = 0;
+    if(d < 1.0f || a <= 0.0f || vm <= 0.0f)
+    {
+        p->vcruise = 0;
+        p->accel = 0;
+        p->t_acc = 0;
+        p->t_end = 0;
+        return 0.0f;
+    }
+
+    // Trapezoid that covers d in n periods: d = v*n - v^2/a
+    float disc = a * a * n * n - 4.0f * a * d;
+    v = (disc >= 0.0f) ? 0.5f * (a * n - Motion_Sqrt(disc)) : vm + 1.0f;
+    if(v > vm)
+    {
+        // Can't make the time, drive the fastest profile the limits allow.
+        v = Motion_Sqrt(a * d);
+        if(v > vm) v = vm;
+    }
+
+    // Round the ramps and cruise to whole periods, then refit v and a so the
+    // profile still ends exactly on the distance.
+    uint32_t t_acc = (uint32_t)(v / a) + 1;
+    float cruise = d / v - (float)t_acc;
+    uint32_t t_cruise = cruise > 0.0f ? (uint32_t)(cruise + 0.5f) : 0;
+
+    int64_t dist_q24 = (int64_t)d * (1 << 24);
+    int32_t v_q24 = (int32_t)(dist_q24 / (t_acc + t_cruise));
+    int32_t a_q24 = v_q24 / (int32_t)t_acc;
+
+    if(distance_ticks < 0)
+    {
+        v_q24 = -v_q24;
+        a_q24 = -a_q24;
+    }
+    p->vcruise = v_q24;
+    p->accel = a_q24;
+    p->t_acc = t_acc;
+    p->t_end = 2 * t_acc + t_cruise;
+    return (float)p->t_end / (float)rate;
+}
+
+MOTION_HIGH_CODE
+void Motion_Step(MotionProfile *p, MotionSetpoint *sp)
+{
+    uint32_t t = ++p->step;
+
+    if(t >= p->t_end)
+    {
+        p->step = p->t_end;
+        sp->pos = p->distance;
+        sp->vel = 0;
+        sp->acc = 0;
+        sp->done = 1;
+        return;
+    }
+
+    sp->done = 0;
+    if(t < p->t_acc)
+    {
+        sp->pos = (int64_t)p->accel * t * t / 2;
+        sp->vel = p->accel * (int32_t)t;
+        sp->acc = p->accel;
+    }
+    else if(t <= p->t_end - p->t_acc)
+    {
+        sp->pos = (int64_t)p->vcruise * p->t_acc / 2 + (int64_t)p->vcruise * (t - p->t_acc);
+        sp->vel = p->vcruise;
+        sp->acc = 0;
+    }
+    else
+    {
+        uint32_t td = p->t_end - t;
+        sp->pos = p->distance - (int64_t)p->accel * td * td / 2;
+        sp->vel = p->accel * (int32_t)td;
+        sp->acc = -p->accel;
+    }
+}
+
+// --- Wheel Controller ---
+
+// The gains get small at high rates (ki is about 1.3 at 10kHz with the EV's
+// tuning), truncating would lose most of the last count.
+static int32_t Motion_Round(float x)
+{
+    return (int32_t)(x < 0.0f ? x - 0.5f : x + 0.5f);
+}
+
+void MotorCtrl_Init(MotorCtrl *c, const MotorGains *g, uint32_t rate, int32_t duty_max)
+{
+    float scale = (float)duty_max * 256.0f;
+    float r = (float)rate;
+
+    c->kp = Motion_Round(g->kp * scale);
+    c->ki = Motion_Round(g->ki * scale / r);
+    c->kd = Motion_Round(g->kd * r * scale);
+    c->kv = Motion_Round(g->kv * r * scale);
+    c->ka = Motion_Round(g->ka * r * r * scale);
+    c->ks = Motion_Round(g->ks * (float)duty_max);
+    c->i_limit = (c->ki > 0) ? (int32_t)(g->i_max * (float)duty_max * 65536.0f / (float)c->ki) : 0;
+    c->duty_max = duty_max;
+    MotorCtrl_Reset(c, 0);
+}
+
+void MotorCtrl_Reset(MotorCtrl *c, int32_t count)
+{
+    c->integ = 0;
+    c->vel_f = 0;
+    c->last_count = count;
+}
+
+MOTION_HIGH_CODE
+int32_t MotorCtrl_Update(MotorCtrl *c, const MotionSetpoint *sp, int32_t count)
+{
+    int32_t delta = count - c->last_count;
+    c->last_count = count;
+    c->vel_f += ((delta << 8) - c->vel_f) >> MOTOR_VEL_FILTER_SHIFT;
+
+    int32_t err = (int32_t)((sp->pos >> 16) - ((int64_t)count << 8)); // Q8 ticks
+    int32_t verr = (sp->vel >> 16) - c->vel_f;                         // Q8 ticks/period
+
+    c->integ += err;
+    if(c->integ > c->i_limit) c->integ = c->i_limit;
+    if(c->integ < -c->i_limit) c->integ = -c->i_limit;
+
+    int64_t u = (int64_t)c->kp * err + (int64_t)c->ki * c->integ + (int64_t)c->kd * verr;
+    int32_t duty = (int32_t)(u >> 16);
+
+    duty += (int32_t)(((int64_t)c->kv * sp->vel + (int64_t)c->ka * sp->acc) >> 32);
+    if(sp->vel > 0) duty += c->ks;
+    else if(sp->vel < 0) duty -= c->ks;
+
+    if(duty > c->duty_max) duty = c->duty_max;
+    if(duty < -c->duty_max) duty = -c->duty_max;
+    return duty;
+}
+
+int Motor_FitFeedForward(const float *duty, const float *speed, int n, float *ks, float *kv)
+{
+    float sx = 0, sy = 0, sxx = 0, sxy = 0;
+    for(int i = 0; i < n; i++)
+    {
+        sx += speed[i];
+        sy += duty[i];
+        sxx += speed[i] * speed[i];
+        sxy += speed[i] * duty[i];
+    }
+
+    float den = (float)n * sxx - sx * sx;
+    if(n < 2 || den <= 0.0f || sx <= 0.0f) return -1;
+
+    *kv = ((float)n * sxy - sx * sy) / den;
+    *ks = (sy - *kv * sx) / (float)n;
+    if(*ks < 0.0f) *ks = 0.0f;
+    return 0;
+}
+
+int32_t Motor_Calibrate(const float *duty, float *speed, int n, float tau_s, float top_duty,
+                        MotorGains *g, int8_t *sign)
+{
+    if(n < 1) return -1;
+    *sign = (speed[n - 1] < 0.0f) ? -1 : 1;
+    for(int i = 0; i < n; i++) speed[i] *= *sign;
+
+    if(Motor_FitFeedForward(duty, speed, n, &g->ks, &g->kv)) return -1;
+    g->ka = g->kv * tau_s;
+
+    int32_t vmax = (int32_t)((top_duty - g->ks) / g->kv);
+    return (vmax > 0) ? vmax : -1;
+}
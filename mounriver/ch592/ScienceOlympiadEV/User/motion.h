@@ -0,0 +1,127 @@
+#ifndef __MOTION_H
+#define __MOTION_H
+
+#include <stdint.h>
+
+// Motion control for the EV: quadrature decoding, a trapezoidal planner that
+// lands on a target distance at a target time, and a PID + feed-forward wheel
+// controller. Nothing in here touches hardware, so motion.c also builds with a
+// desktop compiler for tuning against a motor model.
+//
+// Units used everywhere below:
+//   ticks   - x4 quadrature encoder counts
+//   period  - one control loop iteration (1 / rate seconds)
+//   Qn      - fixed point with n fractional bits
+// Only Motion_Plan() and MotorCtrl_Init() use floats, they are called once
+// before a run. Everything called from the control ISR is integer only.
+
+// --- Quadrature Decoding ---
+
+// Indexed by (previous AB << 2) | current AB. Both bits changing at once means
+// an edge was missed, that counts 0 and bumps the error counter.
+extern const int8_t QUAD_TABLE[16];
+
+typedef struct
+{
+    volatile int32_t count;
+    volatile uint16_t errors;
+    uint8_t state; // last AB, A in bit 1
+} QuadEncoder;
+
+static inline void Quad_Reset(QuadEncoder *q, uint8_t ab)
+{
+    q->count = 0;
+    q->errors = 0;
+    q->state = ab & 3;
+}
+
+// Call from the pin change ISR with the freshly sampled A and B levels.
+static inline void Quad_Update(QuadEncoder *q, uint8_t ab)
+{
+    uint8_t idx = (q->state << 2) | ab;
+    if(((idx ^ (idx >> 2)) & 3) == 3) q->errors++; // both A and B flipped
+    q->count += QUAD_TABLE[idx];
+    q->state = ab;
+}
+
+// --- Trapezoidal Planner ---
+
+typedef struct
+{
+    int64_t distance; // Q24 ticks
+    int32_t vcruise;  // Q24 ticks/period
+    int32_t accel;    // Q24 ticks/period^2
+    uint32_t t_acc;   // periods spent accelerating (same for braking)
+    uint32_t t_end;   // total periods
+    uint32_t step;
+} MotionProfile;
+
+typedef struct
+{
+    int64_t pos; // Q24 ticks
+    int32_t vel; // Q24 ticks/period
+    int32_t acc; // Q24 ticks/period^2
+    uint8_t done;
+} MotionSetpoint;
+
+// Plans distance_ticks in time_s. accel and vmax are the limits in ticks/s^2
+// and ticks/s. Distance wins over time: if the time can't be made within the
+// limits the fastest profile is planned instead. Returns the planned time in
+// seconds.
+float Motion_Plan(MotionProfile *p, int32_t distance_ticks, float time_s,
+                  float accel, float vmax, uint32_t rate);
+
+// Advances one period and writes the setpoint for it.
+void Motion_Step(MotionProfile *p, MotionSetpoint *sp);
+
+// --- Wheel Controller ---
+
+// Tuning in float, per second units so the same numbers work at any rate.
+// Duty is a fraction of full scale (1.0 = 100%).
+typedef struct
+{
+    float kp;     // duty per tick of position error
+    float ki;     // duty per tick*s of position error
+    float kd;     // duty per tick/s of velocity error
+    float ks;     // duty to overcome static friction
+    float kv;     // duty per tick/s of commanded velocity
+    float ka;     // duty per tick/s^2 of commanded acceleration
+    float i_max;  // integrator clamp as a duty fraction
+} MotorGains;
+
+typedef struct
+{
+    int32_t kp, ki, kd;   // Q16 duty counts per Q8 tick (per period)
+    int32_t kv, ka;       // Q8 duty counts per Q24 setpoint unit
+    int32_t ks;           // duty counts
+    int32_t i_limit;      // clamp for integ, Q8 tick*periods
+    int32_t duty_max;
+    int64_t integ;
+    int32_t vel_f;        // filtered measured velocity, Q8 ticks/period
+    int32_t last_count;
+} MotorCtrl;
+
+// Filter shift for the measured velocity, the encoder only moves a few ticks
+// per period at 1kHz and less at 10kHz, so the raw delta is mostly quantization.
+#define MOTOR_VEL_FILTER_SHIFT 3
+
+void MotorCtrl_Init(MotorCtrl *c, const MotorGains *g, uint32_t rate, int32_t duty_max);
+void MotorCtrl_Reset(MotorCtrl *c, int32_t count);
+
+// Returns a signed duty in -duty_max..duty_max.
+int32_t MotorCtrl_Update(MotorCtrl *c, const MotionSetpoint *sp, int32_t count);
+
+// Least squares fit of duty = ks + kv * speed over n open loop calibration
+// points (speed in ticks/s, duty as a fraction). Returns 0 on success, -1 if
+// the points don't span any speed (encoder not turning).
+int Motor_FitFeedForward(const float *duty, const float *speed, int n, float *ks, float *kv);
+
+// One wheel's open loop calibration sweep turned into its feed-forward:
+// speed[i] is what was measured at duty[i], the last point the fastest. Finds
+// the encoder's direction from that point (*sign -1 if it counts backwards)
+// and flips speed[] to match, fits ks and kv into g and sets ka = kv * tau_s.
+// Returns the top speed at top_duty in ticks/s, -1 if the wheel didn't turn.
+int32_t Motor_Calibrate(const float *duty, float *speed, int n, float tau_s, float top_duty,
+                        MotorGains *g, int8_t *sign);
+
+#endif
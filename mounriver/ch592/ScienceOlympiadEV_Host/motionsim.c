@@ -0,0 +1,431 @@
+/* Checks ../ScienceOlympiadEV/User/motion.c on the host, unmodified: the
+	quadrature table, the planner, the feed-forward fit and both wheel
+	controllers, the last driving a model of two N20 gear motors with x4
+	encoders at control rates of 1 to 10 kHz. The EV's numbers come from its
+	ev_config.h. See README.md.
+*/
+
+#include <getopt.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ev_config.h"
+#include "motion.h"
+
+static const MotorGains gains_ev = EV_GAINS;
+static const float cal_duty[NUM_CAL_POINTS] = CAL_DUTY;
+
+// The plant is stepped at 100 kHz, the control rates divide it.
+#define PLANT_HZ 100000
+static const uint32_t rates[] = { 1000, 2000, 5000, 10000 };
+
+// What's allowed: position at the end of a run, tracking during it, and the
+// two wheels apart, in ticks (about 0.2 mm each).
+#define TOL_FINAL 8
+#define TOL_TRACK 20
+#define TOL_APART 12
+
+static int failures;
+
+static void fail( const char * what, double got, double want )
+{
+	if( failures++ < 10 ) printf( "FAIL %s: got %.4f, want %.4f\n", what, got, want );
+}
+
+static uint64_t rng_state;
+
+static uint32_t rnd( void )
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state >> 32;
+}
+
+static double frnd( double lo, double hi )
+{
+	return lo + ( hi - lo ) * ( rnd() / 4294967296.0 );
+}
+
+/* Every transition of QUAD_TABLE against the Gray code: one step either way
+	counts 1, no change counts 0, and both bits changing counts 0 and an
+	error. */
+static void check_quad( void )
+{
+	static const int gray_pos[4] = { 0, 1, 3, 2 }; // AB 00 01 11 10 in order
+	for( uint8_t from = 0; from < 4; from++ )
+		for( uint8_t to = 0; to < 4; to++ )
+		{
+			int d = ( gray_pos[to] - gray_pos[from] ) & 3;
+			QuadEncoder q;
+			Quad_Reset( &q, from );
+			Quad_Update( &q, to );
+			if( q.count != ( d == 1 ? 1 : d == 3 ? -1 : 0 ) ) fail( "quadrature count", q.count, d );
+			if( q.errors != ( d == 2 ) ) fail( "quadrature error", q.errors, d == 2 );
+			if( q.state != to ) fail( "quadrature state", q.state, to );
+		}
+}
+
+/* Motion_Plan() and Motion_Step() on their own, either direction: the
+	setpoint never goes back, stays within the limits (the refit to whole
+	periods may go a little over), is done exactly at the planned time and
+	lands exactly on the distance. */
+static void check_plan( uint32_t rate, int n )
+{
+	for( int i = 0; i < n; i++ )
+	{
+		int32_t distance = 1 + rnd() % 200000;
+		if( rnd() % 2 ) distance = -distance;
+		float time_s = frnd( 0.2, 20 ), accel = frnd( 1000, 20000 ), vmax = frnd( 1000, 10000 );
+		MotionProfile p;
+		MotionSetpoint sp;
+		float planned = Motion_Plan( &p, distance, time_s, accel, vmax, rate );
+		double q = 16777216.0, dir = distance < 0 ? -1 : 1, last = 0, vpeak = 0, apeak = 0;
+		uint32_t t = 0;
+		do
+		{
+			Motion_Step( &p, &sp );
+			t++;
+			if( ( sp.pos - last ) * dir < 0 ) fail( "setpoint went back, ticks", ( sp.pos - last ) / q, 0 );
+			last = sp.pos;
+			if( fabs( sp.vel / q ) > vpeak ) vpeak = fabs( sp.vel / q );
+			if( fabs( sp.acc / q ) > apeak ) apeak = fabs( sp.acc / q );
+		} while( !sp.done && t <= p.t_end );
+		if( fabs( t - planned * rate ) > 0.5 ) fail( "done against the plan, periods", t, planned * rate );
+		if( sp.pos != (int64_t)distance << 24 ) fail( "end of the profile, Q24 off", sp.pos - ( (int64_t)distance << 24 ), 0 );
+		if( vpeak * rate > vmax * 1.02 + rate / q ) fail( "top speed, ticks/s", vpeak * rate, vmax );
+		if( apeak * rate * rate > accel * 1.02 ) fail( "acceleration, ticks/s^2", apeak * rate * rate, accel );
+		Motion_Step( &p, &sp );
+		if( !sp.done || sp.pos != (int64_t)distance << 24 ) fail( "stays done", sp.done, 1 );
+	}
+}
+
+/* Motor_Calibrate() on sweeps that lie exactly on a line, the encoder either
+	way round, and on one where the wheel doesn't turn. */
+static void check_fit( int n )
+{
+	for( int i = 0; i < n; i++ )
+	{
+		double ks = frnd( 0, 0.3 ), free_speed = frnd( 2000, 10000 ), kv = ( 1.0 - ks ) / free_speed;
+		int8_t sign = rnd() % 2 ? 1 : -1, got_sign = 0;
+		float speed[NUM_CAL_POINTS];
+		for( int k = 0; k < NUM_CAL_POINTS; k++ ) speed[k] = sign * ( cal_duty[k] - ks ) / kv;
+		MotorGains g = gains_ev;
+		int32_t vmax = Motor_Calibrate( cal_duty, speed, NUM_CAL_POINTS, MOTOR_TAU_S, TOP_SPEED_DUTY, &g, &got_sign );
+		if( got_sign != sign ) fail( "fit, encoder direction", got_sign, sign );
+		if( fabs( g.ks - ks ) > 1e-4 ) fail( "fit, ks", g.ks, ks );
+		if( fabs( g.kv - kv ) > 1e-4 * kv ) fail( "fit, kv", g.kv, kv );
+		if( fabs( g.ka - kv * MOTOR_TAU_S ) > 1e-4 * kv * MOTOR_TAU_S ) fail( "fit, ka", g.ka, kv * MOTOR_TAU_S );
+		if( fabs( vmax - ( TOP_SPEED_DUTY - ks ) / kv ) > 2 ) fail( "fit, top speed", vmax, ( TOP_SPEED_DUTY - ks ) / kv );
+		if( g.kp != gains_ev.kp || g.ki != gains_ev.ki || g.kd != gains_ev.kd ) fail( "fit changed the PID gains", 1, 0 );
+	}
+	float still[NUM_CAL_POINTS] = { 0 };
+	MotorGains g = gains_ev;
+	int8_t sign;
+	int32_t vmax = Motor_Calibrate( cal_duty, still, NUM_CAL_POINTS, MOTOR_TAU_S, TOP_SPEED_DUTY, &g, &sign );
+	if( vmax != -1 ) fail( "fit with the wheel still", vmax, -1 );
+}
+
+/* One wheel: a first order motor, duty = ks + kv * speed in steady state,
+	time constant tau with the car on it, Coulomb friction that holds it
+	still below ks, and the encoder's A and B from the shaft angle, decoded
+	by Quad_Update() on every edge as the pin interrupt does. */
+typedef struct
+{
+	double ks, kv, tau, drag; // drag, extra friction along the floor, duty
+	double pos, vel;          // ticks, ticks/s
+	int sign;                 // encoder wired backwards
+	int32_t phase;            // last whole tick seen
+	QuadEncoder enc;
+} Wheel;
+
+static uint8_t wheel_ab( int32_t tick )
+{
+	static const uint8_t gray[4] = { 0, 1, 3, 2 };
+	return gray[tick & 3];
+}
+
+static void wheel_init( Wheel * w, double free_speed, double ks, double tau, int sign )
+{
+	memset( w, 0, sizeof( *w ) );
+	w->ks = ks;
+	w->kv = ( 1.0 - ks ) / free_speed;
+	w->tau = tau;
+	w->sign = sign;
+	Quad_Reset( &w->enc, wheel_ab( 0 ) );
+}
+
+static void wheel_step( Wheel * w, int32_t duty, double dt )
+{
+	double u = (double)duty / PWM_PERIOD, f = w->ks + w->drag;
+	if( w->vel == 0 && fabs( u ) <= f ) return;
+	double s = w->vel != 0 ? ( w->vel > 0 ? 1 : -1 ) : ( u > 0 ? 1 : -1 );
+	double nv = w->vel + ( ( u - s * f ) / w->kv - w->vel ) * dt / w->tau;
+	if( nv * s < 0 ) nv = 0; // friction stops it, doesn't turn it round
+	w->vel = nv;
+	w->pos += nv * dt;
+
+	int32_t t = (int32_t)floor( w->pos );
+	while( w->phase != t )
+	{
+		w->phase += t > w->phase ? 1 : -1;
+		Quad_Update( &w->enc, wheel_ab( w->phase * w->sign ) );
+	}
+}
+
+static int32_t wheel_count( const Wheel * w, int8_t sign )
+{
+	return w->enc.count * sign;
+}
+
+typedef struct
+{
+	Wheel w[2];
+	uint32_t rate;
+	uint64_t ticks; // control periods
+} Car;
+
+static void car_run( Car * car, const int32_t duty[2], double seconds )
+{
+	uint32_t sub = PLANT_HZ / car->rate;
+	uint64_t n = (uint64_t)( seconds * car->rate + 0.5 );
+	for( uint64_t i = 0; i < n; i++, car->ticks++ )
+		for( uint32_t k = 0; k < sub; k++ )
+			for( int j = 0; j < 2; j++ ) wheel_step( &car->w[j], duty[j], 1.0 / PLANT_HZ );
+}
+
+/* The sweep, measured on the model with the wheels off the ground (no drag
+	meanwhile), goes through Motor_Calibrate(). */
+static int calibrate( Car * car, MotorGains g[2], int8_t sign[2], int32_t * vmax )
+{
+	float speed[2][NUM_CAL_POINTS];
+	double drag[2] = { car->w[0].drag, car->w[1].drag };
+	car->w[0].drag = car->w[1].drag = 0;
+
+	for( int i = 0; i < NUM_CAL_POINTS; i++ )
+	{
+		int32_t duty = (int32_t)( cal_duty[i] * PWM_PERIOD ), d[2] = { duty, duty };
+		car_run( car, d, 0.2 );
+		int32_t c0[2] = { car->w[0].enc.count, car->w[1].enc.count };
+		uint64_t t0 = car->ticks;
+		car_run( car, d, 0.2 );
+		for( int j = 0; j < 2; j++ )
+			speed[j][i] = (float)( car->w[j].enc.count - c0[j] ) * car->rate / (float)( car->ticks - t0 );
+	}
+	int32_t zero[2] = { 0, 0 };
+	car_run( car, zero, 0.3 );
+	car->w[0].drag = drag[0];
+	car->w[1].drag = drag[1];
+
+	int32_t m[2];
+	for( int j = 0; j < 2; j++ )
+	{
+		g[j] = gains_ev;
+		m[j] = Motor_Calibrate( cal_duty, speed[j], NUM_CAL_POINTS, MOTOR_TAU_S, TOP_SPEED_DUTY, &g[j], &sign[j] );
+	}
+	*vmax = m[0] < m[1] ? m[0] : m[1];
+	return *vmax > 0 ? 0 : -1;
+}
+
+typedef struct
+{
+	double final_err;  // worst wheel, ticks
+	double track_err;  // worst during the run, ticks
+	double apart;      // worst difference between the wheels, ticks
+	double planned;    // s
+	double took;       // s, to the end of the profile
+	int saturated;     // periods at full duty
+} RunResult;
+
+/* A run: calibrate, plan distance_mm in time_ms, then Motion_Step() and
+	MotorCtrl_Update() for both wheels every period until the profile is done
+	and SETTLE_MS after. */
+static int run( uint32_t rate, int32_t distance_mm, int32_t time_ms, RunResult * res )
+{
+	Car car;
+	memset( &car, 0, sizeof( car ) );
+	car.rate = rate;
+
+	// N20 300RPM 50:1 at the battery's voltage, the two a little apart.
+	double free_speed = frnd( 5000, 8000 ), ks = frnd( 0.05, 0.2 ), tau = frnd( 0.02, 0.08 );
+	for( int j = 0; j < 2; j++ )
+	{
+		wheel_init( &car.w[j], free_speed * frnd( 0.9, 1.1 ), ks * frnd( 0.8, 1.2 ), tau * frnd( 0.9, 1.1 ),
+			rnd() % 2 ? 1 : -1 );
+		car.w[j].drag = frnd( 0, 0.05 );
+	}
+
+	MotorGains g[2];
+	int8_t sign[2];
+	int32_t vmax;
+	if( calibrate( &car, g, sign, &vmax ) )
+	{
+		fail( "calibration", -1, 0 );
+		return -1;
+	}
+	for( int j = 0; j < 2; j++ )
+		if( sign[j] != car.w[j].sign ) fail( "encoder direction", sign[j], car.w[j].sign );
+
+	MotorCtrl ctrl[2];
+	MotionProfile profile;
+	MotionSetpoint sp;
+	for( int j = 0; j < 2; j++ )
+	{
+		MotorCtrl_Init( &ctrl[j], &g[j], rate, PWM_PERIOD );
+
+		// Every gain within half a count of what was asked for.
+		double scale = PWM_PERIOD * 256.0;
+		double want[] = { g[j].kp * scale, g[j].ki * scale / rate, g[j].kd * rate * scale, g[j].kv * rate * scale,
+			(double)g[j].ka * rate * rate * scale, g[j].ks * PWM_PERIOD };
+		int32_t got[] = { ctrl[j].kp, ctrl[j].ki, ctrl[j].kd, ctrl[j].kv, ctrl[j].ka, ctrl[j].ks };
+		for( int k = 0; k < 6; k++ )
+			if( fabs( got[k] - want[k] ) > 0.5 + 1e-6 * fabs( want[k] ) ) fail( "gain rounding", got[k], want[k] );
+	}
+	int32_t target = distance_mm * TICKS_PER_METER / 1000;
+	res->planned = Motion_Plan( &profile, target, time_ms / 1000.0f, (float)MAX_ACCEL_MM_S2 * TICKS_PER_METER / 1000,
+		(float)vmax, rate );
+
+	// Run, from where calibration left the wheels.
+	int32_t start[2];
+	for( int j = 0; j < 2; j++ )
+	{
+		car.w[j].enc.count = 0;
+		car.w[j].vel = 0;
+		car.w[j].pos = car.w[j].phase;
+		start[j] = car.w[j].phase;
+		MotorCtrl_Reset( &ctrl[j], 0 );
+	}
+	res->track_err = res->apart = 0;
+	res->saturated = 0;
+	uint32_t settle = 0, periods = 0, end = 0;
+	int32_t duty[2] = { 0, 0 };
+	for( ;; )
+	{
+		Motion_Step( &profile, &sp );
+		periods++;
+		for( int j = 0; j < 2; j++ )
+		{
+			duty[j] = MotorCtrl_Update( &ctrl[j], &sp, wheel_count( &car.w[j], sign[j] ) );
+			if( duty[j] == PWM_PERIOD || duty[j] == -PWM_PERIOD ) res->saturated++;
+			double e = fabs( ( car.w[j].pos - start[j] ) - sp.pos / 16777216.0 );
+			if( e > res->track_err ) res->track_err = e;
+		}
+		double apart = fabs( ( car.w[0].pos - start[0] ) - ( car.w[1].pos - start[1] ) );
+		if( apart > res->apart ) res->apart = apart;
+		if( sp.done && !end ) end = periods;
+		if( sp.done && ++settle >= SETTLE_MS * rate / 1000 ) break;
+		if( periods > 60u * rate ) break;
+		car_run( &car, duty, 1.0 / rate );
+	}
+	res->took = (double)end / rate;
+
+	res->final_err = 0;
+	for( int j = 0; j < 2; j++ )
+	{
+		double e = fabs( ( car.w[j].pos - start[j] ) - target );
+		if( e > res->final_err ) res->final_err = e;
+		if( car.w[j].enc.errors ) fail( "encoder edges missed", car.w[j].enc.errors, 0 );
+	}
+	return 0;
+}
+
+// A distance and a time the planner can make, or now and then one it can't.
+static void pick_run( int32_t * distance_mm, int32_t * time_ms )
+{
+	*distance_mm = 500 + rnd() % 9500;
+	*time_ms = rnd() % 8 ? 4000 + rnd() % 16000 : 500 + rnd() % 3000;
+}
+
+// Half a metre a second on average, the slowest car's top speed is about 0.8.
+static int feasible( int32_t distance_mm, int32_t time_ms )
+{
+	return time_ms >= 2 * distance_mm + 1500;
+}
+
+static void check( uint32_t rate, int n )
+{
+	for( int i = 0; i < n && failures < 10; i++ )
+	{
+		int before = failures;
+		int32_t distance_mm, time_ms;
+		RunResult r;
+		pick_run( &distance_mm, &time_ms );
+		if( run( rate, distance_mm, time_ms, &r ) ) continue;
+
+		if( fabs( r.took - r.planned ) > 0.5 / rate ) fail( "profile end against the plan, s", r.took, r.planned );
+		// A period for the whole periods and half a ms for the floats.
+		double slack = 1.0 / rate + 0.0005;
+		if( r.planned < time_ms / 1000.0 - slack ) fail( "planned before the target time, s", r.planned, time_ms / 1000.0 );
+		if( feasible( distance_mm, time_ms ) && r.planned > time_ms / 1000.0 + slack )
+			fail( "planned after the target time, s", r.planned, time_ms / 1000.0 );
+		if( r.final_err > TOL_FINAL ) fail( "final position, ticks off", r.final_err, TOL_FINAL );
+		if( r.track_err > TOL_TRACK ) fail( "tracking, ticks off", r.track_err, TOL_TRACK );
+		if( r.apart > TOL_APART ) fail( "wheels apart, ticks", r.apart, TOL_APART );
+		if( failures > before ) printf( "  at %u Hz, %d mm in %d ms\n", rate, distance_mm, time_ms );
+	}
+}
+
+static void bench( int n )
+{
+	printf( "rate, Hz   final, mm        tracking, mm     apart, mm        plan vs target, ms\n" );
+	printf( "           mean    worst    mean    worst    mean    worst    mean    worst\n" );
+	for( unsigned k = 0; k < sizeof( rates ) / sizeof( rates[0] ); k++ )
+	{
+		double s[4] = { 0 }, w[4] = { 0 };
+		int runs = 0;
+		rng_state = 0x9e3779b97f4a7c15ull + 1;
+		for( int i = 0; i < n; i++ )
+		{
+			int32_t distance_mm, time_ms;
+			RunResult r;
+			pick_run( &distance_mm, &time_ms );
+			if( !feasible( distance_mm, time_ms ) ) continue;
+			if( run( rates[k], distance_mm, time_ms, &r ) ) continue;
+			double v[4] = { r.final_err * 1000.0 / TICKS_PER_METER, r.track_err * 1000.0 / TICKS_PER_METER,
+				r.apart * 1000.0 / TICKS_PER_METER, fabs( r.planned * 1000 - time_ms ) };
+			for( int j = 0; j < 4; j++ )
+			{
+				s[j] += v[j];
+				if( v[j] > w[j] ) w[j] = v[j];
+			}
+			runs++;
+		}
+		printf( "%8u", rates[k] );
+		for( int j = 0; j < 4; j++ ) printf( "  %6.2f  %7.2f", s[j] / runs, w[j] );
+		printf( "\n" );
+	}
+}
+
+int main( int argc, char ** argv )
+{
+	int n = 8, do_bench = 0, c;
+	uint32_t seed = 1;
+	while( ( c = getopt( argc, argv, "n:r:b" ) ) != -1 )
+	{
+		switch( c )
+		{
+		case 'n': n = atoi( optarg ); break;
+		case 'r': seed = strtoul( optarg, 0, 0 ); break;
+		case 'b': do_bench = 1; break;
+		default:
+			fprintf( stderr, "usage: %s [-n runs] [-r seed] [-b]\n", argv[0] );
+			return 1;
+		}
+	}
+	rng_state = seed * 0x9e3779b97f4a7c15ull + 1;
+
+	check_quad();
+	check_fit( 100 * n );
+	for( unsigned k = 0; k < sizeof( rates ) / sizeof( rates[0] ); k++ )
+	{
+		check_plan( rates[k], 100 * n );
+		check( rates[k], n );
+	}
+	if( do_bench ) bench( n );
+
+	printf( failures ? "FAILED\n" : "ok\n" );
+	return failures ? 2 : 0;
+}